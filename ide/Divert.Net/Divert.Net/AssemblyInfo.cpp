@@ -33,4 +33,7 @@ using namespace System::Security::Permissions;
 
 [assembly:ComVisible(false)];
 
-[assembly:CLSCompliantAttribute(true)];
\ No newline at end of file
+[assembly:CLSCompliantAttribute(true)];
+
+// The test application drives the I/O paths through the internal simulated packet source.
+[assembly:InternalsVisibleTo(L"DivertTests")];
\ No newline at end of file
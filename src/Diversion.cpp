@@ -23,6 +23,12 @@
 */
 
 #include "Diversion.hpp"
+#include "DivertCompiledFilter.hpp"
+#include "DivertCompletionQueue.hpp"
+#include "DivertConnectionRefresher.hpp"
+#include "DivertNativeChecksum.hpp"
+#include "DivertNativeChecksumBatch.hpp"
+#include "DivertProcessNameCache.hpp"
 #include <vcclr.h>
 
 namespace Divert
@@ -117,9 +123,6 @@ namespace Divert
 
 		bool Diversion::ValidateFilter(System::String^ filter, DivertLayer layer, System::String^% errorDetails)
 		{
-			// In case something goes wrong, we'll create this and throw it.
-			System::Exception^ e = nullptr;
-
 			// Check if the string is null or empty. Empty filter strings are not supported, AFAIK.
 			if (System::String::IsNullOrEmpty(filter) || System::String::IsNullOrWhiteSpace(filter))
 			{
@@ -127,29 +130,16 @@ namespace Divert
 				return false;
 			}
 
-			// Marshal the supplied string to a native C string for supplying to WinDivert
-			const char* charString = static_cast<const char*>((System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(filter)).ToPointer());
-
-			if (charString == nullptr)
-			{
-				e = gcnew System::Exception(u8"In Diversion::ValidateFilter(System::String^, DivertLayer, System::String^%) - Failed to marshal filter string.");
-				throw e;
-			}
-
-			const char* errStr = nullptr;
-			uint32_t errPos = 0;
-
-			int result = WinDivertHelperCheckFilter(charString, static_cast<WINDIVERT_LAYER>(layer), &errStr, &errPos);
-
-			// Free the marshalled filter string
-			System::Runtime::InteropServices::Marshal::FreeHGlobal(System::IntPtr((void*)charString));
+			// A valid filter is left compiled in the cache, ready for EvaluateFilter.
+			System::String^ details = nullptr;
 
-			if (result == 0)
+			if (CompiledFilter::TryGetCached(filter, layer, details) == nullptr)
 			{
-				errorDetails = gcnew System::String(errStr);
+				errorDetails = details;
+				return false;
 			}
 
-			return result == 1;
+			return true;
 		}
 
 		bool Diversion::EvaluateFilter(System::String^ filter, DivertLayer layer, array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address)
@@ -164,23 +154,17 @@ namespace Divert
 				throw e;
 			}
 
-			// Marshal the supplied string to a native C string for supplying to WinDivert
-			const char* charString = static_cast<const char*>((System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(filter)).ToPointer());
+			// Only the first evaluation of a filter string parses it. As with WinDivert, an invalid
+			// filter matches nothing.
+			System::String^ errorDetails = nullptr;
+			CompiledFilter^ compiled = CompiledFilter::TryGetCached(filter, layer, errorDetails);
 
-			if (charString == nullptr)
+			if (compiled == nullptr)
 			{
-				e = gcnew System::Exception(u8"In Diversion::EvaluateFilter(System::String^, DivertLayer, array<System::Byte>^, uint32_t, Address^) - Failed to marshal filter string.");
-				throw e;
+				return false;
 			}
 
-			pin_ptr<System::Byte> byteArray = &packetBuffer[0];
-
-			int result = WinDivertHelperEvalFilter(charString, static_cast<WINDIVERT_LAYER>(layer), byteArray, packetLength, address->UnmanagedAddress);
-
-			// Free the marshalled filter string
-			System::Runtime::InteropServices::Marshal::FreeHGlobal(System::IntPtr((void*)charString));
-
-			return result == 1;
+			return compiled->Evaluate(packetBuffer, packetLength, address);
 		}
 
 		void Diversion::GetPacketProcess(Address^ address, TCPHeader^ tcpHeader, IPHeader^ ipv4Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
@@ -188,460 +172,312 @@ namespace Divert
 			// In case something goes wrong, we'll create this and throw it.
 			System::Exception^ e = nullptr;
 
-			ULONG currentTableSize = 0;
+			// The flow is keyed from the point of view of this machine, as the socket tables are.
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				4, IPPROTO_TCP, address->Direction == DivertDirection::Outbound,
+				&ipv4Header->UnmanagedHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipv4Header->UnmanagedHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
 
-			// First, if the table has never been initialized, it needs to be.
-			if (tcpHeader->UnmanagedTcpV4Table == nullptr)
-			{
-				currentTableSize = sizeof(PMIB_TCPTABLE2);
-				tcpHeader->UnmanagedTcpV4Table = static_cast<PMIB_TCPTABLE2>(malloc(currentTableSize));
+			Native::ConnectionRefresher& refresher = Native::ConnectionRefresher::Shared();
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (tcpHeader->UnmanagedTcpV4Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPHeader^, uint64_t%, System::String^) - Failed to allocate TCPTABLE2.");
-					throw e;
-				}
-			}			
-
-			// The return value will give us information about how to proceed to getting a proper populated
-			// table back from Windows. If the return value is ERROR_INSUFFICIENT_BUFFER, then this means we
-			// need to increase the size of the table to the size that the failing call set currentTableSize
-			// to. That is to say, such a failed call will adjust the value of the parameter (passed here as
-			// currentTableSize) to tell the user how much memory to allocate to fit the current table into.
-			DWORD dwRetVal = 0;
-
-			if ((dwRetVal = GetTcpTable2(tcpHeader->UnmanagedTcpV4Table, &currentTableSize, FALSE)) == ERROR_INSUFFICIENT_BUFFER)
+			// The socket tables are kept current by the refresher's thread. Only the first call
+			// ever waits, for the first snapshot.
+			if (!refresher.Start())
 			{
-				// Need to resize
-				free(tcpHeader->UnmanagedTcpV4Table);
-
-				// Allocate with returned, sufficient size
-				tcpHeader->UnmanagedTcpV4Table = static_cast<PMIB_TCPTABLE2>(malloc(currentTableSize));
-
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (tcpHeader->UnmanagedTcpV4Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPHeader^, uint64_t%, System::String^) - Failed to reallocate TCPTABLE2.");
-					throw e;
-				}	
-
-				// Now this call should succeed
-				dwRetVal = GetTcpTable2(tcpHeader->UnmanagedTcpV4Table, &currentTableSize, FALSE);
-
-				if (dwRetVal != NOERROR && tcpHeader->UnmanagedTcpV4Table != nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPHeader^, uint64_t%, System::String^) - Error populating TCPTABLE2.");
-					throw e;
-				}
-			}	
-
-			// Not sure if this is necessary?
-			pin_ptr<ULONG> procIdPtr = &processId;
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In Diversion::GetPacketProcess(TCPHeader^, IPHeader^, ULONG%, System::String^) - Failed to start the connection table refresher.");
+				throw e;
+			}
 
-			// If the traffic is outbound, we want to match the remote port. If it's inbound,
-			// we want to match the local port.
-			bool matchSrcPort = address->Direction == DivertDirection::Outbound;
+			uint32_t owningPid = 0;
 
-			// If we made it here, the table is valid and populated.
-			for (size_t i = 0; i < tcpHeader->UnmanagedTcpV4Table->dwNumEntries; ++i)
+			// A probe of the snapshot's index, cheap enough to make for every packet.
+			if (refresher.FindOwner(key, &owningPid))
 			{
-				// Note here that we mask dwLocalPort. Upper bits can be filled with garbage
-				// accord to Microsoft: https://msdn.microsoft.com/en-us/library/windows/desktop/aa366909(v=vs.85).aspx
-
-				switch (matchSrcPort)
-				{
-					case true:
-					{
-						if (static_cast<u_short>((tcpHeader->UnmanagedTcpV4Table->table[i].dwLocalPort & 0xFFFF)) == tcpHeader->UnmanagedHeader->SrcPort)
-						{
-							if (tcpHeader->UnmanagedTcpV4Table->table[i].dwLocalAddr == ipv4Header->UnmanagedHeader->SrcAddr)
-							{
-								processId = tcpHeader->UnmanagedTcpV4Table->table[i].dwOwningPid;
-								break;
-							}
-						}
-					}
-					break;
-					case false:
-					{
-						if (static_cast<u_short>((tcpHeader->UnmanagedTcpV4Table->table[i].dwLocalPort & 0xFFFF)) == tcpHeader->UnmanagedHeader->DstPort)
-						{
-							if (tcpHeader->UnmanagedTcpV4Table->table[i].dwRemoteAddr == ipv4Header->UnmanagedHeader->DstAddr)
-							{
-								processId = tcpHeader->UnmanagedTcpV4Table->table[i].dwOwningPid;
-								break;
-							}
-						}
-					}
-					break;
-				}
+				processId = owningPid;
+			}
+			else
+			{
+				// The socket may be newer than the snapshot. Don't wait for it, but don't wait
+				// out the whole interval either.
+				refresher.RequestRefresh();
 			}
 
-			std::string procName = GetProcessName(processId);
-			processName = gcnew System::String(procName.c_str());
-
-			// We don't need to free the allocated table here. In fact, it's better not to.
-			// It's assumed that if the user is interested in the process information, they're
-			// going to be interested in the process information more than one time, and since
-			// packets can come through a gazillion at a time, the last thing we want to do
-			// is destroy and recreate the table every single time. 
-			// 
-			// So, we'll leave the table alone, it will only ever be freed and reallocated when
-			// its size is not sufficient. When all is said and done, the table will ultimately
-			// be freed automatically when its owning managed object is garbage collected.
+			processName = ProcessNameCache::GetName(processId);
 		}
 
 		void Diversion::GetPacketProcess(Address^ address, TCPHeader^ tcpHeader, IPv6Header^ ipv6Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
-		{	
+		{
 			// In case something goes wrong, we'll create this and throw it.
 			System::Exception^ e = nullptr;
 
-			ULONG currentTableSize = 0;
+			// The flow is keyed from the point of view of this machine, as the socket tables are.
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				6, IPPROTO_TCP, address->Direction == DivertDirection::Outbound,
+				&ipv6Header->UnmanagedHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipv6Header->UnmanagedHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
 
-			// First, if the table has never been initialized, it needs to be.
-			if (tcpHeader->UnmanagedTcpV6Table == nullptr)
-			{
-				currentTableSize = sizeof(PMIB_TCP6TABLE2);
-				tcpHeader->UnmanagedTcpV6Table = static_cast<PMIB_TCP6TABLE2>(malloc(currentTableSize));
+			Native::ConnectionRefresher& refresher = Native::ConnectionRefresher::Shared();
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (tcpHeader->UnmanagedTcpV6Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPv6Header^, uint64_t%, System::String^) - Failed to allocate TCPTABLE2.");
-					throw e;
-				}
+			// The socket tables are kept current by the refresher's thread. Only the first call
+			// ever waits, for the first snapshot.
+			if (!refresher.Start())
+			{
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In Diversion::GetPacketProcess(TCPHeader^, IPv6Header^, ULONG%, System::String^) - Failed to start the connection table refresher.");
+				throw e;
 			}
 
-			// The return value will give us information about how to proceed to getting a proper populated
-			// table back from Windows. If the return value is ERROR_INSUFFICIENT_BUFFER, then this means we
-			// need to increase the size of the table to the size that the failing call set currentTableSize
-			// to. That is to say, such a failed call will adjust the value of the parameter (passed here as
-			// currentTableSize) to tell the user how much memory to allocate to fit the current table into.
-			DWORD dwRetVal = 0;
+			uint32_t owningPid = 0;
 
-			if ((dwRetVal = GetTcp6Table2(tcpHeader->UnmanagedTcpV6Table, &currentTableSize, FALSE)) == ERROR_INSUFFICIENT_BUFFER)
+			// A probe of the snapshot's index, cheap enough to make for every packet.
+			if (refresher.FindOwner(key, &owningPid))
+			{
+				processId = owningPid;
+			}
+			else
 			{
-				// Need to resize
-				free(tcpHeader->UnmanagedTcpV6Table);
+				// The socket may be newer than the snapshot. Don't wait for it, but don't wait
+				// out the whole interval either.
+				refresher.RequestRefresh();
+			}
 
-				// Allocate with returned, sufficient size
-				tcpHeader->UnmanagedTcpV6Table = static_cast<PMIB_TCP6TABLE2>(malloc(currentTableSize));
+			processName = ProcessNameCache::GetName(processId);
+		}
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (tcpHeader->UnmanagedTcpV6Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPv6Header^, uint64_t%, System::String^) - Failed to reallocate TCPTABLE2.");
-					throw e;
-				}
+		void Diversion::GetPacketProcess(Address^ address, UDPHeader^ udpHeader, IPHeader^ ipv4Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
+		{
+			// In case something goes wrong, we'll create this and throw it.
+			System::Exception^ e = nullptr;
 
-				// Now this call should succeed
-				dwRetVal = GetTcp6Table2(tcpHeader->UnmanagedTcpV6Table, &currentTableSize, FALSE);
+			// The flow is keyed from the point of view of this machine, as the socket tables are.
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				4, IPPROTO_UDP, address->Direction == DivertDirection::Outbound,
+				&ipv4Header->UnmanagedHeader->SrcAddr, udpHeader->UnmanagedHeader->SrcPort,
+				&ipv4Header->UnmanagedHeader->DstAddr, udpHeader->UnmanagedHeader->DstPort
+			);
 
-				if (dwRetVal != NOERROR && tcpHeader->UnmanagedTcpV6Table != nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(TCPHeader^, IPv6Header^, uint64_t%, System::String^) - Error populating TCPTABLE2.");
-					throw e;
-				}
-			}
+			Native::ConnectionRefresher& refresher = Native::ConnectionRefresher::Shared();
 
-			// Not sure if this is necessary?
-			pin_ptr<ULONG> procIdPtr = &processId;
+			// The socket tables are kept current by the refresher's thread. Only the first call
+			// ever waits, for the first snapshot.
+			if (!refresher.Start())
+			{
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In Diversion::GetPacketProcess(UDPHeader^, IPHeader^, ULONG%, System::String^) - Failed to start the connection table refresher.");
+				throw e;
+			}
 
-			// If the traffic is outbound, we want to match the remote port. If it's inbound,
-			// we want to match the local port.
-			bool matchSrcPort = address->Direction == DivertDirection::Outbound;
+			uint32_t owningPid = 0;
 
-			// If we made it here, the table is valid and populated.
-			for (size_t i = 0; i < tcpHeader->UnmanagedTcpV6Table->dwNumEntries; ++i)
+			// A probe of the snapshot's index, cheap enough to make for every packet.
+			if (refresher.FindOwner(key, &owningPid))
 			{
-				switch (matchSrcPort)
-				{
-					case true:
-					{	
-						// Note here that we mask dwLocalPort. Upper bits can be filled with garbage
-						// accord to Microsoft: https://msdn.microsoft.com/en-us/library/windows/desktop/aa366909(v=vs.85).aspx
-
-						if (static_cast<u_short>((tcpHeader->UnmanagedTcpV6Table->table[i].dwLocalPort & 0xFFFF)) == tcpHeader->UnmanagedHeader->SrcPort)
-						{
-							auto oPtr = (uint32_t*)(tcpHeader->UnmanagedTcpV6Table->table[i].LocalAddr.u.Byte);
-
-							if (std::memcmp(ipv6Header->UnmanagedHeader->SrcAddr, oPtr, 4) == 0)
-							{
-								processId = tcpHeader->UnmanagedTcpV6Table->table[i].dwOwningPid;
-								break;
-							}
-						}
-					}
-					break;
-
-					case false:
-					{
-						if (static_cast<u_short>(tcpHeader->UnmanagedTcpV6Table->table[i].dwRemotePort) == tcpHeader->UnmanagedHeader->DstPort)
-						{
-							auto oPtr = (uint32_t*)(tcpHeader->UnmanagedTcpV6Table->table[i].RemoteAddr.u.Byte);
-
-							if (std::memcmp(ipv6Header->UnmanagedHeader->DstAddr, oPtr, 4) == 0)							
-							{
-								processId = tcpHeader->UnmanagedTcpV6Table->table[i].dwOwningPid;
-								break;
-							}
-						}
-					}
-					break;
-				}
+				processId = owningPid;
+			}
+			else
+			{
+				// The socket may be newer than the snapshot. Don't wait for it, but don't wait
+				// out the whole interval either.
+				refresher.RequestRefresh();
 			}
 
-			std::string procName = GetProcessName(processId);
-			processName = gcnew System::String(procName.c_str());
-
-			// We don't need to free the allocated table here. In fact, it's better not to.
-			// It's assumed that if the user is interested in the process information, they're
-			// going to be interested in the process information more than one time, and since
-			// packets can come through a gazillion at a time, the last thing we want to do
-			// is destroy and recreate the table every single time. 
-			// 
-			// So, we'll leave the table alone, it will only ever be freed and reallocated when
-			// its size is not sufficient. When all is said and done, the table will ultimately
-			// be freed automatically when its owning managed object is garbage collected.
+			processName = ProcessNameCache::GetName(processId);
 		}
 
-		void Diversion::GetPacketProcess(Address^ address, UDPHeader^ udpHeader, IPHeader^ ipv4Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
+		void Diversion::GetPacketProcess(Address^ address, UDPHeader^ udpHeader, IPv6Header^ ipv6Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
 		{
 			// In case something goes wrong, we'll create this and throw it.
 			System::Exception^ e = nullptr;
 
-			ULONG currentTableSize = 0;
+			// The flow is keyed from the point of view of this machine, as the socket tables are.
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				6, IPPROTO_UDP, address->Direction == DivertDirection::Outbound,
+				&ipv6Header->UnmanagedHeader->SrcAddr, udpHeader->UnmanagedHeader->SrcPort,
+				&ipv6Header->UnmanagedHeader->DstAddr, udpHeader->UnmanagedHeader->DstPort
+			);
 
-			// First, if the table has never been initialized, it needs to be.
-			if (udpHeader->UnmanagedUdpV4Table == nullptr)
-			{
-				currentTableSize = sizeof(MIB_UDPTABLE_OWNER_PID);
-				udpHeader->UnmanagedUdpV4Table = static_cast<PMIB_UDPTABLE_OWNER_PID>(malloc(currentTableSize));
+			Native::ConnectionRefresher& refresher = Native::ConnectionRefresher::Shared();
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (udpHeader->UnmanagedUdpV4Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPHeader^, uint64_t%, System::String^) - Failed to allocate MIB_UDPTABLE_OWNER_PID.");
-					throw e;
-				}
+			// The socket tables are kept current by the refresher's thread. Only the first call
+			// ever waits, for the first snapshot.
+			if (!refresher.Start())
+			{
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In Diversion::GetPacketProcess(UDPHeader^, IPv6Header^, ULONG%, System::String^) - Failed to start the connection table refresher.");
+				throw e;
 			}
 
-			// The return value will give us information about how to proceed to getting a proper populated
-			// table back from Windows. If the return value is ERROR_INSUFFICIENT_BUFFER, then this means we
-			// need to increase the size of the table to the size that the failing call set currentTableSize
-			// to. That is to say, such a failed call will adjust the value of the parameter (passed here as
-			// currentTableSize) to tell the user how much memory to allocate to fit the current table into.
-			DWORD dwRetVal = 0;
+			uint32_t owningPid = 0;
 
-			if ((dwRetVal = GetExtendedUdpTable(udpHeader->UnmanagedUdpV4Table, &currentTableSize, FALSE, AF_INET, UDP_TABLE_OWNER_PID, 0)) == ERROR_INSUFFICIENT_BUFFER)
+			// A probe of the snapshot's index, cheap enough to make for every packet.
+			if (refresher.FindOwner(key, &owningPid))
+			{
+				processId = owningPid;
+			}
+			else
 			{
-				// Need to resize
-				free(udpHeader->UnmanagedUdpV4Table);
+				// The socket may be newer than the snapshot. Don't wait for it, but don't wait
+				// out the whole interval either.
+				refresher.RequestRefresh();
+			}
 
-				// Allocate with returned, sufficient size
-				udpHeader->UnmanagedUdpV4Table = static_cast<PMIB_UDPTABLE_OWNER_PID>(malloc(currentTableSize));
+			processName = ProcessNameCache::GetName(processId);
+		}
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (udpHeader->UnmanagedUdpV4Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPHeader^, uint64_t%, System::String^) - Failed to reallocate MIB_UDPTABLE_OWNER_PID.");
-					throw e;
-				}
+		Diversion::Diversion()
+		{
+			m_statistics = new Native::Statistics();
+		}
 
-				// Now this call should succeed
-				dwRetVal = GetExtendedUdpTable(udpHeader->UnmanagedUdpV4Table, &currentTableSize, FALSE, AF_INET, UDP_TABLE_OWNER_PID, 0);
+		Diversion::Diversion(DivertHandle^ handle)
+		{
+			m_statistics = new Native::Statistics();
 
-				if (dwRetVal != NOERROR && udpHeader->UnmanagedUdpV4Table != nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPHeader^, uint64_t%, System::String^) - Error populating MIB_UDPTABLE_OWNER_PID.");
-					throw e;
-				}
-			}
+			Handle = handle;
+		}
 
-			// Not sure if this is necessary?
-			pin_ptr<ULONG> procIdPtr = &processId;
+		Diversion::~Diversion()
+		{
+			this->!Diversion();
+		}
 
-			// If the traffic is outbound, we want to match the remote port. If it's inbound,
-			// we want to match the local port.
-			bool matchSrcPort = address->Direction == DivertDirection::Outbound;
+		Diversion::!Diversion()
+		{
+			delete m_winDivertHandle;
 
-			// If we made it here, the table is valid and populated.
-			for (size_t i = 0; i < udpHeader->UnmanagedUdpV4Table->dwNumEntries; ++i)
+			if (m_packetSource != nullptr)
 			{
-				// Note here that we mask dwLocalPort. Upper bits can be filled with garbage
-				// accord to Microsoft: https://msdn.microsoft.com/en-us/library/windows/desktop/aa366909(v=vs.85).aspx
-
-				switch (matchSrcPort)
-				{
-					case true:
-					{
-						if (static_cast<u_short>((udpHeader->UnmanagedUdpV4Table->table[i].dwLocalPort & 0xFFFF)) == udpHeader->UnmanagedHeader->SrcPort)
-						{
-							processId = udpHeader->UnmanagedUdpV4Table->table[i].dwOwningPid;
-							break;
-						}
-					}
-					break;
-					case false:
-					{
-						if (static_cast<u_short>((udpHeader->UnmanagedUdpV4Table->table[i].dwLocalPort & 0xFFFF)) == udpHeader->UnmanagedHeader->DstPort)
-						{
-							processId = udpHeader->UnmanagedUdpV4Table->table[i].dwOwningPid;
-							break;
-						}
-					}
-					break;
-				}
+				delete m_packetSource;
+				m_packetSource = nullptr;
 			}
 
-			std::string procName = GetProcessName(processId);
-			processName = gcnew System::String(procName.c_str());
-
-			// We don't need to free the allocated table here. In fact, it's better not to.
-			// It's assumed that if the user is interested in the process information, they're
-			// going to be interested in the process information more than one time, and since
-			// packets can come through a gazillion at a time, the last thing we want to do
-			// is destroy and recreate the table every single time. 
-			// 
-			// So, we'll leave the table alone, it will only ever be freed and reallocated when
-			// its size is not sufficient. When all is said and done, the table will ultimately
-			// be freed automatically when its owning managed object is garbage collected.
-
+			// Engines and pending results hold their own references, so the counters outlive
+			// this object for as long as anything can still record into them.
+			if (m_statistics != nullptr)
+			{
+				m_statistics->Release();
+				m_statistics = nullptr;
+			}
 		}
 
-		void Diversion::GetPacketProcess(Address^ address, UDPHeader^ udpHeader, IPv6Header^ ipv6Header, ULONG% processId, [System::Runtime::InteropServices::Out] System::String^% processName)
+		DivertHandle^ Diversion::Handle::get()
 		{
-			// In case something goes wrong, we'll create this and throw it.
-			System::Exception^ e = nullptr;
+			return m_winDivertHandle;
+		}	
 
-			ULONG currentTableSize = 0;
+		void Diversion::Handle::set(DivertHandle^ value)
+		{
+			m_winDivertHandle = value;
 
-			// First, if the table has never been initialized, it needs to be.
-			if (udpHeader->UnmanagedUdpV6Table == nullptr)
+			if (m_packetSource != nullptr)
 			{
-				currentTableSize = sizeof(MIB_UDP6TABLE_OWNER_PID);
-				udpHeader->UnmanagedUdpV6Table = static_cast<PMIB_UDP6TABLE_OWNER_PID>(malloc(currentTableSize));
-
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (udpHeader->UnmanagedUdpV6Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPv6Header^, uint64_t%, System::String^) - Failed to allocate MIB_UDP6TABLE_OWNER_PID.");
-					throw e;
-				}
+				delete m_packetSource;
+				m_packetSource = nullptr;
 			}
 
-			// The return value will give us information about how to proceed to getting a proper populated
-			// table back from Windows. If the return value is ERROR_INSUFFICIENT_BUFFER, then this means we
-			// need to increase the size of the table to the size that the failing call set currentTableSize
-			// to. That is to say, such a failed call will adjust the value of the parameter (passed here as
-			// currentTableSize) to tell the user how much memory to allocate to fit the current table into.
-			DWORD dwRetVal = 0;
-
-			if ((dwRetVal = GetExtendedUdpTable(udpHeader->UnmanagedUdpV6Table, &currentTableSize, FALSE, AF_INET6, UDP_TABLE_OWNER_PID, 0)) == ERROR_INSUFFICIENT_BUFFER)
+			if (m_winDivertHandle != nullptr)
 			{
-				// Need to resize
-				free(udpHeader->UnmanagedUdpV6Table);
+				m_packetSource = new Native::WinDivertPacketSource(m_winDivertHandle->UnmanagedHandle);
+			}
+		}
 
-				// Allocate with returned, sufficient size
-				udpHeader->UnmanagedUdpV6Table = static_cast<PMIB_UDP6TABLE_OWNER_PID>(malloc(currentTableSize));
+		bool Diversion::IncrementalChecksums::get()
+		{
+			return m_incrementalChecksums;
+		}
 
-				// If the table is still null, then we have failed to allocate, something is seriously wrong.
-				if (udpHeader->UnmanagedUdpV6Table == nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPv6Header^, uint64_t%, System::String^) - Failed to reallocate MIB_UDP6TABLE_OWNER_PID.");
-					throw e;
-				}
+		void Diversion::IncrementalChecksums::set(bool value)
+		{
+			m_incrementalChecksums = value;
+		}
 
-				// Now this call should succeed
-				dwRetVal = GetExtendedUdpTable(udpHeader->UnmanagedUdpV6Table, &currentTableSize, FALSE, AF_INET6, UDP_TABLE_OWNER_PID, 0);
 
-				if (dwRetVal != NOERROR && udpHeader->UnmanagedUdpV6Table != nullptr)
-				{
-					e = gcnew System::Exception(u8"In Diversion::GetPacketProcess(UDPHeader^, IPv6Header^, uint64_t%, System::String^) - Error populating MIB_UDP6TABLE_OWNER_PID.");
-					throw e;
-				}
-			}
+		Diversion^ Diversion::OpenSimulated(array<array<System::Byte>^>^ packets)
+		{
+			System::Exception^ e = nullptr;
 
-			// Not sure if this is necessary?
-			pin_ptr<ULONG> procIdPtr = &processId;
+			if (packets == nullptr || packets->Length == 0)
+			{
+				e = gcnew System::Exception(u8"In Diversion::OpenSimulated(array<array<System::Byte>^>^) - At least one template packet must be supplied.");
+				throw e;
+			}
 
-			// If the traffic is outbound, we want to match the remote port. If it's inbound,
-			// we want to match the local port.
-			bool matchSrcPort = address->Direction == DivertDirection::Outbound;
+			std::vector< std::vector<uint8_t> > templates;
+			templates.reserve(packets->Length);
 
-			// If we made it here, the table is valid and populated.
-			for (size_t i = 0; i < udpHeader->UnmanagedUdpV6Table->dwNumEntries; ++i)
+			for (int i = 0; i < packets->Length; ++i)
 			{
-				// Note here that we mask dwLocalPort. Upper bits can be filled with garbage
-				// accord to Microsoft: https://msdn.microsoft.com/en-us/library/windows/desktop/aa366909(v=vs.85).aspx
-
-				switch (matchSrcPort)
+				if (packets[i] == nullptr || packets[i]->Length == 0)
 				{
-					case true:
-					{
-
-						if (static_cast<u_short>((udpHeader->UnmanagedUdpV6Table->table[i].dwLocalPort & 0xFFFF)) == udpHeader->UnmanagedHeader->SrcPort)
-						{
-							processId = udpHeader->UnmanagedUdpV6Table->table[i].dwOwningPid;
-							break;
-						}
-					}
-					break;
-					case false:
-					{
-						if (static_cast<u_short>((udpHeader->UnmanagedUdpV6Table->table[i].dwLocalPort & 0xFFFF)) == udpHeader->UnmanagedHeader->DstPort)
-						{
-							processId = udpHeader->UnmanagedUdpV6Table->table[i].dwOwningPid;
-							break;
-						}
-					}
-					break;
+					e = gcnew System::Exception(u8"In Diversion::OpenSimulated(array<array<System::Byte>^>^) - Supplied template packets must not be null or empty.");
+					throw e;
 				}
-			}
 
-			std::string procName = GetProcessName(processId);
-			processName = gcnew System::String(procName.c_str());
+				pin_ptr<System::Byte> packetBytes = &packets[i][0];
+				templates.emplace_back(static_cast<uint8_t*>(packetBytes), static_cast<uint8_t*>(packetBytes) + packets[i]->Length);
+			}
 
-			// We don't need to free the allocated table here. In fact, it's better not to.
-			// It's assumed that if the user is interested in the process information, they're
-			// going to be interested in the process information more than one time, and since
-			// packets can come through a gazillion at a time, the last thing we want to do
-			// is destroy and recreate the table every single time. 
-			// 
-			// So, we'll leave the table alone, it will only ever be freed and reallocated when
-			// its size is not sufficient. When all is said and done, the table will ultimately
-			// be freed automatically when its owning managed object is garbage collected.
+			return OpenSimulated(templates);
 		}
 
-		Diversion::Diversion()
+		Diversion^ Diversion::OpenSimulated(const std::vector< std::vector<uint8_t> >& templates)
 		{
+			Diversion^ diversion = gcnew Diversion();
+			diversion->m_packetSource = new Native::SimulatedPacketSource(templates);
 
+			return diversion;
 		}
 
-		Diversion::Diversion(DivertHandle^ handle)
+		Native::PacketSource* Diversion::UnmanagedPacketSource::get()
 		{
-			Handle = handle;
+			return m_packetSource;
 		}
 
-		Diversion::~Diversion()
+		Native::Statistics* Diversion::UnmanagedStatistics::get()
 		{
-			this->!Diversion();
+			return m_statistics;
 		}
 
-		Diversion::!Diversion()
+		DiversionStatistics^ Diversion::GetStatistics()
 		{
-			delete m_winDivertHandle;
+			System::Exception^ e = nullptr;
+
+			if (m_statistics == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"In Diversion::GetStatistics() - Diversion has been disposed.");
+				throw e;
+			}
+
+			// The snapshot carries both histograms, which is too much for the stack.
+			Native::StatisticsSnapshot* snapshot = new Native::StatisticsSnapshot();
+
+			try
+			{
+				m_statistics->Snapshot(snapshot);
+
+				return gcnew DiversionStatistics(*snapshot);
+			}
+			finally
+			{
+				delete snapshot;
+			}
 		}
 
-		DivertHandle^ Diversion::Handle::get()
+		void Diversion::RecordReceiveError()
 		{
-			return m_winDivertHandle;
-		}	
+			int lastError = Native::GetNativeLastError();
 
-		void Diversion::Handle::set(DivertHandle^ value)
+			m_statistics->RecordReceiveError(lastError);
+
+			Native::SetNativeLastError(lastError);
+		}
+
+		void Diversion::RecordSendError()
 		{
-			m_winDivertHandle = value;
+			int lastError = Native::GetNativeLastError();
+
+			m_statistics->RecordSendError(lastError);
+
+			Native::SetNativeLastError(lastError);
 		}
 
 		bool Diversion::Receive(array<System::Byte>^ packetBuffer, Address^ address, uint32_t% receiveLength)
@@ -665,11 +501,94 @@ namespace Divert
 			
 			uint32_t readLen = 0;
 
-			int result = WinDivertRecv(m_winDivertHandle->UnmanagedHandle, byteArray, packetBuffer->Length, address->UnmanagedAddress, &readLen);
+			bool result = m_packetSource->Receive(byteArray, packetBuffer->Length, address->UnmanagedAddress, &readLen);
+
+			if (result)
+			{
+				m_statistics->RecordReceived(address->UnmanagedAddress, readLen);
+			}
+			else
+			{
+				RecordReceiveError();
+			}
 			
 			receiveLength = readLen;
 
-			return result == 1;
+			return result;
+		}
+
+		bool Diversion::Receive(PacketLease lease, Address^ address)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			if (!address->Reset())
+			{
+				e = gcnew System::Exception(u8"In Diversion::Receive(PacketLease, Address^) - Failed to reset Address.");
+				throw e;
+			}
+
+			uint32_t readLen = 0;
+
+			bool result = m_packetSource->Receive(pool->Data(lease.Buffer), pool->Capacity(lease.Buffer), address->UnmanagedAddress, &readLen);
+
+			if (result)
+			{
+				m_statistics->RecordReceived(address->UnmanagedAddress, readLen);
+			}
+			else
+			{
+				RecordReceiveError();
+			}
+
+			pool->SetLength(lease.Buffer, readLen);
+
+			return result;
+		}
+
+		uint32_t Diversion::ReceiveBatch(PacketBatch^ batch)
+		{
+			System::Exception^ e = nullptr;
+
+			if (batch == nullptr)
+			{
+				e = gcnew System::Exception(u8"In Diversion::ReceiveBatch(PacketBatch^) - Supplied batch is null.");
+				throw e;
+			}
+
+			// Everything the native side touches was pinned when the batch was constructed, so
+			// from here on it's one trip into native code for the whole batch.
+			uint32_t count = m_packetSource->ReceiveBatch(
+				batch->UnmanagedBuffer, 
+				static_cast<uint32_t>(batch->Buffer->Length), 
+				batch->MaxPacketLength, 
+				batch->Capacity, 
+				batch->UnmanagedOffsets, 
+				batch->UnmanagedLengths, 
+				batch->UnmanagedAddresses
+				);
+
+			batch->Count = count;
+
+			if (count != 0)
+			{
+				uint64_t bytes = 0;
+				const uint32_t* lengths = batch->UnmanagedLengths;
+
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					bytes += lengths[i];
+				}
+
+				m_statistics->RecordReceived(batch->UnmanagedAddresses, count, bytes);
+			}
+			else
+			{
+				RecordReceiveError();
+			}
+
+			return count;
 		}
 
 		bool Diversion::ReceiveAsync(array<System::Byte>^ packetBuffer, Address^ address, uint32_t% receiveLength, DivertAsyncResult^ asyncResult)
@@ -690,8 +609,6 @@ namespace Divert
 
 			uint32_t recvLength = 0;
 
-			pin_ptr<uint32_t> pinnedRecvLen = &receiveLength;
-
 			// If the user did not supply a valid DivertAsyncResult object, then the user does not care to wait for a pending
 			// result. In the Receive method, I can't imagine a scenario where this is useful. However, the parameter is
 			// optional. If the user has supplied a valid DivertAsyncResult object, then we need to pin the pointer of the 
@@ -704,63 +621,174 @@ namespace Divert
 
 				//Attempt a read, if it fails, because the user did not provide an async result object, we just
 				// abandon the entire operation.
-				if (!WinDivertRecvEx(m_winDivertHandle->UnmanagedHandle, byteArray, packetBuffer->Length, 0, address->UnmanagedAddress, pinnedRecvLen, nullptr))
+				if (!m_packetSource->ReceiveEx(byteArray, packetBuffer->Length, address->UnmanagedAddress, &recvLength, nullptr))
 				{
+					RecordReceiveError();
 					return false;
 				}
 
 				// Read succeeded immediately, no waiting necessary.
+				m_statistics->RecordReceived(address->UnmanagedAddress, recvLength);
 				receiveLength = recvLength;
 				return true;
 			}
 			else
 			{
-				// In this instance, we can't rely on a pin_ptr. As such, we need to permanently pin the array
-				// and give the handle to the DivertAsyncResult object to manage. Once the user is done with the
-				// async result, it will release the handle, unpinning the address.
-				//
-				// We have to do this because we have no idea when the pointer provided to the WinDivert API will
-				// actually be used, since we're leaving that up to the user.
-				System::Runtime::InteropServices::GCHandle bufferHandle = System::Runtime::InteropServices::GCHandle::Alloc(packetBuffer, System::Runtime::InteropServices::GCHandleType::Pinned);
-
 				if (!asyncResult->Reset())
 				{
 					e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(array<System::Byte>^, Address^, uint32_t%, DivertAsyncResult^) - Failed to reset DivertAsyncResult.");
 					throw e;
 				}
 
-				asyncResult->Buffer = bufferHandle;
-				asyncResult->WinDivertHandle = m_winDivertHandle;
-
-				System::IntPtr bPtr = bufferHandle.AddrOfPinnedObject();
+				// In this instance, we can't rely on a pin_ptr, because we have no idea when the pointer provided to
+				// the WinDivert API will actually be used. The DivertAsyncResult keeps the buffer pinned until the
+				// user collects the result. Results from a DivertAsyncResultPool own a buffer that is pinned once for
+				// life, and a result that is reused with the same buffer keeps its existing pin, so in the steady
+				// state nothing is allocated here.
+				void* bPtr = asyncResult->PinBuffer(packetBuffer);
 
-				if (bPtr == System::IntPtr::Zero)
+				if (bPtr == nullptr)
 				{
 					// Pointer of pinned array is null
 					e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(array<System::Byte>^, Address^, uint32_t%, DivertAsyncResult^) - Failed to pin packet buffer.");
 					throw e;
-				}			
+				}
 
-				if (!WinDivertRecvEx(m_winDivertHandle->UnmanagedHandle, static_cast<void*>(bPtr), packetBuffer->Length, 0, address->UnmanagedAddress, &recvLength, asyncResult->UnmanagedOverlapped))
+				asyncResult->WinDivertHandle = m_winDivertHandle;
+
+				if (!m_packetSource->ReceiveEx(bPtr, packetBuffer->Length, address->UnmanagedAddress, &recvLength, asyncResult->UnmanagedOverlapped))
 				{
-					int lastError = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+					int lastError = Native::GetNativeLastError();
 					if (lastError != ERROR_IO_PENDING)
 					{
 						// Read failed entirely
 						asyncResult->ErrorCode = lastError;
 						asyncResult->NoError = false;
+						asyncResult->ReleaseBuffer();
+						RecordReceiveError();
+					}
+					else
+					{
+						// Recorded by the result once it is collected.
+						asyncResult->TrackPending(m_statistics, address->UnmanagedAddress, false);
+						Native::SetNativeLastError(lastError);
 					}
 					return false;
 				}
 
 				// Read succeeded immediately, no waiting necessary.
+				m_statistics->RecordReceived(address->UnmanagedAddress, recvLength);
 				asyncResult->Length = recvLength;
+				asyncResult->ReleaseBuffer();
 				return true;
 			}
 
 			return false;
 		}
 
+		bool Diversion::ReceiveAsync(PacketLease lease, Address^ address, DivertAsyncResult^ asyncResult)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			if (!address->Reset())
+			{
+				e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(PacketLease, Address^, DivertAsyncResult^) - Failed to reset Address.");
+				throw e;
+			}
+
+			uint8_t* packet = pool->Data(lease.Buffer);
+			const uint32_t capacity = pool->Capacity(lease.Buffer);
+			uint32_t recvLength = 0;
+
+			if (asyncResult == nullptr)
+			{
+				if (!m_packetSource->ReceiveEx(packet, capacity, address->UnmanagedAddress, &recvLength, nullptr))
+				{
+					RecordReceiveError();
+					return false;
+				}
+
+				m_statistics->RecordReceived(address->UnmanagedAddress, recvLength);
+				pool->SetLength(lease.Buffer, recvLength);
+				return true;
+			}
+
+			if (!asyncResult->Reset())
+			{
+				e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(PacketLease, Address^, DivertAsyncResult^) - Failed to reset DivertAsyncResult.");
+				throw e;
+			}
+
+			// The buffer is native memory, so rather than a pin the result holds a reference on
+			// it, and on its pool, until the result is collected.
+			asyncResult->HoldLease(pool, lease.Buffer, true);
+			asyncResult->WinDivertHandle = m_winDivertHandle;
+
+			if (!m_packetSource->ReceiveEx(packet, capacity, address->UnmanagedAddress, &recvLength, asyncResult->UnmanagedOverlapped))
+			{
+				int lastError = Native::GetNativeLastError();
+				if (lastError != ERROR_IO_PENDING)
+				{
+					asyncResult->ErrorCode = lastError;
+					asyncResult->NoError = false;
+					asyncResult->ReleaseBuffer();
+					RecordReceiveError();
+				}
+				else
+				{
+					asyncResult->TrackPending(m_statistics, address->UnmanagedAddress, false);
+					Native::SetNativeLastError(lastError);
+				}
+
+				return false;
+			}
+
+			m_statistics->RecordReceived(address->UnmanagedAddress, recvLength);
+			pool->SetLength(lease.Buffer, recvLength);
+			asyncResult->Length = recvLength;
+			asyncResult->ReleaseBuffer();
+			return true;
+		}
+
+		ReceiveOperation^ Diversion::ReceiveAsync(ReceiveOperation^ operation)
+		{
+			System::Exception^ e = nullptr;
+
+			if (operation == nullptr)
+			{
+				e = gcnew System::ArgumentException(u8"In Diversion::ReceiveAsync(ReceiveOperation^) - Supplied operation is null.");
+				throw e;
+			}
+
+			if (m_packetSource == nullptr)
+			{
+				e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(ReceiveOperation^) - Diversion is not open.");
+				throw e;
+			}
+
+			Native::CompletionDispatcher* dispatcher = Native::CompletionDispatcher::Shared();
+
+			if (dispatcher == nullptr)
+			{
+				e = gcnew System::Exception(u8"In Diversion::ReceiveAsync(ReceiveOperation^) - Failed to start the shared completion dispatcher.");
+				throw e;
+			}
+
+			// Binding again to the same queue is a no-op, so there's no need to remember that it
+			// has already been done.
+			if (!m_packetSource->BindCompletionQueue(dispatcher->Queue(), dispatcher->Key()))
+			{
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In Diversion::ReceiveAsync(ReceiveOperation^) - Failed to bind to the shared completion dispatcher.");
+				throw e;
+			}
+
+			operation->Begin(m_packetSource, m_statistics);
+
+			return operation;
+		}
+
 		bool Diversion::Send(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address, uint32_t% sendLength)
 		{
 			System::Exception^ e = nullptr;
@@ -776,11 +804,42 @@ namespace Divert
 
 			uint32_t sendLen = 0;
 
-			int result = WinDivertSend(m_winDivertHandle->UnmanagedHandle, byteArray, packetLength, address->UnmanagedAddress, &sendLen);
+			bool result = m_packetSource->Send(byteArray, packetLength, address->UnmanagedAddress, &sendLen);
+
+			if (result)
+			{
+				m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
+			}
+			else
+			{
+				RecordSendError();
+			}
 
 			sendLength = sendLen;
 
-			return result == 1;
+			return result;
+		}
+
+		bool Diversion::Send(PacketLease lease, Address^ address, uint32_t% sendLength)
+		{
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			uint32_t sendLen = 0;
+
+			bool result = m_packetSource->Send(pool->Data(lease.Buffer), pool->Length(lease.Buffer), address->UnmanagedAddress, &sendLen);
+
+			if (result)
+			{
+				m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
+			}
+			else
+			{
+				RecordSendError();
+			}
+
+			sendLength = sendLen;
+
+			return result;
 		}
 
 		bool Diversion::SendAsync(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address, uint32_t% sendLength, [System::Runtime::InteropServices::Optional]DivertAsyncResult^ asyncResult)
@@ -806,68 +865,167 @@ namespace Divert
 
 				// Attempt a Send, if it fails, because the user did not provide an async result object, we just
 				// abandon the entire operation.
-				if (!WinDivertSendEx(m_winDivertHandle->UnmanagedHandle, byteArray, packetLength, 0, address->UnmanagedAddress, &sendLen, nullptr))
+				if (!m_packetSource->SendEx(byteArray, packetLength, address->UnmanagedAddress, &sendLen, nullptr))
 				{
+					RecordSendError();
 					return false;
 				}
 
 				// Send succeeded immediately, no waiting necessary.
+				m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
 				sendLength = sendLen;
 				return true;
 			}
 			else
 			{
-				// In this instance, we can't rely on a pin_ptr. As such, we need to permanently pin the array
-				// and give the handle to the DivertAsyncResult object to manage. Once the user is done with the
-				// async result, it will release the handle, unpinning the address.
-				//
-				// We have to do this because we have no idea when the pointer provided to the WinDivert API will
-				// actually be used, since we're leaving that up to the user.
-				System::Runtime::InteropServices::GCHandle bufferHandle = System::Runtime::InteropServices::GCHandle::Alloc(packetBuffer, System::Runtime::InteropServices::GCHandleType::Pinned);
-
 				if (!asyncResult->Reset())
 				{
 					e = gcnew System::Exception(u8"In Diversion::SendAsync(array<System::Byte>^, Address^, uint32_t%, DivertAsyncResult^) - Failed to reset DivertAsyncResult.");
 					throw e;
 				}
 
-				asyncResult->Buffer = bufferHandle;
-				asyncResult->WinDivertHandle = m_winDivertHandle;
+				// See ReceiveAsync. The buffer stays pinned by the DivertAsyncResult until the result is collected.
+				void* bPtr = asyncResult->PinBuffer(packetBuffer);
 
-				System::IntPtr bPtr = bufferHandle.AddrOfPinnedObject();
-
-				if (bPtr == System::IntPtr::Zero)
+				if (bPtr == nullptr)
 				{
 					// Pointer of pinned array is null
 					e = gcnew System::Exception(u8"In Diversion::SendAsync(array<System::Byte>^, Address^, uint32_t%, DivertAsyncResult^) - Failed to pin packet buffer.");
 					throw e;
 				}
 
-				if (!WinDivertSendEx(m_winDivertHandle->UnmanagedHandle, static_cast<void*>(bPtr), packetBuffer->Length, 0, address->UnmanagedAddress, &sendLen, asyncResult->UnmanagedOverlapped))
+				asyncResult->WinDivertHandle = m_winDivertHandle;
+
+				if (!m_packetSource->SendEx(bPtr, packetLength, address->UnmanagedAddress, &sendLen, asyncResult->UnmanagedOverlapped))
 				{
-					int lastError = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+					int lastError = Native::GetNativeLastError();
 					if (lastError != ERROR_IO_PENDING)
 					{
 						// Send failed entirely
 						asyncResult->ErrorCode = lastError;
 						asyncResult->NoError = false;
+						asyncResult->ReleaseBuffer();
+						RecordSendError();
+					}
+					else
+					{
+						asyncResult->TrackPending(m_statistics, address->UnmanagedAddress, true);
+						Native::SetNativeLastError(lastError);
 					}
 
 					return false;
 				}
 
 				// Send succeeded immediately, no waiting necessary.
+				m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
 				asyncResult->Length = sendLen;
+				asyncResult->ReleaseBuffer();
 				return true;
 			}
 
 			return false;
 		}
 
+		bool Diversion::SendAsync(PacketLease lease, Address^ address, uint32_t% sendLength, DivertAsyncResult^ asyncResult)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			uint8_t* packet = pool->Data(lease.Buffer);
+			const uint32_t packetLength = pool->Length(lease.Buffer);
+			uint32_t sendLen = 0;
+
+			if (asyncResult == nullptr)
+			{
+				if (!m_packetSource->SendEx(packet, packetLength, address->UnmanagedAddress, &sendLen, nullptr))
+				{
+					RecordSendError();
+					return false;
+				}
+
+				m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
+				sendLength = sendLen;
+				return true;
+			}
+
+			if (!asyncResult->Reset())
+			{
+				e = gcnew System::Exception(u8"In Diversion::SendAsync(PacketLease, Address^, uint32_t%, DivertAsyncResult^) - Failed to reset DivertAsyncResult.");
+				throw e;
+			}
+
+			// See ReceiveAsync(PacketLease, Address^, DivertAsyncResult^).
+			asyncResult->HoldLease(pool, lease.Buffer, false);
+			asyncResult->WinDivertHandle = m_winDivertHandle;
+
+			if (!m_packetSource->SendEx(packet, packetLength, address->UnmanagedAddress, &sendLen, asyncResult->UnmanagedOverlapped))
+			{
+				int lastError = Native::GetNativeLastError();
+				if (lastError != ERROR_IO_PENDING)
+				{
+					asyncResult->ErrorCode = lastError;
+					asyncResult->NoError = false;
+					asyncResult->ReleaseBuffer();
+					RecordSendError();
+				}
+				else
+				{
+					asyncResult->TrackPending(m_statistics, address->UnmanagedAddress, true);
+					Native::SetNativeLastError(lastError);
+				}
+
+				return false;
+			}
+
+			m_statistics->RecordSent(address->UnmanagedAddress, sendLen);
+			sendLength = sendLen;
+			asyncResult->Length = sendLen;
+			asyncResult->ReleaseBuffer();
+			return true;
+		}
+
+		uint32_t Diversion::SendBatch(PacketBatch^ batch)
+		{
+			System::Exception^ e = nullptr;
+
+			if (batch == nullptr)
+			{
+				e = gcnew System::Exception(u8"In Diversion::SendBatch(PacketBatch^) - Supplied batch is null.");
+				throw e;
+			}
+
+			if (batch->Count == 0)
+			{
+				return 0;
+			}
+
+			// Packets are bounds checked against the buffer by the packet source.
+			uint32_t sent = m_packetSource->SendBatch(
+				batch->UnmanagedBuffer, 
+				static_cast<uint32_t>(batch->Buffer->Length), 
+				batch->UnmanagedOffsets, 
+				batch->UnmanagedLengths, 
+				batch->UnmanagedAddresses, 
+				batch->Count, 
+				batch->UnmanagedResults
+				);
+
+			// Per packet results, so a partial batch counts its successes and failures apart.
+			m_statistics->RecordSent(batch->UnmanagedAddresses, batch->UnmanagedResults, batch->UnmanagedLengths, batch->Count);
+
+			return sent;
+		}
+
 		bool Diversion::Close()
 		{
 			if (m_winDivertHandle && m_winDivertHandle->Valid)
 			{
+				if (m_packetSource != nullptr)
+				{
+					m_packetSource->Detach();
+				}
+
 				return m_winDivertHandle->Close();
 			}
 
@@ -909,13 +1067,22 @@ namespace Divert
 
 		bool Diversion::ParsePacket(array<System::Byte>^ packetBuffer, uint32_t packetLength, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader)
 		{
-			// Ewww, code duplication. Oh well, this was the simplest way to provide the full functionality of the WinDivert parse packet function.
-
-			System::Exception^ e = nullptr;
-
 			// Pin the array to ensure the GC leaves the object alone with the unmanaged code uses it
 			pin_ptr<System::Byte> byteArray = &packetBuffer[0];
 
+			return ParseUnmanagedPacket(byteArray, packetLength, ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader);
+		}
+
+		bool Diversion::ParsePacket(PacketLease lease, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader)
+		{
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			// Native memory, nothing to pin.
+			return ParseUnmanagedPacket(pool->Data(lease.Buffer), pool->Length(lease.Buffer), ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader);
+		}
+
+		bool Diversion::ParseUnmanagedPacket(void* packet, uint32_t packetLength, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader)
+		{
 			PWINDIVERT_IPHDR umpipV4Header = nullptr;
 			PWINDIVERT_IPV6HDR umpipV6Header = nullptr;
 			PWINDIVERT_UDPHDR umpudpHeader = nullptr;
@@ -925,7 +1092,7 @@ namespace Divert
 
 			int retVal = 0;
 
-			retVal = WinDivertHelperParsePacket(byteArray, packetLength, &umpipV4Header, &umpipV6Header, &umpicmpHeader, &umpicmpV6Header, &umptcpHeader, &umpudpHeader, nullptr, nullptr);
+			retVal = WinDivertHelperParsePacket(packet, packetLength, &umpipV4Header, &umpipV6Header, &umpicmpHeader, &umpicmpV6Header, &umptcpHeader, &umpudpHeader, nullptr, nullptr);
 
 			if (ipHeader != nullptr && umpipV4Header != nullptr)
 			{
@@ -957,6 +1124,8 @@ namespace Divert
 				udpHeader->UnmanagedHeader = umpudpHeader;
 			}
 
+			PrepareIncrementalChecksums(ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader, umpicmpV6Header, umptcpHeader, umpudpHeader);
+
 			return retVal == 1;
 		}
 
@@ -1021,54 +1190,118 @@ namespace Divert
 				udpHeader->UnmanagedHeader = umpudpHeader;
 			}
 
+			PrepareIncrementalChecksums(ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader, umpicmpV6Header, umptcpHeader, umpudpHeader);
+
 			return retVal == 1;
 		}
 
+		void Diversion::PrepareIncrementalChecksums(IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader, PWINDIVERT_ICMPV6HDR icmpv6, PWINDIVERT_TCPHDR tcp, PWINDIVERT_UDPHDR udp)
+		{
+			// The checksums that cover the addresses through a pseudo header. ICMP for IPv4 has none.
+			uint16_t* transportChecksum = nullptr;
+			bool zeroMeansNone = false;
+
+			if (tcp != nullptr)
+			{
+				transportChecksum = &tcp->Checksum;
+			}
+			else if (udp != nullptr)
+			{
+				transportChecksum = &udp->Checksum;
+				zeroMeansNone = true;
+			}
+			else if (icmpv6 != nullptr)
+			{
+				transportChecksum = &icmpv6->Checksum;
+			}
+
+			if (ipHeader != nullptr)
+			{
+				ipHeader->IncrementalChecksums = m_incrementalChecksums;
+				ipHeader->SetTransportChecksum(transportChecksum, zeroMeansNone);
+			}
+
+			if (ipv6Header != nullptr)
+			{
+				ipv6Header->IncrementalChecksums = m_incrementalChecksums;
+				ipv6Header->SetTransportChecksum(transportChecksum, zeroMeansNone);
+			}
+
+			if (icmpHeader != nullptr)
+			{
+				icmpHeader->IncrementalChecksums = m_incrementalChecksums;
+			}
+
+			if (icmpv6Header != nullptr)
+			{
+				icmpv6Header->IncrementalChecksums = m_incrementalChecksums;
+			}
+
+			if (tcpHeader != nullptr)
+			{
+				tcpHeader->IncrementalChecksums = m_incrementalChecksums;
+			}
+
+			if (udpHeader != nullptr)
+			{
+				udpHeader->IncrementalChecksums = m_incrementalChecksums;
+			}
+		}
+
 		uint32_t Diversion::CalculateChecksums(array<System::Byte>^ packetBuffer, uint32_t packetLength, ChecksumCalculationFlags flags)
 		{
 			System::Exception^ e = nullptr;
 
+			if (packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In Diversion::CalculateChecksums(array<System::Byte>^, uint32_t, ChecksumCalculationFlags) - Packet length exceeds the length of the buffer.");
+				throw e;
+			}
+
 			// Pin the array to ensure the GC leaves the object alone with the unmanaged code uses it
 			pin_ptr<System::Byte> byteArray = &packetBuffer[0];
 
-			uint64_t flagsInt = (uint64_t)System::Convert::ChangeType(flags, System::UInt64::typeid);
+			return Native::CalculateChecksums(byteArray, packetLength, static_cast<uint64_t>(flags));
+		}
 
-			int retVal = WinDivertHelperCalcChecksums(byteArray, packetLength, flagsInt);
+		uint32_t Diversion::CalculateChecksums(PacketLease lease, ChecksumCalculationFlags flags)
+		{
+			Native::PacketBufferPool* pool = lease.LivePool();
 
-			return retVal == 1;
+			return Native::CalculateChecksums(pool->Data(lease.Buffer), pool->Length(lease.Buffer), static_cast<uint64_t>(flags));
 		}
 
-		std::string Diversion::GetProcessName(const ULONG processId)
+		uint64_t Diversion::CalculateChecksumsBatch(PacketBatch^ batch, ChecksumCalculationFlags flags)
 		{
-			std::string result("SYSTEM");
+			return CalculateChecksumsBatch(batch, flags, 0);
+		}
 
-			HANDLE processHandle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+		uint64_t Diversion::CalculateChecksumsBatch(PacketBatch^ batch, ChecksumCalculationFlags flags, uint32_t threads)
+		{
+			System::Exception^ e = nullptr;
 
-			if (processHandle != nullptr && processHandle != INVALID_HANDLE_VALUE)
+			if (batch == nullptr)
 			{
-				char filename[MAX_PATH];
-				DWORD resSize = MAX_PATH;
+				e = gcnew System::Exception(u8"In Diversion::CalculateChecksumsBatch(PacketBatch^, ChecksumCalculationFlags, uint32_t) - Supplied batch is null.");
+				throw e;
+			}
 
-				if (QueryFullProcessImageNameA(processHandle, 0, filename, &resSize) == 0)
-				{
-					// Failed to get module filename.
-					CloseHandle(processHandle);
-					return result;
-				}
-				else
-				{
-					// Success
-					result = std::string(filename);
-					CloseHandle(processHandle);
-					return result;
-				}
+			if (batch->Count == 0)
+			{
+				return 0;
 			}
 
-			// Failed to open a valid handle. This is almost surely a SYSTEM process, or protected by AV.
-			// Let's not throw any errors. It is expected behavior that this call may fail for reasons such
-			// as I listed above, or the process is closed and the ID reassigned before this call is 
-			// processed.
-			return result;
+			// The batch keeps its arrays pinned, so the pool can work on them directly. Packets
+			// are bounds checked against the buffer by the pool itself.
+			return Native::ChecksumBatchPool::Shared().CalculateChecksums(
+				batch->UnmanagedBuffer,
+				static_cast<uint64_t>(batch->Buffer->Length),
+				batch->UnmanagedOffsets,
+				batch->UnmanagedLengths,
+				batch->Count,
+				static_cast<uint64_t>(flags),
+				threads
+				);
 		}
 
 	} /* namespace Net */
@@ -33,6 +33,12 @@
 #include "DivertTCPHeader.hpp"
 #include "DivertUDPHeader.hpp"
 #include "DivertAsyncResult.hpp"
+#include "DivertAsyncResultPool.hpp"
+#include "DivertPacketBatch.hpp"
+#include "DivertPacketBufferPool.hpp"
+#include "DivertPacketSource.hpp"
+#include "DivertReceiveOperation.hpp"
+#include "DivertStatistics.hpp"
 
 #using <mscorlib.dll>
 
@@ -183,6 +189,9 @@ namespace Divert
 			/// <summary>
 			/// Checks the given filter string to ensure its format is correct and does not contain
 			/// any invalid data.
+			/// 
+			/// The filter is checked by compiling it, and a valid filter is kept in the
+			/// CompiledFilter cache, so that a following EvaluateFilter doesn't parse it again.
 			/// </summary>
 			/// <param name="filter">
 			/// The filter string to check. 
@@ -201,6 +210,10 @@ namespace Divert
 			/// <summary>
 			/// Evaluates a filter against a given packet and its corresponding data to see if the
 			/// filter applies.
+			/// 
+			/// The filter string is compiled on first use and taken from the CompiledFilter cache
+			/// after that, so repeat calls neither marshal nor parse it. Callers evaluating one
+			/// filter many times can hold on to a CompiledFilter and skip the cache lookup too.
 			/// </summary>
 			/// <param name="filter">
 			/// The filter string to check. 
@@ -218,7 +231,7 @@ namespace Divert
 			/// The address information for the supplied packet. 
 			/// </param>
 			/// <returns>
-			/// True if the filter applies, false otherwise. 
+			/// True if the filter applies, false otherwise, including when the filter is invalid.
 			/// </returns>
 			static bool EvaluateFilter(System::String^ filter, DivertLayer layer, array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address);
 
@@ -254,6 +267,19 @@ namespace Divert
 				void set(DivertHandle^ value);
 			}
 
+			/// <summary>
+			/// When set, the headers populated by ParsePacket fold every change made through their
+			/// setters into the IP and transport checksums incrementally, as per RFC 1624. A packet
+			/// that only had a few header fields rewritten, e.g. an address and a port by a NAT, is
+			/// then ready to be sent without calling CalculateChecksums, which sums the whole packet
+			/// again. The checksums must be correct to begin with. Off by default.
+			/// </summary>
+			property bool IncrementalChecksums
+			{
+				bool get();
+				void set(bool value);
+			}
+
 			/// <summary>
 			/// Receives a diverted packet that matched the filter passed to WinDivertOpen(). The
 			/// received packet is guaranteed to match the filter. An application should call
@@ -276,6 +302,23 @@ namespace Divert
 			/// </returns>
 			bool Receive(array<System::Byte>^ packetBuffer, Address^ address, uint32_t% receiveLength);
 
+			/// <summary>
+			/// Receives a diverted packet into a leased buffer, with nothing pinned. The lease's
+			/// Length is set to the length of the packet.
+			/// </summary>
+			/// <param name="lease">
+			/// A valid lease from a PacketBufferPool. Packets longer than its Capacity fail to be
+			/// received, lease a large buffer if they are expected.
+			/// </param>
+			/// <param name="address">
+			/// A Address instance. The Address instance will hold information about the origin and
+			/// direction of the intercepted packet.
+			/// </param>
+			/// <returns>
+			/// True if the operation succeeded and a packet was captured, false otherwise.
+			/// </returns>
+			bool Receive(PacketLease lease, Address^ address);
+
 			/// <summary>
 			/// Receives a diverted packet that matched the filter passed to WinDivertOpen().
 			/// 
@@ -326,6 +369,57 @@ namespace Divert
 			/// </returns>
 			bool ReceiveAsync(array<System::Byte>^ packetBuffer, Address^ address, uint32_t% receiveLength, [System::Runtime::InteropServices::Optional]DivertAsyncResult^ asyncResult);
 
+			/// <summary>
+			/// Receives a diverted packet into a leased buffer, as ReceiveAsync does into an array.
+			/// When the packet is received immediately, the lease's Length is set straight away.
+			/// Otherwise the DivertAsyncResult holds a reference on the buffer until the result is
+			/// collected, and sets the lease's Length when DivertAsyncResult.Get(uint timeout)
+			/// succeeds. Nothing is pinned either way.
+			/// </summary>
+			bool ReceiveAsync(PacketLease lease, Address^ address, [System::Runtime::InteropServices::Optional]DivertAsyncResult^ asyncResult);
+
+			/// <summary>
+			/// Starts an asynchronous read that can be awaited, rather than polled with
+			/// DivertAsyncResult.Get(uint timeout):
+			/// 
+			///     uint length = await diversion.ReceiveAsync(operation);
+			/// 
+			/// The read completes through the shared completion dispatcher, so no thread is blocked
+			/// while it's in flight. The packet lands in operation.Buffer, and its address in
+			/// operation.PacketAddress. Reusing the same operation for every read allocates nothing
+			/// but the continuation's trip to the thread pool.
+			/// A Diversion that is being read by a ReceiveEngine can't also be read this way, as
+			/// its handle is already bound to the engine's completion port.
+			/// </summary>
+			/// <param name="operation">
+			/// The operation to read with. Must not already have a read in flight.
+			/// </param>
+			/// <returns>
+			/// The supplied operation, for awaiting.
+			/// </returns>
+			ReceiveOperation^ ReceiveAsync(ReceiveOperation^ operation);
+
+			/// <summary>
+			/// Receives multiple diverted packets in a single call. This method blocks until at
+			/// least one packet is available, then keeps reading packets that are already queued
+			/// by the driver, without waiting for more, until the batch is full.
+			/// 
+			/// All of the packets are read into the packed PacketBatch.Buffer back to back, and the
+			/// offset, length and address of each one is recorded in the batch tables. The whole
+			/// operation crosses the managed/native boundary once, no matter how many packets are
+			/// read, and the batch storage is pinned once when the batch is created rather than on
+			/// every call. Reuse the same PacketBatch across calls.
+			/// </summary>
+			/// <param name="batch">
+			/// The batch to read packets into. Any previous contents are overwritten and
+			/// PacketBatch.Count is set to the number of packets read.
+			/// </param>
+			/// <returns>
+			/// The number of packets read. Zero indicates that the read for the first packet
+			/// failed. Use Marshal.GetLastWin32Error() to get the reason.
+			/// </returns>
+			uint32_t ReceiveBatch(PacketBatch^ batch);
+
 			/// <summary>
 			/// Injects a packet into the network stack. The injected packet may be one received
 			/// from WinDivertRecv(), or a modified version, or a completely new packet. More
@@ -350,6 +444,11 @@ namespace Divert
 			/// </returns>
 			bool Send(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address, uint32_t% sendLength);
 
+			/// <summary>
+			/// Injects the packet in a leased buffer, Length bytes of it, with nothing pinned.
+			/// </summary>
+			bool Send(PacketLease lease, Address^ address, uint32_t% sendLength);
+
 			/// <summary>
 			/// Injects a packet into the network stack. The injected packet may be one received
 			/// from WinDivertRecv(), or a modified version, or a completely new packet.
@@ -404,6 +503,33 @@ namespace Divert
 			/// </returns>
 			bool SendAsync(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address, uint32_t% sendLength, [System::Runtime::InteropServices::Optional]DivertAsyncResult^ asyncResult);
 
+			/// <summary>
+			/// Injects the packet in a leased buffer, as SendAsync does from an array. When the
+			/// send goes pending, the DivertAsyncResult holds a reference on the buffer until the
+			/// result is collected, so the lease may be released right away.
+			/// </summary>
+			bool SendAsync(PacketLease lease, Address^ address, uint32_t% sendLength, [System::Runtime::InteropServices::Optional]DivertAsyncResult^ asyncResult);
+
+			/// <summary>
+			/// Injects every packet in the supplied batch in a single call. This is the
+			/// counterpart to ReceiveBatch, so that a divert-inspect-reinject loop can receive,
+			/// modify and reinject a whole batch with just two trips into native code, and without
+			/// pinning anything per packet.
+			/// 
+			/// A failure to inject one packet does not stop the rest of the batch from being
+			/// injected. The outcome for each packet is recorded in PacketBatch.Results.
+			/// </summary>
+			/// <param name="batch">
+			/// The batch of packets to inject. The first PacketBatch.Count packets described by the
+			/// batch tables are injected.
+			/// </param>
+			/// <returns>
+			/// The number of packets successfully injected. If this is less than
+			/// PacketBatch.Count, check PacketBatch.Results for the Win32 error code of each
+			/// packet that failed.
+			/// </returns>
+			uint32_t SendBatch(PacketBatch^ batch);
+
 			/// <summary>
 			/// Close the handle. This can be called explicitly by the user or, if the user disposes
 			/// of the Diversion instance, the open handle will be closed automatically as the
@@ -488,6 +614,13 @@ namespace Divert
 			/// </returns>
 			bool ParsePacket(array<System::Byte>^ packetBuffer, uint32_t packetLength, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader);
 
+			/// <summary>
+			/// Parses the packet in a leased buffer, Length bytes of it. The headers point straight
+			/// into the buffer, and stay valid for as long as the lease is held, rather than only
+			/// while the buffer happens not to move.
+			/// </summary>
+			bool ParsePacket(PacketLease lease, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader);
+
 			/// <summary>
 			/// Parses a raw packet (e.g. from WinDivertRecv()) into the various packet headers
 			/// and/or payloads that may or may not be present. More information here:
@@ -537,6 +670,10 @@ namespace Divert
 			/// flag. Typically this function should be invoked on a modified packet before it is
 			/// injected with WinDivertSend(). More information here:
 			/// https://reqrypt.org/windivert-doc.html#divert_helper_calc_checksums
+			/// 
+			/// The checksums are calculated by the library itself rather than by WinDivert, using
+			/// the widest SIMD instructions the processor supports. Transport checksums of IP
+			/// fragments are left alone, since they cover data that isn't in the packet.
 			/// </summary>
 			/// <param name="packetBuffer">
 			/// An array containing the packet data to calculate the checksums for. 
@@ -553,6 +690,63 @@ namespace Divert
 			/// </returns>
 			uint32_t CalculateChecksums(array<System::Byte>^ packetBuffer, uint32_t packetLength, ChecksumCalculationFlags flags);
 
+			/// <summary>
+			/// Calculates the checksums of the packet in a leased buffer, Length bytes of it.
+			/// </summary>
+			uint32_t CalculateChecksums(PacketLease lease, ChecksumCalculationFlags flags);
+
+			/// <summary>
+			/// Calculates the checksums of every packet in the batch in a single native pass,
+			/// without crossing back into managed code between packets. Equivalent to calling
+			/// CalculateChecksums on each packet in turn. Large batches are split across a shared
+			/// pool of worker threads, with one thread for every 256KB of packet data up to the
+			/// number of processors.
+			/// </summary>
+			/// <param name="batch">
+			/// The batch holding the packets to calculate the checksums for.
+			/// </param>
+			/// <param name="flags">
+			/// Checksum calculation flags. Adjust which headers have the checksums calculated for
+			/// with these flags.
+			/// </param>
+			/// <returns>
+			/// The total number of checksums calculated.
+			/// </returns>
+			uint64_t CalculateChecksumsBatch(PacketBatch^ batch, ChecksumCalculationFlags flags);
+
+			/// <summary>
+			/// Calculates the checksums of every packet in the batch in a single native pass,
+			/// splitting the work across the given number of threads. The calling thread counts as
+			/// one of them. Should another batch already be using the worker pool, the batch is
+			/// calculated on the calling thread alone.
+			/// </summary>
+			/// <param name="batch">
+			/// The batch holding the packets to calculate the checksums for.
+			/// </param>
+			/// <param name="flags">
+			/// Checksum calculation flags. Adjust which headers have the checksums calculated for
+			/// with these flags.
+			/// </param>
+			/// <param name="threads">
+			/// The number of threads to use, at most 64. Zero picks a count based on the size of
+			/// the batch.
+			/// </param>
+			/// <returns>
+			/// The total number of checksums calculated.
+			/// </returns>
+			uint64_t CalculateChecksumsBatch(PacketBatch^ batch, ChecksumCalculationFlags flags, uint32_t threads);
+
+			/// <summary>
+			/// Takes a snapshot of this instance's I/O counters and latency histograms. Every
+			/// receive and send method, DivertAsyncResult, ReceiveOperation and ReceiveEngine
+			/// record into them as they go, without locking, so keeping them costs next to nothing.
+			/// Taking a snapshot copies a few kilobytes, and is cheap enough to do every second.
+			/// </summary>
+			/// <returns>
+			/// The snapshot. Later traffic doesn't change it.
+			/// </returns>
+			DiversionStatistics^ GetStatistics();
+
 		private:
 
 			/// <summary>
@@ -576,17 +770,85 @@ namespace Divert
 			DivertHandle^ m_winDivertHandle;
 
 			/// <summary>
-			/// Utility for getting the full path to the binary including the binary name for the
-			/// supplied process ID.
+			/// Where packets are actually read from and injected into. For instances created
+			/// through Open(...) this wraps the WinDivert handle. Exclusively owned by this object.
+			/// </summary>
+			Native::PacketSource* m_packetSource = nullptr;
+
+			/// <summary>
+			/// The counters behind GetStatistics(). This object holds one reference, operations in
+			/// flight hold one each.
+			/// </summary>
+			Native::Statistics* m_statistics = nullptr;
+
+			/// <summary>
+			/// Whether ParsePacket turns on incremental checksum updates in the headers.
 			/// </summary>
-			/// <param name="processId">
-			/// A valid process ID (Must not be equal to 0 or 4, as these values imply SYSTEM). 
+			bool m_incrementalChecksums = false;
+
+			/// <summary>
+			/// Hands the IncrementalChecksums setting to the headers populated by ParsePacket, and
+			/// tells the IP headers where the transport checksum that covers their addresses is.
+			/// </summary>
+			void PrepareIncrementalChecksums(IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader, PWINDIVERT_ICMPV6HDR icmpv6, PWINDIVERT_TCPHDR tcp, PWINDIVERT_UDPHDR udp);
+
+			/// <summary>
+			/// Parses a packet that is already pinned or in native memory, and populates the
+			/// supplied headers. Shared by the ParsePacket overloads that don't return the payload.
+			/// </summary>
+			bool ParseUnmanagedPacket(void* packet, uint32_t packetLength, IPHeader^ ipHeader, IPv6Header^ ipv6Header, ICMPHeader^ icmpHeader, ICMPv6Header^ icmpv6Header, TCPHeader^ tcpHeader, UDPHeader^ udpHeader);
+
+			/// <summary>
+			/// Records the thread's last error as a failed read, leaving the last error as it was
+			/// for the caller to inspect.
+			/// </summary>
+			void RecordReceiveError();
+
+			/// <summary>
+			/// Records the thread's last error as a failed injection, leaving the last error as it
+			/// was for the caller to inspect.
+			/// </summary>
+			void RecordSendError();
+
+		internal:
+
+			/// <summary>
+			/// Creates a Diversion that is not backed by the driver at all. Receive and ReceiveBatch
+			/// hand out copies of the supplied packets in round-robin order, Send and SendBatch
+			/// discard what they're given. Intended for benchmarking and testing the I/O paths
+			/// without the driver or Administrator privileges.
+			/// </summary>
+			/// <param name="packets">
+			/// The template packets to hand out. Must contain at least one packet.
 			/// </param>
 			/// <returns>
-			/// If a valid PID was supplied, the full path to the binary including the binary name.
-			/// If an invalid PID was supplied, an empty string.
+			/// A Diversion instance backed by an in-process simulated packet source.
 			/// </returns>
-			static std::string GetProcessName(const ULONG processId);
+			static Diversion^ OpenSimulated(array<array<System::Byte>^>^ packets);
+
+			/// <summary>
+			/// As OpenSimulated(array), with the templates already copied out. The set may be
+			/// empty, in which case every Receive fails.
+			/// </summary>
+			static Diversion^ OpenSimulated(const std::vector< std::vector<uint8_t> >& templates);
+
+			/// <summary>
+			/// The packet source this instance reads from and injects into. Still owned by this
+			/// object, engines built on top only borrow it.
+			/// </summary>
+			property Native::PacketSource* UnmanagedPacketSource
+			{
+				Native::PacketSource* get();
+			}
+
+			/// <summary>
+			/// The statistics this instance records into, for engines built on top to record into
+			/// as well. Callers that keep it past this object's lifetime must take a reference.
+			/// </summary>
+			property Native::Statistics* UnmanagedStatistics
+			{
+				Native::Statistics* get();
+			}
 
 		};
 
@@ -34,6 +34,15 @@ namespace Divert
 			Init();
 		}
 
+		DivertAsyncResult::DivertAsyncResult(uint32_t bufferLength)
+		{
+			Init();
+
+			m_ownedBuffer = gcnew array<System::Byte>(static_cast<int>(bufferLength));
+			m_ownedBufferPin = System::Runtime::InteropServices::GCHandle::Alloc(m_ownedBuffer, System::Runtime::InteropServices::GCHandleType::Pinned);
+			System::Threading::Interlocked::Increment(s_allocationCount);
+		}
+
 		DivertAsyncResult::~DivertAsyncResult()
 		{
 			this->!DivertAsyncResult();
@@ -41,14 +50,24 @@ namespace Divert
 
 		DivertAsyncResult::!DivertAsyncResult()
 		{
-			if (m_buffer.IsAllocated)
+			ForgetPending();
+
+			ReleaseBuffer();
+
+			if (m_ownedBufferPin.IsAllocated)
 			{
-				m_buffer.Free();
-			}		
+				m_ownedBufferPin.Free();
+			}
+
+			if (m_overlappedEventHandle != nullptr)
+			{
+				m_overlappedEventHandle->Close();
+			}
 
 			if (m_overlapped != nullptr)
 			{
 				free(m_overlapped);
+				m_overlapped = nullptr;
 			}
 		}
 
@@ -129,37 +148,111 @@ namespace Divert
 					m_errorCode = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
 					m_noError = false;
 
-					// Close the overlapped event handle, not needed anymore.
-					m_overlappedEventHandle->Close();
-
-					// Don't need to keep the buffer pinned anymore.
-					if (m_buffer.IsAllocated)
-					{
-						m_buffer.Free();
-					}
+					RecordCompletion(m_errorCode);
 
-					System::Console::WriteLine("1");
+					// Don't need to keep the buffer pinned anymore. The event is kept for the
+					// next operation.
+					ReleaseBuffer();
 
 					return false;
 				}
 
 				m_ioLength = static_cast<uint32_t>(ioLength);
 
-				// Close the overlapped event handle, not needed anymore.
-				m_overlappedEventHandle->Close();
-
-				// Don't need to keep the buffer pinned anymore.
-				if (m_buffer.IsAllocated)
+				if (m_leasePool != nullptr && m_leaseReceive)
 				{
-					m_buffer.Free();
+					m_leasePool->SetLength(m_leaseBuffer, m_ioLength);
 				}
 
+				RecordCompletion(0);
+
+				// Don't need to keep the buffer pinned anymore. The event is kept for the
+				// next operation.
+				ReleaseBuffer();
+
 				return true;
 			}
 
 			return false;
 		}
 
+		array<System::Byte>^ DivertAsyncResult::PacketBuffer::get()
+		{
+			return m_ownedBuffer;
+		}
+
+		int64_t DivertAsyncResult::AllocationCount::get()
+		{
+			return System::Threading::Interlocked::Read(s_allocationCount);
+		}
+
+		void* DivertAsyncResult::PinBuffer(array<System::Byte>^ buffer)
+		{
+			if (buffer == nullptr)
+			{
+				return nullptr;
+			}
+
+			// A lease held for an operation that was never collected.
+			ReleaseLease();
+
+			// The pooled case: our own buffer is pinned for life.
+			if (m_ownedBuffer != nullptr && System::Object::ReferenceEquals(buffer, m_ownedBuffer))
+			{
+				return m_ownedBufferPin.AddrOfPinnedObject().ToPointer();
+			}
+
+			// The same user buffer as last time is still pinned if the previous operation was
+			// never collected through Get().
+			if (m_buffer.IsAllocated)
+			{
+				if (System::Object::ReferenceEquals(buffer, m_buffer.Target))
+				{
+					return m_buffer.AddrOfPinnedObject().ToPointer();
+				}
+
+				m_buffer.Free();
+			}
+
+			m_buffer = System::Runtime::InteropServices::GCHandle::Alloc(buffer, System::Runtime::InteropServices::GCHandleType::Pinned);
+			System::Threading::Interlocked::Increment(s_allocationCount);
+
+			return m_buffer.AddrOfPinnedObject().ToPointer();
+		}
+
+		void DivertAsyncResult::HoldLease(Native::PacketBufferPool* pool, uint32_t buffer, bool receive)
+		{
+			// Whatever was held for an operation that was never collected.
+			ReleaseBuffer();
+
+			pool->AddReference();
+			pool->Retain(buffer);
+
+			m_leasePool = pool;
+			m_leaseBuffer = buffer;
+			m_leaseReceive = receive;
+		}
+
+		void DivertAsyncResult::ReleaseBuffer()
+		{
+			if (m_buffer.IsAllocated)
+			{
+				m_buffer.Free();
+			}
+
+			ReleaseLease();
+		}
+
+		void DivertAsyncResult::ReleaseLease()
+		{
+			if (m_leasePool != nullptr)
+			{
+				m_leasePool->Return(m_leaseBuffer);
+				m_leasePool->Release();
+				m_leasePool = nullptr;
+			}
+		}
+
 		System::Runtime::InteropServices::GCHandle DivertAsyncResult::Buffer::get()
 		{
 			return m_buffer;
@@ -200,38 +293,143 @@ namespace Divert
 			m_overlapped = value;
 		}
 
+		bool DivertAsyncResult::IsPending()
+		{
+			return m_overlapped != nullptr && !HasOverlappedIoCompleted(m_overlapped);
+		}
+
+		DivertAsyncResultPool^ DivertAsyncResult::Pool::get()
+		{
+			return m_pool;
+		}
+
+		void DivertAsyncResult::Pool::set(DivertAsyncResultPool^ value)
+		{
+			m_pool = value;
+		}
+
+		bool DivertAsyncResult::Pooled::get()
+		{
+			return m_pooled;
+		}
+
+		void DivertAsyncResult::Pooled::set(bool value)
+		{
+			m_pooled = value;
+		}
+
 		void DivertAsyncResult::Init()
 		{
 			m_overlapped = static_cast<OVERLAPPED*>(malloc(sizeof(OVERLAPPED)));
+
+			if (m_overlapped == nullptr)
+			{
+				m_noError = false;
+				m_errorCode = ERROR_NOT_ENOUGH_MEMORY;
+				return;
+			}
+
+			memset(m_overlapped, 0, sizeof(*m_overlapped));
+
+			// The event is created once and lives as long as this object does. It's auto-reset,
+			// and Reset() clears any signal left over from an operation that nobody waited on.
+			HANDLE overlappedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+			// If this failed, all is lost. Set m_errorCode to GetLastError. Reset() will keep
+			// reporting failure.
+			if (overlappedEvent == nullptr)
+			{
+				m_noError = false;
+				m_errorCode = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
+				return;
+			}
+
+			// The low bit of hEvent keeps this operation's completion out of any completion port
+			// the WinDivert handle is associated with, see ReceiveEngine. The event itself is
+			// still signalled as usual.
+			m_overlapped->hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<uintptr_t>(overlappedEvent) | 1);
+
+			// The DivertHandle wrapper will automatically close the event when destroyed.
+			m_overlappedEventHandle = gcnew DivertHandle(overlappedEvent, false);
+
+			System::Threading::Interlocked::Increment(s_allocationCount);
 		}
 
 		bool DivertAsyncResult::Reset()
 		{
-			// Reset the overlapped object
+			if (m_overlapped == nullptr || m_overlappedEventHandle == nullptr || !m_overlappedEventHandle->Valid)
+			{
+				m_noError = false;
+				m_errorCode = ERROR_INVALID_HANDLE;
+				return false;
+			}
+
+			// Whatever was pending before was never collected.
+			ForgetPending();
+
+			// Reset the overlapped object, keeping the event we own.
+			HANDLE overlappedEvent = m_overlapped->hEvent;
 			memset(m_overlapped, 0, sizeof(*m_overlapped));
+			m_overlapped->hEvent = overlappedEvent;
+
+			ResetEvent(m_overlappedEventHandle->UnmanagedHandle);
 
 			m_noError = true;
 			m_errorCode = 0;
 			m_ioLength = 0;
 
-			// Create the overlapped event handle
-			HANDLE overlappedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+			return true;
+		}
 
-			// If this failed, all is lost. Set m_errorCode to GetLastError
-			if (overlappedEvent == nullptr)
+		void DivertAsyncResult::TrackPending(Native::Statistics* statistics, PWINDIVERT_ADDRESS address, bool send)
+		{
+			ForgetPending();
+
+			if (statistics == nullptr)
 			{
-				m_errorCode = System::Runtime::InteropServices::Marshal::GetLastWin32Error();
-				return false;
-			}			
+				return;
+			}
 
-			// Set the event property on overlapped
-			m_overlapped->hEvent = overlappedEvent;
+			statistics->AddReference();
 
-			// Create a new handle to wrap the newly created overlapped event. The DivertHandle wrapper
-			// will automatically close handles when destroyed.
-			m_overlappedEventHandle = gcnew DivertHandle(overlappedEvent, false);
+			m_statistics = statistics;
+			m_pendingSince = statistics->RecordPending();
+			m_pendingAddress = address;
+			m_pendingSend = send;
+		}
 
-			return true;
+		void DivertAsyncResult::RecordCompletion(int error)
+		{
+			if (m_statistics == nullptr)
+			{
+				return;
+			}
+
+			if (m_pendingSend)
+			{
+				m_statistics->RecordSendCompleted(m_pendingSince, m_pendingAddress, m_ioLength, error);
+			}
+			else
+			{
+				m_statistics->RecordReceiveCompleted(m_pendingSince, m_pendingAddress, m_ioLength, error);
+			}
+
+			m_statistics->Release();
+			m_statistics = nullptr;
+			m_pendingAddress = nullptr;
+		}
+
+		void DivertAsyncResult::ForgetPending()
+		{
+			if (m_statistics == nullptr)
+			{
+				return;
+			}
+
+			m_statistics->RecordCompleted(m_pendingSince);
+			m_statistics->Release();
+			m_statistics = nullptr;
+			m_pendingAddress = nullptr;
 		}
 
 	} /* namespace Net */
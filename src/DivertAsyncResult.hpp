@@ -25,12 +25,16 @@
 #pragma once
 
 #include "DivertHandle.hpp"
+#include "DivertNativeStatistics.hpp"
+#include "DivertNativePacketBufferPool.hpp"
 #include <cstdint>
 
 namespace Divert
 {
 	namespace Net
 	{
+		ref class DivertAsyncResultPool;
+
 		/// <summary>
 		/// This class handles the underlying system objects and calls to provide users with the
 		/// ability to await and attempt to fetch the results of an asynchronous I/O operation
@@ -88,10 +92,87 @@ namespace Divert
 				void set(uint32_t value);
 			}
 
+			/// <summary>
+			/// Waits for the asynchronous operation to complete.
+			/// 
+			/// The OVERLAPPED structure and the event waited on belong to this object for its
+			/// whole lifetime, and are simply reset between operations, so there's no need to
+			/// construct a new DivertAsyncResult for every operation. Reuse them, or better yet,
+			/// rent them from a DivertAsyncResultPool.
+			/// </summary>
+			/// <param name="timeoutInMilliseconds">
+			/// The maximum time to wait for the operation to complete.
+			/// </param>
+			/// <returns>
+			/// True if the operation completed successfully, false otherwise. 
+			/// </returns>
 			bool Get(uint32_t timeoutInMilliseconds);
 
+			/// <summary>
+			/// For results handed out by a DivertAsyncResultPool, a buffer owned by this result that
+			/// was pinned once when the result was created. Pass this buffer to ReceiveAsync or
+			/// SendAsync along with this result and no pinning happens per operation at all. Null
+			/// for results that were not created by a pool.
+			/// </summary>
+			property array<System::Byte>^ PacketBuffer
+			{
+				array<System::Byte>^ get();
+			}
+
+			/// <summary>
+			/// The total number of allocations made by every DivertAsyncResult in the process. This
+			/// counts OVERLAPPED/event setups, which happen once per DivertAsyncResult, and buffer
+			/// pins, which happen whenever an operation is started with a buffer that isn't already
+			/// pinned by the result. In a steady state receive loop using pooled results and their
+			/// PacketBuffer, this value does not change.
+			/// </summary>
+			static property int64_t AllocationCount
+			{
+				int64_t get();
+			}
+
 		internal:
 
+			/// <summary>
+			/// Constructs a result that owns a buffer of the supplied length, pinned for the
+			/// lifetime of the result. Used by DivertAsyncResultPool.
+			/// </summary>
+			/// <param name="bufferLength">
+			/// The length of the buffer to create.
+			/// </param>
+			DivertAsyncResult(uint32_t bufferLength);
+
+			/// <summary>
+			/// Pins the supplied buffer for the duration of an asynchronous operation, returning
+			/// the address of its first element. If the buffer is this result's own PacketBuffer,
+			/// or is the buffer that is already pinned from the previous operation, no new pin is
+			/// made.
+			/// </summary>
+			/// <param name="buffer">
+			/// The buffer the asynchronous operation is going to use.
+			/// </param>
+			/// <returns>
+			/// The address of the first element of the pinned buffer, or null on failure.
+			/// </returns>
+			void* PinBuffer(array<System::Byte>^ buffer);
+
+			/// <summary>
+			/// Holds a leased buffer for the duration of an asynchronous operation, taking a
+			/// reference on both the buffer and its pool, so that neither goes away while the
+			/// driver may still be using the buffer. Native memory needs no pin.
+			/// </summary>
+			/// <param name="receive">
+			/// Whether the operation is a receive, in which case the length received is stored
+			/// with the buffer when the result is collected.
+			/// </param>
+			void HoldLease(Native::PacketBufferPool* pool, uint32_t buffer, bool receive);
+
+			/// <summary>
+			/// Releases any pin taken on a user supplied buffer by PinBuffer, and any lease held
+			/// by HoldLease. The result's own PacketBuffer stays pinned.
+			/// </summary>
+			void ReleaseBuffer();
+
 			/// <summary>
 			/// GCHandle to the pinned buffer to be used for this asynchronous operation.
 			/// </summary>
@@ -143,6 +224,52 @@ namespace Divert
 			/// </returns>
 			bool Reset();
 
+			/// <summary>
+			/// Marks the operation as pending so that its outcome is recorded in the supplied
+			/// statistics when it's collected through Get(). A reference is held on the statistics
+			/// until then.
+			/// </summary>
+			/// <param name="statistics">
+			/// The statistics of the Diversion that started the operation.
+			/// </param>
+			/// <param name="address">
+			/// The address the operation was started with. Only used to pair a receive with the
+			/// reinjection of the same packet, never dereferenced.
+			/// </param>
+			/// <param name="send">
+			/// Whether the operation is a send rather than a receive.
+			/// </param>
+			void TrackPending(Native::Statistics* statistics, PWINDIVERT_ADDRESS address, bool send);
+
+			/// <summary>
+			/// Whether an operation started with this result may still be in flight, with the
+			/// kernel still owning the OVERLAPPED and the buffer.
+			/// </summary>
+			/// <returns>
+			/// True if the OVERLAPPED has been handed to the kernel and not completed yet.
+			/// </returns>
+			bool IsPending();
+
+			/// <summary>
+			/// The pool that created this result. Null for results that were not created by a
+			/// pool.
+			/// </summary>
+			property DivertAsyncResultPool^ Pool
+			{
+				DivertAsyncResultPool^ get();
+				void set(DivertAsyncResultPool^ value);
+			}
+
+			/// <summary>
+			/// Whether the result is sitting in its pool, waiting to be rented. Only changed by
+			/// the pool, under its lock.
+			/// </summary>
+			property bool Pooled
+			{
+				bool get();
+				void set(bool value);
+			}
+
 		private:
 
 			/// <summary>
@@ -188,6 +315,83 @@ namespace Divert
 			/// </summary>
 			System::Runtime::InteropServices::GCHandle m_buffer;
 
+			/// <summary>
+			/// The pool of the leased buffer held for the operation, if any. Holds a reference on
+			/// the pool and on the buffer.
+			/// </summary>
+			Native::PacketBufferPool* m_leasePool = nullptr;
+
+			uint32_t m_leaseBuffer = 0;
+
+			/// <summary>
+			/// Whether the held buffer is being received into.
+			/// </summary>
+			bool m_leaseReceive = false;
+
+			/// <summary>
+			/// Buffer owned by pooled results. Null otherwise.
+			/// </summary>
+			array<System::Byte>^ m_ownedBuffer;
+
+			/// <summary>
+			/// Pin on m_ownedBuffer, held for the lifetime of this object.
+			/// </summary>
+			System::Runtime::InteropServices::GCHandle m_ownedBufferPin;
+
+			/// <summary>
+			/// Where the pending operation is recorded once collected, if it's being tracked. Holds
+			/// a reference.
+			/// </summary>
+			Native::Statistics* m_statistics = nullptr;
+
+			/// <summary>
+			/// When the tracked operation went pending, as returned by RecordPending().
+			/// </summary>
+			uint64_t m_pendingSince = 0;
+
+			/// <summary>
+			/// The address the tracked operation was started with.
+			/// </summary>
+			PWINDIVERT_ADDRESS m_pendingAddress = nullptr;
+
+			/// <summary>
+			/// Whether the tracked operation is a send.
+			/// </summary>
+			bool m_pendingSend = false;
+
+			/// <summary>
+			/// Backing field for Pool.
+			/// </summary>
+			DivertAsyncResultPool^ m_pool;
+
+			/// <summary>
+			/// Backing field for Pooled.
+			/// </summary>
+			bool m_pooled = false;
+
+			/// <summary>
+			/// Records the outcome of the tracked operation, if any, and lets go of the statistics.
+			/// </summary>
+			/// <param name="error">
+			/// Zero if the operation succeeded with m_ioLength bytes, the Win32 error otherwise.
+			/// </param>
+			void RecordCompletion(int error);
+
+			/// <summary>
+			/// Stops tracking an operation whose outcome will never be collected.
+			/// </summary>
+			void ForgetPending();
+
+			/// <summary>
+			/// Lets go of the lease held by HoldLease, if any.
+			/// </summary>
+			void ReleaseLease();
+
+			/// <summary>
+			/// Backing field for AllocationCount.
+			/// </summary>
+			static int64_t s_allocationCount = 0;
+
 			/// <summary>
 			/// Some specialized initiation is required, regardless of constructor.
 			/// </summary>
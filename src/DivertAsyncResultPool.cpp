@@ -0,0 +1,151 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertAsyncResultPool.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		DivertAsyncResultPool::DivertAsyncResultPool(uint32_t size, uint32_t bufferLength)
+		{
+			System::Exception^ e = nullptr;
+
+			if (size == 0 || bufferLength == 0 || bufferLength > static_cast<uint32_t>(System::Int32::MaxValue))
+			{
+				e = gcnew System::ArgumentException(u8"In DivertAsyncResultPool::DivertAsyncResultPool(uint32_t, uint32_t) - Size and buffer length must both be greater than zero, and the buffer length must fit in a managed array.");
+				throw e;
+			}
+
+			m_bufferLength = bufferLength;
+			m_results = gcnew System::Collections::Generic::Stack<DivertAsyncResult^>(static_cast<int>(size));
+
+			for (uint32_t i = 0; i < size; ++i)
+			{
+				DivertAsyncResult^ result = gcnew DivertAsyncResult(bufferLength);
+				result->Pool = this;
+				result->Pooled = true;
+				m_results->Push(result);
+			}
+
+			m_size = size;
+		}
+
+		DivertAsyncResult^ DivertAsyncResultPool::Rent()
+		{
+			System::Threading::Monitor::Enter(m_results);
+			try
+			{
+				if (m_results->Count > 0)
+				{
+					DivertAsyncResult^ result = m_results->Pop();
+					result->Pooled = false;
+					return result;
+				}
+
+				++m_size;
+				++m_allocations;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(m_results);
+			}
+
+			// Create outside the lock, there's no need to hold up other threads for this.
+			DivertAsyncResult^ result = gcnew DivertAsyncResult(m_bufferLength);
+			result->Pool = this;
+			return result;
+		}
+
+		void DivertAsyncResultPool::Return(DivertAsyncResult^ result)
+		{
+			System::Exception^ e = nullptr;
+
+			if (result == nullptr || result->Pool != this)
+			{
+				e = gcnew System::ArgumentException(u8"In DivertAsyncResultPool::Return(DivertAsyncResult^) - Supplied result was not created by this pool.");
+				throw e;
+			}
+
+			// The kernel still owns the OVERLAPPED and the buffer. Handing them to the next renter
+			// would have its Reset() clear the one, and the completion write into the other.
+			if (result->IsPending())
+			{
+				e = gcnew System::InvalidOperationException(u8"In DivertAsyncResultPool::Return(DivertAsyncResult^) - Supplied result has an operation in flight. Collect it with Get(uint32_t) first.");
+				throw e;
+			}
+
+			System::Threading::Monitor::Enter(m_results);
+			try
+			{
+				// Pushed twice, two renters would share one OVERLAPPED.
+				if (result->Pooled)
+				{
+					e = gcnew System::InvalidOperationException(u8"In DivertAsyncResultPool::Return(DivertAsyncResult^) - Supplied result has already been returned.");
+					throw e;
+				}
+
+				// Drop any pin the caller may have taken on a buffer of their own.
+				result->ReleaseBuffer();
+
+				result->Pooled = true;
+				m_results->Push(result);
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(m_results);
+			}
+		}
+
+		uint32_t DivertAsyncResultPool::Available::get()
+		{
+			System::Threading::Monitor::Enter(m_results);
+			try
+			{
+				return static_cast<uint32_t>(m_results->Count);
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(m_results);
+			}
+		}
+
+		uint32_t DivertAsyncResultPool::Size::get()
+		{
+			return m_size;
+		}
+
+		uint32_t DivertAsyncResultPool::Allocations::get()
+		{
+			return m_allocations;
+		}
+
+		uint32_t DivertAsyncResultPool::BufferLength::get()
+		{
+			return m_bufferLength;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,129 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAsyncResult.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// A pool of DivertAsyncResult objects, each owning an OVERLAPPED structure, an event and
+		/// a PacketBuffer that are created and pinned once, when the result is created. Renting a
+		/// result, passing its PacketBuffer to ReceiveAsync or SendAsync, and returning it to the
+		/// pool costs no allocations, no pins and no kernel objects. The pool is safe to use from
+		/// multiple threads.
+		/// </summary>
+		public ref class DivertAsyncResultPool
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a new pool and fills it with results.
+			/// </summary>
+			/// <param name="size">
+			/// The number of results to create up front. Must be greater than zero.
+			/// </param>
+			/// <param name="bufferLength">
+			/// The length of the PacketBuffer owned by each result. Must be greater than zero.
+			/// </param>
+			DivertAsyncResultPool(uint32_t size, uint32_t bufferLength);
+
+			/// <summary>
+			/// Takes a result from the pool. If the pool is empty, a new result is created, which
+			/// counts toward Allocations. A result should be returned once its operation has been
+			/// collected with DivertAsyncResult.Get(uint timeout), or has completed immediately.
+			/// </summary>
+			/// <returns>
+			/// A result ready to be used for a new asynchronous operation.
+			/// </returns>
+			DivertAsyncResult^ Rent();
+
+			/// <summary>
+			/// Hands a result back to the pool so that it can be rented again.
+			/// </summary>
+			/// <param name="result">
+			/// The result to return. Must not have an operation still in flight.
+			/// </param>
+			/// <exception cref="System::ArgumentException">
+			/// The result wasn't created by this pool.
+			/// </exception>
+			/// <exception cref="System::InvalidOperationException">
+			/// The result's operation hasn't completed, or the result is already in the pool.
+			/// </exception>
+			void Return(DivertAsyncResult^ result);
+
+			/// <summary>
+			/// The number of results currently in the pool, waiting to be rented.
+			/// </summary>
+			property uint32_t Available
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The total number of results this pool has created, including any created because
+			/// Rent() was called on an empty pool.
+			/// </summary>
+			property uint32_t Size
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The number of results created after construction because the pool ran dry. If this
+			/// grows in a steady state loop, the pool is too small.
+			/// </summary>
+			property uint32_t Allocations
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The length of the PacketBuffer owned by each result in this pool.
+			/// </summary>
+			property uint32_t BufferLength
+			{
+				uint32_t get();
+			}
+
+		private:
+
+			System::Collections::Generic::Stack<DivertAsyncResult^>^ m_results;
+
+			uint32_t m_size = 0;
+
+			uint32_t m_allocations = 0;
+
+			uint32_t m_bufferLength = 0;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,444 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertCompiledFilter.hpp"
+#include <string>
+#include <vcclr.h>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			const uint32_t DefaultCacheCapacity = 256;
+
+			const int LayerCount = 2;
+		}
+
+		static CompiledFilter::CompiledFilter()
+		{
+			s_lock = gcnew System::Object();
+			s_caches = gcnew array<System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^>(LayerCount);
+
+			for (int i = 0; i < LayerCount; ++i)
+			{
+				s_caches[i] = gcnew System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>(System::StringComparer::Ordinal);
+			}
+
+			s_cacheCapacity = DefaultCacheCapacity;
+		}
+
+		CompiledFilter::CompiledFilter(System::String^ filter, DivertLayer layer, Native::Filter* compiled)
+		{
+			m_filter = filter;
+			m_layer = layer;
+			m_compiled = compiled;
+		}
+
+		CompiledFilter::~CompiledFilter()
+		{
+			this->!CompiledFilter();
+		}
+
+		CompiledFilter::!CompiledFilter()
+		{
+			if (m_compiled != nullptr)
+			{
+				delete m_compiled;
+				m_compiled = nullptr;
+			}
+		}
+
+		CompiledFilter^ CompiledFilter::Compile(System::String^ filter, DivertLayer layer)
+		{
+			System::Exception^ e = nullptr;
+			System::String^ errorDetails = nullptr;
+
+			CompiledFilter^ compiled = TryCompile(filter, layer, errorDetails);
+
+			if (compiled == nullptr)
+			{
+				e = gcnew System::ArgumentException(u8"In CompiledFilter::Compile(System::String^, DivertLayer) - " + errorDetails, u8"filter");
+				throw e;
+			}
+
+			return compiled;
+		}
+
+		CompiledFilter^ CompiledFilter::GetCached(System::String^ filter, DivertLayer layer)
+		{
+			System::Exception^ e = nullptr;
+			System::String^ errorDetails = nullptr;
+
+			CompiledFilter^ compiled = TryGetCached(filter, layer, errorDetails);
+
+			if (compiled == nullptr)
+			{
+				e = gcnew System::ArgumentException(u8"In CompiledFilter::GetCached(System::String^, DivertLayer) - " + errorDetails, u8"filter");
+				throw e;
+			}
+
+			return compiled;
+		}
+
+		CompiledFilter^ CompiledFilter::TryGetCached(System::String^ filter, DivertLayer layer, System::String^% errorDetails)
+		{
+			System::Exception^ e = nullptr;
+
+			if (layer != DivertLayer::Network && layer != DivertLayer::NetworkForward)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"layer", u8"In CompiledFilter::TryGetCached(System::String^, DivertLayer, System::String^%) - Unknown layer.");
+				throw e;
+			}
+
+			if (filter == nullptr)
+			{
+				errorDetails = u8"Supplied filter string is null, empty or whitespace.";
+				return nullptr;
+			}
+
+			System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache = s_caches[static_cast<int>(layer)];
+
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				CompiledFilter^ compiled = nullptr;
+
+				// A cached filter that someone disposed is compiled again.
+				if (cache->TryGetValue(filter, compiled) && compiled->m_compiled != nullptr)
+				{
+					return compiled;
+				}
+
+				compiled = TryCompile(filter, layer, errorDetails);
+
+				if (compiled == nullptr)
+				{
+					return nullptr;
+				}
+
+				cache->Remove(filter);
+
+				if (static_cast<uint32_t>(cache->Count) >= s_cacheCapacity)
+				{
+					MakeRoom(cache);
+				}
+
+				cache->Add(filter, compiled);
+				return compiled;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		CompiledFilter^ CompiledFilter::TryCompile(System::String^ filter, DivertLayer layer, System::String^% errorDetails)
+		{
+			if (System::String::IsNullOrWhiteSpace(filter))
+			{
+				errorDetails = u8"Supplied filter string is null, empty or whitespace.";
+				return nullptr;
+			}
+
+			// The filter language is plain ASCII. Anything else is replaced with a character that
+			// can't appear in a filter, so that it's reported where it stands.
+			std::string text(static_cast<size_t>(filter->Length), '\0');
+
+			{
+				pin_ptr<const wchar_t> chars = PtrToStringChars(filter);
+
+				for (int i = 0; i < filter->Length; ++i)
+				{
+					text[i] = chars[i] < 0x80 ? static_cast<char>(chars[i]) : '\x01';
+				}
+			}
+
+			Native::Filter* compiled = new Native::Filter();
+
+			const char* errorMessage = nullptr;
+			uint32_t errorPosition = 0;
+
+			if (!compiled->Compile(text.data(), text.size(), static_cast<Native::FilterLayer>(layer), &errorMessage, &errorPosition))
+			{
+				delete compiled;
+				errorDetails = System::String::Format(u8"{0} at position {1}.", gcnew System::String(errorMessage), errorPosition);
+				return nullptr;
+			}
+
+			return gcnew CompiledFilter(filter, layer, compiled);
+		}
+
+		void CompiledFilter::MakeRoom(System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache)
+		{
+			// Drop an eighth of the cache, so that a full cache isn't swept again on every miss.
+			// The dropped filters are left for the GC, since callers may still hold them.
+			System::Collections::Generic::List<System::String^>^ victims = gcnew System::Collections::Generic::List<System::String^>();
+
+			const int toEvict = System::Math::Max(1, cache->Count / 8);
+
+			for each (System::String^ filter in cache->Keys)
+			{
+				if (victims->Count == toEvict)
+				{
+					break;
+				}
+
+				victims->Add(filter);
+			}
+
+			for each (System::String^ filter in victims)
+			{
+				cache->Remove(filter);
+			}
+		}
+
+		void CompiledFilter::ClearCache()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				for each (System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache in s_caches)
+				{
+					cache->Clear();
+				}
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		uint32_t CompiledFilter::CacheCapacity::get()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				return s_cacheCapacity;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		void CompiledFilter::CacheCapacity::set(uint32_t value)
+		{
+			System::Exception^ e = nullptr;
+
+			if (value == 0)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"value", u8"In CompiledFilter::CacheCapacity::set(uint32_t) - Capacity must be greater than zero.");
+				throw e;
+			}
+
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				s_cacheCapacity = value;
+
+				for each (System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache in s_caches)
+				{
+					while (static_cast<uint32_t>(cache->Count) > s_cacheCapacity)
+					{
+						MakeRoom(cache);
+					}
+				}
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		uint32_t CompiledFilter::CacheCount::get()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				uint32_t count = 0;
+
+				for each (System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache in s_caches)
+				{
+					count += static_cast<uint32_t>(cache->Count);
+				}
+
+				return count;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		System::String^ CompiledFilter::Filter::get()
+		{
+			return m_filter;
+		}
+
+		DivertLayer CompiledFilter::Layer::get()
+		{
+			return m_layer;
+		}
+
+		uint32_t CompiledFilter::InstructionCount::get()
+		{
+			return UnmanagedFilter->InstructionCount();
+		}
+
+		bool CompiledFilter::Specialized::get()
+		{
+			return UnmanagedFilter->Backend() != Native::FilterBackend::Interpreter;
+		}
+
+		void CompiledFilter::Specialized::set(bool value)
+		{
+			if (!value)
+			{
+				UnmanagedFilter->SetBackend(Native::FilterBackend::Interpreter);
+			}
+			else if (UnmanagedFilter->Backend() == Native::FilterBackend::Interpreter)
+			{
+				UnmanagedFilter->SetBackend(Native::FilterBackend::Specialized);
+			}
+		}
+
+		bool CompiledFilter::Vectorized::get()
+		{
+			return UnmanagedFilter->Backend() == Native::FilterBackend::Vectorized;
+		}
+
+		void CompiledFilter::Vectorized::set(bool value)
+		{
+			if (value)
+			{
+				UnmanagedFilter->SetBackend(Native::FilterBackend::Vectorized);
+			}
+			else if (UnmanagedFilter->Backend() == Native::FilterBackend::Vectorized)
+			{
+				UnmanagedFilter->SetBackend(Native::FilterBackend::Specialized);
+			}
+		}
+
+		Native::Filter* CompiledFilter::UnmanagedFilter::get()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_compiled == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"CompiledFilter", u8"In CompiledFilter::UnmanagedFilter::get() - Filter has been disposed.");
+				throw e;
+			}
+
+			return m_compiled;
+		}
+
+		bool CompiledFilter::Evaluate(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address)
+		{
+			System::Exception^ e = nullptr;
+
+			if (packetBuffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"packetBuffer", u8"In CompiledFilter::Evaluate(array<System::Byte>^, uint32_t, Address^) - Supplied buffer is null.");
+				throw e;
+			}
+
+			if (packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In CompiledFilter::Evaluate(array<System::Byte>^, uint32_t, Address^) - Packet length exceeds the length of the buffer.");
+				throw e;
+			}
+
+			Native::Filter* compiled = UnmanagedFilter;
+			PWINDIVERT_ADDRESS unmanagedAddress = address == nullptr ? nullptr : address->UnmanagedAddress;
+			bool result = false;
+
+			if (packetBuffer->Length == 0)
+			{
+				result = compiled->Evaluate(nullptr, 0, unmanagedAddress);
+			}
+			else
+			{
+				pin_ptr<System::Byte> byteArray = &packetBuffer[0];
+				result = compiled->Evaluate(byteArray, packetLength, unmanagedAddress);
+			}
+
+			// The finalizer mustn't free the program while it's still being evaluated.
+			System::GC::KeepAlive(this);
+			System::GC::KeepAlive(address);
+
+			return result;
+		}
+
+		uint32_t CompiledFilter::Evaluate(PacketBatch^ batch, array<bool>^ results)
+		{
+			System::Exception^ e = nullptr;
+
+			if (batch == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"batch", u8"In CompiledFilter::Evaluate(PacketBatch^, array<bool>^) - Supplied batch is null.");
+				throw e;
+			}
+
+			if (results == nullptr || static_cast<uint32_t>(results->Length) < batch->Count)
+			{
+				e = gcnew System::ArgumentException(u8"In CompiledFilter::Evaluate(PacketBatch^, array<bool>^) - Results must hold at least one element per packet in the batch.", u8"results");
+				throw e;
+			}
+
+			Native::Filter* compiled = UnmanagedFilter;
+
+			if (batch->Count == 0)
+			{
+				return 0;
+			}
+
+			// The batch's own storage is pinned for its lifetime, only the results need pinning.
+			pin_ptr<bool> resultArray = &results[0];
+
+			const uint32_t matches = compiled->EvaluateBatch(
+				batch->UnmanagedBuffer,
+				static_cast<uint64_t>(batch->Buffer->Length),
+				batch->UnmanagedOffsets,
+				batch->UnmanagedLengths,
+				batch->UnmanagedAddresses,
+				batch->Count,
+				reinterpret_cast<uint8_t*>(resultArray)
+				);
+
+			System::GC::KeepAlive(this);
+			System::GC::KeepAlive(batch);
+
+			return matches;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,268 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Diversion.hpp"
+#include "DivertNativeFilter.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// A WinDivert filter string parsed once into an in-memory decision program, so that
+		/// evaluating it against a packet costs neither parsing, marshalling nor a call into
+		/// WinDivert. Evaluation doesn't modify the filter, so one instance can be shared by any
+		/// number of threads.
+		/// 
+		/// Compiled filters are also cached by filter string and layer, see GetCached(...). The
+		/// cache is what Diversion.EvaluateFilter and Diversion.ValidateFilter go through.
+		/// </summary>
+		public ref class CompiledFilter sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Compiles a filter string.
+			/// </summary>
+			/// <param name="filter">
+			/// The filter string, in the WinDivert filter language.
+			/// </param>
+			/// <param name="layer">
+			/// The layer the filter will be evaluated at.
+			/// </param>
+			/// <returns>
+			/// The compiled filter.
+			/// </returns>
+			/// <exception cref="System::ArgumentException">
+			/// The filter string is null, empty or invalid. The message says what is wrong with it,
+			/// and where.
+			/// </exception>
+			static CompiledFilter^ Compile(System::String^ filter, DivertLayer layer);
+
+			/// <summary>
+			/// Gets the compiled form of a filter string from the cache, compiling and caching it
+			/// first if needed. The returned filter is shared with every other caller asking for
+			/// the same string and layer.
+			/// </summary>
+			/// <param name="filter">
+			/// The filter string, in the WinDivert filter language.
+			/// </param>
+			/// <param name="layer">
+			/// The layer the filter will be evaluated at.
+			/// </param>
+			/// <returns>
+			/// The compiled filter.
+			/// </returns>
+			/// <exception cref="System::ArgumentException">
+			/// The filter string is null, empty or invalid.
+			/// </exception>
+			static CompiledFilter^ GetCached(System::String^ filter, DivertLayer layer);
+
+			/// <summary>
+			/// Empties the cache. Filters already handed out remain usable.
+			/// </summary>
+			static void ClearCache();
+
+			/// <summary>
+			/// The maximum number of filters cached per layer. Must be greater than zero.
+			/// </summary>
+			static property uint32_t CacheCapacity
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// The number of filters currently cached, over all layers.
+			/// </summary>
+			static property uint32_t CacheCount
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~CompiledFilter();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!CompiledFilter();
+
+			/// <summary>
+			/// The filter string this was compiled from.
+			/// </summary>
+			property System::String^ Filter
+			{
+				System::String^ get();
+			}
+
+			/// <summary>
+			/// The layer this was compiled for.
+			/// </summary>
+			property DivertLayer Layer
+			{
+				DivertLayer get();
+			}
+
+			/// <summary>
+			/// The number of tests in the compiled program. Constant parts of the filter compile
+			/// away, so a filter of "true" has none.
+			/// </summary>
+			property uint32_t InstructionCount
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Whether the filter runs on the specialized backend, where each test is bound to
+			/// code written for its field and comparison and runs of == tests on one field are
+			/// merged into a single table lookup. True by default. Setting it to false falls back
+			/// to the interpreter, which gives the same results. Not to be changed while the filter
+			/// is being evaluated on another thread.
+			/// </summary>
+			property bool Specialized
+			{
+				bool get();
+				void set(bool value);
+			}
+
+			/// <summary>
+			/// Whether batches are evaluated on the vectorized backend, which classifies 64 packets
+			/// at a time: the fields the filter tests are copied out into one array per field,
+			/// each test runs over a whole array with SIMD compares, and the results are combined
+			/// as bitmasks. Single packets are still evaluated on the specialized backend, and
+			/// filters that test IPv6 addresses run entirely on it. False by default. Setting it
+			/// to true also sets Specialized. Not to be changed while the filter is being
+			/// evaluated on another thread.
+			/// </summary>
+			property bool Vectorized
+			{
+				bool get();
+				void set(bool value);
+			}
+
+			/// <summary>
+			/// Evaluates the filter against a packet.
+			/// </summary>
+			/// <param name="packetBuffer">
+			/// The packet data to check the filter against.
+			/// </param>
+			/// <param name="packetLength">
+			/// The length of valid packet data inside the supplied buffer.
+			/// </param>
+			/// <param name="address">
+			/// The address information for the supplied packet. May be null, in which case tests
+			/// of inbound, outbound, ifIdx and subIfIdx fail.
+			/// </param>
+			/// <returns>
+			/// True if the filter matches the packet, false otherwise.
+			/// </returns>
+			bool Evaluate(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address);
+
+			/// <summary>
+			/// Evaluates the filter against every packet in a batch with a single native call, for
+			/// classifying received or captured traffic in bulk.
+			/// </summary>
+			/// <param name="batch">
+			/// The packets to evaluate, with their addresses.
+			/// </param>
+			/// <param name="results">
+			/// Receives, for each packet in the batch, whether it matches. Must hold at least
+			/// PacketBatch.Count elements.
+			/// </param>
+			/// <returns>
+			/// The number of packets that match.
+			/// </returns>
+			uint32_t Evaluate(PacketBatch^ batch, array<bool>^ results);
+
+		internal:
+
+			/// <summary>
+			/// GetCached(...) for callers that report invalid filters rather than throw.
+			/// </summary>
+			/// <param name="errorDetails">
+			/// If the filter is invalid, what is wrong with it and where.
+			/// </param>
+			/// <returns>
+			/// The compiled filter, or nullptr if the filter string is invalid.
+			/// </returns>
+			static CompiledFilter^ TryGetCached(System::String^ filter, DivertLayer layer, System::String^% errorDetails);
+
+			/// <summary>
+			/// The compiled program, for native code to evaluate directly.
+			/// </summary>
+			property Native::Filter* UnmanagedFilter
+			{
+				Native::Filter* get();
+			}
+
+		private:
+
+			CompiledFilter(System::String^ filter, DivertLayer layer, Native::Filter* compiled);
+
+			static CompiledFilter();
+
+			/// <summary>
+			/// Compiles a filter string without touching the cache.
+			/// </summary>
+			/// <returns>
+			/// The compiled filter, or nullptr with errorDetails set if the filter is invalid.
+			/// </returns>
+			static CompiledFilter^ TryCompile(System::String^ filter, DivertLayer layer, System::String^% errorDetails);
+
+			/// <summary>
+			/// Makes room for one more entry in a layer's cache. Must hold s_lock.
+			/// </summary>
+			static void MakeRoom(System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^ cache);
+
+			static System::Object^ s_lock;
+
+			/// <summary>
+			/// One cache per layer, indexed by DivertLayer.
+			/// </summary>
+			static array<System::Collections::Generic::Dictionary<System::String^, CompiledFilter^>^>^ s_caches;
+
+			static uint32_t s_cacheCapacity;
+
+			System::String^ m_filter;
+
+			DivertLayer m_layer;
+
+			/// <summary>
+			/// Exclusively owned by this object.
+			/// </summary>
+			Native::Filter* m_compiled = nullptr;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,369 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertCompletionQueue.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				/// <summary>
+				/// Key of the control messages that tell dispatcher workers to exit.
+				/// </summary>
+				const uintptr_t ShutdownKey = static_cast<uintptr_t>(-1);
+
+				const uint32_t WaitForever = UINT32_MAX;
+
+				/// <summary>
+				/// CompletionQueue built on a deque guarded by a mutex and condition variable.
+				/// </summary>
+				class PortableCompletionQueue : public CompletionQueue
+				{
+
+				public:
+
+					virtual bool Associate(void* /* handle */, uintptr_t /* key */) override
+					{
+						SetNativeLastError(NotSupportedError);
+						return false;
+					}
+
+					virtual bool Post(const Completion& completion) override
+					{
+						{
+							std::lock_guard<std::mutex> lock(m_mutex);
+							m_completions.push_back(completion);
+						}
+
+						m_ready.notify_one();
+						return true;
+					}
+
+					virtual bool Dequeue(Completion* completion, uint32_t timeoutInMilliseconds) override
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+
+						if (timeoutInMilliseconds == WaitForever)
+						{
+							m_ready.wait(lock, [this] { return !m_completions.empty(); });
+						}
+						else if (!m_ready.wait_for(lock, std::chrono::milliseconds(timeoutInMilliseconds), [this] { return !m_completions.empty(); }))
+						{
+							return false;
+						}
+
+						*completion = m_completions.front();
+						m_completions.pop_front();
+						return true;
+					}
+
+					virtual bool IsKernelQueue() const override
+					{
+						return false;
+					}
+
+				private:
+
+					std::mutex m_mutex;
+
+					std::condition_variable m_ready;
+
+					std::deque<Completion> m_completions;
+				};
+
+				#ifdef _WIN32
+
+				/// <summary>
+				/// CompletionQueue backed by an I/O completion port.
+				/// </summary>
+				class IocpCompletionQueue : public CompletionQueue
+				{
+
+				public:
+
+					IocpCompletionQueue(HANDLE port) : m_port(port)
+					{
+
+					}
+
+					virtual ~IocpCompletionQueue()
+					{
+						CloseHandle(m_port);
+					}
+
+					virtual bool Associate(void* handle, uintptr_t key) override
+					{
+						return CreateIoCompletionPort(handle, m_port, static_cast<ULONG_PTR>(key), 0) == m_port;
+					}
+
+					virtual bool Post(const Completion& completion) override
+					{
+						// A posted completion has no IO_STATUS_BLOCK behind it, so the error travels
+						// in the OVERLAPPED's Internal member, the same place the kernel keeps it.
+						if (completion.Overlapped != nullptr)
+						{
+							completion.Overlapped->Internal = static_cast<ULONG_PTR>(completion.Error);
+						}
+
+						return PostQueuedCompletionStatus(m_port, completion.Bytes, static_cast<ULONG_PTR>(completion.Key), completion.Overlapped) == TRUE;
+					}
+
+					virtual bool Dequeue(Completion* completion, uint32_t timeoutInMilliseconds) override
+					{
+						DWORD bytes = 0;
+						ULONG_PTR key = 0;
+						LPOVERLAPPED overlapped = nullptr;
+
+						BOOL succeeded = GetQueuedCompletionStatus(m_port, &bytes, &key, &overlapped, static_cast<DWORD>(timeoutInMilliseconds));
+
+						if (overlapped == nullptr && !succeeded)
+						{
+							// Timed out, or the port itself is broken. Nothing was dequeued.
+							return false;
+						}
+
+						completion->Key = static_cast<uintptr_t>(key);
+						completion->Overlapped = overlapped;
+						completion->Bytes = static_cast<uint32_t>(bytes);
+						completion->Error = 0;
+
+						if (!succeeded)
+						{
+							completion->Error = static_cast<int32_t>(GetLastError());
+						}
+						else if (overlapped != nullptr && overlapped->Internal != 0)
+						{
+							// Successful kernel completions leave STATUS_SUCCESS, zero, in Internal.
+							// Posted completions carry their error there, see Post.
+							completion->Error = static_cast<int32_t>(overlapped->Internal);
+						}
+
+						return true;
+					}
+
+					virtual bool IsKernelQueue() const override
+					{
+						return true;
+					}
+
+				private:
+
+					HANDLE m_port;
+				};
+
+				#endif // _WIN32
+			}
+
+			CompletionQueue* CompletionQueue::Create(uint32_t concurrency)
+			{
+				#ifdef _WIN32
+				HANDLE port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, concurrency);
+
+				if (port == nullptr)
+				{
+					return nullptr;
+				}
+
+				return new IocpCompletionQueue(port);
+				#else
+				(void)concurrency;
+				return CreatePortable();
+				#endif
+			}
+
+			CompletionQueue* CompletionQueue::CreatePortable()
+			{
+				return new PortableCompletionQueue();
+			}
+
+			CompletionQueue::~CompletionQueue()
+			{
+
+			}
+
+			struct CompletionDispatcher::Workers
+			{
+				std::vector<std::thread> Threads;
+
+				std::mutex Mutex;
+			};
+
+			CompletionDispatcher::CompletionDispatcher(CompletionQueue* queue) : m_queue(queue), m_workers(new Workers())
+			{
+
+			}
+
+			CompletionDispatcher::~CompletionDispatcher()
+			{
+				Stop();
+
+				delete m_workers;
+				delete m_queue;
+			}
+
+			CompletionDispatcher* CompletionDispatcher::Shared()
+			{
+				static CompletionDispatcher* shared = []() -> CompletionDispatcher*
+				{
+					CompletionQueue* queue = CompletionQueue::Create(0);
+
+					if (queue == nullptr)
+					{
+						return nullptr;
+					}
+
+					CompletionDispatcher* dispatcher = new CompletionDispatcher(queue);
+					uint32_t workers = std::max(2u, std::min(4u, std::thread::hardware_concurrency()));
+
+					if (!dispatcher->Start(workers))
+					{
+						delete dispatcher;
+						return nullptr;
+					}
+
+					return dispatcher;
+				}();
+
+				return shared;
+			}
+
+			bool CompletionDispatcher::Start(uint32_t workerCount)
+			{
+				if (workerCount == 0 || m_queue == nullptr)
+				{
+					return false;
+				}
+
+				std::lock_guard<std::mutex> lock(m_workers->Mutex);
+
+				if (!m_workers->Threads.empty())
+				{
+					return true;
+				}
+
+				CompletionQueue* queue = m_queue;
+				const uintptr_t key = Key();
+
+				for (uint32_t i = 0; i < workerCount; ++i)
+				{
+					m_workers->Threads.emplace_back([queue, key]()
+					{
+						Completion completion;
+
+						for (;;)
+						{
+							if (!queue->Dequeue(&completion, WaitForever))
+							{
+								// Only a broken queue fails an infinite wait.
+								return;
+							}
+
+							if (completion.Overlapped == nullptr)
+							{
+								if (completion.Key == ShutdownKey)
+								{
+									return;
+								}
+
+								continue;
+							}
+
+							// An OVERLAPPED that isn't one of ours, from a handle bound with some
+							// other key. Whoever issued it isn't waiting on this queue, and
+							// treating it as an IoOperation would call through garbage.
+							if (completion.Key != key)
+							{
+								continue;
+							}
+
+							IoOperation* operation = reinterpret_cast<IoOperation*>(completion.Overlapped);
+							operation->Complete(operation, completion.Bytes, completion.Error);
+						}
+					});
+				}
+
+				return true;
+			}
+
+			void CompletionDispatcher::Stop()
+			{
+				std::lock_guard<std::mutex> lock(m_workers->Mutex);
+
+				if (m_workers->Threads.empty())
+				{
+					return;
+				}
+
+				// One shutdown message per worker. Each worker exits on the first one it sees, so
+				// every worker gets exactly one.
+				for (size_t i = 0; i < m_workers->Threads.size(); ++i)
+				{
+					Completion shutdown = { ShutdownKey, nullptr, 0, 0 };
+					m_queue->Post(shutdown);
+				}
+
+				for (std::thread& worker : m_workers->Threads)
+				{
+					worker.join();
+				}
+
+				m_workers->Threads.clear();
+			}
+
+			CompletionQueue* CompletionDispatcher::Queue() const
+			{
+				return m_queue;
+			}
+
+			uintptr_t CompletionDispatcher::Key() const
+			{
+				return reinterpret_cast<uintptr_t>(this);
+			}
+
+			uint32_t CompletionDispatcher::WorkerCount() const
+			{
+				std::lock_guard<std::mutex> lock(m_workers->Mutex);
+				return static_cast<uint32_t>(m_workers->Threads.size());
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,251 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// A single completed (or failed) overlapped operation, as pulled off a CompletionQueue.
+			/// </summary>
+			struct Completion
+			{
+				/// <summary>
+				/// The key the completing handle was associated with, or the key supplied to Post.
+				/// </summary>
+				uintptr_t Key;
+
+				/// <summary>
+				/// The OVERLAPPED the operation was started with. Null only for control messages,
+				/// such as the shutdown notifications posted by CompletionDispatcher.
+				/// </summary>
+				LPOVERLAPPED Overlapped;
+
+				/// <summary>
+				/// The number of bytes transferred.
+				/// </summary>
+				uint32_t Bytes;
+
+				/// <summary>
+				/// Zero if the operation succeeded, otherwise the error it failed with.
+				/// </summary>
+				int32_t Error;
+			};
+
+			/// <summary>
+			/// A queue of completed overlapped operations, shared by any number of waiting threads.
+			/// On Windows this is an I/O completion port, so that completions of overlapped reads
+			/// and writes on associated handles are queued by the kernel with no thread waiting per
+			/// operation. A portable implementation, built on a mutex and condition variable, is
+			/// also provided so the engines built on top can be exercised anywhere against
+			/// simulated packet sources, which Post their completions by hand.
+			/// </summary>
+			class CompletionQueue
+			{
+
+			public:
+
+				/// <summary>
+				/// Creates the best queue for the platform, an I/O completion port on Windows and
+				/// the portable queue everywhere else.
+				/// </summary>
+				/// <param name="concurrency">
+				/// The number of threads the kernel should allow to run completions concurrently.
+				/// Zero lets the system decide. Ignored by the portable queue.
+				/// </param>
+				/// <returns>
+				/// A new queue owned by the caller, or null on failure, in which case the thread's
+				/// last error is set to the reason.
+				/// </returns>
+				static CompletionQueue* Create(uint32_t concurrency);
+
+				/// <summary>
+				/// Creates the portable queue, regardless of platform.
+				/// </summary>
+				static CompletionQueue* CreatePortable();
+
+				virtual ~CompletionQueue();
+
+				/// <summary>
+				/// Associates an OS handle with this queue, so that every overlapped operation
+				/// started on the handle completes into this queue.
+				/// </summary>
+				/// <returns>
+				/// True on success. The portable queue has no kernel side and always fails with
+				/// NotSupportedError.
+				/// </returns>
+				virtual bool Associate(void* handle, uintptr_t key) = 0;
+
+				/// <summary>
+				/// Queues a completion by hand.
+				/// </summary>
+				virtual bool Post(const Completion& completion) = 0;
+
+				/// <summary>
+				/// Waits for the next completion.
+				/// </summary>
+				/// <param name="completion">
+				/// Receives the completion.
+				/// </param>
+				/// <param name="timeoutInMilliseconds">
+				/// The maximum time to wait. UINT32_MAX waits forever.
+				/// </param>
+				/// <returns>
+				/// True if a completion was dequeued, including completions of failed operations,
+				/// whose Error member is set. False if the wait timed out or failed.
+				/// </returns>
+				virtual bool Dequeue(Completion* completion, uint32_t timeoutInMilliseconds) = 0;
+
+				/// <summary>
+				/// Whether this queue is backed by the kernel, and so can be used with Associate.
+				/// </summary>
+				virtual bool IsKernelQueue() const = 0;
+
+			};
+
+			/// <summary>
+			/// An overlapped operation that knows how to complete itself. Anything that is started
+			/// with an IoOperation's Overlapped member, on a handle associated with a
+			/// CompletionDispatcher's queue under the dispatcher's Key(), is completed by one of the
+			/// dispatcher's workers calling Complete. Every other overlapped call on such a handle
+			/// must tag the low bit of its event, so that it never reaches the queue. Overlapped must stay the first member, as completions are mapped back to
+			/// their operation through the OVERLAPPED pointer.
+			/// </summary>
+			struct IoOperation
+			{
+				OVERLAPPED Overlapped;
+
+				/// <summary>
+				/// Invoked on a dispatcher worker thread when the operation completes.
+				/// </summary>
+				void (*Complete)(IoOperation* operation, uint32_t bytes, int32_t error);
+
+				/// <summary>
+				/// Free for use by the owner of the operation.
+				/// </summary>
+				void* Context;
+			};
+
+			/// <summary>
+			/// A fixed pool of worker threads draining a single CompletionQueue and dispatching each
+			/// completion to its IoOperation. This is the shared completion machinery for every
+			/// engine that keeps overlapped operations in flight, so that any number of outstanding
+			/// operations is serviced by a handful of threads instead of one waiting thread each.
+			/// </summary>
+			class CompletionDispatcher
+			{
+
+			public:
+
+				/// <summary>
+				/// Constructs a dispatcher around the supplied queue. The dispatcher takes ownership
+				/// of the queue.
+				/// </summary>
+				CompletionDispatcher(CompletionQueue* queue);
+
+				/// <summary>
+				/// Stops the workers if they are still running, then destroys the queue.
+				/// </summary>
+				~CompletionDispatcher();
+
+				/// <summary>
+				/// The process wide dispatcher, created and started on first use with a worker per
+				/// processor, between two and four. Anything that just needs its overlapped
+				/// operations completed, without caring which threads do it, shares this one. It is
+				/// never destroyed, as joining threads during process teardown isn't safe.
+				/// </summary>
+				/// <returns>
+				/// The shared dispatcher, or null if it could not be created.
+				/// </returns>
+				static CompletionDispatcher* Shared();
+
+				/// <summary>
+				/// Starts the worker threads. Does nothing if they are already running.
+				/// </summary>
+				/// <param name="workerCount">
+				/// The number of workers to start. Must be greater than zero.
+				/// </param>
+				/// <returns>
+				/// True if the workers are running.
+				/// </returns>
+				bool Start(uint32_t workerCount);
+
+				/// <summary>
+				/// Asks every worker to exit once it has drained the completions queued ahead of the
+				/// request, and waits for them to do so. Operations still in flight at this point
+				/// are not waited for, it's up to their owners to cancel and drain them first.
+				/// </summary>
+				void Stop();
+
+				/// <summary>
+				/// The queue this dispatcher drains.
+				/// </summary>
+				CompletionQueue* Queue() const;
+
+				/// <summary>
+				/// The completion key handles must be bound to Queue() with. Only completions
+				/// carrying this key are taken to be IoOperations, anything else that turns up on
+				/// the queue is dropped rather than dispatched.
+				/// </summary>
+				uintptr_t Key() const;
+
+				/// <summary>
+				/// The number of running workers.
+				/// </summary>
+				uint32_t WorkerCount() const;
+
+			private:
+
+				CompletionDispatcher(const CompletionDispatcher&) = delete;
+
+				CompletionDispatcher& operator=(const CompletionDispatcher&) = delete;
+
+				/// <summary>
+				/// Worker threads live here, so that this header stays usable from managed code.
+				/// </summary>
+				struct Workers;
+
+				CompletionQueue* m_queue;
+
+				Workers* m_workers;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,361 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertConnectionRefresher.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const uint8_t TcpProtocol = 6;
+
+				const uint8_t UdpProtocol = 17;
+			}
+
+			ConnectionSnapshot::ConnectionSnapshot() :
+				Generation(0),
+				m_tcp4(4, TcpProtocol),
+				m_udp4(4, UdpProtocol),
+				m_tcp6(6, TcpProtocol),
+				m_udp6(6, UdpProtocol)
+			{
+
+			}
+
+			const ConnectionTable* ConnectionSnapshot::Table(uint8_t family, uint8_t protocol) const
+			{
+				return const_cast<ConnectionSnapshot*>(this)->Table(family, protocol);
+			}
+
+			ConnectionTable* ConnectionSnapshot::Table(uint8_t family, uint8_t protocol)
+			{
+				if (family == 4)
+				{
+					return protocol == TcpProtocol ? &m_tcp4 : protocol == UdpProtocol ? &m_udp4 : nullptr;
+				}
+
+				if (family == 6)
+				{
+					return protocol == TcpProtocol ? &m_tcp6 : protocol == UdpProtocol ? &m_udp6 : nullptr;
+				}
+
+				return nullptr;
+			}
+
+			struct ConnectionRefresher::State
+			{
+				ConnectionSource* Source;
+
+				ConnectionSnapshot Buffers[2];
+
+				/// <summary>
+				/// Index of the published buffer.
+				/// </summary>
+				std::atomic<uint32_t> Current;
+
+				/// <summary>
+				/// Leases currently pinning each buffer.
+				/// </summary>
+				mutable std::atomic<uint32_t> Readers[2];
+
+				std::atomic<uint32_t> Interval;
+
+				std::atomic<uint64_t> Failures;
+
+				/// <summary>
+				/// Serializes refreshes, whichever thread they're on.
+				/// </summary>
+				std::mutex RefreshMutex;
+
+				/// <summary>
+				/// Guards StopRequested and the thread's lifetime.
+				/// </summary>
+				std::mutex ThreadMutex;
+
+				std::condition_variable Wake;
+
+				std::thread Thread;
+
+				std::atomic<bool> Running;
+
+				bool StopRequested = false;
+
+				/// <summary>
+				/// Set without the lock, so that asking for a refresh never blocks. A wakeup lost to
+				/// that only delays the refresh to the end of the interval.
+				/// </summary>
+				std::atomic<bool> RefreshRequested;
+
+				void Run()
+				{
+					std::unique_lock<std::mutex> lock(ThreadMutex);
+
+					while (!StopRequested)
+					{
+						Wake.wait_for(lock, std::chrono::milliseconds(Interval.load(std::memory_order_relaxed)), [this]()
+						{
+							return StopRequested || RefreshRequested;
+						});
+
+						if (StopRequested)
+						{
+							break;
+						}
+
+						RefreshRequested.store(false);
+
+						lock.unlock();
+						Refresh();
+						lock.lock();
+					}
+				}
+
+				bool Refresh()
+				{
+					std::lock_guard<std::mutex> lock(RefreshMutex);
+
+					const uint32_t current = Current.load();
+					const uint32_t back = current ^ 1;
+
+					// Leases taken before the last publish may still be reading the back buffer. They
+					// are short, and no new ones can land on it, since it isn't current.
+					while (Readers[back].load() != 0)
+					{
+						std::this_thread::yield();
+					}
+
+					ConnectionSnapshot& snapshot = Buffers[back];
+
+					const uint8_t families[] = { 4, 6 };
+					const uint8_t protocols[] = { TcpProtocol, UdpProtocol };
+
+					for (uint8_t family : families)
+					{
+						for (uint8_t protocol : protocols)
+						{
+							if (!Source->Snapshot(*snapshot.Table(family, protocol)))
+							{
+								Failures.fetch_add(1, std::memory_order_relaxed);
+								return false;
+							}
+						}
+					}
+
+					snapshot.Generation = Buffers[current].Generation + 1;
+
+					Current.store(back);
+					return true;
+				}
+			};
+
+			#ifdef _WIN32
+			ConnectionRefresher& ConnectionRefresher::Shared()
+			{
+				static ConnectionRefresher* shared = new ConnectionRefresher(&SystemConnectionSource::Shared(), DefaultInterval);
+				return *shared;
+			}
+			#endif
+
+			ConnectionRefresher::ConnectionRefresher(ConnectionSource* source, uint32_t intervalInMilliseconds) : m_state(new State())
+			{
+				m_state->Source = source;
+				m_state->Current.store(0);
+				m_state->Readers[0].store(0);
+				m_state->Readers[1].store(0);
+				m_state->Interval.store(intervalInMilliseconds == 0 ? DefaultInterval : intervalInMilliseconds);
+				m_state->Failures.store(0);
+				m_state->Running.store(false);
+				m_state->RefreshRequested.store(false);
+			}
+
+			ConnectionRefresher::~ConnectionRefresher()
+			{
+				Stop();
+				delete m_state;
+			}
+
+			bool ConnectionRefresher::Start()
+			{
+				if (m_state->Running.load())
+				{
+					return true;
+				}
+
+				if (Generation() == 0)
+				{
+					// A failure here isn't fatal, the thread will keep trying.
+					m_state->Refresh();
+				}
+
+				std::lock_guard<std::mutex> lock(m_state->ThreadMutex);
+
+				if (m_state->Running.load())
+				{
+					return true;
+				}
+
+				m_state->StopRequested = false;
+				m_state->RefreshRequested.store(false);
+
+				try
+				{
+					m_state->Thread = std::thread(&State::Run, m_state);
+				}
+				catch (const std::system_error&)
+				{
+					SetNativeLastError(NotSupportedError);
+					return false;
+				}
+
+				m_state->Running.store(true);
+				return true;
+			}
+
+			void ConnectionRefresher::Stop()
+			{
+				std::thread thread;
+
+				{
+					std::lock_guard<std::mutex> lock(m_state->ThreadMutex);
+
+					if (!m_state->Running.load())
+					{
+						return;
+					}
+
+					m_state->StopRequested = true;
+					m_state->Running.store(false);
+					thread = std::move(m_state->Thread);
+				}
+
+				m_state->Wake.notify_all();
+				thread.join();
+			}
+
+			bool ConnectionRefresher::Running() const
+			{
+				return m_state->Running.load();
+			}
+
+			bool ConnectionRefresher::RefreshNow()
+			{
+				return m_state->Refresh();
+			}
+
+			void ConnectionRefresher::RequestRefresh()
+			{
+				if (!m_state->RefreshRequested.exchange(true))
+				{
+					m_state->Wake.notify_one();
+				}
+			}
+
+			uint32_t ConnectionRefresher::Interval() const
+			{
+				return m_state->Interval.load(std::memory_order_relaxed);
+			}
+
+			void ConnectionRefresher::SetInterval(uint32_t intervalInMilliseconds)
+			{
+				m_state->Interval.store(intervalInMilliseconds == 0 ? DefaultInterval : intervalInMilliseconds, std::memory_order_relaxed);
+			}
+
+			bool ConnectionRefresher::FindOwner(const FlowKey& key, uint32_t* owningPid) const
+			{
+				SnapshotLease lease(*this);
+
+				const ConnectionTable* table = lease.Snapshot().Table(key.Family, key.Protocol);
+
+				return table != nullptr && table->FindOwner(key, owningPid);
+			}
+
+			uint64_t ConnectionRefresher::Generation() const
+			{
+				SnapshotLease lease(*this);
+				return lease.Snapshot().Generation;
+			}
+
+			uint64_t ConnectionRefresher::FailureCount() const
+			{
+				return m_state->Failures.load(std::memory_order_relaxed);
+			}
+
+			uint32_t ConnectionRefresher::Acquire() const
+			{
+				for (;;)
+				{
+					const uint32_t slot = m_state->Current.load();
+
+					m_state->Readers[slot].fetch_add(1);
+
+					// If a publish happened in between, the refresher may already be refilling this
+					// buffer, having seen no readers on it. Let go and pin the new one instead.
+					if (m_state->Current.load() == slot)
+					{
+						return slot;
+					}
+
+					m_state->Readers[slot].fetch_sub(1);
+				}
+			}
+
+			void ConnectionRefresher::Release(uint32_t slot) const
+			{
+				m_state->Readers[slot].fetch_sub(1);
+			}
+
+			const ConnectionSnapshot& ConnectionRefresher::Buffer(uint32_t slot) const
+			{
+				return m_state->Buffers[slot];
+			}
+
+			SnapshotLease::SnapshotLease(const ConnectionRefresher& refresher) : m_refresher(refresher), m_slot(refresher.Acquire())
+			{
+
+			}
+
+			SnapshotLease::~SnapshotLease()
+			{
+				m_refresher.Release(m_slot);
+			}
+
+			const ConnectionSnapshot& SnapshotLease::Snapshot() const
+			{
+				return m_refresher.Buffer(m_slot);
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
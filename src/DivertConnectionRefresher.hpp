@@ -0,0 +1,245 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include "DivertConnectionTable.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// The four socket ownership tables, as taken together by one refresh.
+			/// </summary>
+			class ConnectionSnapshot
+			{
+
+			public:
+
+				ConnectionSnapshot();
+
+				/// <summary>
+				/// The table for a family and protocol, or null if there isn't one.
+				/// </summary>
+				const ConnectionTable* Table(uint8_t family, uint8_t protocol) const;
+
+				ConnectionTable* Table(uint8_t family, uint8_t protocol);
+
+				/// <summary>
+				/// Counts refreshes, starting at one for the first snapshot published. Zero if this
+				/// snapshot has never been filled.
+				/// </summary>
+				uint64_t Generation;
+
+			private:
+
+				ConnectionTable m_tcp4;
+
+				ConnectionTable m_udp4;
+
+				ConnectionTable m_tcp6;
+
+				ConnectionTable m_udp6;
+			};
+
+			class ConnectionRefresher;
+
+			/// <summary>
+			/// Pins the snapshot that is current when it is constructed, for as long as it lives.
+			/// Never blocks, and never waits for a refresh. A refresh that wants to reuse the
+			/// pinned buffer waits for the lease to go instead, so leases should be short lived.
+			/// </summary>
+			class SnapshotLease
+			{
+
+			public:
+
+				explicit SnapshotLease(const ConnectionRefresher& refresher);
+
+				~SnapshotLease();
+
+				/// <summary>
+				/// The pinned snapshot. Its Generation is zero if nothing has been published yet.
+				/// </summary>
+				const ConnectionSnapshot& Snapshot() const;
+
+			private:
+
+				SnapshotLease(const SnapshotLease&) = delete;
+
+				SnapshotLease& operator=(const SnapshotLease&) = delete;
+
+				const ConnectionRefresher& m_refresher;
+
+				uint32_t m_slot;
+			};
+
+			/// <summary>
+			/// Keeps a shared, double buffered snapshot of the socket ownership tables, refreshed
+			/// from a ConnectionSource by a background thread. Each refresh fills whichever buffer
+			/// isn't current and then publishes it with a single atomic store, so readers always see
+			/// a complete snapshot and never wait on a refresh, RCU style. Before refilling a buffer
+			/// the refresher waits for any leases still pinning it to be released.
+			/// </summary>
+			class ConnectionRefresher
+			{
+
+			public:
+
+				/// <summary>
+				/// The interval used unless told otherwise, in milliseconds.
+				/// </summary>
+				static const uint32_t DefaultInterval = 250;
+
+				#ifdef _WIN32
+				/// <summary>
+				/// The refresher used by Diversion::GetPacketProcess, reading from the IP helper
+				/// API. Intentionally never destroyed, as its thread may still be running when
+				/// statics are torn down. Not started until first used.
+				/// </summary>
+				static ConnectionRefresher& Shared();
+				#endif
+
+				/// <summary>
+				/// Constructs a refresher. Nothing is read until Start() or RefreshNow() is called.
+				/// </summary>
+				/// <param name="source">
+				/// Where the tables come from. Must outlive the refresher.
+				/// </param>
+				/// <param name="intervalInMilliseconds">
+				/// How long to wait between refreshes. Must be greater than zero.
+				/// </param>
+				ConnectionRefresher(ConnectionSource* source, uint32_t intervalInMilliseconds);
+
+				/// <summary>
+				/// Stops the refresher, if it is running.
+				/// </summary>
+				~ConnectionRefresher();
+
+				/// <summary>
+				/// Starts the background thread. If nothing has been published yet, refreshes once
+				/// on the calling thread first, so that the first lookups aren't made against empty
+				/// tables. Does nothing if already running.
+				/// </summary>
+				/// <returns>
+				/// True if the refresher is running. False if the thread couldn't be started.
+				/// </returns>
+				bool Start();
+
+				/// <summary>
+				/// Stops the background thread and waits for it to exit.
+				/// </summary>
+				void Stop();
+
+				bool Running() const;
+
+				/// <summary>
+				/// Takes and publishes a new snapshot on the calling thread. Serialized with the
+				/// background thread's refreshes.
+				/// </summary>
+				/// <returns>
+				/// True if a snapshot was published. On failure the previous snapshot stays current
+				/// and the reason is available from GetNativeLastError().
+				/// </returns>
+				bool RefreshNow();
+
+				/// <summary>
+				/// Asks the background thread to refresh as soon as it can, rather than at the end of
+				/// the current interval. Doesn't wait, and is cheap enough to call on a packet path.
+				/// </summary>
+				void RequestRefresh();
+
+				uint32_t Interval() const;
+
+				/// <summary>
+				/// Changes the interval. Takes effect from the next wait.
+				/// </summary>
+				void SetInterval(uint32_t intervalInMilliseconds);
+
+				/// <summary>
+				/// Finds the owner of a flow in the current snapshot.
+				/// </summary>
+				/// <param name="key">
+				/// The flow.
+				/// </param>
+				/// <param name="owningPid">
+				/// Receives the owning process ID, when found.
+				/// </param>
+				/// <returns>
+				/// True if an owning socket was found.
+				/// </returns>
+				bool FindOwner(const FlowKey& key, uint32_t* owningPid) const;
+
+				/// <summary>
+				/// The generation of the current snapshot, zero if none has been published.
+				/// </summary>
+				uint64_t Generation() const;
+
+				/// <summary>
+				/// The number of refreshes that failed, leaving the previous snapshot current.
+				/// </summary>
+				uint64_t FailureCount() const;
+
+			private:
+
+				friend class SnapshotLease;
+
+				ConnectionRefresher(const ConnectionRefresher&) = delete;
+
+				ConnectionRefresher& operator=(const ConnectionRefresher&) = delete;
+
+				/// <summary>
+				/// Pins the current buffer and returns its index.
+				/// </summary>
+				uint32_t Acquire() const;
+
+				void Release(uint32_t slot) const;
+
+				const ConnectionSnapshot& Buffer(uint32_t slot) const;
+
+				/// <summary>
+				/// Both buffers, the thread and its signalling live here, so that this header stays
+				/// usable from managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
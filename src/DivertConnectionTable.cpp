@@ -0,0 +1,697 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#include <iphlpapi.h>
+#endif
+
+#include "DivertConnectionTable.hpp"
+
+#include <mutex>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const uint8_t UnspecifiedAddress[16] = { 0 };
+
+				inline uint64_t Mix(uint64_t value)
+				{
+					// Finalizer from MurmurHash3, so that every input bit affects every output bit.
+					value ^= value >> 33;
+					value *= 0xff51afd7ed558ccdULL;
+					value ^= value >> 33;
+					value *= 0xc4ceb9fe1a85ec53ULL;
+					value ^= value >> 33;
+					return value;
+				}
+
+				const size_t MinimumIndexCapacity = 16;
+
+				const uint8_t TcpProtocol = 6;
+
+				const uint8_t UdpProtocol = 17;
+
+				const size_t TableKinds = 4;
+
+				/// <summary>
+				/// Maps a family and protocol to 0 through 3, for tcp4, udp4, tcp6 and udp6, or to
+				/// TableKinds if the combination isn't one there's a table for.
+				/// </summary>
+				inline size_t TableKind(uint8_t family, uint8_t protocol)
+				{
+					if ((family != 4 && family != 6) || (protocol != TcpProtocol && protocol != UdpProtocol))
+					{
+						return TableKinds;
+					}
+
+					return (family == 6 ? 2 : 0) + (protocol == UdpProtocol ? 1 : 0);
+				}
+
+				inline uint32_t LocalHash(const uint8_t* localAddress, uint16_t localPort)
+				{
+					uint64_t words[2];
+					std::memcpy(words, localAddress, sizeof(words));
+
+					return static_cast<uint32_t>(Mix(words[0] ^ Mix(words[1] ^ localPort)));
+				}
+
+				inline bool SameLocalEnd(const ConnectionEntry& entry, const uint8_t* localAddress, uint16_t localPort)
+				{
+					return entry.LocalPort == localPort && std::memcmp(entry.LocalAddress, localAddress, sizeof(entry.LocalAddress)) == 0;
+				}
+
+				/// <summary>
+				/// Whether a socket has no remote end, as for listening TCP sockets and UDP sockets.
+				/// </summary>
+				inline bool IsUnconnected(const ConnectionEntry& entry)
+				{
+					return entry.RemotePort == 0 && std::memcmp(entry.RemoteAddress, UnspecifiedAddress, sizeof(entry.RemoteAddress)) == 0;
+				}
+
+				inline uint16_t MibPort(const unsigned long port)
+				{
+					// Upper bits can be filled with garbage according to Microsoft:
+					// https://msdn.microsoft.com/en-us/library/windows/desktop/aa366909(v=vs.85).aspx
+					return static_cast<uint16_t>(port & 0xFFFF);
+				}
+			}
+
+			static_assert(sizeof(FlowKey) == 40, "FlowKey is hashed and compared as five 64 bit words.");
+
+			FlowKey FlowKey::FromIPv4(uint8_t protocol, uint32_t localAddress, uint16_t localPort, uint32_t remoteAddress, uint16_t remotePort)
+			{
+				FlowKey key;
+				std::memset(&key, 0, sizeof(key));
+
+				std::memcpy(key.LocalAddress, &localAddress, sizeof(localAddress));
+				std::memcpy(key.RemoteAddress, &remoteAddress, sizeof(remoteAddress));
+				key.LocalPort = localPort;
+				key.RemotePort = remotePort;
+				key.Family = 4;
+				key.Protocol = protocol;
+
+				return key;
+			}
+
+			FlowKey FlowKey::FromIPv6(uint8_t protocol, const void* localAddress, uint16_t localPort, const void* remoteAddress, uint16_t remotePort)
+			{
+				FlowKey key;
+				std::memset(&key, 0, sizeof(key));
+
+				std::memcpy(key.LocalAddress, localAddress, sizeof(key.LocalAddress));
+				std::memcpy(key.RemoteAddress, remoteAddress, sizeof(key.RemoteAddress));
+				key.LocalPort = localPort;
+				key.RemotePort = remotePort;
+				key.Family = 6;
+				key.Protocol = protocol;
+
+				return key;
+			}
+
+			FlowKey FlowKey::FromPacket(uint8_t family, uint8_t protocol, bool outbound, const void* sourceAddress, uint16_t sourcePort, const void* destinationAddress, uint16_t destinationPort)
+			{
+				const void* localAddress = outbound ? sourceAddress : destinationAddress;
+				const void* remoteAddress = outbound ? destinationAddress : sourceAddress;
+				const uint16_t localPort = outbound ? sourcePort : destinationPort;
+				const uint16_t remotePort = outbound ? destinationPort : sourcePort;
+
+				if (family == 4)
+				{
+					uint32_t local = 0;
+					uint32_t remote = 0;
+
+					std::memcpy(&local, localAddress, sizeof(local));
+					std::memcpy(&remote, remoteAddress, sizeof(remote));
+
+					return FromIPv4(protocol, local, localPort, remote, remotePort);
+				}
+
+				return FromIPv6(protocol, localAddress, localPort, remoteAddress, remotePort);
+			}
+
+			bool FlowKey::operator==(const FlowKey& other) const
+			{
+				return std::memcmp(this, &other, sizeof(FlowKey)) == 0;
+			}
+
+			bool FlowKey::operator!=(const FlowKey& other) const
+			{
+				return !(*this == other);
+			}
+
+			uint64_t FlowKey::Hash() const
+			{
+				uint64_t words[5];
+				std::memcpy(words, this, sizeof(words));
+
+				uint64_t hash = 0x9e3779b97f4a7c15ULL;
+
+				for (uint64_t word : words)
+				{
+					hash = Mix(hash ^ word) + 0x9e3779b97f4a7c15ULL;
+				}
+
+				return hash;
+			}
+
+			ConnectionTable::ConnectionTable(uint8_t family, uint8_t protocol) : m_family(family), m_protocol(protocol)
+			{
+
+			}
+
+			uint8_t ConnectionTable::Family() const
+			{
+				return m_family;
+			}
+
+			uint8_t ConnectionTable::Protocol() const
+			{
+				return m_protocol;
+			}
+
+			void ConnectionTable::Clear()
+			{
+				m_entries.clear();
+				m_index.clear();
+			}
+
+			void ConnectionTable::Add(const ConnectionEntry& entry)
+			{
+				m_entries.push_back(entry);
+				m_index.clear();
+			}
+
+			size_t ConnectionTable::Size() const
+			{
+				return m_entries.size();
+			}
+
+			const ConnectionEntry& ConnectionTable::operator[](size_t index) const
+			{
+				return m_entries[index];
+			}
+
+			void ConnectionTable::BuildIndex()
+			{
+				size_t capacity = MinimumIndexCapacity;
+
+				// Keep the load factor at or below one half, so probe sequences stay short.
+				while (capacity < m_entries.size() * 2)
+				{
+					capacity <<= 1;
+				}
+
+				const size_t mask = capacity - 1;
+
+				IndexSlot empty;
+				std::memset(&empty, 0, sizeof(empty));
+				m_index.assign(capacity, empty);
+
+				// Entries are placed into their slots' ranges in a second pass, so that each slot
+				// covers one contiguous run and the table doesn't have to be sorted. Until then, a
+				// slot's First is the index of the first entry seen with its key.
+				std::vector<uint32_t> slotOfEntry(m_entries.size());
+
+				for (size_t i = 0; i < m_entries.size(); ++i)
+				{
+					const ConnectionEntry& entry = m_entries[i];
+					const uint32_t hash = LocalHash(entry.LocalAddress, entry.LocalPort);
+
+					size_t slot = hash & mask;
+
+					while (m_index[slot].Count != 0)
+					{
+						const IndexSlot& existing = m_index[slot];
+
+						if (existing.Hash == hash && SameLocalEnd(m_entries[existing.First], entry.LocalAddress, entry.LocalPort))
+						{
+							break;
+						}
+
+						slot = (slot + 1) & mask;
+					}
+
+					if (m_index[slot].Count == 0)
+					{
+						m_index[slot].Hash = hash;
+						m_index[slot].First = static_cast<uint32_t>(i);
+					}
+
+					++m_index[slot].Count;
+					slotOfEntry[i] = static_cast<uint32_t>(slot);
+				}
+
+				uint32_t next = 0;
+
+				for (IndexSlot& slot : m_index)
+				{
+					slot.First = next;
+					next += slot.Count;
+				}
+
+				// Scatter, preserving the original order within each run.
+				std::vector<ConnectionEntry> ordered(m_entries.size());
+				std::vector<uint32_t> filled(capacity, 0);
+
+				for (size_t i = 0; i < m_entries.size(); ++i)
+				{
+					const uint32_t slot = slotOfEntry[i];
+					ordered[m_index[slot].First + filled[slot]++] = m_entries[i];
+				}
+
+				m_entries.swap(ordered);
+			}
+
+			bool ConnectionTable::Indexed() const
+			{
+				return !m_index.empty();
+			}
+
+			const ConnectionTable::IndexSlot* ConnectionTable::FindSlot(const uint8_t* localAddress, uint16_t localPort) const
+			{
+				const size_t mask = m_index.size() - 1;
+				const uint32_t hash = LocalHash(localAddress, localPort);
+
+				for (size_t slot = hash & mask; m_index[slot].Count != 0; slot = (slot + 1) & mask)
+				{
+					const IndexSlot& candidate = m_index[slot];
+
+					if (candidate.Hash == hash && SameLocalEnd(m_entries[candidate.First], localAddress, localPort))
+					{
+						return &candidate;
+					}
+				}
+
+				return nullptr;
+			}
+
+			bool ConnectionTable::FindOwner(const FlowKey& key, uint32_t* owningPid) const
+			{
+				if (m_index.empty())
+				{
+					return FindOwnerByScan(key, owningPid);
+				}
+
+				const IndexSlot* slot = FindSlot(key.LocalAddress, key.LocalPort);
+
+				if (slot != nullptr)
+				{
+					const ConnectionEntry* unconnected = nullptr;
+
+					for (uint32_t i = slot->First; i < slot->First + slot->Count; ++i)
+					{
+						const ConnectionEntry& entry = m_entries[i];
+
+						if (entry.RemotePort == key.RemotePort && std::memcmp(entry.RemoteAddress, key.RemoteAddress, sizeof(entry.RemoteAddress)) == 0)
+						{
+							*owningPid = entry.OwningPid;
+							return true;
+						}
+
+						if (unconnected == nullptr && IsUnconnected(entry))
+						{
+							unconnected = &entry;
+						}
+					}
+
+					if (unconnected != nullptr)
+					{
+						*owningPid = unconnected->OwningPid;
+						return true;
+					}
+				}
+
+				slot = FindSlot(UnspecifiedAddress, key.LocalPort);
+
+				if (slot != nullptr)
+				{
+					for (uint32_t i = slot->First; i < slot->First + slot->Count; ++i)
+					{
+						if (IsUnconnected(m_entries[i]))
+						{
+							*owningPid = m_entries[i].OwningPid;
+							return true;
+						}
+					}
+				}
+
+				return false;
+			}
+
+			bool ConnectionTable::FindOwnerByScan(const FlowKey& key, uint32_t* owningPid) const
+			{
+				// Best match so far. 2 is a socket bound to the local address with no remote end,
+				// 1 is a socket bound to the unspecified address.
+				int bestRank = 0;
+				uint32_t bestPid = 0;
+
+				for (const ConnectionEntry& entry : m_entries)
+				{
+					if (entry.LocalPort != key.LocalPort)
+					{
+						continue;
+					}
+
+					const bool localMatches = std::memcmp(entry.LocalAddress, key.LocalAddress, sizeof(entry.LocalAddress)) == 0;
+
+					if (localMatches && entry.RemotePort == key.RemotePort && std::memcmp(entry.RemoteAddress, key.RemoteAddress, sizeof(entry.RemoteAddress)) == 0)
+					{
+						*owningPid = entry.OwningPid;
+						return true;
+					}
+
+					if (!IsUnconnected(entry))
+					{
+						// Connected to someone else.
+						continue;
+					}
+
+					if (localMatches && bestRank < 2)
+					{
+						bestRank = 2;
+						bestPid = entry.OwningPid;
+					}
+					else if (bestRank < 1 && std::memcmp(entry.LocalAddress, UnspecifiedAddress, sizeof(entry.LocalAddress)) == 0)
+					{
+						bestRank = 1;
+						bestPid = entry.OwningPid;
+					}
+				}
+
+				if (bestRank == 0)
+				{
+					return false;
+				}
+
+				*owningPid = bestPid;
+				return true;
+			}
+
+			#ifdef _WIN32
+
+			void ConnectionTable::LoadTcp4(const void* table)
+			{
+				const MIB_TCPTABLE2* tcpTable = static_cast<const MIB_TCPTABLE2*>(table);
+
+				m_entries.clear();
+				m_entries.reserve(tcpTable->dwNumEntries);
+
+				for (DWORD i = 0; i < tcpTable->dwNumEntries; ++i)
+				{
+					const MIB_TCPROW2& row = tcpTable->table[i];
+
+					ConnectionEntry entry;
+					std::memset(&entry, 0, sizeof(entry));
+
+					std::memcpy(entry.LocalAddress, &row.dwLocalAddr, sizeof(row.dwLocalAddr));
+					std::memcpy(entry.RemoteAddress, &row.dwRemoteAddr, sizeof(row.dwRemoteAddr));
+					entry.LocalPort = MibPort(row.dwLocalPort);
+					entry.RemotePort = MibPort(row.dwRemotePort);
+					entry.OwningPid = row.dwOwningPid;
+
+					m_entries.push_back(entry);
+				}
+
+				BuildIndex();
+			}
+
+			void ConnectionTable::LoadTcp6(const void* table)
+			{
+				const MIB_TCP6TABLE2* tcpTable = static_cast<const MIB_TCP6TABLE2*>(table);
+
+				m_entries.clear();
+				m_entries.reserve(tcpTable->dwNumEntries);
+
+				for (DWORD i = 0; i < tcpTable->dwNumEntries; ++i)
+				{
+					const MIB_TCP6ROW2& row = tcpTable->table[i];
+
+					ConnectionEntry entry;
+					std::memset(&entry, 0, sizeof(entry));
+
+					std::memcpy(entry.LocalAddress, row.LocalAddr.u.Byte, sizeof(entry.LocalAddress));
+					std::memcpy(entry.RemoteAddress, row.RemoteAddr.u.Byte, sizeof(entry.RemoteAddress));
+					entry.LocalPort = MibPort(row.dwLocalPort);
+					entry.RemotePort = MibPort(row.dwRemotePort);
+					entry.OwningPid = row.dwOwningPid;
+
+					m_entries.push_back(entry);
+				}
+
+				BuildIndex();
+			}
+
+			void ConnectionTable::LoadUdp4(const void* table)
+			{
+				const MIB_UDPTABLE_OWNER_PID* udpTable = static_cast<const MIB_UDPTABLE_OWNER_PID*>(table);
+
+				m_entries.clear();
+				m_entries.reserve(udpTable->dwNumEntries);
+
+				for (DWORD i = 0; i < udpTable->dwNumEntries; ++i)
+				{
+					const MIB_UDPROW_OWNER_PID& row = udpTable->table[i];
+
+					ConnectionEntry entry;
+					std::memset(&entry, 0, sizeof(entry));
+
+					std::memcpy(entry.LocalAddress, &row.dwLocalAddr, sizeof(row.dwLocalAddr));
+					entry.LocalPort = MibPort(row.dwLocalPort);
+					entry.OwningPid = row.dwOwningPid;
+
+					m_entries.push_back(entry);
+				}
+
+				BuildIndex();
+			}
+
+			void ConnectionTable::LoadUdp6(const void* table)
+			{
+				const MIB_UDP6TABLE_OWNER_PID* udpTable = static_cast<const MIB_UDP6TABLE_OWNER_PID*>(table);
+
+				m_entries.clear();
+				m_entries.reserve(udpTable->dwNumEntries);
+
+				for (DWORD i = 0; i < udpTable->dwNumEntries; ++i)
+				{
+					const MIB_UDP6ROW_OWNER_PID& row = udpTable->table[i];
+
+					ConnectionEntry entry;
+					std::memset(&entry, 0, sizeof(entry));
+
+					std::memcpy(entry.LocalAddress, row.ucLocalAddr, sizeof(entry.LocalAddress));
+					entry.LocalPort = MibPort(row.dwLocalPort);
+					entry.OwningPid = row.dwOwningPid;
+
+					m_entries.push_back(entry);
+				}
+
+				BuildIndex();
+			}
+
+			#endif // _WIN32
+
+			struct CannedConnectionSource::State
+			{
+				std::mutex Mutex;
+
+				std::vector<ConnectionEntry> Tables[TableKinds];
+
+				uint64_t SnapshotCount = 0;
+			};
+
+			CannedConnectionSource::CannedConnectionSource() : m_state(new State())
+			{
+
+			}
+
+			CannedConnectionSource::~CannedConnectionSource()
+			{
+				delete m_state;
+			}
+
+			void CannedConnectionSource::Set(uint8_t family, uint8_t protocol, const std::vector<ConnectionEntry>& entries)
+			{
+				const size_t kind = TableKind(family, protocol);
+
+				if (kind == TableKinds)
+				{
+					return;
+				}
+
+				std::lock_guard<std::mutex> lock(m_state->Mutex);
+				m_state->Tables[kind] = entries;
+			}
+
+			bool CannedConnectionSource::Snapshot(ConnectionTable& table)
+			{
+				table.Clear();
+
+				const size_t kind = TableKind(table.Family(), table.Protocol());
+
+				if (kind == TableKinds)
+				{
+					SetNativeLastError(NotSupportedError);
+					return false;
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(m_state->Mutex);
+
+					++m_state->SnapshotCount;
+
+					for (const ConnectionEntry& entry : m_state->Tables[kind])
+					{
+						table.Add(entry);
+					}
+				}
+
+				table.BuildIndex();
+				return true;
+			}
+
+			uint64_t CannedConnectionSource::SnapshotCount() const
+			{
+				std::lock_guard<std::mutex> lock(m_state->Mutex);
+				return m_state->SnapshotCount;
+			}
+
+			#ifdef _WIN32
+
+			struct SystemConnectionSource::State
+			{
+				std::mutex Mutex;
+
+				/// <summary>
+				/// One MIB buffer per table kind, kept between snapshots. uint64_t elements, so the
+				/// tables are suitably aligned.
+				/// </summary>
+				std::vector<uint64_t> Buffers[TableKinds];
+			};
+
+			namespace
+			{
+				DWORD FetchTable(size_t kind, void* buffer, ULONG* length)
+				{
+					switch (kind)
+					{
+						case 0:
+							return GetTcpTable2(static_cast<PMIB_TCPTABLE2>(buffer), length, FALSE);
+						case 1:
+							return GetExtendedUdpTable(buffer, length, FALSE, AF_INET, UDP_TABLE_OWNER_PID, 0);
+						case 2:
+							return GetTcp6Table2(static_cast<PMIB_TCP6TABLE2>(buffer), length, FALSE);
+						default:
+							return GetExtendedUdpTable(buffer, length, FALSE, AF_INET6, UDP_TABLE_OWNER_PID, 0);
+					}
+				}
+			}
+
+			SystemConnectionSource& SystemConnectionSource::Shared()
+			{
+				static SystemConnectionSource shared;
+				return shared;
+			}
+
+			SystemConnectionSource::SystemConnectionSource() : m_state(new State())
+			{
+
+			}
+
+			SystemConnectionSource::~SystemConnectionSource()
+			{
+				delete m_state;
+			}
+
+			bool SystemConnectionSource::Snapshot(ConnectionTable& table)
+			{
+				table.Clear();
+
+				const size_t kind = TableKind(table.Family(), table.Protocol());
+
+				if (kind == TableKinds)
+				{
+					SetNativeLastError(NotSupportedError);
+					return false;
+				}
+
+				std::lock_guard<std::mutex> lock(m_state->Mutex);
+
+				std::vector<uint64_t>& buffer = m_state->Buffers[kind];
+
+				// The table can grow between being sized and being fetched, so allow a few tries.
+				for (int attempt = 0; attempt < 4; ++attempt)
+				{
+					ULONG length = static_cast<ULONG>(buffer.size() * sizeof(uint64_t));
+					const DWORD result = FetchTable(kind, buffer.empty() ? nullptr : buffer.data(), &length);
+
+					if (result == NO_ERROR)
+					{
+						switch (kind)
+						{
+							case 0:
+								table.LoadTcp4(buffer.data());
+								break;
+							case 1:
+								table.LoadUdp4(buffer.data());
+								break;
+							case 2:
+								table.LoadTcp6(buffer.data());
+								break;
+							default:
+								table.LoadUdp6(buffer.data());
+								break;
+						}
+
+						return true;
+					}
+
+					if (result != ERROR_INSUFFICIENT_BUFFER)
+					{
+						SetNativeLastError(static_cast<int32_t>(result));
+						return false;
+					}
+
+					// Leave some headroom, so that a few new sockets don't force another resize.
+					length += length / 8;
+					buffer.resize((length + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+				}
+
+				SetNativeLastError(InsufficientBufferError);
+				return false;
+			}
+
+			#endif // _WIN32
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
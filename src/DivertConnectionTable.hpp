@@ -0,0 +1,336 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include <vector>
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Identifies a flow from the point of view of the local machine, regardless of the
+			/// direction of the packet it was built from. Addresses and ports are kept in network
+			/// byte order, exactly as they appear in packet headers and in the MIB socket tables.
+			/// IPv4 addresses occupy the first four bytes of the address fields. Always build keys
+			/// with the factory functions, so that unused bytes are zero and keys can be compared
+			/// and hashed as raw memory.
+			/// </summary>
+			struct FlowKey
+			{
+				uint8_t LocalAddress[16];
+
+				uint8_t RemoteAddress[16];
+
+				uint16_t LocalPort;
+
+				uint16_t RemotePort;
+
+				/// <summary>
+				/// 4 or 6.
+				/// </summary>
+				uint8_t Family;
+
+				/// <summary>
+				/// IPPROTO_TCP or IPPROTO_UDP.
+				/// </summary>
+				uint8_t Protocol;
+
+				uint16_t Reserved;
+
+				/// <summary>
+				/// Builds a key for an IPv4 flow.
+				/// </summary>
+				static FlowKey FromIPv4(uint8_t protocol, uint32_t localAddress, uint16_t localPort, uint32_t remoteAddress, uint16_t remotePort);
+
+				/// <summary>
+				/// Builds a key for an IPv6 flow. Addresses are 16 bytes each.
+				/// </summary>
+				static FlowKey FromIPv6(uint8_t protocol, const void* localAddress, uint16_t localPort, const void* remoteAddress, uint16_t remotePort);
+
+				/// <summary>
+				/// Builds a key from a packet's source and destination. Outbound packets are sent
+				/// from the local endpoint, inbound packets are sent to it.
+				/// </summary>
+				static FlowKey FromPacket(uint8_t family, uint8_t protocol, bool outbound, const void* sourceAddress, uint16_t sourcePort, const void* destinationAddress, uint16_t destinationPort);
+
+				bool operator==(const FlowKey& other) const;
+
+				bool operator!=(const FlowKey& other) const;
+
+				/// <summary>
+				/// A well mixed 64 bit hash of the whole key.
+				/// </summary>
+				uint64_t Hash() const;
+			};
+
+			/// <summary>
+			/// One socket from a MIB owner table.
+			/// </summary>
+			struct ConnectionEntry
+			{
+				uint8_t LocalAddress[16];
+
+				uint8_t RemoteAddress[16];
+
+				uint16_t LocalPort;
+
+				uint16_t RemotePort;
+
+				uint32_t OwningPid;
+			};
+
+			/// <summary>
+			/// A flat copy of one of the system's socket ownership tables (TCP or UDP, IPv4 or IPv6),
+			/// in a form that doesn't depend on the MIB structures, so that it can be filled from a
+			/// canned table as easily as from the system.
+			/// </summary>
+			class ConnectionTable
+			{
+
+			public:
+
+				ConnectionTable(uint8_t family, uint8_t protocol);
+
+				uint8_t Family() const;
+
+				uint8_t Protocol() const;
+
+				/// <summary>
+				/// Removes every entry, keeping the storage for reuse.
+				/// </summary>
+				void Clear();
+
+				/// <summary>
+				/// Appends an entry. Invalidates the index until BuildIndex() is called again.
+				/// </summary>
+				void Add(const ConnectionEntry& entry);
+
+				size_t Size() const;
+
+				const ConnectionEntry& operator[](size_t index) const;
+
+				/// <summary>
+				/// Indexes the entries by local address and port, so that FindOwner no longer has to
+				/// walk the whole table. Reorders the entries, so that those sharing a local address
+				/// and port are adjacent. The Load functions call this themselves.
+				/// </summary>
+				void BuildIndex();
+
+				/// <summary>
+				/// Whether the index is current.
+				/// </summary>
+				bool Indexed() const;
+
+				/// <summary>
+				/// Finds the process that owns the local end of a flow. An exact match on both
+				/// endpoints wins. Failing that, a socket bound to the local address and port with
+				/// no remote end, such as a listening TCP socket or any UDP socket, and finally a
+				/// socket bound to the local port on the unspecified address. Uses the index when it
+				/// is current, which costs two hash probes plus a walk of the sockets sharing the
+				/// local address and port, and falls back to FindOwnerByScan otherwise.
+				/// </summary>
+				/// <param name="key">
+				/// The flow to find the owner of. Must have the table's family and protocol.
+				/// </param>
+				/// <param name="owningPid">
+				/// Receives the owning process ID, when found.
+				/// </param>
+				/// <returns>
+				/// True if an owning socket was found.
+				/// </returns>
+				bool FindOwner(const FlowKey& key, uint32_t* owningPid) const;
+
+				/// <summary>
+				/// FindOwner, by walking every entry.
+				/// </summary>
+				bool FindOwnerByScan(const FlowKey& key, uint32_t* owningPid) const;
+
+				#ifdef _WIN32
+				/// <summary>
+				/// Replaces the contents with those of a MIB_TCPTABLE2.
+				/// </summary>
+				void LoadTcp4(const void* table);
+
+				/// <summary>
+				/// Replaces the contents with those of a MIB_TCP6TABLE2.
+				/// </summary>
+				void LoadTcp6(const void* table);
+
+				/// <summary>
+				/// Replaces the contents with those of a MIB_UDPTABLE_OWNER_PID.
+				/// </summary>
+				void LoadUdp4(const void* table);
+
+				/// <summary>
+				/// Replaces the contents with those of a MIB_UDP6TABLE_OWNER_PID.
+				/// </summary>
+				void LoadUdp6(const void* table);
+				#endif
+
+			private:
+
+				/// <summary>
+				/// One slot of the open addressing index. Each occupied slot covers the Count
+				/// entries, starting at First, that share a local address and port.
+				/// </summary>
+				struct IndexSlot
+				{
+					uint32_t Hash;
+
+					uint32_t First;
+
+					uint32_t Count;
+				};
+
+				/// <summary>
+				/// Finds the slot for a local address and port, or returns null.
+				/// </summary>
+				const IndexSlot* FindSlot(const uint8_t* localAddress, uint16_t localPort) const;
+
+				uint8_t m_family;
+
+				uint8_t m_protocol;
+
+				std::vector<ConnectionEntry> m_entries;
+
+				/// <summary>
+				/// Power of two sized, linearly probed. Empty when the index isn't current.
+				/// </summary>
+				std::vector<IndexSlot> m_index;
+			};
+
+			/// <summary>
+			/// Somewhere snapshots of the socket ownership tables come from. Abstracted so that
+			/// lookups can be exercised against canned tables, off Windows.
+			/// </summary>
+			class ConnectionSource
+			{
+
+			public:
+
+				virtual ~ConnectionSource()
+				{
+
+				}
+
+				/// <summary>
+				/// Replaces the contents of a table with the current sockets of the table's family
+				/// and protocol, and indexes it.
+				/// </summary>
+				/// <param name="table">
+				/// The table to fill.
+				/// </param>
+				/// <returns>
+				/// True on success. On failure the reason is available from GetNativeLastError(),
+				/// and the table is left empty.
+				/// </returns>
+				virtual bool Snapshot(ConnectionTable& table) = 0;
+			};
+
+			/// <summary>
+			/// Hands out copies of tables supplied by the caller. Safe to use from multiple threads.
+			/// </summary>
+			class CannedConnectionSource : public ConnectionSource
+			{
+
+			public:
+
+				CannedConnectionSource();
+
+				~CannedConnectionSource();
+
+				/// <summary>
+				/// Replaces the sockets handed out for a family and protocol.
+				/// </summary>
+				void Set(uint8_t family, uint8_t protocol, const std::vector<ConnectionEntry>& entries);
+
+				bool Snapshot(ConnectionTable& table) override;
+
+				/// <summary>
+				/// The number of times Snapshot has been called.
+				/// </summary>
+				uint64_t SnapshotCount() const;
+
+			private:
+
+				CannedConnectionSource(const CannedConnectionSource&) = delete;
+
+				CannedConnectionSource& operator=(const CannedConnectionSource&) = delete;
+
+				struct State;
+
+				State* m_state;
+			};
+
+			#ifdef _WIN32
+			/// <summary>
+			/// Reads the tables from the IP helper API. The MIB buffers are kept, and grown as
+			/// needed, across snapshots. Safe to use from multiple threads, snapshots are taken
+			/// one at a time.
+			/// </summary>
+			class SystemConnectionSource : public ConnectionSource
+			{
+
+			public:
+
+				/// <summary>
+				/// The source used by Diversion::GetPacketProcess.
+				/// </summary>
+				static SystemConnectionSource& Shared();
+
+				SystemConnectionSource();
+
+				~SystemConnectionSource();
+
+				bool Snapshot(ConnectionTable& table) override;
+
+			private:
+
+				SystemConnectionSource(const SystemConnectionSource&) = delete;
+
+				SystemConnectionSource& operator=(const SystemConnectionSource&) = delete;
+
+				struct State;
+
+				State* m_state;
+			};
+			#endif
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,196 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertFilterAnalyzer.hpp"
+#include <string>
+#include <vector>
+#include <vcclr.h>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			/// <summary>
+			/// Checks a filter with Diversion::ValidateFilter(...), so that invalid filters are
+			/// reported the same way everywhere, then copies it out as the ASCII the native analyzer
+			/// reads. A valid filter is plain ASCII, so nothing is lost.
+			/// </summary>
+			std::string ToText(System::String^ filter, DivertLayer layer, System::String^ caller, System::String^ parameterName)
+			{
+				System::Exception^ e = nullptr;
+				System::String^ errorDetails = nullptr;
+
+				if (!Diversion::ValidateFilter(filter, layer, errorDetails))
+				{
+					e = gcnew System::ArgumentException(u8"In " + caller + u8" - " + errorDetails, parameterName);
+					throw e;
+				}
+
+				std::string text(static_cast<size_t>(filter->Length), '\0');
+
+				pin_ptr<const wchar_t> chars = PtrToStringChars(filter);
+
+				for (int i = 0; i < filter->Length; ++i)
+				{
+					text[i] = static_cast<char>(chars[i]);
+				}
+
+				return text;
+			}
+		}
+
+		FilterConflict::FilterConflict(System::String^ first, int16_t firstPriority, System::String^ second, int16_t secondPriority, FilterOverlap overlap)
+		{
+			m_first = first;
+			m_firstPriority = firstPriority;
+			m_second = second;
+			m_secondPriority = secondPriority;
+			m_overlap = overlap;
+		}
+
+		System::String^ FilterConflict::First::get()
+		{
+			return m_first;
+		}
+
+		int16_t FilterConflict::FirstPriority::get()
+		{
+			return m_firstPriority;
+		}
+
+		System::String^ FilterConflict::Second::get()
+		{
+			return m_second;
+		}
+
+		int16_t FilterConflict::SecondPriority::get()
+		{
+			return m_secondPriority;
+		}
+
+		FilterOverlap FilterConflict::Overlap::get()
+		{
+			return m_overlap;
+		}
+
+		System::String^ FilterAnalyzer::Simplify(System::String^ filter, DivertLayer layer)
+		{
+			System::Exception^ e = nullptr;
+
+			const std::string text = ToText(filter, layer, u8"FilterAnalyzer::Simplify(System::String^, DivertLayer)", u8"filter");
+
+			const char* errorMessage = nullptr;
+			uint32_t errorPosition = 0;
+			size_t length = 0;
+
+			// Measure first, then simplify into a buffer of the right size.
+			if (!Native::FilterAnalyzer::Simplify(text.data(), text.size(), static_cast<Native::FilterLayer>(layer), nullptr, 0, &length, &errorMessage, &errorPosition))
+			{
+				e = gcnew System::ArgumentException(System::String::Format(u8"In FilterAnalyzer::Simplify(System::String^, DivertLayer) - {0} at position {1}.", gcnew System::String(errorMessage), errorPosition), u8"filter");
+				throw e;
+			}
+
+			std::vector<char> simplified(length + 1);
+
+			Native::FilterAnalyzer::Simplify(text.data(), text.size(), static_cast<Native::FilterLayer>(layer), simplified.data(), simplified.size(), &length, &errorMessage, &errorPosition);
+
+			return gcnew System::String(simplified.data(), 0, static_cast<int>(length));
+		}
+
+		FilterOverlap FilterAnalyzer::Overlap(System::String^ first, System::String^ second, DivertLayer layer)
+		{
+			System::Exception^ e = nullptr;
+
+			const std::string firstText = ToText(first, layer, u8"FilterAnalyzer::Overlap(System::String^, System::String^, DivertLayer)", u8"first");
+			const std::string secondText = ToText(second, layer, u8"FilterAnalyzer::Overlap(System::String^, System::String^, DivertLayer)", u8"second");
+
+			Native::FilterOverlap overlap = Native::FilterOverlap::Unknown;
+			const char* errorMessage = nullptr;
+			uint32_t errorPosition = 0;
+
+			if (!Native::FilterAnalyzer::Overlap(firstText.data(), firstText.size(), secondText.data(), secondText.size(), static_cast<Native::FilterLayer>(layer), &overlap, &errorMessage, &errorPosition))
+			{
+				e = gcnew System::ArgumentException(System::String::Format(u8"In FilterAnalyzer::Overlap(System::String^, System::String^, DivertLayer) - {0} at position {1}.", gcnew System::String(errorMessage), errorPosition));
+				throw e;
+			}
+
+			return static_cast<FilterOverlap>(overlap);
+		}
+
+		array<FilterConflict^>^ FilterAnalyzer::FindConflicts(array<System::String^>^ filters, array<int16_t>^ priorities, DivertLayer layer)
+		{
+			System::Exception^ e = nullptr;
+
+			if (filters == nullptr || priorities == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(filters == nullptr ? u8"filters" : u8"priorities", u8"In FilterAnalyzer::FindConflicts(array<System::String^>^, array<int16_t>^, DivertLayer) - Supplied array is null.");
+				throw e;
+			}
+
+			if (filters->Length != priorities->Length)
+			{
+				e = gcnew System::ArgumentException(u8"In FilterAnalyzer::FindConflicts(array<System::String^>^, array<int16_t>^, DivertLayer) - There must be one priority per filter.", u8"priorities");
+				throw e;
+			}
+
+			// Every filter is checked up front, so that a bad one is reported even if it has no
+			// pair to be compared with.
+			std::vector<std::string> texts;
+			texts.reserve(static_cast<size_t>(filters->Length));
+
+			for (int i = 0; i < filters->Length; ++i)
+			{
+				texts.push_back(ToText(filters[i], layer, u8"FilterAnalyzer::FindConflicts(array<System::String^>^, array<int16_t>^, DivertLayer)", u8"filters"));
+			}
+
+			System::Collections::Generic::List<FilterConflict^>^ conflicts = gcnew System::Collections::Generic::List<FilterConflict^>();
+
+			for (int i = 0; i < filters->Length; ++i)
+			{
+				for (int j = i + 1; j < filters->Length; ++j)
+				{
+					if (priorities[i] == priorities[j])
+					{
+						continue;
+					}
+
+					Native::FilterOverlap overlap = Native::FilterOverlap::Unknown;
+
+					Native::FilterAnalyzer::Overlap(texts[i].data(), texts[i].size(), texts[j].data(), texts[j].size(), static_cast<Native::FilterLayer>(layer), &overlap, nullptr, nullptr);
+
+					if (overlap != Native::FilterOverlap::Disjoint)
+					{
+						conflicts->Add(gcnew FilterConflict(filters[i], priorities[i], filters[j], priorities[j], static_cast<FilterOverlap>(overlap)));
+					}
+				}
+			}
+
+			return conflicts->ToArray();
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,205 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Diversion.hpp"
+#include "DivertNativeFilterAnalyzer.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// What FilterAnalyzer.Overlap(...) could establish about two filters.
+		/// </summary>
+		public enum class FilterOverlap
+		{
+			/// <summary>
+			/// No packet can match both filters.
+			/// </summary>
+			Disjoint = 0,
+
+			/// <summary>
+			/// Some packet matches both, as far as the analyzer can tell. It knows which headers can
+			/// appear together, but not how, say, lengths relate, so in rare cases the packet it has
+			/// in mind can't exist.
+			/// </summary>
+			Overlapping = 1,
+
+			/// <summary>
+			/// The filters were too complex to compare.
+			/// </summary>
+			Unknown = 2
+		};
+
+		/// <summary>
+		/// Two filters opened at different priorities that may both match a packet, as reported by
+		/// FilterAnalyzer.FindConflicts(...). WinDivert hands such a packet to the handle with the
+		/// higher priority first, which is easy to get backwards.
+		/// </summary>
+		public ref class FilterConflict sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a new FilterConflict.
+			/// </summary>
+			FilterConflict(System::String^ first, int16_t firstPriority, System::String^ second, int16_t secondPriority, FilterOverlap overlap);
+
+			/// <summary>
+			/// The filter that comes first in the list given to FindConflicts(...).
+			/// </summary>
+			property System::String^ First
+			{
+				System::String^ get();
+			}
+
+			/// <summary>
+			/// The priority of the first filter.
+			/// </summary>
+			property int16_t FirstPriority
+			{
+				int16_t get();
+			}
+
+			/// <summary>
+			/// The filter that comes second in the list given to FindConflicts(...).
+			/// </summary>
+			property System::String^ Second
+			{
+				System::String^ get();
+			}
+
+			/// <summary>
+			/// The priority of the second filter.
+			/// </summary>
+			property int16_t SecondPriority
+			{
+				int16_t get();
+			}
+
+			/// <summary>
+			/// Overlapping if a packet matching both was found, Unknown if the filters were too
+			/// complex to tell.
+			/// </summary>
+			property FilterOverlap Overlap
+			{
+				FilterOverlap get();
+			}
+
+		private:
+
+			System::String^ m_first;
+
+			int16_t m_firstPriority;
+
+			System::String^ m_second;
+
+			int16_t m_secondPriority;
+
+			FilterOverlap m_overlap;
+
+		};
+
+		/// <summary>
+		/// Static analysis of filter strings, on top of the same parser that
+		/// Diversion.ValidateFilter(...) checks filters with. Filters can be simplified, by folding
+		/// constants and merging or dropping redundant tests, and compared, to find filters on
+		/// different priorities that compete for the same packets.
+		/// </summary>
+		public ref class FilterAnalyzer abstract sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Simplifies a filter string. The result matches exactly the same packets, and can be
+			/// opened in place of the original.
+			/// </summary>
+			/// <param name="filter">
+			/// The filter string, in the WinDivert filter language.
+			/// </param>
+			/// <param name="layer">
+			/// The layer the filter will be used at.
+			/// </param>
+			/// <returns>
+			/// The simplified filter string. A filter that matches every packet comes back as
+			/// "true", one that matches none as "false".
+			/// </returns>
+			/// <exception cref="System::ArgumentException">
+			/// The filter string is null, empty or invalid.
+			/// </exception>
+			static System::String^ Simplify(System::String^ filter, DivertLayer layer);
+
+			/// <summary>
+			/// Works out whether any packet could match both of two filters.
+			/// </summary>
+			/// <param name="first">
+			/// The first filter string.
+			/// </param>
+			/// <param name="second">
+			/// The second filter string.
+			/// </param>
+			/// <param name="layer">
+			/// The layer both filters are used at.
+			/// </param>
+			/// <returns>
+			/// Disjoint if no packet matches both, Overlapping if one may, Unknown if the filters
+			/// were too complex to compare.
+			/// </returns>
+			/// <exception cref="System::ArgumentException">
+			/// Either filter string is null, empty or invalid.
+			/// </exception>
+			static FilterOverlap Overlap(System::String^ first, System::String^ second, DivertLayer layer);
+
+			/// <summary>
+			/// Compares every pair of filters opened at different priorities, and reports those that
+			/// aren't known to be disjoint. Filters at the same priority aren't compared, since
+			/// WinDivert makes no promise about which of them sees a packet first anyway.
+			/// </summary>
+			/// <param name="filters">
+			/// The filter strings.
+			/// </param>
+			/// <param name="priorities">
+			/// The priority each filter is opened at. Must be as long as filters.
+			/// </param>
+			/// <param name="layer">
+			/// The layer all the filters are used at.
+			/// </param>
+			/// <returns>
+			/// The pairs that may conflict, in the order the filters were given.
+			/// </returns>
+			/// <exception cref="System::ArgumentException">
+			/// A filter string is null, empty or invalid, or the arrays differ in length.
+			/// </exception>
+			static array<FilterConflict^>^ FindConflicts(array<System::String^>^ filters, array<int16_t>^ priorities, DivertLayer layer);
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
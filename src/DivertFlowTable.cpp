@@ -0,0 +1,345 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertFlowTable.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			const uint32_t DefaultClosingTimeout = 2000;
+		}
+
+		FlowTable::FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds)
+		{
+			Init(capacity, userSlotCount, idleTimeoutInMilliseconds, DefaultClosingTimeout);
+		}
+
+		FlowTable::FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds)
+		{
+			Init(capacity, userSlotCount, idleTimeoutInMilliseconds, closingTimeoutInMilliseconds);
+		}
+
+		void FlowTable::Init(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds)
+		{
+			System::Exception^ e = nullptr;
+
+			if (capacity == 0 || capacity > Native::FlowTable::MaximumCapacity)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"capacity", u8"In FlowTable::Init(uint32_t, uint32_t, uint32_t, uint32_t) - Capacity must be greater than zero and less than 2^31.");
+				throw e;
+			}
+
+			if (userSlotCount > Native::FlowTable::MaximumUserSlots)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"userSlotCount", u8"In FlowTable::Init(uint32_t, uint32_t, uint32_t, uint32_t) - A flow can carry at most 64 user slots.");
+				throw e;
+			}
+
+			m_table = new Native::FlowTable(capacity, userSlotCount, idleTimeoutInMilliseconds, closingTimeoutInMilliseconds);
+		}
+
+		FlowTable::~FlowTable()
+		{
+			this->!FlowTable();
+		}
+
+		FlowTable::!FlowTable()
+		{
+			if (m_table != nullptr)
+			{
+				delete m_table;
+				m_table = nullptr;
+			}
+		}
+
+		TrackedFlow FlowTable::Track(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv4Header == nullptr || tcpHeader == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv4Header == nullptr ? u8"ipv4Header" : u8"tcpHeader"), u8"In FlowTable::Track(Address^, IPHeader^, TCPHeader^) - Supplied address or header is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				4, IPPROTO_TCP, outbound,
+				&ipv4Header->UnmanagedHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipv4Header->UnmanagedHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
+
+			return Track(key, TcpFlags(tcpHeader), outbound);
+		}
+
+		TrackedFlow FlowTable::Track(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv6Header == nullptr || tcpHeader == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv6Header == nullptr ? u8"ipv6Header" : u8"tcpHeader"), u8"In FlowTable::Track(Address^, IPv6Header^, TCPHeader^) - Supplied address or header is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				6, IPPROTO_TCP, outbound,
+				&ipv6Header->UnmanagedHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipv6Header->UnmanagedHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
+
+			return Track(key, TcpFlags(tcpHeader), outbound);
+		}
+
+		TrackedFlow FlowTable::Track(Address^ address, IPHeader^ ipv4Header, UDPHeader^ udpHeader)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv4Header == nullptr || udpHeader == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv4Header == nullptr ? u8"ipv4Header" : u8"udpHeader"), u8"In FlowTable::Track(Address^, IPHeader^, UDPHeader^) - Supplied address or header is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				4, IPPROTO_UDP, outbound,
+				&ipv4Header->UnmanagedHeader->SrcAddr, udpHeader->UnmanagedHeader->SrcPort,
+				&ipv4Header->UnmanagedHeader->DstAddr, udpHeader->UnmanagedHeader->DstPort
+			);
+
+			return Track(key, 0, outbound);
+		}
+
+		TrackedFlow FlowTable::Track(Address^ address, IPv6Header^ ipv6Header, UDPHeader^ udpHeader)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv6Header == nullptr || udpHeader == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv6Header == nullptr ? u8"ipv6Header" : u8"udpHeader"), u8"In FlowTable::Track(Address^, IPv6Header^, UDPHeader^) - Supplied address or header is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				6, IPPROTO_UDP, outbound,
+				&ipv6Header->UnmanagedHeader->SrcAddr, udpHeader->UnmanagedHeader->SrcPort,
+				&ipv6Header->UnmanagedHeader->DstAddr, udpHeader->UnmanagedHeader->DstPort
+			);
+
+			return Track(key, 0, outbound);
+		}
+
+		bool FlowTable::IsLive(TrackedFlow flow)
+		{
+			Native::FlowTable* table = Table();
+
+			return flow.IsValid && table->IsLive(flow.Index) && table->Generation(flow.Index) == flow.Generation;
+		}
+
+		uint64_t FlowTable::GetSlot(TrackedFlow flow, uint32_t slot)
+		{
+			System::Exception^ e = nullptr;
+
+			if (!IsLive(flow))
+			{
+				e = gcnew System::InvalidOperationException(u8"In FlowTable::GetSlot(TrackedFlow, uint32_t) - The flow has ended.");
+				throw e;
+			}
+
+			if (slot >= m_table->UserSlotCount())
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"slot", u8"In FlowTable::GetSlot(TrackedFlow, uint32_t) - Slot must be less than UserSlotCount.");
+				throw e;
+			}
+
+			return m_table->UserSlots(flow.Index)[slot];
+		}
+
+		void FlowTable::SetSlot(TrackedFlow flow, uint32_t slot, uint64_t value)
+		{
+			System::Exception^ e = nullptr;
+
+			if (!IsLive(flow))
+			{
+				e = gcnew System::InvalidOperationException(u8"In FlowTable::SetSlot(TrackedFlow, uint32_t, uint64_t) - The flow has ended.");
+				throw e;
+			}
+
+			if (slot >= m_table->UserSlotCount())
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"slot", u8"In FlowTable::SetSlot(TrackedFlow, uint32_t, uint64_t) - Slot must be less than UserSlotCount.");
+				throw e;
+			}
+
+			m_table->UserSlots(flow.Index)[slot] = value;
+		}
+
+		bool FlowTable::Remove(TrackedFlow flow)
+		{
+			if (!IsLive(flow))
+			{
+				return false;
+			}
+
+			m_table->Remove(flow.Index);
+			return true;
+		}
+
+		uint32_t FlowTable::Expire()
+		{
+			return Table()->Expire(Native::FlowTable::NowInMilliseconds(), 0);
+		}
+
+		void FlowTable::Clear()
+		{
+			Table()->Clear();
+		}
+
+		void FlowTable::ResetStatistics()
+		{
+			Table()->ResetStatistics();
+		}
+
+		uint32_t FlowTable::Count::get()
+		{
+			return Table()->Count();
+		}
+
+		uint32_t FlowTable::Capacity::get()
+		{
+			return Table()->Capacity();
+		}
+
+		uint32_t FlowTable::UserSlotCount::get()
+		{
+			return Table()->UserSlotCount();
+		}
+
+		uint32_t FlowTable::IdleTimeout::get()
+		{
+			return Table()->IdleTimeout();
+		}
+
+		void FlowTable::IdleTimeout::set(uint32_t value)
+		{
+			Table()->SetIdleTimeout(value);
+		}
+
+		uint32_t FlowTable::ClosingTimeout::get()
+		{
+			return Table()->ClosingTimeout();
+		}
+
+		void FlowTable::ClosingTimeout::set(uint32_t value)
+		{
+			Table()->SetClosingTimeout(value);
+		}
+
+		uint64_t FlowTable::Lookups::get()
+		{
+			return Table()->Statistics().Lookups;
+		}
+
+		uint64_t FlowTable::Hits::get()
+		{
+			return Table()->Statistics().Hits;
+		}
+
+		uint64_t FlowTable::Created::get()
+		{
+			return Table()->Statistics().Created;
+		}
+
+		uint64_t FlowTable::Expired::get()
+		{
+			return Table()->Statistics().Expired;
+		}
+
+		uint64_t FlowTable::Closed::get()
+		{
+			return Table()->Statistics().Closed;
+		}
+
+		uint64_t FlowTable::Reset::get()
+		{
+			return Table()->Statistics().Reset;
+		}
+
+		uint64_t FlowTable::Evicted::get()
+		{
+			return Table()->Statistics().Evicted;
+		}
+
+		TrackedFlow FlowTable::Track(const Native::FlowKey& key, uint8_t tcpFlags, bool outbound)
+		{
+			Native::FlowTable* table = Table();
+
+			bool created = false;
+			const uint32_t index = table->Track(key, tcpFlags, outbound, Native::FlowTable::NowInMilliseconds(), &created);
+
+			if (index == Native::FlowTable::InvalidFlow)
+			{
+				return TrackedFlow();
+			}
+
+			return TrackedFlow(index, table->Generation(index), created);
+		}
+
+		uint8_t FlowTable::TcpFlags(TCPHeader^ tcpHeader)
+		{
+			PWINDIVERT_TCPHDR header = tcpHeader->UnmanagedHeader;
+
+			return static_cast<uint8_t>(
+				(header->Fin ? Native::FlowTable::TcpFin : 0) |
+				(header->Syn ? Native::FlowTable::TcpSyn : 0) |
+				(header->Rst ? Native::FlowTable::TcpRst : 0)
+				);
+		}
+
+		Native::FlowTable* FlowTable::Table()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_table == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"FlowTable", u8"In FlowTable::Table() - Flow table has been disposed.");
+				throw e;
+			}
+
+			return m_table;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,351 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAddress.hpp"
+#include "DivertIpHeader.hpp"
+#include "DivertIpv6Header.hpp"
+#include "DivertTCPHeader.hpp"
+#include "DivertUDPHeader.hpp"
+#include "DivertNativeFlowTable.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// Identifies one flow in a FlowTable, as returned by FlowTable.Track. Flow numbers are
+		/// reused once a flow ends, the generation tells the flows that had the same number apart,
+		/// so a TrackedFlow kept past the end of its flow is simply no longer live.
+		/// </summary>
+		public value struct TrackedFlow
+		{
+
+		public:
+
+			/// <summary>
+			/// The flow's number in its table, between zero and the table's capacity.
+			/// </summary>
+			property uint32_t Index
+			{
+				uint32_t get() { return m_index; }
+			}
+
+			property uint32_t Generation
+			{
+				uint32_t get() { return m_generation; }
+			}
+
+			/// <summary>
+			/// Whether the flow was created for the packet this was returned for.
+			/// </summary>
+			property bool IsNew
+			{
+				bool get() { return m_isNew; }
+			}
+
+			/// <summary>
+			/// False for the value returned for a RST that doesn't belong to any flow, and for a
+			/// default constructed value.
+			/// </summary>
+			property bool IsValid
+			{
+				bool get() { return m_generation != 0; }
+			}
+
+		internal:
+
+			TrackedFlow(uint32_t index, uint32_t generation, bool isNew) : m_index(index), m_generation(generation), m_isNew(isNew)
+			{
+
+			}
+
+		private:
+
+			uint32_t m_index;
+
+			uint32_t m_generation;
+
+			bool m_isNew;
+
+		};
+
+		/// <summary>
+		/// Tracks the flows a diversion sees, so that work which only has to be done once per flow
+		/// is done for the first packet and reused for the rest, rather than repeated for every
+		/// packet. Both directions of a connection are one flow. Each flow carries a fixed number
+		/// of 64 bit user slots, zeroed when the flow is created, to keep whatever was worked out
+		/// about it: a verdict, the owning process ID, counters.
+		/// 
+		/// Flows that see no packet for IdleTimeout are expired a few at a time as packets are
+		/// tracked. A TCP flow ends at the next call after a RST, or ClosingTimeout after both
+		/// ends have sent a FIN. When the table is full, the least recently seen flow makes room.
+		/// 
+		/// Not safe for concurrent use. Give each thread that handles packets its own table.
+		/// </summary>
+		public ref class FlowTable sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a table, with a closing timeout of two seconds. All memory is allocated
+			/// up front.
+			/// </summary>
+			/// <param name="capacity">
+			/// The most flows tracked at once. Must be greater than zero.
+			/// </param>
+			/// <param name="userSlotCount">
+			/// The number of user slots each flow carries, at most 64.
+			/// </param>
+			/// <param name="idleTimeoutInMilliseconds">
+			/// How long a flow may go without a packet before it's expired.
+			/// </param>
+			FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds);
+
+			/// <summary>
+			/// Constructs a table. All memory is allocated up front.
+			/// </summary>
+			/// <param name="capacity">
+			/// The most flows tracked at once. Must be greater than zero.
+			/// </param>
+			/// <param name="userSlotCount">
+			/// The number of user slots each flow carries, at most 64.
+			/// </param>
+			/// <param name="idleTimeoutInMilliseconds">
+			/// How long a flow may go without a packet before it's expired.
+			/// </param>
+			/// <param name="closingTimeoutInMilliseconds">
+			/// How long a TCP flow is kept after both ends have sent a FIN, for the final ACK and
+			/// any retransmissions.
+			/// </param>
+			FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~FlowTable();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!FlowTable();
+
+			/// <summary>
+			/// Finds the flow a TCP over IPv4 packet belongs to, creating it if needed. The headers
+			/// are those populated by Diversion.ParsePacket. FIN and RST flags are acted on.
+			/// </summary>
+			/// <returns>
+			/// The packet's flow. Not valid for a RST that doesn't belong to any flow, no flow is
+			/// created for it.
+			/// </returns>
+			TrackedFlow Track(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader);
+
+			/// <summary>
+			/// Finds the flow a TCP over IPv6 packet belongs to, creating it if needed.
+			/// </summary>
+			TrackedFlow Track(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader);
+
+			/// <summary>
+			/// Finds the flow a UDP over IPv4 packet belongs to, creating it if needed.
+			/// </summary>
+			TrackedFlow Track(Address^ address, IPHeader^ ipv4Header, UDPHeader^ udpHeader);
+
+			/// <summary>
+			/// Finds the flow a UDP over IPv6 packet belongs to, creating it if needed.
+			/// </summary>
+			TrackedFlow Track(Address^ address, IPv6Header^ ipv6Header, UDPHeader^ udpHeader);
+
+			/// <summary>
+			/// Whether a flow is still in the table.
+			/// </summary>
+			bool IsLive(TrackedFlow flow);
+
+			/// <summary>
+			/// Reads one of a flow's user slots.
+			/// </summary>
+			/// <exception cref="System::InvalidOperationException">
+			/// The flow has ended.
+			/// </exception>
+			uint64_t GetSlot(TrackedFlow flow, uint32_t slot);
+
+			/// <summary>
+			/// Writes one of a flow's user slots.
+			/// </summary>
+			/// <exception cref="System::InvalidOperationException">
+			/// The flow has ended.
+			/// </exception>
+			void SetSlot(TrackedFlow flow, uint32_t slot, uint64_t value);
+
+			/// <summary>
+			/// Ends a flow ahead of time.
+			/// </summary>
+			/// <returns>
+			/// False if the flow had already ended.
+			/// </returns>
+			bool Remove(TrackedFlow flow);
+
+			/// <summary>
+			/// Ends every flow whose time is up. Tracking packets does this a few flows at a time,
+			/// so this only needs calling when packets stop arriving for a while.
+			/// </summary>
+			/// <returns>
+			/// The number of flows ended.
+			/// </returns>
+			uint32_t Expire();
+
+			/// <summary>
+			/// Ends every flow.
+			/// </summary>
+			void Clear();
+
+			/// <summary>
+			/// Zeroes Lookups, Hits, Created, Expired, Closed, Reset and Evicted.
+			/// </summary>
+			void ResetStatistics();
+
+			/// <summary>
+			/// The number of flows currently in the table.
+			/// </summary>
+			property uint32_t Count
+			{
+				uint32_t get();
+			}
+
+			property uint32_t Capacity
+			{
+				uint32_t get();
+			}
+
+			property uint32_t UserSlotCount
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// How long, in milliseconds, a flow may go without a packet before it's expired.
+			/// </summary>
+			property uint32_t IdleTimeout
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// How long, in milliseconds, a TCP flow is kept after both ends have sent a FIN.
+			/// </summary>
+			property uint32_t ClosingTimeout
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// Packets tracked.
+			/// </summary>
+			property uint64_t Lookups
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Packets that belonged to a flow already in the table.
+			/// </summary>
+			property uint64_t Hits
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Flows created.
+			/// </summary>
+			property uint64_t Created
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Flows ended for going IdleTimeout without a packet.
+			/// </summary>
+			property uint64_t Expired
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// TCP flows ended after a FIN from both ends.
+			/// </summary>
+			property uint64_t Closed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// TCP flows ended by a RST.
+			/// </summary>
+			property uint64_t Reset
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Flows ended to make room in a full table.
+			/// </summary>
+			property uint64_t Evicted
+			{
+				uint64_t get();
+			}
+
+		private:
+
+			/// <summary>
+			/// The table itself. Exclusively owned by this object.
+			/// </summary>
+			Native::FlowTable* m_table = nullptr;
+
+			/// <summary>
+			/// Shared by the constructors.
+			/// </summary>
+			void Init(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds);
+
+			TrackedFlow Track(const Native::FlowKey& key, uint8_t tcpFlags, bool outbound);
+
+			/// <summary>
+			/// The TCP flags the native table acts on.
+			/// </summary>
+			static uint8_t TcpFlags(TCPHeader^ tcpHeader);
+
+			/// <summary>
+			/// The native table, throwing if this object has been disposed.
+			/// </summary>
+			Native::FlowTable* Table();
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,206 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertFragmentReassembler.hpp"
+#include "DivertNativeFlowTable.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		FragmentReassembler::FragmentReassembler(uint32_t maximumDatagrams, uint64_t memoryBudget, uint32_t timeoutInMilliseconds)
+		{
+			System::Exception^ e = nullptr;
+
+			if (maximumDatagrams == 0)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"maximumDatagrams", u8"In FragmentReassembler::FragmentReassembler(uint32_t, uint64_t, uint32_t) - Maximum datagrams must be greater than zero.");
+				throw e;
+			}
+
+			if (memoryBudget < Native::FragmentReassembler::BlockSize)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"memoryBudget", u8"In FragmentReassembler::FragmentReassembler(uint32_t, uint64_t, uint32_t) - Memory budget must hold at least one block.");
+				throw e;
+			}
+
+			m_reassembler = new Native::FragmentReassembler(maximumDatagrams, memoryBudget, timeoutInMilliseconds);
+		}
+
+		FragmentReassembler::~FragmentReassembler()
+		{
+			this->!FragmentReassembler();
+		}
+
+		FragmentReassembler::!FragmentReassembler()
+		{
+			if (m_reassembler != nullptr)
+			{
+				delete m_reassembler;
+				m_reassembler = nullptr;
+			}
+		}
+
+		FragmentStatus FragmentReassembler::Add(array<System::Byte>^ packetBuffer, uint32_t packetLength, array<System::Byte>^ reassembledBuffer, uint32_t% reassembledLength)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::FragmentReassembler* reassembler = Reassembler();
+
+			if (packetBuffer == nullptr || reassembledBuffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(packetBuffer == nullptr ? u8"packetBuffer" : u8"reassembledBuffer", u8"In FragmentReassembler::Add(array<System::Byte>^, uint32_t, array<System::Byte>^, uint32_t%) - Supplied buffer is null.");
+				throw e;
+			}
+
+			if (packetLength == 0 || packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In FragmentReassembler::Add(array<System::Byte>^, uint32_t, array<System::Byte>^, uint32_t%) - Packet length must be greater than zero and no more than the buffer.");
+				throw e;
+			}
+
+			if (static_cast<uint32_t>(reassembledBuffer->Length) < Native::FragmentReassembler::MaximumPacketLength)
+			{
+				e = gcnew System::ArgumentException(u8"In FragmentReassembler::Add(array<System::Byte>^, uint32_t, array<System::Byte>^, uint32_t%) - Reassembled buffer must be at least MaximumPacketLength bytes long.", u8"reassembledBuffer");
+				throw e;
+			}
+
+			pin_ptr<System::Byte> pinnedPacket = &packetBuffer[0];
+			pin_ptr<System::Byte> pinnedOutput = &reassembledBuffer[0];
+
+			uint32_t outputLength = 0;
+
+			const Native::FragmentResult result = reassembler->Add(pinnedPacket, packetLength, pinnedOutput, &outputLength, Native::FlowTable::NowInMilliseconds());
+
+			reassembledLength = outputLength;
+
+			return static_cast<FragmentStatus>(result);
+		}
+
+		uint32_t FragmentReassembler::Expire()
+		{
+			return Reassembler()->Expire(Native::FlowTable::NowInMilliseconds(), 0);
+		}
+
+		void FragmentReassembler::Clear()
+		{
+			Reassembler()->Clear();
+		}
+
+		void FragmentReassembler::ResetStatistics()
+		{
+			Reassembler()->ResetStatistics();
+		}
+
+		uint32_t FragmentReassembler::Timeout::get()
+		{
+			return Reassembler()->Timeout();
+		}
+
+		void FragmentReassembler::Timeout::set(uint32_t value)
+		{
+			Reassembler()->SetTimeout(value);
+		}
+
+		uint64_t FragmentReassembler::MemoryBudget::get()
+		{
+			return Reassembler()->MemoryBudget();
+		}
+
+		uint64_t FragmentReassembler::MemoryUsed::get()
+		{
+			return Reassembler()->Statistics().MemoryUsed;
+		}
+
+		uint32_t FragmentReassembler::DatagramCount::get()
+		{
+			return Reassembler()->Statistics().Datagrams;
+		}
+
+		uint64_t FragmentReassembler::Fragments::get()
+		{
+			return Reassembler()->Statistics().Fragments;
+		}
+
+		uint64_t FragmentReassembler::Reassembled::get()
+		{
+			return Reassembler()->Statistics().Reassembled;
+		}
+
+		uint64_t FragmentReassembler::Duplicates::get()
+		{
+			return Reassembler()->Statistics().Duplicates;
+		}
+
+		uint64_t FragmentReassembler::Overlapping::get()
+		{
+			return Reassembler()->Statistics().Overlapping;
+		}
+
+		uint64_t FragmentReassembler::Oversized::get()
+		{
+			return Reassembler()->Statistics().Oversized;
+		}
+
+		uint64_t FragmentReassembler::TooManyFragments::get()
+		{
+			return Reassembler()->Statistics().TooManyFragments;
+		}
+
+		uint64_t FragmentReassembler::Malformed::get()
+		{
+			return Reassembler()->Statistics().Malformed;
+		}
+
+		uint64_t FragmentReassembler::Expired::get()
+		{
+			return Reassembler()->Statistics().Expired;
+		}
+
+		uint64_t FragmentReassembler::Evicted::get()
+		{
+			return Reassembler()->Statistics().Evicted;
+		}
+
+		uint64_t FragmentReassembler::Discarded::get()
+		{
+			return Reassembler()->Statistics().Discarded;
+		}
+
+		Native::FragmentReassembler* FragmentReassembler::Reassembler()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_reassembler == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"FragmentReassembler", u8"In FragmentReassembler::Reassembler() - Fragment reassembler has been disposed.");
+				throw e;
+			}
+
+			return m_reassembler;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,281 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNativeFragmentReassembler.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// What FragmentReassembler.Add did with a packet.
+		/// </summary>
+		public enum class FragmentStatus : System::Byte
+		{
+			/// <summary>
+			/// The packet isn't a fragment. Handle it as it is.
+			/// </summary>
+			NotFragment = static_cast<uint8_t>(Native::FragmentResult::NotFragment),
+
+			/// <summary>
+			/// The fragment was kept until the rest of its datagram arrives.
+			/// </summary>
+			Buffered = static_cast<uint8_t>(Native::FragmentResult::Buffered),
+
+			/// <summary>
+			/// The fragment completed its datagram, which is in the reassembled buffer.
+			/// </summary>
+			Complete = static_cast<uint8_t>(Native::FragmentResult::Complete),
+
+			/// <summary>
+			/// The fragment was thrown away, and with it the rest of its datagram.
+			/// </summary>
+			Dropped = static_cast<uint8_t>(Native::FragmentResult::Dropped)
+		};
+
+		/// <summary>
+		/// Puts fragmented IPv4 and IPv6 datagrams back together before they're parsed, so that
+		/// filters, flow tracking and stream reassembly see whole packets with their transport
+		/// headers. A completed datagram is written out as an ordinary unfragmented packet, ready
+		/// for Diversion.ParsePacket.
+		/// 
+		/// Memory is allocated up front and never grows: overlapping fragments drop their
+		/// datagram, tiny and malformed fragments are refused, and when the datagram records or
+		/// the memory budget run out the oldest incomplete datagrams make room. See the native
+		/// FragmentReassembler for the details.
+		/// 
+		/// Not safe for concurrent use. Give each thread that handles packets its own reassembler.
+		/// </summary>
+		public ref class FragmentReassembler sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a reassembler.
+			/// </summary>
+			/// <param name="maximumDatagrams">
+			/// The most datagrams in progress at once. Must be greater than zero.
+			/// </param>
+			/// <param name="memoryBudget">
+			/// The bytes set aside for fragments waiting for the rest of their datagram. Must be at
+			/// least FragmentReassembler.BlockSize.
+			/// </param>
+			/// <param name="timeoutInMilliseconds">
+			/// How long after its first fragment a datagram is given up on.
+			/// </param>
+			FragmentReassembler(uint32_t maximumDatagrams, uint64_t memoryBudget, uint32_t timeoutInMilliseconds);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~FragmentReassembler();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!FragmentReassembler();
+
+			/// <summary>
+			/// Adds a received packet. Call this before Diversion.ParsePacket, and parse the
+			/// reassembled packet instead when the result is Complete.
+			/// </summary>
+			/// <param name="packetBuffer">
+			/// The packet, starting with its IP header.
+			/// </param>
+			/// <param name="reassembledBuffer">
+			/// Receives the reassembled packet. Must be at least MaximumPacketLength bytes long.
+			/// </param>
+			/// <param name="reassembledLength">
+			/// Receives the length of the reassembled packet, and zero when the result isn't
+			/// Complete.
+			/// </param>
+			/// <exception cref="System::ArgumentException">
+			/// The reassembled buffer is too short.
+			/// </exception>
+			FragmentStatus Add(array<System::Byte>^ packetBuffer, uint32_t packetLength, array<System::Byte>^ reassembledBuffer, uint32_t% reassembledLength);
+
+			/// <summary>
+			/// Drops every datagram that has timed out. Adding packets does this a few datagrams at
+			/// a time, so this only needs calling when packets stop arriving for a while.
+			/// </summary>
+			/// <returns>
+			/// The number of datagrams dropped.
+			/// </returns>
+			uint32_t Expire();
+
+			/// <summary>
+			/// Drops every datagram in progress.
+			/// </summary>
+			void Clear();
+
+			/// <summary>
+			/// Zeroes every counter but DatagramCount and MemoryUsed.
+			/// </summary>
+			void ResetStatistics();
+
+			/// <summary>
+			/// The shortest a reassembled buffer may be.
+			/// </summary>
+			static const uint32_t MaximumPacketLength = Native::FragmentReassembler::MaximumPacketLength;
+
+			/// <summary>
+			/// The unit the memory budget is spent in.
+			/// </summary>
+			static const uint32_t BlockSize = Native::FragmentReassembler::BlockSize;
+
+			/// <summary>
+			/// How long, in milliseconds, a datagram may take to complete.
+			/// </summary>
+			property uint32_t Timeout
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// The memory budget, in bytes, rounded down to whole blocks.
+			/// </summary>
+			property uint64_t MemoryBudget
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Bytes of the budget holding fragments.
+			/// </summary>
+			property uint64_t MemoryUsed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams waiting for more fragments.
+			/// </summary>
+			property uint32_t DatagramCount
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Fragments added.
+			/// </summary>
+			property uint64_t Fragments
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams put back together.
+			/// </summary>
+			property uint64_t Reassembled
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Fragments identical to one already held, which were ignored.
+			/// </summary>
+			property uint64_t Duplicates
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams dropped for overlapping fragments.
+			/// </summary>
+			property uint64_t Overlapping
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams dropped for growing past the largest packet IP can carry.
+			/// </summary>
+			property uint64_t Oversized
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams dropped for arriving in too many pieces.
+			/// </summary>
+			property uint64_t TooManyFragments
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Fragments dropped for being malformed.
+			/// </summary>
+			property uint64_t Malformed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Datagrams that didn't complete within the timeout.
+			/// </summary>
+			property uint64_t Expired
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Incomplete datagrams dropped to make room.
+			/// </summary>
+			property uint64_t Evicted
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Fragments dropped for belonging to a datagram that was dropped already.
+			/// </summary>
+			property uint64_t Discarded
+			{
+				uint64_t get();
+			}
+
+		private:
+
+			/// <summary>
+			/// The reassembler itself. Exclusively owned by this object.
+			/// </summary>
+			Native::FragmentReassembler* m_reassembler = nullptr;
+
+			/// <summary>
+			/// The native reassembler, throwing if this object has been disposed.
+			/// </summary>
+			Native::FragmentReassembler* Reassembler();
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -25,6 +25,8 @@
 #include "DivertICMPHeader.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -73,7 +75,9 @@ namespace Divert
 		{
 			if (m_icmpHeader != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_icmpHeader->Type = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -91,7 +95,9 @@ namespace Divert
 		{
 			if (m_icmpHeader != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_icmpHeader->Code = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -127,7 +133,9 @@ namespace Divert
 		{
 			if (m_icmpHeader != nullptr)
 			{
+				UINT32 before = m_icmpHeader->Body;
 				m_icmpHeader->Body = ByteSwap(value);
+				ChecksummedBytesChanged(4, &before, sizeof(before));
 			}
 		}
 
@@ -146,5 +154,30 @@ namespace Divert
 			m_icmpHeader = value;
 		}
 
+		bool ICMPHeader::IncrementalChecksums::get()
+		{
+			return m_incrementalChecksums;
+		}
+
+		void ICMPHeader::IncrementalChecksums::set(bool value)
+		{
+			m_incrementalChecksums = value;
+		}
+
+		uint16_t ICMPHeader::WordAt(uint32_t offset)
+		{
+			uint16_t word;
+			std::memcpy(&word, reinterpret_cast<uint8_t*>(m_icmpHeader) + offset, sizeof(word));
+			return word;
+		}
+
+		void ICMPHeader::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
+		{
+			if (m_incrementalChecksums)
+			{
+				Native::UpdateChecksum(&m_icmpHeader->Checksum, before, reinterpret_cast<uint8_t*>(m_icmpHeader) + offset, length, false);
+			}
+		}
+
 	} /* namespace Net */
 } /* namespace Divert */
\ No newline at end of file
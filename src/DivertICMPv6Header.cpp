@@ -25,6 +25,8 @@
 #include "DivertICMPv6Header.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -73,7 +75,9 @@ namespace Divert
 		{
 			if (m_icmpv6Header != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_icmpv6Header->Type = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -91,7 +95,9 @@ namespace Divert
 		{
 			if (m_icmpv6Header != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_icmpv6Header->Code = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -127,7 +133,9 @@ namespace Divert
 		{
 			if (m_icmpv6Header != nullptr)
 			{
+				UINT32 before = m_icmpv6Header->Body;
 				m_icmpv6Header->Body = ByteSwap(value);
+				ChecksummedBytesChanged(4, &before, sizeof(before));
 			}
 		}
 
@@ -146,5 +154,30 @@ namespace Divert
 			m_icmpv6Header = value;
 		}
 
+		bool ICMPv6Header::IncrementalChecksums::get()
+		{
+			return m_incrementalChecksums;
+		}
+
+		void ICMPv6Header::IncrementalChecksums::set(bool value)
+		{
+			m_incrementalChecksums = value;
+		}
+
+		uint16_t ICMPv6Header::WordAt(uint32_t offset)
+		{
+			uint16_t word;
+			std::memcpy(&word, reinterpret_cast<uint8_t*>(m_icmpv6Header) + offset, sizeof(word));
+			return word;
+		}
+
+		void ICMPv6Header::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
+		{
+			if (m_incrementalChecksums)
+			{
+				Native::UpdateChecksum(&m_icmpv6Header->Checksum, before, reinterpret_cast<uint8_t*>(m_icmpv6Header) + offset, length, false);
+			}
+		}
+
 	} /* namespace Net */
 } /* namespace Divert */
@@ -117,6 +117,17 @@ namespace Divert
 				void set(PWINDIVERT_ICMPV6HDR value);
 			}
 
+			/// <summary>
+			/// When set, each setter folds its change into the header checksum as per RFC 1624, so
+			/// the packet doesn't need a full Diversion::CalculateChecksums afterwards. Set by
+			/// Diversion::ParsePacket from Diversion::IncrementalChecksums.
+			/// </summary>
+			property bool IncrementalChecksums
+			{
+				bool get();
+				void set(bool value);
+			}
+
 		private:
 
 			/// <summary>
@@ -125,6 +136,22 @@ namespace Divert
 			/// </summary>
 			PWINDIVERT_ICMPV6HDR m_icmpv6Header = nullptr;
 
+			/// <summary>
+			/// Reads the 16 bit word at the given offset into the header, in memory order.
+			/// </summary>
+			uint16_t WordAt(uint32_t offset);
+
+			/// <summary>
+			/// Called by the setters after changing bytes covered by a checksum, with a copy of the
+			/// bytes as they were. Does nothing unless IncrementalChecksums is set.
+			/// </summary>
+			void ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length);
+
+			/// <summary>
+			/// Whether the setters update the checksums.
+			/// </summary>
+			bool m_incrementalChecksums = false;
+
 		};
 
 	} /* namespace Net */
@@ -25,6 +25,8 @@
 #include "DivertIPHeader.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -75,7 +77,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_ipHeader->HdrLength = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -93,7 +97,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_ipHeader->Version = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -111,7 +117,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(0);
 				m_ipHeader->TOS = value;
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -129,7 +137,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(2);
 				m_ipHeader->Length = ByteSwap(value);
+				ChecksummedBytesChanged(2, &before, sizeof(before));
 			}
 		}
 
@@ -147,7 +157,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(4);
 				m_ipHeader->Id = ByteSwap(value);
+				ChecksummedBytesChanged(4, &before, sizeof(before));
 			}
 		}
 
@@ -166,8 +178,10 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(6);
 				uint16_t modifiedValue = ByteSwap(value);
 				WINDIVERT_IPHDR_SET_FRAGOFF(m_ipHeader, modifiedValue);
+				ChecksummedBytesChanged(6, &before, sizeof(before));
 			}
 		}
 
@@ -186,8 +200,10 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(6);
 				auto modifiedValue = ByteSwap(value);
 				WINDIVERT_IPHDR_SET_MF(m_ipHeader, modifiedValue);
+				ChecksummedBytesChanged(6, &before, sizeof(before));
 			}
 		}
 
@@ -206,8 +222,10 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(6);
 				uint16_t modifiedValue = ByteSwap(value);
 				WINDIVERT_IPHDR_SET_DF(m_ipHeader, modifiedValue);
+				ChecksummedBytesChanged(6, &before, sizeof(before));
 			}
 		}
 
@@ -226,8 +244,10 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(6);
 				uint16_t modifiedValue = ByteSwap(value);
 				WINDIVERT_IPHDR_SET_RESERVED(m_ipHeader, modifiedValue);
+				ChecksummedBytesChanged(6, &before, sizeof(before));
 			}
 		}
 
@@ -245,7 +265,9 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(8);
 				m_ipHeader->TTL = value;
+				ChecksummedBytesChanged(8, &before, sizeof(before));
 			}
 		}
 
@@ -263,7 +285,20 @@ namespace Divert
 		{
 			if (m_ipHeader != nullptr)
 			{
+				uint16_t before = WordAt(8);
 				m_ipHeader->Protocol = value;
+				ChecksummedBytesChanged(8, &before, sizeof(before));
+
+				// The protocol is also in the transport checksum's pseudo header, as the second
+				// byte of a word whose first byte is zero. TTL shares the word here, so it can't
+				// go through ChecksummedBytesChanged.
+				if (m_incrementalChecksums && m_transportChecksum != nullptr)
+				{
+					const uint8_t pseudoBefore[2] = { 0, reinterpret_cast<const uint8_t*>(&before)[1] };
+					const uint8_t pseudoAfter[2] = { 0, value };
+
+					Native::UpdateChecksum(m_transportChecksum, pseudoBefore, pseudoAfter, sizeof(pseudoAfter), m_transportChecksumOptional);
+				}
 			}
 		}
 
@@ -303,10 +338,11 @@ namespace Divert
 		{
 			UINT32 intAddress = System::BitConverter::ToInt32(value->GetAddressBytes(), 0);
 
-			if (m_ipHeader != nullptr)		
+			if (m_ipHeader != nullptr)
 			{
-				
-				m_ipHeader->SrcAddr = intAddress;				
+				UINT32 before = m_ipHeader->SrcAddr;
+				m_ipHeader->SrcAddr = intAddress;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 
 			m_sourceAddress = value;
@@ -333,8 +369,9 @@ namespace Divert
 
 			if (m_ipHeader != nullptr)
 			{
-
+				UINT32 before = m_ipHeader->DstAddr;
 				m_ipHeader->DstAddr = intAddress;
+				ChecksummedBytesChanged(16, &before, sizeof(before));
 			}
 
 			m_destinationAddress = value;
@@ -362,5 +399,44 @@ namespace Divert
 			m_destinationAddress = System::Net::IPAddress::Any;
 		}
 
+		bool IPHeader::IncrementalChecksums::get()
+		{
+			return m_incrementalChecksums;
+		}
+
+		void IPHeader::IncrementalChecksums::set(bool value)
+		{
+			m_incrementalChecksums = value;
+		}
+
+		void IPHeader::SetTransportChecksum(uint16_t* checksum, bool zeroMeansNone)
+		{
+			m_transportChecksum = checksum;
+			m_transportChecksumOptional = zeroMeansNone;
+		}
+
+		uint16_t IPHeader::WordAt(uint32_t offset)
+		{
+			uint16_t word;
+			std::memcpy(&word, reinterpret_cast<uint8_t*>(m_ipHeader) + offset, sizeof(word));
+			return word;
+		}
+
+		void IPHeader::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
+		{
+			if (m_incrementalChecksums)
+			{
+				const uint8_t* after = reinterpret_cast<uint8_t*>(m_ipHeader) + offset;
+
+				Native::UpdateChecksum(&m_ipHeader->Checksum, before, after, length, false);
+
+				// The addresses are also covered by the transport checksum, through its pseudo header.
+				if (offset >= 12 && m_transportChecksum != nullptr)
+				{
+					Native::UpdateChecksum(m_transportChecksum, before, after, length, m_transportChecksumOptional);
+				}
+			}
+		}
+
 	} /* namespace Net */
 } /* namespace Divert */
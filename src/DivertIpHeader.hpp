@@ -177,6 +177,31 @@ namespace Divert
 				void set(PWINDIVERT_IPHDR value);
 			}
 
+			/// <summary>
+			/// When set, each setter folds its change into the header checksum as per RFC 1624, and
+			/// changes to the addresses and protocol into the checksum of the transport header as
+			/// well, through its pseudo header, so the packet doesn't need a full
+			/// Diversion::CalculateChecksums afterwards. Set by Diversion::ParsePacket from
+			/// Diversion::IncrementalChecksums.
+			/// </summary>
+			property bool IncrementalChecksums
+			{
+				bool get();
+				void set(bool value);
+			}
+
+			/// <summary>
+			/// Tells this header where the checksum of the transport header that follows it is, if
+			/// that checksum covers the addresses through a pseudo header.
+			/// </summary>
+			/// <param name="checksum">
+			/// The TCP, UDP or ICMPv6 checksum field, or nullptr if there is none.
+			/// </param>
+			/// <param name="zeroMeansNone">
+			/// True for UDP, where a zero checksum means there is none.
+			/// </param>
+			void SetTransportChecksum(uint16_t* checksum, bool zeroMeansNone);
+
 		private:
 
 			/// <summary>
@@ -213,6 +238,32 @@ namespace Divert
 			/// </summary>
 			PWINDIVERT_IPHDR m_ipHeader = nullptr;	
 
+			/// <summary>
+			/// Reads the 16 bit word at the given offset into the header, in memory order.
+			/// </summary>
+			uint16_t WordAt(uint32_t offset);
+
+			/// <summary>
+			/// Called by the setters after changing bytes covered by a checksum, with a copy of the
+			/// bytes as they were. Does nothing unless IncrementalChecksums is set.
+			/// </summary>
+			void ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length);
+
+			/// <summary>
+			/// Whether the setters update the checksums.
+			/// </summary>
+			bool m_incrementalChecksums = false;
+
+			/// <summary>
+			/// The checksum of the transport header that covers the addresses, if any.
+			/// </summary>
+			uint16_t* m_transportChecksum = nullptr;
+
+			/// <summary>
+			/// Whether a zero m_transportChecksum means there is none.
+			/// </summary>
+			bool m_transportChecksumOptional = false;
+
 			/// <summary>
 			/// There's some special initialization required, regardless of constructor. Rather than
 			/// duplicate the code, wrap it up in an init method and call it in all constructors.
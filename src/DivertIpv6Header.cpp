@@ -25,6 +25,8 @@
 #include "DivertIPv6Header.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -222,10 +224,15 @@ namespace Divert
 
 			if (m_ipv6Header != nullptr)
 			{
+				UINT32 before[4];
+				std::memcpy(before, m_ipv6Header->SrcAddr, sizeof(before));
+
 				m_ipv6Header->SrcAddr[0] = m_lastSrcAddr[0];
 				m_ipv6Header->SrcAddr[1] = m_lastSrcAddr[1];
 				m_ipv6Header->SrcAddr[2] = m_lastSrcAddr[2];
 				m_ipv6Header->SrcAddr[3] = m_lastSrcAddr[3];
+
+				ChecksummedBytesChanged(8, before, sizeof(before));
 			}			
 
 			m_sourceAddress = value;
@@ -270,10 +277,15 @@ namespace Divert
 
 			if (m_ipv6Header != nullptr)
 			{
+				UINT32 before[4];
+				std::memcpy(before, m_ipv6Header->DstAddr, sizeof(before));
+
 				m_ipv6Header->DstAddr[0] = m_lastDstAddr[0];
 				m_ipv6Header->DstAddr[1] = m_lastDstAddr[1];
 				m_ipv6Header->DstAddr[2] = m_lastDstAddr[2];
 				m_ipv6Header->DstAddr[3] = m_lastDstAddr[3];
+
+				ChecksummedBytesChanged(24, before, sizeof(before));
 			}
 
 			m_destinationAddress = value;
@@ -315,5 +327,32 @@ namespace Divert
 			m_destinationAddress = System::Net::IPAddress::Any;
 		}
 
+		bool IPv6Header::IncrementalChecksums::get()
+		{
+			return m_incrementalChecksums;
+		}
+
+		void IPv6Header::IncrementalChecksums::set(bool value)
+		{
+			m_incrementalChecksums = value;
+		}
+
+		void IPv6Header::SetTransportChecksum(uint16_t* checksum, bool zeroMeansNone)
+		{
+			m_transportChecksum = checksum;
+			m_transportChecksumOptional = zeroMeansNone;
+		}
+
+		void IPv6Header::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
+		{
+			// There is no IPv6 header checksum, only the transport checksum covers the addresses.
+			if (m_incrementalChecksums && m_transportChecksum != nullptr)
+			{
+				const uint8_t* after = reinterpret_cast<uint8_t*>(m_ipv6Header) + offset;
+
+				Native::UpdateChecksum(m_transportChecksum, before, after, length, m_transportChecksumOptional);
+			}
+		}
+
 	} /* namespace Net */
 } /* namespace Divert */
@@ -143,6 +143,30 @@ namespace Divert
 				void set(PWINDIVERT_IPV6HDR value);
 			}
 
+			/// <summary>
+			/// When set, the address setters fold their change into the checksum of the transport
+			/// header as per RFC 1624, since the addresses are covered by its pseudo header, so the
+			/// packet doesn't need a full Diversion::CalculateChecksums afterwards. Set by
+			/// Diversion::ParsePacket from Diversion::IncrementalChecksums.
+			/// </summary>
+			property bool IncrementalChecksums
+			{
+				bool get();
+				void set(bool value);
+			}
+
+			/// <summary>
+			/// Tells this header where the checksum of the transport header that follows it is, if
+			/// that checksum covers the addresses through a pseudo header.
+			/// </summary>
+			/// <param name="checksum">
+			/// The TCP, UDP or ICMPv6 checksum field, or nullptr if there is none.
+			/// </param>
+			/// <param name="zeroMeansNone">
+			/// True for UDP, where a zero checksum means there is none.
+			/// </param>
+			void SetTransportChecksum(uint16_t* checksum, bool zeroMeansNone);
+
 		private:
 
 			/// <summary>
@@ -179,6 +203,27 @@ namespace Divert
 			/// </summary>
 			PWINDIVERT_IPV6HDR m_ipv6Header = nullptr;
 
+			/// <summary>
+			/// Called by the setters after changing bytes covered by a checksum, with a copy of the
+			/// bytes as they were. Does nothing unless IncrementalChecksums is set.
+			/// </summary>
+			void ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length);
+
+			/// <summary>
+			/// Whether the setters update the checksums.
+			/// </summary>
+			bool m_incrementalChecksums = false;
+
+			/// <summary>
+			/// The checksum of the transport header that covers the addresses, if any.
+			/// </summary>
+			uint16_t* m_transportChecksum = nullptr;
+
+			/// <summary>
+			/// Whether a zero m_transportChecksum means there is none.
+			/// </summary>
+			bool m_transportChecksumOptional = false;
+
 			/// <summary>
 			/// There's some special initialization required, regardless of constructor. Rather than
 			/// duplicate the code, wrap it up in an init method and call it in all constructors.
@@ -0,0 +1,116 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+// Shared definitions for the unmanaged side of the library. Anything that is meant to run purely
+// native (batched I/O loops, engines driven by native threads, etc) includes this header rather
+// than windivert.h directly, so that the same code can also be built outside of the CLR, and
+// outside of Windows, against simulated packet sources.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#ifdef _WIN32
+	#include <windivert.h>
+#else
+	#include <cerrno>
+
+	// Minimal stand-in for the WinDivert definitions that the native engines depend on. Layout
+	// matches WINDIVERT_ADDRESS from WinDivert 1.x.
+	typedef struct
+	{
+		uint32_t IfIdx;
+		uint32_t SubIfIdx;
+		uint8_t  Direction;
+	} WINDIVERT_ADDRESS, *PWINDIVERT_ADDRESS;
+
+	#define WINDIVERT_DIRECTION_OUTBOUND 0
+	#define WINDIVERT_DIRECTION_INBOUND 1
+
+	// Stand-in for the Win32 OVERLAPPED structure. Outside of Windows nothing reads the fields,
+	// it only has to be something the completion machinery can hand back out.
+	typedef struct
+	{
+		uintptr_t Internal;
+		uintptr_t InternalHigh;
+		uint32_t  Offset;
+		uint32_t  OffsetHigh;
+		void*     hEvent;
+	} OVERLAPPED, *LPOVERLAPPED;
+#endif
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			#ifdef _WIN32
+			const int NoMoreItemsError = ERROR_NO_MORE_ITEMS;
+			const int InsufficientBufferError = ERROR_INSUFFICIENT_BUFFER;
+			const int IoPendingError = ERROR_IO_PENDING;
+			const int OperationAbortedError = ERROR_OPERATION_ABORTED;
+			const int NotSupportedError = ERROR_NOT_SUPPORTED;
+			const int InvalidParameterError = ERROR_INVALID_PARAMETER;
+			#else
+			const int NoMoreItemsError = EAGAIN;
+			const int InsufficientBufferError = ENOBUFS;
+			const int IoPendingError = EINPROGRESS;
+			const int OperationAbortedError = ECANCELED;
+			const int NotSupportedError = ENOTSUP;
+			const int InvalidParameterError = EINVAL;
+			#endif
+
+			inline void SetNativeLastError(const int error)
+			{
+				#ifdef _WIN32
+				SetLastError(static_cast<DWORD>(error));
+				#else
+				errno = error;
+				#endif
+			}
+
+			inline int GetNativeLastError()
+			{
+				#ifdef _WIN32
+				return static_cast<int>(GetLastError());
+				#else
+				return errno;
+				#endif
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,670 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeChecksum.hpp"
+
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define DIVERT_CHECKSUM_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+#elif defined(_M_ARM) || defined(_M_ARM64) || defined(__aarch64__) || defined(__ARM_NEON)
+	#define DIVERT_CHECKSUM_NEON
+	#include <arm_neon.h>
+#endif
+
+// GCC and Clang only allow intrinsics for instruction sets that are enabled for the function using
+// them. MSVC allows them anywhere, so the kernels can be built without changing the target of the
+// whole translation unit either way.
+#if defined(__GNUC__) || defined(__clang__)
+	#define DIVERT_TARGET(name) __attribute__((target(name)))
+#else
+	#define DIVERT_TARGET(name)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+
+				const uint8_t IcmpProtocol = 1;
+				const uint8_t TcpProtocol = 6;
+				const uint8_t UdpProtocol = 17;
+				const uint8_t Icmpv6Protocol = 58;
+
+				/// <summary>
+				/// The SIMD kernels accumulate 16 bit words into 32 bit lanes, which are emptied into
+				/// the 64 bit total every this many blocks, well before any lane could overflow.
+				/// </summary>
+				const size_t BlocksPerFlush = 16384;
+
+				/// <summary>
+				/// Below this many bytes, e.g. IP headers and pseudo headers, the SIMD kernels spend
+				/// more time reducing their lanes than summing, so the scalar kernel is used instead.
+				/// </summary>
+				const size_t MinimumSimdLength = 64;
+
+				/// <summary>
+				/// Adds with end around carry, so a 64 bit sum stays a valid ones' complement sum.
+				/// </summary>
+				inline uint64_t AddWithCarry(uint64_t sum, uint64_t value)
+				{
+					sum += value;
+					return sum + (sum < value ? 1 : 0);
+				}
+
+				/// <summary>
+				/// The portable kernel, also used for whatever is left over by the SIMD kernels.
+				/// </summary>
+				uint64_t SumScalar(const uint8_t* data, size_t length)
+				{
+					uint64_t sum = 0;
+
+					while (length >= 8)
+					{
+						uint64_t word;
+						std::memcpy(&word, data, sizeof(word));
+						sum = AddWithCarry(sum, word);
+						data += 8;
+						length -= 8;
+					}
+
+					uint64_t tail = 0;
+
+					while (length >= 2)
+					{
+						uint16_t word;
+						std::memcpy(&word, data, sizeof(word));
+						tail += word;
+						data += 2;
+						length -= 2;
+					}
+
+					if (length == 1)
+					{
+						uint8_t padded[2] = { data[0], 0 };
+						uint16_t word;
+						std::memcpy(&word, padded, sizeof(word));
+						tail += word;
+					}
+
+					return AddWithCarry(sum, tail);
+				}
+
+				#ifdef DIVERT_CHECKSUM_X86
+
+				DIVERT_TARGET("sse2")
+				uint64_t SumSse2(const uint8_t* data, size_t length)
+				{
+					const __m128i zero = _mm_setzero_si128();
+					uint64_t sum = 0;
+
+					while (length >= 16)
+					{
+						size_t blocks = length / 16;
+
+						if (blocks > BlocksPerFlush)
+						{
+							blocks = BlocksPerFlush;
+						}
+
+						__m128i low = zero;
+						__m128i high = zero;
+
+						for (size_t i = 0; i < blocks; ++i)
+						{
+							__m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+							low = _mm_add_epi32(low, _mm_unpacklo_epi16(words, zero));
+							high = _mm_add_epi32(high, _mm_unpackhi_epi16(words, zero));
+							data += 16;
+						}
+
+						length -= blocks * 16;
+
+						uint32_t lanes[4];
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_add_epi32(low, high));
+						sum += static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+					}
+
+					return AddWithCarry(sum, SumScalar(data, length));
+				}
+
+				DIVERT_TARGET("avx2")
+				uint64_t SumAvx2(const uint8_t* data, size_t length)
+				{
+					const __m256i zero = _mm256_setzero_si256();
+					uint64_t sum = 0;
+
+					while (length >= 32)
+					{
+						size_t blocks = length / 32;
+
+						if (blocks > BlocksPerFlush)
+						{
+							blocks = BlocksPerFlush;
+						}
+
+						__m256i low = zero;
+						__m256i high = zero;
+
+						for (size_t i = 0; i < blocks; ++i)
+						{
+							__m256i words = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+							low = _mm256_add_epi32(low, _mm256_unpacklo_epi16(words, zero));
+							high = _mm256_add_epi32(high, _mm256_unpackhi_epi16(words, zero));
+							data += 32;
+						}
+
+						length -= blocks * 32;
+
+						uint32_t lanes[8];
+						_mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), _mm256_add_epi32(low, high));
+
+						for (int i = 0; i < 8; ++i)
+						{
+							sum += lanes[i];
+						}
+					}
+
+					return AddWithCarry(sum, SumScalar(data, length));
+				}
+
+				bool CpuSupportsSse2()
+				{
+					#if defined(_M_X64) || defined(__x86_64__)
+					return true;
+					#elif defined(_MSC_VER)
+					int info[4];
+					__cpuid(info, 1);
+					return (info[3] & (1 << 26)) != 0;
+					#else
+					__builtin_cpu_init();
+					return __builtin_cpu_supports("sse2") != 0;
+					#endif
+				}
+
+				bool CpuSupportsAvx2()
+				{
+					#ifdef _MSC_VER
+					int info[4];
+					__cpuid(info, 0);
+
+					if (info[0] < 7)
+					{
+						return false;
+					}
+
+					// AVX2 also needs the operating system to save the upper halves of the YMM
+					// registers, which it advertises through OSXSAVE and XCR0.
+					__cpuid(info, 1);
+
+					if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+					{
+						return false;
+					}
+
+					__cpuidex(info, 7, 0);
+					return (info[1] & (1 << 5)) != 0;
+					#else
+					__builtin_cpu_init();
+					return __builtin_cpu_supports("avx2") != 0;
+					#endif
+				}
+
+				#endif
+
+				#ifdef DIVERT_CHECKSUM_NEON
+
+				uint64_t SumNeon(const uint8_t* data, size_t length)
+				{
+					uint64_t sum = 0;
+
+					while (length >= 16)
+					{
+						size_t blocks = length / 16;
+
+						if (blocks > BlocksPerFlush)
+						{
+							blocks = BlocksPerFlush;
+						}
+
+						uint32x4_t lanes = vdupq_n_u32(0);
+
+						for (size_t i = 0; i < blocks; ++i)
+						{
+							lanes = vpadalq_u16(lanes, vreinterpretq_u16_u8(vld1q_u8(data)));
+							data += 16;
+						}
+
+						length -= blocks * 16;
+
+						uint32_t values[4];
+						vst1q_u32(values, lanes);
+						sum += static_cast<uint64_t>(values[0]) + values[1] + values[2] + values[3];
+					}
+
+					return AddWithCarry(sum, SumScalar(data, length));
+				}
+
+				#endif
+
+				/// <summary>
+				/// The kernel in use, stored as an int so it can be switched atomically.
+				/// </summary>
+				std::atomic<int>& ActiveKernel()
+				{
+					static std::atomic<int> kernel(static_cast<int>(BestChecksumKernel()));
+					return kernel;
+				}
+
+				/// <summary>
+				/// Where the headers of a packet are, as far as checksumming is concerned.
+				/// </summary>
+				struct ChecksumLayout
+				{
+					uint8_t Version;
+					uint32_t Length;
+					uint32_t IpHeaderLength;
+					uint8_t Protocol;
+					uint32_t TransportOffset;
+				};
+
+				/// <summary>
+				/// Locates the IP header and, unless the packet is a fragment, the payload covered by
+				/// the transport checksum. Protocol is left at zero when there is no such payload.
+				/// </summary>
+				bool Locate(const uint8_t* packet, uint32_t packetLength, ChecksumLayout& layout)
+				{
+					layout = ChecksumLayout();
+
+					if (packetLength < 1)
+					{
+						return false;
+					}
+
+					layout.Version = packet[0] >> 4;
+
+					if (layout.Version == 4)
+					{
+						if (packetLength < 20)
+						{
+							return false;
+						}
+
+						layout.IpHeaderLength = static_cast<uint32_t>(packet[0] & 0x0F) * 4;
+						layout.Length = (static_cast<uint32_t>(packet[2]) << 8) | packet[3];
+
+						if (layout.IpHeaderLength < 20 || layout.Length < layout.IpHeaderLength || layout.Length > packetLength)
+						{
+							return false;
+						}
+
+						// Neither MF nor a fragment offset, so the transport payload is all here.
+						if (((packet[6] & 0x3F) | packet[7]) == 0)
+						{
+							layout.Protocol = packet[9];
+							layout.TransportOffset = layout.IpHeaderLength;
+						}
+
+						return true;
+					}
+
+					if (layout.Version != 6 || packetLength < 40)
+					{
+						return false;
+					}
+
+					layout.IpHeaderLength = 40;
+					layout.Length = 40 + ((static_cast<uint32_t>(packet[4]) << 8) | packet[5]);
+
+					if (layout.Length > packetLength)
+					{
+						return false;
+					}
+
+					uint8_t nextHeader = packet[6];
+					uint32_t offset = 40;
+
+					for (;;)
+					{
+						uint32_t headerLength = 0;
+
+						switch (nextHeader)
+						{
+							case 0:
+							case 43:
+							case 60:
+								headerLength = layout.Length - offset < 8 ? 0 : (static_cast<uint32_t>(packet[offset + 1]) + 1) * 8;
+								break;
+
+							case 51:
+								headerLength = layout.Length - offset < 8 ? 0 : (static_cast<uint32_t>(packet[offset + 1]) + 2) * 4;
+								break;
+
+							case 44:
+								// Any fragment, leading or not, only holds part of the payload.
+								return true;
+
+							default:
+								layout.Protocol = nextHeader;
+								layout.TransportOffset = offset;
+								return true;
+						}
+
+						if (headerLength == 0 || headerLength > layout.Length - offset)
+						{
+							return true;
+						}
+
+						nextHeader = packet[offset];
+						offset += headerLength;
+					}
+				}
+
+				/// <summary>
+				/// The partial sum of the pseudo header that TCP, UDP and ICMPv6 checksums include.
+				/// </summary>
+				uint64_t SumPseudoHeader(const uint8_t* packet, const ChecksumLayout& layout, uint32_t transportLength)
+				{
+					if (layout.Version == 4)
+					{
+						uint8_t trailer[4] = { 0, layout.Protocol, static_cast<uint8_t>(transportLength >> 8), static_cast<uint8_t>(transportLength) };
+						return AddWithCarry(SumBytes(packet + 12, 8), SumScalar(trailer, sizeof(trailer)));
+					}
+
+					uint8_t trailer[8] = { static_cast<uint8_t>(transportLength >> 24), static_cast<uint8_t>(transportLength >> 16), static_cast<uint8_t>(transportLength >> 8), static_cast<uint8_t>(transportLength), 0, 0, 0, layout.Protocol };
+					return AddWithCarry(SumBytes(packet + 8, 32), SumScalar(trailer, sizeof(trailer)));
+				}
+
+				/// <summary>
+				/// Replaces the checksum stored at field, which must lie within the summed bytes.
+				/// </summary>
+				/// <returns>
+				/// False if NoReplaceChecksum asked for the existing value to be kept.
+				/// </returns>
+				bool StoreChecksum(uint8_t* field, const uint8_t* data, size_t length, uint64_t initialSum, uint64_t flags, bool zeroMeansNone)
+				{
+					if ((flags & NoReplaceChecksum) != 0 && (field[0] | field[1]) != 0)
+					{
+						return false;
+					}
+
+					field[0] = 0;
+					field[1] = 0;
+
+					uint16_t checksum = FoldChecksum(AddWithCarry(initialSum, SumBytes(data, length)));
+
+					// For UDP a zero checksum means there is none, so a computed zero is sent as its
+					// ones' complement equivalent instead.
+					if (checksum == 0 && zeroMeansNone)
+					{
+						checksum = 0xFFFF;
+					}
+
+					std::memcpy(field, &checksum, sizeof(checksum));
+					return true;
+				}
+
+			}
+
+			ChecksumKernel BestChecksumKernel()
+			{
+				static const ChecksumKernel best = []()
+				{
+					#if defined(DIVERT_CHECKSUM_X86)
+					if (CpuSupportsAvx2())
+					{
+						return ChecksumKernel::Avx2;
+					}
+
+					if (CpuSupportsSse2())
+					{
+						return ChecksumKernel::Sse2;
+					}
+					#elif defined(DIVERT_CHECKSUM_NEON)
+					return ChecksumKernel::Neon;
+					#endif
+
+					return ChecksumKernel::Scalar;
+				}();
+
+				return best;
+			}
+
+			bool IsChecksumKernelSupported(ChecksumKernel kernel)
+			{
+				switch (kernel)
+				{
+					case ChecksumKernel::Scalar:
+						return true;
+
+					#if defined(DIVERT_CHECKSUM_X86)
+					case ChecksumKernel::Sse2:
+						return CpuSupportsSse2();
+
+					case ChecksumKernel::Avx2:
+						return CpuSupportsAvx2();
+					#elif defined(DIVERT_CHECKSUM_NEON)
+					case ChecksumKernel::Neon:
+						return true;
+					#endif
+
+					default:
+						return false;
+				}
+			}
+
+			ChecksumKernel ActiveChecksumKernel()
+			{
+				return static_cast<ChecksumKernel>(ActiveKernel().load(std::memory_order_relaxed));
+			}
+
+			bool SetChecksumKernel(ChecksumKernel kernel)
+			{
+				if (!IsChecksumKernelSupported(kernel))
+				{
+					return false;
+				}
+
+				ActiveKernel().store(static_cast<int>(kernel), std::memory_order_relaxed);
+				return true;
+			}
+
+			const char* ChecksumKernelName(ChecksumKernel kernel)
+			{
+				switch (kernel)
+				{
+					case ChecksumKernel::Scalar:
+						return "Scalar";
+
+					case ChecksumKernel::Sse2:
+						return "SSE2";
+
+					case ChecksumKernel::Avx2:
+						return "AVX2";
+
+					case ChecksumKernel::Neon:
+						return "NEON";
+
+					default:
+						return "Unknown";
+				}
+			}
+
+			uint64_t SumBytes(const uint8_t* data, size_t length)
+			{
+				if (length < MinimumSimdLength)
+				{
+					return SumScalar(data, length);
+				}
+
+				switch (ActiveChecksumKernel())
+				{
+					#if defined(DIVERT_CHECKSUM_X86)
+					case ChecksumKernel::Avx2:
+						return SumAvx2(data, length);
+
+					case ChecksumKernel::Sse2:
+						return SumSse2(data, length);
+					#elif defined(DIVERT_CHECKSUM_NEON)
+					case ChecksumKernel::Neon:
+						return SumNeon(data, length);
+					#endif
+
+					default:
+						return SumScalar(data, length);
+				}
+			}
+
+			uint16_t FoldChecksum(uint64_t sum)
+			{
+				sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+				sum = (sum & 0xFFFF) + (sum >> 16);
+				sum = (sum & 0xFFFF) + (sum >> 16);
+				sum = (sum & 0xFFFF) + (sum >> 16);
+				return static_cast<uint16_t>(~sum);
+			}
+
+			void UpdateChecksum(uint16_t* checksum, const void* before, const void* after, size_t length, bool zeroMeansNone)
+			{
+				if (zeroMeansNone && *checksum == 0)
+				{
+					return;
+				}
+
+				const uint8_t* beforeBytes = static_cast<const uint8_t*>(before);
+				const uint8_t* afterBytes = static_cast<const uint8_t*>(after);
+
+				// HC' = ~(~HC + ~m + m'), where FoldChecksum supplies the outer complement.
+				uint64_t sum = static_cast<uint16_t>(~*checksum);
+
+				for (size_t i = 0; i + 1 < length; i += 2)
+				{
+					uint16_t oldWord;
+					uint16_t newWord;
+					std::memcpy(&oldWord, beforeBytes + i, sizeof(oldWord));
+					std::memcpy(&newWord, afterBytes + i, sizeof(newWord));
+					sum += static_cast<uint16_t>(~oldWord);
+					sum += newWord;
+				}
+
+				uint16_t updated = FoldChecksum(sum);
+
+				if (updated == 0 && zeroMeansNone)
+				{
+					updated = 0xFFFF;
+				}
+
+				*checksum = updated;
+			}
+
+			uint32_t CalculateChecksums(uint8_t* packet, uint32_t packetLength, uint64_t flags)
+			{
+				ChecksumLayout layout;
+
+				if (packet == nullptr || !Locate(packet, packetLength, layout))
+				{
+					return 0;
+				}
+
+				uint32_t calculated = 0;
+
+				if (layout.Version == 4 && (flags & NoIpChecksum) == 0)
+				{
+					if (StoreChecksum(packet + 10, packet, layout.IpHeaderLength, 0, flags, false))
+					{
+						++calculated;
+					}
+				}
+
+				uint8_t* transport = packet + layout.TransportOffset;
+				uint32_t transportLength = layout.Length - layout.TransportOffset;
+
+				switch (layout.Protocol)
+				{
+					case IcmpProtocol:
+					{
+						if (layout.Version == 4 && transportLength >= 8 && (flags & NoIcmpChecksum) == 0)
+						{
+							if (StoreChecksum(transport + 2, transport, transportLength, 0, flags, false))
+							{
+								++calculated;
+							}
+						}
+					}
+					break;
+
+					case Icmpv6Protocol:
+					{
+						if (layout.Version == 6 && transportLength >= 8 && (flags & NoIcmpV6Checksum) == 0)
+						{
+							if (StoreChecksum(transport + 2, transport, transportLength, SumPseudoHeader(packet, layout, transportLength), flags, false))
+							{
+								++calculated;
+							}
+						}
+					}
+					break;
+
+					case TcpProtocol:
+					{
+						uint32_t headerLength = transportLength >= 20 ? static_cast<uint32_t>(transport[12] >> 4) * 4 : 0;
+
+						if (headerLength >= 20 && headerLength <= transportLength && (flags & NoTcpChecksum) == 0)
+						{
+							if (StoreChecksum(transport + 16, transport, transportLength, SumPseudoHeader(packet, layout, transportLength), flags, false))
+							{
+								++calculated;
+							}
+						}
+					}
+					break;
+
+					case UdpProtocol:
+					{
+						if (transportLength >= 8 && (flags & NoUdpChecksum) == 0)
+						{
+							if (StoreChecksum(transport + 6, transport, transportLength, SumPseudoHeader(packet, layout, transportLength), flags, true))
+							{
+								++calculated;
+							}
+						}
+					}
+					break;
+				}
+
+				return calculated;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
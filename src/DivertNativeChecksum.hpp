@@ -0,0 +1,173 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Mirrors ChecksumCalculationFlags, which in turn mirrors the WINDIVERT_HELPER_NO_*
+			/// flags accepted by WinDivertHelperCalcChecksums.
+			/// </summary>
+			enum ChecksumFlags : uint64_t
+			{
+				NoIpChecksum = 1,
+				NoIcmpChecksum = 2,
+				NoIcmpV6Checksum = 4,
+				NoTcpChecksum = 8,
+				NoUdpChecksum = 16,
+				NoReplaceChecksum = 2048
+			};
+
+			/// <summary>
+			/// The implementations of the ones' complement sum at the heart of every checksum.
+			/// </summary>
+			enum class ChecksumKernel
+			{
+				/// <summary>
+				/// Portable C++, 32 bits at a time into a 64 bit accumulator.
+				/// </summary>
+				Scalar,
+
+				/// <summary>
+				/// 16 bytes at a time, available on every x64 processor.
+				/// </summary>
+				Sse2,
+
+				/// <summary>
+				/// 32 bytes at a time, on x86/x64 processors and operating systems that support it.
+				/// </summary>
+				Avx2,
+
+				/// <summary>
+				/// 16 bytes at a time, on ARM processors.
+				/// </summary>
+				Neon
+			};
+
+			/// <summary>
+			/// The fastest kernel supported by the processor this is running on. Determined once.
+			/// </summary>
+			ChecksumKernel BestChecksumKernel();
+
+			/// <summary>
+			/// Whether the given kernel was compiled in and is supported by this processor.
+			/// </summary>
+			bool IsChecksumKernelSupported(ChecksumKernel kernel);
+
+			/// <summary>
+			/// The kernel used by SumBytes and CalculateChecksums. Defaults to BestChecksumKernel.
+			/// </summary>
+			ChecksumKernel ActiveChecksumKernel();
+
+			/// <summary>
+			/// Switches the kernel used by SumBytes and CalculateChecksums, mostly so that kernels can
+			/// be compared against each other. Safe to call while checksums are being calculated.
+			/// </summary>
+			/// <returns>
+			/// False, with nothing changed, if the kernel is not supported.
+			/// </returns>
+			bool SetChecksumKernel(ChecksumKernel kernel);
+
+			/// <summary>
+			/// A printable name for a kernel.
+			/// </summary>
+			const char* ChecksumKernelName(ChecksumKernel kernel);
+
+			/// <summary>
+			/// Ones' complement sums the given bytes as a sequence of 16 bit words in memory order,
+			/// padding an odd trailing byte with zero. The result is not folded, pass it, plus any
+			/// other partial sums, to FoldChecksum.
+			/// </summary>
+			uint64_t SumBytes(const uint8_t* data, size_t length);
+
+			/// <summary>
+			/// Folds a partial sum from SumBytes down to 16 bits and complements it. The result is in
+			/// memory order, ready to be stored into a checksum field as is.
+			/// </summary>
+			uint16_t FoldChecksum(uint64_t sum);
+
+			/// <summary>
+			/// Updates a checksum for a change to some of the bytes it covers, as per RFC 1624
+			/// equation 3, so that nothing but the changed bytes has to be summed.
+			/// </summary>
+			/// <param name="checksum">
+			/// The checksum field to update, in place in the packet.
+			/// </param>
+			/// <param name="before">
+			/// The changed bytes as they were. The change must start at an even offset from the
+			/// start of the checksummed data, so that the bytes line up with its 16 bit words.
+			/// </param>
+			/// <param name="after">
+			/// The changed bytes as they are now.
+			/// </param>
+			/// <param name="length">
+			/// The number of changed bytes. Must be even.
+			/// </param>
+			/// <param name="zeroMeansNone">
+			/// True for UDP, where a zero checksum means there is none. Such a checksum is left at
+			/// zero, and an updated checksum of zero is stored as 0xFFFF instead.
+			/// </param>
+			void UpdateChecksum(uint16_t* checksum, const void* before, const void* after, size_t length, bool zeroMeansNone);
+
+			/// <summary>
+			/// Native replacement for WinDivertHelperCalcChecksums. Recalculates the IPv4 header
+			/// checksum and the ICMP, ICMPv6, TCP or UDP checksum of the packet, skipping any that
+			/// are disabled by the flags.
+			/// 
+			/// Transport checksums of IPv4 and IPv6 fragments are left alone, since they cover data
+			/// that isn't in the packet.
+			/// </summary>
+			/// <param name="packet">
+			/// The packet, starting with its IP header.
+			/// </param>
+			/// <param name="packetLength">
+			/// The number of valid bytes at packet.
+			/// </param>
+			/// <param name="flags">
+			/// Any combination of ChecksumFlags.
+			/// </param>
+			/// <returns>
+			/// The number of checksums calculated, zero for a malformed packet.
+			/// </returns>
+			uint32_t CalculateChecksums(uint8_t* packet, uint32_t packetLength, uint64_t flags);
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,279 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeChecksumBatch.hpp"
+#include "DivertNativeChecksum.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+
+				/// <summary>
+				/// One batch, shared by every thread working on it. Threads claim chunks of packets
+				/// from Next until there are none left, so a thread that drew small packets simply
+				/// claims more chunks.
+				/// </summary>
+				struct BatchJob
+				{
+					uint8_t* Buffer;
+					uint64_t BufferLength;
+					const uint32_t* Offsets;
+					const uint32_t* Lengths;
+					uint32_t Count;
+					uint64_t Flags;
+					uint32_t ChunkSize;
+					std::atomic<uint32_t> Next;
+					std::atomic<uint64_t> Calculated;
+				};
+
+				void Work(BatchJob& job)
+				{
+					uint64_t calculated = 0;
+
+					for (;;)
+					{
+						const uint32_t first = job.Next.fetch_add(job.ChunkSize, std::memory_order_relaxed);
+
+						if (first >= job.Count)
+						{
+							break;
+						}
+
+						const uint32_t last = std::min(job.Count, first + job.ChunkSize);
+
+						for (uint32_t i = first; i < last; ++i)
+						{
+							const uint64_t offset = job.Offsets[i];
+							const uint64_t length = job.Lengths[i];
+
+							if (offset + length <= job.BufferLength)
+							{
+								calculated += CalculateChecksums(job.Buffer + offset, static_cast<uint32_t>(length), job.Flags);
+							}
+						}
+					}
+
+					job.Calculated.fetch_add(calculated, std::memory_order_relaxed);
+				}
+
+			}
+
+			struct ChecksumBatchPool::State
+			{
+				/// <summary>
+				/// Held by whichever caller currently has the workers.
+				/// </summary>
+				std::mutex RunMutex;
+
+				/// <summary>
+				/// Guards everything below.
+				/// </summary>
+				std::mutex Mutex;
+
+				std::condition_variable Wake;
+
+				std::condition_variable Done;
+
+				std::vector<std::thread> Threads;
+
+				/// <summary>
+				/// The batch being worked on, if any.
+				/// </summary>
+				BatchJob* Job = nullptr;
+
+				/// <summary>
+				/// How many more workers may join the current batch.
+				/// </summary>
+				uint32_t Openings = 0;
+
+				/// <summary>
+				/// How many workers are inside the current batch.
+				/// </summary>
+				uint32_t Active = 0;
+
+				bool StopRequested = false;
+
+				void Run()
+				{
+					std::unique_lock<std::mutex> lock(Mutex);
+
+					for (;;)
+					{
+						Wake.wait(lock, [this]()
+						{
+							return StopRequested || (Job != nullptr && Openings > 0);
+						});
+
+						if (StopRequested)
+						{
+							break;
+						}
+
+						--Openings;
+						++Active;
+
+						BatchJob* job = Job;
+
+						lock.unlock();
+						Work(*job);
+						lock.lock();
+
+						if (--Active == 0)
+						{
+							Done.notify_all();
+						}
+					}
+				}
+			};
+
+			ChecksumBatchPool& ChecksumBatchPool::Shared()
+			{
+				static ChecksumBatchPool* shared = new ChecksumBatchPool();
+				return *shared;
+			}
+
+			ChecksumBatchPool::ChecksumBatchPool() : m_state(new State())
+			{
+
+			}
+
+			ChecksumBatchPool::~ChecksumBatchPool()
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_state->Mutex);
+					m_state->StopRequested = true;
+				}
+
+				m_state->Wake.notify_all();
+
+				for (std::thread& thread : m_state->Threads)
+				{
+					thread.join();
+				}
+
+				delete m_state;
+			}
+
+			uint64_t ChecksumBatchPool::CalculateChecksums(uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, uint32_t count, uint64_t flags, uint32_t threads)
+			{
+				if (buffer == nullptr || offsets == nullptr || lengths == nullptr || count == 0)
+				{
+					return 0;
+				}
+
+				if (threads == 0)
+				{
+					uint64_t totalLength = 0;
+
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						totalLength += lengths[i];
+					}
+
+					const uint32_t processors = std::max(1u, std::thread::hardware_concurrency());
+					threads = static_cast<uint32_t>(std::min<uint64_t>(processors, 1 + totalLength / MinimumBytesPerThread));
+				}
+
+				threads = std::min(std::min(threads, static_cast<uint32_t>(MaximumThreads)), count);
+
+				BatchJob job;
+				job.Buffer = buffer;
+				job.BufferLength = bufferLength;
+				job.Offsets = offsets;
+				job.Lengths = lengths;
+				job.Count = count;
+				job.Flags = flags;
+				job.Next.store(0);
+				job.Calculated.store(0);
+
+				std::unique_lock<std::mutex> runLock(m_state->RunMutex, std::defer_lock);
+
+				// Someone else has the workers, or none are wanted.
+				if (threads <= 1 || !runLock.try_lock())
+				{
+					job.ChunkSize = count;
+					Work(job);
+					return job.Calculated.load();
+				}
+
+				// Enough chunks per thread to even out packets of different sizes, but not so many
+				// that the threads spend their time contending on Next.
+				job.ChunkSize = std::max(1u, count / (threads * 8));
+
+				{
+					std::lock_guard<std::mutex> lock(m_state->Mutex);
+
+					while (m_state->Threads.size() < threads - 1)
+					{
+						m_state->Threads.emplace_back([this]()
+						{
+							m_state->Run();
+						});
+					}
+
+					m_state->Job = &job;
+					m_state->Openings = threads - 1;
+				}
+
+				m_state->Wake.notify_all();
+
+				Work(job);
+
+				{
+					// Workers that haven't joined yet would find nothing left to do, so don't let them.
+					std::unique_lock<std::mutex> lock(m_state->Mutex);
+					m_state->Openings = 0;
+					m_state->Job = nullptr;
+
+					m_state->Done.wait(lock, [this]()
+					{
+						return m_state->Active == 0;
+					});
+				}
+
+				return job.Calculated.load();
+			}
+
+			uint32_t ChecksumBatchPool::WorkerCount() const
+			{
+				std::lock_guard<std::mutex> lock(m_state->Mutex);
+				return static_cast<uint32_t>(m_state->Threads.size());
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,135 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Recalculates the checksums of many packets packed into one buffer in a single call,
+			/// optionally splitting the work across a set of worker threads that is kept around
+			/// between calls. Only one batch at a time is spread across the workers. A batch that
+			/// arrives while the workers are busy is done entirely on the calling thread, so callers
+			/// never wait on each other.
+			/// </summary>
+			class ChecksumBatchPool
+			{
+
+			public:
+
+				/// <summary>
+				/// The most threads a single batch will be split across, counting the caller.
+				/// </summary>
+				static const uint32_t MaximumThreads = 64;
+
+				/// <summary>
+				/// When the thread count is left to the pool, each thread is given at least this many
+				/// bytes to checksum, since handing work to another thread costs a few microseconds.
+				/// </summary>
+				static const uint32_t MinimumBytesPerThread = 256 * 1024;
+
+				/// <summary>
+				/// The pool used by Diversion::CalculateChecksumsBatch.
+				/// </summary>
+				static ChecksumBatchPool& Shared();
+
+				ChecksumBatchPool();
+
+				/// <summary>
+				/// Stops and joins the workers.
+				/// </summary>
+				~ChecksumBatchPool();
+
+				/// <summary>
+				/// Recalculates the checksums of every packet in the batch, as CalculateChecksums does
+				/// for a single packet.
+				/// </summary>
+				/// <param name="buffer">
+				/// The packed buffer.
+				/// </param>
+				/// <param name="bufferLength">
+				/// The length of the buffer. Packets that don't lie entirely within it are skipped.
+				/// </param>
+				/// <param name="offsets">
+				/// The offset of each packet in the buffer.
+				/// </param>
+				/// <param name="lengths">
+				/// The length of each packet.
+				/// </param>
+				/// <param name="count">
+				/// The number of packets.
+				/// </param>
+				/// <param name="flags">
+				/// Any combination of ChecksumFlags, applied to every packet.
+				/// </param>
+				/// <param name="threads">
+				/// The number of threads to split the batch across, counting the caller, capped at
+				/// MaximumThreads and at the number of packets. Zero picks a count from the size of
+				/// the batch and the number of processors.
+				/// </param>
+				/// <returns>
+				/// The total number of checksums calculated.
+				/// </returns>
+				uint64_t CalculateChecksums(uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, uint32_t count, uint64_t flags, uint32_t threads);
+
+				/// <summary>
+				/// The number of worker threads started so far. Workers are started as batches ask
+				/// for them, and kept until the pool is destroyed.
+				/// </summary>
+				uint32_t WorkerCount() const;
+
+			private:
+
+				ChecksumBatchPool(const ChecksumBatchPool&) = delete;
+
+				ChecksumBatchPool& operator=(const ChecksumBatchPool&) = delete;
+
+				/// <summary>
+				/// The workers and their signalling live here, so that this header stays usable from
+				/// managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,2073 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeFilter.hpp"
+#include "DivertNativeFilterSyntax.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+	#define DIVERT_FILTER_SSE2
+	#include <emmintrin.h>
+#elif defined(_M_ARM64) || defined(__aarch64__)
+	#define DIVERT_FILTER_NEON
+	#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+// Field loads are written once, as a switch on the field, and forced inline so that the
+// specialized backend gets a copy with the switch folded away for each field.
+#ifdef _MSC_VER
+	#define DIVERT_FORCE_INLINE __forceinline
+#else
+	#define DIVERT_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			using namespace FilterSyntax;
+
+			namespace
+			{
+				/// <summary>
+				/// Jump targets that end evaluation.
+				/// </summary>
+				const uint16_t Accept = 0xFFFF;
+				const uint16_t Reject = 0xFFFE;
+
+				const uint32_t MaximumInstructions = 0xFFF0;
+
+				/// <summary>
+				/// How deeply parentheses, not and (a? b: c) may nest, which bounds the recursion of
+				/// the parser.
+				/// </summary>
+				const uint32_t MaximumDepth = 256;
+
+				struct Instruction
+				{
+					FieldId Field;
+
+					Comparison Test;
+
+					/// <summary>
+					/// Set when the field or constant needs more than 32 bits, so that the test must
+					/// compare all of Constant.
+					/// </summary>
+					bool Wide;
+
+					uint16_t Success;
+
+					uint16_t Failure;
+
+					Value Constant;
+				};
+
+				/// <summary>
+				/// The headers of a packet being evaluated. Headers the packet doesn't have are null.
+				/// </summary>
+				struct Headers
+				{
+					const WINDIVERT_ADDRESS* Address;
+
+					const uint8_t* Ip;
+
+					const uint8_t* Ipv6;
+
+					const uint8_t* Icmp;
+
+					const uint8_t* Icmpv6;
+
+					const uint8_t* Tcp;
+
+					const uint8_t* Udp;
+
+					uint32_t PayloadLength;
+				};
+
+				inline uint32_t ReadUInt16(const uint8_t* data)
+				{
+					return (static_cast<uint32_t>(data[0]) << 8) | data[1];
+				}
+
+				inline uint32_t ReadUInt32(const uint8_t* data)
+				{
+					return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+				}
+
+				/// <summary>
+				/// Finds the headers of a packet, the same way PacketView::Parse does. Transport
+				/// headers are only found in unfragmented packets and leading fragments.
+				/// </summary>
+				void Locate(const uint8_t* packet, uint32_t packetLength, const WINDIVERT_ADDRESS* address, Headers& headers)
+				{
+					headers = Headers();
+					headers.Address = address;
+
+					if (packetLength < 1)
+					{
+						return;
+					}
+
+					uint32_t length = 0;
+					uint32_t offset = 0;
+					uint8_t protocol = 0;
+
+					switch (packet[0] >> 4)
+					{
+						case 4:
+						{
+							if (packetLength < 20)
+							{
+								return;
+							}
+
+							offset = static_cast<uint32_t>(packet[0] & 0x0F) * 4;
+							length = ReadUInt16(packet + 2);
+
+							if (offset < 20 || length < offset || length > packetLength)
+							{
+								return;
+							}
+
+							headers.Ip = packet;
+
+							if ((ReadUInt16(packet + 6) & 0x1FFF) == 0)
+							{
+								protocol = packet[9];
+							}
+						}
+						break;
+
+						case 6:
+						{
+							if (packetLength < 40)
+							{
+								return;
+							}
+
+							length = 40 + ReadUInt16(packet + 4);
+
+							if (length > packetLength)
+							{
+								return;
+							}
+
+							headers.Ipv6 = packet;
+							offset = 40;
+							protocol = packet[6];
+
+							// Skip extension headers, giving up on anything malformed or on a
+							// fragment other than the first.
+							for (bool skipping = true; skipping;)
+							{
+								uint32_t headerLength = 0;
+
+								switch (protocol)
+								{
+									case 0:
+									case 43:
+									case 60:
+										headerLength = length - offset < 8 ? 0 : (static_cast<uint32_t>(packet[offset + 1]) + 1) * 8;
+										break;
+
+									case 51:
+										headerLength = length - offset < 8 ? 0 : (static_cast<uint32_t>(packet[offset + 1]) + 2) * 4;
+										break;
+
+									case 44:
+										headerLength = length - offset < 8 || (ReadUInt16(packet + offset + 2) & 0xFFF8) != 0 ? 0 : 8;
+										break;
+
+									default:
+										skipping = false;
+										continue;
+								}
+
+								if (headerLength == 0 || headerLength > length - offset)
+								{
+									return;
+								}
+
+								protocol = packet[offset];
+								offset += headerLength;
+							}
+						}
+						break;
+
+						default:
+							return;
+					}
+
+					const uint8_t* transport = packet + offset;
+					const uint32_t remaining = length - offset;
+
+					switch (protocol)
+					{
+						case 1:
+						{
+							if (headers.Ip != nullptr && remaining >= 8)
+							{
+								headers.Icmp = transport;
+							}
+						}
+						break;
+
+						case 58:
+						{
+							if (headers.Ipv6 != nullptr && remaining >= 8)
+							{
+								headers.Icmpv6 = transport;
+							}
+						}
+						break;
+
+						case 6:
+						{
+							if (remaining >= 20)
+							{
+								const uint32_t headerLength = static_cast<uint32_t>(transport[12] >> 4) * 4;
+
+								if (headerLength >= 20 && headerLength <= remaining)
+								{
+									headers.Tcp = transport;
+									headers.PayloadLength = remaining - headerLength;
+								}
+							}
+						}
+						break;
+
+						case 17:
+						{
+							if (remaining >= 8)
+							{
+								headers.Udp = transport;
+								headers.PayloadLength = remaining - 8;
+							}
+						}
+						break;
+					}
+				}
+
+				/// <summary>
+				/// Reads a field of up to 32 bits. Returns false if the packet lacks the header the
+				/// field belongs to.
+				/// </summary>
+				DIVERT_FORCE_INLINE bool Load(FieldId field, const Headers& headers, uint32_t& value)
+				{
+					switch (field)
+					{
+						case FieldId::Inbound:
+							value = headers.Address != nullptr && headers.Address->Direction == WINDIVERT_DIRECTION_INBOUND;
+							return headers.Address != nullptr;
+
+						case FieldId::Outbound:
+							value = headers.Address != nullptr && headers.Address->Direction == WINDIVERT_DIRECTION_OUTBOUND;
+							return headers.Address != nullptr;
+
+						case FieldId::IfIdx:
+							value = headers.Address != nullptr ? headers.Address->IfIdx : 0;
+							return headers.Address != nullptr;
+
+						case FieldId::SubIfIdx:
+							value = headers.Address != nullptr ? headers.Address->SubIfIdx : 0;
+							return headers.Address != nullptr;
+
+						case FieldId::Ip:
+							value = headers.Ip != nullptr;
+							return true;
+
+						case FieldId::Ipv6:
+							value = headers.Ipv6 != nullptr;
+							return true;
+
+						case FieldId::Icmp:
+							value = headers.Icmp != nullptr;
+							return true;
+
+						case FieldId::Icmpv6:
+							value = headers.Icmpv6 != nullptr;
+							return true;
+
+						case FieldId::Tcp:
+							value = headers.Tcp != nullptr;
+							return true;
+
+						case FieldId::Udp:
+							value = headers.Udp != nullptr;
+							return true;
+
+						default:
+							break;
+					}
+
+					if (field >= FieldId::IpHdrLength && field <= FieldId::IpDstAddr)
+					{
+						const uint8_t* ip = headers.Ip;
+
+						if (ip == nullptr)
+						{
+							return false;
+						}
+
+						switch (field)
+						{
+							case FieldId::IpHdrLength: value = ip[0] & 0x0F; break;
+							case FieldId::IpTos: value = ip[1]; break;
+							case FieldId::IpLength: value = ReadUInt16(ip + 2); break;
+							case FieldId::IpId: value = ReadUInt16(ip + 4); break;
+							case FieldId::IpDf: value = (ip[6] >> 6) & 1; break;
+							case FieldId::IpMf: value = (ip[6] >> 5) & 1; break;
+							case FieldId::IpFragOff: value = ReadUInt16(ip + 6) & 0x1FFF; break;
+							case FieldId::IpTtl: value = ip[8]; break;
+							case FieldId::IpProtocol: value = ip[9]; break;
+							case FieldId::IpChecksum: value = ReadUInt16(ip + 10); break;
+							case FieldId::IpSrcAddr: value = ReadUInt32(ip + 12); break;
+							default: value = ReadUInt32(ip + 16); break;
+						}
+
+						return true;
+					}
+
+					if (field >= FieldId::Ipv6TrafficClass && field <= FieldId::Ipv6HopLimit)
+					{
+						const uint8_t* ipv6 = headers.Ipv6;
+
+						if (ipv6 == nullptr)
+						{
+							return false;
+						}
+
+						switch (field)
+						{
+							case FieldId::Ipv6TrafficClass: value = ((ipv6[0] & 0x0F) << 4) | (ipv6[1] >> 4); break;
+							case FieldId::Ipv6FlowLabel: value = ReadUInt32(ipv6) & 0x000FFFFF; break;
+							case FieldId::Ipv6Length: value = ReadUInt16(ipv6 + 4); break;
+							case FieldId::Ipv6NextHdr: value = ipv6[6]; break;
+							default: value = ipv6[7]; break;
+						}
+
+						return true;
+					}
+
+					if (field >= FieldId::IcmpType && field <= FieldId::Icmpv6Body)
+					{
+						const bool v6 = field >= FieldId::Icmpv6Type;
+						const uint8_t* icmp = v6 ? headers.Icmpv6 : headers.Icmp;
+
+						if (icmp == nullptr)
+						{
+							return false;
+						}
+
+						switch (v6 ? static_cast<int>(field) - static_cast<int>(FieldId::Icmpv6Type) : static_cast<int>(field) - static_cast<int>(FieldId::IcmpType))
+						{
+							case 0: value = icmp[0]; break;
+							case 1: value = icmp[1]; break;
+							case 2: value = ReadUInt16(icmp + 2); break;
+							default: value = ReadUInt32(icmp + 4); break;
+						}
+
+						return true;
+					}
+
+					if (field >= FieldId::TcpSrcPort && field <= FieldId::TcpPayloadLength)
+					{
+						const uint8_t* tcp = headers.Tcp;
+
+						if (tcp == nullptr)
+						{
+							return false;
+						}
+
+						switch (field)
+						{
+							case FieldId::TcpSrcPort: value = ReadUInt16(tcp); break;
+							case FieldId::TcpDstPort: value = ReadUInt16(tcp + 2); break;
+							case FieldId::TcpSeqNum: value = ReadUInt32(tcp + 4); break;
+							case FieldId::TcpAckNum: value = ReadUInt32(tcp + 8); break;
+							case FieldId::TcpHdrLength: value = tcp[12] >> 4; break;
+							case FieldId::TcpUrg: value = (tcp[13] >> 5) & 1; break;
+							case FieldId::TcpAck: value = (tcp[13] >> 4) & 1; break;
+							case FieldId::TcpPsh: value = (tcp[13] >> 3) & 1; break;
+							case FieldId::TcpRst: value = (tcp[13] >> 2) & 1; break;
+							case FieldId::TcpSyn: value = (tcp[13] >> 1) & 1; break;
+							case FieldId::TcpFin: value = tcp[13] & 1; break;
+							case FieldId::TcpWindow: value = ReadUInt16(tcp + 14); break;
+							case FieldId::TcpChecksum: value = ReadUInt16(tcp + 16); break;
+							case FieldId::TcpUrgPtr: value = ReadUInt16(tcp + 18); break;
+							default: value = headers.PayloadLength; break;
+						}
+
+						return true;
+					}
+
+					const uint8_t* udp = headers.Udp;
+
+					if (udp == nullptr)
+					{
+						return false;
+					}
+
+					switch (field)
+					{
+						case FieldId::UdpSrcPort: value = ReadUInt16(udp); break;
+						case FieldId::UdpDstPort: value = ReadUInt16(udp + 2); break;
+						case FieldId::UdpLength: value = ReadUInt16(udp + 4); break;
+						case FieldId::UdpChecksum: value = ReadUInt16(udp + 6); break;
+						default: value = headers.PayloadLength; break;
+					}
+
+					return true;
+				}
+
+				/// <summary>
+				/// Reads any field as a 128 bit value.
+				/// </summary>
+				bool LoadWide(FieldId field, const Headers& headers, Value& value)
+				{
+					if (field == FieldId::Ipv6SrcAddr || field == FieldId::Ipv6DstAddr)
+					{
+						if (headers.Ipv6 == nullptr)
+						{
+							return false;
+						}
+
+						const uint8_t* address = headers.Ipv6 + (field == FieldId::Ipv6SrcAddr ? 8 : 24);
+
+						for (int i = 0; i < 4; ++i)
+						{
+							value.Words[3 - i] = ReadUInt32(address + i * 4);
+						}
+
+						return true;
+					}
+
+					value = Value();
+					return Load(field, headers, value.Words[0]);
+				}
+
+				inline bool Matches(int order, Comparison test)
+				{
+					switch (test)
+					{
+						case Comparison::Equal: return order == 0;
+						case Comparison::NotEqual: return order != 0;
+						case Comparison::Less: return order < 0;
+						case Comparison::LessOrEqual: return order <= 0;
+						case Comparison::Greater: return order > 0;
+						default: return order >= 0;
+					}
+				}
+
+				/// <summary>
+				/// Chains of at least this many equality tests against one field are merged into a
+				/// single set lookup by the specialized backend.
+				/// </summary>
+				const uint32_t MinimumSetSize = 3;
+
+				struct Step;
+
+				typedef bool (*StepTest)(const Step& step, const Headers& headers);
+
+				/// <summary>
+				/// An instruction of the specialized program. Test is chosen for the instruction's
+				/// field and comparison when the filter is compiled, so running it involves no
+				/// decoding. Set tests look the field up in Set, which holds either a bitmap over all
+				/// 16 bit values or SetSize sorted constants.
+				/// </summary>
+				struct Step
+				{
+					StepTest Test;
+
+					uint16_t Success;
+
+					uint16_t Failure;
+
+					FieldId Field;
+
+					uint32_t SetSize;
+
+					const void* Set;
+
+					Value Constant;
+				};
+
+				template<FieldId F>
+				DIVERT_FORCE_INLINE bool LoadField(const Headers& headers, uint32_t& value)
+				{
+					return Load(F, headers, value);
+				}
+
+				template<Comparison T>
+				DIVERT_FORCE_INLINE bool Compare(uint32_t left, uint32_t right)
+				{
+					switch (T)
+					{
+						case Comparison::Equal: return left == right;
+						case Comparison::NotEqual: return left != right;
+						case Comparison::Less: return left < right;
+						case Comparison::LessOrEqual: return left <= right;
+						case Comparison::Greater: return left > right;
+						default: return left >= right;
+					}
+				}
+
+				template<FieldId F, Comparison T>
+				bool TestNarrow(const Step& step, const Headers& headers)
+				{
+					uint32_t value;
+					return LoadField<F>(headers, value) && Compare<T>(value, step.Constant.Words[0]);
+				}
+
+				template<Comparison T>
+				bool TestWide(const Step& step, const Headers& headers)
+				{
+					Value value;
+					return LoadWide(step.Field, headers, value) && Matches(Order(value, step.Constant), T);
+				}
+
+				template<FieldId F, bool Member>
+				bool TestBitmap(const Step& step, const Headers& headers)
+				{
+					uint32_t value;
+
+					if (!LoadField<F>(headers, value))
+					{
+						return false;
+					}
+
+					const uint64_t* bitmap = static_cast<const uint64_t*>(step.Set);
+					return (((bitmap[value >> 6] >> (value & 63)) & 1) != 0) == Member;
+				}
+
+				template<FieldId F, bool Member>
+				bool TestSorted(const Step& step, const Headers& headers)
+				{
+					uint32_t value;
+
+					if (!LoadField<F>(headers, value))
+					{
+						return false;
+					}
+
+					const uint32_t* set = static_cast<const uint32_t*>(step.Set);
+					return std::binary_search(set, set + step.SetSize, value) == Member;
+				}
+
+				template<bool Member>
+				bool TestWideSorted(const Step& step, const Headers& headers)
+				{
+					Value value;
+
+					if (!LoadWide(step.Field, headers, value))
+					{
+						return false;
+					}
+
+					const Value* set = static_cast<const Value*>(step.Set);
+					const bool found = std::binary_search(set, set + step.SetSize, value, [](const Value& left, const Value& right) { return Order(left, right) < 0; });
+					return found == Member;
+				}
+
+				enum class StepKind
+				{
+					Compare,
+					Bitmap,
+					Sorted
+				};
+
+				template<FieldId F>
+				StepTest SelectTest(StepKind kind, Comparison test)
+				{
+					const bool member = test == Comparison::Equal;
+
+					switch (kind)
+					{
+						case StepKind::Bitmap:
+							return member ? &TestBitmap<F, true> : &TestBitmap<F, false>;
+
+						case StepKind::Sorted:
+							return member ? &TestSorted<F, true> : &TestSorted<F, false>;
+
+						default:
+							break;
+					}
+
+					switch (test)
+					{
+						case Comparison::Equal: return &TestNarrow<F, Comparison::Equal>;
+						case Comparison::NotEqual: return &TestNarrow<F, Comparison::NotEqual>;
+						case Comparison::Less: return &TestNarrow<F, Comparison::Less>;
+						case Comparison::LessOrEqual: return &TestNarrow<F, Comparison::LessOrEqual>;
+						case Comparison::Greater: return &TestNarrow<F, Comparison::Greater>;
+						default: return &TestNarrow<F, Comparison::GreaterOrEqual>;
+					}
+				}
+
+				typedef StepTest (*TestSelector)(StepKind kind, Comparison test);
+
+				template<size_t... Fields>
+				StepTest SelectTest(FieldId field, StepKind kind, Comparison test, std::index_sequence<Fields...>)
+				{
+					static const TestSelector selectors[] = { &SelectTest<static_cast<FieldId>(Fields)>... };
+					return selectors[static_cast<size_t>(field)](kind, test);
+				}
+
+				/// <summary>
+				/// Picks the function a specialized instruction runs.
+				/// </summary>
+				StepTest SelectTest(FieldId field, StepKind kind, Comparison test, bool wide)
+				{
+					if (wide)
+					{
+						if (kind != StepKind::Compare)
+						{
+							return test == Comparison::Equal ? &TestWideSorted<true> : &TestWideSorted<false>;
+						}
+
+						switch (test)
+						{
+							case Comparison::Equal: return &TestWide<Comparison::Equal>;
+							case Comparison::NotEqual: return &TestWide<Comparison::NotEqual>;
+							case Comparison::Less: return &TestWide<Comparison::Less>;
+							case Comparison::LessOrEqual: return &TestWide<Comparison::LessOrEqual>;
+							case Comparison::Greater: return &TestWide<Comparison::Greater>;
+							default: return &TestWide<Comparison::GreaterOrEqual>;
+						}
+					}
+
+					return SelectTest(field, kind, test, std::make_index_sequence<FieldCount>());
+				}
+
+				/// <summary>
+				/// Where an equality test goes when the field holds the constant, and where it goes
+				/// when it doesn't. A != test is an == test with its jumps swapped.
+				/// </summary>
+				uint16_t OnEqual(const Instruction& instruction)
+				{
+					return instruction.Test == Comparison::Equal ? instruction.Success : instruction.Failure;
+				}
+
+				uint16_t OnOther(const Instruction& instruction)
+				{
+					return instruction.Test == Comparison::Equal ? instruction.Failure : instruction.Success;
+				}
+
+				/// <summary>
+				/// The number of packets the vectorized backend extracts and compares at a time, one
+				/// bit of a mask per packet.
+				/// </summary>
+				const uint32_t BlockSize = 64;
+
+				enum class ColumnTest
+				{
+					Equal,
+					Less,
+					Greater
+				};
+
+				/// <summary>
+				/// Compares a column of BlockSize field values against a constant, returning one bit
+				/// per value, set where the test holds. Values are unsigned, which SSE2 can't compare
+				/// directly, so both sides are offset by 2^31 first.
+				/// </summary>
+				template<ColumnTest T>
+				uint64_t CompareColumn(const uint32_t* column, uint32_t constant)
+				{
+					uint64_t mask = 0;
+
+					#if defined(DIVERT_FILTER_SSE2)
+						const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+						const __m128i biasedConstant = _mm_set1_epi32(static_cast<int>(constant ^ 0x80000000u));
+
+						for (uint32_t i = 0; i < BlockSize; i += 4)
+						{
+							const __m128i values = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(column + i)), bias);
+							__m128i result;
+
+							switch (T)
+							{
+								case ColumnTest::Equal: result = _mm_cmpeq_epi32(values, biasedConstant); break;
+								case ColumnTest::Less: result = _mm_cmplt_epi32(values, biasedConstant); break;
+								default: result = _mm_cmpgt_epi32(values, biasedConstant); break;
+							}
+
+							mask |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(result))) << i;
+						}
+					#elif defined(DIVERT_FILTER_NEON)
+						const uint32x4_t constants = vdupq_n_u32(constant);
+						const uint32_t laneBits[4] = { 1, 2, 4, 8 };
+						const uint32x4_t lanes = vld1q_u32(laneBits);
+
+						for (uint32_t i = 0; i < BlockSize; i += 4)
+						{
+							const uint32x4_t values = vld1q_u32(column + i);
+							uint32x4_t result;
+
+							switch (T)
+							{
+								case ColumnTest::Equal: result = vceqq_u32(values, constants); break;
+								case ColumnTest::Less: result = vcltq_u32(values, constants); break;
+								default: result = vcgtq_u32(values, constants); break;
+							}
+
+							mask |= static_cast<uint64_t>(vaddvq_u32(vandq_u32(result, lanes))) << i;
+						}
+					#else
+						for (uint32_t i = 0; i < BlockSize; ++i)
+						{
+							bool result;
+
+							switch (T)
+							{
+								case ColumnTest::Equal: result = column[i] == constant; break;
+								case ColumnTest::Less: result = column[i] < constant; break;
+								default: result = column[i] > constant; break;
+							}
+
+							mask |= static_cast<uint64_t>(result ? 1 : 0) << i;
+						}
+					#endif
+
+					return mask;
+				}
+
+				uint64_t CompareColumn(const uint32_t* column, uint32_t constant, Comparison test)
+				{
+					switch (test)
+					{
+						case Comparison::Equal: return CompareColumn<ColumnTest::Equal>(column, constant);
+						case Comparison::NotEqual: return ~CompareColumn<ColumnTest::Equal>(column, constant);
+						case Comparison::Less: return CompareColumn<ColumnTest::Less>(column, constant);
+						case Comparison::LessOrEqual: return ~CompareColumn<ColumnTest::Greater>(column, constant);
+						case Comparison::Greater: return CompareColumn<ColumnTest::Greater>(column, constant);
+						default: return ~CompareColumn<ColumnTest::Less>(column, constant);
+					}
+				}
+
+				/// <summary>
+				/// Returns the index of the lowest set bit of a nonzero mask.
+				/// </summary>
+				DIVERT_FORCE_INLINE uint32_t LowestBit(uint64_t mask)
+				{
+					#if defined(_MSC_VER) && defined(_M_X64)
+						unsigned long index;
+						_BitScanForward64(&index, mask);
+						return static_cast<uint32_t>(index);
+					#elif defined(_MSC_VER)
+						unsigned long index;
+
+						if (_BitScanForward(&index, static_cast<unsigned long>(mask)))
+						{
+							return static_cast<uint32_t>(index);
+						}
+
+						_BitScanForward(&index, static_cast<unsigned long>(mask >> 32));
+						return static_cast<uint32_t>(index) + 32;
+					#else
+						return static_cast<uint32_t>(__builtin_ctzll(mask));
+					#endif
+				}
+
+				/// <summary>
+				/// Looks the values of a column selected by lanes up in a set step's bitmap or sorted
+				/// constants, for the chains of == or != the specialized backend folds into one step.
+				/// There's no SIMD gather worth having for this, so it goes a value at a time, and
+				/// only for the packets that reach the step.
+				/// </summary>
+				uint64_t LookupColumn(const uint32_t* column, uint64_t lanes, const Step& step, bool member)
+				{
+					uint64_t mask = 0;
+
+					if (FieldBits(step.Field) <= 16)
+					{
+						const uint64_t* bitmap = static_cast<const uint64_t*>(step.Set);
+
+						for (; lanes != 0; lanes &= lanes - 1)
+						{
+							const uint32_t lane = LowestBit(lanes);
+							const uint32_t value = column[lane] & 0xFFFF;
+							mask |= ((bitmap[value >> 6] >> (value & 63)) & 1) << lane;
+						}
+					}
+					else
+					{
+						const uint32_t* set = static_cast<const uint32_t*>(step.Set);
+
+						for (; lanes != 0; lanes &= lanes - 1)
+						{
+							const uint32_t lane = LowestBit(lanes);
+							mask |= static_cast<uint64_t>(std::binary_search(set, set + step.SetSize, column[lane]) ? 1 : 0) << lane;
+						}
+					}
+
+					return member ? mask : ~mask;
+				}
+
+				class Parser
+				{
+
+				public:
+
+					Parser(const char* text, size_t length, FilterLayer layer)
+						: m_text(text), m_length(length), m_position(0), m_layer(layer), m_error(nullptr), m_errorPosition(0)
+					{
+					}
+
+					bool Parse(std::vector<Node>& nodes, uint32_t& root)
+					{
+						m_nodes = &nodes;
+
+						SkipSpace();
+
+						if (m_position == m_length)
+						{
+							return Fail("Filter is empty");
+						}
+
+						if (!ParseExpression(root, 0))
+						{
+							return false;
+						}
+
+						SkipSpace();
+
+						if (m_position != m_length)
+						{
+							return Fail("Unexpected token");
+						}
+
+						return true;
+					}
+
+					const char* Error() const
+					{
+						return m_error;
+					}
+
+					uint32_t ErrorPosition() const
+					{
+						return m_errorPosition;
+					}
+
+				private:
+
+					static bool IsIdentifierStart(char c)
+					{
+						return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+					}
+
+					static bool IsIdentifierPart(char c)
+					{
+						return IsIdentifierStart(c) || (c >= '0' && c <= '9') || c == '.';
+					}
+
+					static bool IsConstantPart(char c)
+					{
+						return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '.' || c == ':';
+					}
+
+					static int HexDigit(char c)
+					{
+						if (c >= '0' && c <= '9')
+						{
+							return c - '0';
+						}
+
+						if (c >= 'a' && c <= 'f')
+						{
+							return c - 'a' + 10;
+						}
+
+						if (c >= 'A' && c <= 'F')
+						{
+							return c - 'A' + 10;
+						}
+
+						return -1;
+					}
+
+					bool Fail(const char* error)
+					{
+						if (m_error == nullptr)
+						{
+							m_error = error;
+							m_errorPosition = static_cast<uint32_t>(m_position);
+						}
+
+						return false;
+					}
+
+					void SkipSpace()
+					{
+						while (m_position < m_length && (m_text[m_position] == ' ' || m_text[m_position] == '\t' || m_text[m_position] == '\r' || m_text[m_position] == '\n'))
+						{
+							++m_position;
+						}
+					}
+
+					/// <summary>
+					/// Consumes a symbol if it comes next. Symbols made of letters must also end there,
+					/// so that "order" isn't taken for "or".
+					/// </summary>
+					bool Take(const char* symbol)
+					{
+						SkipSpace();
+
+						size_t length = 0;
+
+						while (symbol[length] != '\0')
+						{
+							if (m_position + length >= m_length || m_text[m_position + length] != symbol[length])
+							{
+								return false;
+							}
+
+							++length;
+						}
+
+						if (IsIdentifierStart(symbol[0]) && m_position + length < m_length && IsIdentifierPart(m_text[m_position + length]))
+						{
+							return false;
+						}
+
+						m_position += length;
+						return true;
+					}
+
+					uint32_t Add(NodeKind kind)
+					{
+						Node node = Node();
+						node.Kind = kind;
+						node.First = NoNode;
+						node.Next = NoNode;
+						m_nodes->push_back(node);
+						return static_cast<uint32_t>(m_nodes->size() - 1);
+					}
+
+					/// <summary>
+					/// expression := or [ '?' expression ':' expression ]
+					/// </summary>
+					bool ParseExpression(uint32_t& node, uint32_t depth)
+					{
+						if (depth >= MaximumDepth)
+						{
+							return Fail("Filter is nested too deeply");
+						}
+
+						uint32_t condition = NoNode;
+
+						if (!ParseOr(condition, depth))
+						{
+							return false;
+						}
+
+						if (!Take("?"))
+						{
+							node = condition;
+							return true;
+						}
+
+						uint32_t then = NoNode;
+						uint32_t otherwise = NoNode;
+
+						if (!ParseExpression(then, depth + 1))
+						{
+							return false;
+						}
+
+						if (!Take(":"))
+						{
+							return Fail("Expected ':'");
+						}
+
+						if (!ParseExpression(otherwise, depth + 1))
+						{
+							return false;
+						}
+
+						node = Add(NodeKind::Choose);
+						(*m_nodes)[node].First = condition;
+						(*m_nodes)[condition].Next = then;
+						(*m_nodes)[then].Next = otherwise;
+						return true;
+					}
+
+					/// <summary>
+					/// or := and { ( 'or' | '||' ) and }
+					/// </summary>
+					bool ParseOr(uint32_t& node, uint32_t depth)
+					{
+						return ParseChain(node, depth, NodeKind::Or);
+					}
+
+					/// <summary>
+					/// and := unary { ( 'and' | '&&' ) unary }
+					/// </summary>
+					bool ParseAnd(uint32_t& node, uint32_t depth)
+					{
+						return ParseChain(node, depth, NodeKind::And);
+					}
+
+					/// <summary>
+					/// Parses a run of operands joined by and or or into a single node, so that long
+					/// chains neither nest the tree nor deepen the recursion of the compiler.
+					/// </summary>
+					bool ParseChain(uint32_t& node, uint32_t depth, NodeKind kind)
+					{
+						uint32_t first = NoNode;
+
+						if (!(kind == NodeKind::Or ? ParseAnd(first, depth) : ParseUnary(first, depth)))
+						{
+							return false;
+						}
+
+						uint32_t last = first;
+
+						while (kind == NodeKind::Or ? (Take("or") || Take("||")) : (Take("and") || Take("&&")))
+						{
+							uint32_t operand = NoNode;
+
+							if (!(kind == NodeKind::Or ? ParseAnd(operand, depth) : ParseUnary(operand, depth)))
+							{
+								return false;
+							}
+
+							(*m_nodes)[last].Next = operand;
+							last = operand;
+						}
+
+						if (last == first)
+						{
+							node = first;
+							return true;
+						}
+
+						node = Add(kind);
+						(*m_nodes)[node].First = first;
+						return true;
+					}
+
+					/// <summary>
+					/// unary := ( 'not' | '!' ) unary | primary
+					/// </summary>
+					bool ParseUnary(uint32_t& node, uint32_t depth)
+					{
+						uint32_t negations = 0;
+
+						while (Take("not") || (!LooksAt("!=") && Take("!")))
+						{
+							++negations;
+						}
+
+						if (!ParsePrimary(node, depth))
+						{
+							return false;
+						}
+
+						// An even number of negations cancel out.
+						if (negations % 2 == 1)
+						{
+							const uint32_t operand = node;
+							node = Add(NodeKind::Not);
+							(*m_nodes)[node].First = operand;
+						}
+
+						return true;
+					}
+
+					bool LooksAt(const char* symbol)
+					{
+						SkipSpace();
+
+						for (size_t i = 0; symbol[i] != '\0'; ++i)
+						{
+							if (m_position + i >= m_length || m_text[m_position + i] != symbol[i])
+							{
+								return false;
+							}
+						}
+
+						return true;
+					}
+
+					/// <summary>
+					/// primary := '(' expression ')' | 'true' | 'false' | field [ comparison constant ]
+					/// </summary>
+					bool ParsePrimary(uint32_t& node, uint32_t depth)
+					{
+						if (Take("("))
+						{
+							if (!ParseExpression(node, depth + 1))
+							{
+								return false;
+							}
+
+							if (!Take(")"))
+							{
+								return Fail("Expected ')'");
+							}
+
+							return true;
+						}
+
+						if (Take("true"))
+						{
+							node = Add(NodeKind::True);
+							return true;
+						}
+
+						if (Take("false"))
+						{
+							node = Add(NodeKind::False);
+							return true;
+						}
+
+						SkipSpace();
+
+						if (m_position == m_length)
+						{
+							return Fail("Unexpected end of filter");
+						}
+
+						if (!IsIdentifierStart(m_text[m_position]))
+						{
+							return Fail("Unexpected token");
+						}
+
+						const size_t start = m_position;
+
+						while (m_position < m_length && IsIdentifierPart(m_text[m_position]))
+						{
+							++m_position;
+						}
+
+						const FieldName* field = nullptr;
+
+						for (const FieldName& candidate : FieldNames)
+						{
+							const size_t length = std::strlen(candidate.Name);
+
+							if (length == m_position - start && std::memcmp(candidate.Name, m_text + start, length) == 0)
+							{
+								field = &candidate;
+								break;
+							}
+						}
+
+						if (field == nullptr)
+						{
+							m_position = start;
+							return Fail("Unknown field");
+						}
+
+						if (m_layer == FilterLayer::NetworkForward && (field->Id == FieldId::Inbound || field->Id == FieldId::Outbound))
+						{
+							m_position = start;
+							return Fail("Direction is not valid at the forward layer");
+						}
+
+						node = Add(NodeKind::Test);
+						Node& test = (*m_nodes)[node];
+						test.Field = field->Id;
+						test.Test = Comparison::NotEqual;
+
+						if (Take("=="))
+						{
+							test.Test = Comparison::Equal;
+						}
+						else if (Take("!="))
+						{
+							test.Test = Comparison::NotEqual;
+						}
+						else if (Take("<="))
+						{
+							test.Test = Comparison::LessOrEqual;
+						}
+						else if (Take(">="))
+						{
+							test.Test = Comparison::GreaterOrEqual;
+						}
+						else if (Take("="))
+						{
+							test.Test = Comparison::Equal;
+						}
+						else if (Take("<"))
+						{
+							test.Test = Comparison::Less;
+						}
+						else if (Take(">"))
+						{
+							test.Test = Comparison::Greater;
+						}
+						else
+						{
+							return true;
+						}
+
+						Value constant = Value();
+
+						if (!ParseConstant(constant))
+						{
+							return false;
+						}
+
+						(*m_nodes)[node].Constant = constant;
+						return true;
+					}
+
+					/// <summary>
+					/// Parses a decimal, hexadecimal, IPv4 or IPv6 constant. IPv6 addresses contain
+					/// colons, as does (a? b: c), so when the whole run of constant characters isn't a
+					/// constant, the runs ending before each colon are tried, longest first.
+					/// </summary>
+					bool ParseConstant(Value& value)
+					{
+						SkipSpace();
+
+						const size_t start = m_position;
+						size_t end = start;
+
+						while (end < m_length && IsConstantPart(m_text[end]))
+						{
+							++end;
+						}
+
+						while (end > start)
+						{
+							if (ParseNumber(start, end, value) || ParseIpv4(start, end, value) || ParseIpv6(start, end, value))
+							{
+								m_position = end;
+								return true;
+							}
+
+							do
+							{
+								--end;
+							}
+							while (end > start && m_text[end] != ':');
+						}
+
+						return Fail("Expected a number or address");
+					}
+
+					bool ParseNumber(size_t start, size_t end, Value& value)
+					{
+						value = Value();
+
+						uint64_t number = 0;
+
+						if (end - start > 2 && m_text[start] == '0' && (m_text[start + 1] == 'x' || m_text[start + 1] == 'X'))
+						{
+							for (size_t i = start + 2; i < end; ++i)
+							{
+								const int digit = HexDigit(m_text[i]);
+
+								if (digit < 0 || (number = number * 16 + static_cast<uint64_t>(digit)) > 0xFFFFFFFF)
+								{
+									return false;
+								}
+							}
+						}
+						else
+						{
+							for (size_t i = start; i < end; ++i)
+							{
+								if (m_text[i] < '0' || m_text[i] > '9' || (number = number * 10 + static_cast<uint64_t>(m_text[i] - '0')) > 0xFFFFFFFF)
+								{
+									return false;
+								}
+							}
+						}
+
+						value.Words[0] = static_cast<uint32_t>(number);
+						return true;
+					}
+
+					bool ParseIpv4(size_t start, size_t end, Value& value)
+					{
+						value = Value();
+
+						uint32_t octets = 0;
+						uint32_t octet = 0;
+						uint32_t digits = 0;
+
+						for (size_t i = start; i <= end; ++i)
+						{
+							if (i == end || m_text[i] == '.')
+							{
+								if (digits == 0 || octet > 255)
+								{
+									return false;
+								}
+
+								value.Words[0] = (value.Words[0] << 8) | octet;
+								++octets;
+								octet = 0;
+								digits = 0;
+							}
+							else if (m_text[i] >= '0' && m_text[i] <= '9' && digits < 3)
+							{
+								octet = octet * 10 + static_cast<uint32_t>(m_text[i] - '0');
+								++digits;
+							}
+							else
+							{
+								return false;
+							}
+						}
+
+						return octets == 4;
+					}
+
+					bool ParseIpv6(size_t start, size_t end, Value& value)
+					{
+						value = Value();
+
+						uint16_t groups[8] = {};
+						uint32_t count = 0;
+						uint32_t gap = 8;
+						size_t i = start;
+
+						if (end - start >= 2 && m_text[i] == ':' && m_text[i + 1] == ':')
+						{
+							gap = 0;
+							i += 2;
+						}
+
+						while (i < end)
+						{
+							uint32_t group = 0;
+							uint32_t digits = 0;
+
+							while (i < end && digits < 4 && HexDigit(m_text[i]) >= 0)
+							{
+								group = group * 16 + static_cast<uint32_t>(HexDigit(m_text[i]));
+								++digits;
+								++i;
+							}
+
+							if (digits == 0 || count == 8)
+							{
+								return false;
+							}
+
+							groups[count++] = static_cast<uint16_t>(group);
+
+							if (i == end)
+							{
+								break;
+							}
+
+							if (m_text[i] != ':' || i + 1 == end)
+							{
+								return false;
+							}
+
+							++i;
+
+							if (m_text[i] == ':')
+							{
+								if (gap != 8)
+								{
+									return false;
+								}
+
+								gap = count;
+								++i;
+							}
+						}
+
+						if (gap == 8 ? count != 8 : count > 7)
+						{
+							return false;
+						}
+
+						// Slide the groups after the gap to the end.
+						uint16_t address[8] = {};
+						const uint32_t tail = gap == 8 ? 0 : count - gap;
+
+						for (uint32_t g = 0; g < count - tail; ++g)
+						{
+							address[g] = groups[g];
+						}
+
+						for (uint32_t g = 0; g < tail; ++g)
+						{
+							address[8 - tail + g] = groups[gap + g];
+						}
+
+						for (int w = 0; w < 4; ++w)
+						{
+							value.Words[3 - w] = (static_cast<uint32_t>(address[w * 2]) << 16) | address[w * 2 + 1];
+						}
+
+						return true;
+					}
+
+					const char* m_text;
+
+					size_t m_length;
+
+					size_t m_position;
+
+					FilterLayer m_layer;
+
+					std::vector<Node>* m_nodes;
+
+					const char* m_error;
+
+					uint32_t m_errorPosition;
+
+				};
+
+				/// <summary>
+				/// Turns the parsed filter into instructions. Each node is compiled knowing where to
+				/// go once it is decided, so and, or, not and (a? b: c) become jumps rather than
+				/// instructions of their own, and true and false become jumps straight to their
+				/// target.
+				/// </summary>
+				class Compiler
+				{
+
+				public:
+
+					Compiler(const std::vector<Node>& nodes, std::vector<Instruction>& program)
+						: m_nodes(nodes), m_program(program), m_tooLong(false)
+					{
+					}
+
+					bool TooLong() const
+					{
+						return m_tooLong;
+					}
+
+					uint16_t Compile(uint32_t index, uint16_t success, uint16_t failure)
+					{
+						const Node& node = m_nodes[index];
+
+						switch (node.Kind)
+						{
+							case NodeKind::True:
+								return success;
+
+							case NodeKind::False:
+								return failure;
+
+							case NodeKind::Not:
+								return Compile(node.First, failure, success);
+
+							case NodeKind::Choose:
+							{
+								const uint32_t then = m_nodes[node.First].Next;
+								const uint32_t otherwise = m_nodes[then].Next;
+								const uint16_t elseEntry = Compile(otherwise, success, failure);
+								const uint16_t thenEntry = Compile(then, success, failure);
+								return Compile(node.First, thenEntry, elseEntry);
+							}
+
+							case NodeKind::And:
+							case NodeKind::Or:
+							{
+								// Compiled back to front, since each operand jumps to the next.
+								std::vector<uint32_t> operands;
+
+								for (uint32_t operand = node.First; operand != NoNode; operand = m_nodes[operand].Next)
+								{
+									operands.push_back(operand);
+								}
+
+								Group(operands);
+
+								uint16_t entry = node.Kind == NodeKind::And ? success : failure;
+
+								for (size_t i = operands.size(); i-- > 0;)
+								{
+									entry = node.Kind == NodeKind::And ? Compile(operands[i], entry, failure) : Compile(operands[i], success, entry);
+								}
+
+								return entry;
+							}
+
+							default:
+								break;
+						}
+
+						if (success == failure)
+						{
+							return success;
+						}
+
+						if (m_program.size() >= MaximumInstructions)
+						{
+							m_tooLong = true;
+							return failure;
+						}
+
+						Instruction instruction = Instruction();
+						instruction.Field = node.Field;
+						instruction.Test = node.Test;
+						instruction.Wide = node.Field == FieldId::Ipv6SrcAddr || node.Field == FieldId::Ipv6DstAddr || node.Constant.Words[1] != 0 || node.Constant.Words[2] != 0 || node.Constant.Words[3] != 0;
+						instruction.Success = success;
+						instruction.Failure = failure;
+						instruction.Constant = node.Constant;
+
+						m_program.push_back(instruction);
+						return static_cast<uint16_t>(m_program.size() - 1);
+					}
+
+				private:
+
+					/// <summary>
+					/// Moves == and != tests of the same field next to each other, where the first of
+					/// them stands, so that they compile into a chain the specialized backend can
+					/// merge into one set lookup. Operands of and and or can be evaluated in any
+					/// order, since evaluating them has no side effects.
+					/// </summary>
+					void Group(std::vector<uint32_t>& operands) const
+					{
+						std::map<std::pair<FieldId, Comparison>, size_t> firstSeen;
+						std::vector<std::pair<size_t, uint32_t>> keyed;
+
+						for (size_t i = 0; i < operands.size(); ++i)
+						{
+							const Node& operand = m_nodes[operands[i]];
+							size_t key = i;
+
+							if (operand.Kind == NodeKind::Test && (operand.Test == Comparison::Equal || operand.Test == Comparison::NotEqual))
+							{
+								key = firstSeen.insert(std::make_pair(std::make_pair(operand.Field, operand.Test), i)).first->second;
+							}
+
+							keyed.push_back(std::make_pair(key, operands[i]));
+						}
+
+						std::stable_sort(keyed.begin(), keyed.end(), [](const std::pair<size_t, uint32_t>& left, const std::pair<size_t, uint32_t>& right) { return left.first < right.first; });
+
+						for (size_t i = 0; i < operands.size(); ++i)
+						{
+							operands[i] = keyed[i].second;
+						}
+					}
+
+					const std::vector<Node>& m_nodes;
+
+					std::vector<Instruction>& m_program;
+
+					bool m_tooLong;
+
+				};
+			}
+
+			bool FilterSyntax::ParseFilter(const char* filter, size_t length, FilterLayer layer, std::vector<Node>& nodes, uint32_t& root, const char** errorMessage, uint32_t* errorPosition)
+			{
+				Parser parser(filter, length, layer);
+
+				if (!parser.Parse(nodes, root))
+				{
+					if (errorMessage != nullptr)
+					{
+						*errorMessage = parser.Error();
+					}
+
+					if (errorPosition != nullptr)
+					{
+						*errorPosition = parser.ErrorPosition();
+					}
+
+					return false;
+				}
+
+				return true;
+			}
+
+			struct Filter::State
+			{
+				std::vector<Instruction> Program;
+
+				uint16_t Entry;
+
+				FilterBackend Backend;
+
+				std::vector<Step> Steps;
+
+				std::vector<std::vector<uint64_t>> Bitmaps;
+
+				std::vector<std::vector<uint32_t>> Sets;
+
+				std::vector<std::vector<Value>> WideSets;
+
+				bool Vectorizable;
+
+				/// <summary>
+				/// The field extracted into each column by the vectorized backend.
+				/// </summary>
+				std::vector<FieldId> ColumnFields;
+
+				/// <summary>
+				/// The column each instruction tests.
+				/// </summary>
+				std::vector<uint32_t> ColumnOf;
+
+				void Specialize();
+
+				void PrepareColumns();
+
+				uint64_t EvaluateBlock(const uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, const WINDIVERT_ADDRESS* const* addresses, uint32_t count, uint32_t* columns, uint64_t* present, uint64_t* reach) const;
+			};
+
+			/// <summary>
+			/// Builds the specialized program. Steps keep the indices of the instructions they are
+			/// made from, so jumps need no rewriting. An equality test that starts a chain of tests
+			/// against the same field, all jumping to the same place on a match, takes over the
+			/// whole chain as one set lookup. The rest of the chain is then only reached from
+			/// elsewhere in the program, if at all. Steps point straight into the tables, which
+			/// stay put as more are added, since moving a vector doesn't move its elements.
+			/// </summary>
+			void Filter::State::Specialize()
+			{
+				Steps.clear();
+				Steps.reserve(Program.size());
+				Bitmaps.clear();
+				Sets.clear();
+				WideSets.clear();
+
+				// A member further down an equality chain is only worth its own set when
+				// something other than its predecessor in the chain jumps to it; otherwise
+				// the head's set already covers it and building one per member is quadratic.
+				std::vector<uint16_t> references(Program.size());
+				std::vector<bool> continues(Program.size());
+
+				if (Entry < Program.size())
+				{
+					++references[Entry];
+				}
+
+				for (const Instruction& instruction : Program)
+				{
+					for (uint16_t target : { instruction.Success, instruction.Failure })
+					{
+						if (target < Program.size())
+						{
+							++references[target];
+						}
+					}
+
+					if (instruction.Test == Comparison::Equal || instruction.Test == Comparison::NotEqual)
+					{
+						const uint16_t other = OnOther(instruction);
+
+						if (other < Program.size())
+						{
+							const Instruction& next = Program[other];
+							continues[other] = continues[other] || (next.Field == instruction.Field && next.Test == instruction.Test && next.Wide == instruction.Wide && OnEqual(next) == OnEqual(instruction));
+						}
+					}
+				}
+
+				for (size_t index = 0; index < Program.size(); ++index)
+				{
+					const Instruction& instruction = Program[index];
+					Step step = Step();
+					step.Success = instruction.Success;
+					step.Failure = instruction.Failure;
+					step.Field = instruction.Field;
+					step.Constant = instruction.Constant;
+
+					StepKind kind = StepKind::Compare;
+
+					if ((instruction.Test == Comparison::Equal || instruction.Test == Comparison::NotEqual) && !(continues[index] && references[index] == 1))
+					{
+						std::vector<Value> members;
+						uint16_t other = OnOther(instruction);
+
+						members.push_back(instruction.Constant);
+
+						while (other < Program.size())
+						{
+							const Instruction& next = Program[other];
+
+							if (next.Field != instruction.Field || next.Test != instruction.Test || next.Wide != instruction.Wide || OnEqual(next) != OnEqual(instruction))
+							{
+								break;
+							}
+
+							members.push_back(next.Constant);
+							other = OnOther(next);
+						}
+
+						if (members.size() >= MinimumSetSize)
+						{
+							std::sort(members.begin(), members.end(), [](const Value& left, const Value& right) { return Order(left, right) < 0; });
+							members.erase(std::unique(members.begin(), members.end(), [](const Value& left, const Value& right) { return Order(left, right) == 0; }), members.end());
+
+							// Keep the instruction's own Success and Failure meaning: for == they
+							// are match and no match, for != the reverse.
+							if (instruction.Test == Comparison::Equal)
+							{
+								step.Failure = other;
+							}
+							else
+							{
+								step.Success = other;
+							}
+
+							if (instruction.Wide)
+							{
+								WideSets.push_back(std::move(members));
+								step.Set = WideSets.back().data();
+								step.SetSize = static_cast<uint32_t>(WideSets.back().size());
+								kind = StepKind::Sorted;
+							}
+							else if (FieldBits(instruction.Field) <= 16)
+							{
+								std::vector<uint64_t> bitmap(65536 / 64);
+
+								for (const Value& member : members)
+								{
+									if (member.Words[0] <= 0xFFFF)
+									{
+										bitmap[member.Words[0] >> 6] |= static_cast<uint64_t>(1) << (member.Words[0] & 63);
+									}
+								}
+
+								Bitmaps.push_back(std::move(bitmap));
+								step.Set = Bitmaps.back().data();
+								kind = StepKind::Bitmap;
+							}
+							else
+							{
+								std::vector<uint32_t> set;
+
+								for (const Value& member : members)
+								{
+									set.push_back(member.Words[0]);
+								}
+
+								Sets.push_back(std::move(set));
+								step.Set = Sets.back().data();
+								step.SetSize = static_cast<uint32_t>(Sets.back().size());
+								kind = StepKind::Sorted;
+							}
+						}
+					}
+
+					step.Test = SelectTest(instruction.Field, kind, instruction.Test, instruction.Wide);
+					Steps.push_back(step);
+				}
+			}
+
+			/// <summary>
+			/// Works out which columns the vectorized backend extracts: one per field the program
+			/// tests. Programs with 128 bit tests aren't vectorized.
+			/// </summary>
+			void Filter::State::PrepareColumns()
+			{
+				ColumnFields.clear();
+				ColumnOf.clear();
+				Vectorizable = true;
+
+				std::vector<int> columns(FieldCount, -1);
+
+				for (const Instruction& instruction : Program)
+				{
+					if (instruction.Wide)
+					{
+						Vectorizable = false;
+						ColumnFields.clear();
+						ColumnOf.clear();
+						return;
+					}
+
+					int& column = columns[static_cast<size_t>(instruction.Field)];
+
+					if (column < 0)
+					{
+						column = static_cast<int>(ColumnFields.size());
+						ColumnFields.push_back(instruction.Field);
+					}
+
+					ColumnOf.push_back(static_cast<uint32_t>(column));
+				}
+			}
+
+			/// <summary>
+			/// Evaluates the program over one block of up to BlockSize packets. The fields the
+			/// program tests are extracted into columns, alongside masks of the packets that have
+			/// each field. Each instruction is then evaluated for the whole block, with SIMD
+			/// compares or, where the specialized backend folded a chain into a set, a lookup, and
+			/// the results are routed through the program as masks: each instruction passes the
+			/// packets that reach it on to its success or failure target. Jump targets are always
+			/// compiled before the instructions jumping to them, so walking the program from the
+			/// entry downwards visits every instruction after everything that can reach it.
+			/// </summary>
+			uint64_t Filter::State::EvaluateBlock(const uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, const WINDIVERT_ADDRESS* const* addresses, uint32_t count, uint32_t* columns, uint64_t* present, uint64_t* reach) const
+			{
+				uint64_t inside = 0;
+
+				std::fill(present, present + ColumnFields.size(), 0);
+
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					const uint64_t bit = static_cast<uint64_t>(1) << i;
+					Headers headers = Headers();
+
+					if (static_cast<uint64_t>(offsets[i]) + lengths[i] <= bufferLength)
+					{
+						inside |= bit;
+						Locate(buffer + offsets[i], lengths[i], addresses != nullptr ? addresses[i] : nullptr, headers);
+					}
+
+					for (size_t column = 0; column < ColumnFields.size(); ++column)
+					{
+						uint32_t value = 0;
+						present[column] |= Load(ColumnFields[column], headers, value) ? bit : 0;
+						columns[column * BlockSize + i] = value;
+					}
+				}
+
+				std::fill(reach, reach + Entry + 1, 0);
+				reach[Entry] = inside;
+
+				uint64_t accepted = 0;
+
+				for (size_t i = Entry + 1; i-- > 0;)
+				{
+					const uint64_t reached = reach[i];
+
+					if (reached == 0)
+					{
+						continue;
+					}
+
+					const Instruction& instruction = Program[i];
+					const Step& step = Steps[i];
+					const uint32_t* column = columns + ColumnOf[i] * BlockSize;
+					uint64_t passed;
+
+					if (step.Set != nullptr)
+					{
+						passed = LookupColumn(column, reached & present[ColumnOf[i]], step, instruction.Test == Comparison::Equal);
+					}
+					else
+					{
+						passed = CompareColumn(column, instruction.Constant.Words[0], instruction.Test);
+					}
+
+					passed &= present[ColumnOf[i]];
+
+					const uint64_t routes[2] = { reached & passed, reached & ~passed };
+					const uint16_t targets[2] = { step.Success, step.Failure };
+
+					for (int route = 0; route < 2; ++route)
+					{
+						if (targets[route] == Accept)
+						{
+							accepted |= routes[route];
+						}
+						else if (targets[route] != Reject)
+						{
+							reach[targets[route]] |= routes[route];
+						}
+					}
+				}
+
+				return accepted & inside;
+			}
+
+			Filter::Filter() : m_state(new State())
+			{
+				m_state->Entry = Reject;
+				m_state->Backend = FilterBackend::Specialized;
+				m_state->Vectorizable = false;
+			}
+
+			Filter::~Filter()
+			{
+				delete m_state;
+			}
+
+			bool Filter::Compile(const char* filter, size_t length, FilterLayer layer, const char** errorMessage, uint32_t* errorPosition)
+			{
+				std::vector<Node> nodes;
+				uint32_t root = NoNode;
+
+				if (!ParseFilter(filter, filter == nullptr ? 0 : length, layer, nodes, root, errorMessage, errorPosition))
+				{
+					return false;
+				}
+
+				// The program is compiled from the analyzer's simplified filter, which never has more tests.
+				std::vector<Node> simplified;
+				const uint32_t simplifiedRoot = SimplifyNodes(nodes, root, simplified);
+
+				std::vector<Instruction> program;
+				Compiler compiler(simplified, program);
+
+				const uint16_t entry = compiler.Compile(simplifiedRoot, Accept, Reject);
+
+				if (compiler.TooLong())
+				{
+					if (errorMessage != nullptr)
+					{
+						*errorMessage = "Filter is too long";
+					}
+
+					if (errorPosition != nullptr)
+					{
+						*errorPosition = 0;
+					}
+
+					return false;
+				}
+
+				m_state->Program.swap(program);
+				m_state->Entry = entry;
+				m_state->Specialize();
+				m_state->PrepareColumns();
+				return true;
+			}
+
+			bool Filter::Evaluate(const uint8_t* packet, uint32_t packetLength, const WINDIVERT_ADDRESS* address) const
+			{
+				const Instruction* program = m_state->Program.data();
+				uint16_t next = m_state->Entry;
+
+				// Filters that compiled down to a constant never look at the packet.
+				if (next >= Reject)
+				{
+					return next == Accept;
+				}
+
+				Headers headers;
+				Locate(packet, packet == nullptr ? 0 : packetLength, address, headers);
+
+				if (m_state->Backend != FilterBackend::Interpreter)
+				{
+					const Step* steps = m_state->Steps.data();
+
+					do
+					{
+						const Step& step = steps[next];
+						next = step.Test(step, headers) ? step.Success : step.Failure;
+					}
+					while (next < Reject);
+
+					return next == Accept;
+				}
+
+				do
+				{
+					const Instruction& instruction = program[next];
+					bool result;
+
+					if (instruction.Wide)
+					{
+						Value value;
+						result = LoadWide(instruction.Field, headers, value) && Matches(Order(value, instruction.Constant), instruction.Test);
+					}
+					else
+					{
+						uint32_t value;
+						result = Load(instruction.Field, headers, value) && Matches(Order(value, instruction.Constant.Words[0]), instruction.Test);
+					}
+
+					next = result ? instruction.Success : instruction.Failure;
+				}
+				while (next < Reject);
+
+				return next == Accept;
+			}
+
+			uint32_t Filter::EvaluateBatch(const uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, const WINDIVERT_ADDRESS* const* addresses, uint32_t count, uint8_t* results) const
+			{
+				uint32_t matches = 0;
+
+				if (m_state->Backend == FilterBackend::Vectorized && m_state->Vectorizable && m_state->Entry < Reject)
+				{
+					std::vector<uint32_t> columns(m_state->ColumnFields.size() * BlockSize);
+					std::vector<uint64_t> present(m_state->ColumnFields.size());
+					std::vector<uint64_t> reach(m_state->Program.size());
+
+					for (uint32_t first = 0; first < count; first += BlockSize)
+					{
+						const uint32_t blockCount = std::min(BlockSize, count - first);
+						const uint64_t accepted = m_state->EvaluateBlock(buffer, bufferLength, offsets + first, lengths + first, addresses != nullptr ? addresses + first : nullptr, blockCount, columns.data(), present.data(), reach.data());
+
+						for (uint32_t i = 0; i < blockCount; ++i)
+						{
+							const uint8_t match = static_cast<uint8_t>((accepted >> i) & 1);
+							results[first + i] = match;
+							matches += match;
+						}
+					}
+
+					return matches;
+				}
+
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					const bool inside = static_cast<uint64_t>(offsets[i]) + lengths[i] <= bufferLength;
+					const bool match = inside && Evaluate(buffer + offsets[i], lengths[i], addresses != nullptr ? addresses[i] : nullptr);
+
+					results[i] = match ? 1 : 0;
+					matches += match ? 1 : 0;
+				}
+
+				return matches;
+			}
+
+			FilterBackend Filter::Backend() const
+			{
+				return m_state->Backend;
+			}
+
+			void Filter::SetBackend(FilterBackend backend)
+			{
+				m_state->Backend = backend;
+			}
+
+			uint32_t Filter::InstructionCount() const
+			{
+				return static_cast<uint32_t>(m_state->Program.size());
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
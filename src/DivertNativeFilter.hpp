@@ -0,0 +1,215 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Mirrors DivertLayer. Direction tests are only valid at the network layer, since
+			/// forwarded packets are neither inbound nor outbound.
+			/// </summary>
+			enum class FilterLayer
+			{
+				Network = 0,
+				NetworkForward = 1
+			};
+
+			/// <summary>
+			/// How a Filter runs its program.
+			/// </summary>
+			enum class FilterBackend
+			{
+				/// <summary>
+				/// Each instruction is decoded as it is run, through a switch on its field and test.
+				/// </summary>
+				Interpreter = 0,
+
+				/// <summary>
+				/// Each instruction is bound at compile time to a function specialized for its field
+				/// and test, and runs of equality tests against one field are merged into a single
+				/// lookup in a bitmap or sorted table. The default.
+				/// </summary>
+				Specialized = 1,
+
+				/// <summary>
+				/// As Specialized for single packets. Batches are evaluated 64 packets at a time:
+				/// the fields the program tests are extracted into one column per field, each test
+				/// is run over a whole column with SIMD compares, and the results are combined as
+				/// bitmasks. Programs that test IPv6 addresses fall back to Specialized.
+				/// </summary>
+				Vectorized = 2
+			};
+
+			/// <summary>
+			/// A WinDivert filter string compiled into a decision program. Each instruction tests one
+			/// packet field against a constant and names the instruction to continue with on success
+			/// and on failure, the way WinDivert itself represents filters. So evaluating a packet
+			/// involves no parsing, no allocation and no calls into WinDivert, and a program can be
+			/// evaluated by any number of threads at once.
+			/// 
+			/// The language is the one documented for WinDivert 1.1: the fields inbound, outbound,
+			/// ifIdx, subIfIdx, ip, ipv6, icmp, icmpv6, tcp, udp and the ip.*, ipv6.*, icmp.*,
+			/// icmpv6.*, tcp.* and udp.* header fields, compared with ==, =, !=, <, <=, > or >=
+			/// against decimal, hexadecimal, IPv4 or IPv6 constants, and combined with and (&&), or
+			/// (||), not (!), parentheses and (a? b: c). A field without a comparison means != 0. A
+			/// test of a header the packet doesn't have fails, and not inverts that.
+			/// </summary>
+			class Filter
+			{
+
+			public:
+
+				/// <summary>
+				/// Creates a filter that matches nothing, until Compile(...) succeeds.
+				/// </summary>
+				Filter();
+
+				~Filter();
+
+				/// <summary>
+				/// Compiles a filter string, replacing the current program. On failure the current
+				/// program is left as it was.
+				/// </summary>
+				/// <param name="filter">
+				/// The filter string. Need not be null terminated.
+				/// </param>
+				/// <param name="length">
+				/// The length of the filter string.
+				/// </param>
+				/// <param name="layer">
+				/// The layer the filter will be evaluated at.
+				/// </param>
+				/// <param name="errorMessage">
+				/// If not null and the filter is invalid, receives a description of the problem. The
+				/// string is static.
+				/// </param>
+				/// <param name="errorPosition">
+				/// If not null and the filter is invalid, receives the offset of the problem.
+				/// </param>
+				/// <returns>
+				/// True if the filter was valid and compiled, false otherwise.
+				/// </returns>
+				bool Compile(const char* filter, size_t length, FilterLayer layer, const char** errorMessage, uint32_t* errorPosition);
+
+				/// <summary>
+				/// Evaluates the filter against a packet.
+				/// </summary>
+				/// <param name="packet">
+				/// The packet, starting with its IPv4 or IPv6 header.
+				/// </param>
+				/// <param name="packetLength">
+				/// The length of the packet.
+				/// </param>
+				/// <param name="address">
+				/// The address the packet was received with. May be null, in which case tests of
+				/// inbound, outbound, ifIdx and subIfIdx fail.
+				/// </param>
+				/// <returns>
+				/// True if the packet matches the filter.
+				/// </returns>
+				bool Evaluate(const uint8_t* packet, uint32_t packetLength, const WINDIVERT_ADDRESS* address) const;
+
+				/// <summary>
+				/// Evaluates the filter against every packet of a packed batch, as laid out by
+				/// PacketBatch, in a single call.
+				/// </summary>
+				/// <param name="buffer">
+				/// The packed buffer.
+				/// </param>
+				/// <param name="bufferLength">
+				/// The length of the buffer. Packets that don't lie entirely within it don't match.
+				/// </param>
+				/// <param name="offsets">
+				/// The offset of each packet in the buffer.
+				/// </param>
+				/// <param name="lengths">
+				/// The length of each packet.
+				/// </param>
+				/// <param name="addresses">
+				/// The address of each packet. May be null, as may any of its entries, for packets
+				/// read from a capture rather than from WinDivert.
+				/// </param>
+				/// <param name="count">
+				/// The number of packets.
+				/// </param>
+				/// <param name="results">
+				/// Receives 1 for each packet that matches and 0 for each that doesn't.
+				/// </param>
+				/// <returns>
+				/// The number of packets that match.
+				/// </returns>
+				uint32_t EvaluateBatch(const uint8_t* buffer, uint64_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, const WINDIVERT_ADDRESS* const* addresses, uint32_t count, uint8_t* results) const;
+
+				/// <summary>
+				/// The backend used by Evaluate(...) and EvaluateBatch(...).
+				/// </summary>
+				FilterBackend Backend() const;
+
+				/// <summary>
+				/// Selects the backend. All are built by Compile(...), so switching is free and
+				/// doesn't change any result. Not safe to call while the filter is being evaluated.
+				/// </summary>
+				void SetBackend(FilterBackend backend);
+
+				/// <summary>
+				/// The number of instructions in the compiled program. Constant parts of the filter
+				/// compile away, so "true" has none.
+				/// </summary>
+				uint32_t InstructionCount() const;
+
+			private:
+
+				Filter(const Filter&) = delete;
+
+				Filter& operator=(const Filter&) = delete;
+
+				/// <summary>
+				/// The instructions are defined in the source file, so that this header stays usable
+				/// from managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,1833 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeFilterAnalyzer.hpp"
+#include "DivertNativeFilterSyntax.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			using namespace FilterSyntax;
+
+			namespace
+			{
+				/// <summary>
+				/// The exact width of a field in bits, which bounds the values a test can match. Wider
+				/// than FieldBits(...) says for some fields, which is about storage.
+				/// </summary>
+				uint32_t FieldWidth(FieldId field)
+				{
+					switch (field)
+					{
+						case FieldId::Inbound:
+						case FieldId::Outbound:
+						case FieldId::Ip:
+						case FieldId::Ipv6:
+						case FieldId::Icmp:
+						case FieldId::Icmpv6:
+						case FieldId::Tcp:
+						case FieldId::Udp:
+						case FieldId::IpDf:
+						case FieldId::IpMf:
+						case FieldId::TcpUrg:
+						case FieldId::TcpAck:
+						case FieldId::TcpPsh:
+						case FieldId::TcpRst:
+						case FieldId::TcpSyn:
+						case FieldId::TcpFin:
+							return 1;
+
+						case FieldId::IpHdrLength:
+						case FieldId::TcpHdrLength:
+							return 4;
+
+						case FieldId::IpTos:
+						case FieldId::IpTtl:
+						case FieldId::IpProtocol:
+						case FieldId::Ipv6TrafficClass:
+						case FieldId::Ipv6NextHdr:
+						case FieldId::Ipv6HopLimit:
+						case FieldId::IcmpType:
+						case FieldId::IcmpCode:
+						case FieldId::Icmpv6Type:
+						case FieldId::Icmpv6Code:
+							return 8;
+
+						case FieldId::IpFragOff:
+							return 13;
+
+						case FieldId::Ipv6FlowLabel:
+							return 20;
+
+						default:
+							return FieldBits(field);
+					}
+				}
+
+				Value FieldMaximum(FieldId field)
+				{
+					const uint32_t width = FieldWidth(field);
+					Value maximum = Value();
+
+					for (uint32_t i = 0; i < 4 && i * 32 < width; ++i)
+					{
+						maximum.Words[i] = width - i * 32 >= 32 ? 0xFFFFFFFF : (static_cast<uint32_t>(1) << (width - i * 32)) - 1;
+					}
+
+					return maximum;
+				}
+
+				/// <summary>
+				/// The part of the packet a field is read from. Tests of a field fail when its header
+				/// is missing. The presence fields themselves, ip, tcp and so on, can always be read.
+				/// </summary>
+				enum class Header : uint8_t
+				{
+					None,
+					Address,
+					Ip,
+					Ipv6,
+					Icmp,
+					Icmpv6,
+					Tcp,
+					Udp
+				};
+
+				Header FieldHeader(FieldId field)
+				{
+					if (field <= FieldId::SubIfIdx)
+					{
+						return Header::Address;
+					}
+
+					if (field <= FieldId::Udp)
+					{
+						return Header::None;
+					}
+
+					if (field <= FieldId::IpDstAddr)
+					{
+						return Header::Ip;
+					}
+
+					if (field <= FieldId::Ipv6DstAddr)
+					{
+						return Header::Ipv6;
+					}
+
+					if (field <= FieldId::IcmpBody)
+					{
+						return Header::Icmp;
+					}
+
+					if (field <= FieldId::Icmpv6Body)
+					{
+						return Header::Icmpv6;
+					}
+
+					return field <= FieldId::TcpPayloadLength ? Header::Tcp : Header::Udp;
+				}
+
+				bool IsPresenceField(FieldId field)
+				{
+					return field >= FieldId::Ip && field <= FieldId::Udp;
+				}
+
+				/// <summary>
+				/// The header whose presence a presence field tests.
+				/// </summary>
+				Header PresenceHeader(FieldId field)
+				{
+					return static_cast<Header>(static_cast<int>(field) - static_cast<int>(FieldId::Ip) + static_cast<int>(Header::Ip));
+				}
+
+				FieldId PresenceField(Header header)
+				{
+					return static_cast<FieldId>(static_cast<int>(header) - static_cast<int>(Header::Ip) + static_cast<int>(FieldId::Ip));
+				}
+
+				uint32_t HeaderBit(Header header)
+				{
+					return static_cast<uint32_t>(1) << static_cast<int>(header);
+				}
+
+				/// <summary>
+				/// Adds the headers that a set of headers brings with it: ICMP is only found over IPv4
+				/// and ICMPv6 only over IPv6.
+				/// </summary>
+				uint32_t Implied(uint32_t headers)
+				{
+					if ((headers & HeaderBit(Header::Icmp)) != 0)
+					{
+						headers |= HeaderBit(Header::Ip);
+					}
+
+					if ((headers & HeaderBit(Header::Icmpv6)) != 0)
+					{
+						headers |= HeaderBit(Header::Ipv6);
+					}
+
+					return headers;
+				}
+
+				/// <summary>
+				/// Adds the headers that can't be present once a set of headers is known to be missing.
+				/// </summary>
+				uint32_t Precluded(uint32_t headers)
+				{
+					if ((headers & HeaderBit(Header::Ip)) != 0)
+					{
+						headers |= HeaderBit(Header::Icmp);
+					}
+
+					if ((headers & HeaderBit(Header::Ipv6)) != 0)
+					{
+						headers |= HeaderBit(Header::Icmpv6);
+					}
+
+					return headers;
+				}
+
+				/// <summary>
+				/// Whether a packet can carry all of a set of headers at once: one of IPv4 and IPv6,
+				/// and at most one transport header.
+				/// </summary>
+				bool Compatible(uint32_t headers)
+				{
+					const uint32_t transports = headers & (HeaderBit(Header::Icmp) | HeaderBit(Header::Icmpv6) | HeaderBit(Header::Tcp) | HeaderBit(Header::Udp));
+					const uint32_t networks = HeaderBit(Header::Ip) | HeaderBit(Header::Ipv6);
+					return (headers & networks) != networks && (transports & (transports - 1)) == 0;
+				}
+
+				Value Successor(Value value)
+				{
+					for (int i = 0; i < 4 && ++value.Words[i] == 0; ++i)
+					{
+					}
+
+					return value;
+				}
+
+				Value Predecessor(Value value)
+				{
+					for (int i = 0; i < 4 && value.Words[i]-- == 0; ++i)
+					{
+					}
+
+					return value;
+				}
+
+				bool IsZero(const Value& value)
+				{
+					return (value.Words[0] | value.Words[1] | value.Words[2] | value.Words[3]) == 0;
+				}
+
+				/// <summary>
+				/// A closed range of field values.
+				/// </summary>
+				struct Interval
+				{
+					Value Low;
+
+					Value High;
+				};
+
+				/// <summary>
+				/// The values a test of a field matches, as sorted ranges that neither overlap nor
+				/// touch, so that equal sets are equal vectors.
+				/// </summary>
+				typedef std::vector<Interval> ValueSet;
+
+				bool SameSet(const ValueSet& left, const ValueSet& right)
+				{
+					if (left.size() != right.size())
+					{
+						return false;
+					}
+
+					for (size_t i = 0; i < left.size(); ++i)
+					{
+						if (Order(left[i].Low, right[i].Low) != 0 || Order(left[i].High, right[i].High) != 0)
+						{
+							return false;
+						}
+					}
+
+					return true;
+				}
+
+				ValueSet Span(const Value& low, const Value& high)
+				{
+					ValueSet set;
+
+					if (Order(low, high) <= 0)
+					{
+						set.push_back({ low, high });
+					}
+
+					return set;
+				}
+
+				ValueSet Everything(FieldId field)
+				{
+					return Span(Value(), FieldMaximum(field));
+				}
+
+				ValueSet Single(uint32_t value)
+				{
+					Value constant = Value();
+					constant.Words[0] = value;
+					return Span(constant, constant);
+				}
+
+				bool IsEverything(const ValueSet& set, FieldId field)
+				{
+					return set.size() == 1 && IsZero(set[0].Low) && Order(set[0].High, FieldMaximum(field)) == 0;
+				}
+
+				bool Contains(const ValueSet& set, uint32_t value)
+				{
+					Value constant = Value();
+					constant.Words[0] = value;
+
+					for (const Interval& interval : set)
+					{
+						if (Order(interval.Low, constant) <= 0 && Order(constant, interval.High) <= 0)
+						{
+							return true;
+						}
+					}
+
+					return false;
+				}
+
+				ValueSet Intersect(const ValueSet& left, const ValueSet& right)
+				{
+					ValueSet set;
+					size_t i = 0;
+					size_t j = 0;
+
+					while (i < left.size() && j < right.size())
+					{
+						const Value& low = Order(left[i].Low, right[j].Low) >= 0 ? left[i].Low : right[j].Low;
+						const Value& high = Order(left[i].High, right[j].High) <= 0 ? left[i].High : right[j].High;
+
+						if (Order(low, high) <= 0)
+						{
+							set.push_back({ low, high });
+						}
+
+						if (Order(left[i].High, right[j].High) < 0)
+						{
+							++i;
+						}
+						else
+						{
+							++j;
+						}
+					}
+
+					return set;
+				}
+
+				ValueSet Unite(const ValueSet& left, const ValueSet& right)
+				{
+					ValueSet all(left);
+					all.insert(all.end(), right.begin(), right.end());
+					std::sort(all.begin(), all.end(), [](const Interval& a, const Interval& b) { return Order(a.Low, b.Low) < 0; });
+
+					ValueSet set;
+
+					for (const Interval& interval : all)
+					{
+						// Ranges merge when they overlap or when one starts right after the other ends.
+						if (!set.empty() && (Order(interval.Low, set.back().High) <= 0 || Order(interval.Low, Successor(set.back().High)) == 0))
+						{
+							if (Order(interval.High, set.back().High) > 0)
+							{
+								set.back().High = interval.High;
+							}
+						}
+						else
+						{
+							set.push_back(interval);
+						}
+					}
+
+					return set;
+				}
+
+				ValueSet Complement(const ValueSet& set, FieldId field)
+				{
+					ValueSet complement;
+					Value next = Value();
+					bool done = false;
+
+					for (const Interval& interval : set)
+					{
+						if (Order(next, interval.Low) < 0)
+						{
+							complement.push_back({ next, Predecessor(interval.Low) });
+						}
+
+						if (Order(interval.High, FieldMaximum(field)) >= 0)
+						{
+							done = true;
+							break;
+						}
+
+						next = Successor(interval.High);
+					}
+
+					if (!done)
+					{
+						complement.push_back({ next, FieldMaximum(field) });
+					}
+
+					return complement;
+				}
+
+				ValueSet Subtract(const ValueSet& left, const ValueSet& right, FieldId field)
+				{
+					return Intersect(left, Complement(right, field));
+				}
+
+				bool IsSubset(const ValueSet& left, const ValueSet& right, FieldId field)
+				{
+					return Subtract(left, right, field).empty();
+				}
+
+				/// <summary>
+				/// The values of a field that pass a comparison with a constant.
+				/// </summary>
+				ValueSet Matching(FieldId field, Comparison test, const Value& constant)
+				{
+					const Value maximum = FieldMaximum(field);
+					const Value clipped = Order(constant, maximum) <= 0 ? constant : maximum;
+					const bool inside = Order(constant, maximum) <= 0;
+
+					switch (test)
+					{
+						case Comparison::Equal:
+							return inside ? Span(constant, constant) : ValueSet();
+
+						case Comparison::NotEqual:
+							return Subtract(Everything(field), Span(constant, constant), field);
+
+						case Comparison::Less:
+							return IsZero(constant) ? ValueSet() : Span(Value(), inside ? Predecessor(constant) : maximum);
+
+						case Comparison::LessOrEqual:
+							return Span(Value(), clipped);
+
+						case Comparison::Greater:
+							return inside && Order(constant, maximum) != 0 ? Span(Successor(constant), maximum) : ValueSet();
+
+						default:
+							return inside ? Span(constant, maximum) : ValueSet();
+					}
+				}
+
+				enum class TermKind : uint8_t
+				{
+					True,
+					False,
+					Atom,
+					Not,
+					And,
+					Or,
+					Choose
+				};
+
+				/// <summary>
+				/// A filter as the analyzer sees it. Each comparison becomes an atom: the set of values
+				/// of its field that pass, and tests of one field can then be merged by combining
+				/// sets. An atom matches a packet that has the field's header and a value in the set.
+				/// Operands are held by value, since terms are small and rewritten often.
+				/// </summary>
+				struct Term
+				{
+					TermKind Kind;
+
+					FieldId Field;
+
+					ValueSet Set;
+
+					std::vector<Term> Operands;
+				};
+
+				bool Same(const Term& left, const Term& right)
+				{
+					if (left.Kind != right.Kind || left.Operands.size() != right.Operands.size())
+					{
+						return false;
+					}
+
+					if (left.Kind == TermKind::Atom && (left.Field != right.Field || !SameSet(left.Set, right.Set)))
+					{
+						return false;
+					}
+
+					for (size_t i = 0; i < left.Operands.size(); ++i)
+					{
+						if (!Same(left.Operands[i], right.Operands[i]))
+						{
+							return false;
+						}
+					}
+
+					return true;
+				}
+
+				Term Constant(bool value)
+				{
+					Term term = Term();
+					term.Kind = value ? TermKind::True : TermKind::False;
+					return term;
+				}
+
+				Term Compound(TermKind kind, std::vector<Term> operands)
+				{
+					Term term = Term();
+					term.Kind = kind;
+					term.Operands = std::move(operands);
+					return term;
+				}
+
+				/// <summary>
+				/// Builds an atom, folding sets that always or never pass: a test no value passes is
+				/// false, and one every value passes only checks for its header.
+				/// </summary>
+				Term MakeAtom(FieldId field, ValueSet set)
+				{
+					if (set.empty())
+					{
+						return Constant(false);
+					}
+
+					if (IsEverything(set, field))
+					{
+						if (IsPresenceField(field))
+						{
+							return Constant(true);
+						}
+
+						if (FieldHeader(field) != Header::Address)
+						{
+							field = PresenceField(FieldHeader(field));
+							set = Single(1);
+						}
+					}
+
+					Term term = Term();
+					term.Kind = TermKind::Atom;
+					term.Field = field;
+					term.Set = std::move(set);
+					return term;
+				}
+
+				bool IsLiteral(const Term& term)
+				{
+					return term.Kind == TermKind::Atom || (term.Kind == TermKind::Not && term.Operands[0].Kind == TermKind::Atom);
+				}
+
+				const Term& AtomOf(const Term& literal)
+				{
+					return literal.Kind == TermKind::Atom ? literal : literal.Operands[0];
+				}
+
+				/// <summary>
+				/// Negates a term. Presence fields can always be read, so negating a test of one only
+				/// flips its set. Any other test also fails when the header is missing, which not
+				/// turns into a match, so it keeps its not.
+				/// </summary>
+				Term Negate(Term term)
+				{
+					switch (term.Kind)
+					{
+						case TermKind::True:
+							return Constant(false);
+
+						case TermKind::False:
+							return Constant(true);
+
+						case TermKind::Not:
+							return std::move(term.Operands[0]);
+
+						case TermKind::Atom:
+							if (IsPresenceField(term.Field))
+							{
+								return MakeAtom(term.Field, Complement(term.Set, term.Field));
+							}
+
+							break;
+
+						default:
+							break;
+					}
+
+					std::vector<Term> operands;
+					operands.push_back(std::move(term));
+					return Compound(TermKind::Not, std::move(operands));
+				}
+
+				/// <summary>
+				/// The headers a positive atom needs, and those it rules out.
+				/// </summary>
+				void HeaderNeeds(const Term& atom, uint32_t& required, uint32_t& precluded)
+				{
+					required = 0;
+					precluded = 0;
+
+					if (IsPresenceField(atom.Field))
+					{
+						if (!Contains(atom.Set, 0))
+						{
+							required = Implied(HeaderBit(PresenceHeader(atom.Field)));
+						}
+						else if (!Contains(atom.Set, 1))
+						{
+							precluded = Precluded(HeaderBit(PresenceHeader(atom.Field)));
+						}
+					}
+					else
+					{
+						required = Implied(HeaderBit(FieldHeader(atom.Field)));
+					}
+				}
+
+				bool Disjoint(const Term& left, const Term& right);
+
+				/// <summary>
+				/// Whether every packet matching one literal matches the other too. May answer false
+				/// when it can't tell.
+				/// </summary>
+				bool Subset(const Term& left, const Term& right)
+				{
+					if (left.Kind == TermKind::Not)
+					{
+						return right.Kind == TermKind::Not && Subset(right.Operands[0], left.Operands[0]);
+					}
+
+					if (right.Kind == TermKind::Not)
+					{
+						return Disjoint(left, right.Operands[0]);
+					}
+
+					if (left.Field == right.Field)
+					{
+						return IsSubset(left.Set, right.Set, left.Field);
+					}
+
+					if (!IsPresenceField(right.Field))
+					{
+						return false;
+					}
+
+					uint32_t required;
+					uint32_t precluded;
+					HeaderNeeds(left, required, precluded);
+
+					const uint32_t header = HeaderBit(PresenceHeader(right.Field));
+
+					if (!Contains(right.Set, 0))
+					{
+						return (required & header) != 0;
+					}
+
+					return (precluded & header) != 0 || !Compatible(required | header);
+				}
+
+				/// <summary>
+				/// Whether no packet matches both literals. May answer false when it can't tell.
+				/// </summary>
+				bool Disjoint(const Term& left, const Term& right)
+				{
+					if (left.Kind == TermKind::Not)
+					{
+						return right.Kind != TermKind::Not && Subset(right, left.Operands[0]);
+					}
+
+					if (right.Kind == TermKind::Not)
+					{
+						return Subset(left, right.Operands[0]);
+					}
+
+					if (left.Field == right.Field)
+					{
+						return Intersect(left.Set, right.Set).empty();
+					}
+
+					uint32_t leftRequired;
+					uint32_t leftPrecluded;
+					uint32_t rightRequired;
+					uint32_t rightPrecluded;
+					HeaderNeeds(left, leftRequired, leftPrecluded);
+					HeaderNeeds(right, rightRequired, rightPrecluded);
+
+					return !Compatible(leftRequired | rightRequired) || (leftRequired & rightPrecluded) != 0 || (rightRequired & leftPrecluded) != 0;
+				}
+
+				/// <summary>
+				/// Whether every packet matches at least one of two literals.
+				/// </summary>
+				bool Covers(const Term& left, const Term& right)
+				{
+					const Term notLeft = Negate(left);
+					const Term notRight = Negate(right);
+					return IsLiteral(notLeft) && IsLiteral(notRight) && Disjoint(notLeft, notRight);
+				}
+
+				Term Simplify(Term term);
+
+				/// <summary>
+				/// Replaces the literals of a term that facts, themselves literals, decide: those no
+				/// packet satisfying a fact matches become false, and those every such packet matches
+				/// become true.
+				/// </summary>
+				Term Assume(const Term& term, const std::vector<Term>& facts)
+				{
+					if (IsLiteral(term))
+					{
+						for (const Term& fact : facts)
+						{
+							if (Disjoint(fact, term))
+							{
+								return Constant(false);
+							}
+
+							if (Subset(fact, term))
+							{
+								return Constant(true);
+							}
+						}
+
+						return term;
+					}
+
+					Term assumed = term;
+
+					for (Term& operand : assumed.Operands)
+					{
+						operand = Assume(operand, facts);
+					}
+
+					return assumed;
+				}
+
+				/// <summary>
+				/// The most operands of one and or or that are compared with each other in pairs.
+				/// Longer runs are only merged by field, which is linear.
+				/// </summary>
+				const size_t MaximumPairwise = 256;
+
+				/// <summary>
+				/// Simplifies the operands of one and or or, given already simplified operands.
+				/// Nested runs of the same kind are flattened and constants folded. Then tests of one
+				/// field are merged into a single atom, and in the ands the negated ones too, where
+				/// the first of them stood. Last, literals are compared in pairs: in an and, those
+				/// implied by another are dropped and a contradiction makes the whole and false; in an
+				/// or, those implying another are dropped and a pair covering every packet makes it
+				/// true. Repeats until nothing changes, since each rewrite can enable another.
+				/// </summary>
+				Term Combine(TermKind kind, std::vector<Term> operands)
+				{
+					const bool isAnd = kind == TermKind::And;
+					const TermKind identity = isAnd ? TermKind::True : TermKind::False;
+					const TermKind absorbing = isAnd ? TermKind::False : TermKind::True;
+
+					for (bool changed = true; changed;)
+					{
+						changed = false;
+
+						std::vector<Term> flat;
+
+						for (Term& operand : operands)
+						{
+							if (operand.Kind == kind)
+							{
+								for (Term& inner : operand.Operands)
+								{
+									flat.push_back(std::move(inner));
+								}
+
+								changed = true;
+							}
+							else
+							{
+								flat.push_back(std::move(operand));
+							}
+						}
+
+						std::vector<Term> merged;
+						std::vector<size_t> positive(FieldCount, SIZE_MAX);
+						std::vector<size_t> negative(FieldCount, SIZE_MAX);
+						std::vector<std::vector<ValueSet>> pending(FieldCount * 2);
+
+						for (Term& operand : flat)
+						{
+							if (operand.Kind == identity)
+							{
+								changed = true;
+								continue;
+							}
+
+							if (operand.Kind == absorbing)
+							{
+								return Constant(!isAnd);
+							}
+
+							if (IsLiteral(operand))
+							{
+								const Term& atom = AtomOf(operand);
+								const bool isAtom = operand.Kind == TermKind::Atom;
+								const size_t field = static_cast<size_t>(atom.Field);
+								size_t& slot = (isAtom ? positive : negative)[field];
+
+								// Further tests of a field are collected and merged into the first
+								// once all are known, so that long runs are merged in one go.
+								if (slot != SIZE_MAX)
+								{
+									pending[field * 2 + (isAtom ? 0 : 1)].push_back(atom.Set);
+									changed = true;
+									continue;
+								}
+
+								slot = merged.size();
+							}
+							else
+							{
+								bool repeated = false;
+
+								for (size_t i = 0; i < merged.size() && i < MaximumPairwise && !repeated; ++i)
+								{
+									repeated = Same(merged[i], operand);
+								}
+
+								if (repeated)
+								{
+									changed = true;
+									continue;
+								}
+							}
+
+							merged.push_back(std::move(operand));
+						}
+
+						// Tests of the same field: p and S and p and T is p and (S and T), and
+						// not (p and S) and not (p and T) is not (p and (S or T)). Or the other way
+						// around in an or.
+						for (size_t i = 0; i < pending.size(); ++i)
+						{
+							if (pending[i].empty())
+							{
+								continue;
+							}
+
+							const bool isAtom = i % 2 == 0;
+							const FieldId field = static_cast<FieldId>(i / 2);
+							Term& existing = merged[(isAtom ? positive : negative)[i / 2]];
+							ValueSet set = AtomOf(existing).Set;
+
+							if (isAnd == isAtom)
+							{
+								for (const ValueSet& other : pending[i])
+								{
+									set = Intersect(set, other);
+								}
+							}
+							else
+							{
+								for (const ValueSet& other : pending[i])
+								{
+									set.insert(set.end(), other.begin(), other.end());
+								}
+
+								set = Unite(set, ValueSet());
+							}
+
+							Term replacement = MakeAtom(field, std::move(set));
+							existing = isAtom ? std::move(replacement) : Negate(std::move(replacement));
+						}
+
+						// A test and a negated test of the same field: p and S and not (p and T) is
+						// p and (S - T), and p and S or not (p and T) is not (p and (T - S)).
+						for (size_t field = 0; field < FieldCount; ++field)
+						{
+							if (positive[field] == SIZE_MAX || negative[field] == SIZE_MAX)
+							{
+								continue;
+							}
+
+							Term& atom = merged[positive[field]];
+							Term& negated = merged[negative[field]];
+
+							if (atom.Kind != TermKind::Atom || negated.Kind != TermKind::Not || negated.Operands[0].Kind != TermKind::Atom || atom.Field != negated.Operands[0].Field)
+							{
+								continue;
+							}
+
+							const FieldId id = atom.Field;
+
+							if (isAnd)
+							{
+								atom = MakeAtom(id, Subtract(atom.Set, negated.Operands[0].Set, id));
+								negated = Constant(true);
+							}
+							else
+							{
+								negated = Negate(MakeAtom(id, Subtract(negated.Operands[0].Set, atom.Set, id)));
+								atom = Constant(false);
+							}
+
+							changed = true;
+						}
+
+						std::vector<bool> dropped(merged.size(), false);
+
+						for (size_t i = 0; i < merged.size() && i < MaximumPairwise; ++i)
+						{
+							if (dropped[i])
+							{
+								continue;
+							}
+
+							if (merged[i].Kind == absorbing)
+							{
+								return Constant(!isAnd);
+							}
+
+							for (size_t j = 0; j < merged.size() && j < MaximumPairwise && !dropped[i]; ++j)
+							{
+								if (i == j || dropped[j])
+								{
+									continue;
+								}
+
+								const Term& left = merged[i];
+								Term& right = merged[j];
+
+								if (!IsLiteral(left) || !IsLiteral(right))
+								{
+									// x and not x, or x or not x.
+									if (left.Kind == TermKind::Not && Same(left.Operands[0], right))
+									{
+										return Constant(!isAnd);
+									}
+
+									continue;
+								}
+
+								if (isAnd ? Disjoint(left, right) : Covers(left, right))
+								{
+									return Constant(!isAnd);
+								}
+
+								if (isAnd ? Subset(left, right) : Subset(right, left))
+								{
+									dropped[j] = true;
+									changed = true;
+									continue;
+								}
+
+								// A negated test of a field whose header another test needs:
+								// p and not (p and T) is p and not T. And the other way around,
+								// not p or p and S is not (p and not S).
+								const Header header = FieldHeader(AtomOf(right).Field);
+
+								if (left.Kind != TermKind::Atom || header == Header::None || header == Header::Address)
+								{
+									continue;
+								}
+
+								uint32_t required;
+								uint32_t precluded;
+								HeaderNeeds(left, required, precluded);
+
+								if (isAnd && right.Kind == TermKind::Not && (required & HeaderBit(header)) != 0)
+								{
+									right = MakeAtom(AtomOf(right).Field, Complement(AtomOf(right).Set, AtomOf(right).Field));
+									changed = true;
+								}
+								else if (!isAnd && right.Kind == TermKind::Atom && left.Field == PresenceField(header) && SameSet(left.Set, Single(0)))
+								{
+									right = Negate(MakeAtom(right.Field, Complement(right.Set, right.Field)));
+									changed = true;
+								}
+							}
+						}
+
+						// The other operands only matter when the literals here hold, for an and,
+						// or fail, for an or, so the rest can be simplified assuming that.
+						std::vector<Term> facts;
+
+						for (size_t i = 0; i < merged.size() && facts.size() < MaximumPairwise; ++i)
+						{
+							if (!dropped[i] && IsLiteral(merged[i]))
+							{
+								facts.push_back(isAnd ? merged[i] : Negate(merged[i]));
+							}
+						}
+
+						for (size_t i = 0; i < merged.size() && !facts.empty(); ++i)
+						{
+							if (dropped[i] || IsLiteral(merged[i]))
+							{
+								continue;
+							}
+
+							Term assumed = Simplify(Assume(merged[i], facts));
+
+							if (!Same(assumed, merged[i]))
+							{
+								merged[i] = std::move(assumed);
+								changed = true;
+							}
+						}
+
+						operands.clear();
+
+						for (size_t i = 0; i < merged.size(); ++i)
+						{
+							if (!dropped[i])
+							{
+								operands.push_back(std::move(merged[i]));
+							}
+						}
+					}
+
+					if (operands.empty())
+					{
+						return Constant(isAnd);
+					}
+
+					if (operands.size() == 1)
+					{
+						return std::move(operands[0]);
+					}
+
+					return Compound(kind, std::move(operands));
+				}
+
+				Term Simplify(Term term)
+				{
+					switch (term.Kind)
+					{
+						case TermKind::Atom:
+							return MakeAtom(term.Field, std::move(term.Set));
+
+						case TermKind::Not:
+							return Negate(Simplify(std::move(term.Operands[0])));
+
+						case TermKind::And:
+						case TermKind::Or:
+						{
+							std::vector<Term> operands;
+
+							for (Term& operand : term.Operands)
+							{
+								operands.push_back(Simplify(std::move(operand)));
+							}
+
+							return Combine(term.Kind, std::move(operands));
+						}
+
+						case TermKind::Choose:
+						{
+							Term condition = Simplify(std::move(term.Operands[0]));
+							Term then = Simplify(std::move(term.Operands[1]));
+							Term otherwise = Simplify(std::move(term.Operands[2]));
+
+							if (IsLiteral(condition))
+							{
+								then = Simplify(Assume(then, { condition }));
+								otherwise = Simplify(Assume(otherwise, { Negate(condition) }));
+							}
+
+							if (condition.Kind == TermKind::True || Same(then, otherwise))
+							{
+								return then;
+							}
+
+							if (condition.Kind == TermKind::False)
+							{
+								return otherwise;
+							}
+
+							// With a constant branch, (c? a: b) is an and or an or of c and the other
+							// branch, which the rules for those can simplify further.
+							std::vector<Term> operands;
+
+							if (then.Kind == TermKind::True || then.Kind == TermKind::False)
+							{
+								const bool value = then.Kind == TermKind::True;
+								operands.push_back(value ? std::move(condition) : Negate(std::move(condition)));
+								operands.push_back(std::move(otherwise));
+								return Combine(value ? TermKind::Or : TermKind::And, std::move(operands));
+							}
+
+							if (otherwise.Kind == TermKind::True || otherwise.Kind == TermKind::False)
+							{
+								const bool value = otherwise.Kind == TermKind::True;
+								operands.push_back(value ? Negate(std::move(condition)) : std::move(condition));
+								operands.push_back(std::move(then));
+								return Combine(value ? TermKind::Or : TermKind::And, std::move(operands));
+							}
+
+							operands.push_back(std::move(condition));
+							operands.push_back(std::move(then));
+							operands.push_back(std::move(otherwise));
+							return Compound(TermKind::Choose, std::move(operands));
+						}
+
+						default:
+							return term;
+					}
+				}
+
+				Term ToTerm(const std::vector<Node>& nodes, uint32_t index)
+				{
+					const Node& node = nodes[index];
+
+					switch (node.Kind)
+					{
+						case NodeKind::True:
+							return Constant(true);
+
+						case NodeKind::False:
+							return Constant(false);
+
+						case NodeKind::Test:
+						{
+							Term term = Term();
+							term.Kind = TermKind::Atom;
+							term.Field = node.Field;
+							term.Set = Matching(node.Field, node.Test, node.Constant);
+							return term;
+						}
+
+						default:
+							break;
+					}
+
+					std::vector<Term> operands;
+
+					for (uint32_t operand = node.First; operand != NoNode; operand = nodes[operand].Next)
+					{
+						operands.push_back(ToTerm(nodes, operand));
+					}
+
+					const TermKind kind = node.Kind == NodeKind::Not ? TermKind::Not : node.Kind == NodeKind::And ? TermKind::And : node.Kind == NodeKind::Or ? TermKind::Or : TermKind::Choose;
+					return Compound(kind, std::move(operands));
+				}
+
+				/// <summary>
+				/// Turns terms back into nodes, for the compiler and for printing. An atom becomes
+				/// whichever is shorter of an or of its ranges and an and of the bounds and gaps.
+				/// </summary>
+				class Lowering
+				{
+
+				public:
+
+					explicit Lowering(std::vector<Node>& nodes) : m_nodes(nodes)
+					{
+					}
+
+					uint32_t Lower(const Term& term)
+					{
+						switch (term.Kind)
+						{
+							case TermKind::True:
+								return Add(NodeKind::True);
+
+							case TermKind::False:
+								return Add(NodeKind::False);
+
+							case TermKind::Atom:
+								return LowerAtom(term.Field, term.Set);
+
+							default:
+								break;
+						}
+
+						std::vector<uint32_t> operands;
+
+						for (const Term& operand : term.Operands)
+						{
+							operands.push_back(Lower(operand));
+						}
+
+						const NodeKind kind = term.Kind == TermKind::Not ? NodeKind::Not : term.Kind == TermKind::And ? NodeKind::And : term.Kind == TermKind::Or ? NodeKind::Or : NodeKind::Choose;
+						return Join(kind, operands);
+					}
+
+				private:
+
+					uint32_t Add(NodeKind kind)
+					{
+						Node node = Node();
+						node.Kind = kind;
+						node.First = NoNode;
+						node.Next = NoNode;
+						m_nodes.push_back(node);
+						return static_cast<uint32_t>(m_nodes.size() - 1);
+					}
+
+					uint32_t Join(NodeKind kind, const std::vector<uint32_t>& operands)
+					{
+						if (operands.size() == 1 && kind != NodeKind::Not)
+						{
+							return operands[0];
+						}
+
+						for (size_t i = 1; i < operands.size(); ++i)
+						{
+							m_nodes[operands[i - 1]].Next = operands[i];
+						}
+
+						const uint32_t node = Add(kind);
+						m_nodes[node].First = operands[0];
+						return node;
+					}
+
+					uint32_t Test(FieldId field, Comparison test, const Value& constant)
+					{
+						const uint32_t node = Add(NodeKind::Test);
+						m_nodes[node].Field = field;
+						m_nodes[node].Test = test;
+						m_nodes[node].Constant = constant;
+						return node;
+					}
+
+					uint32_t LowerAtom(FieldId field, const ValueSet& set)
+					{
+						const Value maximum = FieldMaximum(field);
+
+						// A presence field that must be 0 reads best as not tcp.
+						if (IsPresenceField(field) && SameSet(set, Single(0)))
+						{
+							return Join(NodeKind::Not, { Test(field, Comparison::NotEqual, Value()) });
+						}
+
+						if (FieldWidth(field) == 1 && SameSet(set, Single(1)))
+						{
+							return Test(field, Comparison::NotEqual, Value());
+						}
+
+						const ValueSet gaps = Intersect(Complement(set, field), Span(set.front().Low, set.back().High));
+						size_t rangeCost = 0;
+						size_t gapCost = (IsZero(set.front().Low) ? 0 : 1) + (Order(set.back().High, maximum) == 0 ? 0 : 1);
+
+						for (const Interval& interval : set)
+						{
+							rangeCost += Order(interval.Low, interval.High) == 0 || IsZero(interval.Low) || Order(interval.High, maximum) == 0 ? 1 : 2;
+						}
+
+						for (const Interval& gap : gaps)
+						{
+							gapCost += Order(gap.Low, gap.High) == 0 ? 1 : 2;
+						}
+
+						std::vector<uint32_t> operands;
+
+						if (rangeCost <= gapCost || gapCost == 0)
+						{
+							for (const Interval& interval : set)
+							{
+								if (Order(interval.Low, interval.High) == 0)
+								{
+									operands.push_back(Test(field, Comparison::Equal, interval.Low));
+								}
+								else if (IsZero(interval.Low) && Order(interval.High, maximum) == 0)
+								{
+									operands.push_back(Test(field, Comparison::GreaterOrEqual, Value()));
+								}
+								else if (IsZero(interval.Low))
+								{
+									operands.push_back(Test(field, Comparison::LessOrEqual, interval.High));
+								}
+								else if (Order(interval.High, maximum) == 0)
+								{
+									operands.push_back(Test(field, Comparison::GreaterOrEqual, interval.Low));
+								}
+								else
+								{
+									operands.push_back(Join(NodeKind::And, { Test(field, Comparison::GreaterOrEqual, interval.Low), Test(field, Comparison::LessOrEqual, interval.High) }));
+								}
+							}
+
+							return Join(NodeKind::Or, operands);
+						}
+
+						if (!IsZero(set.front().Low))
+						{
+							operands.push_back(Test(field, Comparison::GreaterOrEqual, set.front().Low));
+						}
+
+						if (Order(set.back().High, maximum) != 0)
+						{
+							operands.push_back(Test(field, Comparison::LessOrEqual, set.back().High));
+						}
+
+						for (const Interval& gap : gaps)
+						{
+							if (Order(gap.Low, gap.High) == 0)
+							{
+								operands.push_back(Test(field, Comparison::NotEqual, gap.Low));
+							}
+							else
+							{
+								operands.push_back(Join(NodeKind::Or, { Test(field, Comparison::Less, gap.Low), Test(field, Comparison::Greater, gap.High) }));
+							}
+						}
+
+						return Join(NodeKind::And, operands);
+					}
+
+					std::vector<Node>& m_nodes;
+
+				};
+
+				const char* FieldText(FieldId field)
+				{
+					for (const FieldName& name : FieldNames)
+					{
+						if (name.Id == field)
+						{
+							return name.Name;
+						}
+					}
+
+					return "";
+				}
+
+				const char* ComparisonText(Comparison test)
+				{
+					switch (test)
+					{
+						case Comparison::Equal: return " == ";
+						case Comparison::NotEqual: return " != ";
+						case Comparison::Less: return " < ";
+						case Comparison::LessOrEqual: return " <= ";
+						case Comparison::Greater: return " > ";
+						default: return " >= ";
+					}
+				}
+
+				/// <summary>
+				/// Writes nodes out in the filter language, with only the parentheses it needs.
+				/// Addresses are written as addresses, everything else in decimal.
+				/// </summary>
+				void Print(const std::vector<Node>& nodes, uint32_t index, std::string& text)
+				{
+					const Node& node = nodes[index];
+					char buffer[64];
+
+					switch (node.Kind)
+					{
+						case NodeKind::True:
+							text += "true";
+							return;
+
+						case NodeKind::False:
+							text += "false";
+							return;
+
+						case NodeKind::Test:
+						{
+							text += FieldText(node.Field);
+
+							if (node.Test == Comparison::NotEqual && IsZero(node.Constant) && FieldWidth(node.Field) == 1)
+							{
+								return;
+							}
+
+							text += ComparisonText(node.Test);
+
+							if (node.Field == FieldId::IpSrcAddr || node.Field == FieldId::IpDstAddr)
+							{
+								const uint32_t address = node.Constant.Words[0];
+								std::snprintf(buffer, sizeof(buffer), "%u.%u.%u.%u", address >> 24, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+								text += buffer;
+							}
+							else if (node.Field == FieldId::Ipv6SrcAddr || node.Field == FieldId::Ipv6DstAddr)
+							{
+								uint32_t groups[8];
+
+								for (int g = 0; g < 8; ++g)
+								{
+									groups[g] = (node.Constant.Words[3 - g / 2] >> (g % 2 == 0 ? 16 : 0)) & 0xFFFF;
+								}
+
+								// Compress the longest run of zero groups, as is usual.
+								int runStart = -1;
+								int runLength = 1;
+
+								for (int g = 0; g < 8;)
+								{
+									int end = g;
+
+									while (end < 8 && groups[end] == 0)
+									{
+										++end;
+									}
+
+									if (end - g > runLength)
+									{
+										runStart = g;
+										runLength = end - g;
+									}
+
+									g = end == g ? g + 1 : end;
+								}
+
+								for (int g = 0; g < 8; ++g)
+								{
+									if (g == runStart)
+									{
+										text += "::";
+										g += runLength - 1;
+										continue;
+									}
+
+									if (g != 0 && g != runStart + runLength)
+									{
+										text += ":";
+									}
+
+									std::snprintf(buffer, sizeof(buffer), "%x", groups[g]);
+									text += buffer;
+								}
+							}
+							else
+							{
+								std::snprintf(buffer, sizeof(buffer), "%u", node.Constant.Words[0]);
+								text += buffer;
+							}
+
+							return;
+						}
+
+						case NodeKind::Not:
+						{
+							const Node& operand = nodes[node.First];
+							const bool parenthesize = operand.Kind == NodeKind::And || operand.Kind == NodeKind::Or;
+							text += parenthesize ? "not (" : "not ";
+							Print(nodes, node.First, text);
+							text += parenthesize ? ")" : "";
+							return;
+						}
+
+						case NodeKind::Choose:
+						{
+							const uint32_t then = nodes[node.First].Next;
+							const uint32_t otherwise = nodes[then].Next;
+							text += "(";
+							Print(nodes, node.First, text);
+							text += "? ";
+							Print(nodes, then, text);
+							text += ": ";
+							Print(nodes, otherwise, text);
+							text += ")";
+							return;
+						}
+
+						default:
+							break;
+					}
+
+					for (uint32_t operand = node.First; operand != NoNode; operand = nodes[operand].Next)
+					{
+						const bool parenthesize = node.Kind == NodeKind::And && nodes[operand].Kind == NodeKind::Or;
+
+						if (operand != node.First)
+						{
+							text += node.Kind == NodeKind::And ? " and " : " or ";
+						}
+
+						text += parenthesize ? "(" : "";
+						Print(nodes, operand, text);
+						text += parenthesize ? ")" : "";
+					}
+				}
+
+				/// <summary>
+				/// One way for a packet to match a filter: a set of values for each field it tests.
+				/// </summary>
+				typedef std::map<FieldId, ValueSet> Conjunct;
+
+				/// <summary>
+				/// The most conjuncts a filter is expanded into before overlap is given up on.
+				/// </summary>
+				const size_t MaximumConjuncts = 4096;
+
+				bool Restrict(Conjunct& conjunct, FieldId field, const ValueSet& set)
+				{
+					auto found = conjunct.find(field);
+
+					if (found == conjunct.end())
+					{
+						conjunct.emplace(field, set);
+						return !set.empty();
+					}
+
+					found->second = Intersect(found->second, set);
+					return !found->second.empty();
+				}
+
+				/// <summary>
+				/// Whether some packet diverted by WinDivert could satisfy a conjunct. Beyond the sets
+				/// of each field, the headers have to fit together, an IPv4 packet only has a TCP, UDP
+				/// or ICMP header when it's not a later fragment and its protocol says so, and a
+				/// diverted packet is either inbound or outbound.
+				/// </summary>
+				bool Satisfiable(const Conjunct& conjunct)
+				{
+					uint32_t required = 0;
+					uint32_t precluded = 0;
+
+					for (const auto& entry : conjunct)
+					{
+						if (IsPresenceField(entry.first))
+						{
+							const uint32_t header = HeaderBit(PresenceHeader(entry.first));
+							required |= Contains(entry.second, 0) ? 0 : header;
+							precluded |= Contains(entry.second, 1) ? 0 : header;
+						}
+						else if (FieldHeader(entry.first) != Header::Address)
+						{
+							required |= HeaderBit(FieldHeader(entry.first));
+						}
+					}
+
+					required = Implied(required);
+					precluded = Precluded(precluded);
+
+					const uint32_t ip = HeaderBit(Header::Ip);
+					const uint32_t ipv6 = HeaderBit(Header::Ipv6);
+
+					// TCP and UDP need one of IPv4 and IPv6.
+					if ((required & (HeaderBit(Header::Tcp) | HeaderBit(Header::Udp))) != 0 && (precluded & (ip | ipv6)) != 0)
+					{
+						if ((precluded & (ip | ipv6)) == (ip | ipv6))
+						{
+							return false;
+						}
+
+						required |= (precluded & ip) != 0 ? ipv6 : ip;
+					}
+
+					if (!Compatible(required) || (required & precluded) != 0)
+					{
+						return false;
+					}
+
+					if ((required & ip) != 0)
+					{
+						const std::pair<Header, uint32_t> protocols[] = { { Header::Icmp, 1 }, { Header::Tcp, 6 }, { Header::Udp, 17 } };
+
+						for (const auto& protocol : protocols)
+						{
+							if ((required & HeaderBit(protocol.first)) == 0)
+							{
+								continue;
+							}
+
+							auto found = conjunct.find(FieldId::IpProtocol);
+
+							if (found != conjunct.end() && !Contains(found->second, protocol.second))
+							{
+								return false;
+							}
+
+							found = conjunct.find(FieldId::IpFragOff);
+
+							if (found != conjunct.end() && !Contains(found->second, 0))
+							{
+								return false;
+							}
+						}
+					}
+
+					const auto inbound = conjunct.find(FieldId::Inbound);
+					const auto outbound = conjunct.find(FieldId::Outbound);
+					const bool asInbound = (inbound == conjunct.end() || Contains(inbound->second, 1)) && (outbound == conjunct.end() || Contains(outbound->second, 0));
+					const bool asOutbound = (inbound == conjunct.end() || Contains(inbound->second, 0)) && (outbound == conjunct.end() || Contains(outbound->second, 1));
+
+					return asInbound || asOutbound;
+				}
+
+				/// <summary>
+				/// Expands a term, or its negation, into an or of conjuncts, leaving out those no
+				/// packet can satisfy. Diverted packets always have an address, so a negated test of
+				/// inbound, outbound, ifIdx or subIfIdx only flips its set. Returns false if there
+				/// would be more than MaximumConjuncts.
+				/// </summary>
+				bool Expand(const Term& term, bool negated, std::vector<Conjunct>& result)
+				{
+					result.clear();
+
+					switch (term.Kind)
+					{
+						case TermKind::True:
+						case TermKind::False:
+							if ((term.Kind == TermKind::True) != negated)
+							{
+								result.push_back(Conjunct());
+							}
+
+							return true;
+
+						case TermKind::Atom:
+						{
+							if (!negated)
+							{
+								Conjunct conjunct;
+
+								if (Restrict(conjunct, term.Field, term.Set) && Satisfiable(conjunct))
+								{
+									result.push_back(std::move(conjunct));
+								}
+
+								return true;
+							}
+
+							Conjunct flipped;
+
+							if (Restrict(flipped, term.Field, Complement(term.Set, term.Field)) && Satisfiable(flipped))
+							{
+								result.push_back(std::move(flipped));
+							}
+
+							const Header header = FieldHeader(term.Field);
+
+							if (header != Header::None && header != Header::Address)
+							{
+								Conjunct missing;
+								Restrict(missing, PresenceField(header), Single(0));
+								result.push_back(std::move(missing));
+							}
+
+							return true;
+						}
+
+						case TermKind::Not:
+							return Expand(term.Operands[0], !negated, result);
+
+						case TermKind::Choose:
+						{
+							// (c? a: b) is c and a or not c and b, and its negation c and not a or
+							// not c and not b.
+							std::vector<Term> first;
+							first.push_back(term.Operands[0]);
+							first.push_back(negated ? Negate(term.Operands[1]) : term.Operands[1]);
+
+							std::vector<Term> second;
+							second.push_back(Negate(term.Operands[0]));
+							second.push_back(negated ? Negate(term.Operands[2]) : term.Operands[2]);
+
+							std::vector<Term> either;
+							either.push_back(Compound(TermKind::And, std::move(first)));
+							either.push_back(Compound(TermKind::And, std::move(second)));
+							return Expand(Compound(TermKind::Or, std::move(either)), false, result);
+						}
+
+						default:
+							break;
+					}
+
+					// An and, or a negated or, multiplies out; an or, or a negated and, adds up.
+					const bool multiply = (term.Kind == TermKind::And) != negated;
+
+					if (multiply)
+					{
+						result.push_back(Conjunct());
+					}
+
+					std::vector<Conjunct> expanded;
+
+					for (const Term& operand : term.Operands)
+					{
+						if (!Expand(operand, negated, expanded))
+						{
+							return false;
+						}
+
+						if (!multiply)
+						{
+							result.insert(result.end(), expanded.begin(), expanded.end());
+						}
+						else
+						{
+							std::vector<Conjunct> product;
+
+							for (const Conjunct& left : result)
+							{
+								for (const Conjunct& right : expanded)
+								{
+									Conjunct combined = left;
+									bool possible = true;
+
+									for (const auto& entry : right)
+									{
+										possible = possible && Restrict(combined, entry.first, entry.second);
+									}
+
+									if (possible && Satisfiable(combined))
+									{
+										product.push_back(std::move(combined));
+									}
+
+									if (product.size() > MaximumConjuncts)
+									{
+										return false;
+									}
+								}
+							}
+
+							result.swap(product);
+						}
+
+						if (result.size() > MaximumConjuncts)
+						{
+							return false;
+						}
+					}
+
+					return true;
+				}
+
+				/// <summary>
+				/// Parses and simplifies a filter.
+				/// </summary>
+				bool Analyze(const char* filter, size_t length, FilterLayer layer, Term& term, const char** errorMessage, uint32_t* errorPosition)
+				{
+					std::vector<Node> nodes;
+					uint32_t root = NoNode;
+
+					if (!ParseFilter(filter, filter == nullptr ? 0 : length, layer, nodes, root, errorMessage, errorPosition))
+					{
+						return false;
+					}
+
+					term = Simplify(ToTerm(nodes, root));
+					return true;
+				}
+			}
+
+			uint32_t FilterSyntax::SimplifyNodes(const std::vector<Node>& nodes, uint32_t root, std::vector<Node>& simplified)
+			{
+				return Lowering(simplified).Lower(Simplify(ToTerm(nodes, root)));
+			}
+
+			bool FilterAnalyzer::Simplify(const char* filter, size_t length, FilterLayer layer, char* simplified, size_t capacity, size_t* simplifiedLength, const char** errorMessage, uint32_t* errorPosition)
+			{
+				Term term;
+
+				if (!Analyze(filter, length, layer, term, errorMessage, errorPosition))
+				{
+					return false;
+				}
+
+				std::vector<Node> nodes;
+				const uint32_t root = Lowering(nodes).Lower(term);
+
+				std::string text;
+				Print(nodes, root, text);
+
+				if (simplifiedLength != nullptr)
+				{
+					*simplifiedLength = text.size();
+				}
+
+				if (simplified != nullptr && capacity > text.size())
+				{
+					std::memcpy(simplified, text.c_str(), text.size() + 1);
+				}
+
+				return true;
+			}
+
+			bool FilterAnalyzer::Overlap(const char* first, size_t firstLength, const char* second, size_t secondLength, FilterLayer layer, FilterOverlap* overlap, const char** errorMessage, uint32_t* errorPosition)
+			{
+				Term firstTerm;
+				Term secondTerm;
+
+				if (!Analyze(first, firstLength, layer, firstTerm, errorMessage, errorPosition) || !Analyze(second, secondLength, layer, secondTerm, errorMessage, errorPosition))
+				{
+					return false;
+				}
+
+				std::vector<Conjunct> firstConjuncts;
+				std::vector<Conjunct> secondConjuncts;
+
+				*overlap = FilterOverlap::Unknown;
+
+				if (!Expand(firstTerm, false, firstConjuncts) || !Expand(secondTerm, false, secondConjuncts) || firstConjuncts.size() * secondConjuncts.size() > MaximumConjuncts * MaximumConjuncts / 16)
+				{
+					return true;
+				}
+
+				*overlap = FilterOverlap::Disjoint;
+
+				for (const Conjunct& left : firstConjuncts)
+				{
+					for (const Conjunct& right : secondConjuncts)
+					{
+						Conjunct combined = left;
+						bool possible = true;
+
+						for (const auto& entry : right)
+						{
+							possible = possible && Restrict(combined, entry.first, entry.second);
+						}
+
+						if (possible && Satisfiable(combined))
+						{
+							*overlap = FilterOverlap::Overlapping;
+							return true;
+						}
+					}
+				}
+
+				return true;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,156 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNativeFilter.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// What FilterAnalyzer::Overlap(...) could establish about two filters.
+			/// </summary>
+			enum class FilterOverlap
+			{
+				/// <summary>
+				/// No packet can match both filters.
+				/// </summary>
+				Disjoint = 0,
+
+				/// <summary>
+				/// Some packet matches both, as far as the analyzer can tell. It knows which headers
+				/// can appear together and how IPv4 names its transport header, but not how, say,
+				/// lengths relate, so in rare cases the packet it has in mind can't exist.
+				/// </summary>
+				Overlapping = 1,
+
+				/// <summary>
+				/// The filters were too complex to compare.
+				/// </summary>
+				Unknown = 2
+			};
+
+			/// <summary>
+			/// Static analysis of filter strings. Filters are simplified by folding constants and
+			/// constant comparisons, merging tests of the same field, and dropping tests that other
+			/// tests already imply, such as tcp in tcp and tcp.DstPort == 80. The result matches
+			/// exactly the same packets. Filter::Compile(...) compiles the simplified filter, and the
+			/// text form can be handed to WinDivert in place of the original.
+			/// </summary>
+			class FilterAnalyzer
+			{
+
+			public:
+
+				/// <summary>
+				/// Simplifies a filter string.
+				/// </summary>
+				/// <param name="filter">
+				/// The filter string. Need not be null terminated.
+				/// </param>
+				/// <param name="length">
+				/// The length of the filter string.
+				/// </param>
+				/// <param name="layer">
+				/// The layer the filter will be used at.
+				/// </param>
+				/// <param name="simplified">
+				/// Receives the simplified filter, null terminated, if it fits in capacity. May be
+				/// null, to find out the length.
+				/// </param>
+				/// <param name="capacity">
+				/// The size of the simplified buffer, which needs room for the terminator.
+				/// </param>
+				/// <param name="simplifiedLength">
+				/// If not null and the filter is valid, receives the length of the simplified filter,
+				/// not counting the terminator.
+				/// </param>
+				/// <param name="errorMessage">
+				/// If not null and the filter is invalid, receives a description of the problem. The
+				/// string is static.
+				/// </param>
+				/// <param name="errorPosition">
+				/// If not null and the filter is invalid, receives the offset of the problem.
+				/// </param>
+				/// <returns>
+				/// True if the filter was valid, false otherwise.
+				/// </returns>
+				static bool Simplify(const char* filter, size_t length, FilterLayer layer, char* simplified, size_t capacity, size_t* simplifiedLength, const char** errorMessage, uint32_t* errorPosition);
+
+				/// <summary>
+				/// Works out whether any packet diverted by WinDivert could match both of two filters,
+				/// by expanding them into ors of per field ranges and looking for a compatible pair.
+				/// </summary>
+				/// <param name="first">
+				/// The first filter string. Need not be null terminated.
+				/// </param>
+				/// <param name="firstLength">
+				/// The length of the first filter string.
+				/// </param>
+				/// <param name="second">
+				/// The second filter string. Need not be null terminated.
+				/// </param>
+				/// <param name="secondLength">
+				/// The length of the second filter string.
+				/// </param>
+				/// <param name="layer">
+				/// The layer both filters are used at.
+				/// </param>
+				/// <param name="overlap">
+				/// Receives the verdict if both filters are valid.
+				/// </param>
+				/// <param name="errorMessage">
+				/// If not null and a filter is invalid, receives a description of the problem. The
+				/// string is static.
+				/// </param>
+				/// <param name="errorPosition">
+				/// If not null and a filter is invalid, receives the offset of the problem.
+				/// </param>
+				/// <returns>
+				/// True if both filters were valid, false otherwise.
+				/// </returns>
+				static bool Overlap(const char* first, size_t firstLength, const char* second, size_t secondLength, FilterLayer layer, FilterOverlap* overlap, const char** errorMessage, uint32_t* errorPosition);
+
+			private:
+
+				FilterAnalyzer() = delete;
+
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,305 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNativeFilter.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// The parsed form of a filter, shared by the compiler in DivertNativeFilter.cpp and the
+			/// analyzer in DivertNativeFilterAnalyzer.cpp. Not for use outside of those two.
+			/// </summary>
+			namespace FilterSyntax
+			{
+				enum class FieldId : uint8_t
+				{
+					Inbound,
+					Outbound,
+					IfIdx,
+					SubIfIdx,
+					Ip,
+					Ipv6,
+					Icmp,
+					Icmpv6,
+					Tcp,
+					Udp,
+					IpHdrLength,
+					IpTos,
+					IpLength,
+					IpId,
+					IpDf,
+					IpMf,
+					IpFragOff,
+					IpTtl,
+					IpProtocol,
+					IpChecksum,
+					IpSrcAddr,
+					IpDstAddr,
+					Ipv6TrafficClass,
+					Ipv6FlowLabel,
+					Ipv6Length,
+					Ipv6NextHdr,
+					Ipv6HopLimit,
+					Ipv6SrcAddr,
+					Ipv6DstAddr,
+					IcmpType,
+					IcmpCode,
+					IcmpChecksum,
+					IcmpBody,
+					Icmpv6Type,
+					Icmpv6Code,
+					Icmpv6Checksum,
+					Icmpv6Body,
+					TcpSrcPort,
+					TcpDstPort,
+					TcpSeqNum,
+					TcpAckNum,
+					TcpHdrLength,
+					TcpUrg,
+					TcpAck,
+					TcpPsh,
+					TcpRst,
+					TcpSyn,
+					TcpFin,
+					TcpWindow,
+					TcpChecksum,
+					TcpUrgPtr,
+					TcpPayloadLength,
+					UdpSrcPort,
+					UdpDstPort,
+					UdpLength,
+					UdpChecksum,
+					UdpPayloadLength
+				};
+
+				struct FieldName
+				{
+					const char* Name;
+
+					FieldId Id;
+				};
+
+				const FieldName FieldNames[] =
+				{
+					{ "inbound", FieldId::Inbound },
+					{ "outbound", FieldId::Outbound },
+					{ "ifIdx", FieldId::IfIdx },
+					{ "subIfIdx", FieldId::SubIfIdx },
+					{ "ip", FieldId::Ip },
+					{ "ipv6", FieldId::Ipv6 },
+					{ "icmp", FieldId::Icmp },
+					{ "icmpv6", FieldId::Icmpv6 },
+					{ "tcp", FieldId::Tcp },
+					{ "udp", FieldId::Udp },
+					{ "ip.HdrLength", FieldId::IpHdrLength },
+					{ "ip.TOS", FieldId::IpTos },
+					{ "ip.Length", FieldId::IpLength },
+					{ "ip.Id", FieldId::IpId },
+					{ "ip.DF", FieldId::IpDf },
+					{ "ip.MF", FieldId::IpMf },
+					{ "ip.FragOff", FieldId::IpFragOff },
+					{ "ip.TTL", FieldId::IpTtl },
+					{ "ip.Protocol", FieldId::IpProtocol },
+					{ "ip.Checksum", FieldId::IpChecksum },
+					{ "ip.SrcAddr", FieldId::IpSrcAddr },
+					{ "ip.DstAddr", FieldId::IpDstAddr },
+					{ "ipv6.TrafficClass", FieldId::Ipv6TrafficClass },
+					{ "ipv6.FlowLabel", FieldId::Ipv6FlowLabel },
+					{ "ipv6.Length", FieldId::Ipv6Length },
+					{ "ipv6.NextHdr", FieldId::Ipv6NextHdr },
+					{ "ipv6.HopLimit", FieldId::Ipv6HopLimit },
+					{ "ipv6.SrcAddr", FieldId::Ipv6SrcAddr },
+					{ "ipv6.DstAddr", FieldId::Ipv6DstAddr },
+					{ "icmp.Type", FieldId::IcmpType },
+					{ "icmp.Code", FieldId::IcmpCode },
+					{ "icmp.Checksum", FieldId::IcmpChecksum },
+					{ "icmp.Body", FieldId::IcmpBody },
+					{ "icmpv6.Type", FieldId::Icmpv6Type },
+					{ "icmpv6.Code", FieldId::Icmpv6Code },
+					{ "icmpv6.Checksum", FieldId::Icmpv6Checksum },
+					{ "icmpv6.Body", FieldId::Icmpv6Body },
+					{ "tcp.SrcPort", FieldId::TcpSrcPort },
+					{ "tcp.DstPort", FieldId::TcpDstPort },
+					{ "tcp.SeqNum", FieldId::TcpSeqNum },
+					{ "tcp.AckNum", FieldId::TcpAckNum },
+					{ "tcp.HdrLength", FieldId::TcpHdrLength },
+					{ "tcp.Urg", FieldId::TcpUrg },
+					{ "tcp.Ack", FieldId::TcpAck },
+					{ "tcp.Psh", FieldId::TcpPsh },
+					{ "tcp.Rst", FieldId::TcpRst },
+					{ "tcp.Syn", FieldId::TcpSyn },
+					{ "tcp.Fin", FieldId::TcpFin },
+					{ "tcp.Window", FieldId::TcpWindow },
+					{ "tcp.Checksum", FieldId::TcpChecksum },
+					{ "tcp.UrgPtr", FieldId::TcpUrgPtr },
+					{ "tcp.PayloadLength", FieldId::TcpPayloadLength },
+					{ "udp.SrcPort", FieldId::UdpSrcPort },
+					{ "udp.DstPort", FieldId::UdpDstPort },
+					{ "udp.Length", FieldId::UdpLength },
+					{ "udp.Checksum", FieldId::UdpChecksum },
+					{ "udp.PayloadLength", FieldId::UdpPayloadLength }
+				};
+
+				enum class Comparison : uint8_t
+				{
+					Equal,
+					NotEqual,
+					Less,
+					LessOrEqual,
+					Greater,
+					GreaterOrEqual
+				};
+
+				/// <summary>
+				/// A field value or constant of up to 128 bits, least significant word first.
+				/// </summary>
+				struct Value
+				{
+					uint32_t Words[4];
+				};
+
+				enum class NodeKind : uint8_t
+				{
+					True,
+					False,
+					Test,
+					Not,
+					And,
+					Or,
+					Choose
+				};
+
+				/// <summary>
+				/// A node of the parsed filter. Children are chained through Next, starting at First:
+				/// the operands of And and Or, the operand of Not, and the condition, then and else
+				/// parts of Choose.
+				/// </summary>
+				struct Node
+				{
+					NodeKind Kind;
+
+					FieldId Field;
+
+					Comparison Test;
+
+					uint32_t First;
+
+					uint32_t Next;
+
+					Value Constant;
+				};
+
+				const uint32_t NoNode = 0xFFFFFFFF;
+
+				const size_t FieldCount = static_cast<size_t>(FieldId::UdpPayloadLength) + 1;
+
+				/// <summary>
+				/// The widest value a field can hold, in bits.
+				/// </summary>
+				inline uint32_t FieldBits(FieldId field)
+				{
+					switch (field)
+					{
+						case FieldId::Ipv6SrcAddr:
+						case FieldId::Ipv6DstAddr:
+							return 128;
+
+						case FieldId::IfIdx:
+						case FieldId::SubIfIdx:
+						case FieldId::IpSrcAddr:
+						case FieldId::IpDstAddr:
+						case FieldId::Ipv6FlowLabel:
+						case FieldId::IcmpBody:
+						case FieldId::Icmpv6Body:
+						case FieldId::TcpSeqNum:
+						case FieldId::TcpAckNum:
+						case FieldId::TcpPayloadLength:
+						case FieldId::UdpPayloadLength:
+							return 32;
+
+						default:
+							return 16;
+					}
+				}
+
+				inline int Order(uint32_t left, uint32_t right)
+				{
+					return left < right ? -1 : (left > right ? 1 : 0);
+				}
+
+				inline int Order(const Value& left, const Value& right)
+				{
+					for (int i = 3; i >= 0; --i)
+					{
+						if (left.Words[i] != right.Words[i])
+						{
+							return left.Words[i] < right.Words[i] ? -1 : 1;
+						}
+					}
+
+					return 0;
+				}
+
+				/// <summary>
+				/// Parses a filter string into a tree of nodes.
+				/// </summary>
+				/// <returns>
+				/// True if the filter was valid. Otherwise the error message and position, where
+				/// not null, receive what went wrong and where.
+				/// </returns>
+				bool ParseFilter(const char* filter, size_t length, FilterLayer layer, std::vector<Node>& nodes, uint32_t& root, const char** errorMessage, uint32_t* errorPosition);
+
+				/// <summary>
+				/// Writes the simplified form of a parsed filter into another tree, matching exactly
+				/// the same packets with no more tests. Implemented by the analyzer, this is what
+				/// Filter::Compile(...) compiles.
+				/// </summary>
+				/// <returns>
+				/// The root of the simplified tree.
+				/// </returns>
+				uint32_t SimplifyNodes(const std::vector<Node>& nodes, uint32_t root, std::vector<Node>& simplified);
+
+			} /* namespace FilterSyntax */
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
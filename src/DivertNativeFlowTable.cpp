@@ -0,0 +1,765 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeFlowTable.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const size_t CacheLineSize = 64;
+
+				const uint32_t SlotsPerBucket = 10;
+
+				const uint8_t TcpProtocol = 6;
+
+				/// <summary>
+				/// A cache line of the index. A tag of zero marks an empty slot. Overflow counts the
+				/// flows that hash to this bucket or an earlier one but had to be placed further on,
+				/// so a lookup can stop at the first bucket where it's zero, and nothing is left
+				/// behind when a flow is removed.
+				/// </summary>
+				struct Bucket
+				{
+					uint16_t Tags[SlotsPerBucket];
+
+					uint32_t Overflow;
+
+					uint32_t Flows[SlotsPerBucket];
+				};
+
+				static_assert(sizeof(Bucket) == CacheLineSize, "A bucket must fill exactly one cache line.");
+
+				/// <summary>
+				/// Which list a flow is on.
+				/// </summary>
+				enum FlowList : uint8_t
+				{
+					FreeList,
+					ActiveList,
+					ClosingList,
+					ResetPending
+				};
+
+				const uint8_t FinOutbound = 0x01;
+
+				const uint8_t FinInbound = 0x02;
+
+				/// <summary>
+				/// One flow, followed in memory by its user slots. Flows on the active and closing
+				/// lists are kept in the order they were last seen in, so the oldest is always at
+				/// the head.
+				/// </summary>
+				struct Flow
+				{
+					FlowKey Key;
+
+					uint64_t LastSeen;
+
+					uint32_t Previous;
+
+					uint32_t Next;
+
+					uint32_t Generation;
+
+					uint8_t List;
+
+					/// <summary>
+					/// FinOutbound and FinInbound, for the directions a FIN has been seen in.
+					/// </summary>
+					uint8_t Fins;
+
+					uint16_t Reserved;
+				};
+
+				static_assert(sizeof(Flow) == CacheLineSize, "A flow must fill exactly one cache line.");
+
+				struct FlowOrder
+				{
+					uint32_t Head = FlowTable::InvalidFlow;
+
+					uint32_t Tail = FlowTable::InvalidFlow;
+				};
+
+				/// <summary>
+				/// Never zero, so that it can't be mistaken for an empty slot. Taken from the bits
+				/// the bucket index isn't.
+				/// </summary>
+				inline uint16_t TagOf(uint64_t hash)
+				{
+					return static_cast<uint16_t>((hash >> 48) | 1);
+				}
+
+				/// <summary>
+				/// Allocates an array aligned to a cache line, so that no bucket or flow straddles two.
+				/// </summary>
+				template<typename T>
+				T* AllocateAligned(std::unique_ptr<uint8_t[]>& storage, size_t count)
+				{
+					storage.reset(new uint8_t[count * sizeof(T) + CacheLineSize - 1]);
+
+					const uintptr_t address = reinterpret_cast<uintptr_t>(storage.get());
+
+					return reinterpret_cast<T*>((address + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1));
+				}
+			}
+
+			struct FlowTable::State
+			{
+				std::unique_ptr<uint8_t[]> BucketStorage;
+
+				Bucket* Buckets = nullptr;
+
+				uint32_t BucketMask = 0;
+
+				std::unique_ptr<uint8_t[]> FlowStorage;
+
+				/// <summary>
+				/// Each flow is followed by its user slots, so that the slots are usually in a
+				/// line the flow's lookup has just brought in, or the one right after it.
+				/// </summary>
+				uint8_t* Flows = nullptr;
+
+				size_t FlowStride = 0;
+
+				uint32_t Capacity = 0;
+
+				uint32_t UserSlotCount = 0;
+
+				uint32_t IdleTimeout = 0;
+
+				uint32_t ClosingTimeout = 0;
+
+				uint32_t Count = 0;
+
+				/// <summary>
+				/// Unused flows, linked through Next.
+				/// </summary>
+				uint32_t FreeHead = InvalidFlow;
+
+				FlowOrder Active;
+
+				FlowOrder Closing;
+
+				/// <summary>
+				/// A flow that has seen a RST. It's kept until the next call into the table, so the
+				/// caller can still use it for the packet that carried the RST.
+				/// </summary>
+				uint32_t PendingReset = InvalidFlow;
+
+				/// <summary>
+				/// No flow can expire before this time. Keeps Track() from looking at the oldest
+				/// flows, which are rarely in cache, for every packet.
+				/// </summary>
+				uint64_t NextExpiry = 0;
+
+				FlowEndedCallback Callback = nullptr;
+
+				void* Context = nullptr;
+
+				FlowTableStatistics Statistics = FlowTableStatistics();
+
+				Flow& At(uint32_t index) const
+				{
+					return *reinterpret_cast<Flow*>(Flows + index * FlowStride);
+				}
+
+				uint64_t* SlotsOf(uint32_t index) const
+				{
+					return UserSlotCount != 0 ? reinterpret_cast<uint64_t*>(&At(index) + 1) : nullptr;
+				}
+
+				FlowOrder& OrderOf(const Flow& flow)
+				{
+					return flow.List == ClosingList ? Closing : Active;
+				}
+
+				void Append(FlowOrder& order, uint32_t index)
+				{
+					Flow& flow = At(index);
+
+					flow.Previous = order.Tail;
+					flow.Next = InvalidFlow;
+
+					if (order.Tail != InvalidFlow)
+					{
+						At(order.Tail).Next = index;
+					}
+					else
+					{
+						order.Head = index;
+					}
+
+					order.Tail = index;
+				}
+
+				void Unlink(FlowOrder& order, uint32_t index)
+				{
+					Flow& flow = At(index);
+
+					if (flow.Previous != InvalidFlow)
+					{
+						At(flow.Previous).Next = flow.Next;
+					}
+					else
+					{
+						order.Head = flow.Next;
+					}
+
+					if (flow.Next != InvalidFlow)
+					{
+						At(flow.Next).Previous = flow.Previous;
+					}
+					else
+					{
+						order.Tail = flow.Previous;
+					}
+				}
+
+				uint32_t Locate(const FlowKey& key, uint64_t hash) const
+				{
+					const uint16_t tag = TagOf(hash);
+					uint32_t index = static_cast<uint32_t>(hash) & BucketMask;
+
+					for (;;)
+					{
+						const Bucket& bucket = Buckets[index];
+
+						for (uint32_t slot = 0; slot < SlotsPerBucket; ++slot)
+						{
+							if (bucket.Tags[slot] == tag && At(bucket.Flows[slot]).Key == key)
+							{
+								return bucket.Flows[slot];
+							}
+						}
+
+						if (bucket.Overflow == 0)
+						{
+							return InvalidFlow;
+						}
+
+						index = (index + 1) & BucketMask;
+					}
+				}
+
+				/// <summary>
+				/// Adds a flow that isn't in the index yet. There are always more slots than flows,
+				/// so an empty slot is always found.
+				/// </summary>
+				void Index(uint32_t flow, uint64_t hash)
+				{
+					uint32_t index = static_cast<uint32_t>(hash) & BucketMask;
+
+					for (;;)
+					{
+						Bucket& bucket = Buckets[index];
+
+						for (uint32_t slot = 0; slot < SlotsPerBucket; ++slot)
+						{
+							if (bucket.Tags[slot] == 0)
+							{
+								bucket.Tags[slot] = TagOf(hash);
+								bucket.Flows[slot] = flow;
+								return;
+							}
+						}
+
+						++bucket.Overflow;
+						index = (index + 1) & BucketMask;
+					}
+				}
+
+				void Unindex(uint32_t flow)
+				{
+					const uint64_t hash = At(flow).Key.Hash();
+					const uint16_t tag = TagOf(hash);
+					uint32_t index = static_cast<uint32_t>(hash) & BucketMask;
+
+					for (;;)
+					{
+						Bucket& bucket = Buckets[index];
+
+						for (uint32_t slot = 0; slot < SlotsPerBucket; ++slot)
+						{
+							if (bucket.Tags[slot] == tag && bucket.Flows[slot] == flow)
+							{
+								bucket.Tags[slot] = 0;
+								return;
+							}
+						}
+
+						// The flow lies further on, so it was counted here when it was placed.
+						--bucket.Overflow;
+						index = (index + 1) & BucketMask;
+					}
+				}
+
+				uint32_t Create(const FlowKey& key, uint64_t hash, uint64_t now)
+				{
+					const uint32_t index = FreeHead;
+					Flow& flow = At(index);
+
+					FreeHead = flow.Next;
+
+					flow.Key = key;
+					flow.LastSeen = now;
+					flow.List = ActiveList;
+					flow.Fins = 0;
+
+					if (UserSlotCount != 0)
+					{
+						std::memset(SlotsOf(index), 0, UserSlotCount * sizeof(uint64_t));
+					}
+
+					Index(index, hash);
+					Append(Active, index);
+					Postpone(now + IdleTimeout);
+
+					++Count;
+					++Statistics.Created;
+
+					return index;
+				}
+
+				void End(uint32_t index, FlowEnd reason)
+				{
+					Flow& flow = At(index);
+
+					if (Callback != nullptr)
+					{
+						Callback(Context, index, flow.Key, SlotsOf(index), reason);
+					}
+
+					Unindex(index);
+
+					if (flow.List == ResetPending)
+					{
+						PendingReset = InvalidFlow;
+					}
+					else
+					{
+						Unlink(OrderOf(flow), index);
+					}
+
+					flow.List = FreeList;
+					++flow.Generation;
+
+					flow.Next = FreeHead;
+					FreeHead = index;
+
+					--Count;
+
+					switch (reason)
+					{
+						case FlowEnd::Expired:
+							++Statistics.Expired;
+							break;
+
+						case FlowEnd::Closed:
+							++Statistics.Closed;
+							break;
+
+						case FlowEnd::Reset:
+							++Statistics.Reset;
+							break;
+
+						case FlowEnd::Evicted:
+							++Statistics.Evicted;
+							break;
+
+						default:
+							break;
+					}
+				}
+
+				/// <summary>
+				/// Makes sure NextExpiry is no later than the supplied time.
+				/// </summary>
+				void Postpone(uint64_t expiry)
+				{
+					if (expiry < NextExpiry)
+					{
+						NextExpiry = expiry;
+					}
+				}
+
+				uint64_t OldestExpiry(const FlowOrder& order, uint32_t timeout) const
+				{
+					return order.Head == InvalidFlow ? UINT64_MAX : At(order.Head).LastSeen + timeout;
+				}
+
+				bool EndPendingReset()
+				{
+					if (PendingReset == InvalidFlow)
+					{
+						return false;
+					}
+
+					End(PendingReset, FlowEnd::Reset);
+					return true;
+				}
+
+				/// <summary>
+				/// Ends the oldest flow on a list if its time is up.
+				/// </summary>
+				bool ExpireOldest(FlowOrder& order, uint32_t timeout, FlowEnd reason, uint64_t now)
+				{
+					if (order.Head == InvalidFlow)
+					{
+						return false;
+					}
+
+					const uint64_t lastSeen = At(order.Head).LastSeen;
+
+					if (now < lastSeen || now - lastSeen < timeout)
+					{
+						return false;
+					}
+
+					End(order.Head, reason);
+					return true;
+				}
+
+				uint32_t Expire(uint64_t now, uint32_t limit)
+				{
+					uint32_t ended = EndPendingReset() ? 1 : 0;
+
+					if (now < NextExpiry)
+					{
+						return ended;
+					}
+
+					while (limit == 0 || ended < limit)
+					{
+						if (!ExpireOldest(Closing, ClosingTimeout, FlowEnd::Closed, now) && !ExpireOldest(Active, IdleTimeout, FlowEnd::Expired, now))
+						{
+							// Seeing a flow again only ever makes a later flow the oldest, so this
+							// stays a lower bound until flows are added.
+							const uint64_t closing = OldestExpiry(Closing, ClosingTimeout);
+							const uint64_t active = OldestExpiry(Active, IdleTimeout);
+
+							NextExpiry = closing < active ? closing : active;
+							break;
+						}
+
+						++ended;
+					}
+
+					return ended;
+				}
+
+				void Clear()
+				{
+					EndPendingReset();
+
+					while (Closing.Head != InvalidFlow)
+					{
+						End(Closing.Head, FlowEnd::Removed);
+					}
+
+					while (Active.Head != InvalidFlow)
+					{
+						End(Active.Head, FlowEnd::Removed);
+					}
+				}
+			};
+
+			FlowTable::FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds) : m_state(new State())
+			{
+				capacity = capacity == 0 ? 1 : (capacity > MaximumCapacity ? MaximumCapacity : capacity);
+				userSlotCount = userSlotCount > MaximumUserSlots ? MaximumUserSlots : userSlotCount;
+
+				// At most eight flows per ten slots, so probes stay short even when full.
+				uint32_t bucketCount = 1;
+
+				while (static_cast<uint64_t>(bucketCount) * 8 < capacity)
+				{
+					bucketCount <<= 1;
+				}
+
+				m_state->Buckets = AllocateAligned<Bucket>(m_state->BucketStorage, bucketCount);
+				m_state->BucketMask = bucketCount - 1;
+				std::memset(m_state->Buckets, 0, static_cast<size_t>(bucketCount) * sizeof(Bucket));
+
+				const size_t flowSize = sizeof(Flow) + userSlotCount * sizeof(uint64_t);
+
+				m_state->FlowStride = (flowSize + CacheLineSize - 1) & ~(CacheLineSize - 1);
+				m_state->Flows = AllocateAligned<uint8_t>(m_state->FlowStorage, capacity * m_state->FlowStride);
+				std::memset(m_state->Flows, 0, capacity * m_state->FlowStride);
+
+				m_state->Capacity = capacity;
+				m_state->UserSlotCount = userSlotCount;
+
+				for (uint32_t i = 0; i < capacity; ++i)
+				{
+					m_state->At(i).Generation = 1;
+					m_state->At(i).Next = i + 1 < capacity ? i + 1 : InvalidFlow;
+				}
+
+				m_state->FreeHead = 0;
+				m_state->IdleTimeout = idleTimeoutInMilliseconds;
+				m_state->ClosingTimeout = closingTimeoutInMilliseconds;
+			}
+
+			FlowTable::~FlowTable()
+			{
+				m_state->Clear();
+
+				delete m_state;
+			}
+
+			uint32_t FlowTable::Track(const FlowKey& key, uint8_t tcpFlags, bool outbound, uint64_t now, bool* created)
+			{
+				State& state = *m_state;
+
+				state.Expire(now, ExpirationsPerTrack);
+
+				++state.Statistics.Lookups;
+
+				if (created != nullptr)
+				{
+					*created = false;
+				}
+
+				const bool tcp = key.Protocol == TcpProtocol;
+				const uint64_t hash = key.Hash();
+
+				uint32_t index = state.Locate(key, hash);
+
+				if (index != InvalidFlow && tcp && (tcpFlags & (TcpSyn | TcpRst)) == TcpSyn && state.At(index).List == ClosingList)
+				{
+					// A new connection reusing the 5-tuple of one that has finished closing.
+					state.End(index, FlowEnd::Closed);
+					index = InvalidFlow;
+				}
+
+				if (index == InvalidFlow)
+				{
+					if (tcp && (tcpFlags & TcpRst) != 0)
+					{
+						return InvalidFlow;
+					}
+
+					if (state.Count == state.Capacity)
+					{
+						// Flows already closing go first, they're on their way out anyway.
+						state.End(state.Closing.Head != InvalidFlow ? state.Closing.Head : state.Active.Head, FlowEnd::Evicted);
+					}
+
+					index = state.Create(key, hash, now);
+
+					if (created != nullptr)
+					{
+						*created = true;
+					}
+				}
+				else
+				{
+					++state.Statistics.Hits;
+
+					Flow& flow = state.At(index);
+
+					// Flows are kept in the order they were last seen in, and every flow after one
+					// already seen now was seen now too. Most packets belong to a flow that was
+					// seen a moment ago, so most packets don't reorder anything.
+					if (flow.LastSeen != now)
+					{
+						flow.LastSeen = now;
+
+						FlowOrder& order = state.OrderOf(flow);
+
+						if (order.Tail != index)
+						{
+							state.Unlink(order, index);
+							state.Append(order, index);
+						}
+					}
+				}
+
+				if (tcp && (tcpFlags & (TcpFin | TcpRst)) != 0)
+				{
+					Flow& flow = state.At(index);
+
+					if ((tcpFlags & TcpRst) != 0)
+					{
+						state.Unlink(state.OrderOf(flow), index);
+						flow.List = ResetPending;
+						state.PendingReset = index;
+					}
+					else
+					{
+						flow.Fins |= outbound ? FinOutbound : FinInbound;
+
+						if (flow.Fins == (FinOutbound | FinInbound) && flow.List == ActiveList)
+						{
+							state.Unlink(state.Active, index);
+							flow.List = ClosingList;
+							state.Append(state.Closing, index);
+							state.Postpone(now + state.ClosingTimeout);
+						}
+					}
+				}
+
+				return index;
+			}
+
+			uint32_t FlowTable::Find(const FlowKey& key) const
+			{
+				return m_state->Locate(key, key.Hash());
+			}
+
+			bool FlowTable::Remove(const FlowKey& key)
+			{
+				const uint32_t index = m_state->Locate(key, key.Hash());
+
+				if (index == InvalidFlow)
+				{
+					return false;
+				}
+
+				m_state->End(index, FlowEnd::Removed);
+				return true;
+			}
+
+			void FlowTable::Remove(uint32_t flow)
+			{
+				if (IsLive(flow))
+				{
+					m_state->End(flow, FlowEnd::Removed);
+				}
+			}
+
+			uint32_t FlowTable::Expire(uint64_t now, uint32_t limit)
+			{
+				return m_state->Expire(now, limit);
+			}
+
+			void FlowTable::Clear()
+			{
+				m_state->Clear();
+			}
+
+			uint64_t* FlowTable::UserSlots(uint32_t flow)
+			{
+				return m_state->SlotsOf(flow);
+			}
+
+			const uint64_t* FlowTable::UserSlots(uint32_t flow) const
+			{
+				return m_state->SlotsOf(flow);
+			}
+
+			const FlowKey& FlowTable::Key(uint32_t flow) const
+			{
+				return m_state->At(flow).Key;
+			}
+
+			bool FlowTable::IsLive(uint32_t flow) const
+			{
+				return flow < m_state->Capacity && m_state->At(flow).List != FreeList;
+			}
+
+			uint32_t FlowTable::Generation(uint32_t flow) const
+			{
+				return m_state->At(flow).Generation;
+			}
+
+			bool FlowTable::IsClosing(uint32_t flow) const
+			{
+				return m_state->At(flow).List == ClosingList || m_state->At(flow).List == ResetPending;
+			}
+
+			void FlowTable::SetFlowEndedCallback(FlowEndedCallback callback, void* context)
+			{
+				m_state->Callback = callback;
+				m_state->Context = context;
+			}
+
+			uint32_t FlowTable::Count() const
+			{
+				return m_state->Count;
+			}
+
+			uint32_t FlowTable::Capacity() const
+			{
+				return m_state->Capacity;
+			}
+
+			uint32_t FlowTable::UserSlotCount() const
+			{
+				return m_state->UserSlotCount;
+			}
+
+			uint32_t FlowTable::IdleTimeout() const
+			{
+				return m_state->IdleTimeout;
+			}
+
+			void FlowTable::SetIdleTimeout(uint32_t idleTimeoutInMilliseconds)
+			{
+				m_state->IdleTimeout = idleTimeoutInMilliseconds;
+				m_state->NextExpiry = 0;
+			}
+
+			uint32_t FlowTable::ClosingTimeout() const
+			{
+				return m_state->ClosingTimeout;
+			}
+
+			void FlowTable::SetClosingTimeout(uint32_t closingTimeoutInMilliseconds)
+			{
+				m_state->ClosingTimeout = closingTimeoutInMilliseconds;
+				m_state->NextExpiry = 0;
+			}
+
+			FlowTableStatistics FlowTable::Statistics() const
+			{
+				FlowTableStatistics statistics = m_state->Statistics;
+				statistics.Count = m_state->Count;
+
+				return statistics;
+			}
+
+			void FlowTable::ResetStatistics()
+			{
+				m_state->Statistics = FlowTableStatistics();
+			}
+
+			uint64_t FlowTable::NowInMilliseconds()
+			{
+				return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,349 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include "DivertConnectionTable.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Why a flow left a FlowTable.
+			/// </summary>
+			enum class FlowEnd : uint8_t
+			{
+				/// <summary>
+				/// No packet was seen for the idle timeout.
+				/// </summary>
+				Expired,
+
+				/// <summary>
+				/// Both ends sent a FIN, and the closing timeout has passed since.
+				/// </summary>
+				Closed,
+
+				/// <summary>
+				/// Either end sent a RST.
+				/// </summary>
+				Reset,
+
+				/// <summary>
+				/// The table was full and the flow was the least recently seen.
+				/// </summary>
+				Evicted,
+
+				/// <summary>
+				/// Removed by the owner of the table, through Remove() or Clear().
+				/// </summary>
+				Removed
+			};
+
+			/// <summary>
+			/// Counters describing the traffic a FlowTable has seen.
+			/// </summary>
+			struct FlowTableStatistics
+			{
+				/// <summary>
+				/// Packets tracked.
+				/// </summary>
+				uint64_t Lookups;
+
+				/// <summary>
+				/// Packets that belonged to a flow already in the table.
+				/// </summary>
+				uint64_t Hits;
+
+				/// <summary>
+				/// Flows added.
+				/// </summary>
+				uint64_t Created;
+
+				/// <summary>
+				/// Flows that ended with FlowEnd::Expired.
+				/// </summary>
+				uint64_t Expired;
+
+				/// <summary>
+				/// Flows that ended with FlowEnd::Closed.
+				/// </summary>
+				uint64_t Closed;
+
+				/// <summary>
+				/// Flows that ended with FlowEnd::Reset.
+				/// </summary>
+				uint64_t Reset;
+
+				/// <summary>
+				/// Flows that ended with FlowEnd::Evicted.
+				/// </summary>
+				uint64_t Evicted;
+
+				/// <summary>
+				/// The number of flows currently in the table.
+				/// </summary>
+				uint32_t Count;
+			};
+
+			/// <summary>
+			/// Keeps per-flow state for every flow a diversion sees, so that work which only has to
+			/// happen once per flow, such as finding the owning process or classifying it, is done
+			/// for the first packet and reused for the rest. Flows are keyed by FlowKey, from the
+			/// point of view of this machine, so both directions of a connection share one flow.
+			/// 
+			/// The index is an open addressed table of cache line sized buckets holding a short
+			/// hash tag and a flow number per slot, so a lookup usually touches one bucket and then
+			/// the flow itself. Each flow carries a fixed number of 64 bit user slots that are
+			/// zeroed when the flow is created and are the caller's to use.
+			/// 
+			/// Flows that see no packet for the idle timeout are expired a few at a time as packets
+			/// are tracked, or all at once by Expire(). TCP flows are ended early: a RST ends the
+			/// flow at the next call into the table, a FIN from both ends leaves it for the closing
+			/// timeout to absorb the final ACK and any retransmissions. When the table is full, the
+			/// least recently seen flow makes room.
+			/// 
+			/// Not safe for concurrent use. Give each receive thread a table of its own, or split
+			/// flows across tables by FlowKey::Hash().
+			/// </summary>
+			class FlowTable
+			{
+
+			public:
+
+				/// <summary>
+				/// Returned in place of a flow number when there's no flow.
+				/// </summary>
+				static const uint32_t InvalidFlow = 0xFFFFFFFF;
+
+				/// <summary>
+				/// Flows, and so the capacity, are numbered in 32 bits with InvalidFlow reserved.
+				/// </summary>
+				static const uint32_t MaximumCapacity = 0x7FFFFFFF;
+
+				/// <summary>
+				/// The most user slots a flow can carry.
+				/// </summary>
+				static const uint32_t MaximumUserSlots = 64;
+
+				/// <summary>
+				/// The TCP flags Track() acts on, as they appear in the thirteenth byte of the TCP
+				/// header.
+				/// </summary>
+				static const uint8_t TcpFin = 0x01;
+
+				static const uint8_t TcpSyn = 0x02;
+
+				static const uint8_t TcpRst = 0x04;
+
+				/// <summary>
+				/// How many idle flows Track() expires, at most, before doing anything else. Enough
+				/// to keep up with a steady stream of new flows without an occasional packet paying
+				/// for a large sweep.
+				/// </summary>
+				static const uint32_t ExpirationsPerTrack = 4;
+
+				/// <summary>
+				/// Called for every flow that leaves the table, just before its number is reused, so
+				/// that anything its user slots refer to can be released.
+				/// </summary>
+				typedef void(*FlowEndedCallback)(void* context, uint32_t flow, const FlowKey& key, uint64_t* userSlots, FlowEnd reason);
+
+				/// <summary>
+				/// Constructs a table. All memory is allocated up front.
+				/// </summary>
+				/// <param name="capacity">
+				/// The most flows tracked at once. Must be between one and MaximumCapacity.
+				/// </param>
+				/// <param name="userSlotCount">
+				/// The number of 64 bit user slots each flow carries, at most MaximumUserSlots.
+				/// </param>
+				/// <param name="idleTimeoutInMilliseconds">
+				/// How long a flow may go without a packet before it's expired.
+				/// </param>
+				/// <param name="closingTimeoutInMilliseconds">
+				/// How long a TCP flow is kept after both ends have sent a FIN.
+				/// </param>
+				FlowTable(uint32_t capacity, uint32_t userSlotCount, uint32_t idleTimeoutInMilliseconds, uint32_t closingTimeoutInMilliseconds);
+
+				/// <summary>
+				/// Ends every remaining flow with FlowEnd::Removed.
+				/// </summary>
+				~FlowTable();
+
+				/// <summary>
+				/// Finds the flow a packet belongs to, creating it if needed, and marks it as seen.
+				/// </summary>
+				/// <param name="key">
+				/// The packet's flow.
+				/// </param>
+				/// <param name="tcpFlags">
+				/// The packet's TCP flags, any combination of TcpFin, TcpSyn and TcpRst. Ignored for
+				/// flows other than TCP.
+				/// </param>
+				/// <param name="outbound">
+				/// Whether the packet was sent from this machine.
+				/// </param>
+				/// <param name="now">
+				/// The current time in milliseconds, from NowInMilliseconds() or any other clock
+				/// that never goes backwards.
+				/// </param>
+				/// <param name="created">
+				/// Receives whether the flow was created for this packet. May be null.
+				/// </param>
+				/// <returns>
+				/// The flow number, valid until the flow ends. InvalidFlow for a RST that doesn't
+				/// belong to any flow, no flow is created for it.
+				/// </returns>
+				uint32_t Track(const FlowKey& key, uint8_t tcpFlags, bool outbound, uint64_t now, bool* created);
+
+				/// <summary>
+				/// Finds a flow without creating it or marking it as seen.
+				/// </summary>
+				/// <returns>
+				/// The flow number, or InvalidFlow.
+				/// </returns>
+				uint32_t Find(const FlowKey& key) const;
+
+				/// <summary>
+				/// Ends a flow with FlowEnd::Removed.
+				/// </summary>
+				/// <returns>
+				/// False if the flow wasn't in the table.
+				/// </returns>
+				bool Remove(const FlowKey& key);
+
+				/// <summary>
+				/// Ends a flow by number with FlowEnd::Removed. Does nothing for a number that isn't
+				/// a live flow.
+				/// </summary>
+				void Remove(uint32_t flow);
+
+				/// <summary>
+				/// Ends flows that have been idle for too long, and closed and reset flows whose
+				/// time is up.
+				/// </summary>
+				/// <param name="now">
+				/// The current time, on the clock passed to Track().
+				/// </param>
+				/// <param name="limit">
+				/// The most flows to end. Zero for no limit.
+				/// </param>
+				/// <returns>
+				/// The number of flows ended.
+				/// </returns>
+				uint32_t Expire(uint64_t now, uint32_t limit);
+
+				/// <summary>
+				/// Ends every flow with FlowEnd::Removed.
+				/// </summary>
+				void Clear();
+
+				/// <summary>
+				/// The first of a flow's user slots.
+				/// </summary>
+				uint64_t* UserSlots(uint32_t flow);
+
+				const uint64_t* UserSlots(uint32_t flow) const;
+
+				/// <summary>
+				/// The key a flow was created with.
+				/// </summary>
+				const FlowKey& Key(uint32_t flow) const;
+
+				/// <summary>
+				/// Whether a number refers to a flow currently in the table.
+				/// </summary>
+				bool IsLive(uint32_t flow) const;
+
+				/// <summary>
+				/// Incremented every time a flow number is reused, so that a number and generation
+				/// pair identifies one flow for good.
+				/// </summary>
+				uint32_t Generation(uint32_t flow) const;
+
+				/// <summary>
+				/// Whether a TCP flow has seen a FIN from both ends, or a RST.
+				/// </summary>
+				bool IsClosing(uint32_t flow) const;
+
+				/// <summary>
+				/// Sets the function called for every flow that leaves the table. Null to stop being
+				/// told.
+				/// </summary>
+				void SetFlowEndedCallback(FlowEndedCallback callback, void* context);
+
+				uint32_t Count() const;
+
+				uint32_t Capacity() const;
+
+				uint32_t UserSlotCount() const;
+
+				uint32_t IdleTimeout() const;
+
+				void SetIdleTimeout(uint32_t idleTimeoutInMilliseconds);
+
+				uint32_t ClosingTimeout() const;
+
+				void SetClosingTimeout(uint32_t closingTimeoutInMilliseconds);
+
+				FlowTableStatistics Statistics() const;
+
+				void ResetStatistics();
+
+				/// <summary>
+				/// A monotonic clock in milliseconds, suitable for Track() and Expire().
+				/// </summary>
+				static uint64_t NowInMilliseconds();
+
+			private:
+
+				FlowTable(const FlowTable&) = delete;
+
+				FlowTable& operator=(const FlowTable&) = delete;
+
+				/// <summary>
+				/// The buckets and flows live here, so that this header stays usable from managed
+				/// code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
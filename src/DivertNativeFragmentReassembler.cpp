@@ -0,0 +1,1030 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeFragmentReassembler.hpp"
+#include "DivertNativeChecksum.hpp"
+
+#include <chrono>
+#include <memory>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const uint32_t InvalidIndex = 0xFFFFFFFF;
+
+				const uint8_t IcmpProtocol = 1;
+
+				const uint8_t TcpProtocol = 6;
+
+				const uint8_t UdpProtocol = 17;
+
+				const uint8_t Icmpv6Protocol = 58;
+
+				const uint8_t HopByHopHeader = 0;
+
+				const uint8_t RoutingHeader = 43;
+
+				const uint8_t FragmentHeader = 44;
+
+				const uint8_t DestinationOptionsHeader = 60;
+
+				const uint32_t IPv4HeaderLength = 20;
+
+				const uint32_t IPv6HeaderLength = 40;
+
+				const uint32_t MaximumPayload = 65535;
+
+				/// <summary>
+				/// What identifies the fragments of one datagram. For IPv4 addresses take the first
+				/// four bytes of each address.
+				/// </summary>
+				struct FragmentKey
+				{
+					uint8_t Family;
+
+					uint8_t Protocol;
+
+					uint16_t Reserved;
+
+					uint32_t Identification;
+
+					uint8_t Source[16];
+
+					uint8_t Destination[16];
+
+					bool operator==(const FragmentKey& other) const
+					{
+						return std::memcmp(this, &other, sizeof(FragmentKey)) == 0;
+					}
+				};
+
+				static_assert(sizeof(FragmentKey) == 40, "FragmentKey must not have padding, it's compared as bytes.");
+
+				/// <summary>
+				/// A fragment as parsed out of its packet.
+				/// </summary>
+				struct ParsedFragment
+				{
+					FragmentKey Key;
+
+					/// <summary>
+					/// The part of the packet every fragment repeats: the IPv4 header, or the IPv6
+					/// header and the extension headers before the fragment header.
+					/// </summary>
+					const uint8_t* Header;
+
+					uint32_t HeaderLength;
+
+					/// <summary>
+					/// For IPv6, where in the header the byte naming the fragment header is.
+					/// </summary>
+					uint32_t NextHeaderOffset;
+
+					const uint8_t* Payload;
+
+					uint32_t Length;
+
+					uint32_t Offset;
+
+					bool More;
+				};
+
+				enum class ParseResult
+				{
+					NotFragment,
+					Fragment,
+					Malformed
+				};
+
+				const uint8_t DatagramInUse = 0x01;
+
+				const uint8_t DatagramHasLast = 0x02;
+
+				/// <summary>
+				/// The datagram was dropped. It holds no blocks, and is only kept so its remaining
+				/// fragments are recognised and dropped too.
+				/// </summary>
+				const uint8_t DatagramDead = 0x04;
+
+				/// <summary>
+				/// A datagram in progress. Fragments are kept in offset order, linked through
+				/// the BlockInfo of their first blocks. Datagrams are linked from oldest to newest
+				/// through Older and Newer, so timeouts and eviction always start at the head.
+				/// </summary>
+				struct Datagram
+				{
+					FragmentKey Key;
+
+					uint64_t Created;
+
+					uint32_t BucketNext;
+
+					uint32_t Older;
+
+					uint32_t Newer;
+
+					uint32_t FirstFragment;
+
+					/// <summary>
+					/// The payload bytes held. As no two fragments overlap, the datagram is complete
+					/// once this reaches End.
+					/// </summary>
+					uint32_t Received;
+
+					/// <summary>
+					/// The payload length, known once the last fragment has arrived.
+					/// </summary>
+					uint32_t End;
+
+					/// <summary>
+					/// The length of Header, zero until the first fragment has arrived.
+					/// </summary>
+					uint16_t HeaderLength;
+
+					uint16_t NextHeaderOffset;
+
+					/// <summary>
+					/// The longest headers any fragment came with. The payload is bounded by these,
+					/// whichever fragment's headers end up in front of it.
+					/// </summary>
+					uint16_t LargestHeaderLength;
+
+					uint8_t FragmentCount;
+
+					uint8_t Flags;
+
+					uint8_t Header[FragmentReassembler::MaximumHeaderLength];
+				};
+
+				/// <summary>
+				/// Per block bookkeeping. Blocks of one fragment are chained through Next. The first
+				/// block of a fragment also describes the fragment.
+				/// </summary>
+				struct BlockInfo
+				{
+					uint32_t Next;
+
+					uint32_t NextFragment;
+
+					uint32_t Offset;
+
+					uint32_t Length;
+				};
+
+				inline uint16_t ReadUInt16(const uint8_t* data)
+				{
+					return static_cast<uint16_t>((data[0] << 8) | data[1]);
+				}
+
+				inline uint32_t ReadUInt32(const uint8_t* data)
+				{
+					return (static_cast<uint32_t>(data[0]) << 24) | (static_cast<uint32_t>(data[1]) << 16) | (static_cast<uint32_t>(data[2]) << 8) | data[3];
+				}
+
+				inline void WriteUInt16(uint8_t* data, uint32_t value)
+				{
+					data[0] = static_cast<uint8_t>(value >> 8);
+					data[1] = static_cast<uint8_t>(value);
+				}
+
+				ParseResult ParseIPv4(const uint8_t* packet, uint32_t packetLength, ParsedFragment& fragment)
+				{
+					const uint32_t headerLength = (packet[0] & 0x0F) * 4u;
+					const uint32_t totalLength = ReadUInt16(packet + 2);
+
+					if (headerLength < IPv4HeaderLength || totalLength < headerLength || totalLength > packetLength)
+					{
+						return ParseResult::Malformed;
+					}
+
+					const uint16_t fragmentField = ReadUInt16(packet + 6);
+
+					fragment.Offset = (fragmentField & 0x1FFFu) * 8;
+					fragment.More = (fragmentField & 0x2000) != 0;
+
+					if (fragment.Offset == 0 && !fragment.More)
+					{
+						return ParseResult::NotFragment;
+					}
+
+					std::memset(&fragment.Key, 0, sizeof(fragment.Key));
+					fragment.Key.Family = 4;
+					fragment.Key.Protocol = packet[9];
+					fragment.Key.Identification = ReadUInt16(packet + 4);
+					std::memcpy(fragment.Key.Source, packet + 12, 4);
+					std::memcpy(fragment.Key.Destination, packet + 16, 4);
+
+					fragment.Header = packet;
+					fragment.HeaderLength = headerLength;
+					fragment.NextHeaderOffset = 0;
+					fragment.Payload = packet + headerLength;
+					fragment.Length = totalLength - headerLength;
+
+					return ParseResult::Fragment;
+				}
+
+				ParseResult ParseIPv6(const uint8_t* packet, uint32_t packetLength, ParsedFragment& fragment)
+				{
+					const uint32_t payloadLength = ReadUInt16(packet + 4);
+					const uint32_t end = IPv6HeaderLength + payloadLength;
+
+					// A zero length is a jumbogram, which can't be fragmented.
+					if (payloadLength == 0)
+					{
+						return ParseResult::NotFragment;
+					}
+
+					if (end > packetLength)
+					{
+						return ParseResult::Malformed;
+					}
+
+					uint8_t next = packet[6];
+					uint32_t nextHeaderOffset = 6;
+					uint32_t position = IPv6HeaderLength;
+
+					// The headers that may come before the fragment header.
+					while (next == HopByHopHeader || next == RoutingHeader || next == DestinationOptionsHeader)
+					{
+						if (position + 2 > end)
+						{
+							return ParseResult::Malformed;
+						}
+
+						nextHeaderOffset = position;
+						next = packet[position];
+						position += (packet[position + 1] + 1u) * 8;
+					}
+
+					if (next != FragmentHeader)
+					{
+						return ParseResult::NotFragment;
+					}
+
+					if (position + 8 > end || position > FragmentReassembler::MaximumHeaderLength)
+					{
+						return ParseResult::Malformed;
+					}
+
+					const uint16_t fragmentField = ReadUInt16(packet + position + 2);
+
+					fragment.Offset = fragmentField & 0xFFF8u;
+					fragment.More = (fragmentField & 0x0001) != 0;
+
+					std::memset(&fragment.Key, 0, sizeof(fragment.Key));
+					fragment.Key.Family = 6;
+					fragment.Key.Protocol = packet[position];
+					fragment.Key.Identification = ReadUInt32(packet + position + 4);
+					std::memcpy(fragment.Key.Source, packet + 8, 16);
+					std::memcpy(fragment.Key.Destination, packet + 24, 16);
+
+					fragment.Header = packet;
+					fragment.HeaderLength = position;
+					fragment.NextHeaderOffset = nextHeaderOffset;
+					fragment.Payload = packet + position + 8;
+					fragment.Length = end - position - 8;
+
+					return ParseResult::Fragment;
+				}
+
+				ParseResult Parse(const uint8_t* packet, uint32_t packetLength, ParsedFragment& fragment)
+				{
+					if (packetLength >= IPv4HeaderLength && (packet[0] >> 4) == 4)
+					{
+						return ParseIPv4(packet, packetLength, fragment);
+					}
+
+					if (packetLength >= IPv6HeaderLength && (packet[0] >> 4) == 6)
+					{
+						return ParseIPv6(packet, packetLength, fragment);
+					}
+
+					return ParseResult::NotFragment;
+				}
+
+				/// <summary>
+				/// The checks that need nothing but the fragment itself.
+				/// </summary>
+				bool IsWellFormed(const ParsedFragment& fragment)
+				{
+					// Every fragment but the last carries a multiple of eight bytes.
+					if (fragment.More && (fragment.Length == 0 || fragment.Length % 8 != 0))
+					{
+						return false;
+					}
+
+					const uint8_t protocol = fragment.Key.Protocol;
+
+					// RFC 1858: a TCP fragment at offset eight could rewrite the flags of the first.
+					if (fragment.Key.Family == 4 && protocol == TcpProtocol && fragment.Offset == 8)
+					{
+						return false;
+					}
+
+					if (fragment.Offset != 0)
+					{
+						return true;
+					}
+
+					// The first fragment holds the whole transport header, so nothing that filters
+					// on ports or flags can be dodged by splitting the header.
+					if (protocol == TcpProtocol)
+					{
+						return fragment.Length >= 20 && fragment.Length >= (fragment.Payload[12] >> 4) * 4u;
+					}
+
+					if (protocol == UdpProtocol || protocol == IcmpProtocol || protocol == Icmpv6Protocol)
+					{
+						return fragment.Length >= 8;
+					}
+
+					return true;
+				}
+			}
+
+			struct FragmentReassembler::State
+			{
+				std::unique_ptr<Datagram[]> Datagrams;
+
+				uint32_t DatagramCapacity = 0;
+
+				uint32_t FreeDatagram = InvalidIndex;
+
+				uint32_t Oldest = InvalidIndex;
+
+				uint32_t Newest = InvalidIndex;
+
+				std::unique_ptr<uint32_t[]> Buckets;
+
+				uint32_t BucketMask = 0;
+
+				/// <summary>
+				/// Mixed into every hash, so that a sender can't aim fragments at one bucket.
+				/// </summary>
+				uint64_t Seed = 0;
+
+				std::unique_ptr<uint8_t[]> Blocks;
+
+				std::unique_ptr<BlockInfo[]> BlockInfos;
+
+				uint32_t BlockCount = 0;
+
+				uint32_t FreeBlock = InvalidIndex;
+
+				uint32_t FreeBlockCount = 0;
+
+				uint32_t Timeout = 0;
+
+				FragmentStatistics Statistics = FragmentStatistics();
+
+				uint32_t BucketOf(const FragmentKey& key) const
+				{
+					uint64_t words[sizeof(FragmentKey) / sizeof(uint64_t)];
+					std::memcpy(words, &key, sizeof(words));
+
+					uint64_t hash = Seed;
+
+					for (uint64_t word : words)
+					{
+						hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+						hash ^= hash >> 29;
+					}
+
+					return static_cast<uint32_t>(hash >> 32) & BucketMask;
+				}
+
+				uint32_t Find(const FragmentKey& key) const
+				{
+					uint32_t index = Buckets[BucketOf(key)];
+
+					while (index != InvalidIndex && !(Datagrams[index].Key == key))
+					{
+						index = Datagrams[index].BucketNext;
+					}
+
+					return index;
+				}
+
+				void FreeBlocks(Datagram& datagram)
+				{
+					uint32_t fragment = datagram.FirstFragment;
+
+					while (fragment != InvalidIndex)
+					{
+						const uint32_t nextFragment = BlockInfos[fragment].NextFragment;
+						uint32_t block = fragment;
+
+						while (block != InvalidIndex)
+						{
+							const uint32_t next = BlockInfos[block].Next;
+
+							BlockInfos[block].Next = FreeBlock;
+							FreeBlock = block;
+							++FreeBlockCount;
+
+							block = next;
+						}
+
+						fragment = nextFragment;
+					}
+
+					datagram.FirstFragment = InvalidIndex;
+					datagram.Received = 0;
+					Statistics.MemoryUsed = static_cast<uint64_t>(BlockCount - FreeBlockCount) * BlockSize;
+				}
+
+				/// <summary>
+				/// Drops a datagram's fragments, but keeps it, so that the rest of them are
+				/// dropped as they arrive.
+				/// </summary>
+				void Kill(Datagram& datagram)
+				{
+					FreeBlocks(datagram);
+					datagram.Flags |= DatagramDead;
+				}
+
+				void Release(uint32_t index)
+				{
+					Datagram& datagram = Datagrams[index];
+
+					FreeBlocks(datagram);
+
+					uint32_t* link = &Buckets[BucketOf(datagram.Key)];
+
+					while (*link != index)
+					{
+						link = &Datagrams[*link].BucketNext;
+					}
+
+					*link = datagram.BucketNext;
+
+					if (datagram.Older != InvalidIndex)
+					{
+						Datagrams[datagram.Older].Newer = datagram.Newer;
+					}
+					else
+					{
+						Oldest = datagram.Newer;
+					}
+
+					if (datagram.Newer != InvalidIndex)
+					{
+						Datagrams[datagram.Newer].Older = datagram.Older;
+					}
+					else
+					{
+						Newest = datagram.Older;
+					}
+
+					datagram.Flags = 0;
+					datagram.BucketNext = FreeDatagram;
+					FreeDatagram = index;
+					--Statistics.Datagrams;
+				}
+
+				uint32_t Create(const FragmentKey& key, uint64_t now)
+				{
+					if (FreeDatagram == InvalidIndex)
+					{
+						if ((Datagrams[Oldest].Flags & DatagramDead) == 0)
+						{
+							++Statistics.Evicted;
+						}
+
+						Release(Oldest);
+					}
+
+					const uint32_t index = FreeDatagram;
+					Datagram& datagram = Datagrams[index];
+					FreeDatagram = datagram.BucketNext;
+
+					datagram.Key = key;
+					datagram.Created = now;
+					datagram.FirstFragment = InvalidIndex;
+					datagram.Received = 0;
+					datagram.End = 0;
+					datagram.HeaderLength = 0;
+					datagram.NextHeaderOffset = 0;
+					datagram.LargestHeaderLength = 0;
+					datagram.FragmentCount = 0;
+					datagram.Flags = DatagramInUse;
+
+					uint32_t& bucket = Buckets[BucketOf(key)];
+					datagram.BucketNext = bucket;
+					bucket = index;
+
+					datagram.Older = Newest;
+					datagram.Newer = InvalidIndex;
+
+					if (Newest != InvalidIndex)
+					{
+						Datagrams[Newest].Newer = index;
+					}
+					else
+					{
+						Oldest = index;
+					}
+
+					Newest = index;
+					++Statistics.Datagrams;
+
+					return index;
+				}
+
+				/// <summary>
+				/// Makes sure there are enough free blocks, dropping the oldest other datagrams
+				/// that hold any.
+				/// </summary>
+				bool Reserve(uint32_t blocks, uint32_t keep)
+				{
+					uint32_t candidate = Oldest;
+
+					while (FreeBlockCount < blocks && candidate != InvalidIndex)
+					{
+						const uint32_t newer = Datagrams[candidate].Newer;
+
+						if (candidate != keep && Datagrams[candidate].FirstFragment != InvalidIndex)
+						{
+							++Statistics.Evicted;
+							Release(candidate);
+						}
+
+						candidate = newer;
+					}
+
+					return FreeBlockCount >= blocks;
+				}
+
+				uint32_t Store(const uint8_t* data, uint32_t length)
+				{
+					uint32_t first = InvalidIndex;
+					uint32_t* link = &first;
+
+					do
+					{
+						const uint32_t block = FreeBlock;
+						const uint32_t chunk = length < BlockSize ? length : BlockSize;
+
+						FreeBlock = BlockInfos[block].Next;
+						--FreeBlockCount;
+
+						std::memcpy(Blocks.get() + static_cast<size_t>(block) * BlockSize, data, chunk);
+
+						*link = block;
+						link = &BlockInfos[block].Next;
+
+						data += chunk;
+						length -= chunk;
+					} while (length != 0);
+
+					*link = InvalidIndex;
+					Statistics.MemoryUsed = static_cast<uint64_t>(BlockCount - FreeBlockCount) * BlockSize;
+
+					return first;
+				}
+
+				bool SameData(uint32_t fragment, const uint8_t* data) const
+				{
+					uint32_t length = BlockInfos[fragment].Length;
+					uint32_t block = fragment;
+
+					while (length != 0)
+					{
+						const uint32_t chunk = length < BlockSize ? length : BlockSize;
+
+						if (std::memcmp(Blocks.get() + static_cast<size_t>(block) * BlockSize, data, chunk) != 0)
+						{
+							return false;
+						}
+
+						data += chunk;
+						length -= chunk;
+						block = BlockInfos[block].Next;
+					}
+
+					return true;
+				}
+
+				/// <summary>
+				/// Where the last fragment held so far ends.
+				/// </summary>
+				uint32_t HeldEnd(const Datagram& datagram) const
+				{
+					uint32_t last = datagram.FirstFragment;
+
+					if (last == InvalidIndex)
+					{
+						return 0;
+					}
+
+					while (BlockInfos[last].NextFragment != InvalidIndex)
+					{
+						last = BlockInfos[last].NextFragment;
+					}
+
+					return BlockInfos[last].Offset + BlockInfos[last].Length;
+				}
+
+				/// <summary>
+				/// Writes out a complete datagram as an unfragmented packet, and releases it.
+				/// </summary>
+				uint32_t Assemble(uint32_t index, uint8_t* output)
+				{
+					Datagram& datagram = Datagrams[index];
+					const uint32_t headerLength = datagram.HeaderLength;
+
+					std::memcpy(output, datagram.Header, headerLength);
+
+					if (datagram.Key.Family == 4)
+					{
+						WriteUInt16(output + 2, headerLength + datagram.End);
+
+						// Keep DF, clear MF and the offset.
+						output[6] &= 0x40;
+						output[7] = 0;
+
+						output[10] = 0;
+						output[11] = 0;
+
+						const uint16_t checksum = FoldChecksum(SumBytes(output, headerLength));
+						std::memcpy(output + 10, &checksum, sizeof(checksum));
+					}
+					else
+					{
+						// Take the fragment header out of the chain.
+						output[datagram.NextHeaderOffset] = datagram.Key.Protocol;
+						WriteUInt16(output + 4, headerLength - IPv6HeaderLength + datagram.End);
+					}
+
+					uint8_t* payload = output + headerLength;
+
+					for (uint32_t fragment = datagram.FirstFragment; fragment != InvalidIndex; fragment = BlockInfos[fragment].NextFragment)
+					{
+						uint32_t length = BlockInfos[fragment].Length;
+						uint8_t* destination = payload + BlockInfos[fragment].Offset;
+
+						for (uint32_t block = fragment; length != 0; block = BlockInfos[block].Next)
+						{
+							const uint32_t chunk = length < BlockSize ? length : BlockSize;
+
+							std::memcpy(destination, Blocks.get() + static_cast<size_t>(block) * BlockSize, chunk);
+
+							destination += chunk;
+							length -= chunk;
+						}
+					}
+
+					const uint32_t packetLength = headerLength + datagram.End;
+
+					Release(index);
+					++Statistics.Reassembled;
+
+					return packetLength;
+				}
+
+				FragmentResult Drop(Datagram& datagram, uint64_t& counter)
+				{
+					++counter;
+					Kill(datagram);
+					return FragmentResult::Dropped;
+				}
+
+				/// <summary>
+				/// What a reassembled packet can hold past headers of the given length, for its
+				/// length field not to wrap.
+				/// </summary>
+				static uint32_t Room(uint8_t family, uint32_t headerLength)
+				{
+					return family == 4 ? MaximumPayload - headerLength : MaximumPayload - (headerLength - IPv6HeaderLength);
+				}
+
+				FragmentResult Add(const ParsedFragment& fragment, uint8_t* output, uint32_t* outputLength, uint64_t now)
+				{
+					const uint32_t fragmentEnd = fragment.Offset + fragment.Length;
+
+					uint32_t index = Find(fragment.Key);
+
+					if (index == InvalidIndex)
+					{
+						if (!IsWellFormed(fragment))
+						{
+							++Statistics.Malformed;
+							return FragmentResult::Dropped;
+						}
+
+						if (fragmentEnd > Room(fragment.Key.Family, fragment.HeaderLength))
+						{
+							++Statistics.Oversized;
+							return FragmentResult::Dropped;
+						}
+
+						index = Create(fragment.Key, now);
+					}
+
+					Datagram& datagram = Datagrams[index];
+
+					if ((datagram.Flags & DatagramDead) != 0)
+					{
+						++Statistics.Discarded;
+						return FragmentResult::Dropped;
+					}
+
+					if (!IsWellFormed(fragment))
+					{
+						return Drop(datagram, Statistics.Malformed);
+					}
+
+					// Fragments already held count against longer headers arriving late too.
+					if (fragment.HeaderLength > datagram.LargestHeaderLength)
+					{
+						datagram.LargestHeaderLength = static_cast<uint16_t>(fragment.HeaderLength);
+
+						if (HeldEnd(datagram) > Room(fragment.Key.Family, datagram.LargestHeaderLength))
+						{
+							return Drop(datagram, Statistics.Oversized);
+						}
+					}
+
+					if (fragmentEnd > Room(fragment.Key.Family, datagram.LargestHeaderLength))
+					{
+						return Drop(datagram, Statistics.Oversized);
+					}
+
+					// Where the fragment goes, and whether it conflicts with its neighbours.
+					uint32_t previous = InvalidIndex;
+					uint32_t next = datagram.FirstFragment;
+
+					while (next != InvalidIndex && BlockInfos[next].Offset < fragment.Offset)
+					{
+						previous = next;
+						next = BlockInfos[next].NextFragment;
+					}
+
+					if (next != InvalidIndex && BlockInfos[next].Offset == fragment.Offset && BlockInfos[next].Length == fragment.Length)
+					{
+						if (SameData(next, fragment.Payload))
+						{
+							++Statistics.Duplicates;
+							return FragmentResult::Buffered;
+						}
+
+						return Drop(datagram, Statistics.Overlapping);
+					}
+
+					const bool overlapsPrevious = previous != InvalidIndex && BlockInfos[previous].Offset + BlockInfos[previous].Length > fragment.Offset;
+					const bool overlapsNext = next != InvalidIndex && fragmentEnd > BlockInfos[next].Offset;
+
+					// Also a conflict: data past a known end, or two different ends.
+					const bool pastEnd = (datagram.Flags & DatagramHasLast) != 0 && (fragmentEnd > datagram.End || (!fragment.More && fragmentEnd != datagram.End));
+					const bool beforeEnd = !fragment.More && HeldEnd(datagram) > fragmentEnd;
+
+					if (overlapsPrevious || overlapsNext || pastEnd || beforeEnd)
+					{
+						return Drop(datagram, Statistics.Overlapping);
+					}
+
+					if (datagram.FragmentCount == MaximumFragments)
+					{
+						return Drop(datagram, Statistics.TooManyFragments);
+					}
+
+					if (fragment.Length != 0)
+					{
+						const uint32_t blocks = (fragment.Length + BlockSize - 1) / BlockSize;
+
+						if (!Reserve(blocks, index))
+						{
+							// The datagram alone is more than the budget.
+							return Drop(datagram, Statistics.Evicted);
+						}
+
+						const uint32_t stored = Store(fragment.Payload, fragment.Length);
+
+						BlockInfos[stored].Offset = fragment.Offset;
+						BlockInfos[stored].Length = fragment.Length;
+						BlockInfos[stored].NextFragment = next;
+
+						if (previous != InvalidIndex)
+						{
+							BlockInfos[previous].NextFragment = stored;
+						}
+						else
+						{
+							datagram.FirstFragment = stored;
+						}
+
+						datagram.Received += fragment.Length;
+						++datagram.FragmentCount;
+					}
+
+					if (fragment.Offset == 0)
+					{
+						std::memcpy(datagram.Header, fragment.Header, fragment.HeaderLength);
+						datagram.HeaderLength = static_cast<uint16_t>(fragment.HeaderLength);
+						datagram.NextHeaderOffset = static_cast<uint16_t>(fragment.NextHeaderOffset);
+					}
+
+					if (!fragment.More)
+					{
+						datagram.End = fragmentEnd;
+						datagram.Flags |= DatagramHasLast;
+					}
+
+					if ((datagram.Flags & DatagramHasLast) != 0 && datagram.HeaderLength != 0 && datagram.Received == datagram.End)
+					{
+						// Never reached given the checks above, but the output buffer is only
+						// MaximumPacketLength long.
+						if (datagram.End > Room(datagram.Key.Family, datagram.HeaderLength))
+						{
+							return Drop(datagram, Statistics.Oversized);
+						}
+
+						*outputLength = Assemble(index, output);
+						return FragmentResult::Complete;
+					}
+
+					return FragmentResult::Buffered;
+				}
+			};
+
+			FragmentReassembler::FragmentReassembler(uint32_t maximumDatagrams, uint64_t memoryBudget, uint32_t timeoutInMilliseconds) : m_state(new State())
+			{
+				State& state = *m_state;
+
+				state.DatagramCapacity = maximumDatagrams;
+				state.Datagrams.reset(new Datagram[maximumDatagrams]());
+
+				for (uint32_t i = maximumDatagrams; i-- > 0;)
+				{
+					state.Datagrams[i].BucketNext = state.FreeDatagram;
+					state.FreeDatagram = i;
+				}
+
+				uint32_t bucketCount = 1;
+
+				while (bucketCount < maximumDatagrams)
+				{
+					bucketCount <<= 1;
+				}
+
+				state.Buckets.reset(new uint32_t[bucketCount]);
+				state.BucketMask = bucketCount - 1;
+
+				for (uint32_t i = 0; i < bucketCount; ++i)
+				{
+					state.Buckets[i] = InvalidIndex;
+				}
+
+				const uint64_t blockCount = memoryBudget / BlockSize;
+				state.BlockCount = static_cast<uint32_t>(blockCount < InvalidIndex ? blockCount : InvalidIndex - 1);
+				state.Blocks.reset(new uint8_t[static_cast<size_t>(state.BlockCount) * BlockSize]);
+				state.BlockInfos.reset(new BlockInfo[state.BlockCount]);
+
+				for (uint32_t i = state.BlockCount; i-- > 0;)
+				{
+					state.BlockInfos[i].Next = state.FreeBlock;
+					state.FreeBlock = i;
+				}
+
+				state.FreeBlockCount = state.BlockCount;
+				state.Timeout = timeoutInMilliseconds;
+				state.Seed = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^ reinterpret_cast<uintptr_t>(m_state);
+			}
+
+			FragmentReassembler::~FragmentReassembler()
+			{
+				delete m_state;
+			}
+
+			FragmentResult FragmentReassembler::Add(const uint8_t* packet, uint32_t packetLength, uint8_t* output, uint32_t* outputLength, uint64_t now)
+			{
+				State& state = *m_state;
+
+				*outputLength = 0;
+
+				Expire(now, ExpirationsPerAdd);
+
+				ParsedFragment fragment;
+
+				switch (Parse(packet, packetLength, fragment))
+				{
+					case ParseResult::NotFragment:
+						return FragmentResult::NotFragment;
+
+					case ParseResult::Malformed:
+						++state.Statistics.Fragments;
+						++state.Statistics.Malformed;
+						return FragmentResult::Dropped;
+
+					default:
+						break;
+				}
+
+				++state.Statistics.Fragments;
+
+				// An IPv6 fragment header on an unfragmented packet (RFC 6946). Dealt with on its
+				// own, so it can't be mixed up with real fragments of the same identification.
+				if (fragment.Offset == 0 && !fragment.More)
+				{
+					std::memcpy(output, fragment.Header, fragment.HeaderLength);
+					std::memcpy(output + fragment.HeaderLength, fragment.Payload, fragment.Length);
+
+					output[fragment.NextHeaderOffset] = fragment.Key.Protocol;
+					WriteUInt16(output + 4, fragment.HeaderLength - IPv6HeaderLength + fragment.Length);
+
+					*outputLength = fragment.HeaderLength + fragment.Length;
+					++state.Statistics.Reassembled;
+					return FragmentResult::Complete;
+				}
+
+				return state.Add(fragment, output, outputLength, now);
+			}
+
+			uint32_t FragmentReassembler::Expire(uint64_t now, uint32_t limit)
+			{
+				State& state = *m_state;
+				uint32_t expired = 0;
+
+				while (state.Oldest != InvalidIndex && (limit == 0 || expired < limit) && state.Datagrams[state.Oldest].Created + state.Timeout <= now)
+				{
+					if ((state.Datagrams[state.Oldest].Flags & DatagramDead) == 0)
+					{
+						++state.Statistics.Expired;
+					}
+
+					state.Release(state.Oldest);
+					++expired;
+				}
+
+				return expired;
+			}
+
+			void FragmentReassembler::Clear()
+			{
+				while (m_state->Oldest != InvalidIndex)
+				{
+					m_state->Release(m_state->Oldest);
+				}
+			}
+
+			uint32_t FragmentReassembler::Timeout() const
+			{
+				return m_state->Timeout;
+			}
+
+			void FragmentReassembler::SetTimeout(uint32_t timeoutInMilliseconds)
+			{
+				m_state->Timeout = timeoutInMilliseconds;
+			}
+
+			uint64_t FragmentReassembler::MemoryBudget() const
+			{
+				return static_cast<uint64_t>(m_state->BlockCount) * BlockSize;
+			}
+
+			FragmentStatistics FragmentReassembler::Statistics() const
+			{
+				return m_state->Statistics;
+			}
+
+			void FragmentReassembler::ResetStatistics()
+			{
+				FragmentStatistics& statistics = m_state->Statistics;
+				const uint64_t memoryUsed = statistics.MemoryUsed;
+				const uint32_t datagrams = statistics.Datagrams;
+
+				statistics = FragmentStatistics();
+				statistics.MemoryUsed = memoryUsed;
+				statistics.Datagrams = datagrams;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
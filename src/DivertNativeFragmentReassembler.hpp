@@ -0,0 +1,276 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// What FragmentReassembler::Add() did with a packet.
+			/// </summary>
+			enum class FragmentResult : uint8_t
+			{
+				/// <summary>
+				/// The packet isn't a fragment. Nothing was done with it.
+				/// </summary>
+				NotFragment,
+
+				/// <summary>
+				/// The fragment was kept, its datagram isn't complete yet.
+				/// </summary>
+				Buffered,
+
+				/// <summary>
+				/// The fragment completed its datagram, which was written to the output.
+				/// </summary>
+				Complete,
+
+				/// <summary>
+				/// The fragment was thrown away, and with it the rest of its datagram. See the
+				/// statistics for why.
+				/// </summary>
+				Dropped
+			};
+
+			/// <summary>
+			/// Counters describing the fragments a FragmentReassembler has seen.
+			/// </summary>
+			struct FragmentStatistics
+			{
+				/// <summary>
+				/// Fragments added.
+				/// </summary>
+				uint64_t Fragments;
+
+				/// <summary>
+				/// Datagrams put back together.
+				/// </summary>
+				uint64_t Reassembled;
+
+				/// <summary>
+				/// Fragments identical to one already held, which were ignored.
+				/// </summary>
+				uint64_t Duplicates;
+
+				/// <summary>
+				/// Datagrams dropped for fragments that overlap without being identical.
+				/// </summary>
+				uint64_t Overlapping;
+
+				/// <summary>
+				/// Datagrams dropped for growing past the largest packet IP can carry.
+				/// </summary>
+				uint64_t Oversized;
+
+				/// <summary>
+				/// Datagrams dropped for arriving in more than MaximumFragments pieces.
+				/// </summary>
+				uint64_t TooManyFragments;
+
+				/// <summary>
+				/// Fragments dropped for being malformed: truncated, a length other than a multiple
+				/// of eight before the last fragment, a first fragment too short to hold the whole
+				/// transport header, or headers longer than MaximumHeaderLength.
+				/// </summary>
+				uint64_t Malformed;
+
+				/// <summary>
+				/// Datagrams that didn't complete within the timeout.
+				/// </summary>
+				uint64_t Expired;
+
+				/// <summary>
+				/// Incomplete datagrams dropped, oldest first, to make room for new fragments.
+				/// </summary>
+				uint64_t Evicted;
+
+				/// <summary>
+				/// Fragments dropped for belonging to a datagram that was dropped already.
+				/// </summary>
+				uint64_t Discarded;
+
+				/// <summary>
+				/// Bytes of the memory budget holding fragments.
+				/// </summary>
+				uint64_t MemoryUsed;
+
+				/// <summary>
+				/// Datagrams waiting for more fragments.
+				/// </summary>
+				uint32_t Datagrams;
+			};
+
+			/// <summary>
+			/// Puts fragmented IPv4 and IPv6 datagrams back together, so they can be parsed and
+			/// inspected as a whole. Fragments belong together when their source, destination,
+			/// identification and protocol match. The reassembled packet is an ordinary,
+			/// unfragmented packet: the IPv4 header has its length, fragment fields and checksum
+			/// rewritten, the IPv6 fragment header is removed from the chain.
+			/// 
+			/// All memory is allocated up front: a record per datagram in progress, and a budget
+			/// of fixed size blocks that fragment payloads are copied into. Nothing a sender does
+			/// can make it allocate more:
+			/// 
+			/// - Fragments that overlap without being identical drop their whole datagram, as
+			///   RFC 5722 requires for IPv6, so overlapping fragments can never be used to show an
+			///   inspector different data than the receiver sees.
+			/// - A datagram that was dropped stays known, holding no memory, until its timeout, so
+			///   its remaining fragments are dropped rather than starting it over.
+			/// - A first fragment must hold the whole TCP, UDP or ICMP header (RFC 1858, RFC
+			///   7112), fragments other than the last must be multiples of eight bytes, and the
+			///   datagram must fit in a packet.
+			/// - A datagram may have at most MaximumFragments pieces.
+			/// - When the records or the budget run out, the oldest incomplete datagrams make room.
+			/// 
+			/// Not safe for concurrent use.
+			/// </summary>
+			class FragmentReassembler
+			{
+
+			public:
+
+				/// <summary>
+				/// The largest packet a reassembled datagram can make: a full IPv6 payload behind its
+				/// fixed header. Output buffers must be at least this long.
+				/// </summary>
+				static const uint32_t MaximumPacketLength = 40 + 65535;
+
+				/// <summary>
+				/// The most pieces a datagram may arrive in.
+				/// </summary>
+				static const uint32_t MaximumFragments = 64;
+
+				/// <summary>
+				/// The longest IPv4 header, or IPv6 header chain before the fragment header, that is
+				/// accepted.
+				/// </summary>
+				static const uint32_t MaximumHeaderLength = 256;
+
+				/// <summary>
+				/// The size of the blocks fragment payloads are stored in.
+				/// </summary>
+				static const uint32_t BlockSize = 512;
+
+				/// <summary>
+				/// How many timed out datagrams Add() drops, at most, before doing anything else.
+				/// </summary>
+				static const uint32_t ExpirationsPerAdd = 4;
+
+				/// <summary>
+				/// Constructs a reassembler, allocating all of its memory.
+				/// </summary>
+				/// <param name="maximumDatagrams">
+				/// The most datagrams in progress at once. Must be greater than zero.
+				/// </param>
+				/// <param name="memoryBudget">
+				/// The bytes set aside for fragment payloads, rounded down to a whole number of
+				/// blocks. Must hold at least one block.
+				/// </param>
+				/// <param name="timeoutInMilliseconds">
+				/// How long after its first fragment a datagram is given up on.
+				/// </param>
+				FragmentReassembler(uint32_t maximumDatagrams, uint64_t memoryBudget, uint32_t timeoutInMilliseconds);
+
+				~FragmentReassembler();
+
+				/// <summary>
+				/// Adds a packet.
+				/// </summary>
+				/// <param name="packet">
+				/// An IPv4 or IPv6 packet, starting with the IP header.
+				/// </param>
+				/// <param name="output">
+				/// Receives the reassembled packet, when this fragment completes it. Must be at
+				/// least MaximumPacketLength bytes long.
+				/// </param>
+				/// <param name="outputLength">
+				/// Receives the length of the reassembled packet, and zero otherwise.
+				/// </param>
+				/// <param name="now">
+				/// The current time in milliseconds, on a clock that never goes backwards.
+				/// </param>
+				FragmentResult Add(const uint8_t* packet, uint32_t packetLength, uint8_t* output, uint32_t* outputLength, uint64_t now);
+
+				/// <summary>
+				/// Drops datagrams that have timed out.
+				/// </summary>
+				/// <param name="limit">
+				/// The most datagrams to drop. Zero for no limit.
+				/// </param>
+				/// <returns>
+				/// The number of datagrams dropped.
+				/// </returns>
+				uint32_t Expire(uint64_t now, uint32_t limit);
+
+				/// <summary>
+				/// Drops every datagram in progress.
+				/// </summary>
+				void Clear();
+
+				uint32_t Timeout() const;
+
+				void SetTimeout(uint32_t timeoutInMilliseconds);
+
+				/// <summary>
+				/// The memory budget, in bytes, rounded down to whole blocks.
+				/// </summary>
+				uint64_t MemoryBudget() const;
+
+				FragmentStatistics Statistics() const;
+
+				void ResetStatistics();
+
+			private:
+
+				FragmentReassembler(const FragmentReassembler&) = delete;
+
+				FragmentReassembler& operator=(const FragmentReassembler&) = delete;
+
+				/// <summary>
+				/// The datagrams and blocks live here, so that this header stays usable from managed
+				/// code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,376 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativePacketBufferPool.hpp"
+
+#include <atomic>
+#include <memory>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const size_t CacheLineSize = 64;
+
+				/// <summary>
+				/// Large buffers are spaced a whole 64 KB apart, so each of them starts on a cache
+				/// line, and on a page.
+				/// </summary>
+				const size_t LargeBufferStride = static_cast<size_t>(PacketBufferPool::LargeBufferSize) + 1;
+
+				struct BufferInfo
+				{
+					std::atomic<uint32_t> References;
+
+					std::atomic<uint32_t> Generation;
+
+					std::atomic<uint32_t> Length;
+
+					/// <summary>
+					/// The next buffer in the free list, while the buffer is in the pool.
+					/// </summary>
+					std::atomic<uint32_t> Next;
+				};
+
+				/// <summary>
+				/// A lock free stack of buffer numbers. The head packs a counter above the number of
+				/// the top buffer, bumped on every change, so that a buffer leased and returned
+				/// between another thread's read of the head and its exchange can't be mistaken for
+				/// an unchanged stack.
+				/// </summary>
+				struct FreeList
+				{
+					std::atomic<uint64_t> Head;
+
+					/// <summary>
+					/// Keeps the two lists on their own cache lines.
+					/// </summary>
+					uint8_t Padding[CacheLineSize - sizeof(std::atomic<uint64_t>)];
+				};
+
+				uint8_t* AlignToCacheLine(uint8_t* pointer)
+				{
+					return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(pointer) + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1));
+				}
+			}
+
+			struct PacketBufferPool::State
+			{
+				FreeList SmallFree;
+
+				FreeList LargeFree;
+
+				std::atomic<uint32_t> References;
+
+				std::atomic<uint64_t> Leased;
+
+				std::atomic<uint64_t> Promoted;
+
+				std::atomic<uint64_t> Exhausted;
+
+				std::unique_ptr<uint8_t[]> SmallSlab;
+
+				std::unique_ptr<uint8_t[]> LargeSlab;
+
+				uint8_t* Small = nullptr;
+
+				uint8_t* Large = nullptr;
+
+				uint32_t SmallCount = 0;
+
+				uint32_t LargeCount = 0;
+
+				/// <summary>
+				/// Small buffers first, then large ones.
+				/// </summary>
+				std::unique_ptr<BufferInfo[]> Buffers;
+
+				uint32_t Pop(FreeList& list)
+				{
+					uint64_t head = list.Head.load(std::memory_order_acquire);
+
+					for (;;)
+					{
+						const uint32_t buffer = static_cast<uint32_t>(head);
+
+						if (buffer == InvalidBuffer)
+						{
+							return InvalidBuffer;
+						}
+
+						const uint32_t next = Buffers[buffer].Next.load(std::memory_order_relaxed);
+						const uint64_t replacement = (((head >> 32) + 1) << 32) | next;
+
+						if (list.Head.compare_exchange_weak(head, replacement, std::memory_order_acquire, std::memory_order_acquire))
+						{
+							return buffer;
+						}
+					}
+				}
+
+				void Push(FreeList& list, uint32_t buffer)
+				{
+					uint64_t head = list.Head.load(std::memory_order_relaxed);
+					uint64_t replacement = 0;
+
+					do
+					{
+						Buffers[buffer].Next.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+						replacement = (((head >> 32) + 1) << 32) | buffer;
+					} while (!list.Head.compare_exchange_weak(head, replacement, std::memory_order_release, std::memory_order_relaxed));
+				}
+
+				void Fill(FreeList& list, uint32_t first, uint32_t count)
+				{
+					list.Head.store(InvalidBuffer, std::memory_order_relaxed);
+
+					// Pushed in reverse, so the lowest addresses are leased first.
+					for (uint32_t i = count; i-- > 0;)
+					{
+						Push(list, first + i);
+					}
+				}
+
+				/// <summary>
+				/// Counts the buffers in the pool by looking at each of them, rather than keeping
+				/// a count that every lease and return would have to update.
+				/// </summary>
+				uint32_t CountAvailable(uint32_t first, uint32_t count) const
+				{
+					uint32_t available = 0;
+
+					for (uint32_t i = first; i < first + count; ++i)
+					{
+						available += Buffers[i].References.load(std::memory_order_relaxed) == 0 ? 1 : 0;
+					}
+
+					return available;
+				}
+			};
+
+			PacketBufferPool::PacketBufferPool(uint32_t smallBuffers, uint32_t largeBuffers) : m_state(new State())
+			{
+				State& state = *m_state;
+
+				state.References.store(1, std::memory_order_relaxed);
+				state.Leased.store(0, std::memory_order_relaxed);
+				state.Promoted.store(0, std::memory_order_relaxed);
+				state.Exhausted.store(0, std::memory_order_relaxed);
+
+				state.SmallCount = smallBuffers < MaximumBuffers ? smallBuffers : MaximumBuffers;
+				state.LargeCount = largeBuffers < MaximumBuffers ? largeBuffers : MaximumBuffers;
+
+				if (state.SmallCount != 0)
+				{
+					state.SmallSlab.reset(new uint8_t[static_cast<size_t>(state.SmallCount) * SmallBufferSize + CacheLineSize]);
+					state.Small = AlignToCacheLine(state.SmallSlab.get());
+				}
+
+				if (state.LargeCount != 0)
+				{
+					state.LargeSlab.reset(new uint8_t[static_cast<size_t>(state.LargeCount) * LargeBufferStride + CacheLineSize]);
+					state.Large = AlignToCacheLine(state.LargeSlab.get());
+				}
+
+				const uint32_t total = state.SmallCount + state.LargeCount;
+				state.Buffers.reset(new BufferInfo[total]);
+
+				for (uint32_t i = 0; i < total; ++i)
+				{
+					state.Buffers[i].References.store(0, std::memory_order_relaxed);
+					state.Buffers[i].Generation.store(0, std::memory_order_relaxed);
+					state.Buffers[i].Length.store(0, std::memory_order_relaxed);
+				}
+
+				state.Fill(state.SmallFree, 0, state.SmallCount);
+				state.Fill(state.LargeFree, state.SmallCount, state.LargeCount);
+			}
+
+			PacketBufferPool::~PacketBufferPool()
+			{
+				delete m_state;
+			}
+
+			void PacketBufferPool::AddReference()
+			{
+				m_state->References.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void PacketBufferPool::Release()
+			{
+				if (m_state->References.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					delete this;
+				}
+			}
+
+			uint32_t PacketBufferPool::Lease(uint32_t length)
+			{
+				State& state = *m_state;
+
+				if (length > LargeBufferSize)
+				{
+					return InvalidBuffer;
+				}
+
+				uint32_t buffer = InvalidBuffer;
+
+				if (length <= SmallBufferSize)
+				{
+					buffer = state.Pop(state.SmallFree);
+				}
+
+				if (buffer == InvalidBuffer)
+				{
+					buffer = state.Pop(state.LargeFree);
+
+					if (buffer != InvalidBuffer && length <= SmallBufferSize)
+					{
+						state.Promoted.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+
+				if (buffer == InvalidBuffer)
+				{
+					state.Exhausted.fetch_add(1, std::memory_order_relaxed);
+					return InvalidBuffer;
+				}
+
+				BufferInfo& info = state.Buffers[buffer];
+
+				uint32_t generation = info.Generation.load(std::memory_order_relaxed) + 1;
+
+				if (generation == 0)
+				{
+					generation = 1;
+				}
+
+				info.Generation.store(generation, std::memory_order_relaxed);
+				info.Length.store(0, std::memory_order_relaxed);
+				info.References.store(1, std::memory_order_release);
+
+				state.Leased.fetch_add(1, std::memory_order_relaxed);
+
+				return buffer;
+			}
+
+			void PacketBufferPool::Retain(uint32_t buffer)
+			{
+				m_state->Buffers[buffer].References.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			bool PacketBufferPool::Return(uint32_t buffer)
+			{
+				State& state = *m_state;
+
+				if (state.Buffers[buffer].References.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				{
+					return false;
+				}
+
+				state.Push(buffer < state.SmallCount ? state.SmallFree : state.LargeFree, buffer);
+				return true;
+			}
+
+			bool PacketBufferPool::IsLeased(uint32_t buffer, uint32_t generation) const
+			{
+				const State& state = *m_state;
+
+				if (buffer >= state.SmallCount + state.LargeCount)
+				{
+					return false;
+				}
+
+				return state.Buffers[buffer].References.load(std::memory_order_acquire) != 0 && state.Buffers[buffer].Generation.load(std::memory_order_relaxed) == generation;
+			}
+
+			uint32_t PacketBufferPool::Generation(uint32_t buffer) const
+			{
+				return m_state->Buffers[buffer].Generation.load(std::memory_order_relaxed);
+			}
+
+			uint32_t PacketBufferPool::References(uint32_t buffer) const
+			{
+				return m_state->Buffers[buffer].References.load(std::memory_order_relaxed);
+			}
+
+			uint8_t* PacketBufferPool::Data(uint32_t buffer) const
+			{
+				const State& state = *m_state;
+
+				if (buffer < state.SmallCount)
+				{
+					return state.Small + static_cast<size_t>(buffer) * SmallBufferSize;
+				}
+
+				return state.Large + static_cast<size_t>(buffer - state.SmallCount) * LargeBufferStride;
+			}
+
+			uint32_t PacketBufferPool::Capacity(uint32_t buffer) const
+			{
+				return buffer < m_state->SmallCount ? SmallBufferSize : LargeBufferSize;
+			}
+
+			uint32_t PacketBufferPool::Length(uint32_t buffer) const
+			{
+				return m_state->Buffers[buffer].Length.load(std::memory_order_relaxed);
+			}
+
+			void PacketBufferPool::SetLength(uint32_t buffer, uint32_t length)
+			{
+				m_state->Buffers[buffer].Length.store(length, std::memory_order_relaxed);
+			}
+
+			uint32_t PacketBufferPool::SmallBufferCount() const
+			{
+				return m_state->SmallCount;
+			}
+
+			uint32_t PacketBufferPool::LargeBufferCount() const
+			{
+				return m_state->LargeCount;
+			}
+
+			PacketBufferPoolStatistics PacketBufferPool::Statistics() const
+			{
+				const State& state = *m_state;
+				PacketBufferPoolStatistics statistics;
+
+				statistics.Leased = state.Leased.load(std::memory_order_relaxed);
+				statistics.Promoted = state.Promoted.load(std::memory_order_relaxed);
+				statistics.Exhausted = state.Exhausted.load(std::memory_order_relaxed);
+				statistics.SmallAvailable = state.CountAvailable(0, state.SmallCount);
+				statistics.LargeAvailable = state.CountAvailable(state.SmallCount, state.LargeCount);
+
+				return statistics;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
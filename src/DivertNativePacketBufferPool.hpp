@@ -0,0 +1,217 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Counters describing how a PacketBufferPool is being used.
+			/// </summary>
+			struct PacketBufferPoolStatistics
+			{
+				/// <summary>
+				/// Buffers handed out by Lease().
+				/// </summary>
+				uint64_t Leased;
+
+				/// <summary>
+				/// Leases that got a large buffer because every small buffer was out.
+				/// </summary>
+				uint64_t Promoted;
+
+				/// <summary>
+				/// Calls to Lease() that found no buffer big enough.
+				/// </summary>
+				uint64_t Exhausted;
+
+				/// <summary>
+				/// Small buffers currently in the pool. Counted when the statistics are taken.
+				/// </summary>
+				uint32_t SmallAvailable;
+
+				/// <summary>
+				/// Large buffers currently in the pool.
+				/// </summary>
+				uint32_t LargeAvailable;
+			};
+
+			/// <summary>
+			/// A fixed set of packet buffers in native memory, for receiving, parsing, modifying and
+			/// reinjecting packets without allocating or pinning anything per packet. There are two
+			/// sizes: small buffers that hold any packet of a usual MTU, and large buffers that hold
+			/// the largest packet WinDivert can deliver. All of them are carved out of two slabs
+			/// allocated when the pool is created, each buffer starting on a cache line.
+			/// 
+			/// Buffers are numbered. Lease() hands one out with one reference, Retain() adds
+			/// references, for instance while an overlapped operation is using it, and the buffer
+			/// goes back to the pool when Return() drops the last one. Every lease bumps the
+			/// buffer's generation, so a number and generation pair tells a stale lease apart from
+			/// the current one.
+			/// 
+			/// Leasing and returning are lock free and may happen on any thread. The pool itself is
+			/// reference counted like Statistics, so that overlapped operations can finish with
+			/// their buffers after the owner is done with the pool.
+			/// </summary>
+			class PacketBufferPool
+			{
+
+			public:
+
+				/// <summary>
+				/// Returned in place of a buffer number when no buffer could be leased.
+				/// </summary>
+				static const uint32_t InvalidBuffer = 0xFFFFFFFF;
+
+				/// <summary>
+				/// The capacity of a small buffer. Enough for any packet on an Ethernet sized MTU.
+				/// </summary>
+				static const uint32_t SmallBufferSize = 2048;
+
+				/// <summary>
+				/// The capacity of a large buffer, the most WinDivert receives in one packet.
+				/// </summary>
+				static const uint32_t LargeBufferSize = 0xFFFF;
+
+				/// <summary>
+				/// The most buffers of each size.
+				/// </summary>
+				static const uint32_t MaximumBuffers = 0x00FFFFFF;
+
+				/// <summary>
+				/// Creates a pool with a reference count of one, allocating every buffer.
+				/// </summary>
+				/// <param name="smallBuffers">
+				/// The number of small buffers, at most MaximumBuffers.
+				/// </param>
+				/// <param name="largeBuffers">
+				/// The number of large buffers, at most MaximumBuffers.
+				/// </param>
+				PacketBufferPool(uint32_t smallBuffers, uint32_t largeBuffers);
+
+				/// <summary>
+				/// Takes another reference on the pool.
+				/// </summary>
+				void AddReference();
+
+				/// <summary>
+				/// Drops a reference on the pool, destroying it when it was the last one.
+				/// </summary>
+				void Release();
+
+				/// <summary>
+				/// Takes a buffer out of the pool, with one reference and a length of zero. A small
+				/// buffer if the length fits and one is left, a large one otherwise.
+				/// </summary>
+				/// <param name="length">
+				/// The least capacity the buffer must have.
+				/// </param>
+				/// <returns>
+				/// The buffer number, or InvalidBuffer when the length is more than LargeBufferSize
+				/// or no buffer that fits is left.
+				/// </returns>
+				uint32_t Lease(uint32_t length);
+
+				/// <summary>
+				/// Adds a reference to a leased buffer.
+				/// </summary>
+				void Retain(uint32_t buffer);
+
+				/// <summary>
+				/// Drops a reference to a leased buffer, putting it back in the pool when it was the
+				/// last one.
+				/// </summary>
+				/// <returns>
+				/// Whether the buffer went back to the pool.
+				/// </returns>
+				bool Return(uint32_t buffer);
+
+				/// <summary>
+				/// Whether a buffer is leased, and was leased with this generation.
+				/// </summary>
+				bool IsLeased(uint32_t buffer, uint32_t generation) const;
+
+				/// <summary>
+				/// Bumped every time the buffer is leased, and never zero.
+				/// </summary>
+				uint32_t Generation(uint32_t buffer) const;
+
+				uint32_t References(uint32_t buffer) const;
+
+				uint8_t* Data(uint32_t buffer) const;
+
+				uint32_t Capacity(uint32_t buffer) const;
+
+				/// <summary>
+				/// The length of the packet in the buffer, kept with the buffer so that whoever
+				/// holds a reference can tell how much of it is in use.
+				/// </summary>
+				uint32_t Length(uint32_t buffer) const;
+
+				/// <summary>
+				/// Sets the length of the packet in the buffer. Must not be more than its capacity.
+				/// </summary>
+				void SetLength(uint32_t buffer, uint32_t length);
+
+				uint32_t SmallBufferCount() const;
+
+				uint32_t LargeBufferCount() const;
+
+				PacketBufferPoolStatistics Statistics() const;
+
+			private:
+
+				~PacketBufferPool();
+
+				PacketBufferPool(const PacketBufferPool&) = delete;
+
+				PacketBufferPool& operator=(const PacketBufferPool&) = delete;
+
+				/// <summary>
+				/// The slabs and free lists live here, so that this header stays usable from managed
+				/// code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,579 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativePacketRing.hpp"
+#include "DivertNativePacketBufferPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const size_t CacheLineSize = 64;
+
+				/// <summary>
+				/// How many times Push() and Pop() yield and try again before they go to sleep. A
+				/// consumer that keeps up usually frees a slot, or a producer fills one, well
+				/// within this.
+				/// </summary>
+				const uint32_t SpinsBeforeWaiting = 32;
+
+				/// <summary>
+				/// A slot of the ring. The sequence number equals the slot's position for the lap
+				/// when the slot is free for the producer at that position, and the position plus
+				/// one when it holds the descriptor the consumer at that position is to take. Each
+				/// slot fills a cache line, so that consumers popping neighbouring slots, or a
+				/// producer a lap ahead of a consumer, don't contend for the same line.
+				/// </summary>
+				struct Slot
+				{
+					std::atomic<uint64_t> Sequence;
+
+					PacketDescriptor Descriptor;
+
+					uint8_t Padding[CacheLineSize - sizeof(std::atomic<uint64_t>) - sizeof(PacketDescriptor)];
+				};
+
+				static_assert(sizeof(Slot) == CacheLineSize, "A ring slot must fill exactly one cache line.");
+
+				/// <summary>
+				/// A position in the ring, on a cache line of its own.
+				/// </summary>
+				struct Position
+				{
+					std::atomic<uint64_t> Value;
+
+					uint8_t Padding[CacheLineSize - sizeof(std::atomic<uint64_t>)];
+				};
+			}
+
+			struct PacketRing::State
+			{
+				/// <summary>
+				/// Keeps Tail off whatever line the allocation shares with the object before it.
+				/// </summary>
+				uint8_t LeadingPadding[CacheLineSize];
+
+				/// <summary>
+				/// The position the next descriptor is pushed at. Every descriptor ever pushed
+				/// moved it on by one.
+				/// </summary>
+				Position Tail;
+
+				/// <summary>
+				/// The position the next descriptor is popped from. Descriptors popped and
+				/// descriptors dropped from the head both moved it on.
+				/// </summary>
+				Position Head;
+
+				std::unique_ptr<uint8_t[]> SlotStorage;
+
+				Slot* Slots = nullptr;
+
+				uint64_t Mask = 0;
+
+				uint32_t Capacity = 0;
+
+				PacketRingMode Mode = PacketRingMode::SingleProducerSingleConsumer;
+
+				RingOverflow Overflow = RingOverflow::Block;
+
+				/// <summary>
+				/// Whether more than one thread may take from the head at a time. True with
+				/// several consumers, and with RingOverflow::DropOldest, where the producer takes
+				/// from the head to make room.
+				/// </summary>
+				bool SharedHead = false;
+
+				bool SharedTail = false;
+
+				DroppedCallback Callback = nullptr;
+
+				void* Context = nullptr;
+
+				std::atomic<bool> Closed{ false };
+
+				std::atomic<uint32_t> ProducersWaiting{ 0 };
+
+				std::atomic<uint32_t> ConsumersWaiting{ 0 };
+
+				std::mutex Mutex;
+
+				std::condition_variable NotFull;
+
+				std::condition_variable NotEmpty;
+
+				std::atomic<uint64_t> DroppedNewest{ 0 };
+
+				std::atomic<uint64_t> DroppedOldest{ 0 };
+
+				std::atomic<uint64_t> ProducerWaits{ 0 };
+
+				std::atomic<uint64_t> ConsumerWaits{ 0 };
+
+				bool Enqueue(const PacketDescriptor& descriptor)
+				{
+					uint64_t position = Tail.Value.load(std::memory_order_relaxed);
+					Slot* slot;
+
+					for (;;)
+					{
+						slot = &Slots[position & Mask];
+
+						const int64_t lag = static_cast<int64_t>(slot->Sequence.load(std::memory_order_acquire) - position);
+
+						if (lag == 0)
+						{
+							if (!SharedTail)
+							{
+								Tail.Value.store(position + 1, std::memory_order_relaxed);
+								break;
+							}
+
+							if (Tail.Value.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							{
+								break;
+							}
+						}
+						else if (lag < 0)
+						{
+							// The consumer a lap behind hasn't taken this slot yet.
+							return false;
+						}
+						else
+						{
+							position = Tail.Value.load(std::memory_order_relaxed);
+						}
+					}
+
+					slot->Descriptor = descriptor;
+					slot->Sequence.store(position + 1, std::memory_order_release);
+
+					return true;
+				}
+
+				bool Dequeue(PacketDescriptor& descriptor)
+				{
+					uint64_t position = Head.Value.load(std::memory_order_relaxed);
+					Slot* slot;
+
+					for (;;)
+					{
+						slot = &Slots[position & Mask];
+
+						const int64_t lag = static_cast<int64_t>(slot->Sequence.load(std::memory_order_acquire) - (position + 1));
+
+						if (lag == 0)
+						{
+							if (!SharedHead)
+							{
+								Head.Value.store(position + 1, std::memory_order_relaxed);
+								break;
+							}
+
+							if (Head.Value.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							{
+								break;
+							}
+						}
+						else if (lag < 0)
+						{
+							// Nothing pushed here yet, or still being written.
+							return false;
+						}
+						else
+						{
+							position = Head.Value.load(std::memory_order_relaxed);
+						}
+					}
+
+					descriptor = slot->Descriptor;
+					slot->Sequence.store(position + Mask + 1, std::memory_order_release);
+
+					return true;
+				}
+
+				/// <summary>
+				/// Wakes a waiter after a slot changed hands. The fence orders the slot's sequence
+				/// number before the read of the waiter count, as the waiter orders its count
+				/// before its own look at the slots, so that either the waiter sees the slot or
+				/// this sees the waiter.
+				/// </summary>
+				void Wake(std::atomic<uint32_t>& waiting, std::condition_variable& condition)
+				{
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+
+					if (waiting.load(std::memory_order_relaxed) != 0)
+					{
+						std::lock_guard<std::mutex> lock(Mutex);
+						condition.notify_one();
+					}
+				}
+
+				void Pushed()
+				{
+					Wake(ConsumersWaiting, NotEmpty);
+				}
+
+				void Popped()
+				{
+					if (Overflow == RingOverflow::Block)
+					{
+						Wake(ProducersWaiting, NotFull);
+					}
+				}
+
+				void Drop(const PacketDescriptor& descriptor)
+				{
+					if (Callback != nullptr)
+					{
+						Callback(Context, descriptor);
+					}
+				}
+
+				RingPush PushBlocking(const PacketDescriptor& descriptor)
+				{
+					for (uint32_t spin = 0; spin < SpinsBeforeWaiting; ++spin)
+					{
+						std::this_thread::yield();
+
+						if (Closed.load(std::memory_order_acquire))
+						{
+							return RingPush::Closed;
+						}
+
+						if (Enqueue(descriptor))
+						{
+							Pushed();
+							return RingPush::Pushed;
+						}
+					}
+
+					ProducerWaits.fetch_add(1, std::memory_order_relaxed);
+
+					{
+						std::unique_lock<std::mutex> lock(Mutex);
+
+						ProducersWaiting.fetch_add(1, std::memory_order_relaxed);
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+
+						bool pushed;
+
+						while (!(pushed = Enqueue(descriptor)) && !Closed.load(std::memory_order_acquire))
+						{
+							NotFull.wait(lock);
+						}
+
+						ProducersWaiting.fetch_sub(1, std::memory_order_relaxed);
+
+						if (!pushed)
+						{
+							return RingPush::Closed;
+						}
+					}
+
+					Pushed();
+					return RingPush::Pushed;
+				}
+
+				RingPush PushDisplacing(const PacketDescriptor& descriptor)
+				{
+					for (;;)
+					{
+						PacketDescriptor oldest;
+
+						if (Dequeue(oldest))
+						{
+							DroppedOldest.fetch_add(1, std::memory_order_relaxed);
+							Drop(oldest);
+						}
+						else
+						{
+							// A consumer is part way through taking the slot at the head.
+							std::this_thread::yield();
+						}
+
+						if (Enqueue(descriptor))
+						{
+							Pushed();
+							return RingPush::Pushed;
+						}
+					}
+				}
+
+				bool PopWaiting(PacketDescriptor& descriptor, uint32_t timeoutInMilliseconds)
+				{
+					for (uint32_t spin = 0; spin < SpinsBeforeWaiting; ++spin)
+					{
+						std::this_thread::yield();
+
+						if (Dequeue(descriptor))
+						{
+							Popped();
+							return true;
+						}
+
+						if (Closed.load(std::memory_order_acquire))
+						{
+							break;
+						}
+					}
+
+					ConsumerWaits.fetch_add(1, std::memory_order_relaxed);
+
+					const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutInMilliseconds);
+
+					{
+						std::unique_lock<std::mutex> lock(Mutex);
+
+						ConsumersWaiting.fetch_add(1, std::memory_order_relaxed);
+						std::atomic_thread_fence(std::memory_order_seq_cst);
+
+						bool popped;
+
+						while (!(popped = Dequeue(descriptor)) && !Closed.load(std::memory_order_acquire))
+						{
+							if (timeoutInMilliseconds == Infinite)
+							{
+								NotEmpty.wait(lock);
+							}
+							else if (NotEmpty.wait_until(lock, deadline) == std::cv_status::timeout)
+							{
+								popped = Dequeue(descriptor);
+								break;
+							}
+						}
+
+						ConsumersWaiting.fetch_sub(1, std::memory_order_relaxed);
+
+						if (!popped)
+						{
+							return false;
+						}
+					}
+
+					Popped();
+					return true;
+				}
+			};
+
+			PacketRing::PacketRing(uint32_t capacity, PacketRingMode mode, RingOverflow overflow, DroppedCallback callback, void* context) : m_state(new State())
+			{
+				// Two at the least: with one slot, a full ring and an empty one a lap on would
+				// have the same sequence number.
+				uint32_t slotCount = 2;
+
+				while (slotCount < capacity && slotCount < MaximumCapacity)
+				{
+					slotCount <<= 1;
+				}
+
+				m_state->SlotStorage.reset(new uint8_t[slotCount * sizeof(Slot) + CacheLineSize - 1]);
+
+				const uintptr_t address = reinterpret_cast<uintptr_t>(m_state->SlotStorage.get());
+
+				m_state->Slots = reinterpret_cast<Slot*>((address + CacheLineSize - 1) & ~static_cast<uintptr_t>(CacheLineSize - 1));
+
+				for (uint32_t i = 0; i < slotCount; ++i)
+				{
+					Slot* slot = new (&m_state->Slots[i]) Slot();
+					slot->Sequence.store(i, std::memory_order_relaxed);
+				}
+
+				m_state->Tail.Value.store(0, std::memory_order_relaxed);
+				m_state->Head.Value.store(0, std::memory_order_relaxed);
+				m_state->Mask = slotCount - 1;
+				m_state->Capacity = slotCount;
+				m_state->Mode = mode;
+				m_state->Overflow = overflow;
+				m_state->SharedTail = mode == PacketRingMode::MultipleProducersMultipleConsumers;
+				m_state->SharedHead = mode == PacketRingMode::MultipleProducersMultipleConsumers || overflow == RingOverflow::DropOldest;
+				m_state->Callback = callback;
+				m_state->Context = context;
+			}
+
+			PacketRing::~PacketRing()
+			{
+				PacketDescriptor descriptor;
+
+				while (m_state->Dequeue(descriptor))
+				{
+					m_state->Drop(descriptor);
+				}
+
+				delete m_state;
+			}
+
+			RingPush PacketRing::Push(const PacketDescriptor& descriptor)
+			{
+				State& state = *m_state;
+
+				if (state.Closed.load(std::memory_order_acquire))
+				{
+					return RingPush::Closed;
+				}
+
+				if (state.Enqueue(descriptor))
+				{
+					state.Pushed();
+					return RingPush::Pushed;
+				}
+
+				switch (state.Overflow)
+				{
+					case RingOverflow::DropNewest:
+						state.DroppedNewest.fetch_add(1, std::memory_order_relaxed);
+						state.Drop(descriptor);
+						return RingPush::Dropped;
+
+					case RingOverflow::DropOldest:
+						return state.PushDisplacing(descriptor);
+
+					default:
+						return state.PushBlocking(descriptor);
+				}
+			}
+
+			bool PacketRing::TryPush(const PacketDescriptor& descriptor)
+			{
+				if (m_state->Closed.load(std::memory_order_acquire) || !m_state->Enqueue(descriptor))
+				{
+					return false;
+				}
+
+				m_state->Pushed();
+				return true;
+			}
+
+			bool PacketRing::TryPop(PacketDescriptor& descriptor)
+			{
+				if (!m_state->Dequeue(descriptor))
+				{
+					return false;
+				}
+
+				m_state->Popped();
+				return true;
+			}
+
+			bool PacketRing::Pop(PacketDescriptor& descriptor, uint32_t timeoutInMilliseconds)
+			{
+				if (m_state->Dequeue(descriptor))
+				{
+					m_state->Popped();
+					return true;
+				}
+
+				if (timeoutInMilliseconds == 0)
+				{
+					return false;
+				}
+
+				return m_state->PopWaiting(descriptor, timeoutInMilliseconds);
+			}
+
+			void PacketRing::Close()
+			{
+				m_state->Closed.store(true, std::memory_order_release);
+
+				std::lock_guard<std::mutex> lock(m_state->Mutex);
+
+				m_state->NotFull.notify_all();
+				m_state->NotEmpty.notify_all();
+			}
+
+			bool PacketRing::IsClosed() const
+			{
+				return m_state->Closed.load(std::memory_order_acquire);
+			}
+
+			uint32_t PacketRing::Count() const
+			{
+				const uint64_t head = m_state->Head.Value.load(std::memory_order_relaxed);
+				const uint64_t tail = m_state->Tail.Value.load(std::memory_order_relaxed);
+
+				// The two are read at different times, so the difference may be briefly off.
+				if (tail <= head)
+				{
+					return 0;
+				}
+
+				return tail - head > m_state->Capacity ? m_state->Capacity : static_cast<uint32_t>(tail - head);
+			}
+
+			uint32_t PacketRing::Capacity() const
+			{
+				return m_state->Capacity;
+			}
+
+			PacketRingMode PacketRing::Mode() const
+			{
+				return m_state->Mode;
+			}
+
+			RingOverflow PacketRing::Overflow() const
+			{
+				return m_state->Overflow;
+			}
+
+			PacketRingStatistics PacketRing::Statistics() const
+			{
+				PacketRingStatistics statistics;
+
+				statistics.DroppedNewest = m_state->DroppedNewest.load(std::memory_order_relaxed);
+				statistics.DroppedOldest = m_state->DroppedOldest.load(std::memory_order_relaxed);
+				statistics.ProducerWaits = m_state->ProducerWaits.load(std::memory_order_relaxed);
+				statistics.ConsumerWaits = m_state->ConsumerWaits.load(std::memory_order_relaxed);
+
+				// Every descriptor that went in moved the tail on, and every one that came out of
+				// the head, popped or dropped, moved the head on.
+				const uint64_t head = m_state->Head.Value.load(std::memory_order_relaxed);
+
+				statistics.Pushed = m_state->Tail.Value.load(std::memory_order_relaxed);
+				statistics.Popped = head > statistics.DroppedOldest ? head - statistics.DroppedOldest : 0;
+				statistics.Count = Count();
+
+				return statistics;
+			}
+
+			void PacketRing::ReturnToPool(void* pool, const PacketDescriptor& descriptor)
+			{
+				static_cast<PacketBufferPool*>(pool)->Return(descriptor.Buffer);
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
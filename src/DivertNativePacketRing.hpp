@@ -0,0 +1,321 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// One packet handed from the thread that received it to a thread that handles it. The
+			/// packet itself stays where it was received, only its buffer number travels.
+			/// </summary>
+			struct PacketDescriptor
+			{
+				/// <summary>
+				/// The buffer the packet is in, a PacketBufferPool buffer number, or whatever else
+				/// the owner of the ring numbers its buffers by.
+				/// </summary>
+				uint32_t Buffer;
+
+				uint32_t Length;
+
+				/// <summary>
+				/// When the packet was received, in Statistics::Now() terms, or on any clock the
+				/// two ends of the ring agree on.
+				/// </summary>
+				uint64_t Timestamp;
+
+				/// <summary>
+				/// The packet's address, copied whole, so that the receiving thread's address
+				/// structure can be reused for the next packet straight away.
+				/// </summary>
+				WINDIVERT_ADDRESS Address;
+			};
+
+			static_assert(sizeof(PacketDescriptor) <= 32, "A packet descriptor must fit in half a cache line.");
+
+			/// <summary>
+			/// Who may use a PacketRing at the same time.
+			/// </summary>
+			enum class PacketRingMode : uint8_t
+			{
+				/// <summary>
+				/// One thread pushes and one thread pops. Neither end needs an interlocked
+				/// instruction to claim a slot.
+				/// </summary>
+				SingleProducerSingleConsumer,
+
+				/// <summary>
+				/// Any number of threads push and pop.
+				/// </summary>
+				MultipleProducersMultipleConsumers
+			};
+
+			/// <summary>
+			/// What Push() does when the ring is full.
+			/// </summary>
+			enum class RingOverflow : uint8_t
+			{
+				/// <summary>
+				/// Waits for a consumer to make room. Nothing is lost, and a slow consumer slows the
+				/// receive thread down, which lets WinDivert's own queue take up the slack.
+				/// </summary>
+				Block,
+
+				/// <summary>
+				/// Drops the packet being pushed.
+				/// </summary>
+				DropNewest,
+
+				/// <summary>
+				/// Drops the oldest packet in the ring to make room, so consumers that fall behind
+				/// skip ahead rather than work through stale packets.
+				/// </summary>
+				DropOldest
+			};
+
+			/// <summary>
+			/// The outcome of PacketRing::Push().
+			/// </summary>
+			enum class RingPush : uint8_t
+			{
+				/// <summary>
+				/// The packet is in the ring. With RingOverflow::DropOldest, older packets may have
+				/// been dropped to make room.
+				/// </summary>
+				Pushed,
+
+				/// <summary>
+				/// The ring was full and the packet was dropped, with RingOverflow::DropNewest.
+				/// </summary>
+				Dropped,
+
+				/// <summary>
+				/// The ring has been closed. The packet wasn't taken and still belongs to the caller.
+				/// </summary>
+				Closed
+			};
+
+			/// <summary>
+			/// Counters describing the traffic through a PacketRing.
+			/// </summary>
+			struct PacketRingStatistics
+			{
+				/// <summary>
+				/// Packets that went into the ring.
+				/// </summary>
+				uint64_t Pushed;
+
+				/// <summary>
+				/// Packets taken out by consumers.
+				/// </summary>
+				uint64_t Popped;
+
+				/// <summary>
+				/// Packets dropped by RingOverflow::DropNewest.
+				/// </summary>
+				uint64_t DroppedNewest;
+
+				/// <summary>
+				/// Packets dropped by RingOverflow::DropOldest.
+				/// </summary>
+				uint64_t DroppedOldest;
+
+				/// <summary>
+				/// Times a producer had to wait for room, with RingOverflow::Block.
+				/// </summary>
+				uint64_t ProducerWaits;
+
+				/// <summary>
+				/// Times a consumer had to wait for a packet.
+				/// </summary>
+				uint64_t ConsumerWaits;
+
+				/// <summary>
+				/// The number of packets currently in the ring.
+				/// </summary>
+				uint32_t Count;
+			};
+
+			/// <summary>
+			/// A bounded queue of packet descriptors, for handing packets from the thread that
+			/// receives them to the threads that inspect and send them, without taking a lock for
+			/// every packet. Each slot of the ring holds a descriptor and a sequence number on a
+			/// cache line of its own. A producer claims the slot at the tail and a consumer the
+			/// slot at the head, and the sequence number tells each of them whether the other end
+			/// is done with the slot, so producers and consumers only ever meet on the one slot
+			/// they hand over. With a single producer and a single consumer, claiming a slot is a
+			/// plain store, otherwise it's a compare and exchange on the tail or head.
+			/// 
+			/// Only waiting takes a lock. Push() with RingOverflow::Block and Pop() spin briefly
+			/// before they sleep, and the other end only takes the lock to wake them when someone
+			/// is actually asleep.
+			/// 
+			/// Descriptors the ring drops, whichever the overflow policy, are handed to the
+			/// dropped callback, so that their buffers can be released. ReturnToPool() does that
+			/// for buffers from a PacketBufferPool.
+			/// </summary>
+			class PacketRing
+			{
+
+			public:
+
+				/// <summary>
+				/// Passed to Pop() to wait for as long as it takes.
+				/// </summary>
+				static const uint32_t Infinite = 0xFFFFFFFF;
+
+				/// <summary>
+				/// The most slots a ring can have.
+				/// </summary>
+				static const uint32_t MaximumCapacity = 0x01000000;
+
+				/// <summary>
+				/// Called for every descriptor the ring drops, and for those still in the ring when
+				/// it's destroyed. Must not call back into the ring.
+				/// </summary>
+				typedef void(*DroppedCallback)(void* context, const PacketDescriptor& descriptor);
+
+				/// <summary>
+				/// Constructs a ring. All memory is allocated up front.
+				/// </summary>
+				/// <param name="capacity">
+				/// The most descriptors the ring holds, rounded up to a power of two no less than
+				/// two, and at most MaximumCapacity.
+				/// </param>
+				/// <param name="mode">
+				/// Whether more than one thread pushes or pops at a time.
+				/// </param>
+				/// <param name="overflow">
+				/// What Push() does when the ring is full.
+				/// </param>
+				/// <param name="callback">
+				/// Called with every descriptor the ring drops. May be null.
+				/// </param>
+				/// <param name="context">
+				/// Passed to the callback.
+				/// </param>
+				PacketRing(uint32_t capacity, PacketRingMode mode, RingOverflow overflow, DroppedCallback callback, void* context);
+
+				/// <summary>
+				/// Hands every descriptor still in the ring to the dropped callback. Nothing may be
+				/// pushing or popping, or waiting to.
+				/// </summary>
+				~PacketRing();
+
+				/// <summary>
+				/// Adds a descriptor at the tail, applying the overflow policy if the ring is full.
+				/// </summary>
+				/// <returns>
+				/// Whether the descriptor went in, was dropped, or the ring is closed.
+				/// </returns>
+				RingPush Push(const PacketDescriptor& descriptor);
+
+				/// <summary>
+				/// Adds a descriptor at the tail if there's room, never waiting and never dropping
+				/// anything.
+				/// </summary>
+				/// <returns>
+				/// False if the ring was full or closed. The descriptor still belongs to the caller.
+				/// </returns>
+				bool TryPush(const PacketDescriptor& descriptor);
+
+				/// <summary>
+				/// Takes the descriptor at the head, if there is one.
+				/// </summary>
+				bool TryPop(PacketDescriptor& descriptor);
+
+				/// <summary>
+				/// Takes the descriptor at the head, waiting for one if the ring is empty.
+				/// Descriptors pushed before the ring was closed are still popped after it.
+				/// </summary>
+				/// <param name="timeoutInMilliseconds">
+				/// How long to wait, or Infinite.
+				/// </param>
+				/// <returns>
+				/// False if nothing arrived in time, or the ring is closed and empty.
+				/// </returns>
+				bool Pop(PacketDescriptor& descriptor, uint32_t timeoutInMilliseconds);
+
+				/// <summary>
+				/// Stops the ring taking descriptors, and wakes every waiting producer and consumer.
+				/// Consumers go on popping what's left.
+				/// </summary>
+				void Close();
+
+				bool IsClosed() const;
+
+				/// <summary>
+				/// The number of descriptors in the ring. Only a snapshot while other threads are
+				/// using it.
+				/// </summary>
+				uint32_t Count() const;
+
+				uint32_t Capacity() const;
+
+				PacketRingMode Mode() const;
+
+				RingOverflow Overflow() const;
+
+				PacketRingStatistics Statistics() const;
+
+				/// <summary>
+				/// A DroppedCallback that returns the descriptor's buffer to the PacketBufferPool
+				/// passed as the context.
+				/// </summary>
+				static void ReturnToPool(void* pool, const PacketDescriptor& descriptor);
+
+			private:
+
+				PacketRing(const PacketRing&) = delete;
+
+				PacketRing& operator=(const PacketRing&) = delete;
+
+				/// <summary>
+				/// The slots and the means of waiting live here, so that this header stays usable
+				/// from managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
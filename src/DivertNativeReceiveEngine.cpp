@@ -0,0 +1,436 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeReceiveEngine.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				/// <summary>
+				/// Upper bound on the latency samples kept across all slots of an engine.
+				/// </summary>
+				const size_t LatencySampleBudget = 1 << 20;
+
+				const size_t MinimumSamplesPerSlot = 256;
+
+				inline uint64_t NowInNanoseconds()
+				{
+					return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+				}
+			}
+
+			struct ReceiveEngine::State
+			{
+				/// <summary>
+				/// One in-flight read. Operation must stay the first member, completions are mapped
+				/// back to their slot through the OVERLAPPED pointer.
+				/// </summary>
+				struct Slot
+				{
+					IoOperation Operation;
+
+					State* Owner;
+
+					uint32_t Index;
+
+					uint8_t* Buffer;
+
+					PWINDIVERT_ADDRESS Address;
+
+					uint32_t ReadLength;
+
+					uint64_t PostedAt;
+
+					/// <summary>
+					/// Guards Samples, SampleCount and SampleEpoch. A slot only ever has one read in
+					/// flight, so only one worker at a time writes them and the lock is contended
+					/// only while LatencyPercentiles() copies them out.
+					/// </summary>
+					std::mutex SampleMutex;
+
+					/// <summary>
+					/// Ring of the most recent latency samples, in nanoseconds.
+					/// </summary>
+					std::vector<uint64_t> Samples;
+
+					uint64_t SampleCount;
+
+					/// <summary>
+					/// The StatisticsEpoch the samples belong to. When it falls behind, the samples
+					/// are discarded by the worker completing the slot.
+					/// </summary>
+					uint64_t SampleEpoch;
+				};
+
+				PacketSource* Source;
+
+				CompletionDispatcher* Dispatcher;
+
+				PacketCallback Callback;
+
+				void* Context;
+
+				/// <summary>
+				/// The handle's statistics, if the owner asked for reads to be recorded there.
+				/// </summary>
+				Statistics* Recorder = nullptr;
+
+				uint32_t BufferLength;
+
+				uint32_t SlotCount;
+
+				std::unique_ptr<Slot[]> Slots;
+
+				std::atomic<bool> Running{ false };
+
+				std::atomic<uint32_t> Outstanding{ 0 };
+
+				std::atomic<uint64_t> Completed{ 0 };
+
+				std::atomic<uint64_t> Failed{ 0 };
+
+				std::atomic<uint64_t> StatisticsEpoch{ 0 };
+
+				std::mutex Mutex;
+
+				std::condition_variable Drained;
+
+				/// <summary>
+				/// Posts the read for a slot.
+				/// </summary>
+				/// <returns>
+				/// True if a completion for the read is on its way, false if the read failed outright.
+				/// </returns>
+				bool Post(Slot* slot)
+				{
+					std::memset(&slot->Operation.Overlapped, 0, sizeof(slot->Operation.Overlapped));
+					std::memset(slot->Address, 0, sizeof(WINDIVERT_ADDRESS));
+
+					slot->ReadLength = 0;
+					slot->PostedAt = Recorder != nullptr ? Recorder->RecordPending() : NowInNanoseconds();
+
+					// Once bound to a queue, the completion is queued even if the read completes
+					// immediately, so both outcomes are handled by OnComplete.
+					if (Source->ReceiveEx(slot->Buffer, BufferLength, slot->Address, &slot->ReadLength, &slot->Operation.Overlapped))
+					{
+						return true;
+					}
+
+					if (GetNativeLastError() == IoPendingError)
+					{
+						return true;
+					}
+
+					// The read never went anywhere, so it is done as far as the statistics go.
+					if (Recorder != nullptr)
+					{
+						const int error = GetNativeLastError();
+						Recorder->RecordCompleted(slot->PostedAt);
+						SetNativeLastError(error);
+					}
+
+					return false;
+				}
+
+				/// <summary>
+				/// Takes a slot out of circulation, waking Stop() when the last one comes back.
+				/// </summary>
+				void Retire()
+				{
+					if (Outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					{
+						std::lock_guard<std::mutex> lock(Mutex);
+						Drained.notify_all();
+					}
+				}
+
+				static void OnComplete(IoOperation* operation, uint32_t bytes, int32_t error)
+				{
+					Slot* slot = static_cast<Slot*>(operation->Context);
+					State* state = slot->Owner;
+
+					uint64_t now = 0;
+
+					if (state->Recorder != nullptr)
+					{
+						// Reads cancelled by Stop() aren't errors, but they did complete.
+						if (error != OperationAbortedError || state->Running.load(std::memory_order_acquire))
+						{
+							now = state->Recorder->RecordReceiveCompleted(slot->PostedAt, slot->Address, bytes, error);
+						}
+						else
+						{
+							state->Recorder->RecordCompleted(slot->PostedAt);
+						}
+					}
+
+					if (error == 0)
+					{
+						uint64_t latency = (now != 0 ? now : NowInNanoseconds()) - slot->PostedAt;
+						uint64_t epoch = state->StatisticsEpoch.load(std::memory_order_acquire);
+
+						{
+							std::lock_guard<std::mutex> lock(slot->SampleMutex);
+
+							if (slot->SampleEpoch != epoch)
+							{
+								slot->SampleEpoch = epoch;
+								slot->SampleCount = 0;
+							}
+
+							slot->Samples[static_cast<size_t>(slot->SampleCount % slot->Samples.size())] = latency;
+							++slot->SampleCount;
+						}
+
+						state->Completed.fetch_add(1, std::memory_order_relaxed);
+						state->Callback(state->Context, slot->Index, slot->Buffer, bytes, slot->Address, 0);
+					}
+					else if (error != OperationAbortedError || state->Running.load(std::memory_order_acquire))
+					{
+						state->Failed.fetch_add(1, std::memory_order_relaxed);
+						state->Callback(state->Context, slot->Index, nullptr, 0, slot->Address, error);
+					}
+
+					if (state->Running.load(std::memory_order_acquire))
+					{
+						if (state->Post(slot))
+						{
+							return;
+						}
+
+						int postError = GetNativeLastError();
+						state->Failed.fetch_add(1, std::memory_order_relaxed);
+
+						if (state->Recorder != nullptr)
+						{
+							state->Recorder->RecordReceiveError(postError);
+						}
+
+						state->Callback(state->Context, slot->Index, nullptr, 0, slot->Address, postError);
+					}
+
+					state->Retire();
+				}
+			};
+
+			ReceiveEngine::ReceiveEngine(PacketSource* source, CompletionDispatcher* dispatcher, uint8_t* const* buffers, const PWINDIVERT_ADDRESS* addresses, uint32_t slotCount, uint32_t bufferLength, PacketCallback callback, void* context) : m_state(new State())
+			{
+				m_state->Source = source;
+				m_state->Dispatcher = dispatcher;
+				m_state->Callback = callback;
+				m_state->Context = context;
+				m_state->BufferLength = bufferLength;
+				m_state->SlotCount = slotCount;
+				m_state->Slots.reset(new State::Slot[slotCount]);
+
+				const size_t samplesPerSlot = slotCount == 0 ? 0 : std::max(MinimumSamplesPerSlot, LatencySampleBudget / slotCount);
+
+				for (uint32_t i = 0; i < slotCount; ++i)
+				{
+					State::Slot& slot = m_state->Slots[i];
+
+					std::memset(&slot.Operation, 0, sizeof(slot.Operation));
+					slot.Operation.Complete = &State::OnComplete;
+					slot.Operation.Context = &slot;
+					slot.Owner = m_state;
+					slot.Index = i;
+					slot.Buffer = buffers[i];
+					slot.Address = addresses[i];
+					slot.ReadLength = 0;
+					slot.PostedAt = 0;
+					slot.Samples.assign(samplesPerSlot, 0);
+					slot.SampleCount = 0;
+					slot.SampleEpoch = 0;
+				}
+			}
+
+			ReceiveEngine::~ReceiveEngine()
+			{
+				Stop();
+
+				if (m_state->Recorder != nullptr)
+				{
+					m_state->Recorder->Release();
+				}
+
+				delete m_state;
+			}
+
+			bool ReceiveEngine::Start()
+			{
+				if (m_state->Running.load(std::memory_order_acquire))
+				{
+					return true;
+				}
+
+				if (m_state->SlotCount == 0 || m_state->Callback == nullptr || m_state->Dispatcher == nullptr || m_state->Dispatcher->WorkerCount() == 0)
+				{
+					SetNativeLastError(NotSupportedError);
+					return false;
+				}
+
+				if (!m_state->Source->BindCompletionQueue(m_state->Dispatcher->Queue(), m_state->Dispatcher->Key()))
+				{
+					return false;
+				}
+
+				m_state->Running.store(true, std::memory_order_release);
+
+				for (uint32_t i = 0; i < m_state->SlotCount; ++i)
+				{
+					m_state->Outstanding.fetch_add(1, std::memory_order_acq_rel);
+
+					if (!m_state->Post(&m_state->Slots[i]))
+					{
+						int error = GetNativeLastError();
+
+						m_state->Retire();
+						Stop();
+
+						SetNativeLastError(error);
+						return false;
+					}
+				}
+
+				return true;
+			}
+
+			void ReceiveEngine::Stop()
+			{
+				if (!m_state->Running.exchange(false, std::memory_order_acq_rel) && m_state->Outstanding.load(std::memory_order_acquire) == 0)
+				{
+					return;
+				}
+
+				// A worker that saw Running just before it was cleared may still post one more
+				// read, so keep cancelling until every slot has come back.
+				std::unique_lock<std::mutex> lock(m_state->Mutex);
+
+				while (m_state->Outstanding.load(std::memory_order_acquire) != 0)
+				{
+					m_state->Source->CancelPending();
+					m_state->Drained.wait_for(lock, std::chrono::milliseconds(50));
+				}
+
+				lock.unlock();
+
+				// Only the simulated sources can be unbound, a kernel association lasts as long
+				// as the handle does.
+				m_state->Source->BindCompletionQueue(nullptr, 0);
+			}
+
+			uint64_t ReceiveEngine::CompletedCount() const
+			{
+				return m_state->Completed.load(std::memory_order_relaxed);
+			}
+
+			uint64_t ReceiveEngine::FailedCount() const
+			{
+				return m_state->Failed.load(std::memory_order_relaxed);
+			}
+
+			void ReceiveEngine::LatencyPercentiles(const double* percentiles, uint32_t count, uint64_t* results) const
+			{
+				std::vector<uint64_t> samples;
+
+				const uint64_t epoch = m_state->StatisticsEpoch.load(std::memory_order_acquire);
+
+				for (uint32_t i = 0; i < m_state->SlotCount; ++i)
+				{
+					State::Slot& slot = m_state->Slots[i];
+
+					// Workers keep completing reads while this runs, so each slot's samples are
+					// copied out under its lock.
+					std::lock_guard<std::mutex> lock(slot.SampleMutex);
+
+					if (slot.SampleEpoch != epoch)
+					{
+						continue;
+					}
+
+					const size_t kept = static_cast<size_t>(std::min<uint64_t>(slot.SampleCount, slot.Samples.size()));
+
+					samples.insert(samples.end(), slot.Samples.begin(), slot.Samples.begin() + kept);
+				}
+
+				std::sort(samples.begin(), samples.end());
+
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					if (samples.empty())
+					{
+						results[i] = 0;
+						continue;
+					}
+
+					// Nearest rank.
+					double clamped = std::min(100.0, std::max(0.0, percentiles[i]));
+					size_t rank = static_cast<size_t>((clamped / 100.0) * static_cast<double>(samples.size()) + 0.5);
+
+					results[i] = samples[rank == 0 ? 0 : std::min(rank, samples.size()) - 1];
+				}
+			}
+
+			void ReceiveEngine::ResetStatistics()
+			{
+				m_state->Completed.store(0, std::memory_order_relaxed);
+				m_state->Failed.store(0, std::memory_order_relaxed);
+
+				// Slots are owned by whichever worker is completing them, so they drop their own
+				// samples the next time they complete.
+				m_state->StatisticsEpoch.fetch_add(1, std::memory_order_acq_rel);
+			}
+
+			void ReceiveEngine::SetStatistics(Statistics* statistics)
+			{
+				if (statistics != nullptr)
+				{
+					statistics->AddReference();
+				}
+
+				if (m_state->Recorder != nullptr)
+				{
+					m_state->Recorder->Release();
+				}
+
+				m_state->Recorder = statistics;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
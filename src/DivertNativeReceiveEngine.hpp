@@ -0,0 +1,192 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include "DivertCompletionQueue.hpp"
+#include "DivertNativeStatistics.hpp"
+#include "DivertPacketSource.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Keeps a fixed number of overlapped reads in flight against a PacketSource, and has a
+			/// CompletionDispatcher's workers hand each completed read to a callback before posting
+			/// the read again. Every read owns a slot: a caller supplied buffer and address that
+			/// stay valid for the lifetime of the engine, so nothing is allocated per packet.
+			/// </summary>
+			class ReceiveEngine
+			{
+
+			public:
+
+				/// <summary>
+				/// Invoked on a dispatcher worker for every completed read. The packet and address
+				/// belong to the slot and are only valid until the callback returns, after which the
+				/// slot's read is posted again.
+				/// </summary>
+				/// <param name="context">
+				/// The context supplied to the constructor.
+				/// </param>
+				/// <param name="slot">
+				/// The index of the slot the read completed on.
+				/// </param>
+				/// <param name="packet">
+				/// The packet that was read. Null if the read failed.
+				/// </param>
+				/// <param name="length">
+				/// The length of the packet.
+				/// </param>
+				/// <param name="address">
+				/// The address the packet was read with.
+				/// </param>
+				/// <param name="error">
+				/// Zero if the read succeeded, otherwise the error it failed with.
+				/// </param>
+				typedef void (*PacketCallback)(void* context, uint32_t slot, const uint8_t* packet, uint32_t length, PWINDIVERT_ADDRESS address, int32_t error);
+
+				/// <summary>
+				/// Constructs an engine. Nothing is started until Start() is called.
+				/// </summary>
+				/// <param name="source">
+				/// The source to read from. Not owned.
+				/// </param>
+				/// <param name="dispatcher">
+				/// The dispatcher whose workers service completions. Not owned, and may be shared
+				/// with other engines.
+				/// </param>
+				/// <param name="buffers">
+				/// One buffer per slot, each at least bufferLength bytes long. Not owned.
+				/// </param>
+				/// <param name="addresses">
+				/// One address per slot. Not owned.
+				/// </param>
+				/// <param name="slotCount">
+				/// The number of reads to keep in flight.
+				/// </param>
+				/// <param name="bufferLength">
+				/// The length of each slot's buffer.
+				/// </param>
+				/// <param name="callback">
+				/// Invoked for every completed read.
+				/// </param>
+				/// <param name="context">
+				/// Passed through to the callback.
+				/// </param>
+				ReceiveEngine(PacketSource* source, CompletionDispatcher* dispatcher, uint8_t* const* buffers, const PWINDIVERT_ADDRESS* addresses, uint32_t slotCount, uint32_t bufferLength, PacketCallback callback, void* context);
+
+				/// <summary>
+				/// Stops the engine if it is running.
+				/// </summary>
+				~ReceiveEngine();
+
+				/// <summary>
+				/// Binds the source to the dispatcher's queue and posts a read on every slot. The
+				/// dispatcher must already be started.
+				/// </summary>
+				/// <returns>
+				/// True if every read was posted. On failure, nothing is left in flight and the
+				/// thread's last error is set to the reason.
+				/// </returns>
+				bool Start();
+
+				/// <summary>
+				/// Stops posting reads, cancels the ones in flight and waits for every slot to come
+				/// back. Once this returns the callback is not invoked again.
+				/// </summary>
+				void Stop();
+
+				/// <summary>
+				/// The number of reads that completed successfully.
+				/// </summary>
+				uint64_t CompletedCount() const;
+
+				/// <summary>
+				/// The number of reads that failed, not counting reads cancelled by Stop().
+				/// </summary>
+				uint64_t FailedCount() const;
+
+				/// <summary>
+				/// Computes latency percentiles over the reads completed so far. Latency is the time
+				/// from a read being posted to its completion being dispatched, which includes the
+				/// time spent waiting for traffic and for a free worker. A bounded window of the most
+				/// recent samples is kept per worker. Should only be called while stopped.
+				/// </summary>
+				/// <param name="percentiles">
+				/// The percentiles to compute, each in the range [0, 100].
+				/// </param>
+				/// <param name="count">
+				/// The number of entries in percentiles and results.
+				/// </param>
+				/// <param name="results">
+				/// Receives each percentile, in nanoseconds. Zero if there are no samples.
+				/// </param>
+				void LatencyPercentiles(const double* percentiles, uint32_t count, uint64_t* results) const;
+
+				/// <summary>
+				/// Discards the completion counters and latency samples. Safe to call while running.
+				/// </summary>
+				void ResetStatistics();
+
+				/// <summary>
+				/// Has every read also recorded in the supplied per handle statistics, as received
+				/// packets, errors and pending operations. Must be called before Start().
+				/// </summary>
+				/// <param name="statistics">
+				/// The statistics to record in. The engine holds a reference until it is destroyed.
+				/// </param>
+				void SetStatistics(Statistics* statistics);
+
+			private:
+
+				ReceiveEngine(const ReceiveEngine&) = delete;
+
+				ReceiveEngine& operator=(const ReceiveEngine&) = delete;
+
+				/// <summary>
+				/// Slots, counters and synchronization live here, so that this header stays usable
+				/// from managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
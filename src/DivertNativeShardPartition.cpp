@@ -0,0 +1,191 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeShardPartition.hpp"
+
+#include <thread>
+
+#ifndef _WIN32
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const uint32_t PortCount = 0x10000;
+
+				const uint8_t TcpProtocol = 6;
+
+				const uint8_t UdpProtocol = 17;
+			}
+
+			ShardPartition::ShardPartition(uint32_t shardCount, uint32_t stripesPerShard, ShardKey key)
+			{
+				shardCount = shardCount == 0 ? 1 : (shardCount > MaximumShards ? MaximumShards : shardCount);
+				stripesPerShard = stripesPerShard == 0 ? 1 : (stripesPerShard > MaximumStripesPerShard ? MaximumStripesPerShard : stripesPerShard);
+
+				m_shardCount = shardCount;
+				m_stripeCount = shardCount * stripesPerShard;
+				m_key = key;
+			}
+
+			uint32_t ShardPartition::ShardCount() const
+			{
+				return m_shardCount;
+			}
+
+			uint32_t ShardPartition::StripesPerShard() const
+			{
+				return m_stripeCount / m_shardCount;
+			}
+
+			ShardKey ShardPartition::Key() const
+			{
+				return m_key;
+			}
+
+			uint32_t ShardPartition::ShardOfPort(uint16_t port) const
+			{
+				return ((static_cast<uint32_t>(port) * m_stripeCount) / PortCount) % m_shardCount;
+			}
+
+			uint32_t ShardPartition::ShardOf(const FlowKey& flow) const
+			{
+				if (flow.Protocol != TcpProtocol && flow.Protocol != UdpProtocol)
+				{
+					return 0;
+				}
+
+				return ShardOfPort(m_key == ShardKey::LocalPort ? flow.LocalPort : flow.RemotePort);
+			}
+
+			std::string ShardPartition::Term(uint32_t shard) const
+			{
+				if (m_shardCount == 1)
+				{
+					return "true";
+				}
+
+				// Outbound packets are sent from the local port, inbound packets to it.
+				const bool local = m_key == ShardKey::LocalPort;
+				const char* outboundTcp = local ? "tcp.SrcPort" : "tcp.DstPort";
+				const char* outboundUdp = local ? "udp.SrcPort" : "udp.DstPort";
+				const char* inboundTcp = local ? "tcp.DstPort" : "tcp.SrcPort";
+				const char* inboundUdp = local ? "udp.DstPort" : "udp.SrcPort";
+
+				std::string term;
+
+				term.append("(outbound and (").append(Ranges(outboundTcp, shard)).append(" or ").append(Ranges(outboundUdp, shard)).append("))");
+				term.append(" or (inbound and (").append(Ranges(inboundTcp, shard)).append(" or ").append(Ranges(inboundUdp, shard)).append("))");
+
+				if (shard == 0)
+				{
+					term.append(" or (!tcp and !udp)");
+				}
+
+				return term;
+			}
+
+			std::string ShardPartition::Filter(const std::string& filter, uint32_t shard) const
+			{
+				if (m_shardCount == 1)
+				{
+					return filter;
+				}
+
+				return "(" + filter + ") and (" + Term(shard) + ")";
+			}
+
+			uint32_t ShardPartition::FirstPort(uint32_t stripe) const
+			{
+				// The least port p with p * StripeCount / 65536 >= stripe.
+				return (stripe * PortCount + m_stripeCount - 1) / m_stripeCount;
+			}
+
+			std::string ShardPartition::Ranges(const char* field, uint32_t shard) const
+			{
+				std::string ranges;
+
+				for (uint32_t stripe = shard; stripe < m_stripeCount; stripe += m_shardCount)
+				{
+					const uint32_t first = FirstPort(stripe);
+					const uint32_t last = FirstPort(stripe + 1) - 1;
+
+					if (!ranges.empty())
+					{
+						ranges.append(" or ");
+					}
+
+					// The ends of the port space need only one test.
+					if (first == 0)
+					{
+						ranges.append(field).append(" <= ").append(std::to_string(last));
+					}
+					else if (last == PortCount - 1)
+					{
+						ranges.append(field).append(" >= ").append(std::to_string(first));
+					}
+					else
+					{
+						ranges.append("(").append(field).append(" >= ").append(std::to_string(first)).append(" and ").append(field).append(" <= ").append(std::to_string(last)).append(")");
+					}
+				}
+
+				return ranges;
+			}
+
+			bool PinCurrentThread(uint32_t processor)
+			{
+				const uint32_t processors = std::thread::hardware_concurrency();
+
+				if (processors != 0)
+				{
+					processor %= processors;
+				}
+
+				#ifdef _WIN32
+				// Within the calling thread's processor group.
+				const DWORD_PTR mask = static_cast<DWORD_PTR>(1) << (processor % (sizeof(DWORD_PTR) * 8));
+
+				return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+				#else
+				cpu_set_t set;
+
+				CPU_ZERO(&set);
+				CPU_SET(processor, &set);
+
+				return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+				#endif
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,177 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include "DivertConnectionTable.hpp"
+
+#include <string>
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// The port a ShardPartition divides flows by. Either way it's the same port for both
+			/// directions of a flow, so a flow never straddles two shards.
+			/// </summary>
+			enum class ShardKey : uint8_t
+			{
+				/// <summary>
+				/// The port on this machine. Spreads the connections this machine makes, which
+				/// come from the dynamic port range, but puts every connection to one listening
+				/// port on the same shard.
+				/// </summary>
+				LocalPort,
+
+				/// <summary>
+				/// The port on the other end. Spreads the connections made to a server on this
+				/// machine, but puts every connection to one remote service on the same shard.
+				/// </summary>
+				RemotePort
+			};
+
+			/// <summary>
+			/// Splits the packets a filter matches across a number of WinDivert handles opened at
+			/// the same priority, one per shard, so that each handle has a queue and a thread of
+			/// its own rather than every packet going through one. The driver can't hash, so the
+			/// split is made with filter terms alone: the port space is cut into stripes, dealt
+			/// out to the shards in turn, and each shard's filter only admits TCP and UDP packets
+			/// whose key port lies in one of its stripes. Packets with no ports, ICMP and later
+			/// fragments among them, all go to shard zero.
+			/// 
+			/// ShardOf() places a flow the same way the filters do, for code that needs to know
+			/// which shard will see a flow without asking the driver.
+			/// </summary>
+			class ShardPartition
+			{
+
+			public:
+
+				/// <summary>
+				/// The most shards a partition can have.
+				/// </summary>
+				static const uint32_t MaximumShards = 64;
+
+				/// <summary>
+				/// The most stripes each shard can have. More stripes spread ports more evenly,
+				/// at the cost of a longer filter.
+				/// </summary>
+				static const uint32_t MaximumStripesPerShard = 16;
+
+				/// <summary>
+				/// Four stripes per shard puts a quarter of them in the dynamic port range,
+				/// 49152 to 65535, so that range alone has a stripe for every shard.
+				/// </summary>
+				static const uint32_t DefaultStripesPerShard = 4;
+
+				/// <summary>
+				/// Constructs a partition.
+				/// </summary>
+				/// <param name="shardCount">
+				/// The number of shards, between one and MaximumShards.
+				/// </param>
+				/// <param name="stripesPerShard">
+				/// The number of port ranges each shard gets, between one and
+				/// MaximumStripesPerShard.
+				/// </param>
+				/// <param name="key">
+				/// The port flows are divided by.
+				/// </param>
+				ShardPartition(uint32_t shardCount, uint32_t stripesPerShard, ShardKey key);
+
+				uint32_t ShardCount() const;
+
+				uint32_t StripesPerShard() const;
+
+				ShardKey Key() const;
+
+				/// <summary>
+				/// The shard whose filter admits a key port.
+				/// </summary>
+				uint32_t ShardOfPort(uint16_t port) const;
+
+				/// <summary>
+				/// The shard whose filter admits a flow's packets.
+				/// </summary>
+				uint32_t ShardOf(const FlowKey& flow) const;
+
+				/// <summary>
+				/// The filter term that admits a shard's packets and no others. "true" when there
+				/// is only one shard.
+				/// </summary>
+				std::string Term(uint32_t shard) const;
+
+				/// <summary>
+				/// A filter matching what the supplied filter matches, restricted to one shard.
+				/// Network layer only, since forwarded packets are neither inbound nor outbound and
+				/// so have no local port to go by.
+				/// </summary>
+				std::string Filter(const std::string& filter, uint32_t shard) const;
+
+			private:
+
+				/// <summary>
+				/// The first port of a stripe. Stripe i holds the ports p with
+				/// p * StripeCount / 65536 == i, so that ShardOfPort() needs no table.
+				/// </summary>
+				uint32_t FirstPort(uint32_t stripe) const;
+
+				/// <summary>
+				/// The tests for one shard's ranges of one field, or'ed together.
+				/// </summary>
+				std::string Ranges(const char* field, uint32_t shard) const;
+
+				uint32_t m_shardCount;
+
+				uint32_t m_stripeCount;
+
+				ShardKey m_key;
+			};
+
+			/// <summary>
+			/// Restricts the calling thread to one processor, so that a shard's worker stays on the
+			/// processor whose caches hold its flows. Processor numbers past the number of
+			/// processors wrap around.
+			/// </summary>
+			/// <returns>
+			/// False if the operating system refused.
+			/// </returns>
+			bool PinCurrentThread(uint32_t processor);
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
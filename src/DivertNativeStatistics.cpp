@@ -0,0 +1,681 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeStatistics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				/// <summary>
+				/// The number of threads that get a stripe of their own. Stripe OwnedStripes is the
+				/// one every other thread shares.
+				/// </summary>
+				const uint32_t OwnedStripes = 16;
+
+				/// <summary>
+				/// The number of addresses that can be stamped at once. Must be a power of two.
+				/// </summary>
+				const uint32_t StampCount = 1024;
+
+				/// <summary>
+				/// How many slots from its home slot an address's stamp may be kept in. A stamp is only
+				/// dropped when all of them hold other addresses' stamps, so none is while fewer than
+				/// this many packets are waiting to be reinjected.
+				/// </summary>
+				const uint32_t StampProbes = 32;
+
+				/// <summary>
+				/// Held in a stamp's address while its time is being written. Addresses are aligned,
+				/// so this is never a real one.
+				/// </summary>
+				const uintptr_t StampBusy = 1;
+
+				/// <summary>
+				/// The counters one thread bumps. Padded to two cache lines, so that with the 16 byte
+				/// alignment new gives, neighbouring stripes only ever share padding.
+				/// </summary>
+				struct Stripe
+				{
+					std::atomic<uint64_t> ReceivedPackets{ 0 };
+
+					std::atomic<uint64_t> ReceivedBytes{ 0 };
+
+					std::atomic<uint64_t> SentPackets{ 0 };
+
+					std::atomic<uint64_t> SentBytes{ 0 };
+
+					std::atomic<uint64_t> ReceiveErrors{ 0 };
+
+					std::atomic<uint64_t> SendErrors{ 0 };
+
+					std::atomic<uint64_t> PendingStarted{ 0 };
+
+					std::atomic<uint64_t> ReinjectSum{ 0 };
+
+					std::atomic<uint64_t> CompletionSum{ 0 };
+
+					uint8_t Padding[128 - 9 * sizeof(std::atomic<uint64_t>)];
+				};
+
+				/// <summary>
+				/// Buckets are shared by every thread, a stripe's worth of them per thread would be
+				/// too much memory per handle.
+				/// </summary>
+				struct Histogram
+				{
+					std::atomic<uint64_t> Minimum{ UINT64_MAX };
+
+					std::atomic<uint64_t> Maximum{ 0 };
+
+					std::atomic<uint64_t> Buckets[HistogramBucketCount];
+				};
+
+				struct Stamp
+				{
+					std::atomic<uintptr_t> Address{ 0 };
+
+					std::atomic<uint64_t> Time{ 0 };
+				};
+
+				struct ErrorSlot
+				{
+					std::atomic<int32_t> Error{ 0 };
+
+					std::atomic<uint64_t> Count{ 0 };
+				};
+
+				/// <summary>
+				/// Hands out the owned stripes. Only touched the first time a thread records
+				/// something, and when it exits.
+				/// </summary>
+				struct StripePool
+				{
+					std::mutex Mutex;
+
+					std::vector<uint32_t> Free;
+
+					uint32_t Next = 0;
+				};
+
+				StripePool& Pool()
+				{
+					// Never destroyed, threads may exit during process teardown.
+					static StripePool* pool = new StripePool();
+					return *pool;
+				}
+
+				/// <summary>
+				/// The stripe a thread records in, taken on first use and given back when the thread
+				/// exits. The mutex orders the last writes of the old owner before the first writes
+				/// of the next.
+				/// </summary>
+				struct StripeLease
+				{
+					uint32_t Index = UINT32_MAX;
+
+					~StripeLease()
+					{
+						if (Index < OwnedStripes)
+						{
+							StripePool& pool = Pool();
+							std::lock_guard<std::mutex> lock(pool.Mutex);
+							pool.Free.push_back(Index);
+						}
+					}
+
+					uint32_t Acquire()
+					{
+						if (Index == UINT32_MAX)
+						{
+							StripePool& pool = Pool();
+							std::lock_guard<std::mutex> lock(pool.Mutex);
+
+							if (!pool.Free.empty())
+							{
+								Index = pool.Free.back();
+								pool.Free.pop_back();
+							}
+							else
+							{
+								Index = pool.Next < OwnedStripes ? pool.Next++ : OwnedStripes;
+							}
+						}
+
+						return Index;
+					}
+				};
+
+				thread_local StripeLease t_lease;
+
+				/// <summary>
+				/// Adds to a stripe counter: with a plain load and store when the calling thread
+				/// owns the stripe, atomically when the stripe is shared.
+				/// </summary>
+				inline void Add(std::atomic<uint64_t>& counter, uint64_t value, bool owned)
+				{
+					if (owned)
+					{
+						counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+					}
+					else
+					{
+						counter.fetch_add(value, std::memory_order_relaxed);
+					}
+				}
+
+				inline uint32_t HighestBit(uint64_t value)
+				{
+					#if defined(_MSC_VER)
+						unsigned long index;
+
+						if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32)))
+						{
+							return static_cast<uint32_t>(index) + 32;
+						}
+
+						_BitScanReverse(&index, static_cast<unsigned long>(value));
+						return static_cast<uint32_t>(index);
+					#else
+						return 63 - static_cast<uint32_t>(__builtin_clzll(value));
+					#endif
+				}
+
+				inline uint32_t BucketOf(uint64_t value)
+				{
+					if (value >= (static_cast<uint64_t>(1) << HistogramMaximumBits))
+					{
+						return HistogramBucketCount - 1;
+					}
+
+					if (value < HistogramSubBuckets)
+					{
+						return static_cast<uint32_t>(value);
+					}
+
+					const uint32_t shift = HighestBit(value) - HistogramSubBucketBits;
+
+					return (shift + 1) * HistogramSubBuckets + static_cast<uint32_t>((value >> shift) & (HistogramSubBuckets - 1));
+				}
+
+				void Record(Histogram& histogram, std::atomic<uint64_t>& sum, bool owned, uint64_t value)
+				{
+					histogram.Buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+					Add(sum, value, owned);
+
+					// New extremes get rare quickly, so these loops hardly ever run.
+					uint64_t minimum = histogram.Minimum.load(std::memory_order_relaxed);
+
+					while (value < minimum && !histogram.Minimum.compare_exchange_weak(minimum, value, std::memory_order_relaxed))
+					{
+					}
+
+					uint64_t maximum = histogram.Maximum.load(std::memory_order_relaxed);
+
+					while (value > maximum && !histogram.Maximum.compare_exchange_weak(maximum, value, std::memory_order_relaxed))
+					{
+					}
+				}
+
+				void Copy(const Histogram& histogram, HistogramSnapshot* snapshot)
+				{
+					snapshot->Count = 0;
+
+					for (uint32_t i = 0; i < HistogramBucketCount; ++i)
+					{
+						snapshot->Buckets[i] = histogram.Buckets[i].load(std::memory_order_relaxed);
+						snapshot->Count += snapshot->Buckets[i];
+					}
+
+					snapshot->Maximum = histogram.Maximum.load(std::memory_order_relaxed);
+					snapshot->Minimum = snapshot->Count == 0 ? 0 : histogram.Minimum.load(std::memory_order_relaxed);
+				}
+			}
+
+			struct Statistics::Counters
+			{
+				Counters()
+				{
+					for (uint32_t i = 0; i < HistogramBucketCount; ++i)
+					{
+						Reinject.Buckets[i].store(0, std::memory_order_relaxed);
+						Completion.Buckets[i].store(0, std::memory_order_relaxed);
+					}
+				}
+
+				std::atomic<uint32_t> References{ 1 };
+
+				uint64_t CreatedAt = Statistics::Now();
+
+				Stripe Stripes[OwnedStripes + 1];
+
+				Histogram Reinject;
+
+				Histogram Completion;
+
+				ErrorSlot Errors[MaximumErrorCodes];
+
+				std::atomic<uint64_t> OtherErrors{ 0 };
+
+				Stamp Stamps[StampCount];
+
+				uint32_t HomeOf(PWINDIVERT_ADDRESS address)
+				{
+					// Addresses are at least 4 byte aligned and often allocated back to back, so
+					// the low bits are mixed in with a multiplicative hash.
+					const uint64_t hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address)) * UINT64_C(0x9E3779B97F4A7C15);
+					return static_cast<uint32_t>(hash >> 54);
+				}
+
+				bool Claim(Stamp& stamp, uintptr_t expected, uintptr_t key, uint64_t now)
+				{
+					// The slot is marked busy while the time is written, so that a concurrent Take
+					// never pairs the address with another stamp's time.
+					if (!stamp.Address.compare_exchange_strong(expected, StampBusy, std::memory_order_acquire))
+					{
+						return false;
+					}
+
+					stamp.Time.store(now, std::memory_order_relaxed);
+					stamp.Address.store(key, std::memory_order_release);
+					return true;
+				}
+
+				void Mark(PWINDIVERT_ADDRESS address, uint64_t now)
+				{
+					const uintptr_t key = reinterpret_cast<uintptr_t>(address);
+					const uint32_t home = HomeOf(address);
+
+					// The stamp goes in the first slot that is free or already holds the address, so
+					// Take finds the latest stamp first. Two tries, since the oldest stamp, taken
+					// when there is neither, can be changed by another thread in the meantime.
+					for (int attempt = 0; attempt < 2; ++attempt)
+					{
+						Stamp* oldest = nullptr;
+						uintptr_t oldestAddress = 0;
+						uint64_t oldestTime = UINT64_MAX;
+
+						for (uint32_t i = 0; i < StampProbes; ++i)
+						{
+							Stamp& stamp = Stamps[(home + i) & (StampCount - 1)];
+							const uintptr_t current = stamp.Address.load(std::memory_order_acquire);
+
+							if (current == key || current == 0)
+							{
+								if (Claim(stamp, current, key, now))
+								{
+									return;
+								}
+							}
+							else if (current != StampBusy)
+							{
+								const uint64_t time = stamp.Time.load(std::memory_order_relaxed);
+
+								if (time < oldestTime)
+								{
+									oldest = &stamp;
+									oldestAddress = current;
+									oldestTime = time;
+								}
+							}
+						}
+
+						// The oldest stamp's packet was most likely dropped rather than reinjected.
+						if (oldest != nullptr && Claim(*oldest, oldestAddress, key, now))
+						{
+							return;
+						}
+					}
+				}
+
+				bool Take(PWINDIVERT_ADDRESS address, uint64_t* time)
+				{
+					const uintptr_t key = reinterpret_cast<uintptr_t>(address);
+					const uint32_t home = HomeOf(address);
+
+					for (uint32_t i = 0; i < StampProbes; ++i)
+					{
+						Stamp& stamp = Stamps[(home + i) & (StampCount - 1)];
+						uintptr_t expected = key;
+
+						if (stamp.Address.load(std::memory_order_acquire) != key)
+						{
+							continue;
+						}
+
+						*time = stamp.Time.load(std::memory_order_relaxed);
+
+						if (stamp.Address.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+						{
+							return true;
+						}
+					}
+
+					return false;
+				}
+
+				void RecordError(int32_t error)
+				{
+					if (error != 0)
+					{
+						for (ErrorSlot& slot : Errors)
+						{
+							int32_t current = slot.Error.load(std::memory_order_acquire);
+
+							if (current == 0 && slot.Error.compare_exchange_strong(current, error, std::memory_order_acq_rel))
+							{
+								current = error;
+							}
+
+							if (current == error)
+							{
+								slot.Count.fetch_add(1, std::memory_order_relaxed);
+								return;
+							}
+						}
+					}
+
+					OtherErrors.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				void Received(const PWINDIVERT_ADDRESS* addresses, uint32_t count, uint64_t bytes, uint64_t now)
+				{
+					const uint32_t index = t_lease.Acquire();
+					const bool owned = index < OwnedStripes;
+
+					Add(Stripes[index].ReceivedPackets, count, owned);
+					Add(Stripes[index].ReceivedBytes, bytes, owned);
+
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						if (addresses[i] != nullptr)
+						{
+							Mark(addresses[i], now);
+						}
+					}
+				}
+
+				void Sent(const PWINDIVERT_ADDRESS* addresses, const int32_t* results, const uint32_t* lengths, uint32_t count, uint64_t now)
+				{
+					const uint32_t index = t_lease.Acquire();
+					const bool owned = index < OwnedStripes;
+
+					uint64_t sent = 0;
+					uint64_t bytes = 0;
+
+					for (uint32_t i = 0; i < count; ++i)
+					{
+						if (results != nullptr && results[i] != 0)
+						{
+							Add(Stripes[index].SendErrors, 1, owned);
+							RecordError(results[i]);
+							continue;
+						}
+
+						++sent;
+						bytes += lengths[i];
+
+						uint64_t receivedAt = 0;
+
+						if (addresses[i] != nullptr && Take(addresses[i], &receivedAt))
+						{
+							// The clock is only read once there's something to measure.
+							now = now == 0 ? Statistics::Now() : now;
+							Record(Reinject, Stripes[index].ReinjectSum, owned, now > receivedAt ? now - receivedAt : 0);
+						}
+					}
+
+					Add(Stripes[index].SentPackets, sent, owned);
+					Add(Stripes[index].SentBytes, bytes, owned);
+				}
+
+				void Failed(bool send, int32_t error)
+				{
+					const uint32_t index = t_lease.Acquire();
+
+					Add(send ? Stripes[index].SendErrors : Stripes[index].ReceiveErrors, 1, index < OwnedStripes);
+					RecordError(error);
+				}
+
+				void Completed(uint64_t pendingSince, uint64_t now)
+				{
+					const uint32_t index = t_lease.Acquire();
+
+					Record(Completion, Stripes[index].CompletionSum, index < OwnedStripes, now > pendingSince ? now - pendingSince : 0);
+				}
+			};
+
+			uint64_t HistogramBucketLowerBound(uint32_t bucket)
+			{
+				const uint32_t octave = bucket / HistogramSubBuckets;
+				const uint32_t subBucket = bucket % HistogramSubBuckets;
+
+				if (octave == 0)
+				{
+					return subBucket;
+				}
+
+				return static_cast<uint64_t>(HistogramSubBuckets + subBucket) << (octave - 1);
+			}
+
+			uint64_t HistogramPercentile(const uint64_t* buckets, uint64_t count, uint64_t maximum, double percentile)
+			{
+				if (count == 0)
+				{
+					return 0;
+				}
+
+				percentile = percentile < 0 ? 0 : (percentile > 100 ? 100 : percentile);
+
+				// The rank of the value wanted, counting from one.
+				uint64_t rank = static_cast<uint64_t>(percentile / 100 * static_cast<double>(count) + 0.5);
+				rank = rank == 0 ? 1 : (rank > count ? count : rank);
+
+				uint64_t seen = 0;
+
+				for (uint32_t i = 0; i < HistogramBucketCount; ++i)
+				{
+					seen += buckets[i];
+
+					if (seen >= rank)
+					{
+						const uint64_t highest = i + 1 < HistogramBucketCount ? HistogramBucketLowerBound(i + 1) - 1 : maximum;
+						return highest < maximum ? highest : maximum;
+					}
+				}
+
+				return maximum;
+			}
+
+			Statistics::Statistics() : m_counters(new Counters())
+			{
+
+			}
+
+			Statistics::~Statistics()
+			{
+				delete m_counters;
+			}
+
+			void Statistics::AddReference()
+			{
+				m_counters->References.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			void Statistics::Release()
+			{
+				if (m_counters->References.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				{
+					delete this;
+				}
+			}
+
+			uint64_t Statistics::Now()
+			{
+				return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+			}
+
+			void Statistics::RecordReceived(const PWINDIVERT_ADDRESS* addresses, uint32_t count, uint64_t bytes)
+			{
+				if (count != 0)
+				{
+					m_counters->Received(addresses, count, bytes, Now());
+				}
+			}
+
+			void Statistics::RecordReceived(PWINDIVERT_ADDRESS address, uint32_t length)
+			{
+				m_counters->Received(&address, 1, length, Now());
+			}
+
+			void Statistics::RecordSent(const PWINDIVERT_ADDRESS* addresses, const int32_t* results, const uint32_t* lengths, uint32_t count)
+			{
+				if (count != 0)
+				{
+					m_counters->Sent(addresses, results, lengths, count, 0);
+				}
+			}
+
+			void Statistics::RecordSent(PWINDIVERT_ADDRESS address, uint32_t length)
+			{
+				m_counters->Sent(&address, nullptr, &length, 1, 0);
+			}
+
+			void Statistics::RecordReceiveError(int32_t error)
+			{
+				m_counters->Failed(false, error);
+			}
+
+			void Statistics::RecordSendError(int32_t error)
+			{
+				m_counters->Failed(true, error);
+			}
+
+			uint64_t Statistics::RecordPending()
+			{
+				const uint32_t index = t_lease.Acquire();
+
+				Add(m_counters->Stripes[index].PendingStarted, 1, index < OwnedStripes);
+				return Now();
+			}
+
+			uint64_t Statistics::RecordReceiveCompleted(uint64_t pendingSince, PWINDIVERT_ADDRESS address, uint32_t length, int32_t error)
+			{
+				const uint64_t now = Now();
+
+				m_counters->Completed(pendingSince, now);
+
+				if (error == 0)
+				{
+					m_counters->Received(&address, 1, length, now);
+				}
+				else
+				{
+					m_counters->Failed(false, error);
+				}
+
+				return now;
+			}
+
+			uint64_t Statistics::RecordSendCompleted(uint64_t pendingSince, PWINDIVERT_ADDRESS address, uint32_t length, int32_t error)
+			{
+				const uint64_t now = Now();
+
+				m_counters->Completed(pendingSince, now);
+
+				if (error == 0)
+				{
+					m_counters->Sent(&address, nullptr, &length, 1, now);
+				}
+				else
+				{
+					m_counters->Failed(true, error);
+				}
+
+				return now;
+			}
+
+			void Statistics::RecordCompleted(uint64_t pendingSince)
+			{
+				m_counters->Completed(pendingSince, Now());
+			}
+
+			void Statistics::Snapshot(StatisticsSnapshot* snapshot) const
+			{
+				std::memset(snapshot, 0, sizeof(*snapshot));
+
+				const uint64_t now = Now();
+				snapshot->Elapsed = now > m_counters->CreatedAt ? now - m_counters->CreatedAt : 0;
+
+				for (const Stripe& stripe : m_counters->Stripes)
+				{
+					snapshot->ReceivedPackets += stripe.ReceivedPackets.load(std::memory_order_relaxed);
+					snapshot->ReceivedBytes += stripe.ReceivedBytes.load(std::memory_order_relaxed);
+					snapshot->SentPackets += stripe.SentPackets.load(std::memory_order_relaxed);
+					snapshot->SentBytes += stripe.SentBytes.load(std::memory_order_relaxed);
+					snapshot->ReceiveErrors += stripe.ReceiveErrors.load(std::memory_order_relaxed);
+					snapshot->SendErrors += stripe.SendErrors.load(std::memory_order_relaxed);
+					snapshot->PendingStarted += stripe.PendingStarted.load(std::memory_order_relaxed);
+					snapshot->ReinjectLatency.Sum += stripe.ReinjectSum.load(std::memory_order_relaxed);
+					snapshot->CompletionLatency.Sum += stripe.CompletionSum.load(std::memory_order_relaxed);
+				}
+
+				for (const ErrorSlot& slot : m_counters->Errors)
+				{
+					const int32_t error = slot.Error.load(std::memory_order_acquire);
+
+					if (error != 0)
+					{
+						snapshot->Errors[snapshot->ErrorCodeCount].Error = error;
+						snapshot->Errors[snapshot->ErrorCodeCount].Count = slot.Count.load(std::memory_order_relaxed);
+						++snapshot->ErrorCodeCount;
+					}
+				}
+
+				snapshot->OtherErrors = m_counters->OtherErrors.load(std::memory_order_relaxed);
+
+				Copy(m_counters->Reinject, &snapshot->ReinjectLatency);
+				Copy(m_counters->Completion, &snapshot->CompletionLatency);
+
+				// Every completion lands in the histogram exactly once.
+				snapshot->PendingCompleted = snapshot->CompletionLatency.Count;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,354 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// Latency histograms are log-linear, in the style of HdrHistogram: every power of two
+			/// is split into 2^HistogramSubBucketBits equal sub-buckets, so a value is recorded to
+			/// within 1/32 of itself.
+			/// </summary>
+			const uint32_t HistogramSubBucketBits = 5;
+
+			const uint32_t HistogramSubBuckets = 1 << HistogramSubBucketBits;
+
+			/// <summary>
+			/// Values of 2^HistogramMaximumBits nanoseconds (about 18 minutes) and over go in the
+			/// last bucket.
+			/// </summary>
+			const uint32_t HistogramMaximumBits = 40;
+
+			const uint32_t HistogramBucketCount = (HistogramMaximumBits - HistogramSubBucketBits + 1) * HistogramSubBuckets;
+
+			/// <summary>
+			/// The number of distinct error codes counted individually. Further codes are only
+			/// counted in StatisticsSnapshot::OtherErrors.
+			/// </summary>
+			const uint32_t MaximumErrorCodes = 16;
+
+			/// <summary>
+			/// A copy of one latency histogram, in nanoseconds.
+			/// </summary>
+			struct HistogramSnapshot
+			{
+				/// <summary>
+				/// The number of values recorded.
+				/// </summary>
+				uint64_t Count;
+
+				/// <summary>
+				/// The sum of the values recorded.
+				/// </summary>
+				uint64_t Sum;
+
+				/// <summary>
+				/// The smallest value recorded, zero if none were.
+				/// </summary>
+				uint64_t Minimum;
+
+				/// <summary>
+				/// The largest value recorded, zero if none were.
+				/// </summary>
+				uint64_t Maximum;
+
+				/// <summary>
+				/// The number of values recorded in each bucket, see HistogramBucketLowerBound.
+				/// </summary>
+				uint64_t Buckets[HistogramBucketCount];
+			};
+
+			/// <summary>
+			/// One error code and the number of failed operations that reported it.
+			/// </summary>
+			struct ErrorCount
+			{
+				int32_t Error;
+
+				uint64_t Count;
+			};
+
+			/// <summary>
+			/// A copy of every counter of a Statistics object. Each counter is read atomically, but
+			/// they are not all read at the same instant, so a snapshot taken under load can be a
+			/// few operations out between counters.
+			/// </summary>
+			struct StatisticsSnapshot
+			{
+				/// <summary>
+				/// Nanoseconds since the Statistics object was created.
+				/// </summary>
+				uint64_t Elapsed;
+
+				uint64_t ReceivedPackets;
+
+				uint64_t ReceivedBytes;
+
+				uint64_t SentPackets;
+
+				uint64_t SentBytes;
+
+				uint64_t ReceiveErrors;
+
+				uint64_t SendErrors;
+
+				/// <summary>
+				/// Overlapped operations that didn't complete immediately.
+				/// </summary>
+				uint64_t PendingStarted;
+
+				/// <summary>
+				/// Overlapped operations that were started pending and have completed since.
+				/// </summary>
+				uint64_t PendingCompleted;
+
+				/// <summary>
+				/// Failed operations by error code, receives and sends together.
+				/// </summary>
+				ErrorCount Errors[MaximumErrorCodes];
+
+				/// <summary>
+				/// The number of valid entries in Errors.
+				/// </summary>
+				uint32_t ErrorCodeCount;
+
+				/// <summary>
+				/// Failures whose code didn't fit in Errors.
+				/// </summary>
+				uint64_t OtherErrors;
+
+				/// <summary>
+				/// Time from a packet being received to it being sent again with the same address.
+				/// </summary>
+				HistogramSnapshot ReinjectLatency;
+
+				/// <summary>
+				/// Time from an overlapped operation going pending to its completion being seen.
+				/// </summary>
+				HistogramSnapshot CompletionLatency;
+			};
+
+			/// <summary>
+			/// The smallest value that is recorded in a histogram bucket.
+			/// </summary>
+			uint64_t HistogramBucketLowerBound(uint32_t bucket);
+
+			/// <summary>
+			/// The value below which the given percentage of a histogram's values lie, to within the
+			/// width of a bucket.
+			/// </summary>
+			/// <param name="buckets">
+			/// The histogram's HistogramBucketCount buckets.
+			/// </param>
+			/// <param name="count">
+			/// The number of values in the buckets.
+			/// </param>
+			/// <param name="maximum">
+			/// The largest value recorded.
+			/// </param>
+			/// <param name="percentile">
+			/// The percentile, in the range [0, 100].
+			/// </param>
+			/// <returns>
+			/// The highest value in the bucket the percentile falls in, or the largest value
+			/// recorded if that is lower. Zero if the histogram is empty.
+			/// </returns>
+			uint64_t HistogramPercentile(const uint64_t* buckets, uint64_t count, uint64_t maximum, double percentile);
+
+			/// <summary>
+			/// Per handle I/O counters and latency histograms. Recording is lock free. Counters are
+			/// kept in per thread stripes: each of the first threads to record gets a stripe of its
+			/// own in every Statistics object, which it bumps with plain stores, and any further
+			/// threads share an extra stripe bumped atomically. A stripe goes back to the pool when
+			/// its thread exits. Stripes are only summed up when a snapshot is taken, and nothing is
+			/// done on the reading side until then.
+			/// 
+			/// Receive to reinject latency is tracked by address: a received packet's address is
+			/// stamped in a small open addressed table, and the stamp is taken back when a packet is
+			/// sent with the same address, as it is when a packet is reinjected as received. Colliding
+			/// addresses probe a few slots further, and a stamp is only given up, unmeasured, when a
+			/// burst of pending packets fills all of its slots.
+			/// 
+			/// Objects are reference counted, so that an overlapped operation can record its
+			/// completion after the owning handle has been closed.
+			/// </summary>
+			class Statistics
+			{
+
+			public:
+
+				/// <summary>
+				/// Creates a Statistics object with a reference count of one.
+				/// </summary>
+				Statistics();
+
+				/// <summary>
+				/// Takes another reference.
+				/// </summary>
+				void AddReference();
+
+				/// <summary>
+				/// Drops a reference, destroying the object when it was the last one.
+				/// </summary>
+				void Release();
+
+				/// <summary>
+				/// The clock latencies are measured with, in nanoseconds from an arbitrary start.
+				/// </summary>
+				static uint64_t Now();
+
+				/// <summary>
+				/// Records a batch of received packets and stamps their addresses.
+				/// </summary>
+				/// <param name="addresses">
+				/// The address of each packet. Entries may be null.
+				/// </param>
+				/// <param name="count">
+				/// The number of packets.
+				/// </param>
+				/// <param name="bytes">
+				/// The total length of the packets.
+				/// </param>
+				void RecordReceived(const PWINDIVERT_ADDRESS* addresses, uint32_t count, uint64_t bytes);
+
+				/// <summary>
+				/// Records a single received packet.
+				/// </summary>
+				void RecordReceived(PWINDIVERT_ADDRESS address, uint32_t length);
+
+				/// <summary>
+				/// Records a batch of sent packets, and the time since each of their addresses was
+				/// stamped by a receive.
+				/// </summary>
+				/// <param name="addresses">
+				/// The address of each packet. Entries may be null.
+				/// </param>
+				/// <param name="results">
+				/// The result of each send, zero for success, or null if they all succeeded. Failed
+				/// sends are counted as errors.
+				/// </param>
+				/// <param name="lengths">
+				/// The length of each packet.
+				/// </param>
+				/// <param name="count">
+				/// The number of packets.
+				/// </param>
+				void RecordSent(const PWINDIVERT_ADDRESS* addresses, const int32_t* results, const uint32_t* lengths, uint32_t count);
+
+				/// <summary>
+				/// Records a single sent packet.
+				/// </summary>
+				void RecordSent(PWINDIVERT_ADDRESS address, uint32_t length);
+
+				/// <summary>
+				/// Records a failed receive.
+				/// </summary>
+				void RecordReceiveError(int32_t error);
+
+				/// <summary>
+				/// Records a failed send.
+				/// </summary>
+				void RecordSendError(int32_t error);
+
+				/// <summary>
+				/// Records an overlapped operation going pending.
+				/// </summary>
+				/// <returns>
+				/// Now(), to hand back when the operation completes.
+				/// </returns>
+				uint64_t RecordPending();
+
+				/// <summary>
+				/// Records the completion of a read that went pending, along with the packet read or
+				/// the error it failed with.
+				/// </summary>
+				/// <param name="pendingSince">
+				/// What RecordPending returned.
+				/// </param>
+				/// <param name="address">
+				/// The address the packet was read into.
+				/// </param>
+				/// <param name="length">
+				/// The length of the packet read.
+				/// </param>
+				/// <param name="error">
+				/// Zero if the read succeeded, otherwise the error it failed with.
+				/// </param>
+				/// <returns>
+				/// The time of completion, in Now() terms, for callers that time the read too.
+				/// </returns>
+				uint64_t RecordReceiveCompleted(uint64_t pendingSince, PWINDIVERT_ADDRESS address, uint32_t length, int32_t error);
+
+				/// <summary>
+				/// Records the completion of a send that went pending. See RecordReceiveCompleted.
+				/// </summary>
+				uint64_t RecordSendCompleted(uint64_t pendingSince, PWINDIVERT_ADDRESS address, uint32_t length, int32_t error);
+
+				/// <summary>
+				/// Records the completion of an operation that went pending, without recording a
+				/// packet or an error, for operations that were cancelled on purpose.
+				/// </summary>
+				void RecordCompleted(uint64_t pendingSince);
+
+				/// <summary>
+				/// Copies every counter out.
+				/// </summary>
+				void Snapshot(StatisticsSnapshot* snapshot) const;
+
+			private:
+
+				~Statistics();
+
+				Statistics(const Statistics&) = delete;
+
+				Statistics& operator=(const Statistics&) = delete;
+
+				/// <summary>
+				/// Atomic counters live here, so that this header stays usable from managed code.
+				/// </summary>
+				struct Counters;
+
+				Counters* m_counters;
+
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
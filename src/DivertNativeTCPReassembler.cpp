@@ -0,0 +1,903 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertNativeTCPReassembler.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				const uint32_t DefaultClosingTimeout = 2000;
+
+				/// <summary>
+				/// The data capacities of the segment size classes. The largest holds a full sized
+				/// Ethernet segment, anything longer is split across several segments so that a
+				/// long segment never ties up much more memory than it needs.
+				/// </summary>
+				const uint32_t SegmentClasses[] = { 128, 512, 1536 };
+
+				const uint32_t SegmentClassCount = sizeof(SegmentClasses) / sizeof(SegmentClasses[0]);
+
+				const uint32_t MaximumSegmentData = SegmentClasses[SegmentClassCount - 1];
+
+				/// <summary>
+				/// Segments are carved from slabs of this size, which are only given back when the
+				/// reassembler is destroyed.
+				/// </summary>
+				const size_t SlabSize = 64 * 1024;
+
+				/// <summary>
+				/// A buffered run of stream data, followed in memory by the data itself. Segments of
+				/// a stream never overlap, and form a treap ordered by Start, with MaxEnd kept for
+				/// every subtree so that the segments overlapping a range are found without
+				/// visiting the rest. Free segments are linked through Left.
+				/// </summary>
+				struct Segment
+				{
+					Segment* Left;
+
+					Segment* Right;
+
+					uint64_t Start;
+
+					uint64_t End;
+
+					uint64_t MaxEnd;
+
+					uint32_t Priority;
+
+					uint32_t Class;
+
+					uint8_t* Data()
+					{
+						return reinterpret_cast<uint8_t*>(this + 1);
+					}
+				};
+
+				const uint8_t StreamHasBase = 0x01;
+
+				const uint8_t StreamHasFin = 0x02;
+
+				const uint8_t StreamFinished = 0x04;
+
+				const uint8_t StreamReset = 0x08;
+
+				/// <summary>
+				/// One direction of a flow. Offsets count from the first byte after the SYN, or from
+				/// the first segment seen. Everything between ReadOffset and ContiguousEnd has
+				/// arrived, segments past ContiguousEnd are waiting for a gap to be filled.
+				/// </summary>
+				struct Stream
+				{
+					Segment* Root;
+
+					uint64_t ReadOffset;
+
+					uint64_t ContiguousEnd;
+
+					uint64_t FinOffset;
+
+					uint32_t BaseSequence;
+
+					uint8_t Flags;
+				};
+
+				struct FlowStreams
+				{
+					Stream Directions[2];
+
+					/// <summary>
+					/// The bytes of segments both streams hold.
+					/// </summary>
+					uint32_t Memory;
+				};
+
+				/// <summary>
+				/// A range of a pushed segment that isn't covered by buffered data yet.
+				/// </summary>
+				struct Hole
+				{
+					uint64_t Start;
+
+					uint64_t End;
+				};
+
+				inline size_t BlockSize(uint32_t segmentClass)
+				{
+					return sizeof(Segment) + SegmentClasses[segmentClass];
+				}
+
+				inline uint32_t ClassFor(uint32_t length)
+				{
+					uint32_t segmentClass = 0;
+
+					while (SegmentClasses[segmentClass] < length)
+					{
+						++segmentClass;
+					}
+
+					return segmentClass;
+				}
+
+				inline void Update(Segment* node)
+				{
+					uint64_t maxEnd = node->End;
+
+					if (node->Left != nullptr && node->Left->MaxEnd > maxEnd)
+					{
+						maxEnd = node->Left->MaxEnd;
+					}
+
+					if (node->Right != nullptr && node->Right->MaxEnd > maxEnd)
+					{
+						maxEnd = node->Right->MaxEnd;
+					}
+
+					node->MaxEnd = maxEnd;
+				}
+
+				/// <summary>
+				/// Splits a treap into the segments starting before start, and the rest.
+				/// </summary>
+				void Split(Segment* root, uint64_t start, Segment*& before, Segment*& after)
+				{
+					if (root == nullptr)
+					{
+						before = nullptr;
+						after = nullptr;
+						return;
+					}
+
+					if (root->Start < start)
+					{
+						Split(root->Right, start, root->Right, after);
+						before = root;
+					}
+					else
+					{
+						Split(root->Left, start, before, root->Left);
+						after = root;
+					}
+
+					Update(root);
+				}
+
+				void Insert(Segment*& root, Segment* node)
+				{
+					if (root == nullptr)
+					{
+						node->Left = nullptr;
+						node->Right = nullptr;
+						node->MaxEnd = node->End;
+						root = node;
+						return;
+					}
+
+					if (node->Priority > root->Priority)
+					{
+						Split(root, node->Start, node->Left, node->Right);
+						Update(node);
+						root = node;
+						return;
+					}
+
+					Insert(node->Start < root->Start ? root->Left : root->Right, node);
+					Update(root);
+				}
+
+				Segment* RemoveFirst(Segment*& root)
+				{
+					if (root->Left == nullptr)
+					{
+						Segment* first = root;
+						root = root->Right;
+						return first;
+					}
+
+					Segment* first = RemoveFirst(root->Left);
+					Update(root);
+					return first;
+				}
+
+				Segment* First(Segment* root)
+				{
+					while (root != nullptr && root->Left != nullptr)
+					{
+						root = root->Left;
+					}
+
+					return root;
+				}
+
+				Segment* FindStart(Segment* root, uint64_t start)
+				{
+					while (root != nullptr && root->Start != start)
+					{
+						root = start < root->Start ? root->Left : root->Right;
+					}
+
+					return root;
+				}
+
+				/// <summary>
+				/// Calls visit, in order, for every segment overlapping [start, end), until it
+				/// returns false.
+				/// </summary>
+				template<typename Visitor>
+				bool VisitOverlapping(Segment* root, uint64_t start, uint64_t end, Visitor& visit)
+				{
+					if (root == nullptr || root->MaxEnd <= start)
+					{
+						return true;
+					}
+
+					if (!VisitOverlapping(root->Left, start, end, visit))
+					{
+						return false;
+					}
+
+					if (root->Start >= end)
+					{
+						return true;
+					}
+
+					if (root->End > start && !visit(root))
+					{
+						return false;
+					}
+
+					return VisitOverlapping(root->Right, start, end, visit);
+				}
+			}
+
+			struct TCPReassembler::State
+			{
+				std::unique_ptr<FlowTable> Flows;
+
+				std::unique_ptr<FlowStreams[]> Streams;
+
+				uint32_t FlowMemoryLimit = 0;
+
+				uint64_t MemoryLimit = 0;
+
+				Segment* FreeSegments[SegmentClassCount] = {};
+
+				std::vector<std::unique_ptr<uint8_t[]>> Slabs;
+
+				uint32_t PriorityState = 0x9E3779B9;
+
+				std::vector<Hole> Holes;
+
+				/// <summary>
+				/// The part of the last pushed payload that was handed out without being copied.
+				/// Start lies PayloadOffset bytes into Payload.
+				/// </summary>
+				struct
+				{
+					bool Active;
+
+					uint32_t Stream;
+
+					uint64_t Start;
+
+					uint64_t End;
+
+					const uint8_t* Payload;
+
+					uint32_t PayloadOffset;
+				} Borrow = {};
+
+				StreamEndedCallback Callback = nullptr;
+
+				void* Context = nullptr;
+
+				TCPReassemblyStatistics Statistics = TCPReassemblyStatistics();
+
+				Stream& StreamAt(uint32_t stream) const
+				{
+					return Streams[FlowOf(stream)].Directions[stream & 1];
+				}
+
+				uint32_t NextPriority()
+				{
+					// xorshift32, good enough to keep the treaps balanced.
+					PriorityState ^= PriorityState << 13;
+					PriorityState ^= PriorityState >> 17;
+					PriorityState ^= PriorityState << 5;
+					return PriorityState;
+				}
+
+				bool Fits(const FlowStreams& flow, uint32_t segmentClass) const
+				{
+					const size_t size = BlockSize(segmentClass);
+
+					return flow.Memory + size <= FlowMemoryLimit && Statistics.MemoryUsed + size <= MemoryLimit;
+				}
+
+				Segment* Allocate(FlowStreams& flow, uint32_t segmentClass)
+				{
+					if (FreeSegments[segmentClass] == nullptr)
+					{
+						const size_t blockSize = BlockSize(segmentClass);
+						const size_t blocks = SlabSize / blockSize;
+
+						std::unique_ptr<uint8_t[]> slab(new uint8_t[blocks * blockSize]);
+
+						for (size_t i = 0; i < blocks; ++i)
+						{
+							Segment* segment = reinterpret_cast<Segment*>(slab.get() + i * blockSize);
+							segment->Left = FreeSegments[segmentClass];
+							FreeSegments[segmentClass] = segment;
+						}
+
+						Slabs.push_back(std::move(slab));
+						Statistics.MemoryReserved += blocks * blockSize;
+					}
+
+					Segment* segment = FreeSegments[segmentClass];
+					FreeSegments[segmentClass] = segment->Left;
+
+					segment->Class = segmentClass;
+					segment->Priority = NextPriority();
+
+					flow.Memory += static_cast<uint32_t>(BlockSize(segmentClass));
+					Statistics.MemoryUsed += BlockSize(segmentClass);
+
+					return segment;
+				}
+
+				void Free(FlowStreams& flow, Segment* segment)
+				{
+					flow.Memory -= static_cast<uint32_t>(BlockSize(segment->Class));
+					Statistics.MemoryUsed -= BlockSize(segment->Class);
+
+					segment->Left = FreeSegments[segment->Class];
+					FreeSegments[segment->Class] = segment;
+				}
+
+				void FreeAll(FlowStreams& flow, Segment* root)
+				{
+					if (root != nullptr)
+					{
+						FreeAll(flow, root->Left);
+						FreeAll(flow, root->Right);
+						Free(flow, root);
+					}
+				}
+
+				/// <summary>
+				/// Copies data into as many segments as it takes and adds them to a stream.
+				/// </summary>
+				/// <param name="enforceLimits">
+				/// False for data that has already been handed out as readable, and so can't be
+				/// dropped any more.
+				/// </param>
+				/// <returns>
+				/// The number of bytes that didn't fit.
+				/// </returns>
+				uint64_t Store(FlowStreams& flow, Stream& stream, const uint8_t* data, uint64_t start, uint64_t end, bool enforceLimits)
+				{
+					while (start < end)
+					{
+						const uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(end - start, MaximumSegmentData));
+						const uint32_t segmentClass = ClassFor(length);
+
+						if (enforceLimits && !Fits(flow, segmentClass))
+						{
+							return end - start;
+						}
+
+						Segment* segment = Allocate(flow, segmentClass);
+						segment->Start = start;
+						segment->End = start + length;
+						std::memcpy(segment->Data(), data, length);
+
+						Insert(stream.Root, segment);
+
+						data += length;
+						start += length;
+					}
+
+					return 0;
+				}
+
+				/// <summary>
+				/// Moves ContiguousEnd past every buffered segment that now follows on.
+				/// </summary>
+				void Advance(Stream& stream)
+				{
+					Segment* next = nullptr;
+
+					while ((next = FindStart(stream.Root, stream.ContiguousEnd)) != nullptr)
+					{
+						stream.ContiguousEnd = next->End;
+					}
+				}
+
+				void RetainBorrow(const uint8_t* payload)
+				{
+					if (!Borrow.Active)
+					{
+						return;
+					}
+
+					Borrow.Active = false;
+
+					FlowStreams& flow = Streams[FlowOf(Borrow.Stream)];
+					Stream& stream = flow.Directions[Borrow.Stream & 1];
+
+					if (stream.ReadOffset >= Borrow.End)
+					{
+						return;
+					}
+
+					const uint64_t from = std::max(stream.ReadOffset, Borrow.Start);
+
+					Store(flow, stream, payload + Borrow.PayloadOffset + (from - Borrow.Start), from, Borrow.End, false);
+					++Statistics.Retained;
+				}
+
+				static void OnFlowEnded(void* context, uint32_t flow, const FlowKey& key, uint64_t* userSlots, FlowEnd reason)
+				{
+					State* state = static_cast<State*>(context);
+					(void)userSlots;
+
+					if (state->Callback != nullptr)
+					{
+						state->Callback(state->Context, flow, key, reason);
+					}
+
+					FlowStreams& streams = state->Streams[flow];
+
+					for (Stream& stream : streams.Directions)
+					{
+						state->FreeAll(streams, stream.Root);
+					}
+
+					if (state->Borrow.Active && FlowOf(state->Borrow.Stream) == flow)
+					{
+						state->Borrow.Active = false;
+					}
+
+					streams = FlowStreams();
+				}
+			};
+
+			TCPReassembler::TCPReassembler(uint32_t maximumFlows, uint32_t flowMemoryLimit, uint64_t memoryLimit, uint32_t idleTimeoutInMilliseconds) : m_state(new State())
+			{
+				m_state->Flows.reset(new FlowTable(maximumFlows, 0, idleTimeoutInMilliseconds, DefaultClosingTimeout));
+				m_state->Streams.reset(new FlowStreams[maximumFlows]());
+				m_state->FlowMemoryLimit = flowMemoryLimit;
+				m_state->MemoryLimit = memoryLimit;
+
+				m_state->Flows->SetFlowEndedCallback(&State::OnFlowEnded, m_state);
+			}
+
+			TCPReassembler::~TCPReassembler()
+			{
+				// Flows first, their segments go back to the slabs before the slabs go.
+				m_state->Flows.reset();
+
+				delete m_state;
+			}
+
+			TCPSegmentResult TCPReassembler::Push(const FlowKey& key, bool outbound, uint32_t sequence, uint8_t tcpFlags, const uint8_t* payload, uint32_t length, uint64_t now)
+			{
+				State& state = *m_state;
+
+				state.RetainBorrow(state.Borrow.Payload);
+
+				TCPSegmentResult result = { InvalidStream, 0 };
+
+				bool created = false;
+				const uint32_t flow = state.Flows->Track(key, tcpFlags, outbound, now, &created);
+
+				if (flow == FlowTable::InvalidFlow)
+				{
+					return result;
+				}
+
+				result.Stream = flow * 2 + (outbound ? 0 : 1);
+				result.Status = created ? StatusNewFlow : 0;
+
+				FlowStreams& streams = state.Streams[flow];
+				Stream& stream = streams.Directions[result.Stream & 1];
+
+				if ((tcpFlags & FlowTable::TcpRst) != 0)
+				{
+					streams.Directions[0].Flags |= StreamReset;
+					streams.Directions[1].Flags |= StreamReset;
+					result.Status |= StatusReset;
+					return result;
+				}
+
+				// The SYN takes up the sequence number before the first byte of data.
+				uint32_t dataSequence = sequence;
+
+				if ((tcpFlags & FlowTable::TcpSyn) != 0)
+				{
+					++dataSequence;
+
+					if ((stream.Flags & StreamHasBase) == 0)
+					{
+						stream.BaseSequence = dataSequence;
+						stream.Flags |= StreamHasBase;
+					}
+				}
+
+				if (length == 0 && (tcpFlags & FlowTable::TcpFin) == 0)
+				{
+					return result;
+				}
+
+				++state.Statistics.Segments;
+
+				if ((stream.Flags & StreamHasBase) == 0)
+				{
+					// The handshake was missed, the stream starts here.
+					stream.BaseSequence = dataSequence;
+					stream.Flags |= StreamHasBase;
+				}
+
+				// Sequence numbers wrap, offsets don't. Place the segment relative to the read
+				// position, which is never more than a window away from anything current.
+				const int64_t relative = static_cast<int32_t>(dataSequence - (stream.BaseSequence + static_cast<uint32_t>(stream.ReadOffset)));
+
+				if (relative > static_cast<int64_t>(MaximumWindow))
+				{
+					++state.Statistics.OutOfWindow;
+					result.Status |= StatusOutOfWindow;
+					return result;
+				}
+
+				const int64_t signedStart = static_cast<int64_t>(stream.ReadOffset) + relative;
+				const int64_t signedEnd = signedStart + length;
+
+				if ((tcpFlags & FlowTable::TcpFin) != 0 && (stream.Flags & StreamHasFin) == 0 && signedEnd >= static_cast<int64_t>(stream.ContiguousEnd))
+				{
+					stream.FinOffset = static_cast<uint64_t>(signedEnd);
+					stream.Flags |= StreamHasFin;
+				}
+
+				uint64_t end = signedEnd > 0 ? static_cast<uint64_t>(signedEnd) : 0;
+
+				if ((stream.Flags & StreamHasFin) != 0 && end > stream.FinOffset)
+				{
+					end = stream.FinOffset;
+				}
+
+				// Everything before ContiguousEnd has arrived already.
+				const uint64_t start = signedStart > 0 ? static_cast<uint64_t>(signedStart) : 0;
+				const uint64_t from = std::max(start, stream.ContiguousEnd);
+
+				if (from < end)
+				{
+					// Keep what arrived first: only the holes between buffered segments are taken.
+					state.Holes.clear();
+
+					uint64_t cursor = from;
+
+					auto findHoles = [&state, &cursor](Segment* segment)
+					{
+						if (segment->Start > cursor)
+						{
+							state.Holes.push_back({ cursor, segment->Start });
+						}
+
+						cursor = std::max(cursor, segment->End);
+						return true;
+					};
+
+					VisitOverlapping(stream.Root, from, end, findHoles);
+
+					if (cursor < end)
+					{
+						state.Holes.push_back({ cursor, end });
+					}
+
+					const uint64_t contiguousEnd = stream.ContiguousEnd;
+					uint64_t dropped = 0;
+					bool stored = false;
+
+					for (const Hole& hole : state.Holes)
+					{
+						const uint8_t* data = payload + static_cast<size_t>(hole.Start - static_cast<uint64_t>(signedStart));
+
+						if (hole.Start == stream.ContiguousEnd && stream.ReadOffset == stream.ContiguousEnd && !state.Borrow.Active)
+						{
+							state.Borrow.Active = true;
+							state.Borrow.Stream = result.Stream;
+							state.Borrow.Start = hole.Start;
+							state.Borrow.End = hole.End;
+							state.Borrow.Payload = payload;
+							state.Borrow.PayloadOffset = static_cast<uint32_t>(data - payload);
+
+							stream.ContiguousEnd = hole.End;
+							++state.Statistics.Borrowed;
+							continue;
+						}
+
+						const uint64_t holeDropped = state.Store(streams, stream, data, hole.Start, hole.End, true);
+
+						stored = stored || holeDropped < hole.End - hole.Start;
+						dropped += holeDropped;
+					}
+
+					state.Advance(stream);
+
+					if (dropped != 0)
+					{
+						state.Statistics.DroppedBytes += dropped;
+						result.Status |= StatusOverLimit;
+					}
+
+					if (stream.ContiguousEnd > contiguousEnd)
+					{
+						result.Status |= StatusData;
+					}
+					else if (stored)
+					{
+						++state.Statistics.OutOfOrder;
+						result.Status |= StatusOutOfOrder;
+					}
+					else if (state.Holes.empty())
+					{
+						++state.Statistics.Duplicates;
+						result.Status |= StatusDuplicate;
+					}
+				}
+				else if (length != 0)
+				{
+					++state.Statistics.Duplicates;
+					result.Status |= StatusDuplicate;
+				}
+
+				if ((stream.Flags & (StreamHasFin | StreamFinished)) == StreamHasFin && stream.ContiguousEnd >= stream.FinOffset)
+				{
+					stream.Flags |= StreamFinished;
+					result.Status |= StatusFinished;
+				}
+
+				return result;
+			}
+
+			uint32_t TCPReassembler::Peek(uint32_t stream, TCPStreamChunk* chunks, uint32_t maximumChunks) const
+			{
+				const State& state = *m_state;
+				const Stream& current = state.StreamAt(stream);
+
+				uint32_t count = 0;
+				uint64_t position = current.ReadOffset;
+
+				if (maximumChunks == 0 || position >= current.ContiguousEnd)
+				{
+					return 0;
+				}
+
+				if (state.Borrow.Active && state.Borrow.Stream == stream && position < state.Borrow.End)
+				{
+					const uint32_t skip = static_cast<uint32_t>(position - state.Borrow.Start);
+
+					chunks[count].Data = state.Borrow.Payload + state.Borrow.PayloadOffset + skip;
+					chunks[count].Length = static_cast<uint32_t>(state.Borrow.End - position);
+					chunks[count].Borrowed = true;
+					chunks[count].PayloadOffset = state.Borrow.PayloadOffset + skip;
+					++count;
+
+					position = state.Borrow.End;
+				}
+
+				auto collect = [chunks, maximumChunks, &count, &position](Segment* segment)
+				{
+					if (count == maximumChunks)
+					{
+						return false;
+					}
+
+					const uint32_t skip = static_cast<uint32_t>(position - segment->Start);
+
+					chunks[count].Data = segment->Data() + skip;
+					chunks[count].Length = static_cast<uint32_t>(segment->End - position);
+					chunks[count].Borrowed = false;
+					chunks[count].PayloadOffset = 0;
+					++count;
+
+					position = segment->End;
+					return true;
+				};
+
+				VisitOverlapping(current.Root, position, current.ContiguousEnd, collect);
+
+				return count;
+			}
+
+			uint32_t TCPReassembler::Available(uint32_t stream) const
+			{
+				const Stream& current = m_state->StreamAt(stream);
+
+				return static_cast<uint32_t>(current.ContiguousEnd - current.ReadOffset);
+			}
+
+			uint32_t TCPReassembler::Consume(uint32_t stream, uint32_t length)
+			{
+				State& state = *m_state;
+				FlowStreams& streams = state.Streams[FlowOf(stream)];
+				Stream& current = streams.Directions[stream & 1];
+
+				length = std::min(length, static_cast<uint32_t>(current.ContiguousEnd - current.ReadOffset));
+				current.ReadOffset += length;
+
+				Segment* first = nullptr;
+
+				while ((first = First(current.Root)) != nullptr && first->End <= current.ReadOffset)
+				{
+					state.Free(streams, RemoveFirst(current.Root));
+				}
+
+				if (state.Borrow.Active && state.Borrow.Stream == stream && current.ReadOffset >= state.Borrow.End)
+				{
+					state.Borrow.Active = false;
+				}
+
+				return length;
+			}
+
+			uint32_t TCPReassembler::SkipGap(uint32_t stream)
+			{
+				State& state = *m_state;
+				Stream& current = state.StreamAt(stream);
+				Segment* first = First(current.Root);
+
+				if (current.ReadOffset != current.ContiguousEnd)
+				{
+					return 0;
+				}
+
+				// Past the last buffered segment, the only gap left to skip is the one before the FIN.
+				uint64_t next = current.ContiguousEnd;
+
+				if (first != nullptr)
+				{
+					next = first->Start;
+				}
+				else if ((current.Flags & StreamHasFin) != 0 && current.FinOffset > next)
+				{
+					next = current.FinOffset;
+				}
+
+				const uint32_t skipped = static_cast<uint32_t>(next - current.ContiguousEnd);
+
+				current.ReadOffset = next;
+				current.ContiguousEnd = next;
+				state.Advance(current);
+
+				state.Statistics.SkippedBytes += skipped;
+
+				if ((current.Flags & (StreamHasFin | StreamFinished)) == StreamHasFin && current.ContiguousEnd >= current.FinOffset)
+				{
+					current.Flags |= StreamFinished;
+				}
+
+				return skipped;
+			}
+
+			void TCPReassembler::Retain()
+			{
+				m_state->RetainBorrow(m_state->Borrow.Payload);
+			}
+
+			void TCPReassembler::Retain(const uint8_t* payload)
+			{
+				m_state->RetainBorrow(payload);
+			}
+
+			uint64_t TCPReassembler::Position(uint32_t stream) const
+			{
+				return m_state->StreamAt(stream).ReadOffset;
+			}
+
+			bool TCPReassembler::IsFinished(uint32_t stream) const
+			{
+				return (m_state->StreamAt(stream).Flags & StreamFinished) != 0;
+			}
+
+			bool TCPReassembler::IsReset(uint32_t stream) const
+			{
+				return (m_state->StreamAt(stream).Flags & StreamReset) != 0;
+			}
+
+			uint32_t TCPReassembler::Expire(uint64_t now, uint32_t limit)
+			{
+				Retain();
+
+				return m_state->Flows->Expire(now, limit);
+			}
+
+			void TCPReassembler::Clear()
+			{
+				m_state->Borrow.Active = false;
+				m_state->Flows->Clear();
+			}
+
+			const FlowTable& TCPReassembler::Flows() const
+			{
+				return *m_state->Flows;
+			}
+
+			void TCPReassembler::SetStreamEndedCallback(StreamEndedCallback callback, void* context)
+			{
+				m_state->Callback = callback;
+				m_state->Context = context;
+			}
+
+			uint32_t TCPReassembler::FlowMemoryLimit() const
+			{
+				return m_state->FlowMemoryLimit;
+			}
+
+			void TCPReassembler::SetFlowMemoryLimit(uint32_t flowMemoryLimit)
+			{
+				m_state->FlowMemoryLimit = flowMemoryLimit;
+			}
+
+			uint64_t TCPReassembler::MemoryLimit() const
+			{
+				return m_state->MemoryLimit;
+			}
+
+			void TCPReassembler::SetMemoryLimit(uint64_t memoryLimit)
+			{
+				m_state->MemoryLimit = memoryLimit;
+			}
+
+			TCPReassemblyStatistics TCPReassembler::Statistics() const
+			{
+				TCPReassemblyStatistics statistics = m_state->Statistics;
+				statistics.Flows = m_state->Flows->Count();
+				return statistics;
+			}
+
+			void TCPReassembler::ResetStatistics()
+			{
+				TCPReassemblyStatistics& statistics = m_state->Statistics;
+				const uint64_t memoryUsed = statistics.MemoryUsed;
+				const uint64_t memoryReserved = statistics.MemoryReserved;
+
+				statistics = TCPReassemblyStatistics();
+				statistics.MemoryUsed = memoryUsed;
+				statistics.MemoryReserved = memoryReserved;
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,397 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include "DivertConnectionTable.hpp"
+#include "DivertNativeFlowTable.hpp"
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			/// <summary>
+			/// A run of contiguous stream data, as handed out by TCPReassembler::Peek().
+			/// </summary>
+			struct TCPStreamChunk
+			{
+				const uint8_t* Data;
+
+				uint32_t Length;
+
+				/// <summary>
+				/// Set when the data was never copied and still lives in the payload passed to the
+				/// last call to TCPReassembler::Push(), at PayloadOffset. Such a chunk is only valid
+				/// until the next call that changes the reassembler.
+				/// </summary>
+				bool Borrowed;
+
+				uint32_t PayloadOffset;
+			};
+
+			/// <summary>
+			/// What TCPReassembler::Push() did with a segment.
+			/// </summary>
+			struct TCPSegmentResult
+			{
+				/// <summary>
+				/// The stream the segment belongs to, or TCPReassembler::InvalidStream for a RST
+				/// that doesn't belong to any flow.
+				/// </summary>
+				uint32_t Stream;
+
+				/// <summary>
+				/// Any combination of the TCPReassembler status flags.
+				/// </summary>
+				uint32_t Status;
+			};
+
+			/// <summary>
+			/// Counters describing the segments a TCPReassembler has seen.
+			/// </summary>
+			struct TCPReassemblyStatistics
+			{
+				/// <summary>
+				/// Segments pushed that carried data or a FIN.
+				/// </summary>
+				uint64_t Segments;
+
+				/// <summary>
+				/// Segments that arrived in order, with nothing left unread in their stream, and
+				/// were handed out straight from the caller's buffer.
+				/// </summary>
+				uint64_t Borrowed;
+
+				/// <summary>
+				/// Borrowed segments that hadn't been read by the next call, and were copied.
+				/// </summary>
+				uint64_t Retained;
+
+				/// <summary>
+				/// Segments buffered ahead of a gap.
+				/// </summary>
+				uint64_t OutOfOrder;
+
+				/// <summary>
+				/// Segments that carried nothing that hadn't already been seen.
+				/// </summary>
+				uint64_t Duplicates;
+
+				/// <summary>
+				/// Segments starting more than TCPReassembler::MaximumWindow past the read position
+				/// of their stream, which were dropped.
+				/// </summary>
+				uint64_t OutOfWindow;
+
+				/// <summary>
+				/// Bytes that were not buffered because the flow or the reassembler was at its
+				/// memory limit.
+				/// </summary>
+				uint64_t DroppedBytes;
+
+				/// <summary>
+				/// Bytes given up on through TCPReassembler::SkipGap().
+				/// </summary>
+				uint64_t SkippedBytes;
+
+				/// <summary>
+				/// Bytes taken by buffered segments, headers included.
+				/// </summary>
+				uint64_t MemoryUsed;
+
+				/// <summary>
+				/// Bytes taken from the system for segments, in use or not.
+				/// </summary>
+				uint64_t MemoryReserved;
+
+				/// <summary>
+				/// The number of flows currently tracked.
+				/// </summary>
+				uint32_t Flows;
+			};
+
+			/// <summary>
+			/// Puts the payloads of TCP segments back in sequence order, so that the bytes each end
+			/// of a connection sent can be read as a stream, whatever order the segments arrived in
+			/// and however often they were retransmitted.
+			/// 
+			/// Flows are kept in a FlowTable, and each has two streams: the data sent from this
+			/// machine and the data sent to it. Stream numbers are the flow number times two, plus
+			/// one for the inbound direction. Data is placed by sequence number relative to the SYN,
+			/// or to the first segment seen when the handshake was missed. Where segments overlap,
+			/// the bytes that arrived first are kept.
+			/// 
+			/// A segment that arrives in order while nothing of its stream is waiting to be read is
+			/// not copied at all, Peek() hands out the caller's own buffer. Whatever of it is still
+			/// unread when the reassembler is next changed is copied then. Every other segment is
+			/// copied into segments carved from slabs, kept in an interval tree per stream ordered
+			/// by stream offset. Buffered memory is capped per flow and in total. A segment that
+			/// would go over either limit is dropped, and the gap it leaves can be given up on with
+			/// SkipGap().
+			/// 
+			/// Not safe for concurrent use. Give each receive thread a reassembler of its own, or
+			/// split flows across reassemblers by FlowKey::Hash().
+			/// </summary>
+			class TCPReassembler
+			{
+
+			public:
+
+				/// <summary>
+				/// Returned in place of a stream number when there's no stream.
+				/// </summary>
+				static const uint32_t InvalidStream = 0xFFFFFFFF;
+
+				/// <summary>
+				/// The segment made more data readable.
+				/// </summary>
+				static const uint32_t StatusData = 0x01;
+
+				/// <summary>
+				/// The segment was buffered ahead of a gap.
+				/// </summary>
+				static const uint32_t StatusOutOfOrder = 0x02;
+
+				/// <summary>
+				/// The segment carried nothing new.
+				/// </summary>
+				static const uint32_t StatusDuplicate = 0x04;
+
+				/// <summary>
+				/// Some or all of the segment was dropped to stay within the memory limits.
+				/// </summary>
+				static const uint32_t StatusOverLimit = 0x08;
+
+				/// <summary>
+				/// Everything up to the stream's FIN has arrived. Reported once per stream.
+				/// </summary>
+				static const uint32_t StatusFinished = 0x10;
+
+				/// <summary>
+				/// The segment was a RST. Both streams can still be read until the next call that
+				/// changes the reassembler, which ends the flow.
+				/// </summary>
+				static const uint32_t StatusReset = 0x20;
+
+				/// <summary>
+				/// The flow was created for this segment.
+				/// </summary>
+				static const uint32_t StatusNewFlow = 0x40;
+
+				/// <summary>
+				/// The segment started too far ahead of the stream to be believed, and was dropped.
+				/// </summary>
+				static const uint32_t StatusOutOfWindow = 0x80;
+
+				/// <summary>
+				/// How far past the read position of a stream a segment may start. A quarter of the
+				/// sequence space, so that old retransmissions can't be mistaken for new data.
+				/// </summary>
+				static const uint32_t MaximumWindow = 0x40000000;
+
+				/// <summary>
+				/// Called for every flow that ends, before its buffered data is released, so that
+				/// whatever is left in its streams can still be read.
+				/// </summary>
+				typedef void(*StreamEndedCallback)(void* context, uint32_t flow, const FlowKey& key, FlowEnd reason);
+
+				/// <summary>
+				/// Constructs a reassembler.
+				/// </summary>
+				/// <param name="maximumFlows">
+				/// The most flows tracked at once. Must be between one and FlowTable::MaximumCapacity.
+				/// </param>
+				/// <param name="flowMemoryLimit">
+				/// The most bytes of buffered segments a flow may hold, both directions together.
+				/// </param>
+				/// <param name="memoryLimit">
+				/// The most bytes of buffered segments all flows together may hold.
+				/// </param>
+				/// <param name="idleTimeoutInMilliseconds">
+				/// How long a flow may go without a segment before it's ended.
+				/// </param>
+				TCPReassembler(uint32_t maximumFlows, uint32_t flowMemoryLimit, uint64_t memoryLimit, uint32_t idleTimeoutInMilliseconds);
+
+				/// <summary>
+				/// Ends every remaining flow with FlowEnd::Removed, and releases all memory.
+				/// </summary>
+				~TCPReassembler();
+
+				/// <summary>
+				/// Adds one TCP segment to its stream.
+				/// </summary>
+				/// <param name="key">
+				/// The segment's flow.
+				/// </param>
+				/// <param name="outbound">
+				/// Whether the segment was sent from this machine.
+				/// </param>
+				/// <param name="sequence">
+				/// The sequence number, in Host Byte Order.
+				/// </param>
+				/// <param name="tcpFlags">
+				/// Any combination of FlowTable::TcpFin, FlowTable::TcpSyn and FlowTable::TcpRst.
+				/// </param>
+				/// <param name="payload">
+				/// The data the segment carries. Must stay where it is, unchanged, until the next
+				/// call that changes the reassembler, or until Retain() is called.
+				/// </param>
+				/// <param name="length">
+				/// The length of the payload.
+				/// </param>
+				/// <param name="now">
+				/// The current time in milliseconds, from FlowTable::NowInMilliseconds().
+				/// </param>
+				TCPSegmentResult Push(const FlowKey& key, bool outbound, uint32_t sequence, uint8_t tcpFlags, const uint8_t* payload, uint32_t length, uint64_t now);
+
+				/// <summary>
+				/// Fills in the contiguous data waiting to be read from a stream, in order.
+				/// </summary>
+				/// <returns>
+				/// The number of chunks filled in.
+				/// </returns>
+				uint32_t Peek(uint32_t stream, TCPStreamChunk* chunks, uint32_t maximumChunks) const;
+
+				/// <summary>
+				/// The number of contiguous bytes waiting to be read from a stream.
+				/// </summary>
+				uint32_t Available(uint32_t stream) const;
+
+				/// <summary>
+				/// Marks bytes at the start of a stream as read, releasing the segments they were in.
+				/// </summary>
+				/// <returns>
+				/// The number of bytes consumed, at most Available().
+				/// </returns>
+				uint32_t Consume(uint32_t stream, uint32_t length);
+
+				/// <summary>
+				/// Gives up on the gap in front of the next buffered segment of a stream, so that
+				/// reading can carry on after it. Does nothing while there is data to read.
+				/// </summary>
+				/// <returns>
+				/// The number of bytes skipped.
+				/// </returns>
+				uint32_t SkipGap(uint32_t stream);
+
+				/// <summary>
+				/// Copies whatever of the last pushed payload is still unread, so the caller's buffer
+				/// can be reused. Called by every method that changes the reassembler.
+				/// </summary>
+				void Retain();
+
+				/// <summary>
+				/// As Retain(), for a caller that has moved the last pushed payload since, such as
+				/// a managed buffer that was unpinned. Copies from where it is now.
+				/// </summary>
+				void Retain(const uint8_t* payload);
+
+				/// <summary>
+				/// The offset of the next byte to be read from a stream, from the start of the
+				/// stream.
+				/// </summary>
+				uint64_t Position(uint32_t stream) const;
+
+				/// <summary>
+				/// Whether everything up to the FIN of a stream has arrived.
+				/// </summary>
+				bool IsFinished(uint32_t stream) const;
+
+				/// <summary>
+				/// Whether a stream's flow has seen a RST.
+				/// </summary>
+				bool IsReset(uint32_t stream) const;
+
+				/// <summary>
+				/// Ends flows that have been idle for too long, see FlowTable::Expire().
+				/// </summary>
+				uint32_t Expire(uint64_t now, uint32_t limit);
+
+				/// <summary>
+				/// Ends every flow with FlowEnd::Removed.
+				/// </summary>
+				void Clear();
+
+				/// <summary>
+				/// The flows, for their keys and generations.
+				/// </summary>
+				const FlowTable& Flows() const;
+
+				/// <summary>
+				/// Sets the function called for every flow that ends. Null to stop being told.
+				/// </summary>
+				void SetStreamEndedCallback(StreamEndedCallback callback, void* context);
+
+				uint32_t FlowMemoryLimit() const;
+
+				void SetFlowMemoryLimit(uint32_t flowMemoryLimit);
+
+				uint64_t MemoryLimit() const;
+
+				void SetMemoryLimit(uint64_t memoryLimit);
+
+				TCPReassemblyStatistics Statistics() const;
+
+				void ResetStatistics();
+
+				static uint32_t FlowOf(uint32_t stream)
+				{
+					return stream >> 1;
+				}
+
+				static bool IsOutbound(uint32_t stream)
+				{
+					return (stream & 1) == 0;
+				}
+
+			private:
+
+				TCPReassembler(const TCPReassembler&) = delete;
+
+				TCPReassembler& operator=(const TCPReassembler&) = delete;
+
+				/// <summary>
+				/// The flows, streams and segment pool live here, so that this header stays usable
+				/// from managed code.
+				/// </summary>
+				struct State;
+
+				State* m_state;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
@@ -0,0 +1,243 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertPacketBatch.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		PacketBatch::PacketBatch(uint32_t capacity, uint32_t maxPacketLength)
+		{
+			System::Exception^ e = nullptr;
+
+			if (capacity == 0 || maxPacketLength == 0)
+			{
+				e = gcnew System::ArgumentException(u8"In PacketBatch::PacketBatch(uint32_t, uint32_t) - Capacity and maximum packet length must both be greater than zero.");
+				throw e;
+			}
+
+			// Every packet in the packed buffer starts on an 8 byte boundary, so size each slot
+			// accordingly or the last few packets of a full batch might not fit.
+			uint64_t slotLength = (static_cast<uint64_t>(maxPacketLength) + 7) & ~static_cast<uint64_t>(7);
+			uint64_t bufferLength = slotLength * capacity;
+
+			if (bufferLength > static_cast<uint64_t>(System::Int32::MaxValue))
+			{
+				e = gcnew System::ArgumentException(u8"In PacketBatch::PacketBatch(uint32_t, uint32_t) - Capacity multiplied by the maximum packet length is too large for a single buffer.");
+				throw e;
+			}
+
+			m_capacity = capacity;
+			m_maxPacketLength = maxPacketLength;
+
+			m_buffer = gcnew array<System::Byte>(static_cast<int>(bufferLength));
+			m_offsets = gcnew array<uint32_t>(capacity);
+			m_lengths = gcnew array<uint32_t>(capacity);
+			m_addresses = gcnew array<Address^>(capacity);
+			m_results = gcnew array<int>(capacity);
+
+			m_addressTable = static_cast<PWINDIVERT_ADDRESS*>(malloc(sizeof(PWINDIVERT_ADDRESS) * capacity));
+
+			if (m_addressTable == nullptr)
+			{
+				e = gcnew System::OutOfMemoryException(u8"In PacketBatch::PacketBatch(uint32_t, uint32_t) - Failed to allocate address table.");
+				throw e;
+			}
+
+			for (uint32_t i = 0; i < capacity; ++i)
+			{
+				m_addresses[i] = gcnew Address();
+				m_addressTable[i] = m_addresses[i]->UnmanagedAddress;
+			}
+
+			m_bufferPin = System::Runtime::InteropServices::GCHandle::Alloc(m_buffer, System::Runtime::InteropServices::GCHandleType::Pinned);
+			m_offsetsPin = System::Runtime::InteropServices::GCHandle::Alloc(m_offsets, System::Runtime::InteropServices::GCHandleType::Pinned);
+			m_lengthsPin = System::Runtime::InteropServices::GCHandle::Alloc(m_lengths, System::Runtime::InteropServices::GCHandleType::Pinned);
+			m_resultsPin = System::Runtime::InteropServices::GCHandle::Alloc(m_results, System::Runtime::InteropServices::GCHandleType::Pinned);
+		}
+
+		PacketBatch::~PacketBatch()
+		{
+			this->!PacketBatch();
+		}
+
+		PacketBatch::!PacketBatch()
+		{
+			if (m_bufferPin.IsAllocated)
+			{
+				m_bufferPin.Free();
+			}
+
+			if (m_offsetsPin.IsAllocated)
+			{
+				m_offsetsPin.Free();
+			}
+
+			if (m_lengthsPin.IsAllocated)
+			{
+				m_lengthsPin.Free();
+			}
+
+			if (m_resultsPin.IsAllocated)
+			{
+				m_resultsPin.Free();
+			}
+
+			if (m_addressTable != nullptr)
+			{
+				free(m_addressTable);
+				m_addressTable = nullptr;
+			}
+		}
+
+		uint32_t PacketBatch::Capacity::get()
+		{
+			return m_capacity;
+		}
+
+		uint32_t PacketBatch::MaxPacketLength::get()
+		{
+			return m_maxPacketLength;
+		}
+
+		uint32_t PacketBatch::Count::get()
+		{
+			return m_count;
+		}
+
+		void PacketBatch::Count::set(uint32_t value)
+		{
+			if (value > m_capacity)
+			{
+				throw gcnew System::ArgumentOutOfRangeException(u8"value", u8"In PacketBatch::Count::set(uint32_t) - Count cannot exceed Capacity.");
+			}
+
+			m_count = value;
+		}
+
+		array<System::Byte>^ PacketBatch::Buffer::get()
+		{
+			return m_buffer;
+		}
+
+		array<uint32_t>^ PacketBatch::Offsets::get()
+		{
+			return m_offsets;
+		}
+
+		array<uint32_t>^ PacketBatch::Lengths::get()
+		{
+			return m_lengths;
+		}
+
+		array<Address^>^ PacketBatch::Addresses::get()
+		{
+			return m_addresses;
+		}
+
+		array<int>^ PacketBatch::Results::get()
+		{
+			return m_results;
+		}
+
+		bool PacketBatch::Add(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address)
+		{
+			System::Exception^ e = nullptr;
+
+			if (packetBuffer == nullptr || address == nullptr || address->UnmanagedAddress == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"In PacketBatch::Add(array<System::Byte>^, uint32_t, Address^) - Supplied packet buffer or address is null.");
+				throw e;
+			}
+
+			if (packetLength == 0 || packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In PacketBatch::Add(array<System::Byte>^, uint32_t, Address^) - Packet length is zero or exceeds the supplied buffer.");
+				throw e;
+			}
+
+			if (m_count == m_capacity)
+			{
+				return false;
+			}
+
+			// Keep the same packing rules that the native side uses when receiving.
+			uint32_t offset = 0;
+
+			if (m_count > 0)
+			{
+				offset = (m_offsets[m_count - 1] + m_lengths[m_count - 1] + 7u) & ~7u;
+			}
+
+			if (static_cast<uint64_t>(offset) + packetLength > static_cast<uint64_t>(m_buffer->Length))
+			{
+				return false;
+			}
+
+			System::Buffer::BlockCopy(packetBuffer, 0, m_buffer, static_cast<int>(offset), static_cast<int>(packetLength));
+			memcpy(m_addressTable[m_count], address->UnmanagedAddress, sizeof(WINDIVERT_ADDRESS));
+
+			m_offsets[m_count] = offset;
+			m_lengths[m_count] = packetLength;
+			m_results[m_count] = 0;
+
+			++m_count;
+
+			return true;
+		}
+
+		void PacketBatch::Clear()
+		{
+			m_count = 0;
+		}
+
+		uint8_t* PacketBatch::UnmanagedBuffer::get()
+		{
+			return static_cast<uint8_t*>(m_bufferPin.AddrOfPinnedObject().ToPointer());
+		}
+
+		uint32_t* PacketBatch::UnmanagedOffsets::get()
+		{
+			return static_cast<uint32_t*>(m_offsetsPin.AddrOfPinnedObject().ToPointer());
+		}
+
+		uint32_t* PacketBatch::UnmanagedLengths::get()
+		{
+			return static_cast<uint32_t*>(m_lengthsPin.AddrOfPinnedObject().ToPointer());
+		}
+
+		int32_t* PacketBatch::UnmanagedResults::get()
+		{
+			return static_cast<int32_t*>(m_resultsPin.AddrOfPinnedObject().ToPointer());
+		}
+
+		PWINDIVERT_ADDRESS* PacketBatch::UnmanagedAddresses::get()
+		{
+			return m_addressTable;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
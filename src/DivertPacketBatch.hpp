@@ -0,0 +1,247 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAddress.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// A reusable container for moving many packets across the managed/native boundary in a
+		/// single call. Packets are stored back to back in one large buffer, and the Offsets,
+		/// Lengths and Addresses tables describe each packet in that buffer. All of the storage
+		/// is allocated and pinned once, when the batch is constructed, so a PacketBatch can be
+		/// filled and drained over and over without any further allocation or pinning.
+		/// </summary>
+		public ref class PacketBatch
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a new batch.
+			/// </summary>
+			/// <param name="capacity">
+			/// The maximum number of packets the batch can hold. Must be greater than zero.
+			/// </param>
+			/// <param name="maxPacketLength">
+			/// The largest packet the batch is expected to hold. The packed buffer is sized so that
+			/// capacity packets of this length are guaranteed to fit. Must be greater than zero.
+			/// </param>
+			PacketBatch(uint32_t capacity, uint32_t maxPacketLength);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~PacketBatch();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!PacketBatch();
+
+			/// <summary>
+			/// The maximum number of packets this batch can hold.
+			/// </summary>
+			property uint32_t Capacity
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The largest packet this batch was sized for.
+			/// </summary>
+			property uint32_t MaxPacketLength
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The number of valid packets currently described by the batch. Set by
+			/// Diversion.ReceiveBatch, or by the user when building a batch by hand. Cannot exceed
+			/// Capacity.
+			/// </summary>
+			property uint32_t Count
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// The packed packet buffer. Packet i occupies Lengths[i] bytes starting at Offsets[i].
+			/// </summary>
+			property array<System::Byte>^ Buffer
+			{
+				array<System::Byte>^ get();
+			}
+
+			/// <summary>
+			/// The offset of each packet within Buffer.
+			/// </summary>
+			property array<uint32_t>^ Offsets
+			{
+				array<uint32_t>^ get();
+			}
+
+			/// <summary>
+			/// The length of each packet within Buffer.
+			/// </summary>
+			property array<uint32_t>^ Lengths
+			{
+				array<uint32_t>^ get();
+			}
+
+			/// <summary>
+			/// The address information for each packet.
+			/// </summary>
+			property array<Address^>^ Addresses
+			{
+				array<Address^>^ get();
+			}
+
+			/// <summary>
+			/// The per-packet result of the last Diversion.SendBatch call. Zero if the packet was
+			/// injected, otherwise the Win32 error code the injection failed with.
+			/// ERROR_INVALID_PARAMETER for a packet that doesn't lie within Buffer, which isn't
+			/// sent at all.
+			/// </summary>
+			property array<int>^ Results
+			{
+				array<int>^ get();
+			}
+
+			/// <summary>
+			/// Appends a copy of the supplied packet and address to the end of the batch. Useful for
+			/// building up a batch to hand to Diversion.SendBatch. Packets received with
+			/// Diversion.ReceiveBatch can be reinjected directly without this.
+			/// </summary>
+			/// <param name="packetBuffer">
+			/// The array containing the packet to append.
+			/// </param>
+			/// <param name="packetLength">
+			/// The length of valid packet data in the supplied array.
+			/// </param>
+			/// <param name="address">
+			/// The address information for the packet.
+			/// </param>
+			/// <returns>
+			/// True if the packet was appended, false if the batch is already full or there is not
+			/// enough space left in the packed buffer.
+			/// </returns>
+			bool Add(array<System::Byte>^ packetBuffer, uint32_t packetLength, Address^ address);
+
+			/// <summary>
+			/// Empties the batch so that it can be refilled with Add(...).
+			/// </summary>
+			void Clear();
+
+		internal:
+
+			/// <summary>
+			/// Pointer to the first byte of the pinned packed buffer.
+			/// </summary>
+			property uint8_t* UnmanagedBuffer
+			{
+				uint8_t* get();
+			}
+
+			/// <summary>
+			/// Pointer to the first element of the pinned offsets table.
+			/// </summary>
+			property uint32_t* UnmanagedOffsets
+			{
+				uint32_t* get();
+			}
+
+			/// <summary>
+			/// Pointer to the first element of the pinned lengths table.
+			/// </summary>
+			property uint32_t* UnmanagedLengths
+			{
+				uint32_t* get();
+			}
+
+			/// <summary>
+			/// Pointer to the first element of the pinned results table.
+			/// </summary>
+			property int32_t* UnmanagedResults
+			{
+				int32_t* get();
+			}
+
+			/// <summary>
+			/// Native table of the PWINDIVERT_ADDRESS held by each of the Addresses, so that native
+			/// code can walk the batch without touching any managed objects.
+			/// </summary>
+			property PWINDIVERT_ADDRESS* UnmanagedAddresses
+			{
+				PWINDIVERT_ADDRESS* get();
+			}
+
+		private:
+
+			uint32_t m_capacity;
+
+			uint32_t m_maxPacketLength;
+
+			uint32_t m_count = 0;
+
+			array<System::Byte>^ m_buffer;
+
+			array<uint32_t>^ m_offsets;
+
+			array<uint32_t>^ m_lengths;
+
+			array<Address^>^ m_addresses;
+
+			array<int>^ m_results;
+
+			/// <summary>
+			/// Pins held for the lifetime of the batch, so that native code can be handed raw
+			/// pointers without pinning on every call.
+			/// </summary>
+			System::Runtime::InteropServices::GCHandle m_bufferPin;
+
+			System::Runtime::InteropServices::GCHandle m_offsetsPin;
+
+			System::Runtime::InteropServices::GCHandle m_lengthsPin;
+
+			System::Runtime::InteropServices::GCHandle m_resultsPin;
+
+			/// <summary>
+			/// Exclusively owned by this object. The addresses pointed to are owned by the
+			/// corresponding Address objects in m_addresses.
+			/// </summary>
+			PWINDIVERT_ADDRESS* m_addressTable = nullptr;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
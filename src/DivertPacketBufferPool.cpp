@@ -0,0 +1,274 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertPacketBufferPool.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		System::IntPtr PacketLease::Data::get()
+		{
+			return System::IntPtr(UnmanagedData());
+		}
+
+		uint32_t PacketLease::Capacity::get()
+		{
+			return LivePool()->Capacity(m_buffer);
+		}
+
+		uint32_t PacketLease::Length::get()
+		{
+			return LivePool()->Length(m_buffer);
+		}
+
+		void PacketLease::Length::set(uint32_t value)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = LivePool();
+
+			if (value > pool->Capacity(m_buffer))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"value", u8"In PacketLease::Length::set(uint32_t) - Length exceeds the capacity of the buffer.");
+				throw e;
+			}
+
+			pool->SetLength(m_buffer, value);
+		}
+
+		System::Byte PacketLease::default::get(uint32_t index)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = LivePool();
+
+			if (index >= pool->Capacity(m_buffer))
+			{
+				e = gcnew System::IndexOutOfRangeException(u8"In PacketLease::default::get(uint32_t) - Index is outside the buffer.");
+				throw e;
+			}
+
+			return pool->Data(m_buffer)[index];
+		}
+
+		void PacketLease::default::set(uint32_t index, System::Byte value)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = LivePool();
+
+			if (index >= pool->Capacity(m_buffer))
+			{
+				e = gcnew System::IndexOutOfRangeException(u8"In PacketLease::default::set(uint32_t, System::Byte) - Index is outside the buffer.");
+				throw e;
+			}
+
+			pool->Data(m_buffer)[index] = value;
+		}
+
+		void PacketLease::CopyFrom(array<System::Byte>^ source, int offset, int count)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = LivePool();
+
+			if (source == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"source", u8"In PacketLease::CopyFrom(array<System::Byte>^, int, int) - Supplied array is null.");
+				throw e;
+			}
+
+			if (offset < 0 || count < 0 || count > source->Length - offset || static_cast<uint32_t>(count) > pool->Capacity(m_buffer))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"count", u8"In PacketLease::CopyFrom(array<System::Byte>^, int, int) - Offset and count must describe a range within the array, no longer than the buffer.");
+				throw e;
+			}
+
+			System::Runtime::InteropServices::Marshal::Copy(source, offset, System::IntPtr(pool->Data(m_buffer)), count);
+			pool->SetLength(m_buffer, static_cast<uint32_t>(count));
+		}
+
+		int PacketLease::CopyTo(array<System::Byte>^ destination, int offset)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketBufferPool* pool = LivePool();
+
+			if (destination == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"destination", u8"In PacketLease::CopyTo(array<System::Byte>^, int) - Supplied array is null.");
+				throw e;
+			}
+
+			const int length = static_cast<int>(pool->Length(m_buffer));
+
+			if (offset < 0 || length > destination->Length - offset)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"offset", u8"In PacketLease::CopyTo(array<System::Byte>^, int) - The packet doesn't fit in the array at the supplied offset.");
+				throw e;
+			}
+
+			System::Runtime::InteropServices::Marshal::Copy(System::IntPtr(pool->Data(m_buffer)), destination, offset, length);
+
+			return length;
+		}
+
+		PacketLease PacketLease::Retain()
+		{
+			LivePool()->Retain(m_buffer);
+			return *this;
+		}
+
+		bool PacketLease::Release()
+		{
+			return LivePool()->Return(m_buffer);
+		}
+
+		Native::PacketBufferPool* PacketLease::LivePool()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_pool == nullptr)
+			{
+				e = gcnew System::InvalidOperationException(u8"In PacketLease::LivePool() - The lease is not valid.");
+				throw e;
+			}
+
+			Native::PacketBufferPool* pool = m_pool->UnmanagedPool;
+
+			if (!pool->IsLeased(m_buffer, m_generation))
+			{
+				e = gcnew System::InvalidOperationException(u8"In PacketLease::LivePool() - The buffer has gone back to the pool.");
+				throw e;
+			}
+
+			return pool;
+		}
+
+		uint8_t* PacketLease::UnmanagedData()
+		{
+			return LivePool()->Data(m_buffer);
+		}
+
+		PacketBufferPool::PacketBufferPool(uint32_t smallBuffers, uint32_t largeBuffers)
+		{
+			System::Exception^ e = nullptr;
+
+			if (smallBuffers > Native::PacketBufferPool::MaximumBuffers || largeBuffers > Native::PacketBufferPool::MaximumBuffers)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(smallBuffers > Native::PacketBufferPool::MaximumBuffers ? u8"smallBuffers" : u8"largeBuffers", u8"In PacketBufferPool::PacketBufferPool(uint32_t, uint32_t) - Buffer counts must be less than 2^24.");
+				throw e;
+			}
+
+			if (smallBuffers == 0 && largeBuffers == 0)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"smallBuffers", u8"In PacketBufferPool::PacketBufferPool(uint32_t, uint32_t) - The pool must have at least one buffer.");
+				throw e;
+			}
+
+			m_pool = new Native::PacketBufferPool(smallBuffers, largeBuffers);
+		}
+
+		PacketBufferPool::~PacketBufferPool()
+		{
+			this->!PacketBufferPool();
+		}
+
+		PacketBufferPool::!PacketBufferPool()
+		{
+			if (m_pool != nullptr)
+			{
+				// Overlapped operations hold references of their own, the pool stays until
+				// they are done.
+				m_pool->Release();
+				m_pool = nullptr;
+			}
+		}
+
+		PacketLease PacketBufferPool::Lease(uint32_t length)
+		{
+			Native::PacketBufferPool* pool = UnmanagedPool;
+
+			const uint32_t buffer = pool->Lease(length);
+
+			if (buffer == Native::PacketBufferPool::InvalidBuffer)
+			{
+				return PacketLease();
+			}
+
+			return PacketLease(this, buffer, pool->Generation(buffer));
+		}
+
+		uint32_t PacketBufferPool::SmallBufferCount::get()
+		{
+			return UnmanagedPool->SmallBufferCount();
+		}
+
+		uint32_t PacketBufferPool::LargeBufferCount::get()
+		{
+			return UnmanagedPool->LargeBufferCount();
+		}
+
+		uint32_t PacketBufferPool::SmallAvailable::get()
+		{
+			return UnmanagedPool->Statistics().SmallAvailable;
+		}
+
+		uint32_t PacketBufferPool::LargeAvailable::get()
+		{
+			return UnmanagedPool->Statistics().LargeAvailable;
+		}
+
+		uint64_t PacketBufferPool::Leased::get()
+		{
+			return UnmanagedPool->Statistics().Leased;
+		}
+
+		uint64_t PacketBufferPool::Promoted::get()
+		{
+			return UnmanagedPool->Statistics().Promoted;
+		}
+
+		uint64_t PacketBufferPool::Exhausted::get()
+		{
+			return UnmanagedPool->Statistics().Exhausted;
+		}
+
+		Native::PacketBufferPool* PacketBufferPool::UnmanagedPool::get()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_pool == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"PacketBufferPool", u8"In PacketBufferPool::UnmanagedPool::get() - Packet buffer pool has been disposed.");
+				throw e;
+			}
+
+			return m_pool;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
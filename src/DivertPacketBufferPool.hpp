@@ -0,0 +1,298 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNativePacketBufferPool.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		ref class PacketBufferPool;
+
+		/// <summary>
+		/// A buffer leased from a PacketBufferPool. Pass it to Diversion.Receive, ParsePacket,
+		/// CalculateChecksums and Send in place of a byte array: the buffer is native memory, so
+		/// nothing is pinned, and the headers ParsePacket populates point straight into it.
+		/// 
+		/// A lease is a small value, copying it doesn't add a reference. Each holder that needs
+		/// the buffer to stay takes a reference with Retain, and drops it with Release. Once the
+		/// last reference is gone the buffer goes back to the pool, and any copy of the lease left
+		/// behind throws rather than touching a buffer that now belongs to someone else.
+		/// </summary>
+		public value struct PacketLease
+		{
+
+		public:
+
+			/// <summary>
+			/// False for a default constructed lease, and for the lease returned by
+			/// PacketBufferPool.Lease when no buffer was left.
+			/// </summary>
+			property bool IsValid
+			{
+				bool get() { return m_pool != nullptr; }
+			}
+
+			/// <summary>
+			/// The address of the buffer.
+			/// </summary>
+			/// <exception cref="System::InvalidOperationException">
+			/// The buffer went back to the pool.
+			/// </exception>
+			property System::IntPtr Data
+			{
+				System::IntPtr get();
+			}
+
+			/// <summary>
+			/// The size of the buffer.
+			/// </summary>
+			property uint32_t Capacity
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The length of the packet in the buffer. Set by Diversion.Receive, and to be set when
+			/// a packet is built in the buffer by hand. Diversion.Send sends this many bytes.
+			/// </summary>
+			/// <exception cref="System::ArgumentOutOfRangeException">
+			/// Set to more than Capacity.
+			/// </exception>
+			property uint32_t Length
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// A byte of the buffer.
+			/// </summary>
+			/// <exception cref="System::IndexOutOfRangeException">
+			/// The index is not less than Capacity.
+			/// </exception>
+			property System::Byte default[uint32_t]
+			{
+				System::Byte get(uint32_t index);
+				void set(uint32_t index, System::Byte value);
+			}
+
+			/// <summary>
+			/// Copies a packet into the buffer, and sets Length to its length.
+			/// </summary>
+			void CopyFrom(array<System::Byte>^ source, int offset, int count);
+
+			/// <summary>
+			/// Copies the packet in the buffer, Length bytes, into an array.
+			/// </summary>
+			/// <returns>
+			/// The number of bytes copied.
+			/// </returns>
+			int CopyTo(array<System::Byte>^ destination, int offset);
+
+			/// <summary>
+			/// Takes another reference on the buffer.
+			/// </summary>
+			/// <returns>
+			/// This lease, for passing on to whoever the reference is for.
+			/// </returns>
+			PacketLease Retain();
+
+			/// <summary>
+			/// Drops a reference on the buffer.
+			/// </summary>
+			/// <returns>
+			/// Whether that was the last reference, and the buffer went back to the pool.
+			/// </returns>
+			bool Release();
+
+		internal:
+
+			PacketLease(PacketBufferPool^ pool, uint32_t buffer, uint32_t generation) : m_pool(pool), m_buffer(buffer), m_generation(generation)
+			{
+
+			}
+
+			property uint32_t Buffer
+			{
+				uint32_t get() { return m_buffer; }
+			}
+
+			property PacketBufferPool^ Pool
+			{
+				PacketBufferPool^ get() { return m_pool; }
+			}
+
+			/// <summary>
+			/// The native pool, throwing if the pool has been disposed or the buffer is no longer
+			/// leased with this lease's generation.
+			/// </summary>
+			Native::PacketBufferPool* LivePool();
+
+			/// <summary>
+			/// The address of the buffer, throwing as LivePool does.
+			/// </summary>
+			uint8_t* UnmanagedData();
+
+		private:
+
+			PacketBufferPool^ m_pool;
+
+			uint32_t m_buffer;
+
+			uint32_t m_generation;
+
+		};
+
+		/// <summary>
+		/// A fixed set of packet buffers in native memory, to receive, parse, modify and reinject
+		/// packets without allocating or pinning anything per packet. Every byte array passed to
+		/// Receive or Send is pinned for the call, and pinning many small arrays fragments the
+		/// managed heap. The pool's buffers are allocated once, outside the managed heap, in two
+		/// sizes: small buffers hold any packet of an Ethernet sized MTU, large buffers hold the
+		/// largest packet WinDivert delivers.
+		/// 
+		/// Leasing and releasing are lock free and safe from any thread. Disposing the pool makes
+		/// its outstanding leases unusable, but buffers still held by overlapped operations stay
+		/// valid until the operations are done with them.
+		/// </summary>
+		public ref class PacketBufferPool sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a pool, allocating every buffer.
+			/// </summary>
+			/// <param name="smallBuffers">
+			/// The number of SmallBufferSize buffers.
+			/// </param>
+			/// <param name="largeBuffers">
+			/// The number of LargeBufferSize buffers. Small leases use these when the small
+			/// buffers run out.
+			/// </param>
+			PacketBufferPool(uint32_t smallBuffers, uint32_t largeBuffers);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~PacketBufferPool();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!PacketBufferPool();
+
+			/// <summary>
+			/// Leases a buffer, with one reference and a length of zero.
+			/// </summary>
+			/// <param name="length">
+			/// The least capacity the buffer must have. For receiving, SmallBufferSize unless
+			/// larger packets are expected.
+			/// </param>
+			/// <returns>
+			/// The lease, which isn't valid when no buffer that fits was left.
+			/// </returns>
+			PacketLease Lease(uint32_t length);
+
+			static const uint32_t SmallBufferSize = Native::PacketBufferPool::SmallBufferSize;
+
+			static const uint32_t LargeBufferSize = Native::PacketBufferPool::LargeBufferSize;
+
+			property uint32_t SmallBufferCount
+			{
+				uint32_t get();
+			}
+
+			property uint32_t LargeBufferCount
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Small buffers not currently leased.
+			/// </summary>
+			property uint32_t SmallAvailable
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Large buffers not currently leased.
+			/// </summary>
+			property uint32_t LargeAvailable
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Buffers leased.
+			/// </summary>
+			property uint64_t Leased
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Leases that got a large buffer because the small ones had run out.
+			/// </summary>
+			property uint64_t Promoted
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Leases that found no buffer left.
+			/// </summary>
+			property uint64_t Exhausted
+			{
+				uint64_t get();
+			}
+
+		internal:
+
+			/// <summary>
+			/// The native pool, throwing if this object has been disposed.
+			/// </summary>
+			property Native::PacketBufferPool* UnmanagedPool
+			{
+				Native::PacketBufferPool* get();
+			}
+
+		private:
+
+			/// <summary>
+			/// This object's reference on the native pool.
+			/// </summary>
+			Native::PacketBufferPool* m_pool = nullptr;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,254 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertPacketRing.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		PacketRing::PacketRing(PacketBufferPool^ pool, uint32_t capacity, bool multipleProducersAndConsumers, PacketRingOverflow overflow)
+		{
+			System::Exception^ e = nullptr;
+
+			if (pool == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"pool", u8"In PacketRing::PacketRing(PacketBufferPool^, uint32_t, bool, PacketRingOverflow) - Supplied pool is null.");
+				throw e;
+			}
+
+			if (capacity == 0 || capacity > Native::PacketRing::MaximumCapacity)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"capacity", u8"In PacketRing::PacketRing(PacketBufferPool^, uint32_t, bool, PacketRingOverflow) - Capacity must be between one and 2^24.");
+				throw e;
+			}
+
+			Native::RingOverflow nativeOverflow;
+
+			switch (overflow)
+			{
+				case PacketRingOverflow::Block:
+					nativeOverflow = Native::RingOverflow::Block;
+					break;
+
+				case PacketRingOverflow::DropNewest:
+					nativeOverflow = Native::RingOverflow::DropNewest;
+					break;
+
+				case PacketRingOverflow::DropOldest:
+					nativeOverflow = Native::RingOverflow::DropOldest;
+					break;
+
+				default:
+					e = gcnew System::ArgumentOutOfRangeException(u8"overflow", u8"In PacketRing::PacketRing(PacketBufferPool^, uint32_t, bool, PacketRingOverflow) - Unknown overflow policy.");
+					throw e;
+			}
+
+			m_pool = pool->UnmanagedPool;
+			m_pool->AddReference();
+			m_managedPool = pool;
+
+			const Native::PacketRingMode mode = multipleProducersAndConsumers ? Native::PacketRingMode::MultipleProducersMultipleConsumers : Native::PacketRingMode::SingleProducerSingleConsumer;
+
+			m_ring = new Native::PacketRing(capacity, mode, nativeOverflow, &Native::PacketRing::ReturnToPool, m_pool);
+		}
+
+		PacketRing::~PacketRing()
+		{
+			this->!PacketRing();
+		}
+
+		PacketRing::!PacketRing()
+		{
+			if (m_ring != nullptr)
+			{
+				// Whatever is still in the ring goes back to the pool.
+				delete m_ring;
+				m_ring = nullptr;
+			}
+
+			if (m_pool != nullptr)
+			{
+				m_pool->Release();
+				m_pool = nullptr;
+			}
+
+			m_managedPool = nullptr;
+		}
+
+		PacketRingResult PacketRing::Enqueue(PacketLease lease, Address^ address)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::PacketRing* ring = Ring();
+
+			if (address == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"address", u8"In PacketRing::Enqueue(PacketLease, Address^) - Supplied address is null.");
+				throw e;
+			}
+
+			if (lease.Pool != m_managedPool)
+			{
+				e = gcnew System::ArgumentException(u8"In PacketRing::Enqueue(PacketLease, Address^) - The lease is not from this ring's pool.", u8"lease");
+				throw e;
+			}
+
+			Native::PacketBufferPool* pool = lease.LivePool();
+
+			Native::PacketDescriptor descriptor;
+
+			descriptor.Buffer = lease.Buffer;
+			descriptor.Length = pool->Length(lease.Buffer);
+			descriptor.Timestamp = 0;
+			descriptor.Address = *address->UnmanagedAddress;
+
+			switch (ring->Push(descriptor))
+			{
+				case Native::RingPush::Pushed:
+					return PacketRingResult::Enqueued;
+
+				case Native::RingPush::Dropped:
+					return PacketRingResult::Dropped;
+
+				default:
+					return PacketRingResult::Closed;
+			}
+		}
+
+		bool PacketRing::TryDequeue(PacketLease% lease, Address^ address)
+		{
+			Native::PacketDescriptor descriptor;
+
+			if (!Ring()->TryPop(descriptor))
+			{
+				lease = PacketLease();
+				return false;
+			}
+
+			lease = Unpack(descriptor, address);
+			return true;
+		}
+
+		bool PacketRing::Dequeue(PacketLease% lease, Address^ address, int millisecondsTimeout)
+		{
+			System::Exception^ e = nullptr;
+
+			if (millisecondsTimeout < System::Threading::Timeout::Infinite)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"millisecondsTimeout", u8"In PacketRing::Dequeue(PacketLease%, Address^, int) - Timeout must be non-negative, or Timeout.Infinite.");
+				throw e;
+			}
+
+			const uint32_t timeout = millisecondsTimeout == System::Threading::Timeout::Infinite ? Native::PacketRing::Infinite : static_cast<uint32_t>(millisecondsTimeout);
+
+			Native::PacketDescriptor descriptor;
+
+			if (!Ring()->Pop(descriptor, timeout))
+			{
+				lease = PacketLease();
+				return false;
+			}
+
+			lease = Unpack(descriptor, address);
+			return true;
+		}
+
+		void PacketRing::Close()
+		{
+			Ring()->Close();
+		}
+
+		bool PacketRing::IsClosed::get()
+		{
+			return Ring()->IsClosed();
+		}
+
+		uint32_t PacketRing::Count::get()
+		{
+			return Ring()->Count();
+		}
+
+		uint32_t PacketRing::Capacity::get()
+		{
+			return Ring()->Capacity();
+		}
+
+		uint64_t PacketRing::Enqueued::get()
+		{
+			return Ring()->Statistics().Pushed;
+		}
+
+		uint64_t PacketRing::Dequeued::get()
+		{
+			return Ring()->Statistics().Popped;
+		}
+
+		uint64_t PacketRing::DroppedNewest::get()
+		{
+			return Ring()->Statistics().DroppedNewest;
+		}
+
+		uint64_t PacketRing::DroppedOldest::get()
+		{
+			return Ring()->Statistics().DroppedOldest;
+		}
+
+		uint64_t PacketRing::ProducerWaits::get()
+		{
+			return Ring()->Statistics().ProducerWaits;
+		}
+
+		uint64_t PacketRing::ConsumerWaits::get()
+		{
+			return Ring()->Statistics().ConsumerWaits;
+		}
+
+		PacketLease PacketRing::Unpack(const Native::PacketDescriptor& descriptor, Address^ address)
+		{
+			if (address != nullptr)
+			{
+				*address->UnmanagedAddress = descriptor.Address;
+			}
+
+			// The ring held the reference, so the buffer can't have changed hands since it went in.
+			return PacketLease(m_managedPool, descriptor.Buffer, m_pool->Generation(descriptor.Buffer));
+		}
+
+		Native::PacketRing* PacketRing::Ring()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_ring == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"PacketRing", u8"In PacketRing::Ring() - Packet ring has been disposed.");
+				throw e;
+			}
+
+			return m_ring;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
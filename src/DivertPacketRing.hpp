@@ -0,0 +1,268 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAddress.hpp"
+#include "DivertPacketBufferPool.hpp"
+#include "DivertNativePacketRing.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// What PacketRing.Enqueue does when the ring is full.
+		/// </summary>
+		public enum class PacketRingOverflow
+		{
+			/// <summary>
+			/// Waits for a consumer to make room. Nothing is lost, and the receiving thread slows
+			/// down to the pace of the consumers.
+			/// </summary>
+			Block,
+
+			/// <summary>
+			/// Drops the packet being enqueued.
+			/// </summary>
+			DropNewest,
+
+			/// <summary>
+			/// Drops the oldest packet in the ring to make room, so that consumers that fall behind
+			/// skip ahead rather than work through stale packets.
+			/// </summary>
+			DropOldest
+		};
+
+		/// <summary>
+		/// The outcome of PacketRing.Enqueue.
+		/// </summary>
+		public enum class PacketRingResult
+		{
+			/// <summary>
+			/// The packet is in the ring.
+			/// </summary>
+			Enqueued,
+
+			/// <summary>
+			/// The ring was full and the packet was dropped, its buffer released.
+			/// </summary>
+			Dropped,
+
+			/// <summary>
+			/// The ring has been closed. The lease still belongs to the caller.
+			/// </summary>
+			Closed
+		};
+
+		/// <summary>
+		/// Hands packets received into a PacketBufferPool from the thread that receives them to
+		/// the threads that inspect and send them, without a lock per packet. Only the buffer
+		/// number, length and address travel through the ring, the packet stays in its buffer.
+		/// 
+		/// Enqueue moves the caller's reference on the buffer into the ring, and Dequeue moves it
+		/// out to the consumer, who releases it when done with the packet. Packets the ring drops,
+		/// and any still in it when it's disposed, are released by the ring.
+		/// 
+		/// Every method may be called from any thread, as the mode chosen at construction allows.
+		/// Dispose the ring only once every producer and consumer is done with it: Close wakes
+		/// them all up for that.
+		/// </summary>
+		public ref class PacketRing sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a ring.
+			/// </summary>
+			/// <param name="pool">
+			/// The pool every packet passed through the ring is leased from.
+			/// </param>
+			/// <param name="capacity">
+			/// The most packets the ring holds, rounded up to a power of two. At most 2^24.
+			/// </param>
+			/// <param name="multipleProducersAndConsumers">
+			/// False when exactly one thread enqueues and exactly one dequeues, which spares both
+			/// of them an interlocked instruction per packet.
+			/// </param>
+			/// <param name="overflow">
+			/// What Enqueue does when the ring is full.
+			/// </param>
+			PacketRing(PacketBufferPool^ pool, uint32_t capacity, bool multipleProducersAndConsumers, PacketRingOverflow overflow);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~PacketRing();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!PacketRing();
+
+			/// <summary>
+			/// Adds a packet to the ring, taking over the caller's reference on its buffer unless
+			/// the result is Closed.
+			/// </summary>
+			/// <param name="lease">
+			/// The packet's buffer, with Length set to the packet's length.
+			/// </param>
+			/// <param name="address">
+			/// The packet's address, copied into the ring.
+			/// </param>
+			/// <exception cref="System::ArgumentException">
+			/// The lease is from a different pool.
+			/// </exception>
+			PacketRingResult Enqueue(PacketLease lease, Address^ address);
+
+			/// <summary>
+			/// Takes the oldest packet out of the ring, if there is one.
+			/// </summary>
+			/// <param name="lease">
+			/// Receives the packet's buffer. The caller now holds the reference the ring did.
+			/// </param>
+			/// <param name="address">
+			/// Receives the packet's address.
+			/// </param>
+			bool TryDequeue([System::Runtime::InteropServices::Out] PacketLease% lease, Address^ address);
+
+			/// <summary>
+			/// Takes the oldest packet out of the ring, waiting for one if the ring is empty.
+			/// Packets enqueued before the ring was closed are still dequeued after it.
+			/// </summary>
+			/// <param name="millisecondsTimeout">
+			/// How long to wait, or System.Threading.Timeout.Infinite.
+			/// </param>
+			/// <returns>
+			/// False if no packet arrived in time, or the ring is closed and empty.
+			/// </returns>
+			bool Dequeue([System::Runtime::InteropServices::Out] PacketLease% lease, Address^ address, int millisecondsTimeout);
+
+			/// <summary>
+			/// Stops the ring taking packets, and wakes every thread waiting in Enqueue or Dequeue.
+			/// </summary>
+			void Close();
+
+			property bool IsClosed
+			{
+				bool get();
+			}
+
+			/// <summary>
+			/// The number of packets in the ring.
+			/// </summary>
+			property uint32_t Count
+			{
+				uint32_t get();
+			}
+
+			property uint32_t Capacity
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Packets that went into the ring.
+			/// </summary>
+			property uint64_t Enqueued
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Packets taken out by consumers.
+			/// </summary>
+			property uint64_t Dequeued
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Packets dropped by PacketRingOverflow.DropNewest.
+			/// </summary>
+			property uint64_t DroppedNewest
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Packets dropped by PacketRingOverflow.DropOldest.
+			/// </summary>
+			property uint64_t DroppedOldest
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Times Enqueue had to wait for room.
+			/// </summary>
+			property uint64_t ProducerWaits
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Times Dequeue had to wait for a packet.
+			/// </summary>
+			property uint64_t ConsumerWaits
+			{
+				uint64_t get();
+			}
+
+		private:
+
+			/// <summary>
+			/// The ring itself. Exclusively owned by this object.
+			/// </summary>
+			Native::PacketRing* m_ring = nullptr;
+
+			/// <summary>
+			/// This object's reference on the native pool, so that the ring can release dropped
+			/// buffers even after the pool is disposed.
+			/// </summary>
+			Native::PacketBufferPool* m_pool = nullptr;
+
+			/// <summary>
+			/// The pool dequeued leases are handed out against.
+			/// </summary>
+			PacketBufferPool^ m_managedPool = nullptr;
+
+			/// <summary>
+			/// Turns a dequeued descriptor back into a lease and an address.
+			/// </summary>
+			PacketLease Unpack(const Native::PacketDescriptor& descriptor, Address^ address);
+
+			/// <summary>
+			/// The native ring, throwing if this object has been disposed.
+			/// </summary>
+			Native::PacketRing* Ring();
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,496 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertPacketSource.hpp"
+
+#include "DivertCompletionQueue.hpp"
+
+#include <atomic>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			namespace
+			{
+				/// <summary>
+				/// Packets in a packed buffer start on 8 byte boundaries so that headers can be
+				/// read in place without unaligned access penalties.
+				/// </summary>
+				inline uint32_t AlignPacketOffset(const uint32_t offset)
+				{
+					return (offset + 7u) & ~7u;
+				}
+
+				/// <summary>
+				/// Whether an overlapped operation has opted out of completion port notification by
+				/// tagging the low bit of its event, as DivertAsyncResult does.
+				/// </summary>
+				inline bool CompletesThroughEvent(const void* overlapped)
+				{
+					return (reinterpret_cast<uintptr_t>(static_cast<const OVERLAPPED*>(overlapped)->hEvent) & 1) != 0;
+				}
+
+				#ifdef _WIN32
+
+				/// <summary>
+				/// The event the calling thread waits on in the blocking calls of a
+				/// WinDivertPacketSource, created on the thread's first call. Returned tagged, so
+				/// that those calls never complete into a completion port the handle is bound to.
+				/// </summary>
+				HANDLE BlockingEvent()
+				{
+					struct Event
+					{
+						HANDLE Handle = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+						~Event()
+						{
+							if (Handle != nullptr)
+							{
+								CloseHandle(Handle);
+							}
+						}
+					};
+
+					static thread_local Event event;
+
+					if (event.Handle == nullptr)
+					{
+						return nullptr;
+					}
+
+					ResetEvent(event.Handle);
+
+					return reinterpret_cast<HANDLE>(reinterpret_cast<uintptr_t>(event.Handle) | 1);
+				}
+
+				/// <summary>
+				/// Waits for an overlapped call made with a BlockingEvent to finish.
+				/// </summary>
+				bool FinishBlocking(HANDLE handle, BOOL started, OVERLAPPED* overlapped, UINT* length)
+				{
+					if (started)
+					{
+						return true;
+					}
+
+					if (GetLastError() != ERROR_IO_PENDING)
+					{
+						return false;
+					}
+
+					DWORD transferred = 0;
+
+					if (!GetOverlappedResult(handle, overlapped, &transferred, TRUE))
+					{
+						return false;
+					}
+
+					*length = static_cast<UINT>(transferred);
+					return true;
+				}
+
+				#endif // _WIN32
+			}
+
+			PacketSource::~PacketSource()
+			{
+
+			}
+
+			uint32_t PacketSource::ReceiveBatch(uint8_t* buffer, uint32_t bufferLength, uint32_t maxPacketLength, uint32_t maxPackets, uint32_t* offsets, uint32_t* lengths, PWINDIVERT_ADDRESS* addresses)
+			{
+				uint32_t count = 0;
+				uint32_t cursor = 0;
+
+				while (count < maxPackets && cursor <= bufferLength && bufferLength - cursor >= maxPacketLength)
+				{
+					std::memset(addresses[count], 0, sizeof(WINDIVERT_ADDRESS));
+
+					uint32_t readLength = 0;
+
+					// Only the first read is allowed to block. After that we only take what is
+					// already waiting, otherwise a quiet link would hold the whole batch hostage.
+					bool received = count == 0 ?
+						Receive(buffer + cursor, maxPacketLength, addresses[count], &readLength) :
+						TryReceive(buffer + cursor, maxPacketLength, addresses[count], &readLength);
+
+					if (!received)
+					{
+						break;
+					}
+
+					offsets[count] = cursor;
+					lengths[count] = readLength;
+
+					cursor = AlignPacketOffset(cursor + readLength);
+					++count;
+				}
+
+				return count;
+			}
+
+			uint32_t PacketSource::SendBatch(const uint8_t* buffer, uint32_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, PWINDIVERT_ADDRESS* addresses, uint32_t count, int32_t* results)
+			{
+				uint32_t sent = 0;
+
+				for (uint32_t i = 0; i < count; ++i)
+				{
+					uint32_t writeLength = 0;
+
+					// The tables can be written by the caller, so every packet is checked against
+					// the buffer. Summed in 64 bits, so that it can't wrap.
+					if (static_cast<uint64_t>(offsets[i]) + lengths[i] > bufferLength)
+					{
+						results[i] = InvalidParameterError;
+					}
+					else if (Send(buffer + offsets[i], lengths[i], addresses[i], &writeLength))
+					{
+						results[i] = 0;
+						++sent;
+					}
+					else
+					{
+						results[i] = GetNativeLastError();
+					}
+				}
+
+				return sent;
+			}
+
+			bool PacketSource::BindCompletionQueue(CompletionQueue* /* queue */, uintptr_t /* key */)
+			{
+				SetNativeLastError(NotSupportedError);
+				return false;
+			}
+
+			void PacketSource::CancelPending()
+			{
+
+			}
+
+			void PacketSource::Detach()
+			{
+
+			}
+
+			#ifdef _WIN32
+
+			WinDivertPacketSource::WinDivertPacketSource(void* handle) : m_handle(handle), m_completionQueue(nullptr)
+			{
+
+			}
+
+			WinDivertPacketSource::~WinDivertPacketSource()
+			{
+
+			}
+
+			bool WinDivertPacketSource::Receive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength)
+			{
+				// Not WinDivertRecv, whose own OVERLAPPED would complete into the completion port
+				// once the handle is bound to one, where nothing knows what to do with it.
+				OVERLAPPED overlapped = {};
+				overlapped.hEvent = BlockingEvent();
+
+				if (overlapped.hEvent == nullptr)
+				{
+					return false;
+				}
+
+				UINT recvLength = 0;
+
+				if (!FinishBlocking(m_handle, WinDivertRecvEx(m_handle, packet, packetLength, 0, address, &recvLength, &overlapped), &overlapped, &recvLength))
+				{
+					return false;
+				}
+
+				*readLength = recvLength;
+				return true;
+			}
+
+			bool WinDivertPacketSource::TryReceive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength)
+			{
+				// On the stack with the thread's own event, as in Receive, since several threads
+				// may be reading the handle at once.
+				OVERLAPPED overlapped = {};
+				overlapped.hEvent = BlockingEvent();
+
+				if (overlapped.hEvent == nullptr)
+				{
+					return false;
+				}
+
+				UINT recvLength = 0;
+
+				if (WinDivertRecvEx(m_handle, packet, packetLength, 0, address, &recvLength, &overlapped))
+				{
+					*readLength = recvLength;
+					return true;
+				}
+
+				if (GetLastError() != ERROR_IO_PENDING)
+				{
+					return false;
+				}
+
+				// Nothing was queued. Cancel the read, but note that the driver may have completed it
+				// in between, in which case GetOverlappedResult hands us a perfectly good packet that
+				// must not be thrown away. Either way it waits for the read to be done with the
+				// OVERLAPPED before it goes out of scope.
+				CancelIoEx(m_handle, &overlapped);
+
+				DWORD transferred = 0;
+
+				if (GetOverlappedResult(m_handle, &overlapped, &transferred, TRUE))
+				{
+					*readLength = static_cast<uint32_t>(transferred);
+					return true;
+				}
+
+				SetNativeLastError(NoMoreItemsError);
+				return false;
+			}
+
+			bool WinDivertPacketSource::ReceiveEx(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength, void* overlapped)
+			{
+				if (overlapped == nullptr)
+				{
+					return Receive(packet, packetLength, address, readLength);
+				}
+
+				return WinDivertRecvEx(m_handle, packet, packetLength, 0, address, readLength, static_cast<LPOVERLAPPED>(overlapped)) == TRUE;
+			}
+
+			bool WinDivertPacketSource::Send(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength)
+			{
+				// Not WinDivertSend, for the same reason as in Receive.
+				OVERLAPPED overlapped = {};
+				overlapped.hEvent = BlockingEvent();
+
+				if (overlapped.hEvent == nullptr)
+				{
+					return false;
+				}
+
+				UINT sendLength = 0;
+
+				if (!FinishBlocking(m_handle, WinDivertSendEx(m_handle, const_cast<void*>(packet), packetLength, 0, address, &sendLength, &overlapped), &overlapped, &sendLength))
+				{
+					return false;
+				}
+
+				*writeLength = sendLength;
+				return true;
+			}
+
+			bool WinDivertPacketSource::SendEx(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength, void* overlapped)
+			{
+				if (overlapped == nullptr)
+				{
+					return Send(packet, packetLength, address, writeLength);
+				}
+
+				return WinDivertSendEx(m_handle, const_cast<void*>(packet), packetLength, 0, address, writeLength, static_cast<LPOVERLAPPED>(overlapped)) == TRUE;
+			}
+
+			bool WinDivertPacketSource::BindCompletionQueue(CompletionQueue* queue, uintptr_t key)
+			{
+				// A handle stays associated with a completion port until it is closed, so it can be
+				// bound once, and rebinding to the same port is a no-op.
+				if (queue != nullptr && queue == m_completionQueue)
+				{
+					return true;
+				}
+
+				// Completions of a real handle can only be routed by the kernel.
+				if (queue == nullptr || m_completionQueue != nullptr || !queue->IsKernelQueue())
+				{
+					SetNativeLastError(NotSupportedError);
+					return false;
+				}
+
+				if (!queue->Associate(m_handle, key))
+				{
+					return false;
+				}
+
+				m_completionQueue = queue;
+				return true;
+			}
+
+			void WinDivertPacketSource::CancelPending()
+			{
+				CancelIoEx(m_handle, nullptr);
+			}
+
+			void WinDivertPacketSource::Detach()
+			{
+				m_handle = INVALID_HANDLE_VALUE;
+			}
+
+			#endif // _WIN32
+
+			struct SimulatedPacketSource::Counters
+			{
+				std::atomic<uint64_t> Next{ 0 };
+
+				std::atomic<uint64_t> Received{ 0 };
+
+				std::atomic<uint64_t> Sent{ 0 };
+			};
+
+			SimulatedPacketSource::SimulatedPacketSource(const std::vector< std::vector<uint8_t> >& packets) : m_packets(packets), m_counters(new Counters())
+			{
+
+			}
+
+			SimulatedPacketSource::~SimulatedPacketSource()
+			{
+				delete m_counters;
+			}
+
+			bool SimulatedPacketSource::Receive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength)
+			{
+				if (m_packets.empty())
+				{
+					SetNativeLastError(NoMoreItemsError);
+					return false;
+				}
+
+				const uint64_t index = m_counters->Next.fetch_add(1, std::memory_order_relaxed);
+				const std::vector<uint8_t>& next = m_packets[static_cast<size_t>(index % m_packets.size())];
+
+				if (next.size() > packetLength)
+				{
+					SetNativeLastError(InsufficientBufferError);
+					return false;
+				}
+
+				std::memcpy(packet, next.data(), next.size());
+
+				address->IfIdx = 1;
+				address->SubIfIdx = 0;
+				address->Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+				*readLength = static_cast<uint32_t>(next.size());
+
+				m_counters->Received.fetch_add(1, std::memory_order_relaxed);
+
+				return true;
+			}
+
+			bool SimulatedPacketSource::TryReceive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength)
+			{
+				// The simulated queue is never empty.
+				return Receive(packet, packetLength, address, readLength);
+			}
+
+			bool SimulatedPacketSource::ReceiveEx(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength, void* overlapped)
+			{
+				if (overlapped == nullptr || m_completionQueue == nullptr || CompletesThroughEvent(overlapped))
+				{
+					// Simulated reads always complete immediately, so the OVERLAPPED is never needed.
+					return Receive(packet, packetLength, address, readLength);
+				}
+
+				// Bound to a queue. Complete the read right away, but report it the same way a
+				// kernel queue would, as a pending operation that completes through the queue.
+				uint32_t length = 0;
+				Completion completion = { m_completionKey, static_cast<LPOVERLAPPED>(overlapped), 0, 0 };
+
+				if (Receive(packet, packetLength, address, &length))
+				{
+					completion.Bytes = length;
+				}
+				else
+				{
+					completion.Error = GetNativeLastError();
+				}
+
+				if (!m_completionQueue->Post(completion))
+				{
+					return false;
+				}
+
+				SetNativeLastError(IoPendingError);
+				return false;
+			}
+
+			bool SimulatedPacketSource::Send(const void* /* packet */, uint32_t packetLength, PWINDIVERT_ADDRESS /* address */, uint32_t* writeLength)
+			{
+				*writeLength = packetLength;
+				m_counters->Sent.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+
+			bool SimulatedPacketSource::SendEx(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength, void* overlapped)
+			{
+				if (overlapped == nullptr || m_completionQueue == nullptr || CompletesThroughEvent(overlapped))
+				{
+					return Send(packet, packetLength, address, writeLength);
+				}
+
+				uint32_t length = 0;
+				Send(packet, packetLength, address, &length);
+
+				Completion completion = { m_completionKey, static_cast<LPOVERLAPPED>(overlapped), length, 0 };
+
+				if (!m_completionQueue->Post(completion))
+				{
+					return false;
+				}
+
+				SetNativeLastError(IoPendingError);
+				return false;
+			}
+
+			bool SimulatedPacketSource::BindCompletionQueue(CompletionQueue* queue, uintptr_t key)
+			{
+				m_completionQueue = queue;
+				m_completionKey = key;
+				return true;
+			}
+
+			uint64_t SimulatedPacketSource::ReceivedCount() const
+			{
+				return m_counters->Received.load(std::memory_order_relaxed);
+			}
+
+			uint64_t SimulatedPacketSource::SentCount() const
+			{
+				return m_counters->Sent.load(std::memory_order_relaxed);
+			}
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
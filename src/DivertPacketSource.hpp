@@ -0,0 +1,305 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNative.hpp"
+#include <vector>
+
+#ifdef _MANAGED
+#pragma managed(push, off)
+#endif
+
+namespace Divert
+{
+	namespace Net
+	{
+		namespace Native
+		{
+
+			class CompletionQueue;
+
+			/// <summary>
+			/// Abstracts wherever packets are read from and injected into. Diversion instances talk
+			/// to a PacketSource rather than calling WinDivertRecv/WinDivertSend directly, so that
+			/// the per-packet and batched I/O paths can be driven by something other than the
+			/// driver, such as an in-process simulated source for benchmarking. All members are
+			/// native, so a batched call crosses the managed/native boundary exactly once.
+			/// </summary>
+			class PacketSource
+			{
+
+			public:
+
+				virtual ~PacketSource();
+
+				/// <summary>
+				/// Blocks until a packet is available, then reads it into the supplied buffer.
+				/// </summary>
+				/// <returns>
+				/// True if a packet was read, false otherwise. On failure the thread's last error
+				/// is set to the reason.
+				/// </returns>
+				virtual bool Receive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) = 0;
+
+				/// <summary>
+				/// Reads a packet only if one is already queued. Never blocks waiting for traffic.
+				/// </summary>
+				/// <returns>
+				/// True if a packet was read, false if none was immediately available or an error
+				/// occurred.
+				/// </returns>
+				virtual bool TryReceive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) = 0;
+
+				/// <summary>
+				/// Starts an overlapped read. Same contract as WinDivertRecvEx: a true return means
+				/// the read completed immediately, false with ERROR_IO_PENDING means the read will
+				/// complete through the supplied OVERLAPPED, anything else is a failure.
+				/// </summary>
+				/// <param name="overlapped">
+				/// The OVERLAPPED to complete the read through, or null for a read that must
+				/// complete immediately or not at all.
+				/// </param>
+				virtual bool ReceiveEx(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength, void* overlapped) = 0;
+
+				/// <summary>
+				/// Injects a single packet.
+				/// </summary>
+				/// <returns>
+				/// True if the packet was injected, false otherwise. On failure the thread's last
+				/// error is set to the reason.
+				/// </returns>
+				virtual bool Send(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength) = 0;
+
+				/// <summary>
+				/// Starts an overlapped injection. Same contract as WinDivertSendEx, see ReceiveEx.
+				/// </summary>
+				virtual bool SendEx(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength, void* overlapped) = 0;
+
+				/// <summary>
+				/// Fills a single packed buffer with as many packets as possible in one call. The
+				/// call blocks for the first packet only, then drains whatever is already queued
+				/// until either maxPackets have been read, or fewer than maxPacketLength bytes
+				/// remain in the buffer.
+				/// </summary>
+				/// <param name="buffer">
+				/// The packed buffer to read into. Packets are stored back to back.
+				/// </param>
+				/// <param name="bufferLength">
+				/// The total length of the buffer.
+				/// </param>
+				/// <param name="maxPacketLength">
+				/// The largest packet the caller expects. A read is only attempted while at least
+				/// this much space remains, so no packet is ever truncated.
+				/// </param>
+				/// <param name="maxPackets">
+				/// The number of entries in each of the offsets, lengths and addresses tables.
+				/// </param>
+				/// <param name="offsets">
+				/// Receives the offset of each packet within the buffer.
+				/// </param>
+				/// <param name="lengths">
+				/// Receives the length of each packet.
+				/// </param>
+				/// <param name="addresses">
+				/// Table of addresses, one per packet slot, to populate.
+				/// </param>
+				/// <returns>
+				/// The number of packets read. Zero means the blocking read for the first packet
+				/// failed, and the thread's last error is set to the reason.
+				/// </returns>
+				virtual uint32_t ReceiveBatch(uint8_t* buffer, uint32_t bufferLength, uint32_t maxPacketLength, uint32_t maxPackets, uint32_t* offsets, uint32_t* lengths, PWINDIVERT_ADDRESS* addresses);
+
+				/// <summary>
+				/// Injects every packet described by the supplied tables in a single call. A failure
+				/// to inject one packet does not stop the rest of the batch from being injected.
+				/// </summary>
+				/// <param name="buffer">
+				/// The packed buffer holding the packets.
+				/// </param>
+				/// <param name="bufferLength">
+				/// The length of the buffer. A packet that doesn't lie within it isn't injected, and
+				/// gets InvalidParameterError as its result.
+				/// </param>
+				/// <param name="offsets">
+				/// The offset of each packet within the buffer.
+				/// </param>
+				/// <param name="lengths">
+				/// The length of each packet.
+				/// </param>
+				/// <param name="addresses">
+				/// The address of each packet.
+				/// </param>
+				/// <param name="count">
+				/// The number of packets to inject.
+				/// </param>
+				/// <param name="results">
+				/// Receives a result code per packet. Zero if the packet was injected, otherwise the
+				/// error the injection failed with.
+				/// </param>
+				/// <returns>
+				/// The number of packets successfully injected.
+				/// </returns>
+				virtual uint32_t SendBatch(const uint8_t* buffer, uint32_t bufferLength, const uint32_t* offsets, const uint32_t* lengths, PWINDIVERT_ADDRESS* addresses, uint32_t count, int32_t* results);
+
+				/// <summary>
+				/// Routes every overlapped operation started on this source from now on through the
+				/// supplied queue, instead of through the OVERLAPPED's event. Once bound, ReceiveEx
+				/// and SendEx always report completion through the queue, even when they return
+				/// true, unless the OVERLAPPED's event has its low bit tagged. The blocking calls
+				/// never complete through the queue.
+				/// </summary>
+				/// <param name="queue">
+				/// The queue to complete into. Not owned by the source, and must outlive it. Null
+				/// unbinds, for the sources that support it.
+				/// </param>
+				/// <param name="key">
+				/// The key completions from this source are tagged with.
+				/// </param>
+				/// <returns>
+				/// True on success. The default implementation fails with NotSupportedError.
+				/// </returns>
+				virtual bool BindCompletionQueue(CompletionQueue* queue, uintptr_t key);
+
+				/// <summary>
+				/// Cancels every overlapped operation started on this source that has not completed
+				/// yet. Cancelled operations still complete, with OperationAbortedError.
+				/// </summary>
+				virtual void CancelPending();
+
+				/// <summary>
+				/// Called when the owner closes its handle. Implementations must stop touching any
+				/// underlying OS resources after this.
+				/// </summary>
+				virtual void Detach();
+
+			};
+
+			/// <summary>
+			/// PacketSource backed by a WinDivert handle. The handle itself is owned by the
+			/// DivertHandle wrapper, this object simply borrows it.
+			/// </summary>
+			class WinDivertPacketSource : public PacketSource
+			{
+
+			public:
+
+				WinDivertPacketSource(void* handle);
+
+				virtual ~WinDivertPacketSource();
+
+				virtual bool Receive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) override;
+
+				virtual bool TryReceive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) override;
+
+				virtual bool ReceiveEx(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength, void* overlapped) override;
+
+				virtual bool Send(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength) override;
+
+				virtual bool SendEx(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength, void* overlapped) override;
+
+				virtual bool BindCompletionQueue(CompletionQueue* queue, uintptr_t key) override;
+
+				virtual void CancelPending() override;
+
+				virtual void Detach() override;
+
+			private:
+
+				/// <summary>
+				/// The borrowed WinDivert HANDLE.
+				/// </summary>
+				void* m_handle;
+
+				/// <summary>
+				/// The completion port the handle has been associated with, if any.
+				/// </summary>
+				CompletionQueue* m_completionQueue;
+			};
+
+			/// <summary>
+			/// In-process PacketSource that never touches the driver. Reads hand out copies of a
+			/// fixed set of template packets in round-robin order, and sends are counted and
+			/// discarded. Used for benchmarking and for exercising the I/O paths where the driver
+			/// is not available. Safe to use from multiple threads at once. When bound to a
+			/// completion queue, overlapped operations are completed by posting to the queue.
+			/// </summary>
+			class SimulatedPacketSource : public PacketSource
+			{
+
+			public:
+
+				SimulatedPacketSource(const std::vector< std::vector<uint8_t> >& packets);
+
+				virtual ~SimulatedPacketSource();
+
+				virtual bool Receive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) override;
+
+				virtual bool TryReceive(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength) override;
+
+				virtual bool ReceiveEx(void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* readLength, void* overlapped) override;
+
+				virtual bool Send(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength) override;
+
+				virtual bool SendEx(const void* packet, uint32_t packetLength, PWINDIVERT_ADDRESS address, uint32_t* writeLength, void* overlapped) override;
+
+				virtual bool BindCompletionQueue(CompletionQueue* queue, uintptr_t key) override;
+
+				/// <summary>
+				/// The number of packets handed out so far.
+				/// </summary>
+				uint64_t ReceivedCount() const;
+
+				/// <summary>
+				/// The number of packets injected so far.
+				/// </summary>
+				uint64_t SentCount() const;
+
+			private:
+
+				SimulatedPacketSource(const SimulatedPacketSource&) = delete;
+
+				SimulatedPacketSource& operator=(const SimulatedPacketSource&) = delete;
+
+				/// <summary>
+				/// Atomic counters live here, so that this header stays usable from managed code.
+				/// </summary>
+				struct Counters;
+
+				std::vector< std::vector<uint8_t> > m_packets;
+
+				Counters* m_counters;
+
+				CompletionQueue* m_completionQueue = nullptr;
+
+				uintptr_t m_completionKey = 0;
+			};
+
+		} /* namespace Native */
+	} /* namespace Net */
+} /* namespace Divert */
+
+#ifdef _MANAGED
+#pragma managed(pop)
+#endif
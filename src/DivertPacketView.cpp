@@ -0,0 +1,227 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertPacketView.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		bool PacketView::Parse(array<System::Byte>^ packetBuffer, uint32_t packetLength, PacketView% view)
+		{
+			System::Exception^ e = nullptr;
+
+			if (packetBuffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"packetBuffer", u8"In PacketView::Parse(array<System::Byte>^, uint32_t, PacketView%) - Packet buffer cannot be null.");
+				throw e;
+			}
+
+			if (packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In PacketView::Parse(array<System::Byte>^, uint32_t, PacketView%) - Packet length exceeds the length of the buffer.");
+				throw e;
+			}
+
+			view = PacketView();
+
+			if (packetLength < 1)
+			{
+				return false;
+			}
+
+			uint32_t length = 0;
+			uint32_t offset = 0;
+			System::Byte protocol = 0;
+			System::Byte version = static_cast<System::Byte>(packetBuffer[0] >> 4);
+
+			switch (version)
+			{
+				case 4:
+				{
+					if (packetLength < 20)
+					{
+						return false;
+					}
+
+					uint32_t headerLength = static_cast<uint32_t>(packetBuffer[0] & 0x0F) * 4;
+					length = PacketViewReader::ReadUInt16(packetBuffer, 2);
+
+					if (headerLength < 20 || length < headerLength || length > packetLength)
+					{
+						return false;
+					}
+
+					offset = headerLength;
+
+					// Only the leading fragment carries the transport header.
+					if ((PacketViewReader::ReadUInt16(packetBuffer, 6) & 0x1FFF) == 0)
+					{
+						protocol = packetBuffer[9];
+					}
+				}
+				break;
+
+				case 6:
+				{
+					if (packetLength < 40)
+					{
+						return false;
+					}
+
+					length = 40 + static_cast<uint32_t>(PacketViewReader::ReadUInt16(packetBuffer, 4));
+
+					if (length > packetLength)
+					{
+						return false;
+					}
+
+					offset = 40;
+					protocol = SkipIPv6ExtensionHeaders(packetBuffer, length, packetBuffer[6], offset);
+				}
+				break;
+
+				default:
+					return false;
+			}
+
+			view.m_buffer = packetBuffer;
+			view.m_length = length;
+			view.m_networkProtocol = version;
+			view.m_payloadOffset = offset;
+
+			uint32_t transportLength = 0;
+
+			switch (protocol)
+			{
+				case TcpProtocol:
+				{
+					if (length - offset >= 20)
+					{
+						uint32_t headerLength = static_cast<uint32_t>(packetBuffer[offset + 12] >> 4) * 4;
+
+						if (headerLength >= 20 && headerLength <= length - offset)
+						{
+							transportLength = headerLength;
+						}
+					}
+				}
+				break;
+
+				case UdpProtocol:
+				case IcmpProtocol:
+				case Icmpv6Protocol:
+				{
+					// ICMP and ICMPv6 are only recognized under the IP version they belong to.
+					if ((protocol == IcmpProtocol && version != 4) || (protocol == Icmpv6Protocol && version != 6))
+					{
+						break;
+					}
+
+					if (length - offset >= 8)
+					{
+						transportLength = 8;
+					}
+				}
+				break;
+			}
+
+			if (transportLength > 0)
+			{
+				view.m_transportProtocol = protocol;
+				view.m_transportOffset = static_cast<int>(offset);
+				view.m_payloadOffset = offset + transportLength;
+			}
+
+			return true;
+		}
+
+		System::Byte PacketView::SkipIPv6ExtensionHeaders(array<System::Byte>^ packetBuffer, uint32_t packetLength, System::Byte nextHeader, uint32_t% offset)
+		{
+			for (;;)
+			{
+				uint32_t headerLength = 0;
+
+				switch (nextHeader)
+				{
+					// Hop-by-hop, routing and destination options.
+					case 0:
+					case 43:
+					case 60:
+					{
+						if (packetLength - offset < 8)
+						{
+							return 0;
+						}
+
+						headerLength = (static_cast<uint32_t>(packetBuffer[offset + 1]) + 1) * 8;
+					}
+					break;
+
+					// Authentication header, which counts its length in 4 byte units.
+					case 51:
+					{
+						if (packetLength - offset < 8)
+						{
+							return 0;
+						}
+
+						headerLength = (static_cast<uint32_t>(packetBuffer[offset + 1]) + 2) * 4;
+					}
+					break;
+
+					// Fragment header. Only the leading fragment carries the transport header.
+					case 44:
+					{
+						if (packetLength - offset < 8)
+						{
+							return 0;
+						}
+
+						if ((PacketViewReader::ReadUInt16(packetBuffer, static_cast<int>(offset) + 2) & 0xFFF8) != 0)
+						{
+							return 0;
+						}
+
+						headerLength = 8;
+					}
+					break;
+
+					default:
+						return nextHeader;
+				}
+
+				if (headerLength > packetLength - offset)
+				{
+					return 0;
+				}
+
+				nextHeader = packetBuffer[offset];
+				offset += headerLength;
+			}
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
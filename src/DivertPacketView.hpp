@@ -0,0 +1,745 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// Big endian field readers shared by the header views. Every view reads straight out of
+		/// the caller's buffer, so conversion from Network to Host Byte Order happens here.
+		/// </summary>
+		private ref class PacketViewReader abstract sealed
+		{
+
+		internal:
+
+			static uint16_t ReadUInt16(array<System::Byte>^ buffer, int offset)
+			{
+				return static_cast<uint16_t>((buffer[offset] << 8) | buffer[offset + 1]);
+			}
+
+			static uint32_t ReadUInt32(array<System::Byte>^ buffer, int offset)
+			{
+				return (static_cast<uint32_t>(buffer[offset]) << 24) | (static_cast<uint32_t>(buffer[offset + 1]) << 16) | (static_cast<uint32_t>(buffer[offset + 2]) << 8) | static_cast<uint32_t>(buffer[offset + 3]);
+			}
+
+			static System::Net::IPAddress^ ReadAddress(array<System::Byte>^ buffer, int offset, int length)
+			{
+				array<System::Byte>^ addressBytes = gcnew array<System::Byte>(length);
+				System::Buffer::BlockCopy(buffer, offset, addressBytes, 0, length);
+				return gcnew System::Net::IPAddress(addressBytes);
+			}
+
+		};
+
+		/// <summary>
+		/// A read only view of the IPv4 header of a packet parsed by PacketView::Parse. The view
+		/// holds nothing but a reference to the caller's buffer and the offset of the header in
+		/// it, so creating and copying one costs nothing. Unlike IPHeader, all multi-byte values
+		/// are returned in Host Byte Order and bit fields are returned as their plain values.
+		/// 
+		/// More information here: https://en.wikipedia.org/wiki/IPv4#Packet_structure
+		/// </summary>
+		public value struct IPHeaderView
+		{
+
+		public:
+
+			/// <summary>
+			/// The length of the header in 32 bit words.
+			/// </summary>
+			property System::Byte HeaderLength
+			{
+				System::Byte get() { return static_cast<System::Byte>(m_buffer[m_offset] & 0x0F); }
+			}
+
+			property System::Byte Version
+			{
+				System::Byte get() { return static_cast<System::Byte>(m_buffer[m_offset] >> 4); }
+			}
+
+			property System::Byte TOS
+			{
+				System::Byte get() { return m_buffer[m_offset + 1]; }
+			}
+
+			property uint16_t Length
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 2); }
+			}
+
+			property uint16_t Id
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 4); }
+			}
+
+			/// <summary>
+			/// The fragment offset in units of 8 bytes, without the flag bits.
+			/// </summary>
+			property uint16_t FragOff
+			{
+				uint16_t get() { return static_cast<uint16_t>(PacketViewReader::ReadUInt16(m_buffer, m_offset + 6) & 0x1FFF); }
+			}
+
+			property uint16_t MF
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 6] >> 5) & 0x01); }
+			}
+
+			property uint16_t DF
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 6] >> 6) & 0x01); }
+			}
+
+			property uint16_t Reserved
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 6] >> 7) & 0x01); }
+			}
+
+			property System::Byte TTL
+			{
+				System::Byte get() { return m_buffer[m_offset + 8]; }
+			}
+
+			property System::Byte Protocol
+			{
+				System::Byte get() { return m_buffer[m_offset + 9]; }
+			}
+
+			property uint16_t Checksum
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 10); }
+			}
+
+			/// <summary>
+			/// The source address in Host Byte Order, e.g. 0x7F000001 for 127.0.0.1.
+			/// </summary>
+			property uint32_t SourceAddressValue
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 12); }
+			}
+
+			/// <summary>
+			/// The destination address in Host Byte Order, e.g. 0x7F000001 for 127.0.0.1.
+			/// </summary>
+			property uint32_t DestinationAddressValue
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 16); }
+			}
+
+			/// <summary>
+			/// Check if this view refers to an IPv4 header. Reading any other member of an invalid
+			/// view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+			/// <summary>
+			/// Builds a new IPAddress from the source address. This allocates, so prefer
+			/// SourceAddressValue on hot paths.
+			/// </summary>
+			System::Net::IPAddress^ GetSourceAddress()
+			{
+				return PacketViewReader::ReadAddress(m_buffer, m_offset + 12, 4);
+			}
+
+			/// <summary>
+			/// Builds a new IPAddress from the destination address. This allocates, so prefer
+			/// DestinationAddressValue on hot paths.
+			/// </summary>
+			System::Net::IPAddress^ GetDestinationAddress()
+			{
+				return PacketViewReader::ReadAddress(m_buffer, m_offset + 16, 4);
+			}
+
+		internal:
+
+			IPHeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// A read only view of the IPv6 header of a packet parsed by PacketView::Parse. All
+		/// multi-byte values are returned in Host Byte Order.
+		/// 
+		/// More information here: https://en.wikipedia.org/wiki/IPv6_packet#Fixed_header
+		/// </summary>
+		public value struct IPv6HeaderView
+		{
+
+		public:
+
+			/// <summary>
+			/// The length of the payload following the fixed header, extension headers included.
+			/// </summary>
+			property uint16_t Length
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 4); }
+			}
+
+			property System::Byte Version
+			{
+				System::Byte get() { return static_cast<System::Byte>(m_buffer[m_offset] >> 4); }
+			}
+
+			property uint32_t TrafficClass
+			{
+				uint32_t get() { return static_cast<uint32_t>(((m_buffer[m_offset] & 0x0F) << 4) | (m_buffer[m_offset + 1] >> 4)); }
+			}
+
+			property uint32_t FlowLabel
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset) & 0x000FFFFF; }
+			}
+
+			property System::Byte NextHeader
+			{
+				System::Byte get() { return m_buffer[m_offset + 6]; }
+			}
+
+			property System::Byte HopLimit
+			{
+				System::Byte get() { return m_buffer[m_offset + 7]; }
+			}
+
+			/// <summary>
+			/// Check if this view refers to an IPv6 header. Reading any other member of an invalid
+			/// view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+			/// <summary>
+			/// Builds a new IPAddress from the source address. This allocates.
+			/// </summary>
+			System::Net::IPAddress^ GetSourceAddress()
+			{
+				return PacketViewReader::ReadAddress(m_buffer, m_offset + 8, 16);
+			}
+
+			/// <summary>
+			/// Builds a new IPAddress from the destination address. This allocates.
+			/// </summary>
+			System::Net::IPAddress^ GetDestinationAddress()
+			{
+				return PacketViewReader::ReadAddress(m_buffer, m_offset + 24, 16);
+			}
+
+		internal:
+
+			IPv6HeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// A read only view of the ICMP header of a packet parsed by PacketView::Parse.
+		/// 
+		/// More information here:
+		/// https://en.wikipedia.org/wiki/Internet_Control_Message_Protocol#ICMP_datagram_structure
+		/// </summary>
+		public value struct ICMPHeaderView
+		{
+
+		public:
+
+			property System::Byte Type
+			{
+				System::Byte get() { return m_buffer[m_offset]; }
+			}
+
+			property System::Byte Code
+			{
+				System::Byte get() { return m_buffer[m_offset + 1]; }
+			}
+
+			property uint16_t Checksum
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 2); }
+			}
+
+			property uint32_t Body
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 4); }
+			}
+
+			/// <summary>
+			/// Check if this view refers to an ICMP header. Reading any other member of an invalid
+			/// view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+		internal:
+
+			ICMPHeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// A read only view of the ICMPv6 header of a packet parsed by PacketView::Parse.
+		/// 
+		/// More information here: https://en.wikipedia.org/wiki/ICMPv6#Packet_format
+		/// </summary>
+		public value struct ICMPv6HeaderView
+		{
+
+		public:
+
+			property System::Byte Type
+			{
+				System::Byte get() { return m_buffer[m_offset]; }
+			}
+
+			property System::Byte Code
+			{
+				System::Byte get() { return m_buffer[m_offset + 1]; }
+			}
+
+			property uint16_t Checksum
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 2); }
+			}
+
+			property uint32_t Body
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 4); }
+			}
+
+			/// <summary>
+			/// Check if this view refers to an ICMPv6 header. Reading any other member of an
+			/// invalid view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+		internal:
+
+			ICMPv6HeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// A read only view of the TCP header of a packet parsed by PacketView::Parse. All
+		/// multi-byte values are returned in Host Byte Order.
+		/// 
+		/// More information here: https://en.wikipedia.org/wiki/Transmission_Control_Protocol#TCP_segment_structure
+		/// </summary>
+		public value struct TCPHeaderView
+		{
+
+		public:
+
+			property uint16_t SourcePort
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset); }
+			}
+
+			property uint16_t DestinationPort
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 2); }
+			}
+
+			property uint32_t SequenceNumber
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 4); }
+			}
+
+			property uint32_t AcknowledgmentNumber
+			{
+				uint32_t get() { return PacketViewReader::ReadUInt32(m_buffer, m_offset + 8); }
+			}
+
+			property uint16_t Reserved1
+			{
+				uint16_t get() { return static_cast<uint16_t>(m_buffer[m_offset + 12] & 0x0F); }
+			}
+
+			/// <summary>
+			/// The length of the header in 32 bit words.
+			/// </summary>
+			property uint16_t HeaderLength
+			{
+				uint16_t get() { return static_cast<uint16_t>(m_buffer[m_offset + 12] >> 4); }
+			}
+
+			property uint16_t Fin
+			{
+				uint16_t get() { return static_cast<uint16_t>(m_buffer[m_offset + 13] & 0x01); }
+			}
+
+			property uint16_t Syn
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 13] >> 1) & 0x01); }
+			}
+
+			property uint16_t Rst
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 13] >> 2) & 0x01); }
+			}
+
+			property uint16_t Psh
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 13] >> 3) & 0x01); }
+			}
+
+			property uint16_t Ack
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 13] >> 4) & 0x01); }
+			}
+
+			property uint16_t Urg
+			{
+				uint16_t get() { return static_cast<uint16_t>((m_buffer[m_offset + 13] >> 5) & 0x01); }
+			}
+
+			property uint16_t Reserved2
+			{
+				uint16_t get() { return static_cast<uint16_t>(m_buffer[m_offset + 13] >> 6); }
+			}
+
+			property uint16_t WindowSize
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 14); }
+			}
+
+			property uint16_t Checksum
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 16); }
+			}
+
+			property uint16_t UrgentPointer
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 18); }
+			}
+
+			/// <summary>
+			/// Check if this view refers to a TCP header. Reading any other member of an invalid
+			/// view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+		internal:
+
+			TCPHeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// A read only view of the UDP header of a packet parsed by PacketView::Parse. All
+		/// multi-byte values are returned in Host Byte Order.
+		/// 
+		/// More information here:
+		/// https://en.wikipedia.org/wiki/User_Datagram_Protocol#Packet_structure
+		/// </summary>
+		public value struct UDPHeaderView
+		{
+
+		public:
+
+			property uint16_t SourcePort
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset); }
+			}
+
+			property uint16_t DestinationPort
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 2); }
+			}
+
+			property uint16_t Length
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 4); }
+			}
+
+			property uint16_t Checksum
+			{
+				uint16_t get() { return PacketViewReader::ReadUInt16(m_buffer, m_offset + 6); }
+			}
+
+			/// <summary>
+			/// Check if this view refers to a UDP header. Reading any other member of an invalid
+			/// view throws.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_buffer != nullptr; }
+			}
+
+		internal:
+
+			UDPHeaderView(array<System::Byte>^ buffer, int offset) : m_buffer(buffer), m_offset(offset)
+			{
+
+			}
+
+		private:
+
+			array<System::Byte>^ m_buffer;
+
+			int m_offset;
+
+		};
+
+		/// <summary>
+		/// An allocation free alternative to Diversion::ParsePacket. Where ParsePacket needs up to
+		/// six header objects and pins the buffer for the duration of the call, PacketView is a
+		/// value type that records where each header starts in the caller's buffer and hands out
+		/// header views on demand. Parsing is done entirely in managed code, so the buffer is
+		/// never pinned, and nothing is allocated unless one of the GetXxxAddress methods on a
+		/// header view is called.
+		/// 
+		/// The views read the buffer lazily, so they see any changes made to the buffer after
+		/// parsing. Changing the buffer in a way that moves headers around (e.g. changing the IP
+		/// header length) requires the packet to be parsed again.
+		/// </summary>
+		public value struct PacketView
+		{
+
+		public:
+
+			/// <summary>
+			/// Parses the IP and transport headers of a raw packet, such as one delivered by one of
+			/// the Receive methods, without allocating or pinning anything.
+			/// </summary>
+			/// <param name="packetBuffer">
+			/// The buffer holding the packet. The packet must start at the first byte.
+			/// </param>
+			/// <param name="packetLength">
+			/// The length of valid data in the buffer.
+			/// </param>
+			/// <param name="view">
+			/// Receives the parsed view. When parsing fails, this is set to an empty view with no
+			/// valid headers.
+			/// </param>
+			/// <returns>
+			/// True if a well formed IPv4 or IPv6 header was found, false otherwise. A true return
+			/// does not imply a transport header was found, since the packet may carry a protocol
+			/// that isn't understood or may be a non-leading fragment.
+			/// </returns>
+			static bool Parse(array<System::Byte>^ packetBuffer, uint32_t packetLength, [System::Runtime::InteropServices::Out] PacketView% view);
+
+			/// <summary>
+			/// The buffer this view reads from.
+			/// </summary>
+			property array<System::Byte>^ Buffer
+			{
+				array<System::Byte>^ get() { return m_buffer; }
+			}
+
+			/// <summary>
+			/// The length of the packet, as given by the IP header.
+			/// </summary>
+			property uint32_t Length
+			{
+				uint32_t get() { return m_length; }
+			}
+
+			/// <summary>
+			/// The offset in Buffer of the first byte after the last header that was parsed.
+			/// </summary>
+			property uint32_t PayloadOffset
+			{
+				uint32_t get() { return m_payloadOffset; }
+			}
+
+			/// <summary>
+			/// The number of bytes from PayloadOffset to the end of the packet.
+			/// </summary>
+			property uint32_t PayloadLength
+			{
+				uint32_t get() { return m_length - m_payloadOffset; }
+			}
+
+			/// <summary>
+			/// The IPv4 header, if the packet is an IPv4 packet.
+			/// </summary>
+			property IPHeaderView IP
+			{
+				IPHeaderView get() { return m_networkProtocol == 4 ? IPHeaderView(m_buffer, 0) : IPHeaderView(); }
+			}
+
+			/// <summary>
+			/// The IPv6 header, if the packet is an IPv6 packet.
+			/// </summary>
+			property IPv6HeaderView IPv6
+			{
+				IPv6HeaderView get() { return m_networkProtocol == 6 ? IPv6HeaderView(m_buffer, 0) : IPv6HeaderView(); }
+			}
+
+			/// <summary>
+			/// The ICMP header, if the packet is an IPv4 packet carrying ICMP.
+			/// </summary>
+			property ICMPHeaderView ICMP
+			{
+				ICMPHeaderView get() { return m_transportProtocol == IcmpProtocol ? ICMPHeaderView(m_buffer, m_transportOffset) : ICMPHeaderView(); }
+			}
+
+			/// <summary>
+			/// The ICMPv6 header, if the packet is an IPv6 packet carrying ICMPv6.
+			/// </summary>
+			property ICMPv6HeaderView ICMPv6
+			{
+				ICMPv6HeaderView get() { return m_transportProtocol == Icmpv6Protocol ? ICMPv6HeaderView(m_buffer, m_transportOffset) : ICMPv6HeaderView(); }
+			}
+
+			/// <summary>
+			/// The TCP header, if the packet carries TCP.
+			/// </summary>
+			property TCPHeaderView TCP
+			{
+				TCPHeaderView get() { return m_transportProtocol == TcpProtocol ? TCPHeaderView(m_buffer, m_transportOffset) : TCPHeaderView(); }
+			}
+
+			/// <summary>
+			/// The UDP header, if the packet carries UDP.
+			/// </summary>
+			property UDPHeaderView UDP
+			{
+				UDPHeaderView get() { return m_transportProtocol == UdpProtocol ? UDPHeaderView(m_buffer, m_transportOffset) : UDPHeaderView(); }
+			}
+
+			/// <summary>
+			/// Check if the view holds a parsed packet.
+			/// </summary>
+			property bool Valid
+			{
+				bool get() { return m_networkProtocol != 0; }
+			}
+
+		private:
+
+			literal System::Byte IcmpProtocol = 1;
+
+			literal System::Byte TcpProtocol = 6;
+
+			literal System::Byte UdpProtocol = 17;
+
+			literal System::Byte Icmpv6Protocol = 58;
+
+			/// <summary>
+			/// Walks the IPv6 extension header chain starting right after the fixed header.
+			/// </summary>
+			/// <returns>
+			/// The protocol of the first header that isn't an extension header, or zero if the
+			/// chain is malformed or ends in a non-leading fragment. The offset of that header is
+			/// stored in offset.
+			/// </returns>
+			static System::Byte SkipIPv6ExtensionHeaders(array<System::Byte>^ packetBuffer, uint32_t packetLength, System::Byte nextHeader, uint32_t% offset);
+
+			/// <summary>
+			/// The buffer the packet was parsed from.
+			/// </summary>
+			array<System::Byte>^ m_buffer;
+
+			/// <summary>
+			/// The length of the packet, as given by the IP header.
+			/// </summary>
+			uint32_t m_length;
+
+			/// <summary>
+			/// The offset of the transport header, when one was found.
+			/// </summary>
+			int m_transportOffset;
+
+			/// <summary>
+			/// The offset of the first byte after the last parsed header.
+			/// </summary>
+			uint32_t m_payloadOffset;
+
+			/// <summary>
+			/// The IP version of the packet, or zero if it has not been parsed.
+			/// </summary>
+			System::Byte m_networkProtocol;
+
+			/// <summary>
+			/// The IANA protocol number of the transport header, or zero if none was found.
+			/// </summary>
+			System::Byte m_transportProtocol;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
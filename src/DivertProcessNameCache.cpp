@@ -0,0 +1,378 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <Windows.h>
+#include "DivertProcessNameCache.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			const uint32_t DefaultCapacity = 1024;
+
+			/// <summary>
+			/// How long, in milliseconds, a process that couldn't be opened is reported as SYSTEM
+			/// before it is tried again.
+			/// </summary>
+			const int64_t UnopenableTimeToLive = 1000;
+
+			bool IsSystemProcess(uint32_t processId)
+			{
+				return processId == 0 || processId == 4;
+			}
+		}
+
+		static ProcessNameCache::ProcessNameCache()
+		{
+			s_lock = gcnew System::Object();
+			s_entries = gcnew System::Collections::Generic::Dictionary<uint32_t, Entry^>();
+			s_capacity = DefaultCapacity;
+		}
+
+		ProcessNameCache::ProcessWaitHandle::ProcessWaitHandle(System::IntPtr processHandle)
+		{
+			SafeWaitHandle = gcnew Microsoft::Win32::SafeHandles::SafeWaitHandle(processHandle, true);
+		}
+
+		System::String^ ProcessNameCache::GetName(uint32_t processId)
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				if (IsSystemProcess(processId))
+				{
+					++s_hits;
+					return u8"SYSTEM";
+				}
+
+				Entry^ entry = nullptr;
+
+				if (s_entries->TryGetValue(processId, entry))
+				{
+					if (entry->ExpiresAt == 0 || entry->ExpiresAt > System::Diagnostics::Stopwatch::GetTimestamp())
+					{
+						++s_hits;
+						return entry->Name;
+					}
+
+					s_entries->Remove(processId);
+					Release(entry);
+				}
+
+				++s_misses;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+
+			// Opening the process can take a while, so it's done outside the lock.
+			Entry^ resolved = Resolve(processId);
+
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				Entry^ existing = nullptr;
+
+				if (s_entries->TryGetValue(processId, existing))
+				{
+					// Resolved by someone else in the meantime.
+					Release(resolved);
+					return existing->Name;
+				}
+
+				if (static_cast<uint32_t>(s_entries->Count) >= s_capacity)
+				{
+					MakeRoom();
+				}
+
+				resolved->Generation = ++s_generation;
+				s_entries->Add(processId, resolved);
+
+				if (resolved->ExitHandle != nullptr)
+				{
+					// Watch for the process exiting. Registered only once the entry is in place, so
+					// an exit is never missed, and with the generation current, so it is matched.
+					resolved->ExitWait = System::Threading::ThreadPool::RegisterWaitForSingleObject(
+						resolved->ExitHandle,
+						gcnew System::Threading::WaitOrTimerCallback(&ProcessNameCache::OnProcessExited),
+						resolved,
+						System::Threading::Timeout::Infinite,
+						true
+					);
+				}
+
+				return resolved->Name;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		ProcessNameCache::Entry^ ProcessNameCache::Resolve(uint32_t processId)
+		{
+			Entry^ entry = gcnew Entry();
+			entry->ProcessId = processId;
+			entry->Name = u8"SYSTEM";
+
+			// SYNCHRONIZE so that the handle can be waited on. Holding it open also stops the ID
+			// from being reused until the entry is released.
+			HANDLE processHandle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, FALSE, processId);
+
+			if (processHandle != nullptr && processHandle != INVALID_HANDLE_VALUE)
+			{
+				wchar_t filename[MAX_PATH];
+				DWORD resSize = MAX_PATH;
+
+				if (QueryFullProcessImageNameW(processHandle, 0, filename, &resSize) != 0)
+				{
+					entry->Name = System::String::Intern(gcnew System::String(filename, 0, static_cast<int>(resSize)));
+					entry->ExitHandle = gcnew ProcessWaitHandle(System::IntPtr(processHandle));
+					return entry;
+				}
+
+				CloseHandle(processHandle);
+			}
+
+			// Failed to open a valid handle, or to get the module filename. This is almost surely a
+			// SYSTEM process, or protected by AV, or the process is closed and the ID reassigned
+			// before this call is processed. Let's not throw any errors, but let's not keep trying
+			// on every packet either.
+			entry->ExpiresAt = System::Diagnostics::Stopwatch::GetTimestamp() + (UnopenableTimeToLive * System::Diagnostics::Stopwatch::Frequency) / 1000;
+
+			return entry;
+		}
+
+		void ProcessNameCache::Release(Entry^ entry)
+		{
+			if (entry->ExitWait != nullptr)
+			{
+				entry->ExitWait->Unregister(nullptr);
+				entry->ExitWait = nullptr;
+			}
+
+			if (entry->ExitHandle != nullptr)
+			{
+				delete entry->ExitHandle;
+				entry->ExitHandle = nullptr;
+			}
+		}
+
+		void ProcessNameCache::MakeRoom()
+		{
+			// Entries that can only expire go first, as they are the cheapest to lose.
+			System::Collections::Generic::List<uint32_t>^ victims = gcnew System::Collections::Generic::List<uint32_t>();
+			const int64_t now = System::Diagnostics::Stopwatch::GetTimestamp();
+
+			for each (System::Collections::Generic::KeyValuePair<uint32_t, Entry^> pair in s_entries)
+			{
+				if (pair.Value->ExpiresAt != 0 && pair.Value->ExpiresAt <= now)
+				{
+					victims->Add(pair.Key);
+				}
+			}
+
+			for each (uint32_t processId in victims)
+			{
+				Release(s_entries[processId]);
+				s_entries->Remove(processId);
+			}
+
+			if (static_cast<uint32_t>(s_entries->Count) < s_capacity)
+			{
+				return;
+			}
+
+			// Drop an eighth of the cache, so that a full cache isn't swept again on every miss.
+			victims->Clear();
+
+			const int toEvict = System::Math::Max(1, s_entries->Count / 8);
+
+			for each (uint32_t processId in s_entries->Keys)
+			{
+				if (victims->Count == toEvict)
+				{
+					break;
+				}
+
+				victims->Add(processId);
+			}
+
+			for each (uint32_t processId in victims)
+			{
+				Release(s_entries[processId]);
+				s_entries->Remove(processId);
+				++s_evictions;
+			}
+		}
+
+		void ProcessNameCache::OnProcessExited(System::Object^ state, bool timedOut)
+		{
+			Entry^ exited = safe_cast<Entry^>(state);
+
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				Entry^ current = nullptr;
+
+				// Only drop the entry for this generation of the process ID. If the entry has been
+				// replaced, the one in the cache belongs to a later process.
+				if (s_entries->TryGetValue(exited->ProcessId, current) && current->Generation == exited->Generation)
+				{
+					s_entries->Remove(exited->ProcessId);
+					Release(current);
+					++s_invalidations;
+				}
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		void ProcessNameCache::Clear()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				for each (Entry^ entry in s_entries->Values)
+				{
+					Release(entry);
+				}
+
+				s_entries->Clear();
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		void ProcessNameCache::ResetStatistics()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				s_hits = 0;
+				s_misses = 0;
+				s_evictions = 0;
+				s_invalidations = 0;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		uint32_t ProcessNameCache::Capacity::get()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				return s_capacity;
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		void ProcessNameCache::Capacity::set(uint32_t value)
+		{
+			if (value == 0)
+			{
+				throw gcnew System::ArgumentOutOfRangeException(u8"value", u8"In ProcessNameCache::Capacity::set(uint32_t) - Capacity must be greater than zero.");
+			}
+
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				s_capacity = value;
+
+				while (static_cast<uint32_t>(s_entries->Count) > s_capacity)
+				{
+					MakeRoom();
+				}
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		uint32_t ProcessNameCache::Count::get()
+		{
+			System::Threading::Monitor::Enter(s_lock);
+
+			try
+			{
+				return static_cast<uint32_t>(s_entries->Count);
+			}
+			finally
+			{
+				System::Threading::Monitor::Exit(s_lock);
+			}
+		}
+
+		uint64_t ProcessNameCache::Hits::get()
+		{
+			return static_cast<uint64_t>(System::Threading::Interlocked::Read(s_hits));
+		}
+
+		uint64_t ProcessNameCache::Misses::get()
+		{
+			return static_cast<uint64_t>(System::Threading::Interlocked::Read(s_misses));
+		}
+
+		uint64_t ProcessNameCache::Evictions::get()
+		{
+			return static_cast<uint64_t>(System::Threading::Interlocked::Read(s_evictions));
+		}
+
+		uint64_t ProcessNameCache::Invalidations::get()
+		{
+			return static_cast<uint64_t>(System::Threading::Interlocked::Read(s_invalidations));
+		}
+
+		double ProcessNameCache::HitRate::get()
+		{
+			const uint64_t hits = Hits;
+			const uint64_t lookups = hits + Misses;
+
+			return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,212 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// Remembers the image path of each process Diversion.GetPacketProcess has resolved, so
+		/// that repeat lookups neither open the process nor allocate. Names are interned, so every
+		/// process running the same image shares one string. Each cached process is watched, and
+		/// its entry is dropped as soon as it exits, before its ID can be handed to a new process.
+		/// Entries are tagged with a generation, so that the exit of an earlier process with the
+		/// same ID can never drop the entry of a later one.
+		/// </summary>
+		public ref class ProcessNameCache abstract sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Forgets every cached process.
+			/// </summary>
+			static void Clear();
+
+			/// <summary>
+			/// Zeroes Hits, Misses, Evictions and Invalidations.
+			/// </summary>
+			static void ResetStatistics();
+
+			/// <summary>
+			/// The maximum number of processes remembered. Must be greater than zero.
+			/// </summary>
+			static property uint32_t Capacity
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			/// <summary>
+			/// The number of processes currently cached.
+			/// </summary>
+			static property uint32_t Count
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Lookups answered from the cache.
+			/// </summary>
+			static property uint64_t Hits
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Lookups that had to open the process.
+			/// </summary>
+			static property uint64_t Misses
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Live entries dropped because the cache was full.
+			/// </summary>
+			static property uint64_t Evictions
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Entries dropped because their process exited.
+			/// </summary>
+			static property uint64_t Invalidations
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Hits as a fraction of all lookups, or zero if there haven't been any.
+			/// </summary>
+			static property double HitRate
+			{
+				double get();
+			}
+
+		internal:
+
+			/// <summary>
+			/// Gets the full path to the binary of a process.
+			/// </summary>
+			/// <param name="processId">
+			/// The process ID. 0 and 4 imply SYSTEM.
+			/// </param>
+			/// <returns>
+			/// The interned path of the process' image, or "SYSTEM" if the process can't be opened,
+			/// which is almost surely because it is a SYSTEM process or protected by AV.
+			/// </returns>
+			static System::String^ GetName(uint32_t processId);
+
+		private:
+
+			/// <summary>
+			/// A cached process. Processes that could be opened are watched through ExitHandle.
+			/// Those that couldn't are remembered as "SYSTEM" until ExpiresAt, so that they aren't
+			/// opened again for every packet.
+			/// </summary>
+			ref class Entry sealed
+			{
+
+			public:
+
+				uint32_t ProcessId;
+
+				uint64_t Generation;
+
+				System::String^ Name;
+
+				/// <summary>
+				/// Stopwatch timestamp after which the entry is stale, or zero if it only goes when
+				/// the process exits.
+				/// </summary>
+				int64_t ExpiresAt;
+
+				System::Threading::WaitHandle^ ExitHandle;
+
+				System::Threading::RegisteredWaitHandle^ ExitWait;
+			};
+
+			/// <summary>
+			/// Lets a process handle be waited on through the thread pool.
+			/// </summary>
+			ref class ProcessWaitHandle sealed : System::Threading::WaitHandle
+			{
+
+			public:
+
+				ProcessWaitHandle(System::IntPtr processHandle);
+			};
+
+			static ProcessNameCache();
+
+			/// <summary>
+			/// Opens a process, and builds an entry for it.
+			/// </summary>
+			static Entry^ Resolve(uint32_t processId);
+
+			/// <summary>
+			/// Stops watching an entry's process and closes its handle.
+			/// </summary>
+			static void Release(Entry^ entry);
+
+			/// <summary>
+			/// Makes room for one more entry. Must hold s_lock.
+			/// </summary>
+			static void MakeRoom();
+
+			/// <summary>
+			/// Invoked on the thread pool when a cached process exits.
+			/// </summary>
+			static void OnProcessExited(System::Object^ state, bool timedOut);
+
+			static System::Object^ s_lock;
+
+			static System::Collections::Generic::Dictionary<uint32_t, Entry^>^ s_entries;
+
+			static uint32_t s_capacity;
+
+			static uint64_t s_generation;
+
+			/// <summary>
+			/// Counters are only written under s_lock, but are signed so that they can be read with
+			/// Interlocked::Read without it.
+			/// </summary>
+			static int64_t s_hits;
+
+			static int64_t s_misses;
+
+			static int64_t s_evictions;
+
+			static int64_t s_invalidations;
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
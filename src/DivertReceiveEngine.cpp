@@ -0,0 +1,261 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertReceiveEngine.hpp"
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		ReceiveEngine::ReceiveEngine(Diversion^ diversion, uint32_t readsInFlight, uint32_t workerCount, uint32_t maxPacketLength, PacketReceivedHandler^ handler)
+		{
+			System::Exception^ e = nullptr;
+
+			if (diversion == nullptr || handler == nullptr)
+			{
+				e = gcnew System::ArgumentException(u8"In ReceiveEngine::ReceiveEngine(Diversion^, uint32_t, uint32_t, uint32_t, PacketReceivedHandler^) - Diversion and handler must not be null.");
+				throw e;
+			}
+
+			if (readsInFlight == 0 || workerCount == 0 || maxPacketLength == 0 || maxPacketLength > static_cast<uint32_t>(System::Int32::MaxValue))
+			{
+				e = gcnew System::ArgumentException(u8"In ReceiveEngine::ReceiveEngine(Diversion^, uint32_t, uint32_t, uint32_t, PacketReceivedHandler^) - Reads in flight, worker count and maximum packet length must all be greater than zero.");
+				throw e;
+			}
+
+			if (diversion->UnmanagedPacketSource == nullptr)
+			{
+				e = gcnew System::Exception(u8"In ReceiveEngine::ReceiveEngine(Diversion^, uint32_t, uint32_t, uint32_t, PacketReceivedHandler^) - Supplied Diversion is not open.");
+				throw e;
+			}
+
+			m_diversion = diversion;
+			m_handler = handler;
+			m_readsInFlight = readsInFlight;
+			m_workerCount = workerCount;
+
+			m_buffers = gcnew array<array<System::Byte>^>(readsInFlight);
+			m_bufferPins = gcnew array<System::Runtime::InteropServices::GCHandle>(readsInFlight);
+			m_addresses = gcnew array<Address^>(readsInFlight);
+
+			std::vector<uint8_t*> buffers(readsInFlight);
+			std::vector<PWINDIVERT_ADDRESS> addresses(readsInFlight);
+
+			for (uint32_t i = 0; i < readsInFlight; ++i)
+			{
+				m_buffers[i] = gcnew array<System::Byte>(static_cast<int>(maxPacketLength));
+				m_bufferPins[i] = System::Runtime::InteropServices::GCHandle::Alloc(m_buffers[i], System::Runtime::InteropServices::GCHandleType::Pinned);
+				m_addresses[i] = gcnew Address();
+
+				buffers[i] = static_cast<uint8_t*>(m_bufferPins[i].AddrOfPinnedObject().ToPointer());
+				addresses[i] = m_addresses[i]->UnmanagedAddress;
+			}
+
+			Native::CompletionQueue* queue = Native::CompletionQueue::Create(workerCount);
+
+			if (queue == nullptr)
+			{
+				e = gcnew System::ComponentModel::Win32Exception(Native::GetNativeLastError(), u8"In ReceiveEngine::ReceiveEngine(Diversion^, uint32_t, uint32_t, uint32_t, PacketReceivedHandler^) - Failed to create completion port.");
+				throw e;
+			}
+
+			m_dispatcher = new Native::CompletionDispatcher(queue);
+
+			m_callback = gcnew NativePacketCallback(this, &ReceiveEngine::OnPacket);
+
+			Native::ReceiveEngine::PacketCallback callback = static_cast<Native::ReceiveEngine::PacketCallback>(System::Runtime::InteropServices::Marshal::GetFunctionPointerForDelegate(m_callback).ToPointer());
+
+			m_engine = new Native::ReceiveEngine(diversion->UnmanagedPacketSource, m_dispatcher, buffers.data(), addresses.data(), readsInFlight, maxPacketLength, callback, nullptr);
+
+			// Reads made by the engine show up in the diversion's statistics like any other.
+			m_engine->SetStatistics(diversion->UnmanagedStatistics);
+		}
+
+		ReceiveEngine::~ReceiveEngine()
+		{
+			this->!ReceiveEngine();
+		}
+
+		ReceiveEngine::!ReceiveEngine()
+		{
+			if (m_engine != nullptr)
+			{
+				delete m_engine;
+				m_engine = nullptr;
+			}
+
+			if (m_dispatcher != nullptr)
+			{
+				delete m_dispatcher;
+				m_dispatcher = nullptr;
+			}
+
+			if (m_bufferPins != nullptr)
+			{
+				for (int i = 0; i < m_bufferPins->Length; ++i)
+				{
+					if (m_bufferPins[i].IsAllocated)
+					{
+						m_bufferPins[i].Free();
+					}
+				}
+			}
+		}
+
+		void ReceiveEngine::Start()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_engine == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"In ReceiveEngine::Start() - Engine has been disposed.");
+				throw e;
+			}
+
+			m_handlerException = nullptr;
+
+			if (!m_dispatcher->Start(m_workerCount))
+			{
+				e = gcnew System::Exception(u8"In ReceiveEngine::Start() - Failed to start completion workers.");
+				throw e;
+			}
+
+			if (!m_engine->Start())
+			{
+				int lastError = Native::GetNativeLastError();
+
+				m_dispatcher->Stop();
+
+				e = gcnew System::ComponentModel::Win32Exception(lastError, u8"In ReceiveEngine::Start() - Failed to post reads.");
+				throw e;
+			}
+		}
+
+		void ReceiveEngine::Stop()
+		{
+			if (m_engine == nullptr)
+			{
+				return;
+			}
+
+			m_engine->Stop();
+			m_dispatcher->Stop();
+
+			System::Exception^ handlerException = m_handlerException;
+
+			if (handlerException != nullptr)
+			{
+				m_handlerException = nullptr;
+
+				System::Exception^ e = gcnew System::Exception(u8"In ReceiveEngine::Stop() - PacketReceivedHandler threw an exception while the engine was running.", handlerException);
+				throw e;
+			}
+		}
+
+		void ReceiveEngine::ResetStatistics()
+		{
+			if (m_engine != nullptr)
+			{
+				m_engine->ResetStatistics();
+			}
+		}
+
+		array<double>^ ReceiveEngine::GetLatencyPercentiles(array<double>^ percentiles)
+		{
+			System::Exception^ e = nullptr;
+
+			if (percentiles == nullptr || percentiles->Length == 0)
+			{
+				e = gcnew System::ArgumentException(u8"In ReceiveEngine::GetLatencyPercentiles(array<double>^) - At least one percentile must be supplied.");
+				throw e;
+			}
+
+			array<double>^ results = gcnew array<double>(percentiles->Length);
+
+			if (m_engine == nullptr)
+			{
+				return results;
+			}
+
+			std::vector<double> requested(percentiles->Length);
+			std::vector<uint64_t> nanoseconds(percentiles->Length);
+
+			for (int i = 0; i < percentiles->Length; ++i)
+			{
+				requested[i] = percentiles[i];
+			}
+
+			m_engine->LatencyPercentiles(requested.data(), static_cast<uint32_t>(requested.size()), nanoseconds.data());
+
+			for (int i = 0; i < percentiles->Length; ++i)
+			{
+				results[i] = static_cast<double>(nanoseconds[i]) / 1000.0;
+			}
+
+			return results;
+		}
+
+		uint64_t ReceiveEngine::Completed::get()
+		{
+			return m_engine == nullptr ? 0 : m_engine->CompletedCount();
+		}
+
+		uint64_t ReceiveEngine::Failed::get()
+		{
+			return m_engine == nullptr ? 0 : m_engine->FailedCount();
+		}
+
+		uint32_t ReceiveEngine::ReadsInFlight::get()
+		{
+			return m_readsInFlight;
+		}
+
+		uint32_t ReceiveEngine::WorkerCount::get()
+		{
+			return m_workerCount;
+		}
+
+		void ReceiveEngine::OnPacket(void* context, uint32_t slot, const uint8_t* packet, uint32_t length, PWINDIVERT_ADDRESS address, int32_t error)
+		{
+			if (error != 0)
+			{
+				return;
+			}
+
+			// This runs on a native worker thread, an exception escaping from here would take the
+			// whole process down. Keep the first one for Stop() to report.
+			try
+			{
+				m_handler(m_buffers[slot], length, m_addresses[slot]);
+			}
+			catch (System::Exception^ handlerException)
+			{
+				System::Threading::Interlocked::CompareExchange<System::Exception^>(m_handlerException, handlerException, nullptr);
+			}
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
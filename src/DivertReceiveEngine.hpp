@@ -0,0 +1,219 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Diversion.hpp"
+#include "DivertAddress.hpp"
+#include "DivertCompletionQueue.hpp"
+#include "DivertNativeReceiveEngine.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// Handler for packets read by a ReceiveEngine. The packet buffer and address belong to the
+		/// engine and are reused for the next read as soon as the handler returns, so anything
+		/// that must outlive the call has to be copied out. Invoked concurrently on the engine's
+		/// worker threads.
+		/// </summary>
+		/// <param name="packet">
+		/// The buffer holding the packet. May be longer than the packet.
+		/// </param>
+		/// <param name="length">
+		/// The length of the packet.
+		/// </param>
+		/// <param name="address">
+		/// The address the packet was read with.
+		/// </param>
+		public delegate void PacketReceivedHandler(array<System::Byte>^ packet, uint32_t length, Address^ address);
+
+		/// <summary>
+		/// A receive engine that keeps a fixed number of overlapped reads in flight against a
+		/// Diversion, and services their completions with a fixed pool of worker threads through
+		/// an I/O completion port. Unlike DivertAsyncResult.Get(uint timeout), which parks a thread
+		/// on an event per outstanding read, any number of reads in flight is serviced by
+		/// WorkerCount threads. Packet buffers are pinned once, when the engine is constructed.
+		/// </summary>
+		public ref class ReceiveEngine
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs an engine. Nothing is read until Start() is called.
+			/// </summary>
+			/// <param name="diversion">
+			/// The diversion to read from. Must stay open for as long as the engine is running, and
+			/// should not be read from by anything else while the engine is running.
+			/// </param>
+			/// <param name="readsInFlight">
+			/// The number of overlapped reads to keep outstanding. Must be greater than zero.
+			/// </param>
+			/// <param name="workerCount">
+			/// The number of worker threads servicing completions. Must be greater than zero.
+			/// </param>
+			/// <param name="maxPacketLength">
+			/// The length of each read's buffer. Must be greater than zero.
+			/// </param>
+			/// <param name="handler">
+			/// Invoked for every packet read.
+			/// </param>
+			ReceiveEngine(Diversion^ diversion, uint32_t readsInFlight, uint32_t workerCount, uint32_t maxPacketLength, PacketReceivedHandler^ handler);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~ReceiveEngine();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources. Engines should be stopped or disposed
+			/// explicitly, as the finalizer can't wait for handlers still running.
+			/// </summary>
+			!ReceiveEngine();
+
+			/// <summary>
+			/// Starts the workers and posts every read.
+			/// </summary>
+			void Start();
+
+			/// <summary>
+			/// Cancels the reads in flight and waits for the workers to finish with them. If a
+			/// handler threw while the engine was running, the first such exception is rethrown
+			/// here as the inner exception.
+			/// </summary>
+			void Stop();
+
+			/// <summary>
+			/// Discards the completion counters and latency samples.
+			/// </summary>
+			void ResetStatistics();
+
+			/// <summary>
+			/// Computes latency percentiles over recently completed reads. Latency is measured from
+			/// a read being posted to its completion being dispatched to a worker. Best called
+			/// while stopped, for a consistent view.
+			/// </summary>
+			/// <param name="percentiles">
+			/// The percentiles to compute, each in the range [0, 100].
+			/// </param>
+			/// <returns>
+			/// Each percentile, in microseconds.
+			/// </returns>
+			array<double>^ GetLatencyPercentiles(array<double>^ percentiles);
+
+			/// <summary>
+			/// The number of reads that completed successfully.
+			/// </summary>
+			property uint64_t Completed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of reads that failed.
+			/// </summary>
+			property uint64_t Failed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of overlapped reads kept outstanding.
+			/// </summary>
+			property uint32_t ReadsInFlight
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// The number of worker threads servicing completions.
+			/// </summary>
+			property uint32_t WorkerCount
+			{
+				uint32_t get();
+			}
+
+		private:
+
+			/// <summary>
+			/// Native signature of the trampoline handed to Native::ReceiveEngine.
+			/// </summary>
+			[System::Runtime::InteropServices::UnmanagedFunctionPointer(System::Runtime::InteropServices::CallingConvention::Cdecl)]
+			delegate void NativePacketCallback(void* context, uint32_t slot, const uint8_t* packet, uint32_t length, PWINDIVERT_ADDRESS address, int32_t error);
+
+			/// <summary>
+			/// Called on a worker thread for every completed read. Maps the slot back to its
+			/// managed buffer and address, and invokes the user's handler.
+			/// </summary>
+			void OnPacket(void* context, uint32_t slot, const uint8_t* packet, uint32_t length, PWINDIVERT_ADDRESS address, int32_t error);
+
+			Diversion^ m_diversion;
+
+			PacketReceivedHandler^ m_handler;
+
+			/// <summary>
+			/// Kept alive for as long as the native engine may call through it.
+			/// </summary>
+			NativePacketCallback^ m_callback;
+
+			/// <summary>
+			/// One buffer per read, each pinned for the lifetime of the engine.
+			/// </summary>
+			array<array<System::Byte>^>^ m_buffers;
+
+			array<System::Runtime::InteropServices::GCHandle>^ m_bufferPins;
+
+			/// <summary>
+			/// One address per read. The native engine reads into their unmanaged addresses.
+			/// </summary>
+			array<Address^>^ m_addresses;
+
+			/// <summary>
+			/// The first exception thrown by the handler, if any.
+			/// </summary>
+			System::Exception^ m_handlerException;
+
+			uint32_t m_readsInFlight;
+
+			uint32_t m_workerCount;
+
+			/// <summary>
+			/// Exclusively owned by this object.
+			/// </summary>
+			Native::CompletionDispatcher* m_dispatcher = nullptr;
+
+			/// <summary>
+			/// Exclusively owned by this object.
+			/// </summary>
+			Native::ReceiveEngine* m_engine = nullptr;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
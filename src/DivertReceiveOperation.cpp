@@ -0,0 +1,429 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertReceiveOperation.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			void RethrowOnThreadPool(System::Object^ state)
+			{
+				safe_cast<System::Runtime::ExceptionServices::ExceptionDispatchInfo^>(state)->Throw();
+			}
+
+			/// <summary>
+			/// Decides where a continuation runs. A continuation that has nowhere in particular to
+			/// go is kept as the bare Action and queued to the thread pool, anything else is
+			/// wrapped along with its context.
+			/// </summary>
+			ref class ScheduledContinuation sealed
+			{
+
+			public:
+
+				/// <summary>
+				/// Captures the SynchronizationContext or TaskScheduler of the calling thread and,
+				/// if asked to, its execution context.
+				/// </summary>
+				/// <returns>
+				/// The continuation itself if there was nothing to capture, a ScheduledContinuation
+				/// otherwise. Either can be handed to Dispatch.
+				/// </returns>
+				static System::Object^ Capture(System::Action^ continuation, bool flowExecutionContext)
+				{
+					System::Threading::SynchronizationContext^ synchronizationContext = System::Threading::SynchronizationContext::Current;
+					System::Threading::Tasks::TaskScheduler^ scheduler = nullptr;
+
+					// The base SynchronizationContext just posts to the thread pool.
+					if (synchronizationContext != nullptr && synchronizationContext->GetType() == System::Threading::SynchronizationContext::typeid)
+					{
+						synchronizationContext = nullptr;
+					}
+
+					if (synchronizationContext == nullptr && System::Threading::Tasks::TaskScheduler::Current != System::Threading::Tasks::TaskScheduler::Default)
+					{
+						scheduler = System::Threading::Tasks::TaskScheduler::Current;
+					}
+
+					System::Threading::ExecutionContext^ executionContext = flowExecutionContext ? System::Threading::ExecutionContext::Capture() : nullptr;
+
+					if (synchronizationContext == nullptr && scheduler == nullptr && executionContext == nullptr)
+					{
+						return continuation;
+					}
+
+					ScheduledContinuation^ scheduled = gcnew ScheduledContinuation();
+					scheduled->m_continuation = continuation;
+					scheduled->m_synchronizationContext = synchronizationContext;
+					scheduled->m_scheduler = scheduler;
+					scheduled->m_executionContext = executionContext;
+
+					return scheduled;
+				}
+
+				/// <summary>
+				/// Schedules a continuation returned by Capture. Never runs it inline.
+				/// </summary>
+				static void Dispatch(System::Object^ continuation)
+				{
+					ScheduledContinuation^ scheduled = dynamic_cast<ScheduledContinuation^>(continuation);
+
+					if (scheduled == nullptr)
+					{
+						System::Threading::ThreadPool::UnsafeQueueUserWorkItem(s_invoke, continuation);
+						return;
+					}
+
+					if (scheduled->m_synchronizationContext != nullptr)
+					{
+						scheduled->m_synchronizationContext->Post(s_runPosted, scheduled);
+						return;
+					}
+
+					if (scheduled->m_scheduler != nullptr)
+					{
+						System::Threading::Tasks::Task::Factory->StartNew(s_runTask, scheduled, System::Threading::CancellationToken::None, System::Threading::Tasks::TaskCreationOptions::DenyChildAttach, scheduled->m_scheduler);
+						return;
+					}
+
+					System::Threading::ThreadPool::UnsafeQueueUserWorkItem(s_runQueued, scheduled);
+				}
+
+			private:
+
+				static ScheduledContinuation()
+				{
+					s_invoke = gcnew System::Threading::WaitCallback(&ScheduledContinuation::Invoke);
+					s_invokeInContext = gcnew System::Threading::ContextCallback(&ScheduledContinuation::Invoke);
+					s_runQueued = gcnew System::Threading::WaitCallback(&ScheduledContinuation::Run);
+					s_runPosted = gcnew System::Threading::SendOrPostCallback(&ScheduledContinuation::Run);
+					s_runTask = gcnew System::Action<System::Object^>(&ScheduledContinuation::Run);
+				}
+
+				static void Invoke(System::Object^ continuation)
+				{
+					safe_cast<System::Action^>(continuation)();
+				}
+
+				static void Run(System::Object^ state)
+				{
+					ScheduledContinuation^ scheduled = safe_cast<ScheduledContinuation^>(state);
+
+					if (scheduled->m_executionContext == nullptr)
+					{
+						scheduled->m_continuation();
+						return;
+					}
+
+					System::Threading::ExecutionContext::Run(scheduled->m_executionContext, s_invokeInContext, scheduled->m_continuation);
+				}
+
+				static System::Threading::WaitCallback^ s_invoke;
+
+				static System::Threading::ContextCallback^ s_invokeInContext;
+
+				static System::Threading::WaitCallback^ s_runQueued;
+
+				static System::Threading::SendOrPostCallback^ s_runPosted;
+
+				static System::Action<System::Object^>^ s_runTask;
+
+				System::Action^ m_continuation;
+
+				System::Threading::SynchronizationContext^ m_synchronizationContext;
+
+				System::Threading::Tasks::TaskScheduler^ m_scheduler;
+
+				/// <summary>
+				/// Null when the context is not to be flowed, or when flow was suppressed.
+				/// </summary>
+				System::Threading::ExecutionContext^ m_executionContext;
+
+			};
+
+			/// <summary>
+			/// Invoked from native code on a dispatcher worker. Managed code with a native signature
+			/// gets a native entry point, so this can be stored straight in IoOperation::Complete.
+			/// </summary>
+			void CompleteReceiveOperation(Native::IoOperation* operation, uint32_t bytes, int32_t error)
+			{
+				System::Runtime::InteropServices::GCHandle self = System::Runtime::InteropServices::GCHandle::FromIntPtr(System::IntPtr(operation->Context));
+
+				try
+				{
+					safe_cast<ReceiveOperation^>(self.Target)->Complete(bytes, error);
+				}
+				catch (System::Exception^ e)
+				{
+					// Unwinding into the dispatcher would take the worker, and the process, down
+					// without going through the usual unhandled exception handling. Rethrow on the
+					// thread pool instead, where a continuation would normally have run.
+					System::Threading::ThreadPool::QueueUserWorkItem(gcnew System::Threading::WaitCallback(&RethrowOnThreadPool), System::Runtime::ExceptionServices::ExceptionDispatchInfo::Capture(e));
+				}
+			}
+		}
+
+		static ReceiveOperation::ReceiveOperation()
+		{
+			s_completed = gcnew System::Object();
+		}
+
+		ReceiveOperation::ReceiveOperation(uint32_t bufferLength)
+		{
+			System::Exception^ e = nullptr;
+
+			if (bufferLength == 0 || bufferLength > static_cast<uint32_t>(System::Int32::MaxValue))
+			{
+				e = gcnew System::ArgumentException(u8"In ReceiveOperation::ReceiveOperation(uint32_t) - Buffer length must be greater than zero.");
+				throw e;
+			}
+
+			m_buffer = gcnew array<System::Byte>(static_cast<int>(bufferLength));
+			m_bufferPin = System::Runtime::InteropServices::GCHandle::Alloc(m_buffer, System::Runtime::InteropServices::GCHandleType::Pinned);
+			m_address = gcnew Address();
+
+			m_operation = new Native::IoOperation();
+			std::memset(m_operation, 0, sizeof(*m_operation));
+			m_operation->Complete = &CompleteReceiveOperation;
+		}
+
+		ReceiveOperation::~ReceiveOperation()
+		{
+			this->!ReceiveOperation();
+		}
+
+		ReceiveOperation::!ReceiveOperation()
+		{
+			// A read still in flight owns the OVERLAPPED and the buffer. Leaking them is the only
+			// safe option, the read will land in them whenever it completes.
+			if (System::Threading::Volatile::Read(m_inFlight) != 0 && !IsCompleted)
+			{
+				return;
+			}
+
+			if (m_self.IsAllocated)
+			{
+				m_self.Free();
+			}
+
+			if (m_bufferPin.IsAllocated)
+			{
+				m_bufferPin.Free();
+			}
+
+			if (m_operation != nullptr)
+			{
+				delete m_operation;
+				m_operation = nullptr;
+			}
+		}
+
+		array<System::Byte>^ ReceiveOperation::Buffer::get()
+		{
+			return m_buffer;
+		}
+
+		Address^ ReceiveOperation::PacketAddress::get()
+		{
+			return m_address;
+		}
+
+		uint32_t ReceiveOperation::Length::get()
+		{
+			return m_length;
+		}
+
+		ReceiveOperation^ ReceiveOperation::GetAwaiter()
+		{
+			return this;
+		}
+
+		bool ReceiveOperation::IsCompleted::get()
+		{
+			return System::Object::ReferenceEquals(System::Threading::Volatile::Read(m_continuation), s_completed);
+		}
+
+		uint32_t ReceiveOperation::GetResult()
+		{
+			System::Exception^ e = nullptr;
+
+			if (!IsCompleted)
+			{
+				e = gcnew System::InvalidOperationException(u8"In ReceiveOperation::GetResult() - The read has not completed yet.");
+				throw e;
+			}
+
+			uint32_t length = m_length;
+			int error = m_error;
+
+			System::Threading::Volatile::Write(m_inFlight, 0);
+
+			if (error != 0)
+			{
+				e = gcnew System::ComponentModel::Win32Exception(error, u8"In ReceiveOperation::GetResult() - The read failed.");
+				throw e;
+			}
+
+			return length;
+		}
+
+		void ReceiveOperation::OnCompleted(System::Action^ continuation)
+		{
+			System::Exception^ e = nullptr;
+
+			if (continuation == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"In ReceiveOperation::OnCompleted(System::Action^) - Continuation cannot be null.");
+				throw e;
+			}
+
+			Register(ScheduledContinuation::Capture(continuation, true));
+		}
+
+		void ReceiveOperation::UnsafeOnCompleted(System::Action^ continuation)
+		{
+			System::Exception^ e = nullptr;
+
+			if (continuation == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"In ReceiveOperation::UnsafeOnCompleted(System::Action^) - Continuation cannot be null.");
+				throw e;
+			}
+
+			Register(ScheduledContinuation::Capture(continuation, false));
+		}
+
+		void ReceiveOperation::Register(System::Object^ continuation)
+		{
+			System::Exception^ e = nullptr;
+
+			System::Object^ previous = System::Threading::Interlocked::CompareExchange(m_continuation, continuation, nullptr);
+
+			if (previous == nullptr)
+			{
+				return;
+			}
+
+			if (System::Object::ReferenceEquals(previous, s_completed))
+			{
+				// Completed between the caller checking IsCompleted and getting here. Still
+				// scheduled rather than run inline, so it lands in the context it asked for.
+				ScheduledContinuation::Dispatch(continuation);
+				return;
+			}
+
+			e = gcnew System::InvalidOperationException(u8"In ReceiveOperation::Register(System::Object^) - The operation is already being awaited.");
+			throw e;
+		}
+
+		void ReceiveOperation::Begin(Native::PacketSource* source, Native::Statistics* statistics)
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_operation == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"In ReceiveOperation::Begin(Native::PacketSource*, Native::Statistics*) - Operation has been disposed.");
+				throw e;
+			}
+
+			if (System::Threading::Interlocked::CompareExchange(m_inFlight, 1, 0) != 0)
+			{
+				e = gcnew System::InvalidOperationException(u8"In ReceiveOperation::Begin(Native::PacketSource*, Native::Statistics*) - The operation already has a read in flight, or its result has not been fetched.");
+				throw e;
+			}
+
+			m_continuation = nullptr;
+			m_length = 0;
+			m_error = 0;
+
+			std::memset(&m_operation->Overlapped, 0, sizeof(m_operation->Overlapped));
+			std::memset(m_address->UnmanagedAddress, 0, sizeof(WINDIVERT_ADDRESS));
+
+			// Keeps this object alive until the read completes, whether or not anyone still
+			// references it. Freed by Complete.
+			m_self = System::Runtime::InteropServices::GCHandle::Alloc(this);
+			m_operation->Context = System::Runtime::InteropServices::GCHandle::ToIntPtr(m_self).ToPointer();
+
+			if (statistics != nullptr)
+			{
+				statistics->AddReference();
+				m_statistics = statistics;
+				m_pendingSince = statistics->RecordPending();
+			}
+
+			uint32_t readLength = 0;
+
+			// Bound to the dispatcher's queue, so the completion is queued even when the read
+			// completes immediately. Only an outright failure has to be completed here.
+			if (!source->ReceiveEx(m_bufferPin.AddrOfPinnedObject().ToPointer(), static_cast<uint32_t>(m_buffer->Length), m_address->UnmanagedAddress, &readLength, &m_operation->Overlapped))
+			{
+				int error = Native::GetNativeLastError();
+
+				if (error != Native::IoPendingError)
+				{
+					Complete(0, error);
+				}
+			}
+		}
+
+		void ReceiveOperation::Complete(uint32_t bytes, int32_t error)
+		{
+			// The caller holds a reference for the rest of this call. Freed before the
+			// continuation runs, since it may well begin the next read.
+			if (m_self.IsAllocated)
+			{
+				m_self.Free();
+			}
+
+			m_operation->Context = nullptr;
+
+			m_length = bytes;
+			m_error = error;
+
+			// Recorded before the continuation runs, which may well post the next read.
+			Native::Statistics* statistics = m_statistics;
+
+			if (statistics != nullptr)
+			{
+				m_statistics = nullptr;
+				statistics->RecordReceiveCompleted(m_pendingSince, m_address->UnmanagedAddress, bytes, error);
+				statistics->Release();
+			}
+
+			System::Object^ continuation = System::Threading::Interlocked::Exchange(m_continuation, s_completed);
+
+			// This is a dispatcher worker, or the thread that posted the read. Neither is a place
+			// to run arbitrary user code.
+			if (continuation != nullptr)
+			{
+				ScheduledContinuation::Dispatch(continuation);
+			}
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,220 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAddress.hpp"
+#include "DivertCompletionQueue.hpp"
+#include "DivertNativeStatistics.hpp"
+#include "DivertPacketSource.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// A reusable, awaitable packet read. Pass an instance to Diversion.ReceiveAsync and await
+		/// the result, which is the length of the packet read into Buffer:
+		/// 
+		///     uint length = await diversion.ReceiveAsync(operation);
+		/// 
+		/// Completion is delivered by the shared completion dispatcher, so no thread waits on the
+		/// read. The buffer, address and native OVERLAPPED belong to the operation and are set up
+		/// once, when the operation is constructed, so awaiting the same operation over and over
+		/// allocates nothing beyond what it takes to schedule the continuation. An operation can have one read in flight at a time, and can be reused
+		/// as soon as its result has been fetched.
+		/// 
+		/// Continuations never run on the dispatcher's worker threads. They are posted back to the
+		/// SynchronizationContext or TaskScheduler they were awaited from, if there is one, and
+		/// queued to the thread pool otherwise, so a slow continuation can't hold up every other
+		/// completion. Operations must be disposed, as they hold handles to themselves while alive.
+		/// </summary>
+		public ref class ReceiveOperation sealed : public System::Runtime::CompilerServices::ICriticalNotifyCompletion
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a new operation with its own packet buffer.
+			/// </summary>
+			/// <param name="bufferLength">
+			/// The length of the buffer packets are read into. Must be greater than zero.
+			/// </param>
+			ReceiveOperation(uint32_t bufferLength);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~ReceiveOperation();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!ReceiveOperation();
+
+			/// <summary>
+			/// The buffer the packet is read into. Pinned for the lifetime of the operation.
+			/// </summary>
+			property array<System::Byte>^ Buffer
+			{
+				array<System::Byte>^ get();
+			}
+
+			/// <summary>
+			/// The address of the packet read.
+			/// </summary>
+			property Address^ PacketAddress
+			{
+				Address^ get();
+			}
+
+			/// <summary>
+			/// The length of the packet read, once the operation has completed.
+			/// </summary>
+			property uint32_t Length
+			{
+				uint32_t get();
+			}
+
+			/// <summary>
+			/// Part of the awaitable pattern. The operation is its own awaiter.
+			/// </summary>
+			ReceiveOperation^ GetAwaiter();
+
+			/// <summary>
+			/// Whether the read in flight has completed.
+			/// </summary>
+			property bool IsCompleted
+			{
+				bool get();
+			}
+
+			/// <summary>
+			/// Fetches the result of the completed read, and frees the operation for reuse.
+			/// </summary>
+			/// <returns>
+			/// The length of the packet read into Buffer.
+			/// </returns>
+			/// <exception cref="System::ComponentModel::Win32Exception">
+			/// The read failed.
+			/// </exception>
+			uint32_t GetResult();
+
+			/// <summary>
+			/// Part of the awaitable pattern. Registers the continuation to run when the read
+			/// completes, under the execution context captured here.
+			/// </summary>
+			virtual void OnCompleted(System::Action^ continuation);
+
+			/// <summary>
+			/// Part of the awaitable pattern. Registers the continuation to run when the read
+			/// completes, without flowing the execution context. The continuation is scheduled
+			/// right away if the read already has completed.
+			/// </summary>
+			virtual void UnsafeOnCompleted(System::Action^ continuation);
+
+		internal:
+
+			/// <summary>
+			/// Posts the read on the supplied source, which must already be bound to the shared
+			/// completion dispatcher. The read is recorded in the supplied statistics, if any,
+			/// which are referenced until it completes.
+			/// </summary>
+			void Begin(Native::PacketSource* source, Native::Statistics* statistics);
+
+			/// <summary>
+			/// Called by the dispatcher when the read completes.
+			/// </summary>
+			void Complete(uint32_t bytes, int32_t error);
+
+		private:
+
+			/// <summary>
+			/// Stores the continuation, as captured by OnCompleted or UnsafeOnCompleted, or
+			/// schedules it if the read has already completed.
+			/// </summary>
+			/// <param name="continuation">
+			/// The continuation along with where to run it.
+			/// </param>
+			void Register(System::Object^ continuation);
+
+			static ReceiveOperation();
+
+			/// <summary>
+			/// Stored in place of the continuation once the read has completed.
+			/// </summary>
+			static System::Object^ s_completed;
+
+			/// <summary>
+			/// The OVERLAPPED the read is posted with. Its Context holds m_self while a read is in
+			/// flight. Exclusively owned by this object.
+			/// </summary>
+			Native::IoOperation* m_operation = nullptr;
+
+			/// <summary>
+			/// Handle to this object, for the dispatcher to find its way back from the native
+			/// operation. Allocated by Begin and freed on completion, so that it only keeps this
+			/// object alive while a read is in flight, and an operation that is dropped without
+			/// being disposed is still finalized.
+			/// </summary>
+			System::Runtime::InteropServices::GCHandle m_self;
+
+			array<System::Byte>^ m_buffer;
+
+			System::Runtime::InteropServices::GCHandle m_bufferPin;
+
+			Address^ m_address;
+
+			/// <summary>
+			/// The continuation to run on completion, s_completed once complete. Either the bare
+			/// Action, or the Action along with the context it has to be run in.
+			/// </summary>
+			System::Object^ m_continuation;
+
+			uint32_t m_length = 0;
+
+			int m_error = 0;
+
+			/// <summary>
+			/// Statistics the read in flight is recorded in. Holds a reference until Complete.
+			/// </summary>
+			Native::Statistics* m_statistics = nullptr;
+
+			/// <summary>
+			/// When the read in flight was posted, as returned by RecordPending().
+			/// </summary>
+			uint64_t m_pendingSince = 0;
+
+			/// <summary>
+			/// One while a read is in flight or its result has not been fetched yet.
+			/// </summary>
+			int m_inFlight = 0;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
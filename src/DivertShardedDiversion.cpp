@@ -0,0 +1,383 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertShardedDiversion.hpp"
+#include "DivertNativeFilter.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		namespace
+		{
+			/// <summary>
+			/// How long a worker waits for a buffer when the handler is holding on to all of them.
+			/// </summary>
+			const int ExhaustedPoolWait = 1;
+		}
+
+		ShardedDiversion::ShardedDiversion(System::String^ filter, uint32_t shardCount, ShardKey key)
+		{
+			m_partition = new Native::ShardPartition(shardCount, Native::ShardPartition::DefaultStripesPerShard, static_cast<Native::ShardKey>(key));
+			m_filter = filter;
+			m_shards = gcnew array<Diversion^>(static_cast<int>(shardCount));
+			m_faults = gcnew System::Collections::Concurrent::ConcurrentQueue<System::Exception^>();
+		}
+
+		ShardedDiversion^ ShardedDiversion::Open(System::String^ filter, int16_t priority, FilterFlags flags, uint32_t shardCount, ShardKey key)
+		{
+			System::Exception^ e = nullptr;
+
+			if (System::String::IsNullOrWhiteSpace(filter))
+			{
+				e = gcnew System::Exception(u8"In ShardedDiversion::Open(System::String^, int16_t, FilterFlags, uint32_t, ShardKey) - Supplied filter string is null, empty or whitespace.");
+				throw e;
+			}
+
+			if (shardCount == 0 || shardCount > Native::ShardPartition::MaximumShards)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"shardCount", u8"In ShardedDiversion::Open(System::String^, int16_t, FilterFlags, uint32_t, ShardKey) - Shard count must be between 1 and 64.");
+				throw e;
+			}
+
+			ShardedDiversion^ sharded = gcnew ShardedDiversion(filter, shardCount, key);
+
+			try
+			{
+				for (uint32_t shard = 0; shard < shardCount; ++shard)
+				{
+					sharded->m_shards[shard] = Diversion::Open(sharded->GetShardFilter(shard), DivertLayer::Network, priority, flags);
+				}
+			}
+			catch (...)
+			{
+				// Closes and releases the shards already opened.
+				delete sharded;
+				throw;
+			}
+
+			return sharded;
+		}
+
+		ShardedDiversion^ ShardedDiversion::OpenSimulated(array<array<System::Byte>^>^ packets, uint32_t shardCount, ShardKey key)
+		{
+			System::Exception^ e = nullptr;
+
+			if (packets == nullptr || packets->Length == 0)
+			{
+				e = gcnew System::Exception(u8"In ShardedDiversion::OpenSimulated(array<array<System::Byte>^>^, uint32_t, ShardKey) - At least one template packet must be supplied.");
+				throw e;
+			}
+
+			if (shardCount == 0 || shardCount > Native::ShardPartition::MaximumShards)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"shardCount", u8"In ShardedDiversion::OpenSimulated(array<array<System::Byte>^>^, uint32_t, ShardKey) - Shard count must be between 1 and 64.");
+				throw e;
+			}
+
+			ShardedDiversion^ sharded = gcnew ShardedDiversion(u8"true", shardCount, key);
+
+			// Each shard's templates are the ones its filter admits, as the driver would sort
+			// them, so the simulation also checks that the terms cover every packet exactly once.
+			WINDIVERT_ADDRESS address;
+			std::memset(&address, 0, sizeof(address));
+			address.IfIdx = 1;
+			address.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+			for (uint32_t shard = 0; shard < shardCount; ++shard)
+			{
+				const std::string text = sharded->m_partition->Filter(std::string(u8"true"), shard);
+
+				Native::Filter shardFilter;
+
+				if (!shardFilter.Compile(text.data(), text.size(), Native::FilterLayer::Network, nullptr, nullptr))
+				{
+					delete sharded;
+					e = gcnew System::Exception(u8"In ShardedDiversion::OpenSimulated(array<array<System::Byte>^>^, uint32_t, ShardKey) - Failed to compile a shard filter.");
+					throw e;
+				}
+
+				std::vector< std::vector<uint8_t> > templates;
+
+				for (int i = 0; i < packets->Length; ++i)
+				{
+					if (packets[i] == nullptr || packets[i]->Length == 0)
+					{
+						delete sharded;
+						e = gcnew System::Exception(u8"In ShardedDiversion::OpenSimulated(array<array<System::Byte>^>^, uint32_t, ShardKey) - Supplied template packets must not be null or empty.");
+						throw e;
+					}
+
+					pin_ptr<System::Byte> packetBytes = &packets[i][0];
+					const uint8_t* packet = static_cast<uint8_t*>(packetBytes);
+
+					if (shardFilter.Evaluate(packet, static_cast<uint32_t>(packets[i]->Length), &address))
+					{
+						templates.emplace_back(packet, packet + packets[i]->Length);
+					}
+				}
+
+				sharded->m_shards[shard] = Diversion::OpenSimulated(templates);
+			}
+
+			return sharded;
+		}
+
+		ShardedDiversion::~ShardedDiversion()
+		{
+			// Disposing doesn't report handler faults, Close is for that.
+			Stop();
+
+			for (int shard = 0; shard < m_shards->Length; ++shard)
+			{
+				delete m_shards[shard];
+				m_shards[shard] = nullptr;
+			}
+
+			this->!ShardedDiversion();
+		}
+
+		ShardedDiversion::!ShardedDiversion()
+		{
+			if (m_partition != nullptr)
+			{
+				delete m_partition;
+				m_partition = nullptr;
+			}
+		}
+
+		void ShardedDiversion::Start(ShardPacketHandler^ handler)
+		{
+			System::Exception^ e = nullptr;
+
+			if (handler == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"handler", u8"In ShardedDiversion::Start(ShardPacketHandler^) - Supplied handler is null.");
+				throw e;
+			}
+
+			Partition();
+
+			if (m_workers != nullptr || m_stopping)
+			{
+				e = gcnew System::InvalidOperationException(u8"In ShardedDiversion::Start(ShardPacketHandler^) - The workers have already been started, or the shards closed.");
+				throw e;
+			}
+
+			m_handler = handler;
+			m_pools = gcnew array<PacketBufferPool^>(m_shards->Length);
+			m_workers = gcnew array<System::Threading::Thread^>(m_shards->Length);
+
+			for (int shard = 0; shard < m_shards->Length; ++shard)
+			{
+				m_pools[shard] = gcnew PacketBufferPool(0, BuffersPerShard);
+
+				m_workers[shard] = gcnew System::Threading::Thread(gcnew System::Threading::ParameterizedThreadStart(this, &ShardedDiversion::Work));
+				m_workers[shard]->IsBackground = true;
+				m_workers[shard]->Name = System::String::Format(u8"ShardedDiversion shard {0}", shard);
+			}
+
+			for (int shard = 0; shard < m_workers->Length; ++shard)
+			{
+				m_workers[shard]->Start(static_cast<uint32_t>(shard));
+			}
+		}
+
+		void ShardedDiversion::Work(System::Object^ state)
+		{
+			const uint32_t shard = safe_cast<uint32_t>(state);
+
+			Diversion^ diversion = m_shards[shard];
+			PacketBufferPool^ pool = m_pools[shard];
+			Address^ address = gcnew Address();
+
+			// Keeps the managed thread on the OS thread that was pinned.
+			System::Threading::Thread::BeginThreadAffinity();
+
+			try
+			{
+				Native::PinCurrentThread(shard);
+
+				while (!m_stopping)
+				{
+					PacketLease lease = pool->Lease(PacketBufferPool::LargeBufferSize);
+
+					if (!lease.IsValid)
+					{
+						System::Threading::Thread::Sleep(ExhaustedPoolWait);
+						continue;
+					}
+
+					try
+					{
+						if (!diversion->Receive(lease, address))
+						{
+							// A closed handle fails the receive it was blocked in. A shard that
+							// has nothing to receive, simulated with no templates, stops too.
+							if (m_stopping || !(diversion->Handle != nullptr && diversion->Handle->Valid))
+							{
+								break;
+							}
+
+							continue;
+						}
+
+						m_handler(shard, diversion, lease, address);
+					}
+					finally
+					{
+						lease.Release();
+					}
+				}
+			}
+			catch (System::Exception^ fault)
+			{
+				m_faults->Enqueue(fault);
+			}
+			finally
+			{
+				System::Threading::Thread::EndThreadAffinity();
+			}
+		}
+
+		void ShardedDiversion::Close()
+		{
+			Stop();
+
+			if (!m_faults->IsEmpty)
+			{
+				System::Exception^ e = gcnew System::AggregateException(u8"In ShardedDiversion::Close() - The handler threw on one or more shards.", m_faults->ToArray());
+				throw e;
+			}
+		}
+
+		void ShardedDiversion::Stop()
+		{
+			m_stopping = true;
+
+			CloseShards();
+
+			if (m_workers != nullptr)
+			{
+				for (int shard = 0; shard < m_workers->Length; ++shard)
+				{
+					m_workers[shard]->Join();
+				}
+
+				// Only once every worker is out of Receive and the handler.
+				for (int shard = 0; shard < m_pools->Length; ++shard)
+				{
+					delete m_pools[shard];
+					m_pools[shard] = nullptr;
+				}
+
+				m_workers = nullptr;
+			}
+		}
+
+		void ShardedDiversion::CloseShards()
+		{
+			for (int shard = 0; shard < m_shards->Length; ++shard)
+			{
+				if (m_shards[shard] != nullptr)
+				{
+					m_shards[shard]->Close();
+				}
+			}
+		}
+
+		System::String^ ShardedDiversion::GetShardFilter(uint32_t shard)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::ShardPartition* partition = Partition();
+
+			if (shard >= partition->ShardCount())
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"shard", u8"In ShardedDiversion::GetShardFilter(uint32_t) - There is no such shard.");
+				throw e;
+			}
+
+			System::IntPtr filter = System::Runtime::InteropServices::Marshal::StringToHGlobalAnsi(m_filter);
+
+			try
+			{
+				const std::string shardFilter = partition->Filter(std::string(static_cast<const char*>(filter.ToPointer())), shard);
+
+				return gcnew System::String(shardFilter.c_str());
+			}
+			finally
+			{
+				System::Runtime::InteropServices::Marshal::FreeHGlobal(filter);
+			}
+		}
+
+		uint32_t ShardedDiversion::ShardOfPort(uint16_t port)
+		{
+			return Partition()->ShardOfPort(port);
+		}
+
+		uint32_t ShardedDiversion::ShardCount::get()
+		{
+			return Partition()->ShardCount();
+		}
+
+		ShardKey ShardedDiversion::Key::get()
+		{
+			return static_cast<ShardKey>(Partition()->Key());
+		}
+
+		Diversion^ ShardedDiversion::default::get(uint32_t shard)
+		{
+			System::Exception^ e = nullptr;
+
+			if (shard >= static_cast<uint32_t>(m_shards->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"shard", u8"In ShardedDiversion::default::get(uint32_t) - There is no such shard.");
+				throw e;
+			}
+
+			return m_shards[shard];
+		}
+
+		Native::ShardPartition* ShardedDiversion::Partition()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_partition == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"In ShardedDiversion::Partition() - ShardedDiversion has been disposed.");
+				throw e;
+			}
+
+			return m_partition;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,228 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "Diversion.hpp"
+#include "DivertPacketBufferPool.hpp"
+#include "DivertNativeShardPartition.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// The port ShardedDiversion divides flows by. Either way both directions of a flow go to
+		/// the same shard.
+		/// </summary>
+		public enum class ShardKey
+		{
+			/// <summary>
+			/// The port on this machine. Spreads the connections this machine makes, but puts
+			/// every connection to one listening port on the same shard.
+			/// </summary>
+			LocalPort,
+
+			/// <summary>
+			/// The port on the other end. Spreads the connections made to a server on this machine,
+			/// but puts every connection to one remote service on the same shard.
+			/// </summary>
+			RemotePort
+		};
+
+		/// <summary>
+		/// Handles one packet on a shard's worker thread. The lease is released when the handler
+		/// returns, so a handler that keeps the packet must Retain the lease. The address is
+		/// reused for the shard's next packet.
+		/// </summary>
+		public delegate void ShardPacketHandler(uint32_t shard, Diversion^ diversion, PacketLease lease, Address^ address);
+
+		/// <summary>
+		/// Captures with several WinDivert handles at once rather than one. A single handle puts
+		/// every packet through one queue read by one thread. This opens one handle per shard at
+		/// the same priority, and restricts each handle's filter to a share of the flows, so that
+		/// each shard has a queue of its own, and a thread of its own pinned to a processor.
+		/// 
+		/// The driver can't hash, so flows are divided by port ranges written into the filters:
+		/// the port space is cut into stripes, dealt out to the shards in turn. Every packet of a
+		/// flow goes to the same shard, in both directions. Packets with no ports, such as ICMP
+		/// and IP fragments after the first, all go to shard zero. Network layer only.
+		/// </summary>
+		public ref class ShardedDiversion sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// The number of buffers each shard's worker receives into. A handler that keeps
+			/// packets past its return holds on to them.
+			/// </summary>
+			static const uint32_t BuffersPerShard = 32;
+
+			/// <summary>
+			/// Opens one handle per shard at the network layer.
+			/// </summary>
+			/// <param name="filter">
+			/// The packets to capture, across all shards.
+			/// </param>
+			/// <param name="priority">
+			/// The priority every handle is opened at.
+			/// </param>
+			/// <param name="flags">
+			/// The flags every handle is opened with.
+			/// </param>
+			/// <param name="shardCount">
+			/// The number of handles, at most 64. One per processor is a good start.
+			/// </param>
+			/// <param name="key">
+			/// The port flows are divided by.
+			/// </param>
+			/// <exception cref="System::ArgumentOutOfRangeException">
+			/// The shard count is zero or more than 64.
+			/// </exception>
+			/// <exception cref="System::Exception">
+			/// A handle could not be opened. Those already opened are closed.
+			/// </exception>
+			static ShardedDiversion^ Open(System::String^ filter, int16_t priority, FilterFlags flags, uint32_t shardCount, ShardKey key);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~ShardedDiversion();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!ShardedDiversion();
+
+			/// <summary>
+			/// Starts one worker thread per shard, pinned to the processor numbered as the shard,
+			/// each receiving from its shard's handle and calling the handler for every packet.
+			/// </summary>
+			/// <exception cref="System::InvalidOperationException">
+			/// The workers have already been started, or the handles closed.
+			/// </exception>
+			void Start(ShardPacketHandler^ handler);
+
+			/// <summary>
+			/// Stops the workers and closes every handle. Leases the handler kept become unusable.
+			/// </summary>
+			/// <exception cref="System::AggregateException">
+			/// The handler threw on one or more shards. Those shards' workers stopped there.
+			/// </exception>
+			void Close();
+
+			/// <summary>
+			/// The filter a shard's handle was opened with.
+			/// </summary>
+			System::String^ GetShardFilter(uint32_t shard);
+
+			/// <summary>
+			/// The shard that sees the flows with a given key port, local or remote as chosen
+			/// when opening.
+			/// </summary>
+			uint32_t ShardOfPort(uint16_t port);
+
+			property uint32_t ShardCount
+			{
+				uint32_t get();
+			}
+
+			property ShardKey Key
+			{
+				ShardKey get();
+			}
+
+			/// <summary>
+			/// A shard's handle, for its statistics or to send on it from elsewhere.
+			/// </summary>
+			property Diversion^ default[uint32_t]
+			{
+				Diversion^ get(uint32_t shard);
+			}
+
+		internal:
+
+			/// <summary>
+			/// Creates shards that are not backed by the driver. Each shard hands out the template
+			/// packets its filter admits as outbound packets, as Diversion.OpenSimulated does.
+			/// </summary>
+			static ShardedDiversion^ OpenSimulated(array<array<System::Byte>^>^ packets, uint32_t shardCount, ShardKey key);
+
+		private:
+
+			ShardedDiversion(System::String^ filter, uint32_t shardCount, ShardKey key);
+
+			/// <summary>
+			/// Runs on a shard's worker thread.
+			/// </summary>
+			void Work(System::Object^ state);
+
+			/// <summary>
+			/// Closes every handle and waits for the workers to finish.
+			/// </summary>
+			void Stop();
+
+			/// <summary>
+			/// Closes every handle opened so far, ignoring failures.
+			/// </summary>
+			void CloseShards();
+
+			/// <summary>
+			/// The partition, throwing if this object has been disposed.
+			/// </summary>
+			Native::ShardPartition* Partition();
+
+			/// <summary>
+			/// How the flows are divided. Exclusively owned by this object.
+			/// </summary>
+			Native::ShardPartition* m_partition = nullptr;
+
+			/// <summary>
+			/// The filter the shards' filters are built from.
+			/// </summary>
+			System::String^ m_filter = nullptr;
+
+			array<Diversion^>^ m_shards = nullptr;
+
+			array<PacketBufferPool^>^ m_pools = nullptr;
+
+			array<System::Threading::Thread^>^ m_workers = nullptr;
+
+			ShardPacketHandler^ m_handler = nullptr;
+
+			System::Collections::Concurrent::ConcurrentQueue<System::Exception^>^ m_faults = nullptr;
+
+			/// <summary>
+			/// Set by Close, read by the workers between packets.
+			/// </summary>
+			volatile bool m_stopping = false;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
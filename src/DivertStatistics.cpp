@@ -0,0 +1,172 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertStatistics.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		LatencyHistogram::LatencyHistogram(const Native::HistogramSnapshot& histogram)
+		{
+			m_count = histogram.Count;
+			m_sum = histogram.Sum;
+			m_minimum = histogram.Minimum;
+			m_maximum = histogram.Maximum;
+			m_buckets = gcnew array<uint64_t>(static_cast<int>(Native::HistogramBucketCount));
+
+			pin_ptr<uint64_t> buckets = &m_buckets[0];
+			std::memcpy(buckets, histogram.Buckets, sizeof(histogram.Buckets));
+		}
+
+		uint64_t LatencyHistogram::Count::get()
+		{
+			return m_count;
+		}
+
+		double LatencyHistogram::Mean::get()
+		{
+			return m_count == 0 ? 0.0 : static_cast<double>(m_sum) / static_cast<double>(m_count) / 1000.0;
+		}
+
+		double LatencyHistogram::Minimum::get()
+		{
+			return static_cast<double>(m_minimum) / 1000.0;
+		}
+
+		double LatencyHistogram::Maximum::get()
+		{
+			return static_cast<double>(m_maximum) / 1000.0;
+		}
+
+		double LatencyHistogram::GetPercentile(double percentile)
+		{
+			System::Exception^ e = nullptr;
+
+			if (!(percentile >= 0.0 && percentile <= 100.0))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"percentile", u8"In LatencyHistogram::GetPercentile(double) - Percentile must be in the range [0, 100].");
+				throw e;
+			}
+
+			pin_ptr<uint64_t> buckets = &m_buckets[0];
+
+			return static_cast<double>(Native::HistogramPercentile(buckets, m_count, m_maximum, percentile)) / 1000.0;
+		}
+
+		DiversionStatistics::DiversionStatistics(const Native::StatisticsSnapshot& snapshot)
+		{
+			// TimeSpan ticks are 100ns.
+			m_elapsed = System::TimeSpan::FromTicks(static_cast<int64_t>(snapshot.Elapsed / 100));
+			m_receivedPackets = snapshot.ReceivedPackets;
+			m_receivedBytes = snapshot.ReceivedBytes;
+			m_sentPackets = snapshot.SentPackets;
+			m_sentBytes = snapshot.SentBytes;
+			m_receiveErrors = snapshot.ReceiveErrors;
+			m_sendErrors = snapshot.SendErrors;
+			m_pendingStarted = snapshot.PendingStarted;
+			m_pendingCompleted = snapshot.PendingCompleted;
+			m_otherErrors = snapshot.OtherErrors;
+
+			System::Collections::Generic::Dictionary<int, uint64_t>^ errorCounts = gcnew System::Collections::Generic::Dictionary<int, uint64_t>(static_cast<int>(snapshot.ErrorCodeCount));
+
+			for (uint32_t i = 0; i < snapshot.ErrorCodeCount; ++i)
+			{
+				errorCounts[snapshot.Errors[i].Error] = snapshot.Errors[i].Count;
+			}
+
+			m_errorCounts = gcnew System::Collections::ObjectModel::ReadOnlyDictionary<int, uint64_t>(errorCounts);
+
+			m_reinjectLatency = gcnew LatencyHistogram(snapshot.ReinjectLatency);
+			m_completionLatency = gcnew LatencyHistogram(snapshot.CompletionLatency);
+		}
+
+		System::TimeSpan DiversionStatistics::Elapsed::get()
+		{
+			return m_elapsed;
+		}
+
+		uint64_t DiversionStatistics::ReceivedPackets::get()
+		{
+			return m_receivedPackets;
+		}
+
+		uint64_t DiversionStatistics::ReceivedBytes::get()
+		{
+			return m_receivedBytes;
+		}
+
+		uint64_t DiversionStatistics::SentPackets::get()
+		{
+			return m_sentPackets;
+		}
+
+		uint64_t DiversionStatistics::SentBytes::get()
+		{
+			return m_sentBytes;
+		}
+
+		uint64_t DiversionStatistics::ReceiveErrors::get()
+		{
+			return m_receiveErrors;
+		}
+
+		uint64_t DiversionStatistics::SendErrors::get()
+		{
+			return m_sendErrors;
+		}
+
+		uint64_t DiversionStatistics::PendingStarted::get()
+		{
+			return m_pendingStarted;
+		}
+
+		uint64_t DiversionStatistics::PendingCompleted::get()
+		{
+			return m_pendingCompleted;
+		}
+
+		System::Collections::Generic::IReadOnlyDictionary<int, uint64_t>^ DiversionStatistics::ErrorCounts::get()
+		{
+			return m_errorCounts;
+		}
+
+		uint64_t DiversionStatistics::OtherErrors::get()
+		{
+			return m_otherErrors;
+		}
+
+		LatencyHistogram^ DiversionStatistics::ReinjectLatency::get()
+		{
+			return m_reinjectLatency;
+		}
+
+		LatencyHistogram^ DiversionStatistics::CompletionLatency::get()
+		{
+			return m_completionLatency;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,268 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertNativeStatistics.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// A latency histogram, as copied out by Diversion.GetStatistics(). Values are kept in
+		/// log-linear buckets, so percentiles are accurate to about 3%.
+		/// </summary>
+		public ref class LatencyHistogram sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// The number of values recorded.
+			/// </summary>
+			property uint64_t Count
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The mean of the values recorded, in microseconds. Zero if there are none.
+			/// </summary>
+			property double Mean
+			{
+				double get();
+			}
+
+			/// <summary>
+			/// The smallest value recorded, in microseconds. Zero if there are none.
+			/// </summary>
+			property double Minimum
+			{
+				double get();
+			}
+
+			/// <summary>
+			/// The largest value recorded, in microseconds. Zero if there are none.
+			/// </summary>
+			property double Maximum
+			{
+				double get();
+			}
+
+			/// <summary>
+			/// Gets the value below which a given percentage of the recorded values lie.
+			/// </summary>
+			/// <param name="percentile">
+			/// The percentile, in the range [0, 100].
+			/// </param>
+			/// <returns>
+			/// The percentile, in microseconds. Zero if there are no values.
+			/// </returns>
+			double GetPercentile(double percentile);
+
+		internal:
+
+			/// <summary>
+			/// Copies a histogram out of a native snapshot.
+			/// </summary>
+			LatencyHistogram(const Native::HistogramSnapshot& histogram);
+
+		private:
+
+			uint64_t m_count;
+
+			uint64_t m_sum;
+
+			uint64_t m_minimum;
+
+			uint64_t m_maximum;
+
+			array<uint64_t>^ m_buckets;
+
+		};
+
+		/// <summary>
+		/// A snapshot of the I/O counters and latency histograms of one Diversion, as returned by
+		/// Diversion.GetStatistics(). Every count is since the Diversion was opened. To get rates,
+		/// take two snapshots and divide the difference in counts by the difference in Elapsed.
+		/// 
+		/// Counters are read one after the other while traffic is flowing, so under load they can
+		/// disagree with each other by a few operations.
+		/// </summary>
+		public ref class DiversionStatistics sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// The time between the Diversion being opened and the snapshot being taken.
+			/// </summary>
+			property System::TimeSpan Elapsed
+			{
+				System::TimeSpan get();
+			}
+
+			/// <summary>
+			/// The number of packets received, by every receive method.
+			/// </summary>
+			property uint64_t ReceivedPackets
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The total length of the packets received.
+			/// </summary>
+			property uint64_t ReceivedBytes
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of packets injected, by every send method.
+			/// </summary>
+			property uint64_t SentPackets
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The total length of the packets injected.
+			/// </summary>
+			property uint64_t SentBytes
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of receives that failed.
+			/// </summary>
+			property uint64_t ReceiveErrors
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of packets that failed to inject.
+			/// </summary>
+			property uint64_t SendErrors
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of overlapped receives and sends that went pending.
+			/// </summary>
+			property uint64_t PendingStarted
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The number of operations that went pending and have completed since. Together with
+			/// PendingStarted, this tells how many operations are waiting on the driver.
+			/// </summary>
+			property uint64_t PendingCompleted
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Failed receives and sends by Win32 error code. Only the first few distinct codes
+			/// are counted individually, the rest are counted in OtherErrors.
+			/// </summary>
+			property System::Collections::Generic::IReadOnlyDictionary<int, uint64_t>^ ErrorCounts
+			{
+				System::Collections::Generic::IReadOnlyDictionary<int, uint64_t>^ get();
+			}
+
+			/// <summary>
+			/// Failures whose error code is not in ErrorCounts.
+			/// </summary>
+			property uint64_t OtherErrors
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// The time from a packet being received to it being sent again with the same
+			/// Address, or with the same address slot of a PacketBatch.
+			/// </summary>
+			property LatencyHistogram^ ReinjectLatency
+			{
+				LatencyHistogram^ get();
+			}
+
+			/// <summary>
+			/// The time from an overlapped receive or send going pending to its completion being
+			/// seen: when DivertAsyncResult.Get() returns, when a ReceiveOperation completes, or
+			/// when a ReceiveEngine worker picks up a read.
+			/// </summary>
+			property LatencyHistogram^ CompletionLatency
+			{
+				LatencyHistogram^ get();
+			}
+
+		internal:
+
+			/// <summary>
+			/// Copies a native snapshot.
+			/// </summary>
+			DiversionStatistics(const Native::StatisticsSnapshot& snapshot);
+
+		private:
+
+			System::TimeSpan m_elapsed;
+
+			uint64_t m_receivedPackets;
+
+			uint64_t m_receivedBytes;
+
+			uint64_t m_sentPackets;
+
+			uint64_t m_sentBytes;
+
+			uint64_t m_receiveErrors;
+
+			uint64_t m_sendErrors;
+
+			uint64_t m_pendingStarted;
+
+			uint64_t m_pendingCompleted;
+
+			System::Collections::Generic::IReadOnlyDictionary<int, uint64_t>^ m_errorCounts;
+
+			uint64_t m_otherErrors;
+
+			LatencyHistogram^ m_reinjectLatency;
+
+			LatencyHistogram^ m_completionLatency;
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
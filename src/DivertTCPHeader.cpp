@@ -25,6 +25,8 @@
 #include "DivertTCPHeader.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -48,18 +50,6 @@ namespace Divert
 				// This pointer is provided by WinDivert and is not ours to manage.
 				m_tcpHeader = nullptr;
 			}
-
-			if (m_tcpv4Table != nullptr)
-			{
-				// This object is exclusively owned by this object and therefore needs to be freed here.
-				free(m_tcpv4Table);
-			}
-
-			if (m_tcpv6Table != nullptr)
-			{
-				// This object is exclusively owned by this object and therefore needs to be freed here.
-				free(m_tcpv6Table);
-			}
 		}
 
 		TCPHeader::TCPHeader(PWINDIVERT_TCPHDR tcpHeader)
@@ -86,7 +76,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT16 before = m_tcpHeader->SrcPort;
 				m_tcpHeader->SrcPort = ByteSwap(value);
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -104,7 +96,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT16 before = m_tcpHeader->DstPort;
 				m_tcpHeader->DstPort = ByteSwap(value);
+				ChecksummedBytesChanged(2, &before, sizeof(before));
 			}
 		}
 
@@ -122,7 +116,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT32 before = m_tcpHeader->SeqNum;
 				m_tcpHeader->SeqNum = ByteSwap(value);
+				ChecksummedBytesChanged(4, &before, sizeof(before));
 			}
 		}
 
@@ -140,7 +136,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT32 before = m_tcpHeader->AckNum;
 				m_tcpHeader->AckNum = ByteSwap(value);
+				ChecksummedBytesChanged(8, &before, sizeof(before));
 			}
 		}
 
@@ -158,7 +156,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Reserved1 = ByteSwap(value);
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -176,7 +176,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->HdrLength = ByteSwap(value);
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -194,7 +196,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Fin = value;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -212,7 +216,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Syn = value;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -230,7 +236,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Rst = value;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -248,7 +256,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Psh = ByteSwap(value);
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -266,7 +276,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Ack = value;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -284,7 +296,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Urg = value;
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -302,7 +316,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				uint16_t before = WordAt(12);
 				m_tcpHeader->Reserved2 = ByteSwap(value);
+				ChecksummedBytesChanged(12, &before, sizeof(before));
 			}
 		}
 
@@ -320,7 +336,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT16 before = m_tcpHeader->Window;
 				m_tcpHeader->Window = ByteSwap(value);
+				ChecksummedBytesChanged(14, &before, sizeof(before));
 			}
 		}
 
@@ -356,7 +374,9 @@ namespace Divert
 		{
 			if (m_tcpHeader != nullptr)
 			{
+				UINT16 before = m_tcpHeader->UrgPtr;
 				m_tcpHeader->UrgPtr = ByteSwap(value);
+				ChecksummedBytesChanged(18, &before, sizeof(before));
 			}
 		}
 
@@ -375,24 +395,29 @@ namespace Divert
 			m_tcpHeader = value;
 		}
 
-		PMIB_TCPTABLE2 TCPHeader::UnmanagedTcpV4Table::get()
+		bool TCPHeader::IncrementalChecksums::get()
 		{
-			return m_tcpv4Table;
+			return m_incrementalChecksums;
 		}
 
-		void TCPHeader::UnmanagedTcpV4Table::set(PMIB_TCPTABLE2 value)
+		void TCPHeader::IncrementalChecksums::set(bool value)
 		{
-			m_tcpv4Table = value;
+			m_incrementalChecksums = value;
 		}
 
-		PMIB_TCP6TABLE2 TCPHeader::UnmanagedTcpV6Table::get()
+		uint16_t TCPHeader::WordAt(uint32_t offset)
 		{
-			return m_tcpv6Table;
+			uint16_t word;
+			std::memcpy(&word, reinterpret_cast<uint8_t*>(m_tcpHeader) + offset, sizeof(word));
+			return word;
 		}
 
-		void TCPHeader::UnmanagedTcpV6Table::set(PMIB_TCP6TABLE2 value)
+		void TCPHeader::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
 		{
-			m_tcpv6Table = value;
+			if (m_incrementalChecksums)
+			{
+				Native::UpdateChecksum(&m_tcpHeader->Checksum, before, reinterpret_cast<uint8_t*>(m_tcpHeader) + offset, length, false);
+			}
 		}
 
 	} /* namespace Net */
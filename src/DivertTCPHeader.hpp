@@ -217,41 +217,14 @@ namespace Divert
 			}
 
 			/// <summary>
-			/// Internal accessor to the unmanaged PMIB_TCPTABLE2 object held by this object. The
-			/// purpose of the PMIB_TCPTABLE2 object is to allow the user to easily get the
-			/// information about the process behind behind a TCP packet flow. Static helper
-			/// functions are made available in the Diversion class where the user can query this
-			/// type of information by supplying DivertTCPHeader or DivertUDPHeader along with the
-			/// appropriate IP header.
-			/// 
-			/// This object will handle freeing the data this member points to.
-			/// </summary>
-			/// <returns>
-			/// The unmanaged PMIB_TCPTABLE2 member. 
-			/// </returns>
-			property PMIB_TCPTABLE2 UnmanagedTcpV4Table
-			{
-				PMIB_TCPTABLE2 get();
-				void set(PMIB_TCPTABLE2 value);
-			}
-
-			/// <summary>
-			/// Internal accessor to the unmanaged PMIB_TCP6TABLE2 object held by this object. The
-			/// purpose of the PMIB_TCPTABLE2 object is to allow the user to easily get the
-			/// information about the process behind behind a TCP packet flow. Static helper
-			/// functions are made available in the Diversion class where the user can query this
-			/// type of information by supplying DivertTCPHeader or DivertUDPHeader along with the
-			/// appropriate IP header.
-			/// 
-			/// This object will handle freeing the data this member points to.
+			/// When set, each setter folds its change into the header checksum as per RFC 1624, so
+			/// the packet doesn't need a full Diversion::CalculateChecksums afterwards. Set by
+			/// Diversion::ParsePacket from Diversion::IncrementalChecksums.
 			/// </summary>
-			/// <returns>
-			/// The unmanaged PMIB_TCP6TABLE2 member. 
-			/// </returns>
-			property PMIB_TCP6TABLE2 UnmanagedTcpV6Table
+			property bool IncrementalChecksums
 			{
-				PMIB_TCP6TABLE2 get();
-				void set(PMIB_TCP6TABLE2 value);
+				bool get();
+				void set(bool value);
 			}
 
 		private:
@@ -261,18 +234,22 @@ namespace Divert
 			/// members of the library can access it, but it's kept away from the user.
 			/// </summary>
 			PWINDIVERT_TCPHDR m_tcpHeader = nullptr;
-			
+
 			/// <summary>
-			/// Privately held PWINDIVERT_TCPHDR member. Exposed internally only so that other
-			/// members of the library can access it, but it's kept away from the user.
+			/// Reads the 16 bit word at the given offset into the header, in memory order.
 			/// </summary>
-			PMIB_TCPTABLE2 m_tcpv4Table = nullptr;
+			uint16_t WordAt(uint32_t offset);
 
 			/// <summary>
-			/// Privately held PWINDIVERT_TCPHDR member. Exposed internally only so that other
-			/// members of the library can access it, but it's kept away from the user.
+			/// Called by the setters after changing bytes covered by a checksum, with a copy of the
+			/// bytes as they were. Does nothing unless IncrementalChecksums is set.
+			/// </summary>
+			void ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length);
+
+			/// <summary>
+			/// Whether the setters update the checksums.
 			/// </summary>
-			PMIB_TCP6TABLE2 m_tcpv6Table = nullptr;
+			bool m_incrementalChecksums = false;
 		};
 
 	} /* namespace Net */
@@ -0,0 +1,389 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include "DivertTCPReassembler.hpp"
+
+#include "Util.hpp"
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		TCPReassembler::TCPReassembler(uint32_t maximumConnections, uint32_t connectionMemoryLimit, uint64_t memoryLimit, uint32_t idleTimeoutInMilliseconds)
+		{
+			System::Exception^ e = nullptr;
+
+			if (maximumConnections == 0 || maximumConnections > Native::FlowTable::MaximumCapacity)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"maximumConnections", u8"In TCPReassembler::TCPReassembler(uint32_t, uint32_t, uint64_t, uint32_t) - Maximum connections must be greater than zero and less than 2^31.");
+				throw e;
+			}
+
+			m_reassembler = new Native::TCPReassembler(maximumConnections, connectionMemoryLimit, memoryLimit, idleTimeoutInMilliseconds);
+		}
+
+		TCPReassembler::~TCPReassembler()
+		{
+			this->!TCPReassembler();
+		}
+
+		TCPReassembler::!TCPReassembler()
+		{
+			if (m_reassembler != nullptr)
+			{
+				delete m_reassembler;
+				m_reassembler = nullptr;
+			}
+		}
+
+		TCPSegmentResult TCPReassembler::Push(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength)
+		{
+			return Push(address, ipv4Header, tcpHeader, packetBuffer, packetLength, nullptr);
+		}
+
+		TCPSegmentResult TCPReassembler::Push(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, TCPDataHandler^ handler)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv4Header == nullptr || tcpHeader == nullptr || packetBuffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv4Header == nullptr ? u8"ipv4Header" : (tcpHeader == nullptr ? u8"tcpHeader" : u8"packetBuffer")), u8"In TCPReassembler::Push(Address^, IPHeader^, TCPHeader^, array<System::Byte>^, uint32_t, TCPDataHandler^) - Supplied address, header or buffer is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+			PWINDIVERT_IPHDR ipHeader = ipv4Header->UnmanagedHeader;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				4, IPPROTO_TCP, outbound,
+				&ipHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
+
+			return Push(key, outbound, tcpHeader->UnmanagedHeader, packetBuffer, packetLength, ipHeader, ByteSwap(ipHeader->Length), handler);
+		}
+
+		TCPSegmentResult TCPReassembler::Push(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength)
+		{
+			return Push(address, ipv6Header, tcpHeader, packetBuffer, packetLength, nullptr);
+		}
+
+		TCPSegmentResult TCPReassembler::Push(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, TCPDataHandler^ handler)
+		{
+			System::Exception^ e = nullptr;
+
+			if (address == nullptr || ipv6Header == nullptr || tcpHeader == nullptr || packetBuffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(address == nullptr ? u8"address" : (ipv6Header == nullptr ? u8"ipv6Header" : (tcpHeader == nullptr ? u8"tcpHeader" : u8"packetBuffer")), u8"In TCPReassembler::Push(Address^, IPv6Header^, TCPHeader^, array<System::Byte>^, uint32_t, TCPDataHandler^) - Supplied address, header or buffer is null.");
+				throw e;
+			}
+
+			const bool outbound = address->Direction == DivertDirection::Outbound;
+			PWINDIVERT_IPV6HDR ipHeader = ipv6Header->UnmanagedHeader;
+
+			const Native::FlowKey key = Native::FlowKey::FromPacket(
+				6, IPPROTO_TCP, outbound,
+				&ipHeader->SrcAddr, tcpHeader->UnmanagedHeader->SrcPort,
+				&ipHeader->DstAddr, tcpHeader->UnmanagedHeader->DstPort
+			);
+
+			// The payload length covers extension headers, not the fixed header.
+			return Push(key, outbound, tcpHeader->UnmanagedHeader, packetBuffer, packetLength, ipHeader, sizeof(WINDIVERT_IPV6HDR) + ByteSwap(ipHeader->Length), handler);
+		}
+
+		bool TCPReassembler::IsLive(TCPStream stream)
+		{
+			Native::TCPReassembler* reassembler = Reassembler();
+			const uint32_t flow = Native::TCPReassembler::FlowOf(stream.Index);
+
+			return stream.IsValid && reassembler->Flows().IsLive(flow) && reassembler->Flows().Generation(flow) == stream.Generation;
+		}
+
+		uint32_t TCPReassembler::GetAvailable(TCPStream stream)
+		{
+			return m_reassembler->Available(LiveStream(stream));
+		}
+
+		int TCPReassembler::Read(TCPStream stream, array<System::Byte>^ buffer, int offset, int count)
+		{
+			System::Exception^ e = nullptr;
+
+			if (buffer == nullptr)
+			{
+				e = gcnew System::ArgumentNullException(u8"buffer", u8"In TCPReassembler::Read(TCPStream, array<System::Byte>^, int, int) - Supplied buffer is null.");
+				throw e;
+			}
+
+			if (offset < 0 || count < 0 || count > buffer->Length - offset)
+			{
+				e = gcnew System::ArgumentOutOfRangeException(offset < 0 ? u8"offset" : u8"count", u8"In TCPReassembler::Read(TCPStream, array<System::Byte>^, int, int) - Offset and count must describe a range within the buffer.");
+				throw e;
+			}
+
+			const uint32_t index = LiveStream(stream);
+
+			if (count == 0 || m_reassembler->Available(index) == 0)
+			{
+				return 0;
+			}
+
+			const uint32_t MaximumChunks = 16;
+			Native::TCPStreamChunk chunks[MaximumChunks];
+			int read = 0;
+
+			while (read < count)
+			{
+				const uint32_t chunkCount = m_reassembler->Peek(index, chunks, MaximumChunks);
+
+				if (chunkCount == 0)
+				{
+					break;
+				}
+
+				uint32_t taken = 0;
+
+				for (uint32_t i = 0; i < chunkCount && read < count; ++i)
+				{
+					const int length = static_cast<int>(chunks[i].Length < static_cast<uint32_t>(count - read) ? chunks[i].Length : static_cast<uint32_t>(count - read));
+
+					// Borrowed chunks are only seen from a TCPDataHandler, while the packet is pinned.
+					System::Runtime::InteropServices::Marshal::Copy(System::IntPtr(const_cast<uint8_t*>(chunks[i].Data)), buffer, offset + read, length);
+
+					read += length;
+					taken += static_cast<uint32_t>(length);
+				}
+
+				m_reassembler->Consume(index, taken);
+			}
+
+			return read;
+		}
+
+		uint32_t TCPReassembler::Consume(TCPStream stream, uint32_t count)
+		{
+			return m_reassembler->Consume(LiveStream(stream), count);
+		}
+
+		uint32_t TCPReassembler::SkipGap(TCPStream stream)
+		{
+			return m_reassembler->SkipGap(LiveStream(stream));
+		}
+
+		uint64_t TCPReassembler::GetPosition(TCPStream stream)
+		{
+			return m_reassembler->Position(LiveStream(stream));
+		}
+
+		bool TCPReassembler::IsFinished(TCPStream stream)
+		{
+			return m_reassembler->IsFinished(LiveStream(stream));
+		}
+
+		uint32_t TCPReassembler::Expire()
+		{
+			return Reassembler()->Expire(Native::FlowTable::NowInMilliseconds(), 0);
+		}
+
+		void TCPReassembler::Clear()
+		{
+			Reassembler()->Clear();
+		}
+
+		void TCPReassembler::ResetStatistics()
+		{
+			Reassembler()->ResetStatistics();
+		}
+
+		uint32_t TCPReassembler::ConnectionCount::get()
+		{
+			return Reassembler()->Flows().Count();
+		}
+
+		uint32_t TCPReassembler::ConnectionMemoryLimit::get()
+		{
+			return Reassembler()->FlowMemoryLimit();
+		}
+
+		void TCPReassembler::ConnectionMemoryLimit::set(uint32_t value)
+		{
+			Reassembler()->SetFlowMemoryLimit(value);
+		}
+
+		uint64_t TCPReassembler::MemoryLimit::get()
+		{
+			return Reassembler()->MemoryLimit();
+		}
+
+		void TCPReassembler::MemoryLimit::set(uint64_t value)
+		{
+			Reassembler()->SetMemoryLimit(value);
+		}
+
+		uint64_t TCPReassembler::MemoryUsed::get()
+		{
+			return Reassembler()->Statistics().MemoryUsed;
+		}
+
+		uint64_t TCPReassembler::MemoryReserved::get()
+		{
+			return Reassembler()->Statistics().MemoryReserved;
+		}
+
+		uint64_t TCPReassembler::Segments::get()
+		{
+			return Reassembler()->Statistics().Segments;
+		}
+
+		uint64_t TCPReassembler::Borrowed::get()
+		{
+			return Reassembler()->Statistics().Borrowed;
+		}
+
+		uint64_t TCPReassembler::Retained::get()
+		{
+			return Reassembler()->Statistics().Retained;
+		}
+
+		uint64_t TCPReassembler::OutOfOrder::get()
+		{
+			return Reassembler()->Statistics().OutOfOrder;
+		}
+
+		uint64_t TCPReassembler::Duplicates::get()
+		{
+			return Reassembler()->Statistics().Duplicates;
+		}
+
+		uint64_t TCPReassembler::OutOfWindow::get()
+		{
+			return Reassembler()->Statistics().OutOfWindow;
+		}
+
+		uint64_t TCPReassembler::DroppedBytes::get()
+		{
+			return Reassembler()->Statistics().DroppedBytes;
+		}
+
+		uint64_t TCPReassembler::SkippedBytes::get()
+		{
+			return Reassembler()->Statistics().SkippedBytes;
+		}
+
+		TCPSegmentResult TCPReassembler::Push(const Native::FlowKey& key, bool outbound, PWINDIVERT_TCPHDR tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, const void* ipHeader, uint32_t ipLength, TCPDataHandler^ handler)
+		{
+			System::Exception^ e = nullptr;
+
+			Native::TCPReassembler* reassembler = Reassembler();
+
+			if (packetLength > static_cast<uint32_t>(packetBuffer->Length))
+			{
+				e = gcnew System::ArgumentOutOfRangeException(u8"packetLength", u8"In TCPReassembler::Push(const Native::FlowKey&, bool, PWINDIVERT_TCPHDR, array<System::Byte>^, uint32_t, const void*, uint32_t, TCPDataHandler^) - Packet length exceeds the buffer.");
+				throw e;
+			}
+
+			pin_ptr<System::Byte> pinnedPacket = &packetBuffer[0];
+
+			const uint8_t* packet = pinnedPacket;
+			const uint8_t* ip = static_cast<const uint8_t*>(ipHeader);
+			const uint8_t* tcp = reinterpret_cast<const uint8_t*>(tcpHeader);
+
+			if (ip < packet || tcp < ip || tcp + sizeof(WINDIVERT_TCPHDR) > packet + packetLength)
+			{
+				e = gcnew System::ArgumentException(u8"In TCPReassembler::Push(const Native::FlowKey&, bool, PWINDIVERT_TCPHDR, array<System::Byte>^, uint32_t, const void*, uint32_t, TCPDataHandler^) - The headers don't lie within the supplied packet. Parse the packet with Diversion::ParsePacket first.");
+				throw e;
+			}
+
+			// Trailing bytes past the length the IP header gives aren't part of the segment.
+			const uint8_t* payload = tcp + tcpHeader->HdrLength * 4;
+			const uint8_t* end = ip + ipLength < packet + packetLength ? ip + ipLength : packet + packetLength;
+			const uint32_t payloadLength = end > payload ? static_cast<uint32_t>(end - payload) : 0;
+
+			const uint8_t tcpFlags = static_cast<uint8_t>(
+				(tcpHeader->Fin ? Native::FlowTable::TcpFin : 0) |
+				(tcpHeader->Syn ? Native::FlowTable::TcpSyn : 0) |
+				(tcpHeader->Rst ? Native::FlowTable::TcpRst : 0)
+				);
+
+			const Native::TCPSegmentResult result = reassembler->Push(key, outbound, ByteSwap(tcpHeader->SeqNum), tcpFlags, payload, payloadLength, Native::FlowTable::NowInMilliseconds());
+
+			if (result.Stream == Native::TCPReassembler::InvalidStream)
+			{
+				return TCPSegmentResult(TCPStream(), static_cast<TCPSegmentStatus>(result.Status));
+			}
+
+			const TCPStream stream(result.Stream, reassembler->Flows().Generation(Native::TCPReassembler::FlowOf(result.Stream)));
+
+			Native::TCPStreamChunk chunk;
+
+			// Data still in the packet can be handed out as it is, but only while it's pinned.
+			if (handler != nullptr && reassembler->Peek(result.Stream, &chunk, 1) == 1 && chunk.Borrowed)
+			{
+				const uint32_t used = handler(stream, System::ArraySegment<System::Byte>(packetBuffer, static_cast<int>((payload - packet) + chunk.PayloadOffset), static_cast<int>(chunk.Length)));
+
+				// The handler may have cleared or disposed of the reassembler.
+				if (used != 0 && m_reassembler != nullptr && IsLive(stream))
+				{
+					m_reassembler->Consume(result.Stream, used < chunk.Length ? used : chunk.Length);
+				}
+			}
+
+			// Whatever is left unread is copied before returning, so that the caller can reuse the
+			// buffer right away.
+			if (m_reassembler != nullptr)
+			{
+				m_reassembler->Retain();
+			}
+
+			return TCPSegmentResult(stream, static_cast<TCPSegmentStatus>(result.Status));
+		}
+
+		uint32_t TCPReassembler::LiveStream(TCPStream stream)
+		{
+			System::Exception^ e = nullptr;
+
+			if (!IsLive(stream))
+			{
+				e = gcnew System::InvalidOperationException(u8"In TCPReassembler::LiveStream(TCPStream) - The stream's connection has ended.");
+				throw e;
+			}
+
+			return stream.Index;
+		}
+
+		Native::TCPReassembler* TCPReassembler::Reassembler()
+		{
+			System::Exception^ e = nullptr;
+
+			if (m_reassembler == nullptr)
+			{
+				e = gcnew System::ObjectDisposedException(u8"TCPReassembler", u8"In TCPReassembler::Reassembler() - TCP reassembler has been disposed.");
+				throw e;
+			}
+
+			return m_reassembler;
+		}
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -0,0 +1,444 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#pragma once
+
+#include "DivertAddress.hpp"
+#include "DivertIpHeader.hpp"
+#include "DivertIpv6Header.hpp"
+#include "DivertTCPHeader.hpp"
+#include "DivertNativeTCPReassembler.hpp"
+#include <cstdint>
+
+namespace Divert
+{
+	namespace Net
+	{
+
+		/// <summary>
+		/// What TCPReassembler.Push did with a segment. Any combination of the values.
+		/// </summary>
+		public enum class TCPSegmentStatus : System::UInt32
+		{
+			None = 0,
+
+			/// <summary>
+			/// The segment made more data readable.
+			/// </summary>
+			Data = Native::TCPReassembler::StatusData,
+
+			/// <summary>
+			/// The segment was buffered ahead of a gap.
+			/// </summary>
+			OutOfOrder = Native::TCPReassembler::StatusOutOfOrder,
+
+			/// <summary>
+			/// The segment carried nothing new.
+			/// </summary>
+			Duplicate = Native::TCPReassembler::StatusDuplicate,
+
+			/// <summary>
+			/// Some or all of the segment was dropped to stay within the memory limits.
+			/// </summary>
+			OverLimit = Native::TCPReassembler::StatusOverLimit,
+
+			/// <summary>
+			/// Everything up to the stream's FIN has arrived. Reported once per stream.
+			/// </summary>
+			Finished = Native::TCPReassembler::StatusFinished,
+
+			/// <summary>
+			/// The segment was a RST. Both streams of the flow can still be read until the next
+			/// call to Push, Expire or Clear, which ends the flow.
+			/// </summary>
+			Reset = Native::TCPReassembler::StatusReset,
+
+			/// <summary>
+			/// The flow was created for this segment.
+			/// </summary>
+			NewFlow = Native::TCPReassembler::StatusNewFlow,
+
+			/// <summary>
+			/// The segment started too far ahead of the stream to be believed, and was dropped.
+			/// </summary>
+			OutOfWindow = Native::TCPReassembler::StatusOutOfWindow
+		};
+
+		/// <summary>
+		/// Identifies one direction of one TCP connection in a TCPReassembler. Like TrackedFlow,
+		/// a TCPStream kept past the end of its connection is simply no longer live.
+		/// </summary>
+		public value struct TCPStream
+		{
+
+		public:
+
+			/// <summary>
+			/// The stream's number in its reassembler.
+			/// </summary>
+			property uint32_t Index
+			{
+				uint32_t get() { return m_index; }
+			}
+
+			property uint32_t Generation
+			{
+				uint32_t get() { return m_generation; }
+			}
+
+			/// <summary>
+			/// Whether this is the data sent from this machine, rather than to it.
+			/// </summary>
+			property bool IsOutbound
+			{
+				bool get() { return Native::TCPReassembler::IsOutbound(m_index); }
+			}
+
+			/// <summary>
+			/// False for the stream returned for a RST that doesn't belong to any connection, and
+			/// for a default constructed value.
+			/// </summary>
+			property bool IsValid
+			{
+				bool get() { return m_generation != 0; }
+			}
+
+		internal:
+
+			TCPStream(uint32_t index, uint32_t generation) : m_index(index), m_generation(generation)
+			{
+
+			}
+
+		private:
+
+			uint32_t m_index;
+
+			uint32_t m_generation;
+
+		};
+
+		/// <summary>
+		/// The outcome of TCPReassembler.Push.
+		/// </summary>
+		public value struct TCPSegmentResult
+		{
+
+		public:
+
+			property TCPStream Stream
+			{
+				TCPStream get() { return m_stream; }
+			}
+
+			property TCPSegmentStatus Status
+			{
+				TCPSegmentStatus get() { return m_status; }
+			}
+
+		internal:
+
+			TCPSegmentResult(TCPStream stream, TCPSegmentStatus status) : m_stream(stream), m_status(status)
+			{
+
+			}
+
+		private:
+
+			TCPStream m_stream;
+
+			TCPSegmentStatus m_status;
+
+		};
+
+		/// <summary>
+		/// Handles the data a segment made readable while it is still in the packet buffer passed
+		/// to TCPReassembler.Push, valid only until the handler returns. Returns how many bytes of
+		/// it were used. The rest is copied, to be read later.
+		/// </summary>
+		public delegate uint32_t TCPDataHandler(TCPStream stream, System::ArraySegment<System::Byte> data);
+
+		/// <summary>
+		/// Puts the payloads of TCP segments back in sequence order, so that what each end of a
+		/// connection sent can be read as a stream of bytes, however the segments arrived. Each
+		/// connection has two streams, one per direction. Where segments overlap, the bytes that
+		/// arrived first are kept.
+		/// 
+		/// A segment that arrives in order while nothing of its stream is waiting to be read is
+		/// not copied if a TCPDataHandler passed to Push uses it straight from the packet buffer.
+		/// Whatever it leaves unread is copied before Push returns. Other segments are copied into
+		/// pooled memory, capped per connection and in total. A segment that would go over either
+		/// limit is dropped, and the gap it leaves can be given up on with SkipGap.
+		/// 
+		/// Not safe for concurrent use. Give each thread that handles packets its own reassembler.
+		/// </summary>
+		public ref class TCPReassembler sealed
+		{
+
+		public:
+
+			/// <summary>
+			/// Constructs a reassembler.
+			/// </summary>
+			/// <param name="maximumConnections">
+			/// The most connections tracked at once. When full, the least recently seen connection
+			/// makes room.
+			/// </param>
+			/// <param name="connectionMemoryLimit">
+			/// The most bytes a connection may have buffered, both directions together.
+			/// </param>
+			/// <param name="memoryLimit">
+			/// The most bytes all connections together may have buffered.
+			/// </param>
+			/// <param name="idleTimeoutInMilliseconds">
+			/// How long a connection may go without a segment before it's forgotten.
+			/// </param>
+			TCPReassembler(uint32_t maximumConnections, uint32_t connectionMemoryLimit, uint64_t memoryLimit, uint32_t idleTimeoutInMilliseconds);
+
+			/// <summary>
+			/// Destructor, invokes finalizer as per docs here
+			/// https://msdn.microsoft.com/library/ms177197(v=vs.100).aspx.
+			/// </summary>
+			~TCPReassembler();
+
+			/// <summary>
+			/// Finalizer for releasing unmanaged resources.
+			/// </summary>
+			!TCPReassembler();
+
+			/// <summary>
+			/// Adds a TCP over IPv4 segment to its stream. The headers are those populated by
+			/// Diversion.ParsePacket for the packet in packetBuffer. Nothing is kept pointing into
+			/// the buffer, so it may be reused as soon as Push returns.
+			/// </summary>
+			/// <exception cref="System::ArgumentException">
+			/// The headers don't lie within the packet.
+			/// </exception>
+			TCPSegmentResult Push(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength);
+
+			/// <summary>
+			/// As Push, first handing data the segment made readable to handler, if it can be
+			/// read straight from packetBuffer.
+			/// </summary>
+			TCPSegmentResult Push(Address^ address, IPHeader^ ipv4Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, TCPDataHandler^ handler);
+
+			/// <summary>
+			/// Adds a TCP over IPv6 segment to its stream.
+			/// </summary>
+			TCPSegmentResult Push(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength);
+
+			/// <summary>
+			/// Adds a TCP over IPv6 segment to its stream, handing data it made readable to
+			/// handler if it can be read straight from packetBuffer.
+			/// </summary>
+			TCPSegmentResult Push(Address^ address, IPv6Header^ ipv6Header, TCPHeader^ tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, TCPDataHandler^ handler);
+
+			/// <summary>
+			/// Whether a stream's connection is still tracked.
+			/// </summary>
+			bool IsLive(TCPStream stream);
+
+			/// <summary>
+			/// The number of contiguous bytes waiting to be read from a stream.
+			/// </summary>
+			/// <exception cref="System::InvalidOperationException">
+			/// The stream's connection has ended.
+			/// </exception>
+			uint32_t GetAvailable(TCPStream stream);
+
+			/// <summary>
+			/// Copies bytes waiting to be read from a stream into a buffer, and consumes them.
+			/// </summary>
+			/// <returns>
+			/// The number of bytes read, zero if there were none.
+			/// </returns>
+			int Read(TCPStream stream, array<System::Byte>^ buffer, int offset, int count);
+
+			/// <summary>
+			/// Marks bytes at the start of a stream as read.
+			/// </summary>
+			/// <returns>
+			/// The number of bytes consumed, at most GetAvailable.
+			/// </returns>
+			uint32_t Consume(TCPStream stream, uint32_t count);
+
+			/// <summary>
+			/// Gives up on the gap in front of the next buffered data of a stream, or in front of
+			/// its FIN, so that reading can carry on after it. Does nothing while there is data to
+			/// read.
+			/// </summary>
+			/// <returns>
+			/// The number of bytes skipped.
+			/// </returns>
+			uint32_t SkipGap(TCPStream stream);
+
+			/// <summary>
+			/// The offset of the next byte to be read from a stream, from the start of the stream.
+			/// </summary>
+			uint64_t GetPosition(TCPStream stream);
+
+			/// <summary>
+			/// Whether everything up to the FIN of a stream has arrived.
+			/// </summary>
+			bool IsFinished(TCPStream stream);
+
+			/// <summary>
+			/// Ends every connection that has gone IdleTimeout without a segment. Pushing segments
+			/// does this a few connections at a time, so this only needs calling when segments
+			/// stop arriving for a while.
+			/// </summary>
+			/// <returns>
+			/// The number of connections ended.
+			/// </returns>
+			uint32_t Expire();
+
+			/// <summary>
+			/// Forgets every connection.
+			/// </summary>
+			void Clear();
+
+			/// <summary>
+			/// Zeroes every counter other than MemoryUsed and MemoryReserved.
+			/// </summary>
+			void ResetStatistics();
+
+			/// <summary>
+			/// The number of connections currently tracked.
+			/// </summary>
+			property uint32_t ConnectionCount
+			{
+				uint32_t get();
+			}
+
+			property uint32_t ConnectionMemoryLimit
+			{
+				uint32_t get();
+				void set(uint32_t value);
+			}
+
+			property uint64_t MemoryLimit
+			{
+				uint64_t get();
+				void set(uint64_t value);
+			}
+
+			/// <summary>
+			/// Bytes taken by buffered data.
+			/// </summary>
+			property uint64_t MemoryUsed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Bytes set aside for buffered data, in use or not. Grows to the peak of MemoryUsed,
+			/// and is given back when the reassembler is disposed.
+			/// </summary>
+			property uint64_t MemoryReserved
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Segments pushed that carried data or a FIN.
+			/// </summary>
+			property uint64_t Segments
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Segments that could be handed to a TCPDataHandler straight from the packet buffer.
+			/// </summary>
+			property uint64_t Borrowed
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Segments that could be read straight from the packet buffer but weren't all used by
+			/// a TCPDataHandler, and were copied.
+			/// </summary>
+			property uint64_t Retained
+			{
+				uint64_t get();
+			}
+
+			property uint64_t OutOfOrder
+			{
+				uint64_t get();
+			}
+
+			property uint64_t Duplicates
+			{
+				uint64_t get();
+			}
+
+			property uint64_t OutOfWindow
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Bytes dropped to stay within the memory limits.
+			/// </summary>
+			property uint64_t DroppedBytes
+			{
+				uint64_t get();
+			}
+
+			/// <summary>
+			/// Bytes given up on through SkipGap.
+			/// </summary>
+			property uint64_t SkippedBytes
+			{
+				uint64_t get();
+			}
+
+		private:
+
+			/// <summary>
+			/// The reassembler itself. Exclusively owned by this object.
+			/// </summary>
+			Native::TCPReassembler* m_reassembler = nullptr;
+
+			/// <summary>
+			/// Finds the payload within the packet, and pushes it.
+			/// </summary>
+			/// <param name="ipHeader">
+			/// The start of the IP header, ipLength bytes before the end of the packet proper.
+			/// </param>
+			TCPSegmentResult Push(const Native::FlowKey& key, bool outbound, PWINDIVERT_TCPHDR tcpHeader, array<System::Byte>^ packetBuffer, uint32_t packetLength, const void* ipHeader, uint32_t ipLength, TCPDataHandler^ handler);
+
+			/// <summary>
+			/// Returns the native stream number, throwing if its connection has ended.
+			/// </summary>
+			uint32_t LiveStream(TCPStream stream);
+
+			Native::TCPReassembler* Reassembler();
+
+		};
+
+	} /* namespace Net */
+} /* namespace Divert */
@@ -25,6 +25,8 @@
 #include "DivertUDPHeader.hpp"
 
 #include "Util.hpp"
+#include "DivertNativeChecksum.hpp"
+#include <cstring>
 
 namespace Divert
 {
@@ -48,18 +50,6 @@ namespace Divert
 				// This pointer is provided by WinDivert and is not ours to manage.
 				m_udpHeader = nullptr;
 			}
-
-			if (m_udpv4Table != nullptr)
-			{
-				// This object is exclusively owned by this object and therefore needs to be freed here.
-				free(m_udpv4Table);
-			}
-
-			if (m_udpv6Table != nullptr)
-			{
-				// This object is exclusively owned by this object and therefore needs to be freed here.
-				free(m_udpv6Table);
-			}
 		}
 
 		UDPHeader::UDPHeader(PWINDIVERT_UDPHDR udpHeader)
@@ -86,7 +76,9 @@ namespace Divert
 		{
 			if (m_udpHeader != nullptr)
 			{
+				UINT16 before = m_udpHeader->SrcPort;
 				m_udpHeader->SrcPort = ByteSwap(value);
+				ChecksummedBytesChanged(0, &before, sizeof(before));
 			}
 		}
 
@@ -104,7 +96,9 @@ namespace Divert
 		{
 			if (m_udpHeader != nullptr)
 			{
+				UINT16 before = m_udpHeader->DstPort;
 				m_udpHeader->DstPort = ByteSwap(value);
+				ChecksummedBytesChanged(2, &before, sizeof(before));
 			}
 		}
 
@@ -122,7 +116,9 @@ namespace Divert
 		{
 			if (m_udpHeader != nullptr)
 			{
+				UINT16 before = m_udpHeader->Length;
 				m_udpHeader->Length = ByteSwap(value);
+				ChecksummedBytesChanged(4, &before, sizeof(before));
 			}
 		}
 
@@ -159,24 +155,22 @@ namespace Divert
 			m_udpHeader = value;
 		}
 
-		PMIB_UDPTABLE_OWNER_PID UDPHeader::UnmanagedUdpV4Table::get()
+		bool UDPHeader::IncrementalChecksums::get()
 		{
-			return m_udpv4Table;
+			return m_incrementalChecksums;
 		}
 
-		void UDPHeader::UnmanagedUdpV4Table::set(PMIB_UDPTABLE_OWNER_PID value)
+		void UDPHeader::IncrementalChecksums::set(bool value)
 		{
-			m_udpv4Table = value;
+			m_incrementalChecksums = value;
 		}
 
-		PMIB_UDP6TABLE_OWNER_PID UDPHeader::UnmanagedUdpV6Table::get()
+		void UDPHeader::ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length)
 		{
-			return m_udpv6Table;
-		}
-
-		void UDPHeader::UnmanagedUdpV6Table::set(PMIB_UDP6TABLE_OWNER_PID value)
-		{
-			m_udpv6Table = value;
+			if (m_incrementalChecksums)
+			{
+				Native::UpdateChecksum(&m_udpHeader->Checksum, before, reinterpret_cast<uint8_t*>(m_udpHeader) + offset, length, true);
+			}
 		}
 
 	} /* namespace Net */
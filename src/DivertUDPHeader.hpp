@@ -153,41 +153,14 @@ namespace Divert
 			}
 
 			/// <summary>
-			/// Internal accessor to the unmanaged PMIB_UDPTABLE_OWNER_PID object held by this object. The
-			/// purpose of the PMIB_UDPTABLE_OWNER_PID object is to allow the user to easily get the
-			/// information about the process behind behind a TCP packet flow. Static helper
-			/// functions are made available in the Diversion class where the user can query this
-			/// type of information by supplying DivertTCPHeader or DivertUDPHeader along with the
-			/// appropriate IP header.
-			/// 
-			/// This object will handle freeing the data this member points to.
-			/// </summary>
-			/// <returns>
-			/// The unmanaged PMIB_UDPTABLE_OWNER_PID member. 
-			/// </returns>
-			property PMIB_UDPTABLE_OWNER_PID UnmanagedUdpV4Table
-			{
-				PMIB_UDPTABLE_OWNER_PID get();
-				void set(PMIB_UDPTABLE_OWNER_PID value);
-			}
-
-			/// <summary>
-			/// Internal accessor to the unmanaged PMIB_UDP6TABLE_OWNER_PID object held by this object. The
-			/// purpose of the PMIB_UDP6TABLE_OWNER_PID object is to allow the user to easily get the
-			/// information about the process behind behind a TCP packet flow. Static helper
-			/// functions are made available in the Diversion class where the user can query this
-			/// type of information by supplying DivertTCPHeader or DivertUDPHeader along with the
-			/// appropriate IP header.
-			/// 
-			/// This object will handle freeing the data this member points to.
+			/// When set, each setter folds its change into the header checksum as per RFC 1624, so
+			/// the packet doesn't need a full Diversion::CalculateChecksums afterwards. Set by
+			/// Diversion::ParsePacket from Diversion::IncrementalChecksums.
 			/// </summary>
-			/// <returns>
-			/// The unmanaged PMIB_UDP6TABLE_OWNER_PID member. 
-			/// </returns>
-			property PMIB_UDP6TABLE_OWNER_PID UnmanagedUdpV6Table
+			property bool IncrementalChecksums
 			{
-				PMIB_UDP6TABLE_OWNER_PID get();
-				void set(PMIB_UDP6TABLE_OWNER_PID value);
+				bool get();
+				void set(bool value);
 			}
 
 		private:
@@ -198,9 +171,16 @@ namespace Divert
 			/// </summary>
 			PWINDIVERT_UDPHDR m_udpHeader = nullptr;
 
-			PMIB_UDPTABLE_OWNER_PID m_udpv4Table;
+			/// <summary>
+			/// Called by the setters after changing bytes covered by a checksum, with a copy of the
+			/// bytes as they were. Does nothing unless IncrementalChecksums is set.
+			/// </summary>
+			void ChecksummedBytesChanged(uint32_t offset, const void* before, uint32_t length);
 
-			PMIB_UDP6TABLE_OWNER_PID m_udpv6Table;
+			/// <summary>
+			/// Whether the setters update the checksums.
+			/// </summary>
+			bool m_incrementalChecksums = false;
 
 		};
 
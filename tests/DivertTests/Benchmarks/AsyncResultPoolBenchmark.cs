@@ -0,0 +1,121 @@
+﻿* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares ReceiveAsync with a fresh DivertAsyncResult per packet against ReceiveAsync with
+    /// results rented from a DivertAsyncResultPool, using the simulated packet source as the
+    /// backend. The pooled loop should report zero DivertAsyncResult allocations and zero gen 0
+    /// collections once it is warmed up.
+    /// </summary>
+    internal static class AsyncResultPoolBenchmark
+    {
+        private const long PacketsPerRun = 2000000;
+
+        private const uint BufferLength = 2048;
+
+        private const uint PoolSize = 64;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+            Address address = new Address();
+
+            ReceiveUnpooled(diversion, address, PacketsPerRun / 10);
+            Measure("ReceiveAsync, new result per packet", () => ReceiveUnpooled(diversion, address, PacketsPerRun));
+
+            DivertAsyncResultPool pool = new DivertAsyncResultPool(PoolSize, BufferLength);
+
+            ReceivePooled(diversion, address, pool, PacketsPerRun / 10);
+            Measure("ReceiveAsync, pooled results", () => ReceivePooled(diversion, address, pool, PacketsPerRun));
+
+            Console.WriteLine("Pool size {0}, grown {1} times.", pool.Size, pool.Allocations);
+
+            diversion.Close();
+        }
+
+        private static void Measure(string label, Func<long> loop)
+        {
+            long allocationsBefore = DivertAsyncResult.AllocationCount;
+            int collectionsBefore = GC.CollectionCount(0);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long received = loop();
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, received, sw);
+
+            Console.WriteLine("    DivertAsyncResult allocations: {0}, gen 0 collections: {1}",
+                DivertAsyncResult.AllocationCount - allocationsBefore,
+                GC.CollectionCount(0) - collectionsBefore);
+        }
+
+        private static long ReceiveUnpooled(Diversion diversion, Address address, long packets)
+        {
+            // The pre-pool pattern: a new result, and a new buffer to go with it, for every packet.
+            uint receiveLength = 0;
+            long received = 0;
+
+            while (received < packets)
+            {
+                byte[] buffer = new byte[BufferLength];
+
+                using (DivertAsyncResult result = new DivertAsyncResult())
+                {
+                    if (diversion.ReceiveAsync(buffer, address, ref receiveLength, result) || result.Get(1000))
+                    {
+                        ++received;
+                    }
+                }
+            }
+
+            return received;
+        }
+
+        private static long ReceivePooled(Diversion diversion, Address address, DivertAsyncResultPool pool, long packets)
+        {
+            uint receiveLength = 0;
+            long received = 0;
+
+            while (received < packets)
+            {
+                DivertAsyncResult result = pool.Rent();
+
+                if (diversion.ReceiveAsync(result.PacketBuffer, address, ref receiveLength, result) || result.Get(1000))
+                {
+                    ++received;
+                }
+
+                pool.Return(result);
+            }
+
+            return received;
+        }
+    }
+}
@@ -0,0 +1,136 @@
+﻿* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+using System.Linq;
+using System.Threading.Tasks;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares reading with DivertAsyncResult.Get, which blocks a thread per read in flight,
+    /// against awaiting reusable ReceiveOperations completed by the shared dispatcher, using the
+    /// simulated packet source as the backend. Reports the gen 0 collections seen during each run,
+    /// which should be zero for the awaitable loops.
+    /// </summary>
+    internal static class AwaitableReceiveBenchmark
+    {
+        private const long PacketsPerRun = 1000000;
+
+        private const uint BufferLength = 2048;
+
+        private static readonly int[] ConcurrentReaders = new int[] { 1, 16 };
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            using (DivertAsyncResult result = new DivertAsyncResult())
+            {
+                Address address = new Address();
+                byte[] buffer = new byte[BufferLength];
+
+                Measure("ReceiveAsync + DivertAsyncResult.Get", () => ReceiveBlocking(diversion, buffer, address, result, PacketsPerRun));
+            }
+
+            diversion.Close();
+
+            foreach (int readers in ConcurrentReaders)
+            {
+                // A fresh diversion, since the simulated source is now bound to the dispatcher.
+                diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+                ReceiveOperation[] operations = Enumerable.Range(0, readers).Select(i => new ReceiveOperation(BufferLength)).ToArray();
+
+                ReceiveAll(diversion, operations, PacketsPerRun / 10);
+                Measure(string.Format("await ReceiveAsync ({0} readers)", readers), () => ReceiveAll(diversion, operations, PacketsPerRun));
+
+                foreach (ReceiveOperation operation in operations)
+                {
+                    operation.Dispose();
+                }
+
+                diversion.Close();
+            }
+        }
+
+        private static void Measure(string label, Func<long> loop)
+        {
+            int collectionsBefore = GC.CollectionCount(0);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long received = loop();
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, received, sw);
+
+            Console.WriteLine("    gen 0 collections: {0}, process threads: {1}", GC.CollectionCount(0) - collectionsBefore, Process.GetCurrentProcess().Threads.Count);
+        }
+
+        private static long ReceiveBlocking(Diversion diversion, byte[] buffer, Address address, DivertAsyncResult result, long packets)
+        {
+            uint receiveLength = 0;
+            long received = 0;
+
+            while (received < packets)
+            {
+                if (diversion.ReceiveAsync(buffer, address, ref receiveLength, result) || result.Get(1000))
+                {
+                    ++received;
+                }
+            }
+
+            return received;
+        }
+
+        private static long ReceiveAll(Diversion diversion, ReceiveOperation[] operations, long packets)
+        {
+            long perReader = packets / operations.Length;
+
+            Task<long>[] readers = operations.Select(operation => ReceiveLoop(diversion, operation, perReader)).ToArray();
+
+            Task.WaitAll(readers);
+
+            return readers.Sum(reader => reader.Result);
+        }
+
+        private static async Task<long> ReceiveLoop(Diversion diversion, ReceiveOperation operation, long packets)
+        {
+            long received = 0;
+            long bytes = 0;
+
+            while (received < packets)
+            {
+                uint length = await diversion.ReceiveAsync(operation);
+
+                bytes += length + operation.Buffer[0];
+                ++received;
+            }
+
+            return received;
+        }
+    }
+}
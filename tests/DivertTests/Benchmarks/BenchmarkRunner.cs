@@ -0,0 +1,92 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Entry point for the throughput benchmarks. Run the test application with "bench" as the
+    /// first argument to run every benchmark, or "bench name" to run just one of them. None of
+    /// the benchmarks need the driver, they run against the simulated packet source.
+    /// </summary>
+    internal static class BenchmarkRunner
+    {
+        private static readonly Dictionary<string, Action> Benchmarks = new Dictionary<string, Action>(StringComparer.OrdinalIgnoreCase)
+        {
+            { "ReceiveBatch", ReceiveBatchBenchmark.Run },
+            { "SendBatch", SendBatchBenchmark.Run },
+            { "AsyncResultPool", AsyncResultPoolBenchmark.Run },
+            { "ReceiveEngine", ReceiveEngineBenchmark.Run },
+            { "AwaitableReceive", AwaitableReceiveBenchmark.Run },
+            { "ProcessNameCache", ProcessNameCacheBenchmark.Run },
+            { "PacketView", PacketViewBenchmark.Run },
+            { "IncrementalChecksum", IncrementalChecksumBenchmark.Run },
+            { "ChecksumBatch", ChecksumBatchBenchmark.Run },
+            { "Filter", FilterBenchmark.Run },
+            { "Statistics", StatisticsBenchmark.Run },
+            { "FlowTable", FlowTableBenchmark.Run },
+            { "TCPReassembly", TCPReassemblyBenchmark.Run },
+            { "PacketBufferPool", PacketBufferPoolBenchmark.Run },
+            { "PacketRing", PacketRingBenchmark.Run },
+            { "ShardedDiversion", ShardedDiversionBenchmark.Run }
+        };
+
+        internal static void Run(string[] args)
+        {
+            if (args.Length > 1)
+            {
+                Action benchmark;
+                if (!Benchmarks.TryGetValue(args[1], out benchmark))
+                {
+                    Console.WriteLine("Unknown benchmark {0}. Available benchmarks are: {1}", args[1], string.Join(", ", Benchmarks.Keys));
+                    return;
+                }
+
+                benchmark();
+                return;
+            }
+
+            foreach (var benchmark in Benchmarks)
+            {
+                Console.WriteLine("== {0} ==", benchmark.Key);
+                benchmark.Value();
+                Console.WriteLine();
+            }
+        }
+
+        /// <summary>
+        /// Prints a single result line in a consistent format.
+        /// </summary>
+        internal static void Report(string label, long operations, Stopwatch elapsed, string unit = "packets")
+        {
+            double seconds = elapsed.Elapsed.TotalSeconds;
+            double rate = seconds > 0 ? operations / seconds : 0;
+
+            Console.WriteLine("{0,-40} {1,14:N0} {2}/sec ({3:N0} {2} in {4:N1} ms)", label, rate, unit, operations, elapsed.Elapsed.TotalMilliseconds);
+        }
+    }
+}
@@ -0,0 +1,116 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares recalculating the checksums of a full batch one CalculateChecksums call at a time
+    /// against a single CalculateChecksumsBatch call on 1, 4 and 16 threads.
+    /// </summary>
+    internal static class ChecksumBatchBenchmark
+    {
+        private const uint BatchSize = 4096;
+
+        private const uint MaxPacketLength = 1600;
+
+        private const long PacketsPerRun = 4000000;
+
+        private static readonly uint[] ThreadCounts = new uint[] { 1, 4, 16 };
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+            PacketBatch batch = new PacketBatch(BatchSize, MaxPacketLength);
+
+            // Fill the batch once, both loops below recalculate the same packets over and over.
+            diversion.ReceiveBatch(batch);
+
+            // Without the batch API each packet lives in its own array.
+            byte[][] packets = new byte[batch.Count][];
+
+            for (uint i = 0; i < batch.Count; ++i)
+            {
+                packets[i] = new byte[batch.Lengths[i]];
+                System.Buffer.BlockCopy(batch.Buffer, (int)batch.Offsets[i], packets[i], 0, (int)batch.Lengths[i]);
+            }
+
+            CalculatePerPacket(diversion, packets, PacketsPerRun / 10);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long calculated = CalculatePerPacket(diversion, packets, PacketsPerRun);
+            sw.Stop();
+
+            BenchmarkRunner.Report("CalculateChecksums loop", calculated, sw);
+
+            foreach (uint threads in ThreadCounts)
+            {
+                CalculateBatched(diversion, batch, threads, PacketsPerRun / 10);
+
+                sw.Restart();
+                calculated = CalculateBatched(diversion, batch, threads, PacketsPerRun);
+                sw.Stop();
+
+                BenchmarkRunner.Report(string.Format("CalculateChecksumsBatch ({0} threads)", threads), calculated, sw);
+            }
+
+            batch.Dispose();
+            diversion.Close();
+        }
+
+        private static long CalculatePerPacket(Diversion diversion, byte[][] packets, long count)
+        {
+            long calculated = 0;
+
+            while (calculated < count)
+            {
+                foreach (byte[] packet in packets)
+                {
+                    diversion.CalculateChecksums(packet, (uint)packet.Length, 0);
+                }
+
+                calculated += packets.Length;
+            }
+
+            return calculated;
+        }
+
+        private static long CalculateBatched(Diversion diversion, PacketBatch batch, uint threads, long count)
+        {
+            long calculated = 0;
+
+            while (calculated < count)
+            {
+                diversion.CalculateChecksumsBatch(batch, 0, threads);
+                calculated += batch.Count;
+            }
+
+            return calculated;
+        }
+    }
+}
@@ -0,0 +1,131 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares ways of classifying a batch of packets with the same filter: a
+    /// Diversion.EvaluateFilter call per packet, which looks the filter string up in the cache
+    /// every time, a CompiledFilter.Evaluate call per packet, and one CompiledFilter.Evaluate call
+    /// for the whole batch, on the specialized and then the vectorized backend.
+    /// </summary>
+    internal static class FilterBenchmark
+    {
+        private const string Filter = "outbound and (tcp.DstPort == 80 or udp.DstPort == 53 or icmp)";
+
+        private const uint BatchSize = 256;
+
+        private const uint MaxPacketLength = 1600;
+
+        private const long PacketsPerRun = 4000000;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+            PacketBatch batch = new PacketBatch(BatchSize, MaxPacketLength);
+
+            // Fill the batch once, every loop below classifies the same packets over and over.
+            diversion.ReceiveBatch(batch);
+
+            byte[][] packets = new byte[batch.Count][];
+
+            for (uint i = 0; i < batch.Count; ++i)
+            {
+                packets[i] = new byte[batch.Lengths[i]];
+                System.Buffer.BlockCopy(batch.Buffer, (int)batch.Offsets[i], packets[i], 0, (int)batch.Lengths[i]);
+            }
+
+            CompiledFilter filter = CompiledFilter.Compile(Filter, DivertLayer.Network);
+            bool[] results = new bool[batch.Count];
+
+            Console.WriteLine("    {0}: {1} instructions", Filter, filter.InstructionCount);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long evaluated = 0;
+
+            while (evaluated < PacketsPerRun)
+            {
+                for (uint i = 0; i < batch.Count; ++i)
+                {
+                    results[i] = Diversion.EvaluateFilter(Filter, DivertLayer.Network, packets[i], batch.Lengths[i], batch.Addresses[i]);
+                }
+
+                evaluated += batch.Count;
+            }
+
+            sw.Stop();
+            BenchmarkRunner.Report("EvaluateFilter(string) per packet", evaluated, sw);
+
+            sw.Restart();
+            evaluated = 0;
+
+            while (evaluated < PacketsPerRun)
+            {
+                for (uint i = 0; i < batch.Count; ++i)
+                {
+                    results[i] = filter.Evaluate(packets[i], batch.Lengths[i], batch.Addresses[i]);
+                }
+
+                evaluated += batch.Count;
+            }
+
+            sw.Stop();
+            BenchmarkRunner.Report("CompiledFilter per packet", evaluated, sw);
+
+            sw.Restart();
+            evaluated = 0;
+
+            while (evaluated < PacketsPerRun)
+            {
+                filter.Evaluate(batch, results);
+                evaluated += batch.Count;
+            }
+
+            sw.Stop();
+            BenchmarkRunner.Report("CompiledFilter per batch", evaluated, sw);
+
+            filter.Vectorized = true;
+            sw.Restart();
+            evaluated = 0;
+
+            while (evaluated < PacketsPerRun)
+            {
+                filter.Evaluate(batch, results);
+                evaluated += batch.Count;
+            }
+
+            sw.Stop();
+            BenchmarkRunner.Report("CompiledFilter per batch, vectorized", evaluated, sw);
+
+            filter.Dispose();
+            batch.Dispose();
+            diversion.Close();
+        }
+    }
+}
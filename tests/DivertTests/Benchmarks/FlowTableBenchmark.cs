@@ -0,0 +1,122 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Receives packets from the simulated packet source, parses them and tracks their flows in
+    /// a FlowTable, counting packets per flow in a user slot. Runs once with the handful of flows
+    /// in TestData, and once with the source port of every TCP and UDP packet rotated, so that
+    /// tens of thousands of flows are live at once.
+    /// </summary>
+    internal static class FlowTableBenchmark
+    {
+        private const int PacketsPerRun = 2000000;
+
+        private const uint MaxPacketLength = 2048;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            Measure(diversion, "Track (TestData flows)", false);
+            Measure(diversion, "Track (rotating source ports)", true);
+
+            diversion.Close();
+        }
+
+        private static void Measure(Diversion diversion, string label, bool rotatePorts)
+        {
+            FlowTable table = new FlowTable(1 << 20, 1, 60000);
+
+            byte[] buffer = new byte[MaxPacketLength];
+            Address address = new Address();
+            IPHeader ipHeader = new IPHeader();
+            IPv6Header ipv6Header = new IPv6Header();
+            ICMPHeader icmpHeader = new ICMPHeader();
+            ICMPv6Header icmpv6Header = new ICMPv6Header();
+            TCPHeader tcpHeader = new TCPHeader();
+            UDPHeader udpHeader = new UDPHeader();
+            uint receiveLength = 0;
+            long tracked = 0;
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int i = 0; i < PacketsPerRun; ++i)
+            {
+                if (!diversion.Receive(buffer, address, ref receiveLength))
+                {
+                    break;
+                }
+
+                diversion.ParsePacket(buffer, receiveLength, ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader);
+
+                TrackedFlow flow;
+
+                if (tcpHeader.Valid)
+                {
+                    if (rotatePorts)
+                    {
+                        tcpHeader.SourcePort = (ushort)i;
+                    }
+
+                    flow = ipHeader.Valid ? table.Track(address, ipHeader, tcpHeader) : table.Track(address, ipv6Header, tcpHeader);
+                }
+                else if (udpHeader.Valid)
+                {
+                    if (rotatePorts)
+                    {
+                        udpHeader.SourcePort = (ushort)i;
+                    }
+
+                    flow = ipHeader.Valid ? table.Track(address, ipHeader, udpHeader) : table.Track(address, ipv6Header, udpHeader);
+                }
+                else
+                {
+                    continue;
+                }
+
+                if (flow.IsValid)
+                {
+                    table.SetSlot(flow, 0, table.GetSlot(flow, 0) + 1);
+                    ++tracked;
+                }
+            }
+
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, tracked, sw);
+
+            Console.WriteLine("    {0:N0} flows live, {1:N0} created, {2:N0} hits, {3:N0} reset", table.Count, table.Created, table.Hits, table.Reset);
+
+            table.Dispose();
+        }
+    }
+}
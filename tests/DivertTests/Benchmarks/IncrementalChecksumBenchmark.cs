@@ -0,0 +1,210 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+using System.Linq;
+using System.Net;
+using System.Runtime.InteropServices;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Rewrites addresses, ports and TTLs of the TestData packets through the header setters with
+    /// Diversion.IncrementalChecksums on, and checks that every packet comes out identical to a
+    /// copy that had its checksums recalculated from scratch. Then compares the cost of a NAT
+    /// style rewrite with incremental updates against the same rewrite followed by a full
+    /// CalculateChecksums.
+    /// </summary>
+    internal static class IncrementalChecksumBenchmark
+    {
+        private const int Rewrites = 100000;
+
+        private const int TimedRewrites = 2000000;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+            Random random = new Random(1624);
+
+            byte[][] packets = TestData.AllPackets.Select(p => (byte[])p.Clone()).ToArray();
+            GCHandle[] pins = packets.Select(p => GCHandle.Alloc(p, GCHandleType.Pinned)).ToArray();
+
+            try
+            {
+                foreach (byte[] packet in packets)
+                {
+                    diversion.CalculateChecksums(packet, (uint)packet.Length, 0);
+                }
+
+                int mismatches = 0;
+
+                diversion.IncrementalChecksums = true;
+
+                for (int i = 0; i < Rewrites; ++i)
+                {
+                    byte[] packet = packets[i % packets.Length];
+
+                    Rewrite(diversion, packet, random);
+
+                    byte[] recalculated = (byte[])packet.Clone();
+                    diversion.CalculateChecksums(recalculated, (uint)recalculated.Length, 0);
+
+                    if (!recalculated.SequenceEqual(packet))
+                    {
+                        ++mismatches;
+                    }
+                }
+
+                Console.WriteLine("    Rewrites that differ from full recalculation: {0} of {1}", mismatches, Rewrites);
+
+                Measure("Rewrite, incremental checksums", diversion, packets, true);
+                Measure("Rewrite, full CalculateChecksums", diversion, packets, false);
+            }
+            finally
+            {
+                foreach (GCHandle pin in pins)
+                {
+                    pin.Free();
+                }
+
+                diversion.Close();
+            }
+        }
+
+        private static void Rewrite(Diversion diversion, byte[] packet, Random random)
+        {
+            IPHeader ipHeader = new IPHeader();
+            IPv6Header ipv6Header = new IPv6Header();
+            TCPHeader tcpHeader = new TCPHeader();
+            UDPHeader udpHeader = new UDPHeader();
+            ICMPHeader icmpHeader = new ICMPHeader();
+            ICMPv6Header icmpv6Header = new ICMPv6Header();
+
+            diversion.ParsePacket(packet, (uint)packet.Length, ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader);
+
+            switch (random.Next(4))
+            {
+                case 0:
+                    if (ipHeader.Valid)
+                    {
+                        ipHeader.SourceAddress = new IPAddress(BitConverter.GetBytes(random.Next()));
+                    }
+                    else if (ipv6Header.Valid)
+                    {
+                        byte[] address = new byte[16];
+                        random.NextBytes(address);
+                        ipv6Header.DestinationAddress = new IPAddress(address);
+                    }
+                    break;
+
+                case 1:
+                    if (ipHeader.Valid)
+                    {
+                        ipHeader.TTL = (byte)random.Next(256);
+                    }
+                    break;
+
+                case 2:
+                    if (tcpHeader.Valid)
+                    {
+                        tcpHeader.SourcePort = (ushort)random.Next(65536);
+                        tcpHeader.SequenceNumber = (uint)random.Next();
+                    }
+                    else if (udpHeader.Valid)
+                    {
+                        udpHeader.DestinationPort = (ushort)random.Next(65536);
+                    }
+                    else if (icmpHeader.Valid)
+                    {
+                        icmpHeader.Body = (uint)random.Next();
+                    }
+                    else if (icmpv6Header.Valid)
+                    {
+                        icmpv6Header.Body = (uint)random.Next();
+                    }
+                    break;
+
+                default:
+                    if (tcpHeader.Valid)
+                    {
+                        tcpHeader.Psh = (ushort)random.Next(2);
+                    }
+                    else if (icmpHeader.Valid)
+                    {
+                        icmpHeader.Code = (byte)random.Next(256);
+                    }
+                    break;
+            }
+        }
+
+        private static void Measure(string label, Diversion diversion, byte[][] packets, bool incremental)
+        {
+            IPAddress[] addresses = Enumerable.Range(1, 16).Select(i => new IPAddress(new byte[] { 10, 0, 0, (byte)i })).ToArray();
+
+            diversion.IncrementalChecksums = incremental;
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int i = 0; i < TimedRewrites; ++i)
+            {
+                byte[] packet = packets[i % packets.Length];
+
+                // Fresh headers every time, since ParsePacket leaves headers that aren't present in
+                // the packet as they were.
+                IPHeader ipHeader = new IPHeader();
+                TCPHeader tcpHeader = new TCPHeader();
+                UDPHeader udpHeader = new UDPHeader();
+
+                diversion.ParsePacket(packet, (uint)packet.Length, ipHeader, null, null, null, tcpHeader, udpHeader);
+
+                if (ipHeader.Valid)
+                {
+                    ipHeader.SourceAddress = addresses[i % addresses.Length];
+                }
+
+                if (tcpHeader.Valid)
+                {
+                    tcpHeader.SourcePort = (ushort)i;
+                }
+                else if (udpHeader.Valid)
+                {
+                    udpHeader.SourcePort = (ushort)i;
+                }
+
+                if (!incremental)
+                {
+                    diversion.CalculateChecksums(packet, (uint)packet.Length, 0);
+                }
+            }
+
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, TimedRewrites, sw);
+        }
+    }
+}
@@ -0,0 +1,218 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Runs a receive, parse, checksum and reinject loop that keeps a number of packets in
+    /// flight, as an inspecting proxy would, three ways: a new array per packet, a ring of
+    /// reused arrays that are pinned on every call, and leases from a PacketBufferPool. Reports
+    /// the rate and the gen 0 collections each way caused.
+    /// </summary>
+    internal static class PacketBufferPoolBenchmark
+    {
+        private const long PacketsPerRun = 2000000;
+
+        private const int InFlight = 64;
+
+        private const uint BufferLength = 2048;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+            PacketBufferPool pool = new PacketBufferPool(InFlight + 1, 4);
+
+            try
+            {
+                // Warm up every path so JIT and first-touch costs don't land in the measurements.
+                NewArrays(diversion, PacketsPerRun / 10);
+                ReusedArrays(diversion, PacketsPerRun / 10);
+                Leases(diversion, pool, PacketsPerRun / 10);
+
+                Measure("New array per packet", () => NewArrays(diversion, PacketsPerRun));
+                Measure("Reused arrays, pinned per call", () => ReusedArrays(diversion, PacketsPerRun));
+                Measure("PacketBufferPool leases", () => Leases(diversion, pool, PacketsPerRun));
+
+                Console.WriteLine("    Leased: {0:N0}, promoted: {1:N0}, exhausted: {2:N0}, small buffers available: {3}", pool.Leased, pool.Promoted, pool.Exhausted, pool.SmallAvailable);
+            }
+            finally
+            {
+                pool.Dispose();
+                diversion.Close();
+            }
+        }
+
+        private static void Measure(string label, Func<long> run)
+        {
+            int collectionsBefore = GC.CollectionCount(0);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long packets = run();
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, packets, sw);
+            Console.WriteLine("    Gen 0 collections: {0}", GC.CollectionCount(0) - collectionsBefore);
+        }
+
+        private sealed class Headers
+        {
+            internal readonly IPHeader IPv4 = new IPHeader();
+            internal readonly IPv6Header IPv6 = new IPv6Header();
+            internal readonly ICMPHeader ICMP = new ICMPHeader();
+            internal readonly ICMPv6Header ICMPv6 = new ICMPv6Header();
+            internal readonly TCPHeader TCP = new TCPHeader();
+            internal readonly UDPHeader UDP = new UDPHeader();
+        }
+
+        private static long NewArrays(Diversion diversion, long packets)
+        {
+            Queue<byte[]> buffers = new Queue<byte[]>(InFlight);
+            Queue<uint> lengths = new Queue<uint>(InFlight);
+            Queue<Address> addresses = new Queue<Address>(InFlight);
+            Headers headers = new Headers();
+            uint length = 0;
+            uint sent = 0;
+            long handled = 0;
+
+            for (long i = 0; i < packets; ++i)
+            {
+                byte[] buffer = new byte[BufferLength];
+                Address address = new Address();
+
+                if (!diversion.Receive(buffer, address, ref length))
+                {
+                    break;
+                }
+
+                buffers.Enqueue(buffer);
+                lengths.Enqueue(length);
+                addresses.Enqueue(address);
+
+                if (buffers.Count == InFlight)
+                {
+                    byte[] packet = buffers.Dequeue();
+                    uint packetLength = lengths.Dequeue();
+
+                    diversion.ParsePacket(packet, packetLength, headers.IPv4, headers.IPv6, headers.ICMP, headers.ICMPv6, headers.TCP, headers.UDP);
+                    diversion.CalculateChecksums(packet, packetLength, 0);
+                    diversion.Send(packet, packetLength, addresses.Dequeue(), ref sent);
+                    ++handled;
+                }
+            }
+
+            return handled;
+        }
+
+        private static long ReusedArrays(Diversion diversion, long packets)
+        {
+            byte[][] buffers = new byte[InFlight][];
+            uint[] lengths = new uint[InFlight];
+            Address[] addresses = new Address[InFlight];
+            Headers headers = new Headers();
+            uint sent = 0;
+            long handled = 0;
+
+            for (int i = 0; i < InFlight; ++i)
+            {
+                buffers[i] = new byte[BufferLength];
+                addresses[i] = new Address();
+            }
+
+            for (long i = 0; i < packets; ++i)
+            {
+                int slot = (int)(i % InFlight);
+
+                // The slot about to be received into holds the oldest packet.
+                if (i >= InFlight)
+                {
+                    diversion.ParsePacket(buffers[slot], lengths[slot], headers.IPv4, headers.IPv6, headers.ICMP, headers.ICMPv6, headers.TCP, headers.UDP);
+                    diversion.CalculateChecksums(buffers[slot], lengths[slot], 0);
+                    diversion.Send(buffers[slot], lengths[slot], addresses[slot], ref sent);
+                    ++handled;
+                }
+
+                if (!diversion.Receive(buffers[slot], addresses[slot], ref lengths[slot]))
+                {
+                    break;
+                }
+            }
+
+            return handled;
+        }
+
+        private static long Leases(Diversion diversion, PacketBufferPool pool, long packets)
+        {
+            Queue<PacketLease> leases = new Queue<PacketLease>(InFlight);
+            Address[] addresses = new Address[InFlight];
+            Headers headers = new Headers();
+            uint sent = 0;
+            long handled = 0;
+
+            for (int i = 0; i < InFlight; ++i)
+            {
+                addresses[i] = new Address();
+            }
+
+            for (long i = 0; i < packets; ++i)
+            {
+                PacketLease lease = pool.Lease(BufferLength);
+                Address address = addresses[i % InFlight];
+
+                if (!lease.IsValid || !diversion.Receive(lease, address))
+                {
+                    break;
+                }
+
+                leases.Enqueue(lease);
+
+                if (leases.Count == InFlight)
+                {
+                    // The oldest packet's address slot is the one the next packet is read into,
+                    // so it's sent before that happens.
+                    PacketLease packet = leases.Dequeue();
+
+                    diversion.ParsePacket(packet, headers.IPv4, headers.IPv6, headers.ICMP, headers.ICMPv6, headers.TCP, headers.UDP);
+                    diversion.CalculateChecksums(packet, 0);
+                    diversion.Send(packet, addresses[(i + 1) % InFlight], ref sent);
+                    packet.Release();
+                    ++handled;
+                }
+            }
+
+            while (leases.Count != 0)
+            {
+                leases.Dequeue().Release();
+            }
+
+            return handled;
+        }
+    }
+}
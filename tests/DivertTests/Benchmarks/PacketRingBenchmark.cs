@@ -0,0 +1,231 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Collections.Concurrent;
+using System.Diagnostics;
+using System.Threading;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// One thread receives packets into PacketBufferPool leases and hands them to 1 to 16
+    /// consumer threads that parse, checksum and reinject them. The hand-off goes through a
+    /// PacketRing, and through a BlockingCollection for comparison, the locked queue the ring
+    /// replaces. Reports the rate each way for every number of consumers.
+    /// </summary>
+    internal static class PacketRingBenchmark
+    {
+        private const long PacketsPerRun = 1000000;
+
+        private const uint Capacity = 1024;
+
+        private const int MaximumConsumers = 16;
+
+        private const uint BufferLength = 2048;
+
+        /// <summary>
+        /// What the locked queue carries: the lease, and the address fields a consumer needs to
+        /// send the packet on.
+        /// </summary>
+        private struct QueuedPacket
+        {
+            internal PacketLease Lease;
+            internal uint IfIdx;
+            internal uint SubIfIdx;
+            internal DivertDirection Direction;
+        }
+
+        private sealed class Headers
+        {
+            internal readonly IPHeader IPv4 = new IPHeader();
+            internal readonly IPv6Header IPv6 = new IPv6Header();
+            internal readonly ICMPHeader ICMP = new ICMPHeader();
+            internal readonly ICMPv6Header ICMPv6 = new ICMPv6Header();
+            internal readonly TCPHeader TCP = new TCPHeader();
+            internal readonly UDPHeader UDP = new UDPHeader();
+        }
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            // Enough buffers for a full ring, one in each consumer's hands and one being received.
+            PacketBufferPool pool = new PacketBufferPool(Capacity + MaximumConsumers + 1, 0);
+
+            try
+            {
+                // Warm up both paths so JIT and first-touch costs don't land in the measurements.
+                ThroughRing(diversion, pool, 2, PacketsPerRun / 10);
+                ThroughQueue(diversion, pool, 2, PacketsPerRun / 10);
+
+                for (int consumers = 1; consumers <= MaximumConsumers; consumers *= 2)
+                {
+                    int threads = consumers;
+
+                    Measure(string.Format("PacketRing, {0} consumer(s)", consumers), () => ThroughRing(diversion, pool, threads, PacketsPerRun));
+                    Measure(string.Format("BlockingCollection, {0} consumer(s)", consumers), () => ThroughQueue(diversion, pool, threads, PacketsPerRun));
+                }
+            }
+            finally
+            {
+                pool.Dispose();
+                diversion.Close();
+            }
+        }
+
+        private static void Measure(string label, Func<long> run)
+        {
+            Stopwatch sw = Stopwatch.StartNew();
+            long packets = run();
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, packets, sw);
+        }
+
+        private static void Handle(Diversion diversion, Headers headers, PacketLease lease, Address address)
+        {
+            uint sent = 0;
+
+            diversion.ParsePacket(lease, headers.IPv4, headers.IPv6, headers.ICMP, headers.ICMPv6, headers.TCP, headers.UDP);
+            diversion.CalculateChecksums(lease, 0);
+            diversion.Send(lease, address, ref sent);
+            lease.Release();
+        }
+
+        private static long ThroughRing(Diversion diversion, PacketBufferPool pool, int consumers, long packets)
+        {
+            long handled = 0;
+
+            using (PacketRing ring = new PacketRing(pool, Capacity, consumers > 1, PacketRingOverflow.Block))
+            {
+                Thread[] threads = new Thread[consumers];
+
+                for (int i = 0; i < consumers; ++i)
+                {
+                    threads[i] = new Thread(() =>
+                    {
+                        Headers headers = new Headers();
+                        Address address = new Address();
+                        PacketLease lease;
+                        long count = 0;
+
+                        while (ring.Dequeue(out lease, address, Timeout.Infinite))
+                        {
+                            Handle(diversion, headers, lease, address);
+                            ++count;
+                        }
+
+                        Interlocked.Add(ref handled, count);
+                    });
+
+                    threads[i].Start();
+                }
+
+                Address received = new Address();
+
+                for (long i = 0; i < packets; ++i)
+                {
+                    PacketLease lease = pool.Lease(BufferLength);
+
+                    if (!lease.IsValid || !diversion.Receive(lease, received))
+                    {
+                        break;
+                    }
+
+                    ring.Enqueue(lease, received);
+                }
+
+                ring.Close();
+
+                foreach (Thread thread in threads)
+                {
+                    thread.Join();
+                }
+            }
+
+            return handled;
+        }
+
+        private static long ThroughQueue(Diversion diversion, PacketBufferPool pool, int consumers, long packets)
+        {
+            long handled = 0;
+
+            using (BlockingCollection<QueuedPacket> queue = new BlockingCollection<QueuedPacket>(new ConcurrentQueue<QueuedPacket>(), (int)Capacity))
+            {
+                Thread[] threads = new Thread[consumers];
+
+                for (int i = 0; i < consumers; ++i)
+                {
+                    threads[i] = new Thread(() =>
+                    {
+                        Headers headers = new Headers();
+                        Address address = new Address();
+                        long count = 0;
+
+                        foreach (QueuedPacket packet in queue.GetConsumingEnumerable())
+                        {
+                            address.IfIdx = packet.IfIdx;
+                            address.SubIfIdx = packet.SubIfIdx;
+                            address.Direction = packet.Direction;
+
+                            Handle(diversion, headers, packet.Lease, address);
+                            ++count;
+                        }
+
+                        Interlocked.Add(ref handled, count);
+                    });
+
+                    threads[i].Start();
+                }
+
+                Address received = new Address();
+
+                for (long i = 0; i < packets; ++i)
+                {
+                    PacketLease lease = pool.Lease(BufferLength);
+
+                    if (!lease.IsValid || !diversion.Receive(lease, received))
+                    {
+                        break;
+                    }
+
+                    queue.Add(new QueuedPacket { Lease = lease, IfIdx = received.IfIdx, SubIfIdx = received.SubIfIdx, Direction = received.Direction });
+                }
+
+                queue.CompleteAdding();
+
+                foreach (Thread thread in threads)
+                {
+                    thread.Join();
+                }
+            }
+
+            return handled;
+        }
+    }
+}
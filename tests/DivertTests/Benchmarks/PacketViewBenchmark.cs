@@ -0,0 +1,191 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares Diversion.ParsePacket, which needs a fresh set of header objects per packet,
+    /// against the allocation free PacketView.Parse over the TestData packets. Both paths read
+    /// the same handful of fields so neither gets to skip work. Before measuring, checks that
+    /// both parsers agree on every packet.
+    /// </summary>
+    internal static class PacketViewBenchmark
+    {
+        private const long PacketsPerRun = 4000000;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            int mismatches = 0;
+
+            foreach (byte[] packet in TestData.AllPackets)
+            {
+                if (ParseWithHeaders(diversion, packet) != ParseWithView(packet))
+                {
+                    ++mismatches;
+                }
+            }
+
+            Console.WriteLine("    Packets where the parsers disagree: {0}", mismatches);
+
+            // Warm up both paths so JIT and first-touch costs don't land in the measurements.
+            Measure("ParsePacket (header objects)", PacketsPerRun / 10, packet => ParseWithHeaders(diversion, packet), false);
+            Measure("PacketView.Parse", PacketsPerRun / 10, ParseWithView, false);
+
+            Measure("ParsePacket (header objects)", PacketsPerRun, packet => ParseWithHeaders(diversion, packet), true);
+            Measure("PacketView.Parse", PacketsPerRun, ParseWithView, true);
+
+            diversion.Close();
+        }
+
+        private static void Measure(string label, long packets, Func<byte[], long> parse, bool report)
+        {
+            byte[][] allPackets = TestData.AllPackets;
+            long checksum = 0;
+
+            int collectionsBefore = GC.CollectionCount(0);
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (long i = 0; i < packets; ++i)
+            {
+                checksum += parse(allPackets[i % allPackets.Length]);
+            }
+
+            sw.Stop();
+
+            if (report)
+            {
+                BenchmarkRunner.Report(label, packets, sw);
+
+                Console.WriteLine("    Gen 0 collections: {0} (checksum {1})", GC.CollectionCount(0) - collectionsBefore, checksum);
+            }
+        }
+
+        private static long ParseWithHeaders(Diversion diversion, byte[] packet)
+        {
+            IPHeader ipHeader = new IPHeader();
+            IPv6Header ipv6Header = new IPv6Header();
+            ICMPHeader icmpHeader = new ICMPHeader();
+            ICMPv6Header icmpv6Header = new ICMPv6Header();
+            TCPHeader tcpHeader = new TCPHeader();
+            UDPHeader udpHeader = new UDPHeader();
+
+            diversion.ParsePacket(packet, (uint)packet.Length, ipHeader, ipv6Header, icmpHeader, icmpv6Header, tcpHeader, udpHeader);
+
+            long result = 0;
+
+            if (ipHeader.Valid)
+            {
+                result += ipHeader.Length + ipHeader.Protocol + ipHeader.TTL;
+            }
+
+            if (ipv6Header.Valid)
+            {
+                result += ipv6Header.Length + ipv6Header.NextHeader + ipv6Header.HopLimit;
+            }
+
+            if (icmpHeader.Valid)
+            {
+                result += (icmpHeader.Type << 8) + icmpHeader.Code;
+            }
+
+            if (icmpv6Header.Valid)
+            {
+                result += (icmpv6Header.Type << 8) + icmpv6Header.Code;
+            }
+
+            if (tcpHeader.Valid)
+            {
+                result += ((long)tcpHeader.SourcePort << 16) + tcpHeader.DestinationPort + tcpHeader.SequenceNumber + tcpHeader.Syn;
+            }
+
+            if (udpHeader.Valid)
+            {
+                result += ((long)udpHeader.SourcePort << 16) + udpHeader.DestinationPort + udpHeader.Length;
+            }
+
+            return result;
+        }
+
+        private static long ParseWithView(byte[] packet)
+        {
+            PacketView view;
+            PacketView.Parse(packet, (uint)packet.Length, out view);
+
+            long result = 0;
+
+            IPHeaderView ip = view.IP;
+
+            if (ip.Valid)
+            {
+                result += ip.Length + ip.Protocol + ip.TTL;
+            }
+
+            IPv6HeaderView ipv6 = view.IPv6;
+
+            if (ipv6.Valid)
+            {
+                result += ipv6.Length + ipv6.NextHeader + ipv6.HopLimit;
+            }
+
+            ICMPHeaderView icmp = view.ICMP;
+
+            if (icmp.Valid)
+            {
+                result += (icmp.Type << 8) + icmp.Code;
+            }
+
+            ICMPv6HeaderView icmpv6 = view.ICMPv6;
+
+            if (icmpv6.Valid)
+            {
+                result += (icmpv6.Type << 8) + icmpv6.Code;
+            }
+
+            TCPHeaderView tcp = view.TCP;
+
+            if (tcp.Valid)
+            {
+                result += ((long)tcp.SourcePort << 16) + tcp.DestinationPort + tcp.SequenceNumber + tcp.Syn;
+            }
+
+            UDPHeaderView udp = view.UDP;
+
+            if (udp.Valid)
+            {
+                result += ((long)udp.SourcePort << 16) + udp.DestinationPort + udp.Length;
+            }
+
+            return result;
+        }
+    }
+}
@@ -0,0 +1,103 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using System;
+using System.Diagnostics;
+using System.Linq;
+using System.Threading;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Resolves the image names of every running process through the process name cache behind
+    /// Diversion.GetPacketProcess. The first pass opens every process, later passes should be
+    /// answered from the cache without any gen 0 collections. Finally checks that the entry of
+    /// a process that exits is dropped.
+    /// </summary>
+    internal static class ProcessNameCacheBenchmark
+    {
+        private const int Passes = 2000;
+
+        internal static void Run()
+        {
+            ProcessNameCache.Clear();
+            ProcessNameCache.ResetStatistics();
+
+            uint[] processIds = Process.GetProcesses().Select(p => (uint)p.Id).ToArray();
+
+            Measure("First pass, uncached", processIds, 1);
+            Measure("Repeat passes, cached", processIds, Passes);
+
+            Console.WriteLine("    Cached: {0}, hit rate: {1:P2}, evictions: {2}",
+                ProcessNameCache.Count, ProcessNameCache.HitRate, ProcessNameCache.Evictions);
+
+            // Names are interned, so every lookup of one process hands back the same string.
+            string first = ProcessNameCache.GetName((uint)Process.GetCurrentProcess().Id);
+            string second = ProcessNameCache.GetName((uint)Process.GetCurrentProcess().Id);
+            Console.WriteLine("    Same instance on repeat lookups: {0}", ReferenceEquals(first, second));
+
+            using (Process child = Process.Start(new ProcessStartInfo("cmd.exe", "/c exit") { CreateNoWindow = true, UseShellExecute = false }))
+            {
+                ulong invalidationsBefore = ProcessNameCache.Invalidations;
+
+                ProcessNameCache.GetName((uint)child.Id);
+                child.WaitForExit();
+
+                // The exit is observed on the thread pool.
+                Stopwatch waited = Stopwatch.StartNew();
+
+                while (ProcessNameCache.Invalidations == invalidationsBefore && waited.ElapsedMilliseconds < 5000)
+                {
+                    Thread.Sleep(10);
+                }
+
+                Console.WriteLine("    Exited process dropped: {0}", ProcessNameCache.Invalidations > invalidationsBefore);
+            }
+        }
+
+        private static void Measure(string label, uint[] processIds, int passes)
+        {
+            int collectionsBefore = GC.CollectionCount(0);
+            long lookups = 0;
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int pass = 0; pass < passes; ++pass)
+            {
+                foreach (uint processId in processIds)
+                {
+                    ProcessNameCache.GetName(processId);
+                    ++lookups;
+                }
+            }
+
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, lookups, sw);
+
+            Console.WriteLine("    Gen 0 collections: {0}", GC.CollectionCount(0) - collectionsBefore);
+        }
+    }
+}
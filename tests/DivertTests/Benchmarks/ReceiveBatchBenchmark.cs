@@ -0,0 +1,113 @@
+﻿* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares per-packet Diversion.Receive against Diversion.ReceiveBatch at various batch
+    /// sizes, using the in-process simulated packet source as the backend.
+    /// </summary>
+    internal static class ReceiveBatchBenchmark
+    {
+        private const long PacketsPerRun = 4000000;
+
+        private const uint MaxPacketLength = 2048;
+
+        private static readonly uint[] BatchSizes = new uint[] { 1, 8, 64, 256 };
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            // Warm up both paths so JIT and first-touch costs don't land in the measurements.
+            ReceivePerPacket(diversion, PacketsPerRun / 10);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long received = ReceivePerPacket(diversion, PacketsPerRun);
+            sw.Stop();
+
+            BenchmarkRunner.Report("Receive (per packet)", received, sw);
+
+            foreach (uint batchSize in BatchSizes)
+            {
+                PacketBatch batch = new PacketBatch(batchSize, MaxPacketLength);
+
+                ReceiveBatched(diversion, batch, PacketsPerRun / 10);
+
+                sw.Restart();
+                received = ReceiveBatched(diversion, batch, PacketsPerRun);
+                sw.Stop();
+
+                BenchmarkRunner.Report(string.Format("ReceiveBatch (batch size {0})", batchSize), received, sw);
+
+                batch.Dispose();
+            }
+
+            diversion.Close();
+        }
+
+        private static long ReceivePerPacket(Diversion diversion, long packets)
+        {
+            byte[] buffer = new byte[MaxPacketLength];
+            Address address = new Address();
+            uint receiveLength = 0;
+            long received = 0;
+
+            while (received < packets)
+            {
+                if (!diversion.Receive(buffer, address, ref receiveLength))
+                {
+                    break;
+                }
+
+                ++received;
+            }
+
+            return received;
+        }
+
+        private static long ReceiveBatched(Diversion diversion, PacketBatch batch, long packets)
+        {
+            long received = 0;
+
+            while (received < packets)
+            {
+                uint count = diversion.ReceiveBatch(batch);
+
+                if (count == 0)
+                {
+                    break;
+                }
+
+                received += count;
+            }
+
+            return received;
+        }
+    }
+}
@@ -0,0 +1,85 @@
+﻿* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+using System.Threading;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Runs the completion port receive engine against the simulated packet source with a
+    /// growing number of workers, reporting packets/sec and read latency percentiles for each.
+    /// </summary>
+    internal static class ReceiveEngineBenchmark
+    {
+        private const uint ReadsInFlight = 64;
+
+        private const uint MaxPacketLength = 2048;
+
+        private const int WarmupMilliseconds = 250;
+
+        private const int RunMilliseconds = 2000;
+
+        private static readonly uint[] WorkerCounts = new uint[] { 1, 2, 4, 8 };
+
+        private static readonly double[] Percentiles = new double[] { 50, 90, 99, 99.9 };
+
+        internal static void Run()
+        {
+            Console.WriteLine("{0} reads in flight, {1} processors.", ReadsInFlight, Environment.ProcessorCount);
+
+            foreach (uint workers in WorkerCounts)
+            {
+                Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+                long bytes = 0;
+
+                using (ReceiveEngine engine = new ReceiveEngine(diversion, ReadsInFlight, workers, MaxPacketLength, (packet, length, address) =>
+                {
+                    Interlocked.Add(ref bytes, length + packet[0]);
+                }))
+                {
+                    engine.Start();
+                    Thread.Sleep(WarmupMilliseconds);
+                    engine.ResetStatistics();
+
+                    Stopwatch sw = Stopwatch.StartNew();
+                    Thread.Sleep(RunMilliseconds);
+                    engine.Stop();
+                    sw.Stop();
+
+                    BenchmarkRunner.Report(string.Format("ReceiveEngine ({0} workers)", workers), (long)engine.Completed, sw);
+
+                    double[] latencies = engine.GetLatencyPercentiles(Percentiles);
+
+                    Console.WriteLine("    latency p50 {0:N1} us, p90 {1:N1} us, p99 {2:N1} us, p99.9 {3:N1} us, {4} failed",
+                        latencies[0], latencies[1], latencies[2], latencies[3], engine.Failed);
+                }
+
+                diversion.Close();
+            }
+        }
+    }
+}
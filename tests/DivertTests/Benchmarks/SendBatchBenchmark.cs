@@ -0,0 +1,112 @@
+﻿* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Compares reinjecting packets with a per-packet Diversion.Send loop against reinjecting the
+    /// same packets with Diversion.SendBatch, using the simulated packet source as the backend.
+    /// </summary>
+    internal static class SendBatchBenchmark
+    {
+        private const long PacketsPerRun = 4000000;
+
+        private const uint MaxPacketLength = 2048;
+
+        private static readonly uint[] BatchSizes = new uint[] { 8, 64, 256 };
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            foreach (uint batchSize in BatchSizes)
+            {
+                PacketBatch batch = new PacketBatch(batchSize, MaxPacketLength);
+
+                // Fill the batch once, both loops below reinject the same packets over and over.
+                diversion.ReceiveBatch(batch);
+
+                SendPerPacket(diversion, batch, PacketsPerRun / 10);
+
+                Stopwatch sw = Stopwatch.StartNew();
+                long sent = SendPerPacket(diversion, batch, PacketsPerRun);
+                sw.Stop();
+
+                BenchmarkRunner.Report(string.Format("Send loop (batch size {0})", batchSize), sent, sw);
+
+                SendBatched(diversion, batch, PacketsPerRun / 10);
+
+                sw.Restart();
+                sent = SendBatched(diversion, batch, PacketsPerRun);
+                sw.Stop();
+
+                BenchmarkRunner.Report(string.Format("SendBatch (batch size {0})", batchSize), sent, sw);
+
+                batch.Dispose();
+            }
+
+            diversion.Close();
+        }
+
+        private static long SendPerPacket(Diversion diversion, PacketBatch batch, long packets)
+        {
+            // Mirrors what a caller has to do without SendBatch: copy each packet out into its own
+            // array and send it individually.
+            byte[] buffer = new byte[MaxPacketLength];
+            uint sendLength = 0;
+            long sent = 0;
+
+            while (sent < packets)
+            {
+                for (uint i = 0; i < batch.Count; ++i)
+                {
+                    System.Buffer.BlockCopy(batch.Buffer, (int)batch.Offsets[i], buffer, 0, (int)batch.Lengths[i]);
+
+                    if (diversion.Send(buffer, batch.Lengths[i], batch.Addresses[i], ref sendLength))
+                    {
+                        ++sent;
+                    }
+                }
+            }
+
+            return sent;
+        }
+
+        private static long SendBatched(Diversion diversion, PacketBatch batch, long packets)
+        {
+            long sent = 0;
+
+            while (sent < packets)
+            {
+                sent += diversion.SendBatch(batch);
+            }
+
+            return sent;
+        }
+    }
+}
@@ -0,0 +1,114 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System.Diagnostics;
+using System.Threading;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Receives, parses and checksums the test packets on 1 to 16 simulated shards of a
+    /// ShardedDiversion, each with its own worker, for a fixed time per shard count. Reports the
+    /// combined rate for every shard count. Shards whose port stripes hold none of the test
+    /// packets have nothing to do, so the rate levels off once every packet's flow has a shard
+    /// of its own, as it would with too few flows on a real handle.
+    /// </summary>
+    internal static class ShardedDiversionBenchmark
+    {
+        private const int MillisecondsPerRun = 2000;
+
+        private const uint MaximumShards = 16;
+
+        private sealed class Headers
+        {
+            internal readonly IPHeader IPv4 = new IPHeader();
+            internal readonly IPv6Header IPv6 = new IPv6Header();
+            internal readonly ICMPHeader ICMP = new ICMPHeader();
+            internal readonly ICMPv6Header ICMPv6 = new ICMPv6Header();
+            internal readonly TCPHeader TCP = new TCPHeader();
+            internal readonly UDPHeader UDP = new UDPHeader();
+        }
+
+        internal static void Run()
+        {
+            // Warm up so JIT and first-touch costs don't land in the measurements.
+            Measure(2, MillisecondsPerRun / 10);
+
+            for (uint shards = 1; shards <= MaximumShards; shards *= 2)
+            {
+                Stopwatch sw = Stopwatch.StartNew();
+                long packets = Measure(shards, MillisecondsPerRun);
+                sw.Stop();
+
+                BenchmarkRunner.Report(string.Format("ShardedDiversion, {0} shard(s)", shards), packets, sw);
+            }
+        }
+
+        private static long Measure(uint shardCount, int milliseconds)
+        {
+            ShardedDiversion sharded = ShardedDiversion.OpenSimulated(TestData.AllPackets, shardCount, ShardKey.LocalPort);
+
+            // Each shard's worker only touches its own entries.
+            Headers[] headers = new Headers[shardCount];
+            long[] handled = new long[shardCount];
+
+            for (uint i = 0; i < shardCount; ++i)
+            {
+                headers[i] = new Headers();
+            }
+
+            try
+            {
+                sharded.Start((shard, diversion, lease, address) =>
+                {
+                    Headers h = headers[shard];
+
+                    diversion.ParsePacket(lease, h.IPv4, h.IPv6, h.ICMP, h.ICMPv6, h.TCP, h.UDP);
+                    diversion.CalculateChecksums(lease, 0);
+                    ++handled[shard];
+                });
+
+                Thread.Sleep(milliseconds);
+            }
+            finally
+            {
+                sharded.Close();
+                sharded.Dispose();
+            }
+
+            long total = 0;
+
+            foreach (long count in handled)
+            {
+                total += count;
+            }
+
+            return total;
+        }
+    }
+}
@@ -0,0 +1,102 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Measures a receive and reinject loop on the simulated packet source, which every
+    /// Diversion records statistics for, and what taking a statistics snapshot costs.
+    /// </summary>
+    internal static class StatisticsBenchmark
+    {
+        private const long PacketsPerRun = 4000000;
+
+        private const int SnapshotsPerRun = 10000;
+
+        private const uint MaxPacketLength = 2048;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            ReceiveAndReinject(diversion, PacketsPerRun / 10);
+
+            Stopwatch sw = Stopwatch.StartNew();
+            long forwarded = ReceiveAndReinject(diversion, PacketsPerRun);
+            sw.Stop();
+
+            BenchmarkRunner.Report("Receive and reinject", forwarded, sw);
+
+            sw.Restart();
+
+            DiversionStatistics statistics = null;
+
+            for (int i = 0; i < SnapshotsPerRun; ++i)
+            {
+                statistics = diversion.GetStatistics();
+            }
+
+            sw.Stop();
+
+            BenchmarkRunner.Report("GetStatistics", SnapshotsPerRun, sw, "snapshots");
+
+            Console.WriteLine("Received {0:N0} packets ({1:N0} bytes), sent {2:N0} packets, {3:N0} receive errors, {4:N0} send errors.", statistics.ReceivedPackets, statistics.ReceivedBytes, statistics.SentPackets, statistics.ReceiveErrors, statistics.SendErrors);
+            Console.WriteLine("Reinject latency: mean {0:N2} us, p50 {1:N2} us, p99 {2:N2} us, p99.9 {3:N2} us, max {4:N2} us.", statistics.ReinjectLatency.Mean, statistics.ReinjectLatency.GetPercentile(50), statistics.ReinjectLatency.GetPercentile(99), statistics.ReinjectLatency.GetPercentile(99.9), statistics.ReinjectLatency.Maximum);
+
+            diversion.Close();
+        }
+
+        private static long ReceiveAndReinject(Diversion diversion, long packets)
+        {
+            byte[] buffer = new byte[MaxPacketLength];
+            Address address = new Address();
+            uint receiveLength = 0;
+            uint sendLength = 0;
+            long forwarded = 0;
+
+            while (forwarded < packets)
+            {
+                if (!diversion.Receive(buffer, address, ref receiveLength))
+                {
+                    break;
+                }
+
+                if (!diversion.Send(buffer, receiveLength, address, ref sendLength))
+                {
+                    break;
+                }
+
+                ++forwarded;
+            }
+
+            return forwarded;
+        }
+    }
+}
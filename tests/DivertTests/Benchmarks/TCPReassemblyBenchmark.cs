@@ -0,0 +1,153 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using DivertTests.Tests;
+using System;
+using System.Diagnostics;
+
+namespace DivertTests.Benchmarks
+{
+    /// <summary>
+    /// Replays the TestData HTTP request as a thousand interleaved connections, rewriting the
+    /// source port and sequence number of one packet buffer, and reads every stream back through
+    /// a TCPReassembler. Runs once in order, where a TCPDataHandler is handed the packet buffer
+    /// itself, and once with every pair of segments swapped, where the first of each pair is
+    /// buffered.
+    /// Checks that every byte read matches the payload.
+    /// </summary>
+    internal static class TCPReassemblyBenchmark
+    {
+        private const int Connections = 1000;
+
+        private const int SegmentsPerConnection = 200;
+
+        internal static void Run()
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            Measure(diversion, "TCP reassembly (in order)", false);
+            Measure(diversion, "TCP reassembly (pairs swapped)", true);
+
+            diversion.Close();
+        }
+
+        private static void Measure(Diversion diversion, string label, bool swapPairs)
+        {
+            byte[] packet = (byte[])TestData.HttpRequest.Clone();
+            Address address = new Address();
+            IPHeader ipHeader = new IPHeader();
+            TCPHeader tcpHeader = new TCPHeader();
+            byte[] payload;
+
+            address.Direction = DivertDirection.Outbound;
+            diversion.ParsePacket(packet, (uint)packet.Length, ipHeader, null, null, null, tcpHeader, null, out payload);
+
+            TCPReassembler reassembler = new TCPReassembler(Connections, 1 << 20, 256u << 20, 60000);
+            byte[] readBuffer = new byte[64 * 1024];
+            uint isn = tcpHeader.SequenceNumber;
+            long bytesRead = 0;
+            long mismatches = 0;
+
+            // Open every connection with a SYN, so that segments arriving ahead of the first one
+            // aren't taken as the start of the stream. Cutting the packet short drops the payload.
+            tcpHeader.Syn = 1;
+            tcpHeader.SequenceNumber = isn - 1;
+
+            for (int connection = 0; connection < Connections; ++connection)
+            {
+                tcpHeader.SourcePort = (ushort)(10000 + connection);
+                reassembler.Push(address, ipHeader, tcpHeader, packet, (uint)(packet.Length - payload.Length));
+            }
+
+            tcpHeader.Syn = 0;
+
+            // The packet buffer is rewritten for every segment, so data has to be used here or
+            // copied by the reassembler.
+            TCPDataHandler handler = (stream, data) =>
+            {
+                mismatches += Compare(data.Array, data.Offset, data.Count, payload, reassembler.GetPosition(stream));
+                bytesRead += data.Count;
+                return (uint)data.Count;
+            };
+
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int segment = 0; segment < SegmentsPerConnection; ++segment)
+            {
+                int sent = swapPairs ? segment ^ 1 : segment;
+
+                for (int connection = 0; connection < Connections; ++connection)
+                {
+                    tcpHeader.SourcePort = (ushort)(10000 + connection);
+                    tcpHeader.SequenceNumber = isn + (uint)(sent * payload.Length);
+
+                    TCPSegmentResult result = reassembler.Push(address, ipHeader, tcpHeader, packet, (uint)packet.Length, handler);
+                    TCPStream stream = result.Stream;
+
+                    int read;
+
+                    while ((read = reassembler.Read(stream, readBuffer, 0, readBuffer.Length)) > 0)
+                    {
+                        mismatches += Compare(readBuffer, 0, read, payload, reassembler.GetPosition(stream) - (ulong)read);
+                        bytesRead += read;
+                    }
+                }
+            }
+
+            sw.Stop();
+
+            BenchmarkRunner.Report(label, (long)Connections * SegmentsPerConnection, sw, "segments");
+
+            Console.WriteLine("    {0:N0} bytes read, {1:N0} borrowed, {2:N0} retained, {3:N0} out of order, {4:N0} KB reserved", bytesRead, reassembler.Borrowed, reassembler.Retained, reassembler.OutOfOrder, reassembler.MemoryReserved / 1024);
+
+            if (mismatches != 0 || bytesRead != (long)Connections * SegmentsPerConnection * payload.Length)
+            {
+                Console.WriteLine("    MISMATCH: {0:N0} bytes differ from the payload", mismatches);
+            }
+
+            reassembler.Dispose();
+        }
+
+        /// <summary>
+        /// Counts the bytes that differ from the stream of repeated payloads, given where in the
+        /// stream they were read from.
+        /// </summary>
+        private static long Compare(byte[] buffer, int offset, int count, byte[] payload, ulong position)
+        {
+            long mismatches = 0;
+
+            for (int i = 0; i < count; ++i)
+            {
+                if (buffer[offset + i] != payload[(int)((position + (ulong)i) % (ulong)payload.Length)])
+                {
+                    ++mismatches;
+                }
+            }
+
+            return mismatches;
+        }
+    }
+}
@@ -36,6 +36,19 @@ namespace DivertTests
 
         private static void Main(string[] args)
         {
+            if (args.Length > 0 && args[0].Equals("bench", System.StringComparison.OrdinalIgnoreCase))
+            {
+                Benchmarks.BenchmarkRunner.Run(args);
+                return;
+            }
+
+            int testsPassed = 0;
+            int testsFailed = 0;
+
+            // These need no driver, so they run even where the filter tests can't.
+            HeaderSetterTest.Run(ref testsPassed, ref testsFailed);
+            AsyncResultPoolTest.Run(ref testsPassed, ref testsFailed);
+
             string testsFilePath = System.AppDomain.CurrentDomain.BaseDirectory + @"TestData\Tests.json";
             if (!File.Exists(testsFilePath))
             {
@@ -99,9 +112,6 @@ namespace DivertTests
             // Wait for existing packets to flush:
             System.Threading.Thread.Sleep(100);
 
-            int testsPassed = 0;
-            int testsFailed = 0;
-
             // Run tests:
             for(int i = 0; i < tests.Count; ++i)
             {
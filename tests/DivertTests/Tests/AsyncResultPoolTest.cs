@@ -0,0 +1,103 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+using Divert.Net;
+using System;
+
+namespace DivertTests.Tests
+{
+    /// <summary>
+    /// Checks that DivertAsyncResultPool.Return only takes back results the pool handed out and
+    /// hasn't been given back yet. Needs no driver.
+    /// </summary>
+    internal static class AsyncResultPoolTest
+    {
+        internal static void Run(ref int testsPassed, ref int testsFailed)
+        {
+            DivertAsyncResultPool pool = new DivertAsyncResultPool(2, 1500);
+            DivertAsyncResultPool other = new DivertAsyncResultPool(1, 1500);
+
+            DivertAsyncResult rented = pool.Rent();
+            pool.Return(rented);
+
+            Report("Rented result returned", pool.Available == 2, ref testsPassed, ref testsFailed);
+            Report("Second return rejected", Throws<InvalidOperationException>(() => pool.Return(rented)) && pool.Available == 2, ref testsPassed, ref testsFailed);
+
+            using (DivertAsyncResult foreign = new DivertAsyncResult())
+            {
+                Report("Result from no pool rejected", Throws<ArgumentException>(() => pool.Return(foreign)), ref testsPassed, ref testsFailed);
+            }
+
+            DivertAsyncResult sameLength = other.Rent();
+
+            Report("Result from another pool with the same buffer length rejected", Throws<ArgumentException>(() => pool.Return(sameLength)) && pool.Available == 2, ref testsPassed, ref testsFailed);
+
+            other.Return(sameLength);
+
+            // A result created because the pool ran dry belongs to the pool too.
+            DivertAsyncResult first = pool.Rent();
+            DivertAsyncResult second = pool.Rent();
+            DivertAsyncResult extra = pool.Rent();
+
+            pool.Return(extra);
+            pool.Return(second);
+            pool.Return(first);
+
+            Report("Result allocated on demand returned", pool.Available == 3 && pool.Allocations == 1, ref testsPassed, ref testsFailed);
+        }
+
+        private static bool Throws<T>(Action action) where T : Exception
+        {
+            try
+            {
+                action();
+                return false;
+            }
+            catch (T)
+            {
+                return true;
+            }
+        }
+
+        private static void Report(string name, bool passed, ref int testsPassed, ref int testsFailed)
+        {
+            if (passed)
+            {
+                Console.BackgroundColor = ConsoleColor.Green;
+                Console.ForegroundColor = ConsoleColor.White;
+                Console.WriteLine("{0}: Passed.", name);
+                Console.ResetColor();
+                testsPassed++;
+            }
+            else
+            {
+                Console.BackgroundColor = ConsoleColor.Red;
+                Console.ForegroundColor = ConsoleColor.White;
+                Console.WriteLine("{0}: Failed!", name);
+                Console.ResetColor();
+                testsFailed++;
+            }
+        }
+    }
+}
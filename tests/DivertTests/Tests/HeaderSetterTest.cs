@@ -0,0 +1,253 @@
+﻿/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+using Divert.Net;
+using System;
+using System.Linq;
+using System.Net;
+using System.Runtime.InteropServices;
+
+namespace DivertTests.Tests
+{
+    /// <summary>
+    /// Checks the header setters with Diversion.IncrementalChecksums on, one field at a time. Each
+    /// setter changes its field on a copy of every test packet that has the header, and the packet
+    /// must come out identical to a copy that had its checksums recalculated from scratch. Needs
+    /// no driver.
+    /// 
+    /// Changing Protocol changes how CalculateChecksums reads the packet, so for it the checksums
+    /// are verified directly instead. Version, the lengths and the header lengths aren't covered,
+    /// since they change where the packet or its headers end.
+    /// </summary>
+    internal static class HeaderSetterTest
+    {
+        private sealed class Headers
+        {
+            internal readonly IPHeader IPv4 = new IPHeader();
+            internal readonly IPv6Header IPv6 = new IPv6Header();
+            internal readonly ICMPHeader ICMP = new ICMPHeader();
+            internal readonly ICMPv6Header ICMPv6 = new ICMPv6Header();
+            internal readonly TCPHeader TCP = new TCPHeader();
+            internal readonly UDPHeader UDP = new UDPHeader();
+        }
+
+        private sealed class Field
+        {
+            internal Field(string name, Func<Headers, bool> applies, Action<Headers> set, bool verifyDirectly = false)
+            {
+                Name = name;
+                Applies = applies;
+                Set = set;
+                VerifyDirectly = verifyDirectly;
+            }
+
+            internal readonly string Name;
+
+            internal readonly Func<Headers, bool> Applies;
+
+            internal readonly Action<Headers> Set;
+
+            internal readonly bool VerifyDirectly;
+        }
+
+        private static readonly Field[] Fields = new Field[]
+        {
+            new Field("IPHeader.TOS", h => h.IPv4.Valid, h => h.IPv4.TOS ^= 0xB8),
+            new Field("IPHeader.Id", h => h.IPv4.Valid, h => h.IPv4.Id ^= 0x5A5A),
+            new Field("IPHeader.FragOff", h => h.IPv4.Valid, h => h.IPv4.FragOff ^= 0x0123),
+            new Field("IPHeader.MF", h => h.IPv4.Valid, h => h.IPv4.MF ^= 1),
+            new Field("IPHeader.DF", h => h.IPv4.Valid, h => h.IPv4.DF ^= 1),
+            new Field("IPHeader.Reserved", h => h.IPv4.Valid, h => h.IPv4.Reserved ^= 1),
+            new Field("IPHeader.TTL", h => h.IPv4.Valid, h => h.IPv4.TTL ^= 0x3F),
+            new Field("IPHeader.Protocol", h => h.IPv4.Valid && (h.TCP.Valid || h.UDP.Valid), h => h.IPv4.Protocol = 0xFD, true),
+            new Field("IPHeader.SourceAddress", h => h.IPv4.Valid, h => h.IPv4.SourceAddress = IPAddress.Parse("192.0.2.55")),
+            new Field("IPHeader.DestinationAddress", h => h.IPv4.Valid, h => h.IPv4.DestinationAddress = IPAddress.Parse("198.51.100.201")),
+            new Field("IPv6Header.TrafficClass", h => h.IPv6.Valid, h => h.IPv6.TrafficClass ^= 0x2E),
+            new Field("IPv6Header.FlowLabel", h => h.IPv6.Valid, h => h.IPv6.FlowLabel ^= 0xBEEF),
+            new Field("IPv6Header.HopLimit", h => h.IPv6.Valid, h => h.IPv6.HopLimit ^= 0x3F),
+            new Field("IPv6Header.SourceAddress", h => h.IPv6.Valid, h => h.IPv6.SourceAddress = IPAddress.Parse("2001:db8::1:55")),
+            new Field("IPv6Header.DestinationAddress", h => h.IPv6.Valid, h => h.IPv6.DestinationAddress = IPAddress.Parse("2001:db8:ffff::c9")),
+            new Field("TCPHeader.SourcePort", h => h.TCP.Valid, h => h.TCP.SourcePort ^= 0x1234),
+            new Field("TCPHeader.DestinationPort", h => h.TCP.Valid, h => h.TCP.DestinationPort ^= 0x4321),
+            new Field("TCPHeader.SequenceNumber", h => h.TCP.Valid, h => h.TCP.SequenceNumber ^= 0xDEADBEEF),
+            new Field("TCPHeader.AcknowledgmentNumber", h => h.TCP.Valid, h => h.TCP.AcknowledgmentNumber ^= 0x01020304),
+            new Field("TCPHeader.Reserved1", h => h.TCP.Valid, h => h.TCP.Reserved1 ^= 0x5),
+            new Field("TCPHeader.Fin", h => h.TCP.Valid, h => h.TCP.Fin ^= 1),
+            new Field("TCPHeader.Syn", h => h.TCP.Valid, h => h.TCP.Syn ^= 1),
+            new Field("TCPHeader.Rst", h => h.TCP.Valid, h => h.TCP.Rst ^= 1),
+            new Field("TCPHeader.Psh", h => h.TCP.Valid, h => h.TCP.Psh ^= 1),
+            new Field("TCPHeader.Ack", h => h.TCP.Valid, h => h.TCP.Ack ^= 1),
+            new Field("TCPHeader.Urg", h => h.TCP.Valid, h => h.TCP.Urg ^= 1),
+            new Field("TCPHeader.Reserved2", h => h.TCP.Valid, h => h.TCP.Reserved2 ^= 1),
+            new Field("TCPHeader.WindowSize", h => h.TCP.Valid, h => h.TCP.WindowSize ^= 0x0F0F),
+            new Field("TCPHeader.UrgentPointer", h => h.TCP.Valid, h => h.TCP.UrgentPointer ^= 0x00FF),
+            new Field("UDPHeader.SourcePort", h => h.UDP.Valid, h => h.UDP.SourcePort ^= 0x1234),
+            new Field("UDPHeader.DestinationPort", h => h.UDP.Valid, h => h.UDP.DestinationPort ^= 0x4321),
+            new Field("ICMPHeader.Type", h => h.ICMP.Valid, h => h.ICMP.Type ^= 0x08),
+            new Field("ICMPHeader.Code", h => h.ICMP.Valid, h => h.ICMP.Code ^= 0x03),
+            new Field("ICMPHeader.Body", h => h.ICMP.Valid, h => h.ICMP.Body ^= 0xA5A5A5A5),
+            new Field("ICMPv6Header.Type", h => h.ICMPv6.Valid, h => h.ICMPv6.Type ^= 0x01),
+            new Field("ICMPv6Header.Code", h => h.ICMPv6.Valid, h => h.ICMPv6.Code ^= 0x03),
+            new Field("ICMPv6Header.Body", h => h.ICMPv6.Valid, h => h.ICMPv6.Body ^= 0xA5A5A5A5)
+        };
+
+        /// <summary>
+        /// Runs every field, printing a line for each as the driver tests do.
+        /// </summary>
+        internal static void Run(ref int testsPassed, ref int testsFailed)
+        {
+            Diversion diversion = Diversion.OpenSimulated(TestData.AllPackets);
+
+            try
+            {
+                diversion.IncrementalChecksums = true;
+
+                foreach (Field field in Fields)
+                {
+                    int packets = 0;
+                    int mismatches = 0;
+
+                    foreach (byte[] original in TestData.AllPackets)
+                    {
+                        bool? result = RunField(diversion, field, original);
+
+                        if (result.HasValue)
+                        {
+                            ++packets;
+                            mismatches += result.Value ? 0 : 1;
+                        }
+                    }
+
+                    // A field that no test packet has would pass without testing anything.
+                    if (packets > 0 && mismatches == 0)
+                    {
+                        Console.BackgroundColor = ConsoleColor.Green;
+                        Console.ForegroundColor = ConsoleColor.White;
+                        Console.WriteLine("{0} setter Passed.", field.Name);
+                        Console.ResetColor();
+                        testsPassed++;
+                    }
+                    else
+                    {
+                        Console.BackgroundColor = ConsoleColor.Red;
+                        Console.ForegroundColor = ConsoleColor.White;
+                        Console.WriteLine("{0} setter Failed! {1} of {2} packets differ.", field.Name, mismatches, packets);
+                        Console.ResetColor();
+                        testsFailed++;
+                    }
+                }
+            }
+            finally
+            {
+                diversion.Close();
+            }
+        }
+
+        /// <returns>
+        /// Whether the checksums came out right, or null if the packet doesn't have the field.
+        /// </returns>
+        private static bool? RunField(Diversion diversion, Field field, byte[] original)
+        {
+            byte[] packet = (byte[])original.Clone();
+            diversion.CalculateChecksums(packet, (uint)packet.Length, 0);
+
+            // The headers point into the packet for as long as the setters use them.
+            GCHandle pin = GCHandle.Alloc(packet, GCHandleType.Pinned);
+
+            try
+            {
+                Headers headers = new Headers();
+
+                diversion.ParsePacket(packet, (uint)packet.Length, headers.IPv4, headers.IPv6, headers.ICMP, headers.ICMPv6, headers.TCP, headers.UDP);
+
+                if (!field.Applies(headers))
+                {
+                    return null;
+                }
+
+                field.Set(headers);
+
+                if (field.VerifyDirectly)
+                {
+                    return IPv4ChecksumsVerify(packet, headers.TCP.Valid ? 16 : 6);
+                }
+            }
+            finally
+            {
+                pin.Free();
+            }
+
+            byte[] recalculated = (byte[])packet.Clone();
+            diversion.CalculateChecksums(recalculated, (uint)recalculated.Length, 0);
+
+            return recalculated.SequenceEqual(packet);
+        }
+
+        /// <summary>
+        /// Whether the header checksum and the transport checksum of an unfragmented IPv4 packet
+        /// both verify, with the pseudo header taking the protocol from the IP header.
+        /// </summary>
+        private static bool IPv4ChecksumsVerify(byte[] packet, int checksumOffset)
+        {
+            int headerLength = (packet[0] & 0x0F) * 4;
+            int transportLength = ((packet[2] << 8) | packet[3]) - headerLength;
+
+            // UDP over IPv4 may go without a checksum.
+            if (checksumOffset == 6 && packet[headerLength + 6] == 0 && packet[headerLength + 7] == 0)
+            {
+                return Sum(packet, 0, headerLength, 0) == 0xFFFF;
+            }
+
+            uint pseudoHeader = Sum(packet, 12, 8, 0) + packet[9] + (uint)transportLength;
+
+            return Sum(packet, 0, headerLength, 0) == 0xFFFF && Sum(packet, headerLength, transportLength, pseudoHeader) == 0xFFFF;
+        }
+
+        /// <summary>
+        /// The folded one's complement sum of a run of bytes, as per RFC 1071.
+        /// </summary>
+        private static uint Sum(byte[] bytes, int offset, int length, uint initial)
+        {
+            uint sum = initial;
+
+            for (int i = 0; i < length; i += 2)
+            {
+                sum += (uint)(bytes[offset + i] << 8);
+
+                if (i + 1 < length)
+                {
+                    sum += bytes[offset + i + 1];
+                }
+            }
+
+            while (sum > 0xFFFF)
+            {
+                sum = (sum & 0xFFFF) + (sum >> 16);
+            }
+
+            return sum;
+        }
+    }
+}
@@ -170,6 +170,20 @@ namespace DivertTests.Tests
             0x72, 0x6c, 0x64, 0x21, 0x01
         };
 
+        /// <summary>
+        /// Every test packet above, in declaration order. Handy as a template set for driving the
+        /// simulated packet source.
+        /// </summary>
+        internal static readonly byte[][] AllPackets = new byte[][]
+        {
+            EchoRequest,
+            HttpRequest,
+            DnsRequest,
+            IPv6TCPSyn,
+            IPv6EchoReply,
+            IPv6ExtraHeadersUdp
+        };
+
         private TestData()
         {
         }
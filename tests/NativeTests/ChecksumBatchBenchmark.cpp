@@ -0,0 +1,206 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Benchmark for batched checksum recalculation over a packed buffer, as done by
+// Diversion::CalculateChecksumsBatch. Packs a few thousand IPv4 and IPv6 TCP/UDP packets of mixed
+// sizes into one buffer, then recalculates every checksum with one CalculateChecksums call per
+// packet and with ChecksumBatchPool on 1, 4 and 16 threads, checking that every run produces the
+// same bytes. Also checks that packets reaching past the end of the buffer are skipped.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ChecksumBatchBenchmark.cpp ../../src/DivertNativeChecksum.cpp ../../src/DivertNativeChecksumBatch.cpp -o ChecksumBatchBenchmark
+//     ./ChecksumBatchBenchmark [packets] [rounds]
+
+#include "DivertNativeChecksum.hpp"
+#include "DivertNativeChecksumBatch.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+	const uint8_t UdpProtocol = 17;
+
+	const uint32_t ThreadCounts[] = { 1, 4, 16 };
+
+	/// <summary>
+	/// A packed buffer and its tables, laid out the way PacketBatch lays them out.
+	/// </summary>
+	struct Batch
+	{
+		std::vector<uint8_t> Buffer;
+		std::vector<uint32_t> Offsets;
+		std::vector<uint32_t> Lengths;
+	};
+
+	void AddPacket(Batch& batch, uint32_t length, std::mt19937& random)
+	{
+		const uint32_t offset = static_cast<uint32_t>(batch.Buffer.size());
+		batch.Buffer.resize(offset + ((length + 7) & ~7u));
+
+		uint8_t* packet = batch.Buffer.data() + offset;
+
+		for (uint32_t i = 0; i < length; ++i)
+		{
+			packet[i] = static_cast<uint8_t>(random());
+		}
+
+		const bool ipv4 = random() % 2 == 0;
+		const uint8_t protocol = random() % 2 == 0 ? TcpProtocol : UdpProtocol;
+		const uint32_t transport = ipv4 ? 20 : 40;
+
+		if (ipv4)
+		{
+			packet[0] = 0x45;
+			packet[2] = static_cast<uint8_t>(length >> 8);
+			packet[3] = static_cast<uint8_t>(length);
+			packet[6] = 0x40;
+			packet[7] = 0;
+			packet[9] = protocol;
+		}
+		else
+		{
+			packet[0] = 0x60;
+			packet[4] = static_cast<uint8_t>((length - 40) >> 8);
+			packet[5] = static_cast<uint8_t>(length - 40);
+			packet[6] = protocol;
+		}
+
+		if (protocol == TcpProtocol)
+		{
+			packet[transport + 12] = 0x50;
+		}
+
+		batch.Offsets.push_back(offset);
+		batch.Lengths.push_back(length);
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t packets = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 4096;
+	const uint32_t rounds = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 200;
+
+	int failures = 0;
+
+	std::mt19937 random(4242);
+	std::uniform_int_distribution<uint32_t> size(64, 1500);
+
+	Batch batch;
+
+	for (uint32_t i = 0; i < packets; ++i)
+	{
+		AddPacket(batch, size(random), random);
+	}
+
+	const std::vector<uint8_t> original = batch.Buffer;
+	uint64_t totalBytes = 0;
+
+	for (uint32_t length : batch.Lengths)
+	{
+		totalBytes += length;
+	}
+
+	std::printf("%u packets, %.1f MB per batch, %u hardware threads, %s kernel\n\n", packets, totalBytes / 1e6, std::thread::hardware_concurrency(), ChecksumKernelName(ActiveChecksumKernel()));
+
+	// One call per packet, as reinjection loops do today. Its output is the reference.
+	std::vector<uint8_t> expected;
+
+	{
+		auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t round = 0; round < rounds; ++round)
+		{
+			for (uint32_t i = 0; i < packets; ++i)
+			{
+				CalculateChecksums(batch.Buffer.data() + batch.Offsets[i], batch.Lengths[i], 0);
+			}
+		}
+
+		const double seconds = Seconds(started);
+
+		expected = batch.Buffer;
+
+		std::printf("%-24s %12.0f packets/sec %8.2f GB/sec\n", "Per packet", rounds * static_cast<double>(packets) / seconds, rounds * static_cast<double>(totalBytes) / seconds / 1e9);
+	}
+
+	ChecksumBatchPool pool;
+
+	for (uint32_t threads : ThreadCounts)
+	{
+		batch.Buffer = original;
+
+		uint64_t calculated = 0;
+
+		auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t round = 0; round < rounds; ++round)
+		{
+			calculated += pool.CalculateChecksums(batch.Buffer.data(), batch.Buffer.size(), batch.Offsets.data(), batch.Lengths.data(), packets, 0, threads);
+		}
+
+		const double seconds = Seconds(started);
+
+		if (batch.Buffer != expected)
+		{
+			std::printf("batch on %u threads differs from per packet results\n", threads);
+			++failures;
+		}
+
+		char label[32];
+		std::snprintf(label, sizeof(label), "Batch, %u threads", threads);
+		std::printf("%-24s %12.0f packets/sec %8.2f GB/sec (%llu checksums)\n", label, rounds * static_cast<double>(packets) / seconds, rounds * static_cast<double>(totalBytes) / seconds / 1e9, static_cast<unsigned long long>(calculated / rounds));
+	}
+
+	// Packets that don't fit in the buffer are left alone.
+	{
+		std::vector<uint32_t> offsets = { 0, static_cast<uint32_t>(batch.Buffer.size()) - 10 };
+		std::vector<uint32_t> lengths = { batch.Lengths[0], 100 };
+		const uint8_t before = batch.Buffer.back();
+		const uint64_t calculated = pool.CalculateChecksums(batch.Buffer.data(), batch.Buffer.size(), offsets.data(), lengths.data(), 2, 0, 2);
+
+		if (calculated == 0 || calculated > 2 || batch.Buffer.back() != before)
+		{
+			std::printf("out of bounds packet was not skipped\n");
+			++failures;
+		}
+	}
+
+	std::printf("\nWorkers started: %u\n", pool.WorkerCount());
+	std::printf("\n%s\n", failures == 0 ? "PASSED" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
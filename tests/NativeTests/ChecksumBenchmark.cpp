@@ -0,0 +1,338 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test and benchmark for the native checksum engine behind Diversion::CalculateChecksums. Checks
+// every kernel this processor supports against a byte at a time RFC 1071 reference, at every
+// length and alignment up to a couple of kilobytes, then checks that checksummed IPv4 and IPv6
+// packets of every supported protocol verify and that the ChecksumCalculationFlags are honored.
+// Finally times CalculateChecksums on TCP packets from 64 to 9000 bytes with each kernel.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src ChecksumBenchmark.cpp ../../src/DivertNativeChecksum.cpp -o ChecksumBenchmark
+//     ./ChecksumBenchmark [iterations]
+
+#include "DivertNativeChecksum.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t IcmpProtocol = 1;
+	const uint8_t TcpProtocol = 6;
+	const uint8_t UdpProtocol = 17;
+	const uint8_t Icmpv6Protocol = 58;
+
+	const ChecksumKernel AllKernels[] = { ChecksumKernel::Scalar, ChecksumKernel::Sse2, ChecksumKernel::Avx2, ChecksumKernel::Neon };
+
+	const uint32_t PacketSizes[] = { 64, 128, 256, 576, 1500, 4096, 9000 };
+
+	/// <summary>
+	/// RFC 1071, one big endian word at a time, folded as it goes.
+	/// </summary>
+	uint32_t ReferenceSum(const uint8_t* data, size_t length, uint32_t sum = 0)
+	{
+		for (size_t i = 0; i + 1 < length; i += 2)
+		{
+			sum += (static_cast<uint32_t>(data[i]) << 8) | data[i + 1];
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+
+		if (length % 2 == 1)
+		{
+			sum += static_cast<uint32_t>(data[length - 1]) << 8;
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+
+		return sum;
+	}
+
+	/// <summary>
+	/// True if the checksum stored in the packet verifies, i.e. the data plus the pseudo header
+	/// sums to all ones.
+	/// </summary>
+	bool Verifies(const uint8_t* packet, uint32_t transportOffset, uint32_t transportLength, uint8_t protocol, bool pseudoHeader)
+	{
+		uint32_t sum = ReferenceSum(packet + transportOffset, transportLength);
+
+		if (pseudoHeader)
+		{
+			const bool ipv4 = (packet[0] >> 4) == 4;
+			sum = ReferenceSum(packet + (ipv4 ? 12 : 8), ipv4 ? 8 : 32, sum);
+			sum += protocol;
+			sum += transportLength >> 16;
+			sum += transportLength & 0xFFFF;
+			sum = (sum & 0xFFFF) + (sum >> 16);
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+
+		return sum == 0xFFFF;
+	}
+
+	/// <summary>
+	/// An IPv4 or IPv6 packet with a random payload and garbage in every checksum field.
+	/// </summary>
+	std::vector<uint8_t> MakePacket(int version, uint8_t protocol, uint32_t totalLength, std::mt19937& random, uint32_t* transportOffset)
+	{
+		std::vector<uint8_t> packet(totalLength);
+
+		for (uint8_t& byte : packet)
+		{
+			byte = static_cast<uint8_t>(random());
+		}
+
+		if (version == 4)
+		{
+			packet[0] = 0x45;
+			packet[2] = static_cast<uint8_t>(totalLength >> 8);
+			packet[3] = static_cast<uint8_t>(totalLength);
+			packet[6] = 0x40;
+			packet[7] = 0;
+			packet[9] = protocol;
+			*transportOffset = 20;
+		}
+		else
+		{
+			packet[0] = 0x60;
+			packet[4] = static_cast<uint8_t>((totalLength - 40) >> 8);
+			packet[5] = static_cast<uint8_t>(totalLength - 40);
+			packet[6] = protocol;
+			*transportOffset = 40;
+		}
+
+		if (protocol == TcpProtocol)
+		{
+			packet[*transportOffset + 12] = 0x50;
+		}
+		else if (protocol == UdpProtocol)
+		{
+			const uint32_t udpLength = totalLength - *transportOffset;
+			packet[*transportOffset + 4] = static_cast<uint8_t>(udpLength >> 8);
+			packet[*transportOffset + 5] = static_cast<uint8_t>(udpLength);
+		}
+
+		return packet;
+	}
+
+	uint32_t ChecksumFieldOffset(uint8_t protocol)
+	{
+		return protocol == TcpProtocol ? 16 : protocol == UdpProtocol ? 6 : 2;
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t iterations = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 200000;
+
+	int failures = 0;
+
+	std::mt19937 random(1071);
+
+	std::printf("Best kernel: %s\n", ChecksumKernelName(BestChecksumKernel()));
+
+	// Raw sums, at every length and alignment.
+	std::vector<uint8_t> data(4096 + 64);
+
+	for (uint8_t& byte : data)
+	{
+		byte = static_cast<uint8_t>(random());
+	}
+
+	for (ChecksumKernel kernel : AllKernels)
+	{
+		if (!SetChecksumKernel(kernel))
+		{
+			continue;
+		}
+
+		uint32_t mismatches = 0;
+
+		for (size_t alignment = 0; alignment < 32; ++alignment)
+		{
+			for (size_t length = 0; length <= 2048; ++length)
+			{
+				const uint16_t expected = static_cast<uint16_t>(~ReferenceSum(data.data() + alignment, length));
+				const uint16_t actual = FoldChecksum(SumBytes(data.data() + alignment, length));
+
+				// The engine works in memory order, the reference in network order.
+				const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&actual);
+
+				if (((static_cast<uint16_t>(bytes[0]) << 8) | bytes[1]) != expected)
+				{
+					++mismatches;
+				}
+			}
+		}
+
+		std::printf("%-8s sums at every length and alignment: %u mismatches\n", ChecksumKernelName(kernel), mismatches);
+		failures += mismatches != 0 ? 1 : 0;
+	}
+
+	SetChecksumKernel(BestChecksumKernel());
+
+	// Whole packets.
+	struct Case
+	{
+		int Version;
+		uint8_t Protocol;
+		bool PseudoHeader;
+		uint64_t DisableFlag;
+	};
+
+	const Case cases[] =
+	{
+		{ 4, IcmpProtocol, false, NoIcmpChecksum },
+		{ 4, TcpProtocol, true, NoTcpChecksum },
+		{ 4, UdpProtocol, true, NoUdpChecksum },
+		{ 6, Icmpv6Protocol, true, NoIcmpV6Checksum },
+		{ 6, TcpProtocol, true, NoTcpChecksum },
+		{ 6, UdpProtocol, true, NoUdpChecksum }
+	};
+
+	for (const Case& test : cases)
+	{
+		uint32_t bad = 0;
+
+		for (uint32_t totalLength = 60; totalLength < 1600; totalLength += 7)
+		{
+			uint32_t transportOffset = 0;
+			std::vector<uint8_t> packet = MakePacket(test.Version, test.Protocol, totalLength, random, &transportOffset);
+			const uint32_t field = transportOffset + ChecksumFieldOffset(test.Protocol);
+			const uint32_t expectedCount = test.Version == 4 ? 2 : 1;
+
+			// Everything.
+			if (CalculateChecksums(packet.data(), totalLength, 0) != expectedCount)
+			{
+				++bad;
+			}
+
+			if (test.Version == 4 && ReferenceSum(packet.data(), 20) != 0xFFFF)
+			{
+				++bad;
+			}
+
+			if (!Verifies(packet.data(), transportOffset, totalLength - transportOffset, test.Protocol, test.PseudoHeader))
+			{
+				++bad;
+			}
+
+			// The transport checksum disabled leaves the field alone.
+			packet[field] = 0xAB;
+			packet[field + 1] = 0xCD;
+
+			if (CalculateChecksums(packet.data(), totalLength, test.DisableFlag) != expectedCount - 1 || packet[field] != 0xAB || packet[field + 1] != 0xCD)
+			{
+				++bad;
+			}
+
+			// NoReplace keeps non-zero fields, and fills in zero ones.
+			if (CalculateChecksums(packet.data(), totalLength, NoReplaceChecksum) != 0 || packet[field] != 0xAB)
+			{
+				++bad;
+			}
+
+			packet[field] = 0;
+			packet[field + 1] = 0;
+
+			if (CalculateChecksums(packet.data(), totalLength, NoReplaceChecksum | NoIpChecksum) != 1 || !Verifies(packet.data(), transportOffset, totalLength - transportOffset, test.Protocol, test.PseudoHeader))
+			{
+				++bad;
+			}
+		}
+
+		std::printf("IPv%d protocol %-2u packets: %u failures\n", test.Version, test.Protocol, bad);
+		failures += bad != 0 ? 1 : 0;
+	}
+
+	// Malformed and fragmented packets.
+	{
+		uint32_t transportOffset = 0;
+		std::vector<uint8_t> packet = MakePacket(4, TcpProtocol, 200, random, &transportOffset);
+
+		uint32_t bad = 0;
+		bad += CalculateChecksums(packet.data(), 100, 0) != 0 ? 1 : 0;
+
+		packet[6] = 0x20;
+		bad += CalculateChecksums(packet.data(), 200, 0) != 1 ? 1 : 0;
+
+		packet[0] = 0x44;
+		bad += CalculateChecksums(packet.data(), 200, 0) != 0 ? 1 : 0;
+
+		std::printf("Truncated, fragmented and malformed packets: %u failures\n", bad);
+		failures += bad != 0 ? 1 : 0;
+	}
+
+	// Throughput.
+	std::printf("\n%-8s %8s %14s %12s\n", "Kernel", "Bytes", "Packets/sec", "Gbit/sec");
+
+	for (ChecksumKernel kernel : AllKernels)
+	{
+		if (!SetChecksumKernel(kernel))
+		{
+			continue;
+		}
+
+		for (uint32_t size : PacketSizes)
+		{
+			uint32_t transportOffset = 0;
+			std::vector<uint8_t> packet = MakePacket(4, TcpProtocol, size, random, &transportOffset);
+
+			// Fewer iterations for big packets, so every size takes roughly as long.
+			const uint32_t count = static_cast<uint32_t>(static_cast<uint64_t>(iterations) * 1500 / size);
+			uint32_t calculated = 0;
+
+			auto started = std::chrono::steady_clock::now();
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				calculated += CalculateChecksums(packet.data(), size, 0);
+			}
+
+			const double seconds = Seconds(started);
+
+			if (calculated != count * 2)
+			{
+				++failures;
+			}
+
+			std::printf("%-8s %8u %14.0f %12.2f\n", ChecksumKernelName(kernel), size, count / seconds, count * static_cast<double>(size) * 8 / seconds / 1e9);
+		}
+	}
+
+	SetChecksumKernel(BestChecksumKernel());
+
+	std::printf("\n%s\n", failures == 0 ? "PASSED" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
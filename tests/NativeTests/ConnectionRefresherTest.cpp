@@ -0,0 +1,254 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the background connection table refresher. Readers look up flows continuously
+// while the refresher republishes tables whose owners keep changing underneath them, and must
+// only ever see whole snapshots. Uses a canned source, so it needs neither the IP helper API
+// nor Windows. Also reports how long readers take per lookup while refreshes are running, and
+// checks that RequestRefresh cuts the interval short.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ConnectionRefresherTest.cpp ../../src/DivertConnectionTable.cpp ../../src/DivertConnectionRefresher.cpp -o ConnectionRefresherTest
+//     ./ConnectionRefresherTest [tableSize] [readers] [seconds]
+//
+// Adding -fsanitize=thread checks the publishing protocol for races.
+
+#include "DivertConnectionRefresher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	/// <summary>
+	/// A table in which every socket is owned by the same process, so that a reader which sees
+	/// two owners within one snapshot has seen a torn one.
+	/// </summary>
+	std::vector<ConnectionEntry> MakeEntries(uint32_t size, uint32_t pid)
+	{
+		std::vector<ConnectionEntry> entries(size);
+
+		for (uint32_t i = 0; i < size; ++i)
+		{
+			ConnectionEntry& entry = entries[i];
+			std::memset(&entry, 0, sizeof(entry));
+
+			const uint32_t local = 0x0A000000u | (i >> 16);
+			const uint32_t remote = 0xC0A80000u | (i & 0xFFFF);
+
+			std::memcpy(entry.LocalAddress, &local, sizeof(local));
+			std::memcpy(entry.RemoteAddress, &remote, sizeof(remote));
+			entry.LocalPort = static_cast<uint16_t>(1024 + (i & 0x7FFF));
+			entry.RemotePort = 443;
+			entry.OwningPid = pid;
+		}
+
+		return entries;
+	}
+
+	FlowKey KeyFor(const ConnectionEntry& entry)
+	{
+		return FlowKey::FromIPv4(TcpProtocol, *reinterpret_cast<const uint32_t*>(entry.LocalAddress), entry.LocalPort,
+			*reinterpret_cast<const uint32_t*>(entry.RemoteAddress), entry.RemotePort);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t tableSize = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 20000;
+	const uint32_t readerCount = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 4;
+	const int seconds = argc > 3 ? std::atoi(argv[3]) : 2;
+
+	int failures = 0;
+
+	const std::vector<ConnectionEntry> first = MakeEntries(tableSize, 1);
+	const std::vector<ConnectionEntry> second = MakeEntries(tableSize, 2);
+
+	CannedConnectionSource source;
+	source.Set(4, TcpProtocol, first);
+	source.Set(4, UdpProtocol, std::vector<ConnectionEntry>());
+	source.Set(6, TcpProtocol, std::vector<ConnectionEntry>());
+	source.Set(6, UdpProtocol, std::vector<ConnectionEntry>());
+
+	ConnectionRefresher refresher(&source, 1);
+
+	if (refresher.Generation() != 0 || !refresher.Start() || refresher.Generation() == 0)
+	{
+		std::printf("first snapshot was not published by Start\n");
+		return 1;
+	}
+
+	std::atomic<bool> stop(false);
+	std::atomic<uint64_t> torn(0);
+	std::atomic<uint64_t> unowned(0);
+	std::atomic<uint64_t> lookups(0);
+	std::atomic<uint64_t> slowest(0);
+
+	std::vector<std::thread> readers;
+
+	for (uint32_t r = 0; r < readerCount; ++r)
+	{
+		readers.emplace_back([&, r]()
+		{
+			uint32_t next = r * 7919;
+			uint64_t local = 0;
+			uint64_t localSlowest = 0;
+
+			while (!stop.load(std::memory_order_relaxed))
+			{
+				auto started = std::chrono::steady_clock::now();
+
+				{
+					SnapshotLease lease(refresher);
+					const ConnectionTable* table = lease.Snapshot().Table(4, TcpProtocol);
+
+					uint32_t firstPid = 0;
+
+					for (int i = 0; i < 8; ++i)
+					{
+						uint32_t pid = 0;
+
+						if (!table->FindOwner(KeyFor(first[next++ % tableSize]), &pid))
+						{
+							unowned.fetch_add(1, std::memory_order_relaxed);
+						}
+						else if (firstPid == 0)
+						{
+							firstPid = pid;
+						}
+						else if (pid != firstPid)
+						{
+							torn.fetch_add(1, std::memory_order_relaxed);
+						}
+					}
+				}
+
+				const uint64_t elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+				localSlowest = std::max(localSlowest, elapsed);
+				local += 8;
+			}
+
+			lookups.fetch_add(local);
+
+			uint64_t previous = slowest.load();
+
+			while (localSlowest > previous && !slowest.compare_exchange_weak(previous, localSlowest))
+			{
+
+			}
+		});
+	}
+
+	// Flip the owners back and forth, so every refresh publishes something different.
+	auto started = std::chrono::steady_clock::now();
+	uint32_t flips = 0;
+
+	while (std::chrono::steady_clock::now() - started < std::chrono::seconds(seconds))
+	{
+		source.Set(4, TcpProtocol, (++flips % 2) ? second : first);
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+
+	stop.store(true);
+
+	for (std::thread& reader : readers)
+	{
+		reader.join();
+	}
+
+	const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	std::printf("Table entries: %u, readers: %u, snapshots published: %llu, refresh failures: %llu\n", tableSize, readerCount,
+		static_cast<unsigned long long>(refresher.Generation()), static_cast<unsigned long long>(refresher.FailureCount()));
+	std::printf("Lookups/sec: %.0f, slowest 8 lookups under one lease: %.1f us\n", lookups.load() / elapsed, slowest.load() / 1000.0);
+
+	if (torn.load() != 0 || unowned.load() != 0)
+	{
+		std::printf("readers saw %llu torn and %llu incomplete snapshots\n", static_cast<unsigned long long>(torn.load()), static_cast<unsigned long long>(unowned.load()));
+		++failures;
+	}
+
+	if (refresher.Generation() < 2)
+	{
+		std::printf("refresher did not republish\n");
+		++failures;
+	}
+
+	// With a long interval, only RequestRefresh gets a new snapshot out promptly.
+	refresher.SetInterval(60000);
+
+	// Let the thread settle into its long wait.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	const uint64_t before = refresher.Generation();
+	refresher.RequestRefresh();
+
+	auto requested = std::chrono::steady_clock::now();
+
+	while (refresher.Generation() == before && std::chrono::steady_clock::now() - requested < std::chrono::seconds(5))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	if (refresher.Generation() == before)
+	{
+		std::printf("RequestRefresh did not wake the refresher\n");
+		++failures;
+	}
+
+	// Stopping leaves the last snapshot published.
+	const uint64_t published = refresher.Generation();
+	refresher.Stop();
+
+	// Refreshing by hand doesn't need the thread.
+	ConnectionRefresher oneShot(&source, 1);
+
+	if (!oneShot.RefreshNow() || oneShot.Generation() != 1)
+	{
+		std::printf("RefreshNow did not publish\n");
+		++failures;
+	}
+
+	if (refresher.Running() || refresher.Generation() != published)
+	{
+		std::printf("refresher still running after Stop\n");
+		++failures;
+	}
+
+	std::printf("%s\n", failures == 0 ? "OK" : "FAILED");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the connection table index. Fills tables from a canned source, so it needs neither
+// the IP helper API nor Windows, checks that indexed lookups agree with a scan of the whole
+// table for established flows, listeners, sockets bound to the unspecified address and flows
+// with no owner, and reports the cost of each.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ConnectionTableTest.cpp ../../src/DivertConnectionTable.cpp -o ConnectionTableTest
+//     ./ConnectionTableTest [tableSize] [lookups]
+
+#include "DivertConnectionTable.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	uint16_t ToNetwork(uint16_t port)
+	{
+		return static_cast<uint16_t>((port >> 8) | (port << 8));
+	}
+
+	ConnectionEntry MakeEntry(uint32_t local, uint16_t localPort, uint32_t remote, uint16_t remotePort, uint32_t pid)
+	{
+		ConnectionEntry entry = {};
+
+		std::memcpy(entry.LocalAddress, &local, sizeof(local));
+		std::memcpy(entry.RemoteAddress, &remote, sizeof(remote));
+		entry.LocalPort = ToNetwork(localPort);
+		entry.RemotePort = remotePort == 0 ? 0 : ToNetwork(remotePort);
+		entry.OwningPid = pid;
+
+		return entry;
+	}
+
+	/// <summary>
+	/// A server with a few hundred listeners on a handful of addresses, some bound to the
+	/// unspecified address, and many accepted connections sharing each listener's local end,
+	/// plus outbound connections from ephemeral ports.
+	/// </summary>
+	std::vector<ConnectionEntry> MakeEntries(uint32_t size, std::mt19937& random)
+	{
+		std::vector<ConnectionEntry> entries;
+
+		for (uint16_t port = 8000; port < 8256; ++port)
+		{
+			const uint32_t local = (port % 4 == 0) ? 0 : 0x0A000001u + (port % 3);
+			entries.push_back(MakeEntry(local, port, 0, 0, 100 + port % 7));
+		}
+
+		std::uniform_int_distribution<uint32_t> pick(0, 0xFFFFFFFFu);
+
+		while (entries.size() < size)
+		{
+			const uint32_t remote = 0xC0000000u | (pick(random) & 0xFFFFFF);
+			const uint16_t remotePort = static_cast<uint16_t>(1024 + pick(random) % 60000);
+
+			if (entries.size() % 2 == 0)
+			{
+				// Accepted on one of the listeners.
+				const uint16_t port = static_cast<uint16_t>(8000 + pick(random) % 256);
+				const uint32_t local = 0x0A000001u + (port % 3);
+				entries.push_back(MakeEntry(local, port, remote, remotePort, 100 + port % 7));
+			}
+			else
+			{
+				// Outbound, from an ephemeral port.
+				const uint16_t port = static_cast<uint16_t>(49152 + entries.size() % 16384);
+				entries.push_back(MakeEntry(0x0A000001u, port, remote, 443, 2000 + static_cast<uint32_t>(entries.size() % 31)));
+			}
+		}
+
+		return entries;
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t tableSize = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 50000;
+	const uint32_t lookups = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 20000;
+
+	int failures = 0;
+
+	std::mt19937 random(4242);
+	const std::vector<ConnectionEntry> entries = MakeEntries(tableSize, random);
+
+	CannedConnectionSource source;
+	source.Set(4, TcpProtocol, entries);
+
+	ConnectionTable table(4, TcpProtocol);
+
+	if (!source.Snapshot(table) || !table.Indexed() || table.Size() != entries.size())
+	{
+		std::printf("snapshot failed\n");
+		return 1;
+	}
+
+	// Flows to look up: established ones, new inbound connections to listeners, and flows
+	// nothing owns.
+	std::vector<FlowKey> keys;
+	std::uniform_int_distribution<size_t> pickEntry(0, entries.size() - 1);
+
+	for (uint32_t i = 0; i < lookups; ++i)
+	{
+		const ConnectionEntry& entry = entries[pickEntry(random)];
+
+		uint32_t local = 0;
+		uint32_t remote = 0;
+		std::memcpy(&local, entry.LocalAddress, sizeof(local));
+		std::memcpy(&remote, entry.RemoteAddress, sizeof(remote));
+
+		switch (i % 4)
+		{
+			case 0:
+			case 1:
+				keys.push_back(FlowKey::FromIPv4(TcpProtocol, local, entry.LocalPort, remote, entry.RemotePort));
+				break;
+			case 2:
+				keys.push_back(FlowKey::FromIPv4(TcpProtocol, local == 0 ? 0x0A000009u : local, entry.LocalPort, 0x08080808u, ToNetwork(40000)));
+				break;
+			default:
+				keys.push_back(FlowKey::FromIPv4(TcpProtocol, 0x0A000001u, ToNetwork(static_cast<uint16_t>(3000 + i % 1000)), 0x08080808u, ToNetwork(40000)));
+				break;
+		}
+	}
+
+	std::vector<uint32_t> scanned(keys.size());
+	std::vector<char> scannedFound(keys.size());
+
+	auto started = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		scannedFound[i] = table.FindOwnerByScan(keys[i], &scanned[i]) ? 1 : 0;
+	}
+
+	const double scanSeconds = Seconds(started);
+
+	uint32_t mismatches = 0;
+	uint32_t owned = 0;
+
+	started = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < keys.size(); ++i)
+	{
+		uint32_t pid = 0;
+		const bool found = table.FindOwner(keys[i], &pid);
+
+		if (found != (scannedFound[i] != 0) || (found && pid != scanned[i]))
+		{
+			++mismatches;
+		}
+
+		owned += found ? 1 : 0;
+	}
+
+	const double indexSeconds = Seconds(started);
+
+	// A snapshot plus a batch of lookups against it, as a refresh would be used.
+	started = std::chrono::steady_clock::now();
+
+	ConnectionTable fresh(4, TcpProtocol);
+	source.Snapshot(fresh);
+
+	for (const FlowKey& key : keys)
+	{
+		uint32_t pid = 0;
+		fresh.FindOwner(key, &pid);
+	}
+
+	const double batchSeconds = Seconds(started);
+
+	std::printf("Table entries: %u, lookups: %u, owned: %u\n", tableSize, lookups, owned);
+	std::printf("%18s %14s %12s\n", "", "lookups/sec", "ns/lookup");
+	std::printf("%18s %14.0f %12.1f\n", "scan", lookups / scanSeconds, scanSeconds * 1e9 / lookups);
+	std::printf("%18s %14.0f %12.1f\n", "index", lookups / indexSeconds, indexSeconds * 1e9 / lookups);
+	std::printf("%18s %14.0f %12.1f\n", "snapshot + index", lookups / batchSeconds, batchSeconds * 1e9 / lookups);
+
+	if (mismatches != 0)
+	{
+		std::printf("index disagrees with scan for %u lookups\n", mismatches);
+		++failures;
+	}
+
+	// Wildcard preference: a socket on the exact local address beats one on the unspecified
+	// address, which is still found when nothing else matches.
+	ConnectionTable udp(4, UdpProtocol);
+	udp.Add(MakeEntry(0, 53, 0, 0, 1));
+	udp.Add(MakeEntry(0x0100007Fu, 53, 0, 0, 2));
+	udp.BuildIndex();
+
+	uint32_t pid = 0;
+
+	if (!udp.FindOwner(FlowKey::FromIPv4(UdpProtocol, 0x0100007Fu, ToNetwork(53), 0x0100007Fu, ToNetwork(5000)), &pid) || pid != 2)
+	{
+		std::printf("specific bind not preferred\n");
+		++failures;
+	}
+
+	if (!udp.FindOwner(FlowKey::FromIPv4(UdpProtocol, 0x0A000001u, ToNetwork(53), 0x08080808u, ToNetwork(5000)), &pid) || pid != 1)
+	{
+		std::printf("wildcard bind not found\n");
+		++failures;
+	}
+
+	if (udp.FindOwner(FlowKey::FromIPv4(UdpProtocol, 0x0A000001u, ToNetwork(54), 0x08080808u, ToNetwork(5000)), &pid))
+	{
+		std::printf("unowned flow found\n");
+		++failures;
+	}
+
+	// Adding invalidates the index, and lookups still work until it is rebuilt.
+	udp.Add(MakeEntry(0x0A000001u, 54, 0, 0, 3));
+
+	if (udp.Indexed() || !udp.FindOwner(FlowKey::FromIPv4(UdpProtocol, 0x0A000001u, ToNetwork(54), 0x08080808u, ToNetwork(5000)), &pid) || pid != 3)
+	{
+		std::printf("stale index used\n");
+		++failures;
+	}
+
+	// Families and protocols there are no tables for are refused.
+	ConnectionTable icmp(4, 1);
+
+	if (source.Snapshot(icmp))
+	{
+		std::printf("snapshot of unsupported table succeeded\n");
+		++failures;
+	}
+
+	std::printf("%s\n", failures == 0 ? "OK" : "FAILED");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,360 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the filter analyzer. Checks the simplified form of a set of filters, and that every
+// filter in tests/DivertTests/TestData/Tests.json still matches the same packets once simplified
+// and written back out. Then checks overlap verdicts for a set of pairs, and that no two filters
+// of Tests.json that both match one of the test packets are reported as disjoint.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FilterAnalyzerTest.cpp ../../src/DivertNativeFilter.cpp ../../src/DivertNativeFilterAnalyzer.cpp ../../src/DivertNativeChecksum.cpp -o FilterAnalyzerTest
+//     ./FilterAnalyzerTest [Tests.json] [TestData.cs]
+
+#include "DivertNativeChecksum.hpp"
+#include "DivertNativeFilterAnalyzer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	std::string ReadFile(const char* path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		return contents.str();
+	}
+
+	/// <summary>
+	/// Reads the string value of the next "key":"value" pair at or after position, advancing
+	/// position past it. Tests.json has no escapes, so none are handled.
+	/// </summary>
+	bool NextValue(const std::string& json, const std::string& key, size_t& position, std::string& value)
+	{
+		const std::string quoted = "\"" + key + "\"";
+		size_t found = json.find(quoted, position);
+
+		if (found == std::string::npos)
+		{
+			return false;
+		}
+
+		size_t start = json.find('"', json.find(':', found + quoted.size()) + 1);
+		size_t end = json.find('"', start + 1);
+
+		value = json.substr(start + 1, end - start - 1);
+		position = end + 1;
+		return true;
+	}
+
+	/// <summary>
+	/// Extracts "internal static readonly byte[] Name = new byte[] { 0x.., ... };" arrays.
+	/// </summary>
+	std::map<std::string, std::vector<uint8_t>> ReadPackets(const std::string& source)
+	{
+		std::map<std::string, std::vector<uint8_t>> packets;
+		const std::string marker = "internal static readonly byte[] ";
+		size_t position = 0;
+
+		while ((position = source.find(marker, position)) != std::string::npos)
+		{
+			position += marker.size();
+
+			const size_t nameEnd = source.find_first_of(" =", position);
+			const std::string name = source.substr(position, nameEnd - position);
+			const size_t open = source.find('{', nameEnd);
+			const size_t close = source.find('}', open);
+
+			std::vector<uint8_t> bytes;
+
+			for (size_t hex = source.find("0x", open); hex < close; hex = source.find("0x", hex + 2))
+			{
+				bytes.push_back(static_cast<uint8_t>(std::strtoul(source.c_str() + hex, nullptr, 16)));
+			}
+
+			if (!bytes.empty())
+			{
+				packets[name] = bytes;
+			}
+
+			position = close;
+		}
+
+		return packets;
+	}
+
+	const std::map<std::string, std::string> PacketNames =
+	{
+		{ "&pkt_echo_request", "EchoRequest" },
+		{ "&pkt_http_request", "HttpRequest" },
+		{ "&pkt_dns_request", "DnsRequest" },
+		{ "&pkt_ipv6_tcp_syn", "IPv6TCPSyn" },
+		{ "&pkt_ipv6_echo_reply", "IPv6EchoReply" },
+		{ "&pkt_ipv6_exthdrs_udp", "IPv6ExtraHeadersUdp" }
+	};
+
+	std::string Trim(const std::string& text)
+	{
+		const size_t start = text.find_first_not_of(" \t");
+		const size_t end = text.find_last_not_of(" \t");
+		return start == std::string::npos ? std::string() : text.substr(start, end - start + 1);
+	}
+
+	std::string Simplified(const std::string& text)
+	{
+		size_t length = 0;
+
+		if (!FilterAnalyzer::Simplify(text.data(), text.size(), FilterLayer::Network, nullptr, 0, &length, nullptr, nullptr))
+		{
+			return "<invalid>";
+		}
+
+		std::vector<char> simplified(length + 1);
+		FilterAnalyzer::Simplify(text.data(), text.size(), FilterLayer::Network, simplified.data(), simplified.size(), &length, nullptr, nullptr);
+		return std::string(simplified.data(), length);
+	}
+
+	FilterOverlap Overlap(const std::string& first, const std::string& second)
+	{
+		FilterOverlap overlap = FilterOverlap::Unknown;
+		FilterAnalyzer::Overlap(first.data(), first.size(), second.data(), second.size(), FilterLayer::Network, &overlap, nullptr, nullptr);
+		return overlap;
+	}
+
+	const char* OverlapName(FilterOverlap overlap)
+	{
+		return overlap == FilterOverlap::Disjoint ? "disjoint" : overlap == FilterOverlap::Overlapping ? "overlapping" : "unknown";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* testsPath = argc > 1 ? argv[1] : "../DivertTests/TestData/Tests.json";
+	const char* dataPath = argc > 2 ? argv[2] : "../DivertTests/Tests/TestData.cs";
+
+	const std::string json = ReadFile(testsPath);
+	std::map<std::string, std::vector<uint8_t>> packets = ReadPackets(ReadFile(dataPath));
+
+	if (json.empty() || packets.size() != PacketNames.size())
+	{
+		std::printf("Couldn't read %s and %s\n", testsPath, dataPath);
+		return 1;
+	}
+
+	for (auto& packet : packets)
+	{
+		CalculateChecksums(packet.second.data(), static_cast<uint32_t>(packet.second.size()), 0);
+	}
+
+	WINDIVERT_ADDRESS address = {};
+	address.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+	int failed = 0;
+
+	const std::pair<const char*, const char*> simplifications[] =
+	{
+		{ "tcp and tcp.DstPort == 80", "tcp.DstPort == 80" },
+		{ "tcp or tcp.DstPort == 80", "tcp" },
+		{ "outbound and tcp.DstPort == 80 and tcp", "outbound and tcp.DstPort == 80" },
+		{ "tcp and udp", "false" },
+		{ "icmp and ip", "icmp" },
+		{ "icmp and ipv6", "false" },
+		{ "true and (false or tcp)", "tcp" },
+		{ "inbound or not inbound", "true" },
+		{ "tcp.DstPort == 80 or tcp.DstPort == 81 or tcp.DstPort == 82", "tcp.DstPort >= 80 and tcp.DstPort <= 82" },
+		{ "tcp.DstPort == 80 or tcp.DstPort == 443 or tcp.DstPort == 80", "tcp.DstPort == 80 or tcp.DstPort == 443" },
+		{ "tcp.DstPort == 80 and tcp.DstPort == 443", "false" },
+		{ "tcp.DstPort >= 10 and tcp.DstPort <= 20 and tcp.DstPort != 15", "tcp.DstPort >= 10 and tcp.DstPort <= 20 and tcp.DstPort != 15" },
+		{ "tcp.DstPort <= 65535", "tcp" },
+		{ "tcp.DstPort > 65535", "false" },
+		{ "ip.TTL < 300 and ip.DF == 1", "ip.DF" },
+		{ "tcp and not tcp.DstPort == 80", "tcp.DstPort != 80" },
+		{ "udp and (tcp.DstPort == 80 or udp.DstPort == 53)", "udp.DstPort == 53" },
+		{ "(tcp? true: udp)", "tcp or udp" },
+		{ "(tcp? tcp.DstPort == 80: false)", "tcp.DstPort == 80" },
+		{ "(tcp? tcp.DstPort == 80: udp.DstPort == 53)", "(tcp? tcp.DstPort == 80: udp.DstPort == 53)" },
+		{ "ip.DstAddr == 10.0.0.1 or ip.DstAddr == 10.0.0.1", "ip.DstAddr == 10.0.0.1" },
+		{ "ipv6.SrcAddr == ::1 or ipv6.SrcAddr == 2001:db8::ff00:42:8329", "ipv6.SrcAddr == ::1 or ipv6.SrcAddr == 2001:db8::ff00:42:8329" },
+		{ "tcp.Syn == 1 and not tcp.Ack == 1", "tcp.Syn and tcp.Ack == 0" }
+	};
+
+	int simplifiedCorrectly = 0;
+
+	for (const auto& simplification : simplifications)
+	{
+		const std::string simplified = Simplified(simplification.first);
+
+		if (simplified != simplification.second)
+		{
+			std::printf("\"%s\" simplified to \"%s\", expected \"%s\"\n", simplification.first, simplified.c_str(), simplification.second);
+			++failed;
+			continue;
+		}
+
+		++simplifiedCorrectly;
+	}
+
+	std::printf("Simplifications: %d of %d as expected\n", simplifiedCorrectly, static_cast<int>(sizeof(simplifications) / sizeof(simplifications[0])));
+
+	std::vector<std::string> filters;
+	std::vector<std::vector<bool>> matches;
+	int roundTrips = 0;
+	size_t position = 0;
+	std::string name;
+
+	while (NextValue(json, "TestName", position, name))
+	{
+		std::string text;
+		std::string data;
+		std::string match;
+
+		NextValue(json, "TestFilter", position, text);
+		NextValue(json, "TestData", position, data);
+		NextValue(json, "Match", position, match);
+
+		const std::string simplified = Simplified(text);
+		Filter filter;
+
+		if (!filter.Compile(simplified.data(), simplified.size(), FilterLayer::Network, nullptr, nullptr))
+		{
+			std::printf("%s: \"%s\" simplified to \"%s\", which doesn't compile\n", name.c_str(), text.c_str(), simplified.c_str());
+			++failed;
+			continue;
+		}
+
+		const std::vector<uint8_t>& packet = packets[PacketNames.at(Trim(data))];
+
+		if (filter.Evaluate(packet.data(), static_cast<uint32_t>(packet.size()), &address) != (Trim(match) == "TRUE"))
+		{
+			std::printf("%s: \"%s\" simplified to \"%s\", which gives the wrong result\n", name.c_str(), text.c_str(), simplified.c_str());
+			++failed;
+			continue;
+		}
+
+		if (Simplified(simplified) != simplified)
+		{
+			std::printf("%s: \"%s\" simplifies further than \"%s\"\n", name.c_str(), text.c_str(), simplified.c_str());
+			++failed;
+			continue;
+		}
+
+		filters.push_back(text);
+		matches.push_back(std::vector<bool>());
+
+		for (const auto& other : packets)
+		{
+			matches.back().push_back(filter.Evaluate(other.second.data(), static_cast<uint32_t>(other.second.size()), &address));
+		}
+
+		++roundTrips;
+	}
+
+	std::printf("Tests.json: %d filters simplified and still correct\n", roundTrips);
+
+	struct Pair
+	{
+		const char* First;
+
+		const char* Second;
+
+		FilterOverlap Expected;
+	};
+
+	const Pair pairs[] =
+	{
+		{ "tcp.DstPort == 80", "udp.DstPort == 53", FilterOverlap::Disjoint },
+		{ "tcp", "tcp.DstPort == 80", FilterOverlap::Overlapping },
+		{ "inbound", "outbound", FilterOverlap::Disjoint },
+		{ "inbound and tcp", "not outbound", FilterOverlap::Overlapping },
+		{ "ip.Protocol == 17", "tcp", FilterOverlap::Disjoint },
+		{ "ip.Protocol == 6", "tcp", FilterOverlap::Overlapping },
+		{ "ip.FragOff > 0", "udp", FilterOverlap::Disjoint },
+		{ "tcp.DstPort < 1024", "tcp.DstPort >= 1024", FilterOverlap::Disjoint },
+		{ "not tcp", "tcp.DstPort == 80", FilterOverlap::Disjoint },
+		{ "not tcp.DstPort == 80", "tcp.DstPort == 80", FilterOverlap::Disjoint },
+		{ "not tcp.DstPort == 80", "tcp.DstPort == 80 or udp", FilterOverlap::Overlapping },
+		{ "icmp", "ipv6", FilterOverlap::Disjoint },
+		{ "true", "false", FilterOverlap::Disjoint },
+		{ "true", "true", FilterOverlap::Overlapping },
+		{ "(tcp? tcp.DstPort == 80: udp.DstPort == 53)", "udp.DstPort == 53", FilterOverlap::Overlapping },
+		{ "(tcp? tcp.DstPort == 80: udp.DstPort == 53)", "udp.DstPort == 80", FilterOverlap::Disjoint },
+		{ "ip.DstAddr >= 10.0.0.0 and ip.DstAddr <= 10.255.255.255", "ip.DstAddr == 192.168.0.1 or ipv6", FilterOverlap::Disjoint }
+	};
+
+	int overlapsCorrect = 0;
+
+	for (const Pair& pair : pairs)
+	{
+		const FilterOverlap overlap = Overlap(pair.First, pair.Second);
+
+		if (overlap != pair.Expected || Overlap(pair.Second, pair.First) != overlap)
+		{
+			std::printf("\"%s\" and \"%s\" reported %s, expected %s\n", pair.First, pair.Second, OverlapName(overlap), OverlapName(pair.Expected));
+			++failed;
+			continue;
+		}
+
+		++overlapsCorrect;
+	}
+
+	std::printf("Overlaps: %d of %d as expected\n", overlapsCorrect, static_cast<int>(sizeof(pairs) / sizeof(pairs[0])));
+
+	// Two filters that both match one packet can't be disjoint.
+	int pairsChecked = 0;
+
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		for (size_t j = i; j < filters.size(); ++j)
+		{
+			bool shared = false;
+
+			for (size_t p = 0; p < matches[i].size(); ++p)
+			{
+				shared = shared || (matches[i][p] && matches[j][p]);
+			}
+
+			if (shared && Overlap(filters[i], filters[j]) == FilterOverlap::Disjoint)
+			{
+				std::printf("\"%s\" and \"%s\" match the same packet but were reported disjoint\n", filters[i].c_str(), filters[j].c_str());
+				++failed;
+			}
+
+			++pairsChecked;
+		}
+	}
+
+	std::printf("Tests.json: %d pairs checked for overlap\n", pairsChecked);
+
+	std::printf("\n%s\n", failed == 0 ? "PASSED" : "FAILED");
+	return failed == 0 ? 0 : 1;
+}
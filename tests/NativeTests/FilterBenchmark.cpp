@@ -0,0 +1,351 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Benchmark for offline classification with the native filter engine. Builds a packed batch of
+// IPv4 and IPv6 TCP, UDP and ICMP packets with varied addresses, ports and flags, the way a
+// capture would be loaded into a PacketBatch, then evaluates a handful of typical filters over
+// it with Filter::EvaluateBatch, using the interpreter, the specialized and the vectorized
+// backend. Besides a few typical filters, it runs block list style filters of 1, 10 and 100
+// clauses. Each filter's results are checked against the same condition written by hand in C++,
+// and its throughput is reported in millions of packets per second on one core.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FilterBenchmark.cpp ../../src/DivertNativeFilter.cpp ../../src/DivertNativeFilterAnalyzer.cpp -o FilterBenchmark
+//     ./FilterBenchmark [packets] [rounds]
+
+#include "DivertNativeFilter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	/// <summary>
+	/// What the generator put in each packet, for checking the filters against.
+	/// </summary>
+	struct Truth
+	{
+		bool Outbound;
+		int Version;
+		uint8_t Protocol;
+		uint32_t DstAddr;
+		uint16_t DstPort;
+		bool Syn;
+		bool Ack;
+		uint32_t PayloadLength;
+	};
+
+	struct Capture
+	{
+		std::vector<uint8_t> Buffer;
+		std::vector<uint32_t> Offsets;
+		std::vector<uint32_t> Lengths;
+		std::vector<WINDIVERT_ADDRESS> Addresses;
+		std::vector<Truth> Truths;
+	};
+
+	const uint16_t Ports[] = { 80, 443, 53, 22, 8080, 123, 5353, 3389 };
+
+	void AddPacket(Capture& capture, std::mt19937& random)
+	{
+		Truth truth = Truth();
+		truth.Outbound = random() % 2 == 0;
+		truth.Version = random() % 4 == 0 ? 6 : 4;
+
+		switch (random() % 8)
+		{
+			case 0: truth.Protocol = truth.Version == 4 ? 1 : 58; break;
+			case 1: case 2: case 3: truth.Protocol = 17; break;
+			default: truth.Protocol = 6; break;
+		}
+
+		truth.DstAddr = random() % 2 == 0 ? (0x0A000000 | (random() & 0xFFFFFF)) : static_cast<uint32_t>(random());
+		truth.DstPort = Ports[random() % (sizeof(Ports) / sizeof(Ports[0]))];
+		truth.Syn = random() % 4 == 0;
+		truth.Ack = !truth.Syn || random() % 2 == 0;
+		truth.PayloadLength = random() % 3 == 0 ? 0 : random() % 1200;
+
+		const uint32_t ipLength = truth.Version == 4 ? 20 : 40;
+		const uint32_t transportLength = truth.Protocol == 6 ? 20 : 8;
+		const uint32_t length = ipLength + transportLength + truth.PayloadLength;
+		const uint32_t offset = static_cast<uint32_t>(capture.Buffer.size());
+
+		capture.Buffer.resize(offset + ((length + 7) & ~7u));
+		uint8_t* packet = capture.Buffer.data() + offset;
+
+		if (truth.Version == 4)
+		{
+			packet[0] = 0x45;
+			packet[2] = static_cast<uint8_t>(length >> 8);
+			packet[3] = static_cast<uint8_t>(length);
+			packet[6] = 0x40;
+			packet[8] = 64;
+			packet[9] = truth.Protocol;
+			packet[12] = 192;
+			packet[13] = 168;
+			packet[16] = static_cast<uint8_t>(truth.DstAddr >> 24);
+			packet[17] = static_cast<uint8_t>(truth.DstAddr >> 16);
+			packet[18] = static_cast<uint8_t>(truth.DstAddr >> 8);
+			packet[19] = static_cast<uint8_t>(truth.DstAddr);
+		}
+		else
+		{
+			packet[0] = 0x60;
+			packet[4] = static_cast<uint8_t>((length - 40) >> 8);
+			packet[5] = static_cast<uint8_t>(length - 40);
+			packet[6] = truth.Protocol;
+			packet[7] = 64;
+			packet[23] = 1;
+			packet[24] = 0x20;
+			packet[25] = 0x01;
+			packet[39] = static_cast<uint8_t>(truth.DstAddr);
+		}
+
+		uint8_t* transport = packet + ipLength;
+
+		if (truth.Protocol == 6 || truth.Protocol == 17)
+		{
+			transport[0] = 0xC0;
+			transport[1] = static_cast<uint8_t>(random());
+			transport[2] = static_cast<uint8_t>(truth.DstPort >> 8);
+			transport[3] = static_cast<uint8_t>(truth.DstPort);
+		}
+
+		if (truth.Protocol == 6)
+		{
+			transport[12] = 0x50;
+			transport[13] = static_cast<uint8_t>((truth.Syn ? 0x02 : 0) | (truth.Ack ? 0x10 : 0));
+		}
+		else if (truth.Protocol == 17)
+		{
+			transport[4] = static_cast<uint8_t>((transportLength + truth.PayloadLength) >> 8);
+			transport[5] = static_cast<uint8_t>(transportLength + truth.PayloadLength);
+		}
+		else
+		{
+			transport[0] = 8;
+		}
+
+		WINDIVERT_ADDRESS address = {};
+		address.Direction = truth.Outbound ? WINDIVERT_DIRECTION_OUTBOUND : WINDIVERT_DIRECTION_INBOUND;
+
+		capture.Offsets.push_back(offset);
+		capture.Lengths.push_back(length);
+		capture.Addresses.push_back(address);
+		capture.Truths.push_back(truth);
+	}
+
+	struct Case
+	{
+		std::string Filter;
+		std::function<bool(const Truth&)> Expected;
+	};
+
+	std::vector<Case> FixedCases()
+	{
+		return
+		{
+			{
+				"true",
+				[](const Truth&) { return true; }
+			},
+			{
+				"tcp.DstPort == 80 or tcp.DstPort == 443",
+				[](const Truth& t) { return t.Protocol == 6 && (t.DstPort == 80 || t.DstPort == 443); }
+			},
+			{
+				"outbound and udp.DstPort == 53",
+				[](const Truth& t) { return t.Outbound && t.Protocol == 17 && t.DstPort == 53; }
+			},
+			{
+				"ip.DstAddr >= 10.0.0.0 and ip.DstAddr <= 10.255.255.255 and tcp.Syn and not tcp.Ack",
+				[](const Truth& t) { return t.Version == 4 && (t.DstAddr >> 24) == 10 && t.Protocol == 6 && t.Syn && !t.Ack; }
+			},
+			{
+				"ipv6 and (tcp? tcp.PayloadLength > 0: udp)",
+				[](const Truth& t) { return t.Version == 6 && (t.Protocol == 6 ? t.PayloadLength > 0 : t.Protocol == 17); }
+			},
+			{
+				"icmp or icmpv6 or (inbound and (tcp.DstPort == 22 or tcp.DstPort == 3389))",
+				[](const Truth& t) { return t.Protocol == 1 || t.Protocol == 58 || (!t.Outbound && t.Protocol == 6 && (t.DstPort == 22 || t.DstPort == 3389)); }
+			}
+		};
+	}
+
+	/// <summary>
+	/// A filter of the given number of clauses, like the port and address block lists these
+	/// filters are usually made of. Grouped filters list all the port clauses and then all the
+	/// address clauses. Mixed filters alternate between TCP and UDP ports, so that no two
+	/// neighbouring clauses test the same field.
+	/// </summary>
+	Case ClauseCase(uint32_t clauses, bool grouped)
+	{
+		std::vector<uint16_t> tcpPorts;
+		std::vector<uint16_t> udpPorts;
+		std::vector<uint32_t> dstAddrs;
+		std::string filter;
+
+		for (uint32_t i = 0; i < clauses; ++i)
+		{
+			const uint16_t port = i < 8 ? Ports[i] : static_cast<uint16_t>(10000 + i);
+			char clause[64];
+
+			if (grouped ? i < (clauses + 1) / 2 : i % 2 == 0)
+			{
+				tcpPorts.push_back(port);
+				std::snprintf(clause, sizeof(clause), "tcp.DstPort == %u", port);
+			}
+			else if (!grouped)
+			{
+				udpPorts.push_back(port);
+				std::snprintf(clause, sizeof(clause), "udp.DstPort == %u", port);
+			}
+			else
+			{
+				const uint32_t address = 0x0A000000 | (i * 7919 % 0xFFFFFF);
+				dstAddrs.push_back(address);
+				std::snprintf(clause, sizeof(clause), "ip.DstAddr == %u.%u.%u.%u", address >> 24, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+			}
+
+			filter += (i == 0 ? "" : " or ") + std::string(clause);
+		}
+
+		auto contains = [](const auto& values, uint32_t value) { return std::find(values.begin(), values.end(), value) != values.end(); };
+
+		return
+		{
+			filter,
+			[=](const Truth& t)
+			{
+				return (t.Protocol == 6 && contains(tcpPorts, t.DstPort)) || (t.Protocol == 17 && contains(udpPorts, t.DstPort)) || (t.Version == 4 && contains(dstAddrs, t.DstAddr));
+			}
+		};
+	}
+
+	std::string Abbreviate(const std::string& filter)
+	{
+		return filter.size() <= 60 ? filter : filter.substr(0, 50) + "... (" + std::to_string(filter.size()) + " chars)";
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t packets = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 65536;
+	const uint32_t rounds = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 50;
+
+	std::mt19937 random(1101);
+	Capture capture;
+
+	for (uint32_t i = 0; i < packets; ++i)
+	{
+		AddPacket(capture, random);
+	}
+
+	std::vector<const WINDIVERT_ADDRESS*> addresses;
+
+	for (const WINDIVERT_ADDRESS& address : capture.Addresses)
+	{
+		addresses.push_back(&address);
+	}
+
+	std::vector<uint8_t> results(packets);
+	int failures = 0;
+
+	std::printf("%u packets, %u rounds\n\n", packets, rounds);
+
+	std::vector<Case> cases = FixedCases();
+
+	for (uint32_t clauses : { 1u, 10u, 100u })
+	{
+		cases.push_back(ClauseCase(clauses, true));
+		cases.push_back(ClauseCase(clauses, false));
+	}
+
+	std::printf("%-64s %12s %8s %16s %16s %16s\n", "Filter", "Instructions", "Match", "Interpreter", "Specialized", "Vectorized");
+
+	for (const Case& test : cases)
+	{
+		Filter filter;
+		const char* error = nullptr;
+		uint32_t errorPosition = 0;
+
+		if (!filter.Compile(test.Filter.data(), test.Filter.size(), FilterLayer::Network, &error, &errorPosition))
+		{
+			std::printf("\"%s\" failed to compile: %s at %u\n", test.Filter.c_str(), error, errorPosition);
+			++failures;
+			continue;
+		}
+
+		double rates[3] = {};
+		uint32_t matches = 0;
+		uint32_t wrong = 0;
+
+		for (FilterBackend backend : { FilterBackend::Interpreter, FilterBackend::Specialized, FilterBackend::Vectorized })
+		{
+			filter.SetBackend(backend);
+
+			matches = filter.EvaluateBatch(capture.Buffer.data(), capture.Buffer.size(), capture.Offsets.data(), capture.Lengths.data(), addresses.data(), packets, results.data());
+
+			for (uint32_t i = 0; i < packets; ++i)
+			{
+				wrong += (results[i] != 0) != test.Expected(capture.Truths[i]) ? 1 : 0;
+			}
+
+			auto started = std::chrono::steady_clock::now();
+
+			for (uint32_t round = 0; round < rounds; ++round)
+			{
+				filter.EvaluateBatch(capture.Buffer.data(), capture.Buffer.size(), capture.Offsets.data(), capture.Lengths.data(), addresses.data(), packets, results.data());
+			}
+
+			rates[static_cast<int>(backend)] = rounds * static_cast<double>(packets) / Seconds(started) / 1e6;
+		}
+
+		std::printf("%-64s %12u %7.1f%% %10.1f Mpps %10.1f Mpps %10.1f Mpps%s\n", Abbreviate(test.Filter).c_str(), filter.InstructionCount(), 100.0 * matches / packets, rates[0], rates[1], rates[2], wrong == 0 ? "" : " WRONG");
+
+		if (wrong != 0)
+		{
+			std::printf("    %u results differ from what was expected\n", wrong);
+			++failures;
+		}
+	}
+
+	std::printf("\n%s\n", failures == 0 ? "PASSED" : "FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,284 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Conformance test for the native filter compiler. Runs every case in
+// tests/DivertTests/TestData/Tests.json, the suite ported from WinDivert, with every backend
+// against the packets in tests/DivertTests/Tests/TestData.cs, reading both files as they are so
+// that the cases can't drift apart. Each case is run on its own and in a batch. Also checks that malformed filters are rejected, and that
+// inbound and outbound are refused at the forward layer.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FilterConformanceTest.cpp ../../src/DivertNativeFilter.cpp ../../src/DivertNativeFilterAnalyzer.cpp ../../src/DivertNativeChecksum.cpp -o FilterConformanceTest
+//     ./FilterConformanceTest [Tests.json] [TestData.cs]
+
+#include "DivertNativeChecksum.hpp"
+#include "DivertNativeFilter.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	std::string ReadFile(const char* path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		return contents.str();
+	}
+
+	/// <summary>
+	/// Reads the string value of the next "key":"value" pair at or after position, advancing
+	/// position past it. Tests.json has no escapes, so none are handled.
+	/// </summary>
+	bool NextValue(const std::string& json, const std::string& key, size_t& position, std::string& value)
+	{
+		const std::string quoted = "\"" + key + "\"";
+		size_t found = json.find(quoted, position);
+
+		if (found == std::string::npos)
+		{
+			return false;
+		}
+
+		size_t start = json.find('"', json.find(':', found + quoted.size()) + 1);
+		size_t end = json.find('"', start + 1);
+
+		value = json.substr(start + 1, end - start - 1);
+		position = end + 1;
+		return true;
+	}
+
+	/// <summary>
+	/// Extracts "internal static readonly byte[] Name = new byte[] { 0x.., ... };" arrays.
+	/// </summary>
+	std::map<std::string, std::vector<uint8_t>> ReadPackets(const std::string& source)
+	{
+		std::map<std::string, std::vector<uint8_t>> packets;
+		const std::string marker = "internal static readonly byte[] ";
+		size_t position = 0;
+
+		while ((position = source.find(marker, position)) != std::string::npos)
+		{
+			position += marker.size();
+
+			const size_t nameEnd = source.find_first_of(" =", position);
+			const std::string name = source.substr(position, nameEnd - position);
+			const size_t open = source.find('{', nameEnd);
+			const size_t close = source.find('}', open);
+
+			std::vector<uint8_t> bytes;
+
+			for (size_t hex = source.find("0x", open); hex < close; hex = source.find("0x", hex + 2))
+			{
+				bytes.push_back(static_cast<uint8_t>(std::strtoul(source.c_str() + hex, nullptr, 16)));
+			}
+
+			if (!bytes.empty())
+			{
+				packets[name] = bytes;
+			}
+
+			position = close;
+		}
+
+		return packets;
+	}
+
+	const std::map<std::string, std::string> PacketNames =
+	{
+		{ "&pkt_echo_request", "EchoRequest" },
+		{ "&pkt_http_request", "HttpRequest" },
+		{ "&pkt_dns_request", "DnsRequest" },
+		{ "&pkt_ipv6_tcp_syn", "IPv6TCPSyn" },
+		{ "&pkt_ipv6_echo_reply", "IPv6EchoReply" },
+		{ "&pkt_ipv6_exthdrs_udp", "IPv6ExtraHeadersUdp" }
+	};
+
+	std::string Trim(const std::string& text)
+	{
+		const size_t start = text.find_first_not_of(" \t");
+		const size_t end = text.find_last_not_of(" \t");
+		return start == std::string::npos ? std::string() : text.substr(start, end - start + 1);
+	}
+
+	bool Compiles(const std::string& text, FilterLayer layer)
+	{
+		Filter filter;
+		return filter.Compile(text.data(), text.size(), layer, nullptr, nullptr);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char* testsPath = argc > 1 ? argv[1] : "../DivertTests/TestData/Tests.json";
+	const char* dataPath = argc > 2 ? argv[2] : "../DivertTests/Tests/TestData.cs";
+
+	const std::string json = ReadFile(testsPath);
+	std::map<std::string, std::vector<uint8_t>> packets = ReadPackets(ReadFile(dataPath));
+
+	if (json.empty() || packets.size() != PacketNames.size())
+	{
+		std::printf("Couldn't read %s and %s\n", testsPath, dataPath);
+		return 1;
+	}
+
+	// As the managed test runner does, give every packet correct checksums first.
+	for (auto& packet : packets)
+	{
+		CalculateChecksums(packet.second.data(), static_cast<uint32_t>(packet.second.size()), 0);
+	}
+
+	WINDIVERT_ADDRESS address = {};
+	address.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+	int passed = 0;
+	int failed = 0;
+	size_t position = 0;
+	std::string name;
+
+	while (NextValue(json, "TestName", position, name))
+	{
+		std::string text;
+		std::string data;
+		std::string match;
+
+		NextValue(json, "TestFilter", position, text);
+		NextValue(json, "TestData", position, data);
+		NextValue(json, "Match", position, match);
+
+		const std::vector<uint8_t>& packet = packets[PacketNames.at(Trim(data))];
+		const bool expected = Trim(match) == "TRUE";
+
+		Filter filter;
+		const char* error = nullptr;
+		uint32_t errorPosition = 0;
+
+		if (!filter.Compile(text.data(), text.size(), FilterLayer::Network, &error, &errorPosition))
+		{
+			std::printf("%s: \"%s\" failed to compile: %s at %u\n", name.c_str(), text.c_str(), error, errorPosition);
+			++failed;
+			continue;
+		}
+
+		bool correct = true;
+
+		// Batches repeat the packet across more than one block of the vectorized backend.
+		const uint32_t copies = 100;
+		std::vector<uint8_t> buffer;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> lengths;
+		std::vector<const WINDIVERT_ADDRESS*> addresses(copies, &address);
+		std::vector<uint8_t> results(copies);
+
+		for (uint32_t i = 0; i < copies; ++i)
+		{
+			offsets.push_back(static_cast<uint32_t>(buffer.size()));
+			lengths.push_back(static_cast<uint32_t>(packet.size()));
+			buffer.insert(buffer.end(), packet.begin(), packet.end());
+		}
+
+		for (FilterBackend backend : { FilterBackend::Interpreter, FilterBackend::Specialized, FilterBackend::Vectorized })
+		{
+			const char* backendName = backend == FilterBackend::Interpreter ? "interpreter" : backend == FilterBackend::Specialized ? "specialized" : "vectorized";
+			filter.SetBackend(backend);
+
+			if (filter.Evaluate(packet.data(), static_cast<uint32_t>(packet.size()), &address) != expected)
+			{
+				std::printf("%s: \"%s\" should%s match with the %s backend\n", name.c_str(), text.c_str(), expected ? "" : " not", backendName);
+				correct = false;
+			}
+
+			if (filter.EvaluateBatch(buffer.data(), buffer.size(), offsets.data(), lengths.data(), addresses.data(), copies, results.data()) != (expected ? copies : 0))
+			{
+				std::printf("%s: \"%s\" should%s match a batch with the %s backend\n", name.c_str(), text.c_str(), expected ? "" : " not", backendName);
+				correct = false;
+			}
+		}
+
+		if (!correct)
+		{
+			++failed;
+			continue;
+		}
+
+		++passed;
+	}
+
+	std::printf("Tests.json: %d passed, %d failed\n", passed, failed);
+
+	const char* invalid[] =
+	{
+		"",
+		"   ",
+		"tcp.DstPort ==",
+		"tcp.DstPort == 80 and",
+		"(tcp",
+		"tcp)",
+		"(tcp? true)",
+		"tcp.Bogus == 1",
+		"tcp.DstPort == 0x100000000",
+		"tcp.DstPort == 4294967296",
+		"ip.SrcAddr == 1.2.3.256",
+		"ipv6.SrcAddr == 1::2::3",
+		"ipv6.SrcAddr == 1:2:3:4:5:6:7:8:9",
+		"tcp.DstPort == 80 80",
+		"and tcp",
+		"tcp.DstPort => 80"
+	};
+
+	int rejected = 0;
+
+	for (const char* text : invalid)
+	{
+		if (Compiles(text, FilterLayer::Network))
+		{
+			std::printf("\"%s\" should not compile\n", text);
+			++failed;
+		}
+		else
+		{
+			++rejected;
+		}
+	}
+
+	std::printf("Malformed filters: %d of %d rejected\n", rejected, static_cast<int>(sizeof(invalid) / sizeof(invalid[0])));
+
+	if (Compiles("outbound and tcp", FilterLayer::NetworkForward) || !Compiles("ifIdx == 3 and tcp", FilterLayer::NetworkForward))
+	{
+		std::printf("Forward layer direction check is wrong\n");
+		++failed;
+	}
+
+	std::printf("\n%s\n", failed == 0 ? "PASSED" : "FAILED");
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Benchmark for the flow table with a million concurrent flows. Creates the flows, then runs a
+// stream of packets drawn uniformly from them in both directions, counting packets and bytes in
+// each flow's user slots, through the flow table and through a std::unordered_map doing the same,
+// and checks both end up with the same counts. Finally runs a stream where one packet in
+// sixteen starts a new flow and idle flows expire, so the table is replaced continuously while
+// it stays full.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FlowTableBenchmark.cpp ../../src/DivertConnectionTable.cpp ../../src/DivertNativeFlowTable.cpp -o FlowTableBenchmark
+//     ./FlowTableBenchmark [flows] [packets]
+
+#include "DivertNativeFlowTable.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	struct FlowKeyHasher
+	{
+		size_t operator()(const FlowKey& key) const
+		{
+			return static_cast<size_t>(key.Hash());
+		}
+	};
+
+	struct Counters
+	{
+		uint64_t Packets;
+
+		uint64_t Bytes;
+	};
+
+	/// <summary>
+	/// One packet of the stream, as a diversion would see it.
+	/// </summary>
+	struct Packet
+	{
+		uint32_t Flow;
+
+		uint16_t Length;
+
+		bool Outbound;
+	};
+
+	/// <summary>
+	/// A quarter of the flows are IPv6, a third of the rest are UDP.
+	/// </summary>
+	FlowKey MakeFlow(uint32_t i)
+	{
+		const uint8_t protocol = i % 3 == 0 ? UdpProtocol : TcpProtocol;
+		const uint16_t localPort = static_cast<uint16_t>(1024 + (i & 0x7FFF));
+		const uint16_t remotePort = static_cast<uint16_t>(i % 7 == 0 ? 53 : 443);
+
+		if (i % 4 == 0)
+		{
+			uint8_t local[16] = { 0x20, 0x01, 0x0d, 0xb8 };
+			uint8_t remote[16] = { 0x26, 0x06, 0x47, 0x00 };
+
+			std::memcpy(local + 12, &i, sizeof(i));
+			remote[15] = static_cast<uint8_t>(i % 199);
+
+			return FlowKey::FromIPv6(protocol, local, localPort, remote, remotePort);
+		}
+
+		return FlowKey::FromIPv4(protocol, 0x0A000000u | (i >> 15), localPort, 0xC0A80000u | (i % 251), remotePort);
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t flowCount = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 1000000;
+	const uint32_t packetCount = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 10000000;
+
+	int failures = 0;
+
+	std::vector<FlowKey> flows(flowCount);
+
+	for (uint32_t i = 0; i < flowCount; ++i)
+	{
+		flows[i] = MakeFlow(i);
+	}
+
+	std::mt19937 random(2024);
+	std::uniform_int_distribution<uint32_t> pickFlow(0, flowCount - 1);
+	std::uniform_int_distribution<uint32_t> pickLength(40, 1500);
+
+	std::vector<Packet> stream(packetCount);
+
+	for (Packet& packet : stream)
+	{
+		packet.Flow = pickFlow(random);
+		packet.Length = static_cast<uint16_t>(pickLength(random));
+		packet.Outbound = (random() & 1) != 0;
+	}
+
+	// A capacity with room to spare, as an application expecting a million flows would choose.
+	FlowTable table(flowCount + flowCount / 4, 2, 60000, 2000);
+
+	uint64_t now = 0;
+
+	auto started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < flowCount; ++i)
+	{
+		table.Track(flows[i], FlowTable::TcpSyn, true, now, nullptr);
+	}
+
+	const double createSeconds = Seconds(started);
+
+	// The clock advances a millisecond every thousand packets, so flows are reordered as they
+	// would be in a live capture.
+	started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < packetCount; ++i)
+	{
+		if (i % 1000 == 0)
+		{
+			++now;
+		}
+
+		const Packet& packet = stream[i];
+		const uint32_t flow = table.Track(flows[packet.Flow], 0, packet.Outbound, now, nullptr);
+		uint64_t* slots = table.UserSlots(flow);
+
+		slots[0] += 1;
+		slots[1] += packet.Length;
+	}
+
+	const double tableSeconds = Seconds(started);
+
+	std::unordered_map<FlowKey, Counters, FlowKeyHasher> map;
+	map.reserve(flowCount + flowCount / 4);
+
+	started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < flowCount; ++i)
+	{
+		map.emplace(flows[i], Counters());
+	}
+
+	const double mapCreateSeconds = Seconds(started);
+
+	started = std::chrono::steady_clock::now();
+
+	for (const Packet& packet : stream)
+	{
+		Counters& counters = map[flows[packet.Flow]];
+
+		counters.Packets += 1;
+		counters.Bytes += packet.Length;
+	}
+
+	const double mapSeconds = Seconds(started);
+
+	uint32_t mismatches = 0;
+
+	for (uint32_t i = 0; i < flowCount; ++i)
+	{
+		const uint32_t flow = table.Find(flows[i]);
+		const Counters& counters = map[flows[i]];
+
+		if (flow == FlowTable::InvalidFlow || table.UserSlots(flow)[0] != counters.Packets || table.UserSlots(flow)[1] != counters.Bytes)
+		{
+			++mismatches;
+		}
+	}
+
+	if (mismatches != 0 || table.Count() != flowCount)
+	{
+		std::printf("flow table disagrees with the map for %u flows\n", mismatches);
+		++failures;
+	}
+
+	// Churn: one packet in sixteen starts a new flow, with an idle timeout short enough that
+	// flows of the first pass expire and come back all the way through.
+	table.SetIdleTimeout(2000);
+	table.ResetStatistics();
+
+	uint32_t nextFlow = flowCount;
+	uint64_t created = 0;
+
+	started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < packetCount; ++i)
+	{
+		if (i % 1000 == 0)
+		{
+			++now;
+		}
+
+		const Packet& packet = stream[i];
+		const FlowKey key = (i & 15) == 0 ? MakeFlow(nextFlow++) : flows[packet.Flow];
+		bool isNew = false;
+		const uint32_t flow = table.Track(key, 0, packet.Outbound, now, &isNew);
+
+		table.UserSlots(flow)[0] += 1;
+		created += isNew ? 1 : 0;
+	}
+
+	const double churnSeconds = Seconds(started);
+
+	const FlowTableStatistics statistics = table.Statistics();
+
+	std::printf("Flows: %u, packets: %u\n", flowCount, packetCount);
+	std::printf("%22s %14s %12s\n", "", "packets/sec", "ns/packet");
+	std::printf("%22s %14.0f %12.1f\n", "create (table)", flowCount / createSeconds, createSeconds * 1e9 / flowCount);
+	std::printf("%22s %14.0f %12.1f\n", "create (map)", flowCount / mapCreateSeconds, mapCreateSeconds * 1e9 / flowCount);
+	std::printf("%22s %14.0f %12.1f\n", "track (table)", packetCount / tableSeconds, tableSeconds * 1e9 / packetCount);
+	std::printf("%22s %14.0f %12.1f\n", "track (map)", packetCount / mapSeconds, mapSeconds * 1e9 / packetCount);
+	std::printf("%22s %14.0f %12.1f\n", "track with churn", packetCount / churnSeconds, churnSeconds * 1e9 / packetCount);
+	std::printf("churn: %llu created, %llu expired, %llu evicted, %u live\n",
+		static_cast<unsigned long long>(statistics.Created), static_cast<unsigned long long>(statistics.Expired),
+		static_cast<unsigned long long>(statistics.Evicted), statistics.Count);
+
+	if (statistics.Created != created || created < (packetCount + 15) / 16 || statistics.Count > table.Capacity() || statistics.Lookups != packetCount)
+	{
+		std::printf("churn statistics don't add up\n");
+		++failures;
+	}
+
+	std::printf(failures == 0 ? "PASSED\n" : "FAILED\n");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the flow table. Checks that both directions of a flow share one entry, that user
+// slots start zeroed and stay with their flow, idle expiry, TCP teardown on FIN and RST, reuse of
+// a closed 5-tuple, eviction when full, and that the index agrees with a reference map through
+// heavy churn at full capacity.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FlowTableTest.cpp ../../src/DivertConnectionTable.cpp ../../src/DivertNativeFlowTable.cpp -o FlowTableTest
+//     ./FlowTableTest [operations]
+
+#include "DivertNativeFlowTable.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	int g_failures = 0;
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	struct Ended
+	{
+		uint32_t Flow;
+
+		FlowEnd Reason;
+
+		uint64_t FirstSlot;
+	};
+
+	std::vector<Ended> g_ended;
+
+	void RecordEnded(void* context, uint32_t flow, const FlowKey& key, uint64_t* userSlots, FlowEnd reason)
+	{
+		(void)context;
+		(void)key;
+
+		g_ended.push_back(Ended{ flow, reason, userSlots != nullptr ? userSlots[0] : 0 });
+	}
+
+	FlowKey MakeKey(uint8_t protocol, uint32_t local, uint16_t localPort, uint32_t remote, uint16_t remotePort)
+	{
+		return FlowKey::FromIPv4(protocol, local, localPort, remote, remotePort);
+	}
+
+	void TestDirectionsAndSlots()
+	{
+		FlowTable table(16, 2, 1000, 100);
+
+		const uint32_t local = 0x0100000Au;
+		const uint32_t remote = 0x08080808u;
+		const uint16_t localPort = 0x3930;
+		const uint16_t remotePort = 0x5000;
+
+		bool created = false;
+		const uint32_t flow = table.Track(FlowKey::FromPacket(4, TcpProtocol, true, &local, localPort, &remote, remotePort), FlowTable::TcpSyn, true, 0, &created);
+
+		Check(flow != FlowTable::InvalidFlow && created, "first packet creates the flow");
+		Check(table.UserSlots(flow)[0] == 0 && table.UserSlots(flow)[1] == 0, "user slots start zeroed");
+
+		table.UserSlots(flow)[1] = 42;
+
+		const uint32_t reply = table.Track(FlowKey::FromPacket(4, TcpProtocol, false, &remote, remotePort, &local, localPort), FlowTable::TcpSyn, false, 1, &created);
+
+		Check(reply == flow && !created, "the reply belongs to the same flow");
+		Check(table.UserSlots(reply)[1] == 42, "user slots stay with the flow");
+		Check(table.Count() == 1, "one flow for both directions");
+
+		const uint32_t udp = table.Track(MakeKey(UdpProtocol, local, localPort, remote, remotePort), 0, true, 2, &created);
+
+		Check(udp != flow && created, "the same ports over UDP are another flow");
+
+		const FlowTableStatistics statistics = table.Statistics();
+
+		Check(statistics.Lookups == 3 && statistics.Hits == 1 && statistics.Created == 2 && statistics.Count == 2, "statistics count lookups, hits and flows");
+	}
+
+	void TestIdleExpiry()
+	{
+		FlowTable table(16, 1, 1000, 100);
+		table.SetFlowEndedCallback(&RecordEnded, nullptr);
+		g_ended.clear();
+
+		const uint32_t first = table.Track(MakeKey(UdpProtocol, 1, 1, 2, 2), 0, true, 0, nullptr);
+		const uint32_t second = table.Track(MakeKey(UdpProtocol, 1, 1, 2, 3), 0, true, 500, nullptr);
+		const uint32_t generation = table.Generation(first);
+
+		table.UserSlots(first)[0] = 7;
+
+		Check(table.Expire(999, 0) == 0, "nothing expires early");
+
+		// Seeing the first flow again puts it behind the second.
+		table.Track(MakeKey(UdpProtocol, 1, 1, 2, 2), 0, false, 999, nullptr);
+
+		Check(table.Expire(1499, 0) == 0 && table.Expire(1500, 0) == 1, "the second flow expires a timeout after it was last seen");
+		Check(g_ended.size() == 1 && g_ended[0].Flow == second && g_ended[0].Reason == FlowEnd::Expired, "expiry is reported");
+		Check(!table.IsLive(second) && table.IsLive(first), "only the idle flow ends");
+
+		// Tracking expires flows along the way.
+		table.Track(MakeKey(UdpProtocol, 1, 1, 2, 4), 0, true, 5000, nullptr);
+
+		Check(!table.IsLive(first) || table.Generation(first) != generation, "track expires idle flows");
+		Check(g_ended.size() == 2 && g_ended[1].FirstSlot == 7, "the callback sees the user slots");
+		Check(table.Count() == 1, "only the new flow is left");
+	}
+
+	void TestTcpTeardown()
+	{
+		FlowTable table(16, 1, 60000, 100);
+		table.SetFlowEndedCallback(&RecordEnded, nullptr);
+		g_ended.clear();
+
+		const FlowKey key = MakeKey(TcpProtocol, 1, 1, 2, 2);
+
+		const uint32_t flow = table.Track(key, FlowTable::TcpSyn, true, 0, nullptr);
+		table.Track(key, FlowTable::TcpFin, true, 10, nullptr);
+
+		Check(!table.IsClosing(flow), "one FIN leaves the flow open");
+
+		table.Track(key, FlowTable::TcpFin, false, 20, nullptr);
+
+		Check(table.IsClosing(flow), "a FIN from both ends closes the flow");
+		Check(table.Track(key, 0, true, 30, nullptr) == flow, "the final ACK still finds the flow");
+		Check(table.Expire(129, 0) == 0 && table.Expire(130, 0) == 1, "closed flows last the closing timeout");
+		Check(g_ended.size() == 1 && g_ended[0].Reason == FlowEnd::Closed, "closing is reported");
+
+		// A new connection on the same 5-tuple before the old one is gone.
+		const uint32_t old = table.Track(key, FlowTable::TcpSyn, true, 200, nullptr);
+		table.Track(key, FlowTable::TcpFin, true, 210, nullptr);
+		table.Track(key, FlowTable::TcpFin, false, 211, nullptr);
+
+		const uint32_t oldGeneration = table.Generation(old);
+		bool created = false;
+		const uint32_t reused = table.Track(key, FlowTable::TcpSyn, true, 212, &created);
+
+		Check(created && (reused != old || table.Generation(reused) != oldGeneration), "a SYN on a closed 5-tuple starts a new flow");
+		Check(!table.IsClosing(reused), "the new flow is open");
+
+		// A RST keeps the flow for the packet that carried it, and ends it on the next call.
+		g_ended.clear();
+
+		const uint32_t reset = table.Track(key, FlowTable::TcpRst, false, 300, &created);
+		const uint32_t resetGeneration = table.Generation(reset);
+
+		Check(reset == reused && !created && table.IsLive(reset) && table.IsClosing(reset), "the RST still gets its flow");
+
+		table.Track(MakeKey(TcpProtocol, 1, 1, 2, 9), FlowTable::TcpSyn, true, 301, nullptr);
+
+		Check(table.Generation(reset) != resetGeneration && g_ended.size() == 1 && g_ended[0].Reason == FlowEnd::Reset, "the reset flow ends on the next call");
+		Check(table.Track(key, FlowTable::TcpRst, false, 302, &created) == FlowTable::InvalidFlow && !created, "a stray RST creates nothing");
+		Check(table.Find(key) == FlowTable::InvalidFlow, "the reset flow is gone");
+		Check(table.Statistics().Reset == 1 && table.Statistics().Closed == 2, "teardown statistics");
+	}
+
+	void TestEviction()
+	{
+		FlowTable table(4, 0, 60000, 100);
+		table.SetFlowEndedCallback(&RecordEnded, nullptr);
+		g_ended.clear();
+
+		uint32_t flows[4];
+
+		for (uint16_t i = 0; i < 4; ++i)
+		{
+			flows[i] = table.Track(MakeKey(UdpProtocol, 1, i, 2, 2), 0, true, i, nullptr);
+		}
+
+		// Seen again, so no longer the oldest.
+		table.Track(MakeKey(UdpProtocol, 1, 0, 2, 2), 0, true, 10, nullptr);
+
+		bool created = false;
+		table.Track(MakeKey(UdpProtocol, 1, 9, 2, 2), 0, true, 11, &created);
+
+		Check(created && table.Count() == 4, "a full table still takes new flows");
+		Check(g_ended.size() == 1 && g_ended[0].Flow == flows[1] && g_ended[0].Reason == FlowEnd::Evicted, "the least recently seen flow is evicted");
+		Check(table.UserSlots(flows[0]) == nullptr, "no user slots when none were asked for");
+
+		table.Clear();
+
+		Check(table.Count() == 0 && g_ended.size() == 5 && g_ended[4].Reason == FlowEnd::Removed, "clear removes every flow");
+	}
+
+	struct FlowKeyHasher
+	{
+		size_t operator()(const FlowKey& key) const
+		{
+			return static_cast<size_t>(key.Hash());
+		}
+	};
+
+	/// <summary>
+	/// Drives the table at full capacity with a random mix of packets for a small key space,
+	/// removals and expiry, and checks every lookup against a reference map. The key space is
+	/// larger than the table, so flows are evicted and displaced all the time.
+	/// </summary>
+	void TestChurn(uint32_t operations)
+	{
+		const uint32_t capacity = 1000;
+
+		FlowTable table(capacity, 1, 500, 10);
+
+		std::unordered_map<FlowKey, uint64_t, FlowKeyHasher> expected;
+		std::mt19937 random(7);
+		std::uniform_int_distribution<uint32_t> pickKey(0, capacity * 3 / 2);
+		std::uniform_int_distribution<uint32_t> pickOperation(0, 99);
+
+		struct Tracker
+		{
+			std::unordered_map<FlowKey, uint64_t, FlowKeyHasher>* Expected;
+
+			static void Ended(void* context, uint32_t flow, const FlowKey& key, uint64_t* userSlots, FlowEnd reason)
+			{
+				(void)flow;
+				(void)reason;
+
+				auto* expected = static_cast<Tracker*>(context)->Expected;
+				auto it = expected->find(key);
+
+				if (it == expected->end() || it->second != userSlots[0])
+				{
+					Check(false, "ended flow matches the reference");
+				}
+
+				expected->erase(key);
+			}
+		};
+
+		Tracker tracker = { &expected };
+		table.SetFlowEndedCallback(&Tracker::Ended, &tracker);
+
+		uint64_t now = 0;
+		uint32_t mismatches = 0;
+
+		for (uint32_t i = 0; i < operations; ++i)
+		{
+			const FlowKey key = MakeKey(UdpProtocol, 0x0100000Au, static_cast<uint16_t>(pickKey(random)), 0x08080808u, 53);
+			const uint32_t operation = pickOperation(random);
+
+			if (operation < 2)
+			{
+				table.Remove(key);
+			}
+			else if (operation < 3)
+			{
+				now += 20;
+				table.Expire(now, 0);
+			}
+			else
+			{
+				bool created = false;
+				const uint32_t flow = table.Track(key, 0, true, now, &created);
+				auto it = expected.find(key);
+
+				if (created != (it == expected.end()))
+				{
+					++mismatches;
+				}
+
+				if (created)
+				{
+					table.UserSlots(flow)[0] = i;
+					expected[key] = i;
+				}
+				else if (table.UserSlots(flow)[0] != it->second)
+				{
+					++mismatches;
+				}
+			}
+
+			if (table.Count() != expected.size() || table.Count() > capacity)
+			{
+				++mismatches;
+			}
+		}
+
+		for (const auto& entry : expected)
+		{
+			const uint32_t flow = table.Find(entry.first);
+
+			if (flow == FlowTable::InvalidFlow || table.UserSlots(flow)[0] != entry.second)
+			{
+				++mismatches;
+			}
+		}
+
+		Check(mismatches == 0, "the table agrees with the reference through churn");
+
+		const FlowTableStatistics statistics = table.Statistics();
+
+		std::printf("churn: %u operations, %llu created, %llu expired, %llu evicted, %u live\n", operations,
+			static_cast<unsigned long long>(statistics.Created), static_cast<unsigned long long>(statistics.Expired),
+			static_cast<unsigned long long>(statistics.Evicted), statistics.Count);
+
+		table.Clear();
+
+		Check(expected.empty() && table.Count() == 0, "clear ends every flow");
+		Check(table.Find(MakeKey(UdpProtocol, 0x0100000Au, 1, 0x08080808u, 53)) == FlowTable::InvalidFlow, "lookups in an emptied table stop");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t operations = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000000;
+
+	TestDirectionsAndSlots();
+	TestIdleExpiry();
+	TestTcpTeardown();
+	TestEviction();
+	TestChurn(operations);
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures);
+
+	return g_failures == 0 ? 0 : 1;
+}
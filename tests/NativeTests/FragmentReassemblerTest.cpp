@@ -0,0 +1,568 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for IPv4 and IPv6 fragment reassembly. Checks that fragments arriving in any order come
+// back as one ordinary packet that parses like any other: IPv4 length, fragment fields and
+// checksum rewritten, the IPv6 fragment header taken out of the chain. Then the hardening:
+// identical duplicates are ignored, overlaps drop the whole datagram and keep it dropped until
+// its timeout, tiny first fragments, misaligned and oversized fragments and too many pieces are
+// refused, and a flood of incomplete datagrams never takes more than the budget or stops a
+// legitimate datagram from getting through. Finishes with randomly cut, shuffled and repeated
+// datagrams, and reports the cost per fragment.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src FragmentReassemblerTest.cpp ../../src/DivertNativeChecksum.cpp ../../src/DivertNativeFragmentReassembler.cpp -o FragmentReassemblerTest
+//     ./FragmentReassemblerTest [datagrams]
+
+#include "DivertNativeFragmentReassembler.hpp"
+#include "DivertNativeChecksum.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	const uint8_t HopByHopHeader = 0;
+
+	const uint8_t FragmentHeader = 44;
+
+	typedef std::vector<uint8_t> Bytes;
+
+	int g_failures = 0;
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	void WriteUInt16(uint8_t* data, uint32_t value)
+	{
+		data[0] = static_cast<uint8_t>(value >> 8);
+		data[1] = static_cast<uint8_t>(value);
+	}
+
+	uint16_t ReadUInt16(const uint8_t* data)
+	{
+		return static_cast<uint16_t>((data[0] << 8) | data[1]);
+	}
+
+	/// <summary>
+	/// A transport payload of the given length, with a plausible header for the protocol.
+	/// </summary>
+	Bytes MakePayload(uint8_t protocol, uint32_t length, uint32_t seed)
+	{
+		Bytes payload(length);
+
+		for (uint32_t i = 0; i < length; ++i)
+		{
+			payload[i] = static_cast<uint8_t>(i * 7 + seed);
+		}
+
+		if (protocol == TcpProtocol && length >= 20)
+		{
+			payload[12] = 0x50;
+		}
+
+		return payload;
+	}
+
+	/// <summary>
+	/// One IPv4 fragment of a payload.
+	/// </summary>
+	Bytes Fragment4(uint8_t protocol, uint16_t id, const Bytes& payload, uint32_t offset, uint32_t length, bool more, uint32_t source = 0x0A000001)
+	{
+		Bytes packet(20 + length);
+
+		packet[0] = 0x45;
+		WriteUInt16(&packet[2], 20 + length);
+		WriteUInt16(&packet[4], id);
+		WriteUInt16(&packet[6], (more ? 0x2000 : 0) | (offset / 8));
+		packet[8] = 64;
+		packet[9] = protocol;
+		packet[12] = static_cast<uint8_t>(source >> 24);
+		packet[13] = static_cast<uint8_t>(source >> 16);
+		packet[14] = static_cast<uint8_t>(source >> 8);
+		packet[15] = static_cast<uint8_t>(source);
+		packet[16] = 10;
+		packet[19] = 2;
+
+		const uint16_t checksum = FoldChecksum(SumBytes(packet.data(), 20));
+		std::memcpy(&packet[10], &checksum, sizeof(checksum));
+
+		std::copy(payload.begin() + offset, payload.begin() + offset + length, packet.begin() + 20);
+		return packet;
+	}
+
+	/// <summary>
+	/// One IPv6 fragment of a payload, with a hop-by-hop options header in front of the fragment
+	/// header.
+	/// </summary>
+	Bytes Fragment6(uint8_t protocol, uint32_t id, const Bytes& payload, uint32_t offset, uint32_t length, bool more)
+	{
+		Bytes packet(40 + 8 + 8 + length);
+
+		packet[0] = 0x60;
+		WriteUInt16(&packet[4], 16 + length);
+		packet[6] = HopByHopHeader;
+		packet[7] = 64;
+		packet[8] = 0xFE;
+		packet[9] = 0x80;
+		packet[23] = 1;
+		packet[24] = 0xFE;
+		packet[25] = 0x80;
+		packet[39] = 2;
+
+		// Hop-by-hop options: PadN filling the six bytes.
+		packet[40] = FragmentHeader;
+		packet[41] = 0;
+		packet[42] = 1;
+		packet[43] = 4;
+
+		packet[48] = protocol;
+		WriteUInt16(&packet[50], offset | (more ? 1 : 0));
+		packet[52] = static_cast<uint8_t>(id >> 24);
+		packet[53] = static_cast<uint8_t>(id >> 16);
+		packet[54] = static_cast<uint8_t>(id >> 8);
+		packet[55] = static_cast<uint8_t>(id);
+
+		std::copy(payload.begin() + offset, payload.begin() + offset + length, packet.begin() + 56);
+		return packet;
+	}
+
+	FragmentResult Add(FragmentReassembler& reassembler, const Bytes& packet, Bytes& output, uint64_t now = 1)
+	{
+		uint32_t outputLength = 0;
+		output.resize(FragmentReassembler::MaximumPacketLength);
+
+		const FragmentResult result = reassembler.Add(packet.data(), static_cast<uint32_t>(packet.size()), output.data(), &outputLength, now);
+
+		output.resize(outputLength);
+		return result;
+	}
+
+	/// <summary>
+	/// Whether output is an unfragmented IPv4 packet carrying exactly the payload.
+	/// </summary>
+	bool IsReassembled4(const Bytes& output, uint8_t protocol, const Bytes& payload)
+	{
+		return output.size() == 20 + payload.size() &&
+			ReadUInt16(&output[2]) == output.size() &&
+			(ReadUInt16(&output[6]) & 0x3FFF) == 0 &&
+			output[9] == protocol &&
+			FoldChecksum(SumBytes(output.data(), 20)) == 0 &&
+			std::equal(payload.begin(), payload.end(), output.begin() + 20);
+	}
+
+	/// <summary>
+	/// Whether output is an IPv6 packet with the hop-by-hop header, no fragment header, and
+	/// exactly the payload.
+	/// </summary>
+	bool IsReassembled6(const Bytes& output, uint8_t protocol, const Bytes& payload)
+	{
+		return output.size() == 48 + payload.size() &&
+			ReadUInt16(&output[4]) == output.size() - 40 &&
+			output[6] == HopByHopHeader &&
+			output[40] == protocol &&
+			std::equal(payload.begin(), payload.end(), output.begin() + 48);
+	}
+
+	void TestIPv4()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 30000);
+		const Bytes payload = MakePayload(UdpProtocol, 4000, 1);
+		Bytes output;
+
+		Check(Add(reassembler, Fragment4(UdpProtocol, 1, payload, 0, 4000, false), output) == FragmentResult::NotFragment, "whole packet is not a fragment");
+
+		// Last first, then the middle, then the first.
+		Check(Add(reassembler, Fragment4(UdpProtocol, 7, payload, 2960, 1040, false), output) == FragmentResult::Buffered, "last fragment buffered");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 7, payload, 1480, 1480, true), output) == FragmentResult::Buffered, "middle fragment buffered");
+		Check(reassembler.Statistics().Datagrams == 1 && reassembler.Statistics().MemoryUsed != 0, "one datagram held");
+
+		Check(Add(reassembler, Fragment4(UdpProtocol, 7, payload, 0, 1480, true), output) == FragmentResult::Complete, "first fragment completes");
+		Check(IsReassembled4(output, UdpProtocol, payload), "IPv4 packet rebuilt with length, flags and checksum");
+
+		const FragmentStatistics statistics = reassembler.Statistics();
+		Check(statistics.Fragments == 3 && statistics.Reassembled == 1, "counted");
+		Check(statistics.Datagrams == 0 && statistics.MemoryUsed == 0, "everything released");
+
+		// Same identification from another source is another datagram.
+		Add(reassembler, Fragment4(UdpProtocol, 8, payload, 0, 1480, true, 0x0A000001), output);
+		Add(reassembler, Fragment4(UdpProtocol, 8, payload, 0, 1480, true, 0x0A000003), output);
+		Check(reassembler.Statistics().Datagrams == 2, "keyed by source");
+	}
+
+	void TestIPv6()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 30000);
+		const Bytes payload = MakePayload(TcpProtocol, 3000, 2);
+		Bytes output;
+
+		Check(Add(reassembler, Fragment6(TcpProtocol, 0x12345678, payload, 1232, 1232, true), output) == FragmentResult::Buffered, "IPv6 middle fragment");
+		Check(Add(reassembler, Fragment6(TcpProtocol, 0x12345678, payload, 2464, 536, false), output) == FragmentResult::Buffered, "IPv6 last fragment");
+		Check(Add(reassembler, Fragment6(TcpProtocol, 0x12345678, payload, 0, 1232, true), output) == FragmentResult::Complete, "IPv6 first fragment completes");
+		Check(IsReassembled6(output, TcpProtocol, payload), "IPv6 packet rebuilt without the fragment header");
+
+		// A fragment header on a packet that was never fragmented.
+		const Bytes small = MakePayload(TcpProtocol, 100, 3);
+		Check(Add(reassembler, Fragment6(TcpProtocol, 0x12345678, small, 0, 100, false), output) == FragmentResult::Complete, "atomic fragment passes straight through");
+		Check(IsReassembled6(output, TcpProtocol, small), "atomic fragment loses its fragment header");
+		Check(reassembler.Statistics().Datagrams == 0, "atomic fragment holds nothing");
+	}
+
+	void TestOverlap()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 1000);
+		const Bytes payload = MakePayload(UdpProtocol, 2000, 4);
+		Bytes output;
+
+		Add(reassembler, Fragment4(UdpProtocol, 9, payload, 0, 1000, true), output);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 9, payload, 0, 1000, true), output) == FragmentResult::Buffered, "identical duplicate ignored");
+		Check(reassembler.Statistics().Duplicates == 1, "duplicate counted");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 9, payload, 1000, 1000, false), output) == FragmentResult::Complete && IsReassembled4(output, UdpProtocol, payload), "duplicate doesn't disturb reassembly");
+
+		// Same place, different bytes.
+		Bytes forged = payload;
+		forged[500] ^= 0xFF;
+		Add(reassembler, Fragment4(UdpProtocol, 10, payload, 0, 1000, true), output, 10);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 10, forged, 0, 1000, true), output, 10) == FragmentResult::Dropped, "conflicting duplicate drops the datagram");
+
+		// Partly overlapping.
+		Add(reassembler, Fragment4(UdpProtocol, 11, payload, 0, 1000, true), output, 10);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 11, payload, 992, 1008, false), output, 10) == FragmentResult::Dropped, "overlap drops the datagram");
+		Check(reassembler.Statistics().Overlapping == 2 && reassembler.Statistics().MemoryUsed == 0, "overlaps counted, memory released");
+
+		// The rest of a dropped datagram is dropped too, until the timeout.
+		Check(Add(reassembler, Fragment4(UdpProtocol, 11, payload, 1000, 1000, false), output, 20) == FragmentResult::Dropped, "dropped datagram stays dropped");
+		Check(reassembler.Statistics().Discarded == 1, "discarded counted");
+
+		Check(reassembler.Expire(1010, 0) == 2 && reassembler.Statistics().Expired == 0, "dropped datagrams leave at the timeout, not counted as expired");
+		Add(reassembler, Fragment4(UdpProtocol, 11, payload, 0, 1000, true), output, 1020);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 11, payload, 1000, 1000, false), output, 1020) == FragmentResult::Complete, "identification reusable after the timeout");
+
+		// A last fragment that disagrees with data already held past it.
+		Add(reassembler, Fragment4(UdpProtocol, 12, payload, 1000, 1000, true), output, 1020);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 12, payload, 504, 496, false), output, 1020) == FragmentResult::Dropped, "end before held data drops the datagram");
+	}
+
+	void TestMalformed()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 30000);
+		const Bytes payload = MakePayload(TcpProtocol, 70000, 5);
+		Bytes output;
+
+		Check(Add(reassembler, Fragment4(TcpProtocol, 20, payload, 0, 16, true), output) == FragmentResult::Dropped, "first fragment without the whole TCP header");
+		Check(Add(reassembler, Fragment4(TcpProtocol, 21, payload, 8, 64, true), output) == FragmentResult::Dropped, "TCP fragment at offset eight");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 22, payload, 0, 4, true), output) == FragmentResult::Dropped, "first fragment without the whole UDP header");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 23, payload, 0, 100, true), output) == FragmentResult::Dropped, "misaligned fragment");
+		Check(reassembler.Statistics().Malformed == 4, "malformed counted");
+
+		Bytes truncated = Fragment4(UdpProtocol, 24, payload, 0, 800, true);
+		truncated.resize(400);
+		Check(Add(reassembler, truncated, output) == FragmentResult::Dropped && reassembler.Statistics().Malformed == 5, "truncated fragment");
+
+		Check(Add(reassembler, Fragment4(UdpProtocol, 25, payload, 65520, 64, false), output) == FragmentResult::Dropped, "fragment past the largest packet");
+		Check(reassembler.Statistics().Oversized == 1, "oversized counted");
+
+		for (uint32_t i = 1; i <= FragmentReassembler::MaximumFragments; ++i)
+		{
+			Add(reassembler, Fragment4(UdpProtocol, 26, payload, i * 8, 8, true), output);
+		}
+
+		Check(reassembler.Statistics().TooManyFragments == 0, "MaximumFragments pieces allowed");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 26, payload, 1000, 8, true), output) == FragmentResult::Dropped, "one piece more");
+		Check(reassembler.Statistics().TooManyFragments == 1 && reassembler.Statistics().MemoryUsed == 0, "too many fragments counted, memory released");
+	}
+
+	/// <summary>
+	/// An IPv4 fragment with its header padded out to 60 bytes with no-op options.
+	/// </summary>
+	Bytes WithOptions4(Bytes packet)
+	{
+		packet.insert(packet.begin() + 20, 40, 1);
+		packet[0] = 0x4F;
+		WriteUInt16(&packet[2], static_cast<uint32_t>(packet.size()));
+		packet[10] = 0;
+		packet[11] = 0;
+
+		const uint16_t checksum = FoldChecksum(SumBytes(packet.data(), 60));
+		std::memcpy(&packet[10], &checksum, sizeof(checksum));
+		return packet;
+	}
+
+	/// <summary>
+	/// An IPv6 fragment with its hop-by-hop header padded out to 208 bytes, so that the headers
+	/// kept in front of the payload are 248 bytes long.
+	/// </summary>
+	Bytes WithLongHopByHop6(Bytes packet)
+	{
+		packet.insert(packet.begin() + 48, 200, 0);
+		WriteUInt16(&packet[4], static_cast<uint32_t>(packet.size()) - 40);
+		packet[41] = 25;
+		packet[43] = 204;
+		return packet;
+	}
+
+	void TestHeaderLengths()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 30000);
+		const Bytes payload = MakePayload(UdpProtocol, 65512, 9);
+		const uint32_t piece = 8192;
+		Bytes output;
+
+		// Later fragments with short headers fill all the room they allow, then a first fragment
+		// with longer headers would make the packet too long for its length field.
+		for (uint32_t offset = piece; offset < payload.size(); offset += piece)
+		{
+			const uint32_t length = std::min<uint32_t>(piece, static_cast<uint32_t>(payload.size()) - offset);
+			Check(Add(reassembler, Fragment4(UdpProtocol, 40, payload, offset, length, offset + length < payload.size()), output) == FragmentResult::Buffered, "IPv4 fragments with short headers buffered");
+		}
+
+		Check(Add(reassembler, WithOptions4(Fragment4(UdpProtocol, 40, payload, 0, piece, true)), output) == FragmentResult::Dropped && output.empty(), "IPv4 first fragment with longer headers dropped");
+		Check(reassembler.Statistics().Oversized == 1 && reassembler.Statistics().MemoryUsed == 0, "IPv4 mismatched headers counted as oversized");
+
+		// The other way round, the first fragment bounds the rest.
+		Check(Add(reassembler, WithOptions4(Fragment4(UdpProtocol, 41, payload, 0, piece, true)), output) == FragmentResult::Buffered, "IPv4 first fragment with options buffered");
+		Check(Add(reassembler, Fragment4(UdpProtocol, 41, payload, 65504, 8, false), output) == FragmentResult::Dropped, "IPv4 last fragment past the first one's room dropped");
+		Check(reassembler.Statistics().Oversized == 2, "IPv4 late oversize counted");
+
+		const Bytes v6Payload = MakePayload(UdpProtocol, 65520, 10);
+
+		for (uint32_t offset = piece; offset < v6Payload.size(); offset += piece)
+		{
+			const uint32_t length = std::min<uint32_t>(piece, static_cast<uint32_t>(v6Payload.size()) - offset);
+			Check(Add(reassembler, Fragment6(UdpProtocol, 42, v6Payload, offset, length, offset + length < v6Payload.size()), output) == FragmentResult::Buffered, "IPv6 fragments with short headers buffered");
+		}
+
+		Check(Add(reassembler, WithLongHopByHop6(Fragment6(UdpProtocol, 42, v6Payload, 0, piece, true)), output) == FragmentResult::Dropped && output.empty(), "IPv6 first fragment with longer headers dropped");
+		Check(reassembler.Statistics().Oversized == 3 && reassembler.Statistics().MemoryUsed == 0, "IPv6 mismatched headers counted as oversized");
+
+		// Mismatched but within bounds: the first fragment's headers are the ones kept.
+		const Bytes small = MakePayload(UdpProtocol, 2000, 11);
+
+		Add(reassembler, Fragment4(UdpProtocol, 43, small, 1000, 1000, false), output);
+		Check(Add(reassembler, WithOptions4(Fragment4(UdpProtocol, 43, small, 0, 1000, true)), output) == FragmentResult::Complete, "IPv4 mismatched headers within bounds complete");
+		Check(output.size() == 60 + small.size() && ReadUInt16(&output[2]) == output.size() && std::equal(small.begin(), small.end(), output.begin() + 60), "IPv4 packet rebuilt behind the first fragment's headers");
+	}
+
+	void TestTimeout()
+	{
+		FragmentReassembler reassembler(16, 1 << 20, 1000);
+		const Bytes payload = MakePayload(UdpProtocol, 2000, 6);
+		Bytes output;
+
+		Add(reassembler, Fragment4(UdpProtocol, 30, payload, 0, 1000, true), output, 100);
+		Add(reassembler, Fragment4(UdpProtocol, 31, payload, 0, 1000, true), output, 600);
+
+		// Adding anything expires the datagrams whose time is up.
+		Add(reassembler, Fragment4(UdpProtocol, 32, payload, 0, 1000, true), output, 1100);
+		Check(reassembler.Statistics().Expired == 1 && reassembler.Statistics().Datagrams == 2, "timed out datagram expired on add");
+
+		Check(Add(reassembler, Fragment4(UdpProtocol, 30, payload, 1000, 1000, false), output, 1100) == FragmentResult::Buffered, "late fragment starts over");
+		Check(reassembler.Expire(5000, 0) == 3 && reassembler.Statistics().MemoryUsed == 0, "expire all");
+	}
+
+	void TestFlood()
+	{
+		// Room for 16 datagrams and 64 KB of fragments.
+		FragmentReassembler reassembler(16, 1 << 16, 30000);
+		const Bytes payload = MakePayload(UdpProtocol, 3000, 7);
+		Bytes output;
+
+		for (uint32_t i = 0; i < 10000; ++i)
+		{
+			// First fragments only, never completed.
+			Add(reassembler, Fragment4(UdpProtocol, static_cast<uint16_t>(i), payload, 0, 1480, true, 0x0B000000 + i), output);
+			Check(reassembler.Statistics().Datagrams <= 16 && reassembler.Statistics().MemoryUsed <= reassembler.MemoryBudget(), "flood stays within bounds");
+		}
+
+		Check(reassembler.Statistics().Evicted == 10000 - 16, "oldest evicted");
+
+		// A legitimate datagram still gets through in the middle of the flood.
+		Add(reassembler, Fragment4(UdpProtocol, 1, payload, 1480, 1520, false), output);
+		Add(reassembler, Fragment4(UdpProtocol, 99, payload, 0, 1480, true, 0x0C000000), output);
+		Check(Add(reassembler, Fragment4(UdpProtocol, 1, payload, 0, 1480, true), output) == FragmentResult::Complete && IsReassembled4(output, UdpProtocol, payload), "legitimate datagram reassembled under flood");
+
+		// A datagram larger than the whole budget can't push everything else out forever.
+		FragmentReassembler small(16, 4096, 30000);
+		const Bytes large = MakePayload(UdpProtocol, 16000, 8);
+		uint32_t offset = 0;
+		FragmentResult result = FragmentResult::Buffered;
+
+		while (result == FragmentResult::Buffered)
+		{
+			result = Add(small, Fragment4(UdpProtocol, 40, large, offset, 1480, true), output);
+			offset += 1480;
+		}
+
+		Check(result == FragmentResult::Dropped && small.Statistics().MemoryUsed == 0, "datagram larger than the budget dropped");
+	}
+
+	void TestRandom(uint32_t datagrams)
+	{
+		std::mt19937 random(1234);
+		FragmentReassembler reassembler(datagrams, 64ull << 20, 30000);
+
+		std::vector<Bytes> payloads;
+		std::vector<Bytes> packets;
+		std::vector<uint32_t> owners;
+
+		for (uint32_t d = 0; d < datagrams; ++d)
+		{
+			const bool ipv6 = d % 2 == 1;
+			const uint32_t length = 16 + random() % 20000;
+			payloads.push_back(MakePayload(UdpProtocol, length, d));
+
+			uint32_t offset = 0;
+
+			while (offset < length)
+			{
+				uint32_t piece = 8 * (1 + random() % 200);
+				bool more = offset + piece < length;
+
+				if (!more)
+				{
+					piece = length - offset;
+				}
+
+				// Always at least two pieces, a single one isn't a fragment.
+				if (offset == 0 && !more)
+				{
+					piece = (length - 1) / 8 * 8;
+					more = true;
+				}
+
+				packets.push_back(ipv6 ? Fragment6(UdpProtocol, d, payloads[d], offset, piece, more) : Fragment4(UdpProtocol, static_cast<uint16_t>(d), payloads[d], offset, piece, more));
+				owners.push_back(d);
+
+				// Some pieces arrive twice.
+				if (random() % 10 == 0)
+				{
+					packets.push_back(packets.back());
+					owners.push_back(d);
+				}
+
+				offset += piece;
+			}
+		}
+
+		std::vector<uint32_t> order(packets.size());
+
+		for (uint32_t i = 0; i < order.size(); ++i)
+		{
+			order[i] = i;
+		}
+
+		std::shuffle(order.begin(), order.end(), random);
+
+		std::vector<uint32_t> completed(datagrams);
+		Bytes output;
+		bool exact = true;
+
+		for (uint32_t i : order)
+		{
+			if (Add(reassembler, packets[i], output) == FragmentResult::Complete)
+			{
+				const uint32_t d = owners[i];
+				++completed[d];
+				exact &= d % 2 == 1 ? IsReassembled6(output, UdpProtocol, payloads[d]) : IsReassembled4(output, UdpProtocol, payloads[d]);
+			}
+		}
+
+		Check(exact, "random datagrams reassembled exactly");
+		Check(std::all_of(completed.begin(), completed.end(), [](uint32_t count) { return count >= 1; }), "every random datagram completed");
+		Check(reassembler.Statistics().Overlapping == 0 && reassembler.Statistics().Evicted == 0, "no false overlaps");
+	}
+
+	void Benchmark()
+	{
+		const uint32_t datagrams = 500000;
+		FragmentReassembler reassembler(1024, 16 << 20, 30000);
+		const Bytes payload = MakePayload(UdpProtocol, 2000, 9);
+		std::vector<Bytes> packets;
+
+		// Datagrams of two fragments, two datagrams interleaved at a time.
+		for (uint32_t d = 0; d < 1024; d += 2)
+		{
+			packets.push_back(Fragment4(UdpProtocol, static_cast<uint16_t>(d), payload, 0, 1480, true));
+			packets.push_back(Fragment4(UdpProtocol, static_cast<uint16_t>(d + 1), payload, 0, 1480, true));
+			packets.push_back(Fragment4(UdpProtocol, static_cast<uint16_t>(d + 1), payload, 1480, 520, false));
+			packets.push_back(Fragment4(UdpProtocol, static_cast<uint16_t>(d), payload, 1480, 520, false));
+		}
+
+		Bytes output(FragmentReassembler::MaximumPacketLength);
+		uint32_t outputLength = 0;
+		uint64_t bytes = 0;
+
+		const auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t i = 0; i < datagrams * 2; ++i)
+		{
+			const Bytes& packet = packets[i % packets.size()];
+
+			if (reassembler.Add(packet.data(), static_cast<uint32_t>(packet.size()), output.data(), &outputLength, 1) == FragmentResult::Complete)
+			{
+				bytes += outputLength;
+			}
+		}
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		Check(bytes == static_cast<uint64_t>(datagrams) * 2020, "benchmark reassembled everything");
+		std::printf("%u fragments: %.1f ns per fragment, %.2f GB/s reassembled\n", datagrams * 2, seconds * 1e9 / (datagrams * 2), bytes / seconds / 1e9);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t datagrams = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000;
+
+	TestIPv4();
+	TestIPv6();
+	TestOverlap();
+	TestMalformed();
+	TestHeaderLengths();
+	TestTimeout();
+	TestFlood();
+	TestRandom(datagrams);
+	Benchmark();
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures);
+	return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,335 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for incremental checksum updates, as done by the header setters when
+// Diversion::IncrementalChecksums is on. Builds random IPv4 and IPv6 packets of every protocol
+// with valid checksums, then makes random rewrites of the fields a NAT would touch (addresses,
+// ports, TTL, sequence numbers, flags and so on). Each rewrite is folded into the checksums the
+// way the setters do it, and the packet must come out byte for byte identical to a copy that had
+// its checksums recalculated from scratch. Also reports what a rewrite costs either way.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src IncrementalChecksumTest.cpp ../../src/DivertNativeChecksum.cpp -o IncrementalChecksumTest
+//     ./IncrementalChecksumTest [packets] [rewritesPerPacket]
+
+#include "DivertNativeChecksum.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t IcmpProtocol = 1;
+	const uint8_t TcpProtocol = 6;
+	const uint8_t UdpProtocol = 17;
+	const uint8_t Icmpv6Protocol = 58;
+
+	/// <summary>
+	/// A packet under test, and where its checksums are.
+	/// </summary>
+	struct TestPacket
+	{
+		std::vector<uint8_t> Bytes;
+		int Version;
+		uint8_t Protocol;
+		uint32_t TransportOffset;
+
+		uint16_t* IpChecksum()
+		{
+			return Version == 4 ? reinterpret_cast<uint16_t*>(&Bytes[10]) : nullptr;
+		}
+
+		uint16_t* TransportChecksum()
+		{
+			const uint32_t field = Protocol == TcpProtocol ? 16 : Protocol == UdpProtocol ? 6 : 2;
+			return reinterpret_cast<uint16_t*>(&Bytes[TransportOffset + field]);
+		}
+	};
+
+	/// <summary>
+	/// A field that can be rewritten: where it is, how wide, and which bits of its first two bytes
+	/// may change without changing how the packet parses. Offsets are relative to the IP header
+	/// for network fields and to the transport header for transport fields.
+	/// </summary>
+	struct Field
+	{
+		bool Network;
+		uint32_t Offset;
+		uint32_t Length;
+		uint8_t Mask[2];
+	};
+
+	const Field IPv4Fields[] =
+	{
+		{ true, 0, 2, { 0x00, 0xFF } },     // Version and header length, then TOS.
+		{ true, 4, 2, { 0xFF, 0xFF } },     // Id.
+		{ true, 6, 2, { 0x40, 0x00 } },     // Flags and fragment offset, only DF.
+		{ true, 8, 2, { 0xFF, 0x00 } },     // TTL, then protocol.
+		{ true, 12, 4, { 0xFF, 0xFF } },    // Source address.
+		{ true, 16, 4, { 0xFF, 0xFF } }     // Destination address.
+	};
+
+	const Field IPv6Fields[] =
+	{
+		{ true, 8, 16, { 0xFF, 0xFF } },    // Source address.
+		{ true, 24, 16, { 0xFF, 0xFF } }    // Destination address.
+	};
+
+	const Field TcpFields[] =
+	{
+		{ false, 0, 2, { 0xFF, 0xFF } },    // Source port.
+		{ false, 2, 2, { 0xFF, 0xFF } },    // Destination port.
+		{ false, 4, 4, { 0xFF, 0xFF } },    // Sequence number.
+		{ false, 8, 4, { 0xFF, 0xFF } },    // Acknowledgment number.
+		{ false, 12, 2, { 0x0F, 0xFF } },   // Header length and reserved bits, then flags.
+		{ false, 14, 2, { 0xFF, 0xFF } },   // Window size.
+		{ false, 18, 2, { 0xFF, 0xFF } }    // Urgent pointer.
+	};
+
+	const Field UdpFields[] =
+	{
+		{ false, 0, 2, { 0xFF, 0xFF } },    // Source port.
+		{ false, 2, 2, { 0xFF, 0xFF } }     // Destination port.
+	};
+
+	const Field IcmpFields[] =
+	{
+		{ false, 0, 2, { 0xFF, 0xFF } },    // Type and code.
+		{ false, 4, 4, { 0xFF, 0xFF } }     // Body.
+	};
+
+	TestPacket MakePacket(std::mt19937& random)
+	{
+		static const uint8_t protocols[] = { IcmpProtocol, TcpProtocol, UdpProtocol, Icmpv6Protocol, TcpProtocol, UdpProtocol };
+
+		TestPacket packet;
+		const uint32_t kind = random() % 6;
+		packet.Version = kind < 3 ? 4 : 6;
+		packet.Protocol = protocols[kind];
+
+		const uint32_t ipHeaderLength = packet.Version == 4 ? (5 + random() % 11) * 4 : 40;
+		const uint32_t transportHeaderLength = packet.Protocol == TcpProtocol ? (5 + random() % 11) * 4 : 8;
+		const uint32_t totalLength = ipHeaderLength + transportHeaderLength + random() % 1400;
+
+		packet.TransportOffset = ipHeaderLength;
+		packet.Bytes.resize(totalLength);
+
+		for (uint8_t& byte : packet.Bytes)
+		{
+			byte = static_cast<uint8_t>(random());
+		}
+
+		uint8_t* bytes = packet.Bytes.data();
+
+		if (packet.Version == 4)
+		{
+			bytes[0] = static_cast<uint8_t>(0x40 | (ipHeaderLength / 4));
+			bytes[2] = static_cast<uint8_t>(totalLength >> 8);
+			bytes[3] = static_cast<uint8_t>(totalLength);
+			bytes[6] = 0x40;
+			bytes[7] = 0;
+			bytes[9] = packet.Protocol;
+		}
+		else
+		{
+			bytes[0] = 0x60;
+			bytes[4] = static_cast<uint8_t>((totalLength - 40) >> 8);
+			bytes[5] = static_cast<uint8_t>(totalLength - 40);
+			bytes[6] = packet.Protocol;
+		}
+
+		if (packet.Protocol == TcpProtocol)
+		{
+			bytes[ipHeaderLength + 12] = static_cast<uint8_t>((transportHeaderLength / 4) << 4);
+		}
+
+		CalculateChecksums(bytes, totalLength, 0);
+		return packet;
+	}
+
+	/// <summary>
+	/// Folds a change to a field into the checksums, as the header setters do: a change to the
+	/// IPv4 header updates the header checksum, a change to an address also updates the transport
+	/// checksum through the pseudo header, and a change to the transport header updates the
+	/// transport checksum. ICMP has no pseudo header.
+	/// </summary>
+	void FieldChanged(TestPacket& packet, const Field& field, const uint8_t* before, const uint8_t* after)
+	{
+		const bool udp = packet.Protocol == UdpProtocol;
+
+		if (!field.Network)
+		{
+			UpdateChecksum(packet.TransportChecksum(), before, after, field.Length, udp);
+			return;
+		}
+
+		if (packet.Version == 4)
+		{
+			UpdateChecksum(packet.IpChecksum(), before, after, field.Length, false);
+		}
+
+		const bool address = field.Offset >= (packet.Version == 4 ? 12u : 8u);
+
+		if (address && packet.Protocol != IcmpProtocol)
+		{
+			UpdateChecksum(packet.TransportChecksum(), before, after, field.Length, udp);
+		}
+	}
+
+	/// <summary>
+	/// Rewrites a field with random bytes, and folds the change into the checksums.
+	/// </summary>
+	void Rewrite(TestPacket& packet, const Field& field, std::mt19937& random)
+	{
+		uint8_t* bytes = packet.Bytes.data() + (field.Network ? 0 : packet.TransportOffset) + field.Offset;
+
+		uint8_t before[16];
+		std::memcpy(before, bytes, field.Length);
+
+		for (uint32_t i = 0; i < field.Length; ++i)
+		{
+			const uint8_t mask = i < 2 ? field.Mask[i] : 0xFF;
+			bytes[i] = static_cast<uint8_t>((random() & mask) | (before[i] & ~mask));
+		}
+
+		FieldChanged(packet, field, before, bytes);
+	}
+
+	const Field& PickField(const TestPacket& packet, std::mt19937& random)
+	{
+		const bool network = random() % 2 == 0;
+
+		if (network)
+		{
+			return packet.Version == 4 ? IPv4Fields[random() % 6] : IPv6Fields[random() % 2];
+		}
+
+		switch (packet.Protocol)
+		{
+			case TcpProtocol:
+				return TcpFields[random() % 7];
+			case UdpProtocol:
+				return UdpFields[random() % 2];
+			default:
+				return IcmpFields[random() % 2];
+		}
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t packets = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 20000;
+	const uint32_t rewritesPerPacket = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 8;
+
+	std::mt19937 random(1624);
+
+	uint32_t mismatches = 0;
+	uint32_t rewrites = 0;
+
+	for (uint32_t i = 0; i < packets; ++i)
+	{
+		TestPacket packet = MakePacket(random);
+
+		for (uint32_t j = 0; j < rewritesPerPacket; ++j)
+		{
+			Rewrite(packet, PickField(packet, random), random);
+			++rewrites;
+
+			std::vector<uint8_t> recalculated = packet.Bytes;
+			CalculateChecksums(recalculated.data(), static_cast<uint32_t>(recalculated.size()), 0);
+
+			if (recalculated != packet.Bytes)
+			{
+				++mismatches;
+			}
+		}
+	}
+
+	std::printf("%u rewrites of %u random packets, %u differ from full recalculation\n", rewrites, packets, mismatches);
+
+	// The typical NAT rewrite: a new source address and port on a full sized TCP packet.
+	std::vector<TestPacket> nat;
+
+	while (nat.size() < 1024)
+	{
+		TestPacket packet = MakePacket(random);
+
+		if (packet.Version == 4 && packet.Protocol == TcpProtocol)
+		{
+			nat.push_back(packet);
+		}
+	}
+
+	const uint32_t iterations = 2000000;
+	const Field& address = IPv4Fields[4];
+	const Field& port = TcpFields[0];
+
+	auto started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < iterations; ++i)
+	{
+		TestPacket& packet = nat[i % nat.size()];
+		uint8_t* sourceAddress = &packet.Bytes[12];
+		uint8_t* sourcePort = &packet.Bytes[packet.TransportOffset];
+
+		uint8_t before[4];
+		std::memcpy(before, sourceAddress, sizeof(before));
+		std::memcpy(sourceAddress, &i, sizeof(i));
+		FieldChanged(packet, address, before, sourceAddress);
+
+		std::memcpy(before, sourcePort, sizeof(uint16_t));
+		std::memcpy(sourcePort, &i, sizeof(uint16_t));
+		FieldChanged(packet, port, before, sourcePort);
+	}
+
+	const double incrementalSeconds = Seconds(started);
+
+	started = std::chrono::steady_clock::now();
+
+	for (uint32_t i = 0; i < iterations; ++i)
+	{
+		TestPacket& packet = nat[i % nat.size()];
+		std::memcpy(&packet.Bytes[12], &i, sizeof(i));
+		std::memcpy(&packet.Bytes[packet.TransportOffset], &i, sizeof(uint16_t));
+		CalculateChecksums(packet.Bytes.data(), static_cast<uint32_t>(packet.Bytes.size()), 0);
+	}
+
+	const double fullSeconds = Seconds(started);
+
+	std::printf("IPv4/TCP address and port rewrite: incremental %.0f ns, full recalculation %.0f ns\n", incrementalSeconds * 1e9 / iterations, fullSeconds * 1e9 / iterations);
+
+	std::printf("\n%s\n", mismatches == 0 ? "PASSED" : "FAILED");
+	return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the packet buffer pool. Checks buffer sizes and alignment, falling back to large
+// buffers when the small ones run out, reference counting and generations, that the pool
+// outlives its owner while a buffer is still in use, and that threads leasing, writing, sharing
+// and returning buffers as fast as they can never get a buffer someone else still holds. Reports
+// the cost of a lease and return next to allocating a buffer.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src PacketBufferPoolTest.cpp ../../src/DivertNativePacketBufferPool.cpp -o PacketBufferPoolTest
+//     ./PacketBufferPoolTest [operationsPerThread] [threads]
+
+#include "DivertNativePacketBufferPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint32_t InvalidBuffer = PacketBufferPool::InvalidBuffer;
+
+	std::atomic<int> g_failures(0);
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	void TestLeasing()
+	{
+		PacketBufferPool* pool = new PacketBufferPool(2, 1);
+
+		const uint32_t first = pool->Lease(1500);
+		Check(first != InvalidBuffer && pool->Capacity(first) == PacketBufferPool::SmallBufferSize, "small lease");
+		Check(reinterpret_cast<uintptr_t>(pool->Data(first)) % 64 == 0, "small buffer on a cache line");
+		Check(pool->References(first) == 1 && pool->Length(first) == 0 && pool->Generation(first) != 0, "fresh lease");
+
+		const uint32_t large = pool->Lease(9000);
+		Check(large != InvalidBuffer && pool->Capacity(large) == PacketBufferPool::LargeBufferSize, "large lease");
+		Check(reinterpret_cast<uintptr_t>(pool->Data(large)) % 64 == 0, "large buffer on a cache line");
+
+		// The whole large buffer is writable.
+		std::memset(pool->Data(large), 0xAB, PacketBufferPool::LargeBufferSize);
+
+		Check(pool->Lease(PacketBufferPool::LargeBufferSize + 1) == InvalidBuffer, "longer than any buffer");
+		Check(pool->Lease(9000) == InvalidBuffer && pool->Statistics().Exhausted == 1, "large buffers exhausted");
+
+		const uint32_t second = pool->Lease(64);
+		Check(second != InvalidBuffer && second != first, "second small lease");
+		Check(pool->Data(second) >= pool->Data(first) + PacketBufferPool::SmallBufferSize || pool->Data(first) >= pool->Data(second) + PacketBufferPool::SmallBufferSize, "buffers don't overlap");
+		Check(pool->Lease(64) == InvalidBuffer, "all exhausted");
+
+		// A large buffer stands in for a small one.
+		Check(pool->Return(large), "large returned");
+		const uint32_t promoted = pool->Lease(64);
+		Check(promoted == large && pool->Statistics().Promoted == 1, "small lease promoted to large");
+		pool->Return(promoted);
+
+		// References and generations.
+		const uint32_t generation = pool->Generation(first);
+		pool->SetLength(first, 1500);
+		pool->Retain(first);
+		Check(!pool->Return(first) && pool->IsLeased(first, generation), "still held after one return");
+		Check(pool->Return(first) && !pool->IsLeased(first, generation), "returned with the last reference");
+		Check(pool->Statistics().SmallAvailable == 1, "back in the pool");
+
+		const uint32_t again = pool->Lease(100);
+		Check(again == first && pool->Generation(again) != generation && pool->Length(again) == 0, "reused with a new generation");
+		Check(!pool->IsLeased(again, generation) && pool->IsLeased(again, pool->Generation(again)), "stale lease told apart");
+		Check(!pool->IsLeased(1000, 1), "unknown buffer");
+
+		// The owner lets go while a buffer is still in use: the pool stays until it's returned.
+		pool->AddReference();
+		pool->Release();
+		pool->Data(again)[0] = 1;
+		pool->Return(again);
+		pool->Return(second);
+
+		const PacketBufferPoolStatistics statistics = pool->Statistics();
+		Check(statistics.Leased == 5 && statistics.SmallAvailable == 2 && statistics.LargeAvailable == 1, "counted");
+
+		pool->Release();
+	}
+
+	void TestEmpty()
+	{
+		PacketBufferPool* pool = new PacketBufferPool(0, 0);
+		Check(pool->Lease(1) == InvalidBuffer, "empty pool");
+		pool->Release();
+	}
+
+	void TestConcurrent(uint32_t operations, uint32_t threads)
+	{
+		const uint32_t buffers = threads * 2;
+		PacketBufferPool* pool = new PacketBufferPool(buffers, threads);
+
+		// Who owns each buffer. A buffer leased by two threads at once shows up here.
+		std::vector<std::atomic<uint32_t>> owners(buffers + threads);
+		std::vector<std::thread> workers;
+
+		for (auto& owner : owners)
+		{
+			owner.store(0);
+		}
+
+		for (uint32_t t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&, t]()
+			{
+				const uint32_t self = t + 1;
+				uint32_t held[4];
+
+				for (uint32_t i = 0; i < operations; ++i)
+				{
+					const uint32_t count = 1 + i % 4;
+					uint32_t leased = 0;
+
+					for (uint32_t j = 0; j < count; ++j)
+					{
+						const uint32_t buffer = pool->Lease(j == 3 ? 4000 : 1500);
+
+						if (buffer == InvalidBuffer)
+						{
+							continue;
+						}
+
+						uint32_t expected = 0;
+						Check(owners[buffer].compare_exchange_strong(expected, self), "buffer leased twice");
+
+						std::memset(pool->Data(buffer), static_cast<int>(self), 64);
+						pool->SetLength(buffer, self);
+
+						// Every other buffer is shared for a moment, as an overlapped operation would.
+						if (j % 2 == 1)
+						{
+							pool->Retain(buffer);
+						}
+
+						held[leased++] = buffer;
+					}
+
+					for (uint32_t j = 0; j < leased; ++j)
+					{
+						const uint32_t buffer = held[j];
+						const uint8_t* data = pool->Data(buffer);
+
+						Check(data[0] == self && data[63] == self && pool->Length(buffer) == self, "buffer written over while held");
+
+						if (pool->References(buffer) == 2)
+						{
+							Check(!pool->Return(buffer), "shared buffer kept");
+						}
+
+						owners[buffer].store(0);
+						Check(pool->Return(buffer), "buffer returned");
+					}
+				}
+			});
+		}
+
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+
+		const PacketBufferPoolStatistics statistics = pool->Statistics();
+		Check(statistics.SmallAvailable == buffers && statistics.LargeAvailable == threads, "every buffer back after the threads are done");
+		std::printf("%u threads: %llu leases, %llu promoted, %llu exhausted\n", threads, static_cast<unsigned long long>(statistics.Leased), static_cast<unsigned long long>(statistics.Promoted), static_cast<unsigned long long>(statistics.Exhausted));
+
+		pool->Release();
+	}
+
+	void Benchmark()
+	{
+		const uint32_t iterations = 10000000;
+		PacketBufferPool* pool = new PacketBufferPool(1024, 16);
+		uint64_t sum = 0;
+
+		auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			const uint32_t buffer = pool->Lease(1500);
+			pool->Data(buffer)[0] = static_cast<uint8_t>(i);
+			sum += pool->Data(buffer)[0];
+			pool->Return(buffer);
+		}
+
+		const double poolSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		started = std::chrono::steady_clock::now();
+
+		for (uint32_t i = 0; i < iterations; ++i)
+		{
+			uint8_t* buffer = new uint8_t[PacketBufferPool::SmallBufferSize];
+			buffer[0] = static_cast<uint8_t>(i);
+			sum += buffer[0];
+			delete[] buffer;
+		}
+
+		const double allocatorSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		std::printf("lease and return: %.1f ns, new and delete: %.1f ns (%llu)\n", poolSeconds * 1e9 / iterations, allocatorSeconds * 1e9 / iterations, static_cast<unsigned long long>(sum));
+
+		pool->Release();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t operations = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 200000;
+	const uint32_t threads = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 4;
+
+	TestLeasing();
+	TestEmpty();
+	TestConcurrent(operations, threads);
+	Benchmark();
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures.load());
+	return g_failures == 0 ? 0 : 1;
+}
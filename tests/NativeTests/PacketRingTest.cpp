@@ -0,0 +1,503 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test and benchmark for the packet ring. Checks ordering, each overflow policy, closing and
+// timeouts, that producers and consumers hammering a ring lose and duplicate nothing, and that
+// dropped descriptors find their way back to a buffer pool. Then has one receive thread feed 1 to
+// 16 consumers, through the ring and through a queue behind a mutex, and reports packets per
+// second for each.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src PacketRingTest.cpp ../../src/DivertNativePacketRing.cpp ../../src/DivertNativePacketBufferPool.cpp -o PacketRingTest
+//     ./PacketRingTest [packetsPerRun] [maximumConsumers]
+
+#include "DivertNativePacketRing.hpp"
+#include "DivertNativePacketBufferPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint32_t Infinite = PacketRing::Infinite;
+
+	std::atomic<int> g_failures(0);
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	PacketDescriptor Describe(uint32_t buffer)
+	{
+		PacketDescriptor descriptor = PacketDescriptor();
+
+		descriptor.Buffer = buffer;
+		descriptor.Length = buffer % 1500;
+		descriptor.Timestamp = static_cast<uint64_t>(buffer) << 20;
+		descriptor.Address.IfIdx = buffer * 3;
+		descriptor.Address.SubIfIdx = buffer * 5;
+		descriptor.Address.Direction = static_cast<uint8_t>(buffer & 1);
+
+		return descriptor;
+	}
+
+	bool Intact(const PacketDescriptor& descriptor)
+	{
+		const PacketDescriptor expected = Describe(descriptor.Buffer);
+
+		return descriptor.Length == expected.Length && descriptor.Timestamp == expected.Timestamp && descriptor.Address.IfIdx == expected.Address.IfIdx && descriptor.Address.SubIfIdx == expected.Address.SubIfIdx && descriptor.Address.Direction == expected.Address.Direction;
+	}
+
+	struct DropLog
+	{
+		std::vector<uint32_t> Buffers;
+	};
+
+	void LogDrop(void* context, const PacketDescriptor& descriptor)
+	{
+		static_cast<DropLog*>(context)->Buffers.push_back(descriptor.Buffer);
+	}
+
+	void TestOrdering()
+	{
+		PacketRing ring(5, PacketRingMode::SingleProducerSingleConsumer, RingOverflow::Block, nullptr, nullptr);
+		PacketDescriptor descriptor;
+
+		Check(ring.Capacity() == 8, "capacity rounded up to a power of two");
+		Check(PacketRing(1, PacketRingMode::SingleProducerSingleConsumer, RingOverflow::Block, nullptr, nullptr).Capacity() == 2, "at least two slots");
+		Check(!ring.TryPop(descriptor) && !ring.Pop(descriptor, 0), "empty");
+
+		// Several laps, so every slot is reused.
+		for (uint32_t lap = 0; lap < 5; ++lap)
+		{
+			for (uint32_t i = 0; i < 8; ++i)
+			{
+				Check(ring.Push(Describe(lap * 8 + i)) == RingPush::Pushed, "pushed");
+			}
+
+			Check(ring.Count() == 8 && !ring.TryPush(Describe(99)), "full");
+
+			for (uint32_t i = 0; i < 8; ++i)
+			{
+				Check(ring.TryPop(descriptor) && descriptor.Buffer == lap * 8 + i && Intact(descriptor), "popped in order");
+			}
+		}
+
+		const PacketRingStatistics statistics = ring.Statistics();
+		Check(statistics.Pushed == 40 && statistics.Popped == 40 && statistics.Count == 0, "counted");
+	}
+
+	void TestDropNewest()
+	{
+		DropLog log;
+		PacketRing ring(4, PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::DropNewest, LogDrop, &log);
+		PacketDescriptor descriptor;
+
+		for (uint32_t i = 0; i < 6; ++i)
+		{
+			Check(ring.Push(Describe(i)) == (i < 4 ? RingPush::Pushed : RingPush::Dropped), "newest dropped when full");
+		}
+
+		Check(log.Buffers.size() == 2 && log.Buffers[0] == 4 && log.Buffers[1] == 5, "dropped descriptors handed to the callback");
+		Check(ring.TryPop(descriptor) && descriptor.Buffer == 0, "oldest kept");
+		Check(ring.Statistics().DroppedNewest == 2, "drops counted");
+	}
+
+	void TestDropOldest(PacketRingMode mode)
+	{
+		DropLog log;
+		PacketRing ring(4, mode, RingOverflow::DropOldest, LogDrop, &log);
+		PacketDescriptor descriptor;
+
+		for (uint32_t i = 0; i < 7; ++i)
+		{
+			Check(ring.Push(Describe(i)) == RingPush::Pushed, "always pushed");
+		}
+
+		Check(log.Buffers.size() == 3 && log.Buffers[0] == 0 && log.Buffers[2] == 2, "oldest handed to the callback");
+
+		for (uint32_t i = 3; i < 7; ++i)
+		{
+			Check(ring.TryPop(descriptor) && descriptor.Buffer == i && Intact(descriptor), "newest kept in order");
+		}
+
+		const PacketRingStatistics statistics = ring.Statistics();
+		Check(statistics.Pushed == 7 && statistics.Popped == 4 && statistics.DroppedOldest == 3, "counted");
+	}
+
+	void TestClosing()
+	{
+		PacketRing ring(4, PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::Block, nullptr, nullptr);
+		PacketDescriptor descriptor;
+
+		auto started = std::chrono::steady_clock::now();
+		Check(!ring.Pop(descriptor, 50), "timed out");
+		Check(std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(45), "waited out the timeout");
+
+		// A consumer asleep on an empty ring, and a producer asleep on a full one, are both woken
+		// by the other end.
+		std::thread consumer([&]()
+		{
+			PacketDescriptor popped;
+			Check(ring.Pop(popped, Infinite) && popped.Buffer == 7, "woken by a push");
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		ring.Push(Describe(7));
+		consumer.join();
+
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			ring.Push(Describe(i));
+		}
+
+		std::thread producer([&]()
+		{
+			Check(ring.Push(Describe(4)) == RingPush::Pushed, "woken by a pop");
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		Check(ring.Pop(descriptor, Infinite) && descriptor.Buffer == 0, "popped for the producer");
+		producer.join();
+
+		Check(ring.Statistics().ProducerWaits == 1 && ring.Statistics().ConsumerWaits >= 2, "waits counted");
+
+		// Closing wakes a producer waiting for room, leaves what's in the ring to be popped,
+		// then wakes consumers waiting for more.
+		std::thread blocked([&]()
+		{
+			Check(ring.Push(Describe(5)) == RingPush::Closed, "waiting producer told the ring closed");
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		ring.Close();
+		blocked.join();
+
+		Check(ring.IsClosed() && ring.Push(Describe(6)) == RingPush::Closed && !ring.TryPush(Describe(6)), "closed");
+
+		for (uint32_t i = 1; i < 5; ++i)
+		{
+			Check(ring.Pop(descriptor, Infinite) && descriptor.Buffer == i, "drained after closing");
+		}
+
+		Check(!ring.Pop(descriptor, Infinite), "closed and empty");
+	}
+
+	void TestPool()
+	{
+		PacketBufferPool* pool = new PacketBufferPool(8, 0);
+
+		{
+			PacketRing ring(2, PacketRingMode::SingleProducerSingleConsumer, RingOverflow::DropOldest, PacketRing::ReturnToPool, pool);
+
+			for (uint32_t i = 0; i < 5; ++i)
+			{
+				ring.Push(Describe(pool->Lease(1500)));
+			}
+
+			Check(pool->Statistics().SmallAvailable == 6, "displaced buffers returned");
+		}
+
+		Check(pool->Statistics().SmallAvailable == 8, "buffers left in the ring returned when it's destroyed");
+		pool->Release();
+	}
+
+	/// <summary>
+	/// Producers push their share of a range of numbers, consumers pop until the ring is closed
+	/// and tick off what they get. Every number must turn up exactly once, or be accounted for by
+	/// a drop.
+	/// </summary>
+	void TestConcurrent(PacketRingMode mode, RingOverflow overflow, uint32_t producers, uint32_t consumers, uint32_t packets)
+	{
+		std::vector<std::atomic<uint8_t>> seen(packets);
+		std::atomic<uint64_t> dropped(0);
+
+		for (auto& count : seen)
+		{
+			count.store(0);
+		}
+
+		struct Context
+		{
+			std::vector<std::atomic<uint8_t>>* Seen;
+
+			std::atomic<uint64_t>* Dropped;
+		} context = { &seen, &dropped };
+
+		PacketRing ring(64, mode, overflow, [](void* context, const PacketDescriptor& descriptor)
+		{
+			Context* c = static_cast<Context*>(context);
+			(*c->Seen)[descriptor.Buffer].fetch_add(1);
+			c->Dropped->fetch_add(1);
+		}, &context);
+
+		std::vector<std::thread> threads;
+
+		for (uint32_t c = 0; c < consumers; ++c)
+		{
+			threads.emplace_back([&]()
+			{
+				PacketDescriptor descriptor;
+				uint32_t previous = 0;
+				bool first = true;
+
+				while (ring.Pop(descriptor, Infinite))
+				{
+					Check(Intact(descriptor), "descriptor torn");
+					seen[descriptor.Buffer].fetch_add(1);
+
+					// With one producer, a single consumer sees its packets in order.
+					if (producers == 1 && consumers == 1)
+					{
+						Check(first || descriptor.Buffer > previous, "out of order");
+						previous = descriptor.Buffer;
+						first = false;
+					}
+				}
+			});
+		}
+
+		std::vector<std::thread> feeders;
+
+		for (uint32_t p = 0; p < producers; ++p)
+		{
+			feeders.emplace_back([&, p]()
+			{
+				for (uint32_t i = p; i < packets; i += producers)
+				{
+					const RingPush result = ring.Push(Describe(i));
+					Check(result == RingPush::Pushed || (result == RingPush::Dropped && overflow == RingOverflow::DropNewest), "push failed");
+				}
+			});
+		}
+
+		for (auto& feeder : feeders)
+		{
+			feeder.join();
+		}
+
+		ring.Close();
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		uint32_t missing = 0;
+		uint32_t duplicated = 0;
+
+		for (auto& count : seen)
+		{
+			missing += count.load() == 0 ? 1 : 0;
+			duplicated += count.load() > 1 ? 1 : 0;
+		}
+
+		const PacketRingStatistics statistics = ring.Statistics();
+
+		Check(missing == 0 && duplicated == 0, "every packet popped or dropped exactly once");
+		Check(statistics.Pushed + statistics.DroppedNewest == packets && statistics.Popped + dropped.load() == packets, "counts add up");
+
+		if (overflow == RingOverflow::Block)
+		{
+			Check(dropped.load() == 0, "nothing dropped when blocking");
+		}
+
+		std::printf("%s %u:%u %-11s popped %llu, dropped %llu, producer waits %llu, consumer waits %llu\n", mode == PacketRingMode::SingleProducerSingleConsumer ? "spsc" : "mpmc", producers, consumers, overflow == RingOverflow::Block ? "block" : (overflow == RingOverflow::DropNewest ? "drop-newest" : "drop-oldest"), static_cast<unsigned long long>(statistics.Popped), static_cast<unsigned long long>(dropped.load()), static_cast<unsigned long long>(statistics.ProducerWaits), static_cast<unsigned long long>(statistics.ConsumerWaits));
+	}
+
+	/// <summary>
+	/// The hand-off the ring replaces: a queue behind a mutex, with a condition variable to wait on.
+	/// </summary>
+	class LockedQueue
+	{
+
+	public:
+
+		explicit LockedQueue(size_t capacity) : m_capacity(capacity)
+		{
+
+		}
+
+		void Push(const PacketDescriptor& descriptor)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notFull.wait(lock, [this]() { return m_queue.size() < m_capacity; });
+			m_queue.push_back(descriptor);
+			lock.unlock();
+			m_notEmpty.notify_one();
+		}
+
+		bool Pop(PacketDescriptor& descriptor)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this]() { return !m_queue.empty() || m_closed; });
+
+			if (m_queue.empty())
+			{
+				return false;
+			}
+
+			descriptor = m_queue.front();
+			m_queue.pop_front();
+			lock.unlock();
+			m_notFull.notify_one();
+
+			return true;
+		}
+
+		void Close()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			m_notEmpty.notify_all();
+		}
+
+	private:
+
+		std::mutex m_mutex;
+
+		std::condition_variable m_notFull;
+
+		std::condition_variable m_notEmpty;
+
+		std::deque<PacketDescriptor> m_queue;
+
+		size_t m_capacity;
+
+		bool m_closed = false;
+	};
+
+	/// <summary>
+	/// One thread stands in for the receive loop and pushes as fast as it can, consumers pop and
+	/// touch each descriptor. Returns packets per second.
+	/// </summary>
+	template<typename Push, typename Pop, typename Close>
+	double Run(uint32_t consumers, uint32_t packets, Push push, Pop pop, Close close)
+	{
+		std::atomic<uint64_t> checksum(0);
+		std::vector<std::thread> threads;
+
+		const auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t c = 0; c < consumers; ++c)
+		{
+			threads.emplace_back([&]()
+			{
+				PacketDescriptor descriptor;
+				uint64_t sum = 0;
+
+				while (pop(descriptor))
+				{
+					sum += descriptor.Length + descriptor.Address.IfIdx;
+				}
+
+				checksum.fetch_add(sum);
+			});
+		}
+
+		for (uint32_t i = 0; i < packets; ++i)
+		{
+			push(Describe(i));
+		}
+
+		close();
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		Check(checksum.load() != 0, "packets delivered");
+		return packets / seconds;
+	}
+
+	void Benchmark(uint32_t packets, uint32_t maximumConsumers)
+	{
+		const uint32_t capacity = 1024;
+
+		std::printf("consumers  ring Mpps  locked Mpps  (%u hardware threads)\n", std::thread::hardware_concurrency());
+
+		for (uint32_t consumers = 1; consumers <= maximumConsumers; consumers *= 2)
+		{
+			const PacketRingMode mode = consumers == 1 ? PacketRingMode::SingleProducerSingleConsumer : PacketRingMode::MultipleProducersMultipleConsumers;
+			PacketRing ring(capacity, mode, RingOverflow::Block, nullptr, nullptr);
+
+			const double ring_ = Run(consumers, packets,
+				[&](const PacketDescriptor& descriptor) { ring.Push(descriptor); },
+				[&](PacketDescriptor& descriptor) { return ring.Pop(descriptor, Infinite); },
+				[&]() { ring.Close(); });
+
+			LockedQueue queue(capacity);
+
+			const double locked = Run(consumers, packets,
+				[&](const PacketDescriptor& descriptor) { queue.Push(descriptor); },
+				[&](PacketDescriptor& descriptor) { return queue.Pop(descriptor); },
+				[&]() { queue.Close(); });
+
+			std::printf("%9u  %9.2f  %11.2f  %s\n", consumers, ring_ / 1e6, locked / 1e6, consumers == 1 ? "spsc" : "mpmc");
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t packets = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000000;
+	const uint32_t maximumConsumers = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 16;
+
+	TestOrdering();
+	TestDropNewest();
+	TestDropOldest(PacketRingMode::SingleProducerSingleConsumer);
+	TestDropOldest(PacketRingMode::MultipleProducersMultipleConsumers);
+	TestClosing();
+	TestPool();
+
+	TestConcurrent(PacketRingMode::SingleProducerSingleConsumer, RingOverflow::Block, 1, 1, 500000);
+	TestConcurrent(PacketRingMode::SingleProducerSingleConsumer, RingOverflow::DropOldest, 1, 1, 500000);
+	TestConcurrent(PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::Block, 4, 4, 500000);
+	TestConcurrent(PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::DropNewest, 4, 4, 500000);
+	TestConcurrent(PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::DropOldest, 4, 4, 500000);
+	TestConcurrent(PacketRingMode::MultipleProducersMultipleConsumers, RingOverflow::Block, 1, 16, 500000);
+
+	Benchmark(packets, maximumConsumers);
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures.load());
+	return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Benchmark for the process owner lookup behind Diversion::GetPacketProcess. Builds a synthetic
+// 50k entry TCP connection table, then resolves the owners of a stream of packets drawn from a
+// smaller working set of flows, once straight from the table's index and once through a
+// ConnectionRefresher, as GetPacketProcess does, and checks both agree. The refresher keeps
+// publishing new snapshots throughout, to show that a generation change costs the lookups nothing.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ProcessOwnerLookupBenchmark.cpp ../../src/DivertConnectionTable.cpp ../../src/DivertConnectionRefresher.cpp -o ProcessOwnerLookupBenchmark
+//     ./ProcessOwnerLookupBenchmark [tableSize] [activeFlows] [packets]
+
+#include "DivertConnectionRefresher.hpp"
+#include "DivertConnectionTable.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t UdpProtocol = 17;
+
+	uint16_t ToNetwork(uint16_t port)
+	{
+		return static_cast<uint16_t>((port >> 8) | (port << 8));
+	}
+
+	/// <summary>
+	/// Every entry is a connection from 10.0.x.y to one of a handful of remote servers. The
+	/// first few entries are listeners, with no remote end.
+	/// </summary>
+	std::vector<ConnectionEntry> MakeEntries(uint32_t size)
+	{
+		std::vector<ConnectionEntry> entries;
+
+		for (uint32_t i = 0; i < size; ++i)
+		{
+			ConnectionEntry entry = {};
+
+			const uint32_t local = 0x0A000000u | (i >> 14);
+			std::memcpy(entry.LocalAddress, &local, sizeof(local));
+			entry.LocalPort = ToNetwork(static_cast<uint16_t>(1024 + (i & 0x3FFF)));
+
+			if (i >= 16)
+			{
+				const uint32_t remote = 0xC0A80000u | (i % 251);
+				std::memcpy(entry.RemoteAddress, &remote, sizeof(remote));
+				entry.RemotePort = ToNetwork(443);
+			}
+
+			entry.OwningPid = 1000 + (i % 97);
+
+			entries.push_back(entry);
+		}
+
+		return entries;
+	}
+
+	FlowKey KeyFor(const ConnectionEntry& entry)
+	{
+		uint32_t local = 0;
+		uint32_t remote = 0;
+		std::memcpy(&local, entry.LocalAddress, sizeof(local));
+		std::memcpy(&remote, entry.RemoteAddress, sizeof(remote));
+
+		// Listeners are hit by inbound connections from arbitrary remote ends.
+		if (remote == 0)
+		{
+			remote = 0x08080808u;
+			return FlowKey::FromIPv4(TcpProtocol, local, entry.LocalPort, remote, ToNetwork(50000));
+		}
+
+		return FlowKey::FromIPv4(TcpProtocol, local, entry.LocalPort, remote, entry.RemotePort);
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point since)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t tableSize = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 50000;
+	const uint32_t activeFlows = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 2000;
+	const uint32_t packets = argc > 3 ? static_cast<uint32_t>(std::atoi(argv[3])) : 2000000;
+
+	int failures = 0;
+
+	const std::vector<ConnectionEntry> entries = MakeEntries(tableSize);
+
+	ConnectionTable table(4, TcpProtocol);
+
+	for (const ConnectionEntry& entry : entries)
+	{
+		table.Add(entry);
+	}
+
+	table.BuildIndex();
+
+	std::mt19937 random(12345);
+	std::uniform_int_distribution<uint32_t> pickEntry(0, tableSize - 1);
+	std::uniform_int_distribution<uint32_t> pickFlow(0, activeFlows - 1);
+
+	std::vector<FlowKey> flows;
+
+	for (uint32_t i = 0; i < activeFlows; ++i)
+	{
+		flows.push_back(KeyFor(entries[i < 8 ? i : pickEntry(random)]));
+	}
+
+	std::vector<uint32_t> stream(packets);
+
+	for (auto& flow : stream)
+	{
+		flow = pickFlow(random);
+	}
+
+	// Straight from the index, with nothing in the way.
+	std::vector<uint32_t> expected(activeFlows);
+	uint64_t checksum = 0;
+
+	auto started = std::chrono::steady_clock::now();
+
+	for (uint32_t flow : stream)
+	{
+		uint32_t pid = 0;
+		table.FindOwner(flows[flow], &pid);
+		expected[flow] = pid;
+		checksum += pid;
+	}
+
+	const double indexSeconds = Seconds(started);
+
+	// Through a refresher, which pins the current snapshot for every lookup.
+	CannedConnectionSource source;
+	source.Set(4, TcpProtocol, entries);
+	source.Set(4, UdpProtocol, std::vector<ConnectionEntry>());
+	source.Set(6, TcpProtocol, std::vector<ConnectionEntry>());
+	source.Set(6, UdpProtocol, std::vector<ConnectionEntry>());
+
+	ConnectionRefresher refresher(&source, 1);
+
+	if (!refresher.Start())
+	{
+		std::printf("refresher failed to start\n");
+		return 1;
+	}
+
+	const uint64_t firstGeneration = refresher.Generation();
+	uint64_t refresherChecksum = 0;
+
+	started = std::chrono::steady_clock::now();
+
+	for (uint32_t flow : stream)
+	{
+		uint32_t pid = 0;
+		refresher.FindOwner(flows[flow], &pid);
+
+		if (pid != expected[flow])
+		{
+			++failures;
+		}
+
+		refresherChecksum += pid;
+	}
+
+	const double refresherSeconds = Seconds(started);
+
+	const uint64_t generations = refresher.Generation() - firstGeneration;
+
+	refresher.Stop();
+
+	std::printf("Table entries: %u, active flows: %u, packets: %u\n", tableSize, activeFlows, packets);
+	std::printf("%10s %14s %12s\n", "", "lookups/sec", "ns/lookup");
+	std::printf("%10s %14.0f %12.1f\n", "index", packets / indexSeconds, indexSeconds * 1e9 / packets);
+	std::printf("%10s %14.0f %12.1f\n", "refresher", packets / refresherSeconds, refresherSeconds * 1e9 / packets);
+	std::printf("snapshots published during the run: %llu\n", static_cast<unsigned long long>(generations));
+
+	if (checksum != refresherChecksum)
+	{
+		std::printf("refresher owners disagree with the table\n");
+		++failures;
+	}
+
+	std::printf("%s\n", failures == 0 ? "OK" : "FAILED");
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Load test for the completion queue based receive engine, run against the simulated packet
+// source, so it needs neither the driver nor Windows. Reports packets/sec and latency
+// percentiles as the number of dispatcher workers grows, with and without per handle
+// statistics being recorded, so that the cost of recording them shows. The percentiles are also
+// read while the workers are running, which -fsanitize=thread checks for races.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ReceiveEngineLoadTest.cpp ../../src/DivertPacketSource.cpp ../../src/DivertCompletionQueue.cpp ../../src/DivertNativeReceiveEngine.cpp ../../src/DivertNativeStatistics.cpp -o ReceiveEngineLoadTest
+//     ./ReceiveEngineLoadTest [readsInFlight] [secondsPerRun]
+//
+// On Windows the same sources build with cl /EHsc, in which case CompletionQueue::Create hands
+// back an I/O completion port and the simulated source posts into it.
+
+#include "DivertPacketSource.hpp"
+#include "DivertCompletionQueue.hpp"
+#include "DivertNativeReceiveEngine.hpp"
+#include "DivertNativeStatistics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint32_t PacketBufferLength = 2048;
+
+	/// <summary>
+	/// A minimal IPv4/TCP SYN, a minimal IPv4/UDP datagram and an IPv4/TCP segment with a
+	/// payload, so the source hands out a mix of lengths.
+	/// </summary>
+	std::vector< std::vector<uint8_t> > MakePackets()
+	{
+		std::vector< std::vector<uint8_t> > packets;
+
+		std::vector<uint8_t> syn(40, 0);
+		syn[0] = 0x45; syn[3] = 40; syn[8] = 64; syn[9] = 6;
+		syn[32] = 0x50; syn[33] = 0x02;
+		packets.push_back(syn);
+
+		std::vector<uint8_t> datagram(28 + 64, 0);
+		datagram[0] = 0x45; datagram[3] = static_cast<uint8_t>(datagram.size()); datagram[8] = 64; datagram[9] = 17;
+		packets.push_back(datagram);
+
+		std::vector<uint8_t> segment(40 + 1200, 0);
+		segment[0] = 0x45; segment[2] = static_cast<uint8_t>(segment.size() >> 8); segment[3] = static_cast<uint8_t>(segment.size()); segment[8] = 64; segment[9] = 6;
+		segment[32] = 0x50; segment[33] = 0x18;
+		packets.push_back(segment);
+
+		return packets;
+	}
+
+	std::atomic<uint64_t> g_bytes(0);
+
+	void OnPacket(void* context, uint32_t slot, const uint8_t* packet, uint32_t length, PWINDIVERT_ADDRESS address, int32_t error)
+	{
+		if (error == 0)
+		{
+			// Touch the packet, as any real consumer would.
+			g_bytes.fetch_add(length + packet[0], std::memory_order_relaxed);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t readsInFlight = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 64;
+	const int secondsPerRun = argc > 2 ? std::atoi(argv[2]) : 2;
+	const uint32_t workerCounts[] = { 1, 2, 4, 8 };
+	const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	std::printf("Reads in flight: %u, hardware threads: %u\n", readsInFlight, std::thread::hardware_concurrency());
+	std::printf("%8s %6s %14s %10s %10s %10s %10s\n", "workers", "stats", "packets/sec", "p50 us", "p90 us", "p99 us", "p99.9 us");
+
+	int failures = 0;
+
+	for (uint32_t workers : workerCounts)
+	for (bool recorded : { false, true })
+	{
+		SimulatedPacketSource source(MakePackets());
+		CompletionDispatcher dispatcher(CompletionQueue::Create(workers));
+
+		std::vector<uint8_t> storage(static_cast<size_t>(readsInFlight) * PacketBufferLength);
+		std::vector<WINDIVERT_ADDRESS> addressStorage(readsInFlight);
+		std::vector<uint8_t*> buffers(readsInFlight);
+		std::vector<PWINDIVERT_ADDRESS> addresses(readsInFlight);
+
+		for (uint32_t i = 0; i < readsInFlight; ++i)
+		{
+			buffers[i] = &storage[static_cast<size_t>(i) * PacketBufferLength];
+			addresses[i] = &addressStorage[i];
+		}
+
+		ReceiveEngine engine(&source, &dispatcher, buffers.data(), addresses.data(), readsInFlight, PacketBufferLength, &OnPacket, nullptr);
+		Statistics* statistics = new Statistics();
+
+		if (recorded)
+		{
+			engine.SetStatistics(statistics);
+		}
+
+		if (!dispatcher.Start(workers) || !engine.Start())
+		{
+			std::printf("%8u failed to start, error %d\n", workers, GetNativeLastError());
+			statistics->Release();
+			++failures;
+			continue;
+		}
+
+		// Warm up, then measure a clean window.
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		engine.ResetStatistics();
+
+		auto started = std::chrono::steady_clock::now();
+		uint64_t results[4];
+
+		// Read the percentiles while the workers are still recording, as a monitor would.
+		while (std::chrono::steady_clock::now() - started < std::chrono::seconds(secondsPerRun))
+		{
+			engine.LatencyPercentiles(percentiles, 4, results);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		engine.Stop();
+		auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		dispatcher.Stop();
+
+		engine.LatencyPercentiles(percentiles, 4, results);
+
+		std::printf("%8u %6s %14.0f %10.2f %10.2f %10.2f %10.2f\n", workers, recorded ? "on" : "off", static_cast<double>(engine.CompletedCount()) / elapsed,
+			results[0] / 1000.0, results[1] / 1000.0, results[2] / 1000.0, results[3] / 1000.0);
+
+		if (engine.CompletedCount() == 0 || engine.FailedCount() != 0)
+		{
+			std::printf("%8u completed %llu, failed %llu\n", workers, static_cast<unsigned long long>(engine.CompletedCount()), static_cast<unsigned long long>(engine.FailedCount()));
+			++failures;
+		}
+
+		// Every read the engine posted has come back by now, aborted or not, so the pending
+		// counts must balance.
+		std::unique_ptr<StatisticsSnapshot> snapshot(new StatisticsSnapshot());
+		statistics->Snapshot(snapshot.get());
+		statistics->Release();
+
+		if (recorded && (snapshot->ReceivedPackets < engine.CompletedCount() || snapshot->PendingStarted != snapshot->PendingCompleted || snapshot->CompletionLatency.Count != snapshot->PendingCompleted))
+		{
+			std::printf("%8u statistics received %llu, pending started %llu, completed %llu\n", workers, static_cast<unsigned long long>(snapshot->ReceivedPackets),
+				static_cast<unsigned long long>(snapshot->PendingStarted), static_cast<unsigned long long>(snapshot->PendingCompleted));
+			++failures;
+		}
+	}
+
+	return failures == 0 ? 0 : 1;
+}
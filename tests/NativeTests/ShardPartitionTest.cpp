@@ -0,0 +1,478 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for sharded capture. Compiles every shard's filter with the native filter compiler and
+// checks that each packet of a few thousand random TCP, UDP, ICMP and fragmented flows, in both
+// directions, is admitted by exactly one shard, the one ShardPartition::ShardOf() names, and that
+// the filters stay within WinDivert's instruction limit. Checks that flows from the dynamic port
+// range are spread evenly. Then runs one pinned worker per shard, each reading from a simulated
+// packet source holding its shard's packets, and reports how the packet rate scales with the
+// number of shards.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src ShardPartitionTest.cpp ../../src/DivertNativeShardPartition.cpp ../../src/DivertNativeFilter.cpp ../../src/DivertNativeFilterAnalyzer.cpp ../../src/DivertNativeChecksum.cpp ../../src/DivertPacketSource.cpp ../../src/DivertCompletionQueue.cpp ../../src/DivertConnectionTable.cpp -o ShardPartitionTest
+//     ./ShardPartitionTest [flows] [millisecondsPerRun]
+
+#include "DivertNativeShardPartition.hpp"
+#include "DivertNativeChecksum.hpp"
+#include "DivertNativeFilter.hpp"
+#include "DivertPacketSource.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	/// <summary>
+	/// WINDIVERT_FILTER_MAXLEN in WinDivert 1.x.
+	/// </summary>
+	const uint32_t MaximumInstructions = 256;
+
+	std::atomic<int> g_failures(0);
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	struct TestFlow
+	{
+		FlowKey Key;
+
+		/// <summary>
+		/// An IPv4 fragment other than the first, which carries no ports.
+		/// </summary>
+		bool LaterFragment;
+	};
+
+	void WriteUInt16(uint8_t* data, uint32_t value)
+	{
+		data[0] = static_cast<uint8_t>(value >> 8);
+		data[1] = static_cast<uint8_t>(value);
+	}
+
+	/// <summary>
+	/// Builds a packet of a flow, sent from the local end when outbound and to it otherwise.
+	/// </summary>
+	std::vector<uint8_t> Build(const TestFlow& flow, bool outbound)
+	{
+		const FlowKey& key = flow.Key;
+		const uint32_t payload = 32;
+		const uint32_t transport = key.Protocol == 6 ? 20 : 8;
+		const uint32_t ip = key.Family == 4 ? 20 : 40;
+
+		std::vector<uint8_t> packet(ip + transport + payload, 0);
+		uint8_t* data = packet.data();
+
+		const uint8_t* source = outbound ? key.LocalAddress : key.RemoteAddress;
+		const uint8_t* destination = outbound ? key.RemoteAddress : key.LocalAddress;
+
+		if (key.Family == 4)
+		{
+			data[0] = 0x45;
+			WriteUInt16(data + 2, static_cast<uint32_t>(packet.size()));
+			WriteUInt16(data + 6, flow.LaterFragment ? 0x0010 : 0x4000);
+			data[8] = 64;
+			data[9] = key.Protocol;
+			std::memcpy(data + 12, source, 4);
+			std::memcpy(data + 16, destination, 4);
+		}
+		else
+		{
+			data[0] = 0x60;
+			WriteUInt16(data + 4, transport + payload);
+			data[6] = key.Protocol;
+			data[7] = 64;
+			std::memcpy(data + 8, source, 16);
+			std::memcpy(data + 24, destination, 16);
+		}
+
+		uint8_t* header = data + ip;
+
+		if (key.Protocol == 6 || key.Protocol == 17)
+		{
+			WriteUInt16(header, outbound ? key.LocalPort : key.RemotePort);
+			WriteUInt16(header + 2, outbound ? key.RemotePort : key.LocalPort);
+
+			if (key.Protocol == 6)
+			{
+				header[12] = 0x50;
+				header[13] = 0x18;
+			}
+			else
+			{
+				WriteUInt16(header + 4, transport + payload);
+			}
+		}
+		else
+		{
+			// An echo request.
+			header[0] = key.Family == 4 ? 8 : 128;
+		}
+
+		CalculateChecksums(data, static_cast<uint32_t>(packet.size()), 0);
+
+		return packet;
+	}
+
+	std::vector<TestFlow> RandomFlows(std::mt19937& random, uint32_t count, bool dynamicPorts)
+	{
+		std::vector<TestFlow> flows;
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const uint32_t kind = random() % 10;
+			const uint8_t protocol = kind < 5 ? 6 : (kind < 8 ? 17 : (kind == 8 ? 1 : 6));
+			const bool ipv6 = random() % 3 == 0 && kind != 9;
+			uint8_t local[16];
+			uint8_t remote[16];
+
+			for (uint32_t b = 0; b < 16; ++b)
+			{
+				local[b] = static_cast<uint8_t>(random());
+				remote[b] = static_cast<uint8_t>(random());
+			}
+
+			const uint16_t localPort = static_cast<uint16_t>(dynamicPorts ? 49152 + random() % 16384 : random());
+			const uint16_t remotePort = static_cast<uint16_t>(random());
+
+			TestFlow flow;
+			uint8_t family = ipv6 ? 6 : 4;
+			uint8_t icmp = ipv6 ? 58 : 1;
+
+			flow.Key = FlowKey::FromPacket(family, protocol == 1 ? icmp : protocol, true, local, localPort, remote, remotePort);
+			flow.LaterFragment = kind == 9;
+
+			if (protocol == 1)
+			{
+				flow.Key.LocalPort = 0;
+				flow.Key.RemotePort = 0;
+			}
+
+			flows.push_back(flow);
+		}
+
+		return flows;
+	}
+
+	/// <summary>
+	/// Compiles a filter for every shard.
+	/// </summary>
+	std::vector<Filter*> CompileShards(const ShardPartition& partition, const char* filter)
+	{
+		std::vector<Filter*> filters;
+
+		for (uint32_t shard = 0; shard < partition.ShardCount(); ++shard)
+		{
+			const std::string text = partition.Filter(filter, shard);
+			const char* error = nullptr;
+			uint32_t position = 0;
+
+			Filter* compiled = new Filter();
+
+			if (!compiled->Compile(text.data(), text.size(), FilterLayer::Network, &error, &position))
+			{
+				std::printf("  %s at %u in %s\n", error, position, text.c_str());
+				Check(false, "shard filter compiles");
+			}
+
+			Check(compiled->InstructionCount() <= MaximumInstructions, "shard filter within the driver's limit");
+
+			filters.push_back(compiled);
+		}
+
+		return filters;
+	}
+
+	void TestPartition(uint32_t shardCount, ShardKey key, const std::vector<TestFlow>& flows)
+	{
+		const ShardPartition partition(shardCount, ShardPartition::DefaultStripesPerShard, key);
+		std::vector<Filter*> filters = CompileShards(partition, "ip or ipv6");
+		uint32_t misplaced = 0;
+
+		for (const TestFlow& flow : flows)
+		{
+			// Fragments other than the first carry no ports, and go to shard zero.
+			const uint32_t expected = flow.LaterFragment ? 0 : partition.ShardOf(flow.Key);
+
+			for (int direction = 0; direction < 2; ++direction)
+			{
+				const std::vector<uint8_t> packet = Build(flow, direction == 0);
+
+				WINDIVERT_ADDRESS address = WINDIVERT_ADDRESS();
+				address.Direction = direction == 0 ? WINDIVERT_DIRECTION_OUTBOUND : WINDIVERT_DIRECTION_INBOUND;
+
+				uint32_t matches = 0;
+				uint32_t matched = 0;
+
+				for (uint32_t shard = 0; shard < shardCount; ++shard)
+				{
+					if (filters[shard]->Evaluate(packet.data(), static_cast<uint32_t>(packet.size()), &address))
+					{
+						++matches;
+						matched = shard;
+					}
+				}
+
+				if (matches != 1 || matched != expected)
+				{
+					++misplaced;
+				}
+			}
+		}
+
+		if (misplaced != 0)
+		{
+			std::printf("  %u shards, %s: %u packets misplaced\n", shardCount, key == ShardKey::LocalPort ? "local port" : "remote port", misplaced);
+		}
+
+		Check(misplaced == 0, "every packet admitted by exactly its flow's shard");
+
+		for (Filter* filter : filters)
+		{
+			delete filter;
+		}
+	}
+
+	void TestEdges()
+	{
+		const ShardPartition partition(3, 1, ShardKey::LocalPort);
+
+		// Three stripes of 21845.33 ports: 0-21845, 21846-43690, 43691-65535.
+		Check(partition.ShardOfPort(0) == 0 && partition.ShardOfPort(21845) == 0, "first stripe");
+		Check(partition.ShardOfPort(21846) == 1 && partition.ShardOfPort(43690) == 1, "second stripe");
+		Check(partition.ShardOfPort(43691) == 2 && partition.ShardOfPort(65535) == 2, "last stripe");
+		Check(partition.Term(1) == "(outbound and ((tcp.SrcPort >= 21846 and tcp.SrcPort <= 43690) or (udp.SrcPort >= 21846 and udp.SrcPort <= 43690))) or (inbound and ((tcp.DstPort >= 21846 and tcp.DstPort <= 43690) or (udp.DstPort >= 21846 and udp.DstPort <= 43690)))", "term");
+
+		const ShardPartition single(1, 4, ShardKey::RemotePort);
+		Check(single.Filter("tcp", 0) == "tcp" && single.ShardOfPort(12345) == 0, "one shard leaves the filter alone");
+
+		const ShardPartition clamped(1000, 1000, ShardKey::LocalPort);
+		Check(clamped.ShardCount() == ShardPartition::MaximumShards && clamped.StripesPerShard() == ShardPartition::MaximumStripesPerShard, "clamped");
+	}
+
+	void TestBalance(std::mt19937& random)
+	{
+		const std::vector<TestFlow> flows = RandomFlows(random, 64000, true);
+
+		for (uint32_t shardCount = 2; shardCount <= 16; shardCount *= 2)
+		{
+			const ShardPartition partition(shardCount, ShardPartition::DefaultStripesPerShard, ShardKey::LocalPort);
+			std::vector<uint32_t> counts(shardCount, 0);
+			uint32_t ported = 0;
+
+			for (const TestFlow& flow : flows)
+			{
+				if (flow.Key.Protocol == 6 || flow.Key.Protocol == 17)
+				{
+					++counts[partition.ShardOfPort(flow.Key.LocalPort)];
+					++ported;
+				}
+			}
+
+			const double mean = static_cast<double>(ported) / shardCount;
+			const double lowest = *std::min_element(counts.begin(), counts.end()) / mean;
+			const double highest = *std::max_element(counts.begin(), counts.end()) / mean;
+
+			std::printf("%2u shards: dynamic port flows per shard between %.2f and %.2f of the mean\n", shardCount, lowest, highest);
+			Check(lowest > 0.85 && highest < 1.15, "dynamic ports spread evenly");
+		}
+	}
+
+	/// <summary>
+	/// A shard's worker: receives from its own source, finds the packet's shard from its ports
+	/// as a check on the simulated split, recalculates checksums and reinjects.
+	/// </summary>
+	void Work(SimulatedPacketSource* source, const ShardPartition* partition, uint32_t shard, const std::atomic<bool>* stop, uint64_t* handled, uint64_t* misplaced)
+	{
+		PinCurrentThread(shard);
+
+		uint8_t buffer[2048];
+		WINDIVERT_ADDRESS address;
+		uint64_t count = 0;
+		uint64_t wrong = 0;
+
+		while (!stop->load(std::memory_order_relaxed))
+		{
+			for (uint32_t i = 0; i < 256; ++i)
+			{
+				uint32_t length = 0;
+
+				if (!source->Receive(buffer, sizeof(buffer), &address, &length))
+				{
+					return;
+				}
+
+				const uint32_t ip = (buffer[0] >> 4) == 4 ? 20 : 40;
+				const uint8_t protocol = ip == 20 ? buffer[9] : buffer[6];
+				const bool fragment = ip == 20 && (buffer[7] != 0 || (buffer[6] & 0x1F) != 0);
+
+				if ((protocol == 6 || protocol == 17) && !fragment)
+				{
+					// The simulated source hands everything out as outbound.
+					const uint32_t port = partition->Key() == ShardKey::LocalPort ? (buffer[ip] << 8) | buffer[ip + 1] : (buffer[ip + 2] << 8) | buffer[ip + 3];
+					wrong += partition->ShardOfPort(static_cast<uint16_t>(port)) != shard ? 1 : 0;
+				}
+				else
+				{
+					wrong += shard != 0 ? 1 : 0;
+				}
+
+				CalculateChecksums(buffer, length, 0);
+
+				uint32_t written = 0;
+				source->Send(buffer, length, &address, &written);
+				++count;
+			}
+		}
+
+		*handled = count;
+		*misplaced = wrong;
+	}
+
+	void TestScaling(std::mt19937& random, uint32_t milliseconds)
+	{
+		const std::vector<TestFlow> flows = RandomFlows(random, 4096, true);
+
+		std::printf("shards   Mpps  scale  packets per shard  (%u hardware threads)\n", std::thread::hardware_concurrency());
+
+		double single = 0;
+
+		for (uint32_t shardCount = 1; shardCount <= 8; shardCount *= 2)
+		{
+			const ShardPartition partition(shardCount, ShardPartition::DefaultStripesPerShard, ShardKey::LocalPort);
+			std::vector<Filter*> filters = CompileShards(partition, "true");
+			std::vector< std::vector< std::vector<uint8_t> > > templates(shardCount);
+
+			// What each shard's handle would be handed by the driver.
+			for (const TestFlow& flow : flows)
+			{
+				const std::vector<uint8_t> packet = Build(flow, true);
+
+				WINDIVERT_ADDRESS address = WINDIVERT_ADDRESS();
+				address.Direction = WINDIVERT_DIRECTION_OUTBOUND;
+
+				for (uint32_t shard = 0; shard < shardCount; ++shard)
+				{
+					if (filters[shard]->Evaluate(packet.data(), static_cast<uint32_t>(packet.size()), &address))
+					{
+						templates[shard].push_back(packet);
+					}
+				}
+			}
+
+			std::vector<SimulatedPacketSource*> sources;
+			std::vector<uint64_t> handled(shardCount, 0);
+			std::vector<uint64_t> misplaced(shardCount, 0);
+			std::vector<std::thread> workers;
+			std::atomic<bool> stop(false);
+
+			for (uint32_t shard = 0; shard < shardCount; ++shard)
+			{
+				Check(!templates[shard].empty(), "every shard has flows");
+				sources.push_back(new SimulatedPacketSource(templates[shard]));
+			}
+
+			const auto started = std::chrono::steady_clock::now();
+
+			for (uint32_t shard = 0; shard < shardCount; ++shard)
+			{
+				workers.emplace_back(Work, sources[shard], &partition, shard, &stop, &handled[shard], &misplaced[shard]);
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+			stop.store(true);
+
+			for (auto& worker : workers)
+			{
+				worker.join();
+			}
+
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+			uint64_t total = 0;
+
+			for (uint32_t shard = 0; shard < shardCount; ++shard)
+			{
+				total += handled[shard];
+				Check(misplaced[shard] == 0, "worker only sees its shard's flows");
+				Check(sources[shard]->SentCount() == handled[shard], "everything reinjected");
+				delete sources[shard];
+				delete filters[shard];
+			}
+
+			const double rate = total / seconds / 1e6;
+
+			if (shardCount == 1)
+			{
+				single = rate;
+			}
+
+			std::printf("%6u  %5.2f  x%.2f ", shardCount, rate, single > 0 ? rate / single : 0.0);
+
+			for (uint32_t shard = 0; shard < shardCount; ++shard)
+			{
+				std::printf(" %llu", static_cast<unsigned long long>(handled[shard]));
+			}
+
+			std::printf("\n");
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t flowCount = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000;
+	const uint32_t milliseconds = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 500;
+
+	std::mt19937 random(20151028);
+
+	TestEdges();
+
+	const std::vector<TestFlow> flows = RandomFlows(random, flowCount, false);
+
+	for (uint32_t shardCount : { 1u, 2u, 3u, 4u, 7u, 8u, 16u, 64u })
+	{
+		TestPartition(shardCount, ShardKey::LocalPort, flows);
+		TestPartition(shardCount, ShardKey::RemotePort, flows);
+	}
+
+	TestBalance(random);
+	TestScaling(random, milliseconds);
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures.load());
+	return g_failures == 0 ? 0 : 1;
+}
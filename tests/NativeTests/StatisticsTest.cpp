@@ -0,0 +1,342 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for the per handle statistics. Checks the histogram bucket layout and percentiles, that
+// counters add up exactly when more threads record than there are owned stripes and when
+// threads come and go, that receive to reinject latency is paired up by address, also when
+// addresses collide in the stamp table, and that the error table spills over into OtherErrors. Reports the cost of recording a packet.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -pthread -I../../src StatisticsTest.cpp ../../src/DivertNativeStatistics.cpp -o StatisticsTest
+//     ./StatisticsTest [threads] [packetsPerThread]
+
+#include "DivertNativeStatistics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	int g_failures = 0;
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	std::unique_ptr<StatisticsSnapshot> Take(const Statistics& statistics)
+	{
+		std::unique_ptr<StatisticsSnapshot> snapshot(new StatisticsSnapshot());
+		statistics.Snapshot(snapshot.get());
+		return snapshot;
+	}
+
+	void TestBuckets()
+	{
+		bool increasing = true;
+		bool precise = true;
+
+		for (uint32_t i = 0; i + 1 < HistogramBucketCount; ++i)
+		{
+			const uint64_t lower = HistogramBucketLowerBound(i);
+			const uint64_t width = HistogramBucketLowerBound(i + 1) - lower;
+
+			increasing = increasing && width > 0;
+			precise = precise && (lower < HistogramSubBuckets * 2 ? width == 1 : width * HistogramSubBuckets <= lower);
+		}
+
+		Check(increasing, "bucket bounds increase");
+		Check(precise, "buckets are within 1/32 of their values");
+		Check(HistogramBucketLowerBound(HistogramBucketCount - 1) < (static_cast<uint64_t>(1) << HistogramMaximumBits), "last bucket starts below the maximum");
+
+		// 100 values in bucket 10, then one far out.
+		std::unique_ptr<HistogramSnapshot> histogram(new HistogramSnapshot());
+		std::memset(histogram.get(), 0, sizeof(*histogram));
+		histogram->Buckets[10] = 100;
+		histogram->Buckets[400] = 1;
+		histogram->Count = 101;
+		histogram->Minimum = 10;
+		histogram->Maximum = HistogramBucketLowerBound(400) + 5;
+
+		Check(HistogramPercentile(histogram->Buckets, histogram->Count, histogram->Maximum, 50) == 10, "median");
+		Check(HistogramPercentile(histogram->Buckets, histogram->Count, histogram->Maximum, 99) == 10, "p99");
+		Check(HistogramPercentile(histogram->Buckets, histogram->Count, histogram->Maximum, 100) == histogram->Maximum, "p100 is the maximum");
+		Check(HistogramPercentile(histogram->Buckets, histogram->Count, histogram->Maximum, 0) == 10, "p0");
+
+		histogram->Count = 0;
+		Check(HistogramPercentile(histogram->Buckets, histogram->Count, histogram->Maximum, 50) == 0, "empty histogram");
+	}
+
+	void TestThreads(uint32_t threadCount, uint32_t packetsPerThread)
+	{
+		Statistics* statistics = new Statistics();
+
+		// Two rounds, so the second round's threads pick up stripes the first round gave back.
+		for (int round = 0; round < 2; ++round)
+		{
+			std::vector<std::thread> threads;
+
+			for (uint32_t t = 0; t < threadCount; ++t)
+			{
+				threads.emplace_back([statistics, packetsPerThread, t]()
+				{
+					std::vector<WINDIVERT_ADDRESS> addresses(4);
+
+					for (uint32_t i = 0; i < packetsPerThread; ++i)
+					{
+						PWINDIVERT_ADDRESS address = &addresses[i % addresses.size()];
+
+						statistics->RecordReceived(address, 100);
+						statistics->RecordSent(address, 100);
+
+						if (i % 100 == 0)
+						{
+							statistics->RecordSendError(static_cast<int32_t>(1 + t % 4));
+						}
+					}
+				});
+			}
+
+			for (std::thread& thread : threads)
+			{
+				thread.join();
+			}
+		}
+
+		std::unique_ptr<StatisticsSnapshot> snapshot = Take(*statistics);
+		const uint64_t packets = 2ull * threadCount * packetsPerThread;
+		const uint64_t errors = 2ull * threadCount * ((packetsPerThread + 99) / 100);
+
+		Check(snapshot->ReceivedPackets == packets && snapshot->SentPackets == packets, "packet counts add up");
+		Check(snapshot->ReceivedBytes == packets * 100 && snapshot->SentBytes == packets * 100, "byte counts add up");
+		Check(snapshot->SendErrors == errors && snapshot->ReceiveErrors == 0, "error counts add up");
+		// Each thread has one packet pending at a time, and no stamp is lost while there are no
+		// more pending than the stamp table's 32 probes, wherever the addresses hash to.
+		Check(threadCount > 32 || snapshot->ReinjectLatency.Count == packets, "every reinjected packet is timed");
+
+		uint64_t byCode = snapshot->OtherErrors;
+
+		for (uint32_t i = 0; i < snapshot->ErrorCodeCount; ++i)
+		{
+			byCode += snapshot->Errors[i].Count;
+		}
+
+		Check(byCode == errors && snapshot->OtherErrors == 0 && snapshot->ErrorCodeCount == (threadCount < 4 ? threadCount : 4), "errors by code add up");
+
+		statistics->Release();
+	}
+
+	void TestReinject()
+	{
+		Statistics* statistics = new Statistics();
+		WINDIVERT_ADDRESS received = {};
+		WINDIVERT_ADDRESS other = {};
+
+		statistics->RecordReceived(&received, 60);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		statistics->RecordSent(&received, 60);
+		statistics->RecordSent(&received, 60);
+		statistics->RecordSent(&other, 60);
+
+		std::unique_ptr<StatisticsSnapshot> snapshot = Take(*statistics);
+
+		Check(snapshot->SentPackets == 3, "every send counted");
+		Check(snapshot->ReinjectLatency.Count == 1, "one stamp, one sample");
+		Check(snapshot->ReinjectLatency.Minimum >= 5000000 && snapshot->ReinjectLatency.Maximum < 5000000000ull, "reinject latency measured");
+		Check(snapshot->ReinjectLatency.Sum == snapshot->ReinjectLatency.Minimum, "sum of one sample");
+
+		// A batch send, one packet of which failed.
+		PWINDIVERT_ADDRESS addresses[] = { &received, &other };
+		const int32_t results[] = { 0, 5 };
+		const uint32_t lengths[] = { 40, 50 };
+
+		statistics->RecordReceived(addresses, 2, 90);
+		statistics->RecordSent(addresses, results, lengths, 2);
+
+		snapshot = Take(*statistics);
+
+		Check(snapshot->ReceivedPackets == 3 && snapshot->ReceivedBytes == 150, "batch receive counted");
+		Check(snapshot->SentPackets == 4 && snapshot->SentBytes == 220 && snapshot->SendErrors == 1, "batch send counted");
+		Check(snapshot->ReinjectLatency.Count == 2, "only the packet sent is timed");
+		Check(snapshot->ErrorCodeCount == 1 && snapshot->Errors[0].Error == 5, "batch send error by code");
+
+		statistics->Release();
+	}
+
+	void TestBurst()
+	{
+		Statistics* statistics = new Statistics();
+		std::vector<WINDIVERT_ADDRESS> addresses(32);
+		std::vector<PWINDIVERT_ADDRESS> pointers;
+
+		for (WINDIVERT_ADDRESS& address : addresses)
+		{
+			pointers.push_back(&address);
+		}
+
+		// A whole burst pending at once, and a packet received twice into the same address.
+		statistics->RecordReceived(pointers.data(), static_cast<uint32_t>(pointers.size()), 100);
+		statistics->RecordReceived(pointers[0], 100);
+
+		for (PWINDIVERT_ADDRESS address : pointers)
+		{
+			statistics->RecordSent(address, 100);
+		}
+
+		std::unique_ptr<StatisticsSnapshot> snapshot = Take(*statistics);
+
+		Check(snapshot->ReinjectLatency.Count == pointers.size(), "every packet of a burst is timed");
+
+		// Many more pending than the table holds: the oldest stamps go, and nothing is timed twice.
+		std::vector<WINDIVERT_ADDRESS> many(4096);
+
+		for (WINDIVERT_ADDRESS& address : many)
+		{
+			statistics->RecordReceived(&address, 100);
+		}
+
+		for (WINDIVERT_ADDRESS& address : many)
+		{
+			statistics->RecordSent(&address, 100);
+			statistics->RecordSent(&address, 100);
+		}
+
+		snapshot = Take(*statistics);
+
+		Check(snapshot->ReinjectLatency.Count > pointers.size() && snapshot->ReinjectLatency.Count <= pointers.size() + 1024, "a full table drops stamps");
+
+		statistics->Release();
+	}
+
+	void TestPending()
+	{
+		Statistics* statistics = new Statistics();
+		WINDIVERT_ADDRESS address = {};
+
+		uint64_t since = statistics->RecordPending();
+		statistics->RecordReceiveCompleted(since, &address, 64, 0);
+
+		since = statistics->RecordPending();
+		statistics->RecordSendCompleted(since, &address, 64, 0);
+
+		since = statistics->RecordPending();
+		statistics->RecordReceiveCompleted(since, &address, 0, 995);
+
+		since = statistics->RecordPending();
+		statistics->RecordCompleted(since);
+
+		statistics->RecordPending();
+
+		std::unique_ptr<StatisticsSnapshot> snapshot = Take(*statistics);
+
+		Check(snapshot->PendingStarted == 5 && snapshot->PendingCompleted == 4, "pending operations counted");
+		Check(snapshot->ReceivedPackets == 1 && snapshot->SentPackets == 1 && snapshot->ReceiveErrors == 1, "completions recorded");
+		Check(snapshot->ReinjectLatency.Count == 1, "completed send paired with completed receive");
+
+		// References keep the object alive past its owner.
+		statistics->AddReference();
+		statistics->Release();
+		Check(Take(*statistics)->PendingStarted == 5, "still alive with a reference left");
+		statistics->Release();
+	}
+
+	void TestErrorTable()
+	{
+		Statistics* statistics = new Statistics();
+
+		for (int32_t error = 1; error <= static_cast<int32_t>(MaximumErrorCodes) + 4; ++error)
+		{
+			statistics->RecordReceiveError(error);
+			statistics->RecordReceiveError(error);
+		}
+
+		statistics->RecordReceiveError(0);
+
+		std::unique_ptr<StatisticsSnapshot> snapshot = Take(*statistics);
+
+		Check(snapshot->ErrorCodeCount == MaximumErrorCodes, "error table full");
+		Check(snapshot->OtherErrors == 9, "codes past the table spill over");
+		Check(snapshot->Errors[0].Count == 2 && snapshot->ReceiveErrors == 2 * (MaximumErrorCodes + 4) + 1, "error counts");
+
+		statistics->Release();
+	}
+
+	void Benchmark(uint32_t packets)
+	{
+		Statistics* statistics = new Statistics();
+		WINDIVERT_ADDRESS address = {};
+
+		auto started = std::chrono::steady_clock::now();
+
+		for (uint32_t i = 0; i < packets; ++i)
+		{
+			statistics->RecordReceived(&address, 1500);
+			statistics->RecordSent(&address, 1500);
+		}
+
+		const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+
+		std::printf("receive and reinject recorded in %.1f ns per packet\n", elapsed / packets);
+
+		started = std::chrono::steady_clock::now();
+
+		for (uint32_t i = 0; i < 1000; ++i)
+		{
+			Take(*statistics);
+		}
+
+		std::printf("snapshot taken in %.1f us\n", std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count() / 1000);
+
+		statistics->Release();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t threads = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 24;
+	const uint32_t packetsPerThread = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 100000;
+
+	TestBuckets();
+	TestThreads(threads, packetsPerThread);
+	TestReinject();
+	TestBurst();
+	TestPending();
+	TestErrorTable();
+	Benchmark(packetsPerThread * 10);
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures);
+	return g_failures == 0 ? 0 : 1;
+}
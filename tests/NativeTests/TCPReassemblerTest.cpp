@@ -0,0 +1,521 @@
+/*
+* The MIT License (MIT)
+*
+* Copyright (c) 2015 Jesse Nicholson
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Test for TCP stream reassembly. Checks that in order data is handed out from the caller's
+// buffer and only copied when it isn't read in time, including when one buffer is reused for
+// every segment, that out of order, overlapping and
+// duplicated segments come out as the original stream with the first copy of every byte kept,
+// sequence numbers wrapping, FIN and RST, the per flow and global memory limits with SkipGap,
+// and that randomly cut, reordered and repeated segments of many interleaved streams always
+// reassemble exactly with all memory given back. Reports the cost per segment.
+//
+// Build and run from this directory, on Linux:
+//
+//     g++ -std=c++14 -O2 -I../../src TCPReassemblerTest.cpp ../../src/DivertConnectionTable.cpp ../../src/DivertNativeFlowTable.cpp ../../src/DivertNativeTCPReassembler.cpp -o TCPReassemblerTest
+//     ./TCPReassemblerTest [streams]
+
+#include "DivertNativeTCPReassembler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace Divert::Net::Native;
+
+namespace
+{
+	const uint8_t TcpProtocol = 6;
+
+	const uint8_t Fin = FlowTable::TcpFin;
+
+	const uint8_t Syn = FlowTable::TcpSyn;
+
+	const uint8_t Rst = FlowTable::TcpRst;
+
+	int g_failures = 0;
+
+	void Check(bool condition, const char* what)
+	{
+		if (!condition)
+		{
+			std::printf("FAILED: %s\n", what);
+			++g_failures;
+		}
+	}
+
+	FlowKey KeyOf(uint32_t client)
+	{
+		return FlowKey::FromIPv4(TcpProtocol, 0x0A000001, static_cast<uint16_t>(1024 + client % 60000), 0x0A000002 + client / 60000, 80);
+	}
+
+	TCPSegmentResult Push(TCPReassembler& reassembler, const FlowKey& key, bool outbound, uint32_t sequence, uint8_t flags, const std::string& data, uint64_t now = 1)
+	{
+		return reassembler.Push(key, outbound, sequence, flags, reinterpret_cast<const uint8_t*>(data.data()), static_cast<uint32_t>(data.size()), now);
+	}
+
+	/// <summary>
+	/// Payloads given as literals are kept for the whole run, as the reassembler may still be
+	/// pointing at them after the call.
+	/// </summary>
+	std::deque<std::string> g_payloads;
+
+	TCPSegmentResult Push(TCPReassembler& reassembler, const FlowKey& key, bool outbound, uint32_t sequence, uint8_t flags, const char* data, uint64_t now = 1)
+	{
+		g_payloads.emplace_back(data);
+		return Push(reassembler, key, outbound, sequence, flags, g_payloads.back(), now);
+	}
+
+	/// <summary>
+	/// Reads and consumes everything readable from a stream.
+	/// </summary>
+	std::string ReadAll(TCPReassembler& reassembler, uint32_t stream)
+	{
+		std::string text;
+		TCPStreamChunk chunks[8];
+		uint32_t count = 0;
+
+		while ((count = reassembler.Peek(stream, chunks, 8)) != 0)
+		{
+			uint32_t length = 0;
+
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				text.append(reinterpret_cast<const char*>(chunks[i].Data), chunks[i].Length);
+				length += chunks[i].Length;
+			}
+
+			reassembler.Consume(stream, length);
+		}
+
+		return text;
+	}
+
+	void TestInOrder()
+	{
+		TCPReassembler reassembler(16, 1 << 20, 1 << 24, 60000);
+		const FlowKey key = KeyOf(1);
+
+		Check(Push(reassembler, key, true, 1000, Syn, "").Status == TCPReassembler::StatusNewFlow, "SYN creates the flow");
+
+		std::string first = "GET / HTTP/1.1\r\n";
+		const TCPSegmentResult result = Push(reassembler, key, true, 1001, 0, first);
+
+		TCPStreamChunk chunk;
+		Check(result.Status == TCPReassembler::StatusData && TCPReassembler::IsOutbound(result.Stream), "in order data is readable");
+		Check(reassembler.Peek(result.Stream, &chunk, 1) == 1 && chunk.Borrowed && chunk.Data == reinterpret_cast<const uint8_t*>(first.data()) && chunk.PayloadOffset == 0, "in order data is not copied");
+		Check(reassembler.Statistics().MemoryUsed == 0, "nothing buffered");
+
+		// Half read, then the caller's buffer goes away.
+		reassembler.Consume(result.Stream, 4);
+		Push(reassembler, key, false, 5000, Syn, "");
+		first.assign(first.size(), 'x');
+
+		Check(reassembler.Statistics().Retained == 1 && reassembler.Statistics().MemoryUsed != 0, "unread data retained");
+		Check(reassembler.Peek(result.Stream, &chunk, 1) == 1 && !chunk.Borrowed, "retained data is copied");
+		Check(ReadAll(reassembler, result.Stream) == "/ HTTP/1.1\r\n", "retained data intact");
+		Check(reassembler.Statistics().MemoryUsed == 0, "read data released");
+		Check(reassembler.Position(result.Stream) == 16, "position");
+
+		// Read in time: no copy at all.
+		Push(reassembler, key, true, 1017, 0, "Host: a\r\n");
+		Check(ReadAll(reassembler, result.Stream) == "Host: a\r\n", "second segment");
+		Push(reassembler, key, true, 1026, 0, "\r\n");
+		Check(reassembler.Statistics().Retained == 1 && reassembler.Statistics().Borrowed == 3, "consumed data never copied");
+		Check(ReadAll(reassembler, result.Stream) == "\r\n", "third segment");
+
+		// The other direction.
+		const TCPSegmentResult response = Push(reassembler, key, false, 5001, 0, "HTTP/1.1 200 OK");
+		Check(response.Stream == result.Stream + 1 && !TCPReassembler::IsOutbound(response.Stream), "inbound stream pairs with outbound");
+		Check(ReadAll(reassembler, response.Stream) == "HTTP/1.1 200 OK", "inbound data");
+	}
+
+	void TestBufferReuse()
+	{
+		TCPReassembler reassembler(16, 1 << 20, 1 << 24, 60000);
+		const FlowKey key = KeyOf(7);
+
+		std::string sent;
+
+		for (uint32_t i = 0; sent.size() < 4000; ++i)
+		{
+			sent.push_back(static_cast<char>('a' + i % 26));
+		}
+
+		Push(reassembler, key, true, 999, Syn, "");
+
+		// One buffer for every segment, as a receive loop has. Like the managed wrapper, use what
+		// can be read in place, then retain the rest before the buffer is written over.
+		std::vector<uint8_t> buffer(64);
+		std::string received;
+		uint32_t offset = 0;
+		uint32_t stream = TCPReassembler::InvalidStream;
+
+		for (uint32_t i = 0; offset < sent.size(); ++i)
+		{
+			const uint32_t length = std::min<uint32_t>(1 + i * 7 % 64, static_cast<uint32_t>(sent.size()) - offset);
+
+			std::copy(sent.begin() + offset, sent.begin() + offset + length, buffer.begin());
+			stream = reassembler.Push(key, true, 1000 + offset, 0, buffer.data(), length, 1).Stream;
+			offset += length;
+
+			TCPStreamChunk chunk;
+
+			if (reassembler.Peek(stream, &chunk, 1) == 1 && chunk.Borrowed)
+			{
+				const uint32_t used = chunk.Length * (i % 3) / 2;
+
+				received.append(reinterpret_cast<const char*>(chunk.Data), used);
+				reassembler.Consume(stream, used);
+			}
+
+			reassembler.Retain();
+			std::fill(buffer.begin(), buffer.end(), static_cast<uint8_t>('#'));
+
+			if (i % 5 == 4)
+			{
+				received += ReadAll(reassembler, stream);
+			}
+		}
+
+		received += ReadAll(reassembler, stream);
+
+		Check(received == sent, "a reused buffer doesn't corrupt the stream");
+		Check(reassembler.Statistics().Borrowed != 0 && reassembler.Statistics().Retained != 0, "reused buffer borrowed and retained");
+		Check(reassembler.Statistics().MemoryUsed == 0, "reused buffer data released");
+	}
+
+	void TestOutOfOrder()
+	{
+		TCPReassembler reassembler(16, 1 << 20, 1 << 24, 60000);
+		const FlowKey key = KeyOf(2);
+
+		// The stream starts right before the sequence numbers wrap.
+		const uint32_t isn = 0xFFFFFFF0;
+		Push(reassembler, key, false, isn, Syn, "");
+
+		const uint32_t stream = Push(reassembler, key, false, isn + 1 + 10, 0, "klmno").Stream;
+		Check(reassembler.Available(stream) == 0, "gap blocks reading");
+
+		TCPSegmentResult result = Push(reassembler, key, false, isn + 1 + 20, 0, "uvwxyz");
+		Check(result.Status == TCPReassembler::StatusOutOfOrder, "buffered ahead of the gap");
+
+		// Overlaps both its neighbours, the bytes that arrived first win.
+		result = Push(reassembler, key, false, isn + 1 + 8, 0, "IJKLMNOPQRSTU");
+		Check(result.Status == TCPReassembler::StatusOutOfOrder, "overlap buffered");
+
+		Push(reassembler, key, false, isn + 1 + 12, 0, "#");
+		Check(reassembler.Statistics().Duplicates == 1, "fully covered segment is a duplicate");
+
+		result = Push(reassembler, key, false, isn + 1, 0, "abcdefgh");
+		Check((result.Status & TCPReassembler::StatusData) != 0, "gap filled");
+		Check(ReadAll(reassembler, stream) == "abcdefghIJklmnoPQRSTuvwxyz", "first copy of every byte kept, across the wrap");
+
+		Push(reassembler, key, false, isn + 1 + 3, 0, "def");
+		Check(reassembler.Statistics().Duplicates == 2, "retransmission of read data is a duplicate");
+
+		result = Push(reassembler, key, false, isn + 1 + 26, Fin, "!");
+		Check((result.Status & TCPReassembler::StatusFinished) != 0 && reassembler.IsFinished(stream), "FIN finishes the stream");
+		Check(ReadAll(reassembler, stream) == "!", "data with the FIN");
+
+		Push(reassembler, key, false, isn + 1 + 27, 0, "after");
+		Check(reassembler.Available(stream) == 0, "nothing after the FIN");
+
+		// Far ahead of anything plausible.
+		result = Push(reassembler, key, true, 0, 0, "x");
+		result = Push(reassembler, key, true, 0x50000000, 0, "y");
+		Check(result.Status == TCPReassembler::StatusOutOfWindow, "out of window dropped");
+
+		// A FIN that arrives before the data in front of it.
+		const FlowKey other = KeyOf(3);
+		const uint32_t late = Push(reassembler, other, true, 100, Fin, "end").Stream;
+		Check(reassembler.IsFinished(late), "midstream pickup");
+		const FlowKey third = KeyOf(4);
+		Push(reassembler, third, true, 100, Syn, "");
+		result = Push(reassembler, third, true, 104, Fin, "lo");
+		Check(!reassembler.IsFinished(result.Stream) && result.Status == TCPReassembler::StatusOutOfOrder, "early FIN waits for the data");
+		result = Push(reassembler, third, true, 101, 0, "hel");
+		Check((result.Status & TCPReassembler::StatusFinished) != 0 && ReadAll(reassembler, result.Stream) == "hello", "finished once the gap fills");
+	}
+
+	std::vector<uint32_t> g_ended;
+
+	void RecordEnded(void* context, uint32_t flow, const FlowKey& key, FlowEnd reason)
+	{
+		TCPReassembler* reassembler = static_cast<TCPReassembler*>(context);
+		(void)key;
+
+		// What's left can still be read.
+		g_ended.push_back(reassembler->Available(flow * 2) + (reason == FlowEnd::Reset ? 1000 : 0));
+	}
+
+	void TestReset()
+	{
+		TCPReassembler reassembler(16, 1 << 20, 1 << 24, 100);
+		reassembler.SetStreamEndedCallback(&RecordEnded, &reassembler);
+		g_ended.clear();
+
+		const FlowKey key = KeyOf(5);
+		const uint32_t stream = Push(reassembler, key, true, 1, 0, "abc", 10).Stream;
+		Push(reassembler, key, true, 10, 0, "out of order", 10);
+
+		const TCPSegmentResult result = Push(reassembler, key, false, 7, Rst, "", 10);
+		Check(result.Status == TCPReassembler::StatusReset && reassembler.IsReset(stream), "RST reported");
+		Check(reassembler.Available(stream) == 3, "data readable after RST");
+
+		Push(reassembler, KeyOf(6), true, 1, 0, "x", 10);
+		Check(g_ended.size() == 1 && g_ended[0] == 1003, "reset flow ended at the next call, data still readable then");
+		Check(reassembler.Statistics().MemoryUsed == 0, "reset flow released");
+
+		Check(Push(reassembler, KeyOf(7), true, 1, Rst, "", 10).Stream == TCPReassembler::InvalidStream, "RST without a flow");
+
+		Check(reassembler.Expire(200, 0) == 1 && reassembler.Statistics().Flows == 0, "idle flow expired");
+	}
+
+	void TestLimits()
+	{
+		const uint32_t flowLimit = 8 * 1024;
+		TCPReassembler reassembler(16, flowLimit, 12 * 1024, 60000);
+
+		const FlowKey key = KeyOf(8);
+		const std::string segment(1400, 's');
+		uint32_t stream = Push(reassembler, key, true, 1000, Syn, "").Stream;
+
+		// Nothing can be read until the first segment arrives, so everything is buffered.
+		uint32_t overLimit = 0;
+
+		for (uint32_t i = 1; i < 10; ++i)
+		{
+			if ((Push(reassembler, key, true, 1001 + i * 1400, 0, segment).Status & TCPReassembler::StatusOverLimit) != 0)
+			{
+				++overLimit;
+			}
+		}
+
+		const TCPReassemblyStatistics statistics = reassembler.Statistics();
+		Check(overLimit == 4 && statistics.MemoryUsed <= flowLimit && statistics.DroppedBytes == 4 * 1400, "per flow limit");
+
+		// A second flow runs into the global limit.
+		const FlowKey other = KeyOf(9);
+		Push(reassembler, other, true, 1000, Syn, "");
+
+		for (uint32_t i = 1; i < 10; ++i)
+		{
+			Push(reassembler, other, true, 1001 + i * 1400, 0, segment);
+		}
+
+		Check(reassembler.Statistics().MemoryUsed <= 12 * 1024 && reassembler.Statistics().DroppedBytes > 4 * 1400, "global limit");
+
+		// The first segment never comes. Skip the gap, read, and skip the gap the limit left.
+		Check(reassembler.SkipGap(stream) == 1400 && reassembler.Available(stream) == 5 * 1400, "skip the missing segment");
+		Check(ReadAll(reassembler, stream) == std::string(5 * 1400, 's'), "read after the gap");
+		Check(reassembler.SkipGap(stream) == 0, "nothing left to skip to");
+
+		Push(reassembler, key, true, 1001 + 10 * 1400, Fin, "");
+		Check(reassembler.SkipGap(stream) == 4 * 1400 && reassembler.IsFinished(stream), "skip to the FIN");
+
+		stream = Push(reassembler, other, true, 1001, 0, segment).Stream;
+		Check(reassembler.Available(stream) > 1400, "second flow fills in");
+	}
+
+	/// <summary>
+	/// Sends many streams, each cut into random segments that are reordered, repeated and made
+	/// to overlap, and checks that every stream comes out exactly as sent.
+	/// </summary>
+	void TestRandom(uint32_t streamCount)
+	{
+		std::mt19937 random(2016);
+		TCPReassembler reassembler(streamCount, 1 << 20, 1ull << 32, 60000);
+
+		struct Sent
+		{
+			std::string Data;
+
+			std::string Received;
+
+			uint32_t Isn;
+		};
+
+		struct Piece
+		{
+			uint32_t Client;
+
+			uint32_t Offset;
+
+			uint32_t Length;
+		};
+
+		std::vector<Sent> sent(streamCount);
+		std::vector<Piece> pieces;
+
+		for (uint32_t client = 0; client < streamCount; ++client)
+		{
+			Sent& current = sent[client];
+			current.Data.resize(std::uniform_int_distribution<uint32_t>(1, 20000)(random));
+			current.Isn = random();
+
+			Push(reassembler, KeyOf(client), true, current.Isn - 1, Syn, "");
+
+			for (char& c : current.Data)
+			{
+				c = static_cast<char>(random());
+			}
+
+			uint32_t offset = 0;
+
+			while (offset < current.Data.size())
+			{
+				const uint32_t length = std::min<uint32_t>(std::uniform_int_distribution<uint32_t>(1, 3000)(random), static_cast<uint32_t>(current.Data.size()) - offset);
+				pieces.push_back({ client, offset, length });
+
+				// Now and then a retransmission, or one that overlaps the next segment.
+				if (random() % 8 == 0)
+				{
+					const uint32_t extra = std::min<uint32_t>(random() % 2000, static_cast<uint32_t>(current.Data.size()) - offset - length);
+					pieces.push_back({ client, offset, length + extra });
+				}
+
+				offset += length;
+			}
+		}
+
+		// Mostly in order, with a fraction moved far out of place.
+		for (size_t i = 0; i < pieces.size(); ++i)
+		{
+			if (random() % 4 == 0)
+			{
+				std::swap(pieces[i], pieces[std::min(pieces.size() - 1, i + random() % 64)]);
+			}
+		}
+
+		for (const Piece& piece : pieces)
+		{
+			Sent& current = sent[piece.Client];
+
+			// Copy the payload, so a borrowed segment that isn't retained shows up as garbage.
+			std::string payload = current.Data.substr(piece.Offset, piece.Length);
+			const TCPSegmentResult result = Push(reassembler, KeyOf(piece.Client), true, current.Isn + piece.Offset, 0, payload);
+
+			if (random() % 2 == 0)
+			{
+				current.Received += ReadAll(reassembler, result.Stream);
+			}
+			else
+			{
+				reassembler.Retain();
+			}
+
+			payload.assign(payload.size(), '?');
+		}
+
+		bool exact = true;
+
+		for (uint32_t client = 0; client < streamCount; ++client)
+		{
+			sent[client].Received += ReadAll(reassembler, reassembler.Flows().Find(KeyOf(client)) * 2);
+
+			exact = exact && sent[client].Received == sent[client].Data;
+		}
+
+		const TCPReassemblyStatistics statistics = reassembler.Statistics();
+		Check(exact, "random streams reassemble exactly");
+		Check(statistics.MemoryUsed == 0, "all memory given back");
+		Check(statistics.DroppedBytes == 0 && statistics.OutOfWindow == 0, "nothing dropped");
+
+		std::printf("random: %u streams, %zu segments, %llu borrowed, %llu retained, %llu out of order, %llu duplicates, %llu KB reserved\n",
+			streamCount, pieces.size(),
+			static_cast<unsigned long long>(statistics.Borrowed), static_cast<unsigned long long>(statistics.Retained),
+			static_cast<unsigned long long>(statistics.OutOfOrder), static_cast<unsigned long long>(statistics.Duplicates),
+			static_cast<unsigned long long>(statistics.MemoryReserved / 1024));
+	}
+
+	void Benchmark()
+	{
+		const uint32_t flows = 1000;
+		const uint32_t segmentsPerFlow = 1000;
+		const std::string payload(1400, 'p');
+
+		for (int outOfOrder = 0; outOfOrder < 2; ++outOfOrder)
+		{
+			TCPReassembler reassembler(flows, 1 << 20, 1ull << 32, 60000);
+			std::vector<FlowKey> keys;
+			uint64_t bytes = 0;
+
+			for (uint32_t flow = 0; flow < flows; ++flow)
+			{
+				keys.push_back(KeyOf(flow));
+				Push(reassembler, keys[flow], true, 0xFFFFFFFF, Syn, "");
+			}
+
+			const auto started = std::chrono::steady_clock::now();
+
+			for (uint32_t i = 0; i < segmentsPerFlow; i += 2)
+			{
+				for (uint32_t flow = 0; flow < flows; ++flow)
+				{
+					// Out of order swaps every pair of segments. Whatever is readable is read
+					// straight away, as an inspecting caller would.
+					for (uint32_t j = 0; j < 2; ++j)
+					{
+						const uint32_t segment = outOfOrder ? i + 1 - j : i + j;
+						const TCPSegmentResult result = Push(reassembler, keys[flow], true, segment * 1400, 0, payload);
+
+						TCPStreamChunk chunks[4];
+						const uint32_t count = reassembler.Peek(result.Stream, chunks, 4);
+
+						for (uint32_t c = 0; c < count; ++c)
+						{
+							bytes += reassembler.Consume(result.Stream, chunks[c].Length);
+						}
+					}
+				}
+			}
+
+			const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+			const double segments = static_cast<double>(flows) * segmentsPerFlow;
+
+			std::printf("%s: %.1f ns per segment, %.0f MB read\n", outOfOrder ? "pairs swapped" : "in order", elapsed / segments, bytes / 1e6);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const uint32_t streams = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 500;
+
+	TestInOrder();
+	TestBufferReuse();
+	TestOutOfOrder();
+	TestReset();
+	TestLimits();
+	TestRandom(streams);
+	Benchmark();
+
+	std::printf(g_failures == 0 ? "PASSED\n" : "%d FAILED\n", g_failures);
+	return g_failures == 0 ? 0 : 1;
+}